@@ -862,6 +862,54 @@ struct BSDF {
 
 
 
+// JP: プール中のlinearIndex番目の光源サンプルを生成する。
+//     環境光とそれ以外の光源の両方がある場合は、ダイバージェンスを抑えるためにサブセットの先頭の
+//     probToSampleEnvLightの割合を環境光に、残りをそれ以外の光源に割り当てる。
+//     sampleLightFuncは(ul, sampleEnvLight, u0, u1, lightSample, areaPDensity)を受け取る各サンプルの光源サンプリング。
+// EN: Generate the linearIndex-th light sample in the pool.
+//     When there are both an environmental light and the other lights, assign the fraction probToSampleEnvLight
+//     at the head of the subset to the environmental light and the rest to the others to avoid divergence.
+//     sampleLightFunc is the light sampling of each sample taking (ul, sampleEnvLight, u0, u1, lightSample, areaPDensity).
+template <typename LightSampleType, typename SampleLightFunc>
+CUDA_DEVICE_FUNCTION CUDA_INLINE void preSampleLight(
+    shared::PreSampledLightPoolTemplate<LightSampleType> &pool, uint32_t linearIndex,
+    bool hasEnvLight, bool hasAreaLights, float probToSampleEnvLight,
+    const SampleLightFunc &sampleLightFunc) {
+    uint32_t indexInSubset = linearIndex % pool.subsetSize;
+    shared::PCG32RNG rng = pool.rngs[linearIndex];
+
+    // JP: サブセットの大きさによらず正しい確率を使うために、実際に環境光に割り当てられる割合を用いる。
+    // EN: Use the fraction actually assigned to the environmental light to get the correct probability
+    //     regardless of the subset size.
+    float probToSampleCurLightType = 1.0f;
+    bool sampleEnvLight = false;
+    if (hasEnvLight) {
+        if (hasAreaLights) {
+            uint32_t numEnvLightSamples = static_cast<uint32_t>(ceilf(probToSampleEnvLight * pool.subsetSize));
+            float probEnvLight = static_cast<float>(numEnvLightSamples) / pool.subsetSize;
+            sampleEnvLight = indexInSubset < numEnvLightSamples;
+            probToSampleCurLightType = sampleEnvLight ? probEnvLight : (1 - probEnvLight);
+        }
+        else {
+            sampleEnvLight = true;
+        }
+    }
+
+    shared::PreSampledLightTemplate<LightSampleType> preSampledLight;
+    float ul = rng.getFloat0cTo1o();
+    float u0 = rng.getFloat0cTo1o();
+    float u1 = rng.getFloat0cTo1o();
+    sampleLightFunc(
+        ul, sampleEnvLight, u0, u1,
+        &preSampledLight.sample, &preSampledLight.areaPDensity);
+    preSampledLight.areaPDensity *= probToSampleCurLightType;
+
+    pool.rngs[linearIndex] = rng;
+    pool.lights[linearIndex] = preSampledLight;
+}
+
+
+
 CUDA_DEVICE_FUNCTION CUDA_INLINE Point3D transformPointFromObjectToWorldSpace(const Point3D &p) {
     float3 xfmP = optixTransformPointFromObjectToWorldSpace(make_float3(p.x, p.y, p.z));
     return Point3D(xfmP.x, xfmP.y, xfmP.z);
@@ -6,7 +6,17 @@
 #include "../common/dds_loader.h"
 #include "../../ext/stb_image.h"
 #include "tinyexr.h"
+#include "miniz.h"
 #include "../ext/stb_image_write.h"
+#include <iomanip>
+#include <charconv>
+
+#if !defined(HP_Platform_Windows_MSVC)
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#   include <fcntl.h>
+#   include <unistd.h>
+#endif
 
 void devPrintf(const char* fmt, ...) {
     va_list args;
@@ -74,8 +84,203 @@ std::vector<char> readBinaryFile(const std::filesystem::path &filepath) {
 
 
 
+bool isAVX2Supported() {
+    // JP: 関数内staticの初期化はスレッドセーフなので、複数のスレッドから同時に呼ばれても一度だけ判定される。
+    // EN: Initialization of a function-local static is thread-safe,
+    //     so the check runs only once even when called from multiple threads concurrently.
+    static const bool ret = []() {
+        bool supported = false;
+#if defined(HP_Platform_Windows_MSVC)
+        int32_t cpuInfo[4];
+        __cpuid(cpuInfo, 0);
+        if (cpuInfo[0] >= 7) {
+            __cpuidex(cpuInfo, 7, 0);
+            supported = (cpuInfo[1] & (1 << 5)) != 0;
+        }
+#else
+        supported = __builtin_cpu_supports("avx2");
+#endif
+        return supported;
+    }();
+
+    return ret;
+}
+
+bool MappedFile::open(const std::filesystem::path &filePath) {
+    close();
+
+#if defined(HP_Platform_Windows_MSVC)
+    m_fileHandle = CreateFileW(
+        filePath.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (m_fileHandle == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(m_fileHandle, &fileSize) || fileSize.QuadPart == 0) {
+        close();
+        return false;
+    }
+
+    m_mappingHandle = CreateFileMappingW(m_fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!m_mappingHandle) {
+        close();
+        return false;
+    }
+
+    m_data = static_cast<const uint8_t*>(MapViewOfFile(m_mappingHandle, FILE_MAP_READ, 0, 0, 0));
+    if (!m_data) {
+        close();
+        return false;
+    }
+    m_size = static_cast<size_t>(fileSize.QuadPart);
+#else
+    int fd = ::open(filePath.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) != 0 || fileStat.st_size == 0) {
+        ::close(fd);
+        return false;
+    }
+
+    void* data = mmap(nullptr, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED)
+        return false;
+
+    m_data = static_cast<const uint8_t*>(data);
+    m_size = static_cast<size_t>(fileStat.st_size);
+#endif
+
+    return true;
+}
+
+void MappedFile::close() {
+#if defined(HP_Platform_Windows_MSVC)
+    if (m_data)
+        UnmapViewOfFile(m_data);
+    if (m_mappingHandle)
+        CloseHandle(m_mappingHandle);
+    if (m_fileHandle != INVALID_HANDLE_VALUE)
+        CloseHandle(m_fileHandle);
+    m_mappingHandle = nullptr;
+    m_fileHandle = INVALID_HANDLE_VALUE;
+#else
+    if (m_data)
+        munmap(const_cast<uint8_t*>(m_data), m_size);
+#endif
+    m_data = nullptr;
+    m_size = 0;
+}
+
+
+
+// JP: Walker's Alias Methodのテーブルを構築する。
+//     小グループと大グループへの振り分けは並列に行い、ペアリングは線形時間の逐次処理で行う。
+//     振り分けは元の順序を保つので、結果は逐次版と完全に一致する。
+// EN: Build the table for Walker's alias method.
+//     Partitioning into the small and large groups runs in parallel, then the pairing runs sequentially
+//     in linear time.
+//     The partitioning preserves the original order so the result is bit-identical to the sequential build.
 template <typename RealType>
-void DiscreteDistribution1DTemplate<RealType>::
+static void buildAliasTable(
+    const RealType* values, uint32_t numValues, RealType avgWeight,
+    shared::AliasTableEntry<RealType>* aliasTable, shared::AliasValueMap<RealType>* valueMaps) {
+    struct IndexAndWeight {
+        uint32_t index;
+        RealType weight;
+        IndexAndWeight() {}
+        IndexAndWeight(uint32_t _index, RealType _weight) :
+            index(_index), weight(_weight) {}
+    };
+
+    constexpr uint32_t minChunkSize = 1 << 16;
+
+    // JP: チャンクごとに小グループの要素数を数えて、各チャンクの書き込み開始位置を求める。
+    // EN: Count the small group entries per chunk, then compute the write offset of each chunk.
+    const uint32_t numChunks = computeNumParallelChunks(numValues, minChunkSize);
+    std::vector<uint32_t> smallOffsets(numChunks + 1, 0);
+    parallelForChunks(
+        0, numValues, minChunkSize,
+        [&](uint32_t chunkIdx, uint32_t begin, uint32_t end) {
+            uint32_t numSmalls = 0;
+            for (uint32_t i = begin; i < end; ++i)
+                numSmalls += values[i] <= avgWeight ? 1 : 0;
+            smallOffsets[chunkIdx + 1] = numSmalls;
+        });
+    for (uint32_t chunkIdx = 0; chunkIdx < numChunks; ++chunkIdx)
+        smallOffsets[chunkIdx + 1] += smallOffsets[chunkIdx];
+    const uint32_t numSmalls = smallOffsets[numChunks];
+
+    // JP: 大グループの要素はペアリング中に小グループへ移るので、小グループは全要素分の領域を確保する。
+    // EN: Entries of the large group move to the small group during pairing,
+    //     so allocate the small group for all the entries.
+    std::vector<IndexAndWeight> smallGroup(numValues);
+    std::vector<IndexAndWeight> largeGroup(numValues - numSmalls);
+    parallelForChunks(
+        0, numValues, minChunkSize,
+        [&](uint32_t chunkIdx, uint32_t begin, uint32_t end) {
+            uint32_t smallIdx = smallOffsets[chunkIdx];
+            uint32_t largeIdx = begin - smallOffsets[chunkIdx];
+            for (uint32_t i = begin; i < end; ++i) {
+                RealType weight = values[i];
+                if (weight <= avgWeight)
+                    smallGroup[smallIdx++] = IndexAndWeight(i, weight);
+                else
+                    largeGroup[largeIdx++] = IndexAndWeight(i, weight);
+            }
+        });
+
+    uint32_t smallGroupSize = numSmalls;
+    uint32_t largeGroupSize = numValues - numSmalls;
+    while (smallGroupSize > 0 && largeGroupSize > 0) {
+        IndexAndWeight smallPair = smallGroup[--smallGroupSize];
+        IndexAndWeight &largePair = largeGroup[largeGroupSize - 1];
+        uint32_t secondIndex = largePair.index;
+        RealType reducedWeight = (largePair.weight + smallPair.weight) - avgWeight;
+        largePair.weight = reducedWeight;
+        if (largePair.weight <= avgWeight) {
+            smallGroup[smallGroupSize++] = largePair;
+            --largeGroupSize;
+        }
+        RealType probToPickFirst = smallPair.weight / avgWeight;
+        aliasTable[smallPair.index] = shared::AliasTableEntry<RealType>(secondIndex, probToPickFirst);
+
+        shared::AliasValueMap<RealType> valueMap;
+        valueMap.scaleForFirst = avgWeight / values[smallPair.index];
+        valueMap.scaleForSecond = avgWeight / values[secondIndex];
+        valueMap.offsetForSecond = (reducedWeight - smallPair.weight) / values[secondIndex];
+        valueMaps[smallPair.index] = valueMap;
+    }
+
+    // JP: 残った要素はそれぞれ独立に書き込めるので並列に処理する。
+    // EN: Remaining entries can be written independently, so process them in parallel.
+    const auto writeRemaining = [&](const std::vector<IndexAndWeight> &group, uint32_t groupSize) {
+        parallelForChunks(
+            0, groupSize, minChunkSize,
+            [&](uint32_t chunkIdx, uint32_t begin, uint32_t end) {
+                for (uint32_t i = begin; i < end; ++i) {
+                    const IndexAndWeight &pair = group[i];
+                    aliasTable[pair.index] = shared::AliasTableEntry<RealType>(0xFFFFFFFF, 1.0f);
+
+                    shared::AliasValueMap<RealType> valueMap;
+                    valueMap.scaleForFirst = avgWeight / values[pair.index];
+                    valueMap.scaleForSecond = 0;
+                    valueMap.offsetForSecond = 0;
+                    valueMaps[pair.index] = valueMap;
+                }
+            });
+    };
+    writeRemaining(smallGroup, smallGroupSize);
+    writeRemaining(largeGroup, largeGroupSize);
+}
+
+
+
+template <typename RealType, typename Storage>
+void DiscreteDistribution1DTemplate<RealType, Storage>::
 initialize(
     CUcontext cuContext, cudau::BufferType type,
     const RealType* values, uint32_t numValues) {
@@ -101,71 +306,15 @@ initialize(
     std::memcpy(weights, values, sizeof(RealType) * m_numValues);
     m_weights.unmap();
 
-    CompensatedSum<RealType> sum(0);
+    CompensatedSum_T<RealType> sum(0);
     for (uint32_t i = 0; i < m_numValues; ++i)
         sum += values[i];
     RealType avgWeight = sum / m_numValues;
     m_integral = sum;
 
-    struct IndexAndWeight {
-        uint32_t index;
-        RealType weight;
-        IndexAndWeight() {}
-        IndexAndWeight(uint32_t _index, RealType _weight) :
-            index(_index), weight(_weight) {}
-    };
-
-    std::vector<IndexAndWeight> smallGroup;
-    std::vector<IndexAndWeight> largeGroup;
-    for (uint32_t i = 0; i < m_numValues; ++i) {
-        RealType weight = values[i];
-        IndexAndWeight entry(i, weight);
-        if (weight <= avgWeight)
-            smallGroup.push_back(entry);
-        else
-            largeGroup.push_back(entry);
-    }
     shared::AliasTableEntry<RealType>* aliasTable = m_aliasTable.map();
     shared::AliasValueMap<RealType>* valueMaps = m_valueMaps.map();
-    for (int i = 0; !smallGroup.empty() && !largeGroup.empty(); ++i) {
-        IndexAndWeight smallPair = smallGroup.back();
-        smallGroup.pop_back();
-        IndexAndWeight &largePair = largeGroup.back();
-        uint32_t secondIndex = largePair.index;
-        RealType reducedWeight = (largePair.weight + smallPair.weight) - avgWeight;
-        largePair.weight = reducedWeight;
-        if (largePair.weight <= avgWeight) {
-            smallGroup.push_back(largePair);
-            largeGroup.pop_back();
-        }
-        RealType probToPickFirst = smallPair.weight / avgWeight;
-        aliasTable[smallPair.index] = shared::AliasTableEntry<RealType>(secondIndex, probToPickFirst);
-
-        shared::AliasValueMap<RealType> valueMap;
-        RealType probToPickSecond = 1 - probToPickFirst;
-        valueMap.scaleForFirst = avgWeight / values[smallPair.index];
-        valueMap.scaleForSecond = avgWeight / values[secondIndex];
-        valueMap.offsetForSecond = (reducedWeight - smallPair.weight) / values[secondIndex];
-        valueMaps[smallPair.index] = valueMap;
-    }
-    while (!smallGroup.empty() || !largeGroup.empty()) {
-        IndexAndWeight pair;
-        if (!smallGroup.empty()) {
-            pair = smallGroup.back();
-            smallGroup.pop_back();
-        }
-        else {
-            pair = largeGroup.back();
-            largeGroup.pop_back();
-        }
-        aliasTable[pair.index] = shared::AliasTableEntry<RealType>(0xFFFFFFFF, 1.0f);
-
-        shared::AliasValueMap<RealType> valueMap;
-        valueMap.scaleForFirst = avgWeight / values[pair.index];
-        valueMap.scaleForSecond = 0;
-        valueMap.offsetForSecond = 0;
-        valueMaps[pair.index] = valueMap;
-    }
+    buildAliasTable(values, m_numValues, avgWeight, aliasTable, valueMaps);
     m_valueMaps.unmap();
     m_aliasTable.unmap();
 #else
@@ -191,18 +340,140 @@ initialize(
     }
     m_integral = sum;
 
+    if constexpr (std::is_same_v<Storage, HostMemoryStorage>)
+        buildEytzingerCDF(CDF);
+
     m_CDF.unmap();
 #endif
 
     m_isInitialized = true;
 }
 
-template class DiscreteDistribution1DTemplate<float>;
+#if !defined(USE_WALKER_ALIAS_METHOD)
+template <typename RealType, typename Storage>
+void DiscreteDistribution1DTemplate<RealType, Storage>::
+buildEytzingerCDF(const RealType* CDF) {
+    // JP: 葉の深さを揃えるため完全二分木になるまで+infで埋める。
+    //     +infはどのuよりも大きいので探索結果に影響しない。
+    // EN: Pad with +inf up to a complete binary tree to make all leaves have the same depth.
+    //     +inf is greater than any u so it doesn't affect the search result.
+    m_eytzingerDepth = nextPowOf2Exponent(m_numValues + 1);
+    const uint32_t numNodes = (1u << m_eytzingerDepth) - 1;
+    m_eytzingerCDF.resize(numNodes + 1);
+    m_eytzingerToSorted.resize(numNodes + 1);
+
+    // JP: 0番のノードは使用しない。探索が右端を越えた場合は0番にたどり着くので末尾の次を指させる。
+    // EN: Node 0 is unused. A search going past the right end reaches node 0,
+    //     so let it point to the one past the end.
+    m_eytzingerCDF[0] = std::numeric_limits<RealType>::infinity();
+    m_eytzingerToSorted[0] = numNodes;
+
+    // JP: 中間順で木を辿るとソート順に一致する。
+    // EN: In-order traversal of the tree matches the sorted order.
+    uint32_t sortedIdx = 0;
+    uint32_t node = 1;
+    std::vector<uint32_t> stack;
+    stack.reserve(m_eytzingerDepth);
+    while (node <= numNodes || !stack.empty()) {
+        while (node <= numNodes) {
+            stack.push_back(node);
+            node = 2 * node;
+        }
+        node = stack.back();
+        stack.pop_back();
+        m_eytzingerCDF[node] = sortedIdx < m_numValues ?
+            CDF[sortedIdx] : std::numeric_limits<RealType>::infinity();
+        m_eytzingerToSorted[node] = sortedIdx;
+        ++sortedIdx;
+        node = 2 * node + 1;
+    }
+}
 
+static void sampleEytzingerCDF_AVX2(
+    const float* eytzingerCDF, uint32_t depth, float integral,
+    const float* u, uint32_t n, uint32_t* nodes) {
+    const __m256 integrals = _mm256_set1_ps(integral);
+    for (uint32_t i = 0; i < n; i += 8) {
+        const __m256 us = _mm256_mul_ps(_mm256_loadu_ps(u + i), integrals);
+        __m256i ks = _mm256_set1_epi32(1);
+        for (uint32_t l = 0; l < depth; ++l) {
+            const __m256 cdfs = _mm256_i32gather_ps(eytzingerCDF, ks, sizeof(float));
+            // JP: 比較結果は真のレーンで-1なので、引くことで2k + (CDF[k] <= u)になる。
+            // EN: The comparison yields -1 on true lanes, so subtracting it gives 2k + (CDF[k] <= u).
+            const __m256i goRight = _mm256_castps_si256(_mm256_cmp_ps(cdfs, us, _CMP_LE_OQ));
+            ks = _mm256_sub_epi32(_mm256_add_epi32(ks, ks), goRight);
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(nodes + i), ks);
+    }
+}
 
+template <typename RealType, typename Storage>
+void DiscreteDistribution1DTemplate<RealType, Storage>::
+sampleN(const RealType* u, uint32_t n, uint32_t* idx, RealType* prob) const
+    requires std::is_same_v<Storage, HostMemoryStorage> {
+    Assert(m_isInitialized && m_numValues > 0, "Distribution is empty.");
+    const RealType* weights = m_weights.getHostPointer();
+
+    // JP: 葉に到達したノード番号から、右に進んだ末尾の連続部分と左に進んだ1回分を取り除くと
+    //     uより大きい最初の要素(upper bound)のノードになる。
+    // EN: Removing the trailing right moves and one left move from the leaf node number
+    //     gives the node of the first element greater than u (upper bound).
+    const auto nodeToIndex = [this](uint32_t node) {
+        node >>= tzcnt(~node) + 1;
+        return std::min(m_eytzingerToSorted[node], m_numValues) - 1;
+    };
 
-template <typename RealType>
-void RegularConstantContinuousDistribution1DTemplate<RealType>::
+    uint32_t i = 0;
+    if constexpr (std::is_same_v<RealType, float>) {
+        if (isAVX2Supported()) {
+            constexpr uint32_t batchSize = 256;
+            uint32_t nodes[batchSize];
+            const uint32_t numVecs = n / 8 * 8;
+            while (i < numVecs) {
+                const uint32_t curBatchSize = std::min(batchSize, numVecs - i);
+                sampleEytzingerCDF_AVX2(
+                    m_eytzingerCDF.data(), m_eytzingerDepth, m_integral,
+                    u + i, curBatchSize, nodes);
+                for (uint32_t j = 0; j < curBatchSize; ++j) {
+                    const uint32_t index = nodeToIndex(nodes[j]);
+                    idx[i + j] = index;
+                    prob[i + j] = weights[index] / m_integral;
+                }
+                i += curBatchSize;
+            }
+        }
+    }
+
+    for (; i < n; ++i) {
+        Assert(u[i] >= 0 && u[i] < 1, "\"u\": %g must be in range [0, 1).", u[i]);
+        const RealType su = u[i] * m_integral;
+        uint32_t node = 1;
+        for (uint32_t l = 0; l < m_eytzingerDepth; ++l)
+            node = 2 * node + (m_eytzingerCDF[node] <= su ? 1 : 0);
+        const uint32_t index = nodeToIndex(node);
+        idx[i] = index;
+        prob[i] = weights[index] / m_integral;
+    }
+}
+#else
+template <typename RealType, typename Storage>
+void DiscreteDistribution1DTemplate<RealType, Storage>::
+sampleN(const RealType* u, uint32_t n, uint32_t* idx, RealType* prob) const
+    requires std::is_same_v<Storage, HostMemoryStorage> {
+    shared::DiscreteDistribution1DTemplate<RealType> dist;
+    getDeviceType(&dist);
+    for (uint32_t i = 0; i < n; ++i)
+        idx[i] = dist.sample(u[i], &prob[i]);
+}
+#endif
+
+template class DiscreteDistribution1DTemplate<float, DeviceMemoryStorage>;
+template class DiscreteDistribution1DTemplate<float, HostMemoryStorage>;
+
+
+
+template <typename RealType, typename Storage>
+void RegularConstantContinuousDistribution1DTemplate<RealType, Storage>::
 initialize(
     CUcontext cuContext, cudau::BufferType type,
     const RealType* values, uint32_t numValues) {
@@ -216,7 +487,7 @@ initialize(
     RealType* PDF = m_PDF.map();
     std::memcpy(PDF, values, sizeof(RealType) * m_numValues);
 
-    CompensatedSum<RealType> sum(0);
+    CompensatedSum_T<RealType> sum(0);
     for (uint32_t i = 0; i < m_numValues; ++i)
         sum += values[i];
     RealType avgWeight = sum / m_numValues;
@@ -226,66 +497,9 @@ initialize(
         PDF[i] /= m_integral;
     m_PDF.unmap();
 
-    struct IndexAndWeight {
-        uint32_t index;
-        RealType weight;
-        IndexAndWeight() {}
-        IndexAndWeight(uint32_t _index, RealType _weight) :
-            index(_index), weight(_weight) {}
-    };
-
-    std::vector<IndexAndWeight> smallGroup;
-    std::vector<IndexAndWeight> largeGroup;
-    for (uint32_t i = 0; i < m_numValues; ++i) {
-        RealType weight = values[i];
-        IndexAndWeight entry(i, weight);
-        if (weight <= avgWeight)
-            smallGroup.push_back(entry);
-        else
-            largeGroup.push_back(entry);
-    }
-
     shared::AliasTableEntry<RealType>* aliasTable = m_aliasTable.map();
     shared::AliasValueMap<RealType>* valueMaps = m_valueMaps.map();
-    for (int i = 0; !smallGroup.empty() && !largeGroup.empty(); ++i) {
-        IndexAndWeight smallPair = smallGroup.back();
-        smallGroup.pop_back();
-        IndexAndWeight &largePair = largeGroup.back();
-        uint32_t secondIndex = largePair.index;
-        RealType reducedWeight = (largePair.weight + smallPair.weight) - avgWeight;
-        largePair.weight = reducedWeight;
-        if (largePair.weight <= avgWeight) {
-            smallGroup.push_back(largePair);
-            largeGroup.pop_back();
-        }
-        RealType probToPickFirst = smallPair.weight / avgWeight;
-        aliasTable[smallPair.index] = shared::AliasTableEntry<RealType>(secondIndex, probToPickFirst);
-
-        shared::AliasValueMap<RealType> valueMap;
-        RealType probToPickSecond = 1 - probToPickFirst;
-        valueMap.scaleForFirst = avgWeight / values[smallPair.index];
-        valueMap.scaleForSecond = avgWeight / values[secondIndex];
-        valueMap.offsetForSecond = (reducedWeight - smallPair.weight) / values[secondIndex];
-        valueMaps[smallPair.index] = valueMap;
-    }
-    while (!smallGroup.empty() || !largeGroup.empty()) {
-        IndexAndWeight pair;
-        if (!smallGroup.empty()) {
-            pair = smallGroup.back();
-            smallGroup.pop_back();
-        }
-        else {
-            pair = largeGroup.back();
-            largeGroup.pop_back();
-        }
-        aliasTable[pair.index] = shared::AliasTableEntry<RealType>(0xFFFFFFFF, 1.0f);
-
-        shared::AliasValueMap<RealType> valueMap;
-        valueMap.scaleForFirst = avgWeight / values[pair.index];
-        valueMap.scaleForSecond = 0;
-        valueMap.offsetForSecond = 0;
-        valueMaps[pair.index] = valueMap;
-    }
+    buildAliasTable(values, m_numValues, avgWeight, aliasTable, valueMaps);
     m_valueMaps.unmap();
     m_aliasTable.unmap();
 #else
@@ -315,17 +529,18 @@ initialize(
     m_isInitialized = true;
 }
 
-template class RegularConstantContinuousDistribution1DTemplate<float>;
+template class RegularConstantContinuousDistribution1DTemplate<float, DeviceMemoryStorage>;
+template class RegularConstantContinuousDistribution1DTemplate<float, HostMemoryStorage>;
 
 
 
-template <typename RealType>
-void RegularConstantContinuousDistribution2DTemplate<RealType>::
+template <typename RealType, typename Storage>
+void RegularConstantContinuousDistribution2DTemplate<RealType, Storage>::
 initialize(
     CUcontext cuContext, cudau::BufferType type,
     const RealType* values, uint32_t numD1, uint32_t numD2) {
     Assert(!m_isInitialized, "Already initialized!");
-    m_1DDists = new RegularConstantContinuousDistribution1DTemplate<RealType>[numD2];
+    m_1DDists = new RegularConstantContinuousDistribution1DTemplate<RealType, Storage>[numD2];
     m_raw1DDists.initialize(cuContext, type, static_cast<uint32_t>(numD2));
 
     shared::RegularConstantContinuousDistribution1DTemplate<RealType>* rawDists = m_raw1DDists.map();
@@ -335,7 +550,7 @@ initialize(
     CompensatedSum_T<RealType> sum(0);
     RealType* integrals = new RealType[numD2];
     for (uint32_t i = 0; i < numD2; ++i) {
-        RegularConstantContinuousDistribution1DTemplate<RealType> &dist = m_1DDists[i];
+        RegularConstantContinuousDistribution1DTemplate<RealType, Storage> &dist = m_1DDists[i];
         dist.initialize(cuContext, type, values + i * numD1, numD1);
         dist.getDeviceType(&rawDists[i]);
         integrals[i] = dist.getIntegral();
@@ -354,7 +569,119 @@ initialize(
     m_isInitialized = true;
 }
 
-template class RegularConstantContinuousDistribution2DTemplate<float>;
+template class RegularConstantContinuousDistribution2DTemplate<float, DeviceMemoryStorage>;
+template class RegularConstantContinuousDistribution2DTemplate<float, HostMemoryStorage>;
+
+
+
+template <typename RealType, typename Storage>
+void HierarchicalImportanceMapTemplate<RealType, Storage>::
+initialize(
+    CUcontext cuContext, cudau::BufferType type,
+    const RealType* values, uint32_t numD1, uint32_t numD2, uint32_t resolution) {
+    Assert(!m_isInitialized, "Already initialized!");
+    Assert(numD1 > 0 && numD2 > 0, "Invalid size: %u x %u", numD1, numD2);
+    int32_t log2Width = nextPowOf2Exponent(numD1);
+    int32_t log2Height = nextPowOf2Exponent(numD2);
+    if (resolution > 0) {
+        const int32_t scaleExp = static_cast<int32_t>(nextPowOf2Exponent(resolution)) -
+            std::max(log2Width, log2Height);
+        log2Width = std::max(log2Width + scaleExp, 0);
+        log2Height = std::max(log2Height + scaleExp, 0);
+    }
+    m_log2Width = log2Width;
+    m_log2Height = log2Height;
+    const uint32_t numLevels = std::max(m_log2Width, m_log2Height) + 1;
+
+    // JP: 各レベルの大きさと位置は64ビットで求める。
+    // EN: Compute the size and position of each level in 64-bit.
+    std::vector<uint2> levelSizes(numLevels);
+    std::vector<size_t> levelOffsets(numLevels);
+    size_t numValues = 0;
+    for (uint32_t level = 0; level < numLevels; ++level) {
+        const uint32_t shift = numLevels - 1 - level;
+        levelSizes[level] = make_uint2(
+            1u << (m_log2Width > shift ? m_log2Width - shift : 0),
+            1u << (m_log2Height > shift ? m_log2Height - shift : 0));
+        levelOffsets[level] = numValues;
+        numValues += static_cast<size_t>(levelSizes[level].x) * levelSizes[level].y;
+    }
+    Assert(numValues <= UINT32_MAX, "Too large importance map: %u x %u", getWidth(), getHeight());
+    m_values.initialize(cuContext, type, static_cast<uint32_t>(numValues));
+
+    RealType* levelValues = m_values.map();
+
+    // JP: 最も細かいレベルの各セルに重なる入力の値の平均を求める。
+    //     範囲は切り下げと切り上げで求め、入力より細かい解像度の場合も少なくとも1つの値を含むようにする。
+    // EN: Compute the average of the input values overlapping each cell of the finest level.
+    //     Compute the range by flooring and ceiling so that it contains at least one value
+    //     even when the resolution is finer than the input.
+    {
+        const uint32_t width = levelSizes[numLevels - 1].x;
+        const uint32_t height = levelSizes[numLevels - 1].y;
+        RealType* finestValues = levelValues + levelOffsets[numLevels - 1];
+        const uint32_t minRowsPerChunk = std::max((1u << 14) / width, 1u);
+        parallelForChunks(
+            0, height, minRowsPerChunk,
+            [&](uint32_t chunkIdx, uint32_t begin, uint32_t end) {
+                for (uint32_t cy = begin; cy < end; ++cy) {
+                    const uint32_t y0 = static_cast<uint32_t>(static_cast<uint64_t>(cy) * numD2 / height);
+                    const uint32_t y1 = std::max(
+                        static_cast<uint32_t>((static_cast<uint64_t>(cy + 1) * numD2 + height - 1) / height),
+                        y0 + 1);
+                    for (uint32_t cx = 0; cx < width; ++cx) {
+                        const uint32_t x0 = static_cast<uint32_t>(static_cast<uint64_t>(cx) * numD1 / width);
+                        const uint32_t x1 = std::max(
+                            static_cast<uint32_t>((static_cast<uint64_t>(cx + 1) * numD1 + width - 1) / width),
+                            x0 + 1);
+                        double sum = 0.0;
+                        for (uint32_t y = y0; y < y1; ++y) {
+                            for (uint32_t x = x0; x < x1; ++x)
+                                sum += values[static_cast<size_t>(y) * numD1 + x];
+                        }
+                        finestValues[static_cast<size_t>(cy) * width + cx] =
+                            static_cast<RealType>(sum / ((x1 - x0) * (y1 - y0)));
+                    }
+                }
+            });
+    }
+
+    // JP: 下のレベルの2x2 (短辺が1のレベルでは長辺方向の2つ)の合計から上のレベルを順に作る。
+    // EN: Build upper levels in order from the sums of 2x2 (two along the longer side at a level with the shorter side 1)
+    //     of the level below.
+    for (int level = static_cast<int>(numLevels) - 2; level >= 0; --level) {
+        const uint2 size = levelSizes[level];
+        const uint2 lowerSize = levelSizes[level + 1];
+        const uint32_t stepX = lowerSize.x / size.x;
+        const uint32_t stepY = lowerSize.y / size.y;
+        RealType* curValues = levelValues + levelOffsets[level];
+        const RealType* lowerValues = levelValues + levelOffsets[level + 1];
+        const uint32_t minRowsPerChunk = std::max((1u << 14) / size.x, 1u);
+        parallelForChunks(
+            0, size.y, minRowsPerChunk,
+            [&](uint32_t chunkIdx, uint32_t begin, uint32_t end) {
+                for (uint32_t y = begin; y < end; ++y) {
+                    for (uint32_t x = 0; x < size.x; ++x) {
+                        double sum = 0.0;
+                        for (uint32_t dy = 0; dy < stepY; ++dy) {
+                            for (uint32_t dx = 0; dx < stepX; ++dx)
+                                sum += lowerValues[static_cast<size_t>(stepY * y + dy) * lowerSize.x + stepX * x + dx];
+                        }
+                        curValues[static_cast<size_t>(y) * size.x + x] = static_cast<RealType>(sum);
+                    }
+                }
+            });
+    }
+
+    Assert(std::isfinite(levelValues[0]), "invalid integral value.");
+
+    m_values.unmap();
+
+    m_isInitialized = true;
+}
+
+template class HierarchicalImportanceMapTemplate<float, DeviceMemoryStorage>;
+template class HierarchicalImportanceMapTemplate<float, HostMemoryStorage>;
 
 
 
@@ -376,133 +703,130 @@ void ProbabilityTexture::initialize(CUcontext cuContext, uint32_t numValues) {
     m_isInitialized = true;
 }
 
+void ProbabilityTexture::readWeights(float* values, uint32_t numValues, CUstream stream) const {
+    // JP: 1次元のインデックスはcompute2DFrom1D()によって行優先で2次元に対応しているので、
+    //     最初のミップレベルをそのまま並べたものが重みの列になる。
+    // EN: 1D indices map to 2D in row-major order by compute2DFrom1D(),
+    //     so the first mip level as is becomes the sequence of the weights.
+    const size_t numTexels = m_cuArray.getWidth() * m_cuArray.getHeight();
+    Assert(numValues <= numTexels, "Too many values: %u > %zu", numValues, numTexels);
+    std::vector<float> texels(numTexels);
+    m_cuArray.read(texels, 0, stream);
+    CUDADRV_CHECK(cuStreamSynchronize(stream));
+    std::copy_n(texels.cbegin(), numValues, values);
+}
 
 
-void SlotFinder::initialize(uint32_t numSlots) {
-    m_numLayers = 1;
-    m_numLowestFlagBins = nextMultiplierForPowOf2(numSlots, 5);
 
-    // e.g. factor 4
+static inline uint32_t tzcnt64(uint64_t x) {
+    return static_cast<uint32_t>(_tzcnt_u64(x));
+}
+
+static inline uint32_t popcnt64(uint64_t x) {
+    return static_cast<uint32_t>(_mm_popcnt_u64(x));
+}
+
+static inline uint32_t nthSetBit64(uint64_t value, uint32_t n) {
+    uint32_t lo = static_cast<uint32_t>(value);
+    uint32_t numSetBitsInLo = popcnt(lo);
+    if (n < numSetBitsInLo)
+        return nthSetBit(lo, n);
+    uint32_t idx = nthSetBit(static_cast<uint32_t>(value >> 32), n - numSetBitsInLo);
+    return idx == 0xFFFFFFFF ? idx : 32 + idx;
+}
+
+void SlotFinder::initialize(uint32_t numSlots) {
+    // e.g. 64-bit words are illustrated as 4-bit words here.
     // 0 | 1101 | 0011 | 1001 | 1011 | 0010 | 1010 | 0000 | 1011 | 1110 | 0101 | 111* | **** | **** | **** | **** | **** | 43 flags
-    // OR bins:
+    // OR words:
     // 1 | 1      1      1      1    | 1      1      0      1    | 1      1      1      *    | *      *      *      *    | 11
     // 2 | 1                           1                           1                           *                         | 3
-    // AND bins
+    // AND words
     // 1 | 0      0      0      0    | 0      0      0      0    | 0      0      1      *    | *      *      *      *    | 11
     // 2 | 0                           0                           0                           *                         | 3
     //
     // numSlots: 43
-    // numLowestFlagBins: 11
     // numLayers: 3
     //
     // Memory Order
-    // LowestFlagBins (layer 0) | OR, AND Bins (layer 1) | ... | OR, AND Bins (layer n-1)
-    // Offset Pair to OR, AND (layer 0) | ... | Offset Pair to OR, AND (layer n-1)
-    // NumUsedFlags (layer 0) | ... | NumUsedFlags (layer n-1)
-    // Offset to NumUsedFlags (layer 0) | ... | Offset to NumUsedFlags (layer n-1)
-    // NumFlags (layer 0) | ... | NumFlags (layer n-1)
-
-    uint32_t numFlagBinsInLayer = m_numLowestFlagBins;
-    m_numTotalCompiledFlagBins = 0;
-    while (numFlagBinsInLayer > 1) {
-        ++m_numLayers;
-        numFlagBinsInLayer = nextMultiplierForPowOf2(numFlagBinsInLayer, 5);
-        m_numTotalCompiledFlagBins += 2 * numFlagBinsInLayer; // OR bins and AND bins
-    }
-
-    size_t memSize = sizeof(uint32_t) *
-        ((m_numLowestFlagBins + m_numTotalCompiledFlagBins) +
-         m_numLayers * 2 +
-         (m_numLowestFlagBins + m_numTotalCompiledFlagBins / 2) +
-         m_numLayers +
-         m_numLayers);
-    void* mem = malloc(memSize);
-
-    uintptr_t memHead = (uintptr_t)mem;
-    m_flagBins = (uint32_t*)memHead;
-    memHead += sizeof(uint32_t) * (m_numLowestFlagBins + m_numTotalCompiledFlagBins);
-
-    m_offsetsToOR_AND = (uint32_t*)memHead;
-    memHead += sizeof(uint32_t) * m_numLayers * 2;
-
-    m_numUsedFlagsUnderBinList = (uint32_t*)memHead;
-    memHead += sizeof(uint32_t) * (m_numLowestFlagBins + m_numTotalCompiledFlagBins / 2);
-
-    m_offsetsToNumUsedFlags = (uint32_t*)memHead;
-    memHead += sizeof(uint32_t) * m_numLayers;
-
-    m_numFlagsInLayerList = (uint32_t*)memHead;
+    // FlagWords (layer 0) | OR, AND Words (layer 1) | ... | OR, AND Words (layer n-1)
+    // NumUsedFlags (layer 1) | ... | NumUsedFlags (layer n-1)
+    // JP: 最下層のワードの使用中スロット数はpopcntで求まるので保持しない。
+    // EN: The number of used slots under a lowest word is obtained by popcnt so it isn't stored.
 
-    uint32_t layer = 0;
-    uint32_t offsetToOR_AND = 0;
+    m_numLayers = 1;
+    m_numFlagsInLayerList.clear();
+    m_offsetsToOR_AND.clear();
+    m_offsetsToNumUsedFlags.clear();
+
+    m_numFlagsInLayerList.push_back(numSlots);
+    uint32_t numWordsInLayer = getNumWordsInLayer(0);
+    m_offsetsToOR_AND.push_back(0);
+    m_offsetsToOR_AND.push_back(0);
+    m_offsetsToNumUsedFlags.push_back(0);
+    uint32_t offsetToOR_AND = numWordsInLayer;
     uint32_t offsetToNumUsedFlags = 0;
-    {
-        m_numFlagsInLayerList[layer] = numSlots;
-
-        numFlagBinsInLayer = nextMultiplierForPowOf2(numSlots, 5);
-
-        m_offsetsToOR_AND[2 * layer + 0] = offsetToOR_AND;
-        m_offsetsToOR_AND[2 * layer + 1] = offsetToOR_AND;
-        m_offsetsToNumUsedFlags[layer] = offsetToNumUsedFlags;
+    while (numWordsInLayer > 1) {
+        m_numFlagsInLayerList.push_back(numWordsInLayer);
+        numWordsInLayer = getNumWordsInLayer(m_numLayers);
 
-        offsetToOR_AND += numFlagBinsInLayer;
-        offsetToNumUsedFlags += numFlagBinsInLayer;
-    }
-    while (numFlagBinsInLayer > 1) {
-        ++layer;
-        m_numFlagsInLayerList[layer] = numFlagBinsInLayer;
-
-        numFlagBinsInLayer = nextMultiplierForPowOf2(numFlagBinsInLayer, 5);
+        m_offsetsToOR_AND.push_back(offsetToOR_AND);
+        m_offsetsToOR_AND.push_back(offsetToOR_AND + numWordsInLayer);
+        m_offsetsToNumUsedFlags.push_back(offsetToNumUsedFlags);
 
-        m_offsetsToOR_AND[2 * layer + 0] = offsetToOR_AND;
-        m_offsetsToOR_AND[2 * layer + 1] = offsetToOR_AND + numFlagBinsInLayer;
-        m_offsetsToNumUsedFlags[layer] = offsetToNumUsedFlags;
-
-        offsetToOR_AND += 2 * numFlagBinsInLayer;
-        offsetToNumUsedFlags += numFlagBinsInLayer;
+        offsetToOR_AND += 2 * numWordsInLayer;
+        offsetToNumUsedFlags += numWordsInLayer;
+        ++m_numLayers;
     }
 
-    std::fill_n(m_flagBins, m_numLowestFlagBins + m_numTotalCompiledFlagBins, 0);
-    std::fill_n(m_numUsedFlagsUnderBinList, m_numLowestFlagBins + m_numTotalCompiledFlagBins / 2, 0);
+    m_flagWords.assign(offsetToOR_AND, 0);
+    m_numUsedFlagsUnderWordList.assign(offsetToNumUsedFlags, 0);
+    m_numUsed = 0;
 }
 
 void SlotFinder::finalize() {
-    if (m_flagBins)
-        free(m_flagBins);
-    m_flagBins = nullptr;
+    m_flagWords = std::vector<uint64_t>();
+    m_numUsedFlagsUnderWordList = std::vector<uint32_t>();
+    m_offsetsToOR_AND = std::vector<uint32_t>();
+    m_offsetsToNumUsedFlags = std::vector<uint32_t>();
+    m_numFlagsInLayerList = std::vector<uint32_t>();
+    m_numLayers = 0;
+    m_numUsed = 0;
 }
 
-void SlotFinder::aggregate() {
-    uint32_t offsetToOR_last = m_offsetsToOR_AND[2 * 0 + 0];
-    uint32_t offsetToAND_last = m_offsetsToOR_AND[2 * 0 + 1];
-    uint32_t offsetToNumUsedFlags_last = m_offsetsToNumUsedFlags[0];
-    for (int layer = 1; layer < static_cast<int32_t>(m_numLayers); ++layer) {
-        uint32_t numFlagBinsInLayer = nextMultiplierForPowOf2(m_numFlagsInLayerList[layer], 5);
+uint32_t SlotFinder::getNumUsedFlagsUnderWord(uint32_t layer, uint32_t wordIdx) const {
+    if (layer == 0)
+        return popcnt64(m_flagWords[wordIdx]);
+    return m_numUsedFlagsUnderWordList[m_offsetsToNumUsedFlags[layer] + wordIdx];
+}
+
+void SlotFinder::aggregate(uint32_t firstWordIdx, uint32_t lastWordIdx) {
+    for (uint32_t layer = 1; layer < m_numLayers; ++layer) {
+        firstWordIdx /= 64;
+        lastWordIdx /= 64;
         uint32_t offsetToOR = m_offsetsToOR_AND[2 * layer + 0];
         uint32_t offsetToAND = m_offsetsToOR_AND[2 * layer + 1];
-        uint32_t offsetToNumUsedFlags = m_offsetsToNumUsedFlags[layer];
-        for (int binIdx = 0; binIdx < static_cast<int32_t>(numFlagBinsInLayer); ++binIdx) {
-            uint32_t &ORFlagBin = m_flagBins[offsetToOR + binIdx];
-            uint32_t &ANDFlagBin = m_flagBins[offsetToAND + binIdx];
-            uint32_t &numUsedFlagsUnderBin = m_numUsedFlagsUnderBinList[offsetToNumUsedFlags + binIdx];
-
-            uint32_t numFlagsInBin = std::min(32u, m_numFlagsInLayerList[layer] - 32 * binIdx);
-            for (int bit = 0; bit < static_cast<int32_t>(numFlagsInBin); ++bit) {
-                uint32_t lBinIdx = 32 * binIdx + bit;
-                uint32_t lORFlagBin = m_flagBins[offsetToOR_last + lBinIdx];
-                uint32_t lANDFlagBin = m_flagBins[offsetToAND_last + lBinIdx];
-                uint32_t lNumFlagsInBin = std::min(32u, m_numFlagsInLayerList[layer - 1] - 32 * lBinIdx);
-                if (lORFlagBin != 0)
-                    ORFlagBin |= 1 << bit;
-                if (popcnt(lANDFlagBin) == lNumFlagsInBin)
-                    ANDFlagBin |= 1 << bit;
-                numUsedFlagsUnderBin += m_numUsedFlagsUnderBinList[offsetToNumUsedFlags_last + lBinIdx];
+        uint32_t offsetToOR_last = m_offsetsToOR_AND[2 * (layer - 1) + 0];
+        uint32_t offsetToAND_last = m_offsetsToOR_AND[2 * (layer - 1) + 1];
+        for (uint32_t wordIdx = firstWordIdx; wordIdx <= lastWordIdx; ++wordIdx) {
+            uint64_t ORFlagWord = 0;
+            uint64_t ANDFlagWord = 0;
+            uint32_t numUsedFlagsUnderWord = 0;
+
+            uint32_t numFlagsInWord = std::min(64u, m_numFlagsInLayerList[layer] - 64 * wordIdx);
+            for (uint32_t bit = 0; bit < numFlagsInWord; ++bit) {
+                uint32_t lWordIdx = 64 * wordIdx + bit;
+                if (m_flagWords[offsetToOR_last + lWordIdx] != 0)
+                    ORFlagWord |= 1ull << bit;
+                if (m_flagWords[offsetToAND_last + lWordIdx] == getFullMask(layer - 1, lWordIdx))
+                    ANDFlagWord |= 1ull << bit;
+                numUsedFlagsUnderWord += getNumUsedFlagsUnderWord(layer - 1, lWordIdx);
             }
-        }
 
-        offsetToOR_last = offsetToOR;
-        offsetToAND_last = offsetToAND;
-        offsetToNumUsedFlags_last = offsetToNumUsedFlags;
+            m_flagWords[offsetToOR + wordIdx] = ORFlagWord;
+            m_flagWords[offsetToAND + wordIdx] = ANDFlagWord;
+            m_numUsedFlagsUnderWordList[m_offsetsToNumUsedFlags[layer] + wordIdx] = numUsedFlagsUnderWord;
+        }
     }
 }
 
@@ -513,16 +837,14 @@ void SlotFinder::resize(uint32_t numSlots) {
     SlotFinder newFinder;
     newFinder.initialize(numSlots);
 
-    uint32_t numLowestFlagBins = std::min(m_numLowestFlagBins, newFinder.m_numLowestFlagBins);
-    for (int binIdx = 0; binIdx < static_cast<int32_t>(numLowestFlagBins); ++binIdx) {
-        uint32_t numFlagsInBin = std::min(32u, numSlots - 32 * binIdx);
-        uint32_t mask = numFlagsInBin >= 32 ? 0xFFFFFFFF : ((1 << numFlagsInBin) - 1);
-        uint32_t value = m_flagBins[0 + binIdx] & mask;
-        newFinder.m_flagBins[0 + binIdx] = value;
-        newFinder.m_numUsedFlagsUnderBinList[0 + binIdx] = popcnt(value);
+    uint32_t numLowestWords = std::min(getNumWordsInLayer(0), newFinder.getNumWordsInLayer(0));
+    for (uint32_t wordIdx = 0; wordIdx < numLowestWords; ++wordIdx) {
+        uint64_t value = m_flagWords[wordIdx] & newFinder.getFullMask(0, wordIdx);
+        newFinder.m_flagWords[wordIdx] = value;
+        newFinder.m_numUsed += popcnt64(value);
     }
 
-    newFinder.aggregate();
+    newFinder.aggregate(0, newFinder.getNumWordsInLayer(0) - 1);
 
     *this = std::move(newFinder);
 }
@@ -531,26 +853,33 @@ void SlotFinder::setInUse(uint32_t slotIdx) {
     if (getUsage(slotIdx))
         return;
 
-    bool setANDFlag = false;
-    uint32_t flagIdxInLayer = slotIdx;
-    for (int layer = 0; layer < static_cast<int32_t>(m_numLayers); ++layer) {
-        uint32_t binIdx = flagIdxInLayer / 32;
-        uint32_t flagIdxInBin = flagIdxInLayer % 32;
-
-        // JP: 最下層ではOR/ANDは同じ実体だがsetANDFlagが初期値falseであるので設定は1回きり。
-        uint32_t &ORFlagBin = m_flagBins[m_offsetsToOR_AND[2 * layer + 0] + binIdx];
-        uint32_t &ANDFlagBin = m_flagBins[m_offsetsToOR_AND[2 * layer + 1] + binIdx];
-        uint32_t &numUsedFlagsUnderBin = m_numUsedFlagsUnderBinList[m_offsetsToNumUsedFlags[layer] + binIdx];
-        ORFlagBin |= (1 << flagIdxInBin);
-        if (setANDFlag)
-            ANDFlagBin |= (1 << flagIdxInBin);
-        ++numUsedFlagsUnderBin;
-
-        // JP: このビンに利用可能なスロットが無くなった場合は次のANDレイヤーもフラグを立てる。
-        uint32_t numFlagsInBin = std::min(32u, m_numFlagsInLayerList[layer] - 32 * binIdx);
-        setANDFlag = popcnt(ANDFlagBin) == numFlagsInBin;
-
-        flagIdxInLayer = binIdx;
+    ++m_numUsed;
+
+    // JP: 下位のワードが空でなくなった/満杯になった場合のみ上位のOR/ANDフラグを立てる。
+    //     使用中スロット数は全ての層で更新する。
+    // EN: Set upper OR/AND flags only when the lower word has become non-empty/full.
+    //     The number of used slots is updated in all layers.
+    uint32_t wordIdx = slotIdx / 64;
+    uint64_t &flagWord = m_flagWords[wordIdx];
+    bool setORFlag = flagWord == 0;
+    flagWord |= 1ull << (slotIdx % 64);
+    bool setANDFlag = flagWord == getFullMask(0, wordIdx);
+
+    for (uint32_t layer = 1; layer < m_numLayers; ++layer) {
+        uint32_t flagIdxInWord = wordIdx % 64;
+        wordIdx /= 64;
+
+        uint64_t &ORFlagWord = m_flagWords[m_offsetsToOR_AND[2 * layer + 0] + wordIdx];
+        uint64_t &ANDFlagWord = m_flagWords[m_offsetsToOR_AND[2 * layer + 1] + wordIdx];
+        ++m_numUsedFlagsUnderWordList[m_offsetsToNumUsedFlags[layer] + wordIdx];
+        if (setORFlag) {
+            setORFlag = ORFlagWord == 0;
+            ORFlagWord |= 1ull << flagIdxInWord;
+        }
+        if (setANDFlag) {
+            ANDFlagWord |= 1ull << flagIdxInWord;
+            setANDFlag = ANDFlagWord == getFullMask(layer, wordIdx);
+        }
     }
 }
 
@@ -558,178 +887,610 @@ void SlotFinder::setNotInUse(uint32_t slotIdx) {
     if (!getUsage(slotIdx))
         return;
 
-    bool resetORFlag = false;
-    uint32_t flagIdxInLayer = slotIdx;
-    for (int layer = 0; layer < static_cast<int32_t>(m_numLayers); ++layer) {
-        uint32_t binIdx = flagIdxInLayer / 32;
-        uint32_t flagIdxInBin = flagIdxInLayer % 32;
+    --m_numUsed;
+
+    // JP: 下位のワードが満杯でなくなった/空になった場合のみ上位のAND/ORフラグを下げる。
+    // EN: Reset upper AND/OR flags only when the lower word is no longer full/has become empty.
+    uint32_t wordIdx = slotIdx / 64;
+    uint64_t &flagWord = m_flagWords[wordIdx];
+    bool resetANDFlag = flagWord == getFullMask(0, wordIdx);
+    flagWord &= ~(1ull << (slotIdx % 64));
+    bool resetORFlag = flagWord == 0;
+
+    for (uint32_t layer = 1; layer < m_numLayers; ++layer) {
+        uint32_t flagIdxInWord = wordIdx % 64;
+        wordIdx /= 64;
+
+        uint64_t &ORFlagWord = m_flagWords[m_offsetsToOR_AND[2 * layer + 0] + wordIdx];
+        uint64_t &ANDFlagWord = m_flagWords[m_offsetsToOR_AND[2 * layer + 1] + wordIdx];
+        --m_numUsedFlagsUnderWordList[m_offsetsToNumUsedFlags[layer] + wordIdx];
+        if (resetANDFlag) {
+            resetANDFlag = ANDFlagWord == getFullMask(layer, wordIdx);
+            ANDFlagWord &= ~(1ull << flagIdxInWord);
+        }
+        if (resetORFlag) {
+            ORFlagWord &= ~(1ull << flagIdxInWord);
+            resetORFlag = ORFlagWord == 0;
+        }
+    }
+}
 
-        // JP: 最下層ではOR/ANDは同じ実体だがresetORFlagが初期値falseであるので設定は1回きり。
-        uint32_t &ORFlagBin = m_flagBins[m_offsetsToOR_AND[2 * layer + 0] + binIdx];
-        uint32_t &ANDFlagBin = m_flagBins[m_offsetsToOR_AND[2 * layer + 1] + binIdx];
-        uint32_t &numUsedFlagsUnderBin = m_numUsedFlagsUnderBinList[m_offsetsToNumUsedFlags[layer] + binIdx];
-        if (resetORFlag)
-            ORFlagBin &= ~(1 << flagIdxInBin);
-        ANDFlagBin &= ~(1 << flagIdxInBin);
-        --numUsedFlagsUnderBin;
+void SlotFinder::setInUseRange(uint32_t firstSlotIdx, uint32_t numSlots) {
+    if (numSlots == 0)
+        return;
+    Assert(firstSlotIdx + numSlots <= m_numFlagsInLayerList[0], "Out of range.");
+
+    uint32_t lastSlotIdx = firstSlotIdx + numSlots - 1;
+    uint32_t firstWordIdx = firstSlotIdx / 64;
+    uint32_t lastWordIdx = lastSlotIdx / 64;
+    for (uint32_t wordIdx = firstWordIdx; wordIdx <= lastWordIdx; ++wordIdx) {
+        uint64_t mask = ~0ull;
+        if (wordIdx == firstWordIdx)
+            mask &= ~0ull << (firstSlotIdx % 64);
+        if (wordIdx == lastWordIdx)
+            mask &= ~0ull >> (63 - lastSlotIdx % 64);
+        uint64_t &flagWord = m_flagWords[wordIdx];
+        m_numUsed += popcnt64(mask & ~flagWord);
+        flagWord |= mask;
+    }
 
-        // JP: このビンに使用中スロットが無くなった場合は次のORレイヤーのフラグを下げる。
-        uint32_t numFlagsInBin = std::min(32u, m_numFlagsInLayerList[layer] - 32 * binIdx);
-        resetORFlag = ORFlagBin == 0;
+    aggregate(firstWordIdx, lastWordIdx);
+}
 
-        flagIdxInLayer = binIdx;
+void SlotFinder::releaseRange(uint32_t firstSlotIdx, uint32_t numSlots) {
+    if (numSlots == 0)
+        return;
+    Assert(firstSlotIdx + numSlots <= m_numFlagsInLayerList[0], "Out of range.");
+
+    uint32_t lastSlotIdx = firstSlotIdx + numSlots - 1;
+    uint32_t firstWordIdx = firstSlotIdx / 64;
+    uint32_t lastWordIdx = lastSlotIdx / 64;
+    for (uint32_t wordIdx = firstWordIdx; wordIdx <= lastWordIdx; ++wordIdx) {
+        uint64_t mask = ~0ull;
+        if (wordIdx == firstWordIdx)
+            mask &= ~0ull << (firstSlotIdx % 64);
+        if (wordIdx == lastWordIdx)
+            mask &= ~0ull >> (63 - lastSlotIdx % 64);
+        uint64_t &flagWord = m_flagWords[wordIdx];
+        m_numUsed -= popcnt64(mask & flagWord);
+        flagWord &= ~mask;
     }
+
+    aggregate(firstWordIdx, lastWordIdx);
 }
 
 uint32_t SlotFinder::getFirstAvailableSlot() const {
-    uint32_t binIdx = 0;
-    for (int layer = m_numLayers - 1; layer >= 0; --layer) {
-        uint32_t ANDFlagBinOffset = m_offsetsToOR_AND[2 * layer + 1];
-        uint32_t numFlagsInBin = std::min(32u, m_numFlagsInLayerList[layer] - 32 * binIdx);
-        uint32_t numFlagBinsInLayer = nextMultiplierForPowOf2(m_numFlagsInLayerList[layer], 5);
-        uint32_t ANDFlagBin = m_flagBins[ANDFlagBinOffset + binIdx];
-
-        if (popcnt(ANDFlagBin) != numFlagsInBin) {
-            // JP: このビンに利用可能なスロットを発見。
-            binIdx = tzcnt(~ANDFlagBin) + 32 * binIdx;
-        }
-        else {
-            // JP: 利用可能なスロットが見つからなかった。
-            return 0xFFFFFFFF;
-        }
+    uint32_t wordIdx = 0;
+    for (int32_t layer = m_numLayers - 1; layer >= 0; --layer) {
+        uint64_t ANDFlagWord = m_flagWords[m_offsetsToOR_AND[2 * layer + 1] + wordIdx];
+        uint64_t availableFlags = ~ANDFlagWord & getFullMask(layer, wordIdx);
+        // JP: 利用可能なスロットが見つからなかった。
+        // EN: No available slot found.
+        if (availableFlags == 0)
+            return InvalidSlotIndex;
+        wordIdx = 64 * wordIdx + tzcnt64(availableFlags);
     }
 
-    Assert(binIdx < m_numFlagsInLayerList[0], "Invalid value.");
-    return binIdx;
+    Assert(wordIdx < m_numFlagsInLayerList[0], "Invalid value.");
+    return wordIdx;
 }
 
-uint32_t SlotFinder::getFirstUsedSlot() const {
-    uint32_t binIdx = 0;
-    for (int layer = m_numLayers - 1; layer >= 0; --layer) {
-        uint32_t ORFlagBinOffset = m_offsetsToOR_AND[2 * layer + 0];
-        uint32_t numFlagsInBin = std::min(32u, m_numFlagsInLayerList[layer] - 32 * binIdx);
-        uint32_t numFlagBinsInLayer = nextMultiplierForPowOf2(m_numFlagsInLayerList[layer], 5);
-        uint32_t ORFlagBin = m_flagBins[ORFlagBinOffset + binIdx];
+void SlotFinder::propagateFullFlagConcurrent(uint32_t layer, uint32_t wordIdx) {
+    // JP: 確保のみが並行に行われる間はANDフラグは単調に立つだけなので、
+    //     既に立っているフラグを他のスレッドが重ねて立てても問題無い。
+    //     遅れているスレッドの代わりに伝播を進めることでロックフリー性を保つ。
+    // EN: AND flags only monotonically get set while only claims run concurrently,
+    //     so setting an already set flag by another thread is harmless.
+    //     Advancing the propagation on behalf of a delayed thread keeps this lock-free.
+    for (++layer; layer < m_numLayers; ++layer) {
+        uint64_t flag = 1ull << (wordIdx % 64);
+        wordIdx /= 64;
+
+        std::atomic_ref<uint64_t> ANDFlagWord(m_flagWords[m_offsetsToOR_AND[2 * layer + 1] + wordIdx]);
+        uint64_t oldANDFlagWord = ANDFlagWord.fetch_or(flag, std::memory_order_relaxed);
+        if ((oldANDFlagWord | flag) != getFullMask(layer, wordIdx))
+            break;
+    }
+}
 
-        if (ORFlagBin != 0) {
-            // JP: このビンに使用中のスロットを発見。
-            binIdx = tzcnt(ORFlagBin) + 32 * binIdx;
+uint32_t SlotFinder::claimFirstAvailableSlot() {
+    while (true) {
+        // JP: 上位の層のANDフラグはヒントとして辿る。
+        //     伝播の遅れにより満杯のワードに行き着いた場合は伝播を手伝ってやり直す。
+        // EN: Follow AND flags in upper layers as hints.
+        //     Help the propagation and retry when reaching a full word due to propagation delay.
+        uint32_t wordIdx = 0;
+        bool retry = false;
+        for (int32_t layer = m_numLayers - 1; layer > 0; --layer) {
+            std::atomic_ref<uint64_t> ANDFlagWord(m_flagWords[m_offsetsToOR_AND[2 * layer + 1] + wordIdx]);
+            uint64_t availableFlags = ~ANDFlagWord.load(std::memory_order_relaxed) & getFullMask(layer, wordIdx);
+            if (availableFlags == 0) {
+                if (layer == static_cast<int32_t>(m_numLayers) - 1)
+                    return InvalidSlotIndex;
+                propagateFullFlagConcurrent(layer, wordIdx);
+                retry = true;
+                break;
+            }
+            wordIdx = 64 * wordIdx + tzcnt64(availableFlags);
         }
-        else {
-            // JP: 使用中スロットが見つからなかった。
-            return 0xFFFFFFFF;
+        if (retry)
+            continue;
+
+        std::atomic_ref<uint64_t> flagWord(m_flagWords[wordIdx]);
+        uint64_t fullMask = getFullMask(0, wordIdx);
+        uint64_t oldFlagWord = flagWord.load(std::memory_order_relaxed);
+        while (true) {
+            uint64_t availableFlags = ~oldFlagWord & fullMask;
+            if (availableFlags == 0)
+                break;
+
+            uint64_t flag = availableFlags & (~availableFlags + 1);
+            if (!flagWord.compare_exchange_weak(
+                oldFlagWord, oldFlagWord | flag,
+                std::memory_order_acq_rel, std::memory_order_relaxed))
+                continue;
+
+            // JP: スロットの確保に成功。上位の層の使用中スロット数とORフラグを更新する。
+            // EN: Succeeded in claiming the slot. Update the used slot counts and OR flags in upper layers.
+            uint32_t slotIdx = 64 * wordIdx + tzcnt64(flag);
+            std::atomic_ref<uint32_t>(m_numUsed).fetch_add(1, std::memory_order_relaxed);
+            uint32_t lWordIdx = wordIdx;
+            for (uint32_t layer = 1; layer < m_numLayers; ++layer) {
+                uint64_t ORFlag = 1ull << (lWordIdx % 64);
+                lWordIdx /= 64;
+
+                std::atomic_ref<uint32_t>(
+                    m_numUsedFlagsUnderWordList[m_offsetsToNumUsedFlags[layer] + lWordIdx]).
+                    fetch_add(1, std::memory_order_relaxed);
+                std::atomic_ref<uint64_t> ORFlagWord(m_flagWords[m_offsetsToOR_AND[2 * layer + 0] + lWordIdx]);
+                if ((ORFlagWord.load(std::memory_order_relaxed) & ORFlag) == 0)
+                    ORFlagWord.fetch_or(ORFlag, std::memory_order_relaxed);
+            }
+            if ((oldFlagWord | flag) == fullMask)
+                propagateFullFlagConcurrent(0, wordIdx);
+
+            return slotIdx;
         }
+
+        // JP: 他のスレッドに先を越されてワードが満杯になった。
+        // EN: The word has become full by other threads.
+        if (m_numLayers == 1)
+            return InvalidSlotIndex;
+        propagateFullFlagConcurrent(0, wordIdx);
+    }
+}
+
+uint32_t SlotFinder::getFirstUsedSlot() const {
+    uint32_t wordIdx = 0;
+    for (int32_t layer = m_numLayers - 1; layer >= 0; --layer) {
+        uint64_t ORFlagWord = m_flagWords[m_offsetsToOR_AND[2 * layer + 0] + wordIdx];
+        // JP: 使用中スロットが見つからなかった。
+        // EN: No used slot found.
+        if (ORFlagWord == 0)
+            return InvalidSlotIndex;
+        wordIdx = 64 * wordIdx + tzcnt64(ORFlagWord);
     }
 
-    Assert(binIdx < m_numFlagsInLayerList[0], "Invalid value.");
-    return binIdx;
+    Assert(wordIdx < m_numFlagsInLayerList[0], "Invalid value.");
+    return wordIdx;
 }
 
 uint32_t SlotFinder::find_nthUsedSlot(uint32_t n) const {
     if (n >= getNumUsed())
-        return 0xFFFFFFFF;
-
-    uint32_t startBinIdx = 0;
-    uint32_t accNumUsed = 0;
-    for (int layer = m_numLayers - 1; layer >= 0; --layer) {
-        uint32_t numUsedFlagsOffset = m_offsetsToNumUsedFlags[layer];
-        uint32_t numFlagBinsInLayer = nextMultiplierForPowOf2(m_numFlagsInLayerList[layer], 5);
-        for (int binIdx = startBinIdx; binIdx < static_cast<int32_t>(numFlagBinsInLayer); ++binIdx) {
-            uint32_t numUsedFlagsUnderBin = m_numUsedFlagsUnderBinList[numUsedFlagsOffset + binIdx];
-
-            // JP: 現在のビンの配下にインデックスnの使用中スロットがある。
-            if (accNumUsed + numUsedFlagsUnderBin > n) {
-                startBinIdx = 32 * binIdx;
-                if (layer == 0) {
-                    uint32_t flagBin = m_flagBins[binIdx];
-                    startBinIdx += nthSetBit(flagBin, n - accNumUsed);
-                }
+        return InvalidSlotIndex;
+
+    uint32_t wordIdx = 0;
+    for (int32_t layer = m_numLayers - 1; layer > 0; --layer) {
+        // JP: 空でない下位ワードのみを辿り、インデックスnの使用中スロットを含むものを探す。
+        // EN: Visit only non-empty lower words to find the one containing the n-th used slot.
+        uint64_t ORFlagWord = m_flagWords[m_offsetsToOR_AND[2 * layer + 0] + wordIdx];
+        while (ORFlagWord != 0) {
+            uint32_t lWordIdx = 64 * wordIdx + tzcnt64(ORFlagWord);
+            uint32_t numUsedFlagsUnderWord = getNumUsedFlagsUnderWord(layer - 1, lWordIdx);
+            if (n < numUsedFlagsUnderWord) {
+                wordIdx = lWordIdx;
                 break;
             }
-
-            accNumUsed += numUsedFlagsUnderBin;
+            n -= numUsedFlagsUnderWord;
+            ORFlagWord &= ORFlagWord - 1;
         }
+        Assert(ORFlagWord != 0, "Inconsistent used slot counts.");
     }
 
-    Assert(startBinIdx < m_numFlagsInLayerList[0], "Invalid value.");
-    return startBinIdx;
+    uint32_t slotIdx = 64 * wordIdx + nthSetBit64(m_flagWords[wordIdx], n);
+    Assert(slotIdx < m_numFlagsInLayerList[0], "Invalid value.");
+    return slotIdx;
 }
 
 void SlotFinder::debugPrint() const {
-    uint32_t numLowestFlagBins = nextMultiplierForPowOf2(m_numFlagsInLayerList[0], 5);
-    hpprintf("----");
-    for (int binIdx = 0; binIdx < static_cast<int32_t>(numLowestFlagBins); ++binIdx) {
-        hpprintf("------------------------------------");
-    }
-    hpprintf("\n");
-    for (int layer = m_numLayers - 1; layer > 0; --layer) {
-        hpprintf("layer %u (%u):\n", layer, m_numFlagsInLayerList[layer]);
-        uint32_t numFlagBinsInLayer = nextMultiplierForPowOf2(m_numFlagsInLayerList[layer], 5);
-        hpprintf(" OR:");
-        for (int binIdx = 0; binIdx < static_cast<int32_t>(numFlagBinsInLayer); ++binIdx) {
-            uint32_t ORFlagBin = m_flagBins[m_offsetsToOR_AND[2 * layer + 0] + binIdx];
-            for (int i = 0; i < 32; ++i) {
+    const auto printFlagWords = [this](uint32_t layer, uint32_t offset) {
+        uint32_t numWordsInLayer = getNumWordsInLayer(layer);
+        for (uint32_t wordIdx = 0; wordIdx < numWordsInLayer; ++wordIdx) {
+            uint64_t flagWord = m_flagWords[offset + wordIdx];
+            for (uint32_t i = 0; i < 64; ++i) {
                 if (i % 8 == 0)
                     hpprintf(" ");
 
-                bool valid = binIdx * 32 + i < static_cast<int32_t>(m_numFlagsInLayerList[layer]);
+                bool valid = wordIdx * 64 + i < m_numFlagsInLayerList[layer];
                 if (!valid)
                     continue;
 
-                bool b = (ORFlagBin >> i) & 0x1;
+                bool b = (flagWord >> i) & 0x1;
                 hpprintf("%c", b ? '|' : '_');
             }
         }
         hpprintf("\n");
+    };
+    const auto printNumUsedFlags = [this](uint32_t layer) {
+        uint32_t numWordsInLayer = getNumWordsInLayer(layer);
+        hpprintf("    ");
+        for (uint32_t wordIdx = 0; wordIdx < numWordsInLayer; ++wordIdx)
+            hpprintf("                                                                %8u",
+                     getNumUsedFlagsUnderWord(layer, wordIdx));
+        hpprintf("\n");
+    };
+
+    hpprintf("----");
+    for (uint32_t wordIdx = 0; wordIdx < getNumWordsInLayer(0); ++wordIdx)
+        hpprintf("------------------------------------------------------------------------");
+    hpprintf("\n");
+    for (int32_t layer = m_numLayers - 1; layer > 0; --layer) {
+        hpprintf("layer %u (%u):\n", layer, m_numFlagsInLayerList[layer]);
+        hpprintf(" OR:");
+        printFlagWords(layer, m_offsetsToOR_AND[2 * layer + 0]);
         hpprintf("AND:");
-        for (int binIdx = 0; binIdx < static_cast<int32_t>(numFlagBinsInLayer); ++binIdx) {
-            uint32_t ANDFlagBin = m_flagBins[m_offsetsToOR_AND[2 * layer + 1] + binIdx];
-            for (int i = 0; i < 32; ++i) {
-                if (i % 8 == 0)
-                    hpprintf(" ");
+        printFlagWords(layer, m_offsetsToOR_AND[2 * layer + 1]);
+        printNumUsedFlags(layer);
+    }
+    hpprintf("layer 0 (%u):\n", m_numFlagsInLayerList[0]);
+    hpprintf("   :");
+    printFlagWords(0, 0);
+    printNumUsedFlags(0);
+}
 
-                bool valid = binIdx * 32 + i < static_cast<int32_t>(m_numFlagsInLayerList[layer]);
-                if (!valid)
-                    continue;
+// JP: 64ビット階層ビットマップ化する前の32ビットビンによるSlotFinder。
+//     benchmarkSlotFinders()での比較にのみ使うので、ベンチマークに必要な機能だけを残している。
+// EN: SlotFinder with 32-bit bins before the 64-bit hierarchical bitmap.
+//     Used only for comparison in benchmarkSlotFinders(), so only the features the benchmark needs are kept.
+class LegacySlotFinder {
+    uint32_t m_numLayers;
+    uint32_t m_numLowestFlagBins;
+    uint32_t m_numTotalCompiledFlagBins;
+    std::vector<uint32_t> m_flagBins;
+    std::vector<uint32_t> m_offsetsToOR_AND;
+    std::vector<uint32_t> m_numUsedFlagsUnderBinList;
+    std::vector<uint32_t> m_offsetsToNumUsedFlags;
+    std::vector<uint32_t> m_numFlagsInLayerList;
+
+public:
+    LegacySlotFinder(uint32_t numSlots) {
+        m_numLayers = 1;
+        m_numLowestFlagBins = nextMultiplierForPowOf2(numSlots, 5);
+
+        uint32_t numFlagBinsInLayer = m_numLowestFlagBins;
+        m_numTotalCompiledFlagBins = 0;
+        while (numFlagBinsInLayer > 1) {
+            ++m_numLayers;
+            numFlagBinsInLayer = nextMultiplierForPowOf2(numFlagBinsInLayer, 5);
+            m_numTotalCompiledFlagBins += 2 * numFlagBinsInLayer; // OR bins and AND bins
+        }
 
-                bool b = (ANDFlagBin >> i) & 0x1;
-                hpprintf("%c", b ? '|' : '_');
-            }
+        m_flagBins.assign(m_numLowestFlagBins + m_numTotalCompiledFlagBins, 0);
+        m_offsetsToOR_AND.resize(m_numLayers * 2);
+        m_numUsedFlagsUnderBinList.assign(m_numLowestFlagBins + m_numTotalCompiledFlagBins / 2, 0);
+        m_offsetsToNumUsedFlags.resize(m_numLayers);
+        m_numFlagsInLayerList.resize(m_numLayers);
+
+        uint32_t layer = 0;
+        uint32_t offsetToOR_AND = 0;
+        uint32_t offsetToNumUsedFlags = 0;
+        {
+            m_numFlagsInLayerList[layer] = numSlots;
+
+            numFlagBinsInLayer = nextMultiplierForPowOf2(numSlots, 5);
+
+            m_offsetsToOR_AND[2 * layer + 0] = offsetToOR_AND;
+            m_offsetsToOR_AND[2 * layer + 1] = offsetToOR_AND;
+            m_offsetsToNumUsedFlags[layer] = offsetToNumUsedFlags;
+
+            offsetToOR_AND += numFlagBinsInLayer;
+            offsetToNumUsedFlags += numFlagBinsInLayer;
         }
-        hpprintf("\n");
-        hpprintf("    ");
-        for (int binIdx = 0; binIdx < static_cast<int32_t>(numFlagBinsInLayer); ++binIdx) {
-            uint32_t numUsedFlagsUnderBin = m_numUsedFlagsUnderBinList[m_offsetsToNumUsedFlags[layer] + binIdx];
-            hpprintf("                            %8u", numUsedFlagsUnderBin);
+        while (numFlagBinsInLayer > 1) {
+            ++layer;
+            m_numFlagsInLayerList[layer] = numFlagBinsInLayer;
+
+            numFlagBinsInLayer = nextMultiplierForPowOf2(numFlagBinsInLayer, 5);
+
+            m_offsetsToOR_AND[2 * layer + 0] = offsetToOR_AND;
+            m_offsetsToOR_AND[2 * layer + 1] = offsetToOR_AND + numFlagBinsInLayer;
+            m_offsetsToNumUsedFlags[layer] = offsetToNumUsedFlags;
+
+            offsetToOR_AND += 2 * numFlagBinsInLayer;
+            offsetToNumUsedFlags += numFlagBinsInLayer;
         }
-        hpprintf("\n");
     }
-    {
-        hpprintf("layer 0 (%u):\n", m_numFlagsInLayerList[0]);
-        uint32_t numFlagBinsInLayer = nextMultiplierForPowOf2(m_numFlagsInLayerList[0], 5);
-        hpprintf("   :");
-        for (int binIdx = 0; binIdx < static_cast<int32_t>(numFlagBinsInLayer); ++binIdx) {
-            uint32_t ORFlagBin = m_flagBins[binIdx];
-            for (int i = 0; i < 32; ++i) {
-                if (i % 8 == 0)
-                    hpprintf(" ");
 
-                bool valid = binIdx * 32 + i < static_cast<int32_t>(m_numFlagsInLayerList[0]);
-                if (!valid)
-                    continue;
+    bool getUsage(uint32_t slotIdx) const {
+        return (bool)((m_flagBins[slotIdx / 32] >> (slotIdx % 32)) & 0x1);
+    }
 
-                bool b = (ORFlagBin >> i) & 0x1;
-                hpprintf("%c", b ? '|' : '_');
+    uint32_t getNumUsed() const {
+        return m_numUsedFlagsUnderBinList[m_offsetsToNumUsedFlags[m_numLayers - 1]];
+    }
+
+    void setInUse(uint32_t slotIdx) {
+        if (getUsage(slotIdx))
+            return;
+
+        bool setANDFlag = false;
+        uint32_t flagIdxInLayer = slotIdx;
+        for (int layer = 0; layer < static_cast<int32_t>(m_numLayers); ++layer) {
+            uint32_t binIdx = flagIdxInLayer / 32;
+            uint32_t flagIdxInBin = flagIdxInLayer % 32;
+
+            uint32_t &ORFlagBin = m_flagBins[m_offsetsToOR_AND[2 * layer + 0] + binIdx];
+            uint32_t &ANDFlagBin = m_flagBins[m_offsetsToOR_AND[2 * layer + 1] + binIdx];
+            uint32_t &numUsedFlagsUnderBin = m_numUsedFlagsUnderBinList[m_offsetsToNumUsedFlags[layer] + binIdx];
+            ORFlagBin |= (1 << flagIdxInBin);
+            if (setANDFlag)
+                ANDFlagBin |= (1 << flagIdxInBin);
+            ++numUsedFlagsUnderBin;
+
+            uint32_t numFlagsInBin = std::min(32u, m_numFlagsInLayerList[layer] - 32 * binIdx);
+            setANDFlag = static_cast<uint32_t>(popcnt(ANDFlagBin)) == numFlagsInBin;
+
+            flagIdxInLayer = binIdx;
+        }
+    }
+
+    void setNotInUse(uint32_t slotIdx) {
+        if (!getUsage(slotIdx))
+            return;
+
+        bool resetORFlag = false;
+        uint32_t flagIdxInLayer = slotIdx;
+        for (int layer = 0; layer < static_cast<int32_t>(m_numLayers); ++layer) {
+            uint32_t binIdx = flagIdxInLayer / 32;
+            uint32_t flagIdxInBin = flagIdxInLayer % 32;
+
+            uint32_t &ORFlagBin = m_flagBins[m_offsetsToOR_AND[2 * layer + 0] + binIdx];
+            uint32_t &ANDFlagBin = m_flagBins[m_offsetsToOR_AND[2 * layer + 1] + binIdx];
+            uint32_t &numUsedFlagsUnderBin = m_numUsedFlagsUnderBinList[m_offsetsToNumUsedFlags[layer] + binIdx];
+            if (resetORFlag)
+                ORFlagBin &= ~(1 << flagIdxInBin);
+            ANDFlagBin &= ~(1 << flagIdxInBin);
+            --numUsedFlagsUnderBin;
+
+            resetORFlag = ORFlagBin == 0;
+
+            flagIdxInLayer = binIdx;
+        }
+    }
+
+    uint32_t getFirstAvailableSlot() const {
+        uint32_t binIdx = 0;
+        for (int layer = m_numLayers - 1; layer >= 0; --layer) {
+            uint32_t ANDFlagBinOffset = m_offsetsToOR_AND[2 * layer + 1];
+            uint32_t numFlagsInBin = std::min(32u, m_numFlagsInLayerList[layer] - 32 * binIdx);
+            uint32_t ANDFlagBin = m_flagBins[ANDFlagBinOffset + binIdx];
+
+            if (static_cast<uint32_t>(popcnt(ANDFlagBin)) != numFlagsInBin)
+                binIdx = tzcnt(~ANDFlagBin) + 32 * binIdx;
+            else
+                return 0xFFFFFFFF;
+        }
+
+        return binIdx;
+    }
+
+    uint32_t find_nthUsedSlot(uint32_t n) const {
+        if (n >= getNumUsed())
+            return 0xFFFFFFFF;
+
+        uint32_t startBinIdx = 0;
+        uint32_t accNumUsed = 0;
+        for (int layer = m_numLayers - 1; layer >= 0; --layer) {
+            uint32_t numUsedFlagsOffset = m_offsetsToNumUsedFlags[layer];
+            uint32_t numFlagBinsInLayer = nextMultiplierForPowOf2(m_numFlagsInLayerList[layer], 5);
+            for (int binIdx = startBinIdx; binIdx < static_cast<int32_t>(numFlagBinsInLayer); ++binIdx) {
+                uint32_t numUsedFlagsUnderBin = m_numUsedFlagsUnderBinList[numUsedFlagsOffset + binIdx];
+                if (accNumUsed + numUsedFlagsUnderBin > n) {
+                    startBinIdx = 32 * binIdx;
+                    if (layer == 0)
+                        startBinIdx += nthSetBit(m_flagBins[binIdx], n - accNumUsed);
+                    break;
+                }
+                accNumUsed += numUsedFlagsUnderBin;
             }
         }
-        hpprintf("\n");
-        hpprintf("    ");
-        for (int binIdx = 0; binIdx < static_cast<int32_t>(numFlagBinsInLayer); ++binIdx) {
-            uint32_t numUsedFlagsUnderBin = m_numUsedFlagsUnderBinList[binIdx];
-            hpprintf("                            %8u", numUsedFlagsUnderBin);
+
+        return startBinIdx;
+    }
+};
+
+int32_t benchmarkSlotFinders(uint32_t numSlots) {
+    StopWatchHiRes sw;
+    const auto measure = [&sw](const auto &func) {
+        sw.start();
+        func();
+        return sw.getMeasurement(sw.stop(), StopWatchDurationType::Microseconds) * 1e-3f;
+    };
+
+    struct Result {
+        float allocTime;
+        float findTime;
+        float churnTime;
+        float freeTime;
+        std::vector<uint32_t> slots;
+        uint64_t checksum;
+    };
+
+    // JP: ジオメトリーインスタンスの生成と破棄を模して、全スロットを1つずつ確保し、
+    //     全ての使用中スロットをインデックスで引き、偶数番のスロットを解放して再確保し、最後に全て解放する。
+    //     確保されたスロットの列は両実装で一致しなければならない。
+    // EN: Mimicking creation and destruction of geometry instances, claim all the slots one by one,
+    //     look up all the used slots by index, release and reclaim the even slots, then release all.
+    //     The sequences of claimed slots must match between both implementations.
+    const auto run = [&](auto &finder) {
+        Result result;
+        result.slots.reserve(numSlots + numSlots / 2);
+        result.checksum = 0;
+        result.allocTime = measure([&]() {
+            for (uint32_t i = 0; i < numSlots; ++i) {
+                uint32_t slotIdx = finder.getFirstAvailableSlot();
+                finder.setInUse(slotIdx);
+                result.slots.push_back(slotIdx);
+            }
+        });
+        result.findTime = measure([&]() {
+            for (uint32_t i = 0; i < numSlots; ++i)
+                result.checksum += finder.find_nthUsedSlot(i);
+        });
+        result.churnTime = measure([&]() {
+            for (uint32_t i = 0; i < numSlots; i += 2)
+                finder.setNotInUse(i);
+            for (uint32_t i = 0; i < numSlots; i += 2) {
+                uint32_t slotIdx = finder.getFirstAvailableSlot();
+                finder.setInUse(slotIdx);
+                result.slots.push_back(slotIdx);
+            }
+        });
+        result.freeTime = measure([&]() {
+            for (uint32_t i = 0; i < numSlots; ++i)
+                finder.setNotInUse(i);
+        });
+        result.checksum += finder.getNumUsed();
+        return result;
+    };
+
+    LegacySlotFinder legacyFinder(numSlots);
+    const Result legacyResult = run(legacyFinder);
+
+    SlotFinder finder;
+    finder.initialize(numSlots);
+    const Result result = run(finder);
+
+    // JP: 新しい実装のみが持つ範囲操作。
+    // EN: Range operations only the new implementation has.
+    const float rangeTime = measure([&]() {
+        finder.setInUseRange(0, numSlots);
+        finder.releaseRange(0, numSlots);
+    });
+    finder.finalize();
+
+    const bool identical =
+        legacyResult.slots == result.slots && legacyResult.checksum == result.checksum;
+
+    hpprintf("SlotFinder: %u slots\n", numSlots);
+    hpprintf("%22s | %12s | %12s | %8s\n", "", "legacy", "new", "speedup");
+    const auto printRow = [](const char* name, float legacyTime, float time) {
+        hpprintf("%22s | %9.3f ms | %9.3f ms | %7.2fx\n",
+                 name, legacyTime, time, legacyTime / std::max(time, 1e-6f));
+    };
+    printRow("claim all", legacyResult.allocTime, result.allocTime);
+    printRow("find_nthUsedSlot all", legacyResult.findTime, result.findTime);
+    printRow("release/reclaim half", legacyResult.churnTime, result.churnTime);
+    printRow("release all", legacyResult.freeTime, result.freeTime);
+    hpprintf("%22s | %12s | %9.3f ms |\n", "range claim/release", "-", rangeTime);
+    hpprintf("identical: %s\n", identical ? "yes" : "NO");
+
+    return identical ? 0 : -1;
+}
+
+// JP: 32スレッドから同時にclaimFirstAvailableSlot()を呼び、同じスロットが二重に渡されないこと、
+//     全てのスロットが渡されること、上位の層の集計が逐次の場合と一致することを確かめる。
+//     2回目以降は一部のスロットを解放した状態から同時に確保し直す。
+// EN: Call claimFirstAvailableSlot() from 32 threads simultaneously, then check that no slot is handed out twice,
+//     all the slots are handed out, and the aggregation in upper layers matches the sequential one.
+//     From the second round, reclaim simultaneously from a state where some slots are released.
+static bool testConcurrentSlotClaims() {
+    constexpr uint32_t numThreads = 32;
+    constexpr uint32_t numRounds = 8;
+    // JP: 最下層のワードの境界をまたぐように64の倍数にしない。
+    // EN: Not a multiple of 64 so that the last lowest-layer word is partial.
+    constexpr uint32_t numSlots = 100003;
+
+    SlotFinder finder;
+    finder.initialize(numSlots);
+
+    bool success = true;
+    std::vector<uint32_t> claimCounts(numSlots, 0);
+    for (uint32_t round = 0; round < numRounds && success; ++round) {
+        // JP: 2回目以降は(round + 1)個おきにスロットを解放しておく。
+        // EN: From the second round, release every (round + 1)-th slot beforehand.
+        uint32_t numExpectedClaims = numSlots;
+        if (round > 0) {
+            numExpectedClaims = 0;
+            for (uint32_t slotIdx = round; slotIdx < numSlots; slotIdx += round + 1) {
+                finder.setNotInUse(slotIdx);
+                ++numExpectedClaims;
+            }
         }
-        hpprintf("\n");
+
+        std::vector<std::vector<uint32_t>> claimedSlotsPerThread(numThreads);
+        std::atomic<uint32_t> numReadyThreads = 0;
+        std::vector<std::thread> threads;
+        threads.reserve(numThreads);
+        for (uint32_t threadIdx = 0; threadIdx < numThreads; ++threadIdx) {
+            threads.emplace_back([&, threadIdx]() {
+                // JP: 全スレッドが揃ってから一斉に確保を始めて競合を起こしやすくする。
+                // EN: Start claiming all at once after all the threads are ready to make contention likely.
+                numReadyThreads.fetch_add(1);
+                while (numReadyThreads.load() < numThreads)
+                    std::this_thread::yield();
+
+                std::vector<uint32_t> &claimedSlots = claimedSlotsPerThread[threadIdx];
+                while (true) {
+                    const uint32_t slotIdx = finder.claimFirstAvailableSlot();
+                    if (slotIdx == SlotFinder::InvalidSlotIndex)
+                        break;
+                    claimedSlots.push_back(slotIdx);
+                }
+            });
+        }
+        for (std::thread &thread : threads)
+            thread.join();
+
+        uint32_t numClaims = 0;
+        uint32_t numDuplicates = 0;
+        uint32_t numInvalids = 0;
+        std::fill(claimCounts.begin(), claimCounts.end(), 0);
+        for (const std::vector<uint32_t> &claimedSlots : claimedSlotsPerThread) {
+            for (uint32_t slotIdx : claimedSlots) {
+                ++numClaims;
+                if (slotIdx >= numSlots) {
+                    ++numInvalids;
+                    continue;
+                }
+                if (++claimCounts[slotIdx] > 1)
+                    ++numDuplicates;
+            }
+        }
+
+        // JP: 全スロットが使用中になり、使用中スロット数と上位の層の集計が一致しているはず。
+        // EN: All the slots should be in use, and the number of used slots and the upper layer aggregation should match.
+        uint32_t numInconsistencies = 0;
+        for (uint32_t n = 0; n < numSlots; ++n) {
+            if (finder.find_nthUsedSlot(n) != n)
+                ++numInconsistencies;
+        }
+        const bool passed =
+            numClaims == numExpectedClaims && numDuplicates == 0 && numInvalids == 0 &&
+            finder.getNumUsed() == numSlots &&
+            finder.getFirstAvailableSlot() == SlotFinder::InvalidSlotIndex &&
+            numInconsistencies == 0;
+        hpprintf("%s: Concurrent slot claims (round %u, %u threads): "
+                 "claims %u/%u, duplicates %u, invalid %u, used %u/%u, inconsistent lookups %u\n",
+                 passed ? "OK" : "FAILED", round, numThreads,
+                 numClaims, numExpectedClaims, numDuplicates, numInvalids,
+                 finder.getNumUsed(), numSlots, numInconsistencies);
+        success &= passed;
     }
+
+    finder.finalize();
+
+    return success;
 }
 
 
@@ -914,9 +1675,12 @@ static BumpMapTextureType getBumpMapType(GLenum glFormat) {
     return BumpMapTextureType::NormalMap;
 }
 
+// JP: 最大解像度の設定によって読み込むミップレベルが変わるので、キーに含める。
+// EN: The mip levels to load change with the max resolution setting, so include it in the key.
 struct TextureCacheKey {
     std::filesystem::path filePath;
     CUcontext cuContext;
+    uint32_t maxResolution;
 
     bool operator<(const TextureCacheKey &rKey) const {
         if (filePath < rKey.filePath)
@@ -927,6 +1691,10 @@ struct TextureCacheKey {
             return true;
         else if (cuContext > rKey.cuContext)
             return false;
+        if (maxResolution < rKey.maxResolution)
+            return true;
+        else if (maxResolution > rKey.maxResolution)
+            return false;
         return false;
     }
 };
@@ -985,6 +1753,7 @@ struct TextureCacheValue {
 };
 
 static std::map<TextureCacheKey, TextureCacheValue> s_textureCache;
+static uint32_t s_maxTextureResolution = 0;
 static std::map<ImmTextureCacheKey<float>, TextureCacheValue> s_Fx1ImmTextureCache;
 static std::map<ImmTextureCacheKey<float2>, TextureCacheValue> s_Fx2ImmTextureCache;
 static std::map<ImmTextureCacheKey<float3>, TextureCacheValue> s_Fx3ImmTextureCache;
@@ -997,6 +1766,40 @@ void finalizeTextureCaches() {
     s_Fx4ImmTextureCache.clear();
 }
 
+void setMaxTextureResolution(uint32_t maxResolution) {
+    s_maxTextureResolution = maxResolution;
+}
+
+// JP: 最大解像度の設定に従ってDDSファイルをマップし、CUDA配列に格納可能なミップレベルを選ぶ。
+//     CUDAのBCフォーマットのミップマップ配列はブロック単位の解像度で最後のレベルを決めるため、
+//     1x1ブロックより小さいレベル(4x4未満)は格納できない(cudau::Array::initializeのコメント参照)。
+// EN: Map a DDS file according to the max resolution setting and select mip levels storable in a CUDA array.
+//     CUDA's mipmapped arrays with BC formats determine the last level by the block resolution,
+//     so levels below a 1x1 block (smaller than 4x4) cannot be stored (see the comment in cudau::Array::initialize).
+static bool openDDSImage(
+    const std::filesystem::path &filePath, dds::MappedImage* image, int32_t* numDeviceMipLevels) {
+    dds::ImageInfo info;
+    if (!dds::queryInfo(filePath.string().c_str(), &info))
+        return false;
+
+    int32_t firstMipLevel = 0;
+    if (s_maxTextureResolution > 0) {
+        uint32_t maxDim = std::max(info.width, info.height);
+        while (firstMipLevel < info.mipCount - 1 &&
+               (maxDim >> firstMipLevel) > s_maxTextureResolution)
+            ++firstMipLevel;
+    }
+    if (!image->open(filePath.string().c_str(), firstMipLevel))
+        return false;
+
+    const uint32_t numBlocksX = (image->getWidth() + 3) / 4;
+    const uint32_t numBlocksY = (image->getHeight() + 3) / 4;
+    const int32_t maxNumDeviceMipLevels = prevPowOf2Exponent(std::max(numBlocksX, numBlocksY)) + 1;
+    *numDeviceMipLevels = std::min(image->getNumMipLevels(), maxNumDeviceMipLevels);
+
+    return true;
+}
+
 template <typename T>
 void createImmTexture(
     CUcontext cuContext,
@@ -1154,6 +1957,73 @@ template void createImmTexture(
     std::shared_ptr<cudau::Array>* texture,
     std::shared_ptr<glu::Texture2D>* gfxTexture);
 
+// JP: デコード済みのテクスチャー画像。ワーカースレッドで作られ、メインスレッドでアップロードされる。
+// EN: Decoded texture image. Created on a worker thread and uploaded on the main thread.
+struct DecodedTextureImage {
+    dds::MappedImage ddsImage;
+    uint8_t* linearImageData;
+    int32_t width;
+    int32_t height;
+    int32_t mipCount;
+    cudau::ArrayElementType elemType;
+    uint32_t numChannels;
+    bool needsDegamma;
+    bool isHDR;
+
+    DecodedTextureImage() :
+        linearImageData(nullptr) {}
+    ~DecodedTextureImage() {
+        if (linearImageData)
+            stbi_image_free(linearImageData);
+    }
+};
+
+static bool decodeTextureImage(const std::filesystem::path &filePath, DecodedTextureImage* image) {
+    if (filePath.extension() == ".dds" ||
+        filePath.extension() == ".DDS") {
+        if (!openDDSImage(filePath, &image->ddsImage, &image->mipCount))
+            return false;
+        image->width = image->ddsImage.getWidth();
+        image->height = image->ddsImage.getHeight();
+        image->numChannels = 1;
+        translate(image->ddsImage.getFormat(), &image->elemType, &image->needsDegamma, &image->isHDR);
+    }
+    else {
+        int32_t n;
+        image->linearImageData = stbi_load(
+            filePath.string().c_str(), &image->width, &image->height, &n, 4);
+        if (!image->linearImageData)
+            return false;
+        image->mipCount = 1;
+        image->elemType = cudau::ArrayElementType::UInt8;
+        image->numChannels = 4;
+        image->needsDegamma = true;
+        image->isHDR = false;
+    }
+
+    return true;
+}
+
+static std::shared_ptr<cudau::Array> uploadDecodedTextureImage(
+    CUcontext cuContext, const DecodedTextureImage &image, bool useSurface) {
+    auto texture = std::make_shared<cudau::Array>();
+    texture->initialize2D(
+        cuContext, image.elemType, image.numChannels,
+        useSurface ? cudau::ArraySurface::Enable : cudau::ArraySurface::Disable,
+        cudau::ArrayTextureGather::Disable,
+        image.width, image.height, image.mipCount);
+    if (image.ddsImage.isOpen()) {
+        for (int32_t mipLevel = 0; mipLevel < image.mipCount; ++mipLevel) {
+            const dds::MipView &mip = image.ddsImage.getMip(mipLevel);
+            texture->write<uint8_t>(mip.data, mip.size, mipLevel);
+        }
+    }
+    else {
+        texture->write<uint8_t>(image.linearImageData, image.width * image.height * 4);
+    }
+    return texture;
+}
+
 template <typename T, bool useSurface>
 bool loadTexture(
     const std::filesystem::path &filePath, const T &fallbackValue,
@@ -1164,6 +2034,7 @@ bool loadTexture(
     TextureCacheKey cacheKey;
     cacheKey.filePath = filePath;
     cacheKey.cuContext = cuContext;
+    cacheKey.maxResolution = s_maxTextureResolution;
     if (s_textureCache.count(cacheKey)) {
         const TextureCacheValue &value = s_textureCache.at(cacheKey);
         *texture = value.texture;
@@ -1173,56 +2044,13 @@ bool loadTexture(
         return true;
     }
 
-    bool success = true;
-    TextureCacheValue cacheValue = {};
-    if (filePath.extension() == ".dds" ||
-        filePath.extension() == ".DDS") {
-        int32_t width, height, mipCount;
-        dds::Format ddsFormat;
-        size_t* sizes;
-        uint8_t** imageData = dds::load(filePath.string().c_str(),
-                                        &width, &height, &mipCount, &sizes, &ddsFormat);
-        mipCount = std::max(mipCount - 2, 1);
-        if (imageData) {
-            cudau::ArrayElementType elemType;
-            translate(ddsFormat, &elemType, &cacheValue.needsDegamma, &cacheValue.isHDR);
-            cacheValue.texture = std::make_shared<cudau::Array>();
-            cacheValue.texture->initialize2D(
-                cuContext, elemType, 1,
-                useSurface ? cudau::ArraySurface::Enable : cudau::ArraySurface::Disable,
-                cudau::ArrayTextureGather::Disable,
-                width, height, mipCount);
-            for (int32_t mipLevel = 0; mipLevel < mipCount; ++mipLevel)
-                cacheValue.texture->write<uint8_t>(
-                    imageData[mipLevel], static_cast<uint32_t>(sizes[mipLevel]), mipLevel);
-            dds::free(imageData, mipCount, sizes);
-        }
-        else {
-            success = false;
-        }
-    }
-    else {
-        int32_t width, height, n;
-        uint8_t* linearImageData = stbi_load(filePath.string().c_str(),
-                                             &width, &height, &n, 4);
-        if (linearImageData) {
-            cacheValue.texture = std::make_shared<cudau::Array>();
-            cacheValue.texture->initialize2D(
-                cuContext, cudau::ArrayElementType::UInt8, 4,
-                useSurface ? cudau::ArraySurface::Enable : cudau::ArraySurface::Disable,
-                cudau::ArrayTextureGather::Disable,
-                width, height, 1);
-            cacheValue.texture->write<uint8_t>(linearImageData, width * height * 4);
-            stbi_image_free(linearImageData);
-            cacheValue.needsDegamma = true;
-            cacheValue.isHDR = false;
-        }
-        else {
-            success = false;
-        }
-    }
-
+    DecodedTextureImage image;
+    bool success = decodeTextureImage(filePath, &image);
     if (success) {
+        TextureCacheValue cacheValue = {};
+        cacheValue.texture = uploadDecodedTextureImage(cuContext, image, useSurface);
+        cacheValue.needsDegamma = image.needsDegamma;
+        cacheValue.isHDR = image.isHDR;
         s_textureCache[cacheKey] = cacheValue;
 
         *texture = s_textureCache.at(cacheKey).texture;
@@ -1232,8 +2060,6 @@ bool loadTexture(
     }
     else {
         createImmTexture(cuContext, fallbackValue, true, texture);
-        cacheValue.needsDegamma = true;
-        cacheValue.isHDR = false;
     }
 
     return success;
@@ -1279,6 +2105,7 @@ bool loadNormalTexture(
     TextureCacheKey cacheKey;
     cacheKey.filePath = filePath;
     cacheKey.cuContext = cuContext;
+    cacheKey.maxResolution = s_maxTextureResolution;
     if (s_textureCache.count(cacheKey)) {
         const TextureCacheValue &value = s_textureCache.at(cacheKey);
         *texture = value.texture;
@@ -1291,13 +2118,12 @@ bool loadNormalTexture(
     TextureCacheValue cacheValue;
     if (filePath.extension() == ".dds" ||
         filePath.extension() == ".DDS") {
-        int32_t width, height, mipCount;
-        dds::Format ddsFormat;
-        size_t* sizes;
-        uint8_t** imageData = dds::load(
-            filePath.string().c_str(), &width, &height, &mipCount, &sizes, &ddsFormat);
-        mipCount = std::max(mipCount - 2, 1);
-        if (imageData) {
+        dds::MappedImage ddsImage;
+        int32_t mipCount;
+        if (openDDSImage(filePath, &ddsImage, &mipCount)) {
+            const int32_t width = ddsImage.getWidth();
+            const int32_t height = ddsImage.getHeight();
+            const dds::Format ddsFormat = ddsImage.getFormat();
             bool isHDR;
             if constexpr (useGLTexture) {
                 GLenum glFormat;
@@ -1308,9 +2134,11 @@ bool loadNormalTexture(
                     cudau::ArrayTextureGather::Disable;
                 cacheValue.gfxTexture = std::make_shared<glu::Texture2D>();
                 cacheValue.gfxTexture->initialize(glFormat, width, height, mipCount);
-                for (int mipLevel = 0; mipLevel < mipCount; ++mipLevel)
+                for (int mipLevel = 0; mipLevel < mipCount; ++mipLevel) {
+                    const dds::MipView &mip = ddsImage.getMip(mipLevel);
                     cacheValue.gfxTexture->transferCompressedImage(
-                        imageData[mipLevel], static_cast<GLsizei>(sizes[mipLevel]), mipLevel);
+                        mip.data, static_cast<GLsizei>(mip.size), mipLevel);
+                }
                 //cacheValue.texture->initializeFromGLTexture2D(
                 //    cuContext, cacheValue.gfxTexture->getHandle(),
                 //    cudau::ArraySurface::Disable, textureGather);
@@ -1327,10 +2155,10 @@ bool loadNormalTexture(
                 cudau::ArraySurface::Disable,
                 textureGather,
                 width, height, mipCount);
-            for (int32_t mipLevel = 0; mipLevel < mipCount; ++mipLevel)
-                cacheValue.texture->write<uint8_t>(
-                    imageData[mipLevel], static_cast<uint32_t>(sizes[mipLevel]), mipLevel);
-            dds::free(imageData, mipCount, sizes);
+            for (int32_t mipLevel = 0; mipLevel < mipCount; ++mipLevel) {
+                const dds::MipView &mip = ddsImage.getMip(mipLevel);
+                cacheValue.texture->write<uint8_t>(mip.data, mip.size, mipLevel);
+            }
         }
         else {
             success = false;
@@ -1385,6 +2213,156 @@ bool loadNormalTexture(
     return success;
 }
 
+void AsyncTextureLoader::initialize(uint32_t numThreads) {
+    if (numThreads == 0)
+        numThreads = std::max(std::thread::hardware_concurrency(), 1u);
+    m_stopRequested = false;
+    m_workers.reserve(numThreads);
+    for (uint32_t i = 0; i < numThreads; ++i)
+        m_workers.emplace_back(&AsyncTextureLoader::workerMain, this);
+}
+
+void AsyncTextureLoader::finalize() {
+    {
+        std::lock_guard lock(m_mutex);
+        m_stopRequested = true;
+    }
+    m_cv.notify_all();
+    for (std::thread &worker : m_workers)
+        worker.join();
+    m_workers.clear();
+
+    m_requests.clear();
+    m_pathToRequest.clear();
+    m_queue.clear();
+    m_completedRequests.clear();
+    m_numUnfinishedRequests = 0;
+}
+
+void AsyncTextureLoader::workerMain() {
+    while (true) {
+        uint32_t requestID;
+        std::filesystem::path filePath;
+        {
+            std::unique_lock lock(m_mutex);
+            m_cv.wait(lock, [this]() { return m_stopRequested || !m_queue.empty(); });
+            if (m_stopRequested)
+                return;
+
+            requestID = m_queue.begin()->second;
+            m_queue.erase(m_queue.begin());
+            Request &request = m_requests[requestID];
+            request.isQueued = false;
+            filePath = request.filePath;
+        }
+
+        auto image = std::make_shared<DecodedTextureImage>();
+        if (!decodeTextureImage(filePath, image.get()))
+            image = nullptr;
+
+        {
+            std::lock_guard lock(m_mutex);
+            m_requests[requestID].image = std::move(image);
+            m_completedRequests.push_back(requestID);
+        }
+    }
+}
+
+uint32_t AsyncTextureLoader::request(
+    const std::filesystem::path &filePath, float priority,
+    const CompletionCallback &callback) {
+    std::lock_guard lock(m_mutex);
+
+    if (auto it = m_pathToRequest.find(filePath); it != m_pathToRequest.cend()) {
+        uint32_t requestID = it->second;
+        Request &request = m_requests[requestID];
+        // JP: 完了済みのリクエストには新たなリクエストを作る。
+        // EN: Create a new request for a finished request.
+        if (request.isQueued || !request.callbacks.empty()) {
+            request.callbacks.push_back(callback);
+            if (request.isQueued) {
+                m_queue.erase(std::make_pair(request.priority, requestID));
+                request.priority += priority;
+                m_queue.insert(std::make_pair(request.priority, requestID));
+            }
+            return requestID;
+        }
+    }
+
+    uint32_t requestID = static_cast<uint32_t>(m_requests.size());
+    Request request;
+    request.filePath = filePath;
+    request.priority = priority;
+    request.callbacks.push_back(callback);
+    request.isQueued = true;
+    m_requests.push_back(std::move(request));
+    m_pathToRequest[filePath] = requestID;
+    m_queue.insert(std::make_pair(priority, requestID));
+    ++m_numUnfinishedRequests;
+    m_cv.notify_one();
+
+    return requestID;
+}
+
+void AsyncTextureLoader::raisePriority(uint32_t requestID, float deltaPriority) {
+    std::lock_guard lock(m_mutex);
+    Request &request = m_requests[requestID];
+    if (!request.isQueued)
+        return;
+    m_queue.erase(std::make_pair(request.priority, requestID));
+    request.priority += deltaPriority;
+    m_queue.insert(std::make_pair(request.priority, requestID));
+}
+
+uint32_t AsyncTextureLoader::processCompletedRequests(CUcontext cuContext, CUstream stream) {
+    std::vector<uint32_t> completedRequests;
+    {
+        std::lock_guard lock(m_mutex);
+        completedRequests.swap(m_completedRequests);
+    }
+
+    for (uint32_t requestID : completedRequests) {
+        std::filesystem::path filePath;
+        std::shared_ptr<DecodedTextureImage> image;
+        std::vector<CompletionCallback> callbacks;
+        {
+            std::lock_guard lock(m_mutex);
+            Request &request = m_requests[requestID];
+            filePath = request.filePath;
+            image = std::move(request.image);
+            callbacks = std::move(request.callbacks);
+            request.callbacks.clear();
+            --m_numUnfinishedRequests;
+        }
+
+        // JP: 失敗した場合はフォールバックのテクスチャーが使われ続ける。
+        // EN: The fallback texture continues to be used on failure.
+        if (!image) {
+            hpprintf("Failed to load %s.\n", filePath.string().c_str());
+            continue;
+        }
+
+        TextureCacheKey cacheKey;
+        cacheKey.filePath = filePath;
+        cacheKey.cuContext = cuContext;
+        cacheKey.maxResolution = s_maxTextureResolution;
+        if (!s_textureCache.count(cacheKey)) {
+            TextureCacheValue cacheValue = {};
+            cacheValue.texture = uploadDecodedTextureImage(cuContext, *image, false);
+            cacheValue.needsDegamma = image->needsDegamma;
+            cacheValue.isHDR = image->isHDR;
+            s_textureCache[cacheKey] = cacheValue;
+        }
+        const TextureCacheValue &value = s_textureCache.at(cacheKey);
+        for (const CompletionCallback &callback : callbacks)
+            callback(stream, value.texture, value.needsDegamma, value.isHDR);
+    }
+
+    return static_cast<uint32_t>(completedRequests.size());
+}
+
+
+
 void createNormalTexture(
     CUcontext cuContext,
     const std::filesystem::path &normalPath,
@@ -1443,9 +2421,69 @@ shared::TexDimInfo calcDimInfo(const cudau::Array &cuArray, bool isLeftHanded) {
     return dimInfo;
 }
 
-void createLambertMaterial(
-    CUcontext cuContext, Scene* scene,
-    const std::filesystem::path &reflectancePath, const RGB &immReflectance,
+// JP: シーンに非同期ローダーが設定されている場合はテクスチャーの読み込みをリクエストしてtrueを返す。
+//     読み込みが完了するまではフォールバックのテクスチャーが使われ、
+//     完了時にテクスチャーを差し替えてデバイス上のマテリアルデータのテクスチャーオブジェクトと
+//     その解像度情報のフィールドのみを更新する。
+//     texObjOffsetとdimInfoOffsetはshared::MaterialData中のそれらのフィールドのオフセット。
+// EN: Request loading the texture and return true when the scene has an asynchronous loader.
+//     The fallback texture is used until the loading completes,
+//     then the texture is replaced and only the fields of the texture object and its dimension info
+//     in the material data on the device are updated.
+//     texObjOffset and dimInfoOffset are the offsets of those fields in shared::MaterialData.
+static bool requestMaterialTexture(
+    CUcontext cuContext, Scene* scene, Material* mat, Texture* dstTex,
+    const std::filesystem::path &filePath, bool allowsDegamma,
+    size_t texObjOffset, size_t dimInfoOffset) {
+    if (!scene->textureLoader)
+        return false;
+
+    // JP: 読み込み済みのテクスチャーは同期的なパスでキャッシュから取得する。
+    // EN: Get an already loaded texture from the cache in the synchronous path.
+    TextureCacheKey cacheKey;
+    cacheKey.filePath = filePath;
+    cacheKey.cuContext = cuContext;
+    cacheKey.maxResolution = s_maxTextureResolution;
+    if (s_textureCache.count(cacheKey))
+        return false;
+
+    hpprintf("  Requested: %s\n", filePath.string().c_str());
+    uint32_t requestID = scene->textureLoader->request(
+        filePath, 1.0f,
+        [scene, mat, dstTex, allowsDegamma, texObjOffset, dimInfoOffset]
+        (CUstream stream, const std::shared_ptr<cudau::Array> &texture, bool needsDegamma, bool isHDR) {
+        cudau::TextureSampler sampler;
+        sampler.setXyFilterMode(cudau::TextureFilterMode::Linear);
+        sampler.setWrapMode(0, cudau::TextureWrapMode::Repeat);
+        sampler.setWrapMode(1, cudau::TextureWrapMode::Repeat);
+        sampler.setMipMapFilterMode(cudau::TextureFilterMode::Linear);
+        sampler.setReadMode(allowsDegamma && needsDegamma ?
+                            cudau::TextureReadMode::NormalizedFloat_sRGB :
+                            cudau::TextureReadMode::NormalizedFloat);
+
+        if (dstTex->texObj)
+            CUDADRV_CHECK(cuTexObjectDestroy(dstTex->texObj));
+        dstTex->cudaArray = texture;
+        dstTex->texObj = sampler.createTextureObject(*texture);
+
+        // JP: ページング可能なメモリーからの非同期転送は呼び出し中にステージングされるので、
+        //     ローカル変数から転送してよい。
+        // EN: An asynchronous transfer from pageable memory is staged during the call,
+        //     so transferring from local variables is fine.
+        const CUdeviceptr matDataPtr = scene->materialDataBuffer.getCUdeviceptrAt(mat->materialSlot);
+        const CUtexObject texObj = dstTex->texObj;
+        const shared::TexDimInfo dimInfo = calcDimInfo(*texture);
+        CUDADRV_CHECK(cuMemcpyHtoDAsync(matDataPtr + texObjOffset, &texObj, sizeof(texObj), stream));
+        CUDADRV_CHECK(cuMemcpyHtoDAsync(matDataPtr + dimInfoOffset, &dimInfo, sizeof(dimInfo), stream));
+    });
+    mat->textureRequestIDs.push_back(requestID);
+
+    return true;
+}
+
+void createLambertMaterial(
+    CUcontext cuContext, Scene* scene,
+    const std::filesystem::path &reflectancePath, const RGB &immReflectance,
     const std::filesystem::path &normalPath,
     const std::filesystem::path &emittancePath, const RGB &immEmittance) {
     shared::MaterialData* matDataOnHost = scene->materialDataBuffer.getMappedPointer();
@@ -1476,7 +2514,11 @@ void createLambertMaterial(
 
     mat->body = Material::Lambert();
     auto &body = std::get<Material::Lambert>(mat->body);
-    if (!reflectancePath.empty()) {
+    if (!reflectancePath.empty() &&
+        !requestMaterialTexture(
+            cuContext, scene, mat, &body.texReflectance, reflectancePath, true,
+            offsetof(shared::MaterialData, asLambert.reflectance),
+            offsetof(shared::MaterialData, asLambert.reflectanceDimInfo))) {
         hpprintf("  Reading: %s ... ", reflectancePath.string().c_str());
         if (loadTexture(
             reflectancePath, float4(immReflectance.toNative(), 1.0f), cuContext,
@@ -1523,8 +2565,7 @@ void createLambertMaterial(
             mat->texEmittance.texObj = sampler_normFloat.createTextureObject(*mat->texEmittance.cudaArray);
     }
 
-    mat->materialSlot = scene->materialSlotFinder.getFirstAvailableSlot();
-    scene->materialSlotFinder.setInUse(mat->materialSlot);
+    mat->materialSlot = scene->materialSlotFinder.claimFirstAvailableSlot();
 
     shared::MaterialData matData = {};
     matData.asLambert.reflectance = body.texReflectance.texObj;
@@ -1580,7 +2621,11 @@ void createDiffuseAndSpecularMaterial(
     mat->body = Material::DiffuseAndSpecular();
     auto &body = std::get<Material::DiffuseAndSpecular>(mat->body);
 
-    if (!diffuseColorPath.empty()) {
+    if (!diffuseColorPath.empty() &&
+        !requestMaterialTexture(
+            cuContext, scene, mat, &body.texDiffuse, diffuseColorPath, true,
+            offsetof(shared::MaterialData, asDiffuseAndSpecular.diffuse),
+            offsetof(shared::MaterialData, asDiffuseAndSpecular.diffuseDimInfo))) {
         hpprintf("  Reading: %s ... ", diffuseColorPath.string().c_str());
         if (loadTexture(
             diffuseColorPath, float4(immDiffuseColor.toNative(), 1.0f), cuContext,
@@ -1598,7 +2643,11 @@ void createDiffuseAndSpecularMaterial(
     else
         body.texDiffuse.texObj = sampler_normFloat.createTextureObject(*body.texDiffuse.cudaArray);
 
-    if (!specularColorPath.empty()) {
+    if (!specularColorPath.empty() &&
+        !requestMaterialTexture(
+            cuContext, scene, mat, &body.texSpecular, specularColorPath, true,
+            offsetof(shared::MaterialData, asDiffuseAndSpecular.specular),
+            offsetof(shared::MaterialData, asDiffuseAndSpecular.specularDimInfo))) {
         hpprintf("  Reading: %s ... ", specularColorPath.string().c_str());
         if (loadTexture(
             specularColorPath, float4(immSpecularColor.toNative(), 1.0f), cuContext,
@@ -1648,8 +2697,7 @@ void createDiffuseAndSpecularMaterial(
             mat->texEmittance.texObj = sampler_normFloat.createTextureObject(*mat->texEmittance.cudaArray);
     }
 
-    mat->materialSlot = scene->materialSlotFinder.getFirstAvailableSlot();
-    scene->materialSlotFinder.setInUse(mat->materialSlot);
+    mat->materialSlot = scene->materialSlotFinder.claimFirstAvailableSlot();
 
     shared::MaterialData matData = {};
     matData.asDiffuseAndSpecular.diffuse = body.texDiffuse.texObj;
@@ -1712,7 +2760,11 @@ void createSimplePBRMaterial(
     mat->body = Material::SimplePBR();
     auto &body = std::get<Material::SimplePBR>(mat->body);
 
-    if (!baseColor_opacityPath.empty()) {
+    if (!baseColor_opacityPath.empty() &&
+        !requestMaterialTexture(
+            cuContext, scene, mat, &body.texBaseColor_opacity, baseColor_opacityPath, true,
+            offsetof(shared::MaterialData, asSimplePBR.baseColor_opacity),
+            offsetof(shared::MaterialData, asSimplePBR.baseColor_opacity_dimInfo))) {
         hpprintf("  Reading: %s ... ", baseColor_opacityPath.string().c_str());
         if (loadTexture(baseColor_opacityPath, immBaseColor_opacity, cuContext,
                         &body.texBaseColor_opacity.cudaArray, &needsDegamma))
@@ -1730,7 +2782,11 @@ void createSimplePBRMaterial(
     else
         body.texBaseColor_opacity.texObj = sampler_normFloat.createTextureObject(*body.texBaseColor_opacity.cudaArray);
 
-    if (!occlusion_roughness_metallicPath.empty()) {
+    if (!occlusion_roughness_metallicPath.empty() &&
+        !requestMaterialTexture(
+            cuContext, scene, mat, &body.texOcclusion_roughness_metallic, occlusion_roughness_metallicPath, false,
+            offsetof(shared::MaterialData, asSimplePBR.occlusion_roughness_metallic),
+            offsetof(shared::MaterialData, asSimplePBR.occlusion_roughness_metallic_dimInfo))) {
         hpprintf("  Reading: %s ... ", occlusion_roughness_metallicPath.string().c_str());
         if (loadTexture(
             occlusion_roughness_metallicPath, float4(immOcclusion_roughness_metallic, 0.0f),
@@ -1776,8 +2832,7 @@ void createSimplePBRMaterial(
             mat->texEmittance.texObj = sampler_normFloat.createTextureObject(*mat->texEmittance.cudaArray);
     }
 
-    mat->materialSlot = scene->materialSlotFinder.getFirstAvailableSlot();
-    scene->materialSlotFinder.setInUse(mat->materialSlot);
+    mat->materialSlot = scene->materialSlotFinder.claimFirstAvailableSlot();
 
     shared::MaterialData matData = {};
     matData.asSimplePBR.baseColor_opacity = body.texBaseColor_opacity.texObj;
@@ -1803,38 +2858,69 @@ void createSimplePBRMaterial(
     scene->materials.push_back(mat);
 }
 
+void setMaterialEmittance(CUcontext cuContext, Scene* scene, Material* mat, const RGB &immEmittance) {
+    cudau::TextureSampler sampler_normFloat;
+    sampler_normFloat.setXyFilterMode(cudau::TextureFilterMode::Linear);
+    sampler_normFloat.setWrapMode(0, cudau::TextureWrapMode::Repeat);
+    sampler_normFloat.setWrapMode(1, cudau::TextureWrapMode::Repeat);
+    sampler_normFloat.setMipMapFilterMode(cudau::TextureFilterMode::Linear);
+    sampler_normFloat.setReadMode(cudau::TextureReadMode::NormalizedFloat);
+
+    // JP: 値がゼロでもテクスチャーを持たせて、後から再び編集できるようにする。
+    // EN: Keep a texture even for zero so that the emittance can be edited again later.
+    if (mat->texEmittance.texObj)
+        CUDADRV_CHECK(cuTexObjectDestroy(mat->texEmittance.texObj));
+    createImmTexture(cuContext, immEmittance.toNative(), false, &mat->texEmittance.cudaArray, nullptr);
+    mat->texEmittance.texObj = sampler_normFloat.createTextureObject(*mat->texEmittance.cudaArray);
+
+    shared::MaterialData matData;
+    CUdeviceptr matDataPtr = scene->materialDataBuffer.getCUdeviceptrAt(mat->materialSlot);
+    CUDADRV_CHECK(cuMemcpyDtoH(&matData, matDataPtr, sizeof(matData)));
+    matData.emittance = mat->texEmittance.texObj;
+    CUDADRV_CHECK(cuMemcpyHtoD(matDataPtr, &matData, sizeof(matData)));
+
+    mat->markLightDistDirty();
+}
+
 GeometryInstance* createGeometryInstance(
     CUcontext cuContext, Scene* scene,
-    const std::vector<shared::Vertex> &vertices,
-    const std::vector<shared::Triangle> &triangles,
+    const shared::Vertex* vertices, uint32_t numVertices,
+    const shared::Triangle* triangles, uint32_t numTriangles,
     const Material* mat, optixu::Material optixMat,
-    bool allocateGfxResource) {
+    bool allocateGfxResource, const AABB* aabb) {
     shared::GeometryInstanceData* geomInstDataOnHost = scene->geomInstDataBuffer.getMappedPointer();
 
     GeometryInstance* geomInst = new GeometryInstance();
     geomInst->geometryType = optixu::GeometryType::Triangles;
 
-    for (int triIdx = 0; triIdx < triangles.size(); ++triIdx) {
-        const shared::Triangle &tri = triangles[triIdx];
-        const shared::Vertex (&vs)[3] = {
-            vertices[tri.index0],
-            vertices[tri.index1],
-            vertices[tri.index2],
-        };
-        geomInst->aabb
-            .unify(vs[0].position)
-            .unify(vs[1].position)
-            .unify(vs[2].position);
+    if (aabb) {
+        geomInst->aabb = *aabb;
+    }
+    else {
+        for (uint32_t triIdx = 0; triIdx < numTriangles; ++triIdx) {
+            const shared::Triangle &tri = triangles[triIdx];
+            const shared::Vertex (&vs)[3] = {
+                vertices[tri.index0],
+                vertices[tri.index1],
+                vertices[tri.index2],
+            };
+            geomInst->aabb
+                .unify(vs[0].position)
+                .unify(vs[1].position)
+                .unify(vs[2].position);
+        }
     }
 
     geomInst->mat = mat;
+    geomInst->needsLightDistUpdate = true;
+    geomInst->needsEmitterTriangleReadback = false;
     if (allocateGfxResource) {
         geomInst->gfxVertexBuffer.initialize(
-            sizeof(shared::Vertex), vertices.size(), glu::Buffer::Usage::StaticDraw);
-        geomInst->gfxVertexBuffer.write(vertices);
+            sizeof(shared::Vertex), numVertices, glu::Buffer::Usage::StaticDraw);
+        geomInst->gfxVertexBuffer.write(vertices, numVertices);
         geomInst->gfxTriangleBuffer.initialize(
-            sizeof(shared::Triangle), triangles.size(), glu::Buffer::Usage::StaticDraw);
-        geomInst->gfxTriangleBuffer.write(triangles);
+            sizeof(shared::Triangle), numTriangles, glu::Buffer::Usage::StaticDraw);
+        geomInst->gfxTriangleBuffer.write(triangles, numTriangles);
 
         geomInst->gfxVertexArray.initialize();
         {
@@ -1859,19 +2945,18 @@ GeometryInstance* createGeometryInstance(
             glVertexArrayElementBuffer(vaoHandle, geomInst->gfxTriangleBuffer.getHandle());
         }
     }
-    geomInst->vertexBuffer.initialize(cuContext, Scene::bufferType, vertices);
-    geomInst->triangleBuffer.initialize(cuContext, Scene::bufferType, triangles);
+    geomInst->vertexBuffer.initialize(cuContext, Scene::bufferType, vertices, numVertices);
+    geomInst->triangleBuffer.initialize(cuContext, Scene::bufferType, triangles, numTriangles);
     if (mat->texEmittance.cudaArray) {
 #if USE_PROBABILITY_TEXTURE
         geomInst->emitterPrimDist.initialize(
-            cuContext, static_cast<uint32_t>(triangles.size()));
+            cuContext, numTriangles);
 #else
         geomInst->emitterPrimDist.initialize(
-            cuContext, Scene::bufferType, nullptr, static_cast<uint32_t>(triangles.size()));
+            cuContext, Scene::bufferType, nullptr, numTriangles);
 #endif
     }
-    geomInst->geomInstSlot = scene->geomInstSlotFinder.getFirstAvailableSlot();
-    scene->geomInstSlotFinder.setInUse(geomInst->geomInstSlot);
+    geomInst->geomInstSlot = scene->geomInstSlotFinder.claimFirstAvailableSlot();
 
     shared::GeometryInstanceData geomInstData = {};
     geomInstData.vertexBuffer = geomInst->vertexBuffer.getROBuffer<shared::enableBufferOobCheck>();
@@ -1915,10 +3000,11 @@ GeometryInstance* createTFDMGeometryInstance(
     }
 
     geomInst->mat = mat;
+    geomInst->needsLightDistUpdate = true;
+    geomInst->needsEmitterTriangleReadback = false;
     geomInst->vertexBuffer.initialize(cuContext, Scene::bufferType, vertices);
     geomInst->triangleBuffer.initialize(cuContext, Scene::bufferType, triangles);
-    geomInst->geomInstSlot = scene->geomInstSlotFinder.getFirstAvailableSlot();
-    scene->geomInstSlotFinder.setInUse(geomInst->geomInstSlot);
+    geomInst->geomInstSlot = scene->geomInstSlotFinder.claimFirstAvailableSlot();
 
     shared::GeometryInstanceData geomInstData = {};
     geomInstData.vertexBuffer = geomInst->vertexBuffer.getROBuffer<shared::enableBufferOobCheck>();
@@ -1937,195 +3023,223 @@ GeometryInstance* createTFDMGeometryInstance(
 }
 
 GeometryGroup* createGeometryGroup(
-    Scene* scene,
+    CUcontext cuContext, Scene* scene,
     const std::set<const GeometryInstance*> &geomInsts) {
     GeometryGroup* geomGroup = new GeometryGroup();
     geomGroup->geomInsts = geomInsts;
     geomGroup->numEmitterPrimitives = 0;
 
+    std::vector<uint32_t> geomInstSlots;
     optixu::GeometryType geomType = (*geomInsts.cbegin())->geometryType;
     geomGroup->optixGas = scene->optixScene.createGeometryAccelerationStructure(geomType);
     for (auto it = geomInsts.cbegin(); it != geomInsts.cend(); ++it) {
         const GeometryInstance* geomInst = *it;
+        geomInstSlots.push_back(geomInst->geomInstSlot);
         geomGroup->optixGas.addChild(geomInst->optixGeomInst);
         if (geomInst->mat->texEmittance.cudaArray)
             geomGroup->numEmitterPrimitives += static_cast<uint32_t>(geomInst->triangleBuffer.numElements());
         geomGroup->aabb.unify(geomInst->aabb);
     }
+    geomGroup->geomInstSlots.initialize(cuContext, Scene::bufferType, geomInstSlots);
     geomGroup->optixGas.setNumMaterialSets(1);
     geomGroup->optixGas.setNumRayTypes(0, scene->numRayTypes);
     geomGroup->needsReallocation = true;
     geomGroup->needsRebuild = true;
     geomGroup->refittable = geomType == optixu::GeometryType::CustomPrimitives;
+    geomGroup->compacted = false;
 
     return geomGroup;
 }
 
 constexpr bool useLambertMaterial = false;
 
-void createTriangleMeshes(
-    const std::string &meshName,
-    const std::filesystem::path &filePath,
-    MaterialConvention matConv,
-    const Matrix4x4 &preTransform,
-    CUcontext cuContext, Scene* scene, optixu::Material optixMat,
-    bool allocateGfxResource) {
-    hpprintf("Reading: %s ... ", filePath.string().c_str());
-    fflush(stdout);
-    Assimp::Importer importer;
-    const aiScene* aiscene = importer.ReadFile(
-        filePath.string(),
-        aiProcess_Triangulate |
-        aiProcess_GenNormals |
-        aiProcess_CalcTangentSpace |
-        aiProcess_FlipUVs);
-    if (!aiscene) {
-        hpprintf("Failed to load %s.\n", filePath.string().c_str());
-        return;
-    }
-    hpprintf("done.\n");
+// JP: Assimpのマテリアルから抽出した情報。パスはソースファイルのディレクトリからの相対パス。
+// EN: Information extracted from an Assimp material. Paths are relative to the directory of the source file.
+struct AssimpMaterialInfo {
+    std::string name;
+    std::string reflectancePath;
+    std::string diffuseColorPath;
+    std::string specularColorPath;
+    std::string normalPath;
+    std::string emittancePath;
+    RGB immReflectance;
+    RGB immDiffuseColor;
+    RGB immSpecularColor;
+    RGB immEmittance;
+    float immSmoothness;
+
+    AssimpMaterialInfo() : immSmoothness(0.0f) {}
+};
 
-    std::filesystem::path dirPath = filePath;
-    dirPath.remove_filename();
+static void extractAssimpMaterialInfo(const aiMaterial* aiMat, AssimpMaterialInfo* info) {
+    aiString strValue;
+    float color[3];
 
-    uint32_t baseMatIndex = static_cast<uint32_t>(scene->materials.size());
-    for (uint32_t matIdx = 0; matIdx < aiscene->mNumMaterials; ++matIdx) {
-        std::filesystem::path emittancePath;
-        RGB immEmittance(0.0f);
-
-        const aiMaterial* aiMat = aiscene->mMaterials[matIdx];
-        aiString strValue;
-        float color[3];
-
-        std::string matName;
-        if (aiMat->Get(AI_MATKEY_NAME, strValue) == aiReturn_SUCCESS)
-            matName = strValue.C_Str();
-        hpprintf("%s:\n", matName.c_str());
-
-        std::filesystem::path reflectancePath;
-        RGB immReflectance;
-        std::filesystem::path diffuseColorPath;
-        RGB immDiffuseColor;
-        std::filesystem::path specularColorPath;
-        RGB immSpecularColor;
-        float immSmoothness;
-        if constexpr (useLambertMaterial) {
-            if (aiMat->Get(AI_MATKEY_TEXTURE_DIFFUSE(0), strValue) == aiReturn_SUCCESS) {
-                reflectancePath = dirPath / strValue.C_Str();
-            }
-            else {
-                if (aiMat->Get(AI_MATKEY_COLOR_DIFFUSE, color, nullptr) != aiReturn_SUCCESS) {
-                    color[0] = 1.0f;
-                    color[1] = 0.0f;
-                    color[2] = 1.0f;
-                }
-                immReflectance = RGB(color[0], color[1], color[2]);
-            }
-            (void)diffuseColorPath;
-            (void)immDiffuseColor;
-            (void)specularColorPath;
-            (void)immSpecularColor;
-            (void)immSmoothness;
+    if (aiMat->Get(AI_MATKEY_NAME, strValue) == aiReturn_SUCCESS)
+        info->name = strValue.C_Str();
+
+    if constexpr (useLambertMaterial) {
+        if (aiMat->Get(AI_MATKEY_TEXTURE_DIFFUSE(0), strValue) == aiReturn_SUCCESS) {
+            info->reflectancePath = strValue.C_Str();
         }
         else {
-            if (aiMat->Get(AI_MATKEY_TEXTURE_DIFFUSE(0), strValue) == aiReturn_SUCCESS) {
-                diffuseColorPath = dirPath / strValue.C_Str();
+            if (aiMat->Get(AI_MATKEY_COLOR_DIFFUSE, color, nullptr) != aiReturn_SUCCESS) {
+                color[0] = 1.0f;
+                color[1] = 0.0f;
+                color[2] = 1.0f;
             }
-            else {
-                if (aiMat->Get(AI_MATKEY_COLOR_DIFFUSE, color, nullptr) != aiReturn_SUCCESS) {
-                    color[0] = 0.0f;
-                    color[1] = 0.0f;
-                    color[2] = 0.0f;
-                }
-                immDiffuseColor = RGB(color[0], color[1], color[2]);
+            info->immReflectance = RGB(color[0], color[1], color[2]);
+        }
+    }
+    else {
+        if (aiMat->Get(AI_MATKEY_TEXTURE_DIFFUSE(0), strValue) == aiReturn_SUCCESS) {
+            info->diffuseColorPath = strValue.C_Str();
+        }
+        else {
+            if (aiMat->Get(AI_MATKEY_COLOR_DIFFUSE, color, nullptr) != aiReturn_SUCCESS) {
+                color[0] = 0.0f;
+                color[1] = 0.0f;
+                color[2] = 0.0f;
             }
+            info->immDiffuseColor = RGB(color[0], color[1], color[2]);
+        }
 
-            if (aiMat->Get(AI_MATKEY_TEXTURE_SPECULAR(0), strValue) == aiReturn_SUCCESS) {
-                specularColorPath = dirPath / strValue.C_Str();
-            }
-            else {
-                if (aiMat->Get(AI_MATKEY_COLOR_SPECULAR, color, nullptr) != aiReturn_SUCCESS) {
-                    color[0] = 0.0f;
-                    color[1] = 0.0f;
-                    color[2] = 0.0f;
-                }
-                immSpecularColor = RGB(color[0], color[1], color[2]);
+        if (aiMat->Get(AI_MATKEY_TEXTURE_SPECULAR(0), strValue) == aiReturn_SUCCESS) {
+            info->specularColorPath = strValue.C_Str();
+        }
+        else {
+            if (aiMat->Get(AI_MATKEY_COLOR_SPECULAR, color, nullptr) != aiReturn_SUCCESS) {
+                color[0] = 0.0f;
+                color[1] = 0.0f;
+                color[2] = 0.0f;
             }
+            info->immSpecularColor = RGB(color[0], color[1], color[2]);
+        }
 
-            // JP: 極端に鋭いスペキュラーにするとNEEで寄与が一切サンプルできなくなってしまう。
-            // EN: Exteremely sharp specular makes it impossible to sample a contribution with NEE.
-            if (aiMat->Get(AI_MATKEY_SHININESS, &immSmoothness, nullptr) != aiReturn_SUCCESS)
-                immSmoothness = 0.0f;
-            immSmoothness = std::sqrt(immSmoothness);
-            immSmoothness = immSmoothness / 11.0f/*30.0f*/;
+        // JP: 極端に鋭いスペキュラーにするとNEEで寄与が一切サンプルできなくなってしまう。
+        // EN: Exteremely sharp specular makes it impossible to sample a contribution with NEE.
+        float immSmoothness;
+        if (aiMat->Get(AI_MATKEY_SHININESS, &immSmoothness, nullptr) != aiReturn_SUCCESS)
+            immSmoothness = 0.0f;
+        immSmoothness = std::sqrt(immSmoothness);
+        immSmoothness = immSmoothness / 11.0f/*30.0f*/;
+        info->immSmoothness = immSmoothness;
+    }
 
-            (void)reflectancePath;
-            (void)immReflectance;
-        }
+    if (aiMat->Get(AI_MATKEY_TEXTURE_HEIGHT(0), strValue) == aiReturn_SUCCESS)
+        info->normalPath = strValue.C_Str();
+    else if (aiMat->Get(AI_MATKEY_TEXTURE_NORMALS(0), strValue) == aiReturn_SUCCESS)
+        info->normalPath = strValue.C_Str();
 
-        std::filesystem::path normalPath;
-        if (aiMat->Get(AI_MATKEY_TEXTURE_HEIGHT(0), strValue) == aiReturn_SUCCESS)
-            normalPath = dirPath / strValue.C_Str();
-        else if (aiMat->Get(AI_MATKEY_TEXTURE_NORMALS(0), strValue) == aiReturn_SUCCESS)
-            normalPath = dirPath / strValue.C_Str();
+    if (info->name == "Pavement_Cobblestone_Big_BLENDSHADER") {
+        info->immSmoothness = 0.2f;
+    }
+    else if (info->name == "Pavement_Cobblestone_Small_BLENDSHADER") {
+        info->immSmoothness = 0.2f;
+    }
+    else if (info->name == "Pavement_Brick_BLENDSHADER") {
+        info->immSmoothness = 0.2f;
+    }
+    else if (info->name == "Pavement_Cobblestone_Wet_BLENDSHADER") {
+        info->immSmoothness = 0.2f;
+    }
 
-        if (matName == "Pavement_Cobblestone_Big_BLENDSHADER") {
-            immSmoothness = 0.2f;
-        }
-        else if (matName == "Pavement_Cobblestone_Small_BLENDSHADER") {
-            immSmoothness = 0.2f;
-        }
-        else if (matName == "Pavement_Brick_BLENDSHADER") {
-            immSmoothness = 0.2f;
-        }
-        else if (matName == "Pavement_Cobblestone_Wet_BLENDSHADER") {
-            immSmoothness = 0.2f;
-        }
+    if (aiMat->Get(AI_MATKEY_TEXTURE_EMISSIVE(0), strValue) == aiReturn_SUCCESS)
+        info->emittancePath = strValue.C_Str();
+    else if (aiMat->Get(AI_MATKEY_COLOR_EMISSIVE, color, nullptr) == aiReturn_SUCCESS)
+        info->immEmittance = RGB(color[0], color[1], color[2]);
+}
 
-        if (aiMat->Get(AI_MATKEY_TEXTURE_EMISSIVE(0), strValue) == aiReturn_SUCCESS)
-            emittancePath = dirPath / strValue.C_Str();
-        else if (aiMat->Get(AI_MATKEY_COLOR_EMISSIVE, color, nullptr) == aiReturn_SUCCESS)
-            immEmittance = RGB(color[0], color[1], color[2]);
+static void createMaterialFromInfo(
+    CUcontext cuContext, Scene* scene,
+    MaterialConvention matConv, const std::filesystem::path &dirPath,
+    const AssimpMaterialInfo &info) {
+    const auto toPath = [&dirPath](const std::string &relPath) {
+        return relPath.empty() ? std::filesystem::path() : dirPath / relPath;
+    };
 
-        if (matConv == MaterialConvention::Traditional) {
-            if constexpr (useLambertMaterial) {
-                createLambertMaterial(
-                    cuContext, scene,
-                    reflectancePath, immReflectance,
-                    normalPath,
-                    emittancePath, immEmittance);
-            }
-            else {
-                createDiffuseAndSpecularMaterial(
-                    cuContext, scene,
-                    diffuseColorPath, immDiffuseColor,
-                    specularColorPath, immSpecularColor,
-                    immSmoothness,
-                    normalPath,
-                    emittancePath, immEmittance);
-            }
+    hpprintf("%s:\n", info.name.c_str());
+    if (matConv == MaterialConvention::Traditional) {
+        if constexpr (useLambertMaterial) {
+            createLambertMaterial(
+                cuContext, scene,
+                toPath(info.reflectancePath), info.immReflectance,
+                toPath(info.normalPath),
+                toPath(info.emittancePath), info.immEmittance);
         }
         else {
-            // JP: diffuseテクスチャーとしてベースカラー + 不透明度
-            //     specularテクスチャーとしてオクルージョン、ラフネス、メタリック
-            //     が格納されていると仮定している。
-            // EN: We assume diffuse texture as base color + opacity,
-            //     specular texture as occlusion, roughness, metallic.
-            createSimplePBRMaterial(
+            createDiffuseAndSpecularMaterial(
                 cuContext, scene,
-                diffuseColorPath, float4(immDiffuseColor.toNative(), 1.0f),
-                specularColorPath, immSpecularColor.toNative(),
-                normalPath,
-                emittancePath, immEmittance);
+                toPath(info.diffuseColorPath), info.immDiffuseColor,
+                toPath(info.specularColorPath), info.immSpecularColor,
+                info.immSmoothness,
+                toPath(info.normalPath),
+                toPath(info.emittancePath), info.immEmittance);
         }
     }
+    else {
+        // JP: diffuseテクスチャーとしてベースカラー + 不透明度
+        //     specularテクスチャーとしてオクルージョン、ラフネス、メタリック
+        //     が格納されていると仮定している。
+        // EN: We assume diffuse texture as base color + opacity,
+        //     specular texture as occlusion, roughness, metallic.
+        createSimplePBRMaterial(
+            cuContext, scene,
+            toPath(info.diffuseColorPath), float4(info.immDiffuseColor.toNative(), 1.0f),
+            toPath(info.specularColorPath), info.immSpecularColor.toNative(),
+            toPath(info.normalPath),
+            toPath(info.emittancePath), info.immEmittance);
+    }
+}
 
-    uint32_t baseGeomInstIndex = static_cast<uint32_t>(scene->geomInsts.size());
+struct ConvertedMesh {
+    std::vector<shared::Vertex> vertices;
+    std::vector<shared::Triangle> triangles;
+    AABB aabb;
+};
+
+// JP: アップロード対象のメッシュデータへの参照。変換結果かマップされたキャッシュを指す。
+// EN: Reference to mesh data to upload. Points to either the converted result or the mapped cache.
+struct MeshDataView {
+    const shared::Vertex* vertices;
+    const shared::Triangle* triangles;
+    uint32_t numVertices;
+    uint32_t numTriangles;
+    uint32_t materialIndex;
+    AABB aabb;
+};
+
+static void convertAssimpMeshes(const aiScene* aiscene, std::vector<ConvertedMesh> &convertedMeshes) {
+    // JP: メッシュの変換(法線の正規化、接線のフォールバック、AABBの計算)は
+    //     メッシュと頂点/三角形の範囲ごとのタスクに分割して並列に行う。
+    // EN: Convert meshes (normal normalization, tangent fallback, AABB computation) in parallel
+    //     by splitting them into tasks per mesh and vertex/triangle range.
+    struct ConversionTask {
+        uint32_t meshIdx;
+        uint32_t begin;
+        uint32_t end;
+        bool isTriangleTask;
+    };
+    constexpr uint32_t conversionTaskSize = 16384;
+
+    convertedMeshes.resize(aiscene->mNumMeshes);
+    std::vector<ConversionTask> conversionTasks;
     for (uint32_t meshIdx = 0; meshIdx < aiscene->mNumMeshes; ++meshIdx) {
         const aiMesh* aiMesh = aiscene->mMeshes[meshIdx];
+        ConvertedMesh &convertedMesh = convertedMeshes[meshIdx];
+        convertedMesh.vertices.resize(aiMesh->mNumVertices);
+        convertedMesh.triangles.resize(aiMesh->mNumFaces);
+        for (uint32_t begin = 0; begin < aiMesh->mNumVertices; begin += conversionTaskSize)
+            conversionTasks.push_back(ConversionTask{
+                meshIdx, begin, std::min(begin + conversionTaskSize, aiMesh->mNumVertices), false });
+        for (uint32_t begin = 0; begin < aiMesh->mNumFaces; begin += conversionTaskSize)
+            conversionTasks.push_back(ConversionTask{
+                meshIdx, begin, std::min(begin + conversionTaskSize, aiMesh->mNumFaces), true });
+    }
 
-        std::vector<shared::Vertex> vertices(aiMesh->mNumVertices);
-        for (int vIdx = 0; vIdx < vertices.size(); ++vIdx) {
+    const auto convertVertices = []
+    (const aiMesh* aiMesh, uint32_t begin, uint32_t end, shared::Vertex* vertices) {
+        for (uint32_t vIdx = begin; vIdx < end; ++vIdx) {
             const aiVector3D &aip = aiMesh->mVertices[vIdx];
             const aiVector3D &ain = aiMesh->mNormals[vIdx];
             aiVector3D aitc0dir;
@@ -2155,9 +3269,13 @@ void createTriangleMeshes(
             v.texCoord = Point2D(ait.x, ait.y);
             vertices[vIdx] = v;
         }
+    };
 
-        std::vector<shared::Triangle> triangles(aiMesh->mNumFaces);
-        for (int fIdx = 0; fIdx < triangles.size(); ++fIdx) {
+    // JP: AABBは変換後の頂点を待たずにAssimpの頂点位置から直接求める。
+    // EN: Compute the AABB directly from Assimp's vertex positions without waiting for the converted vertices.
+    const auto convertTriangles = []
+    (const aiMesh* aiMesh, uint32_t begin, uint32_t end, shared::Triangle* triangles, AABB* aabb) {
+        for (uint32_t fIdx = begin; fIdx < end; ++fIdx) {
             const aiFace &aif = aiMesh->mFaces[fIdx];
             Assert(aif.mNumIndices == 3, "Number of face vertices must be 3 here.");
             shared::Triangle tri;
@@ -2165,16 +3283,501 @@ void createTriangleMeshes(
             tri.index1 = aif.mIndices[1];
             tri.index2 = aif.mIndices[2];
             triangles[fIdx] = tri;
+
+            for (uint32_t i = 0; i < 3; ++i) {
+                const aiVector3D &aip = aiMesh->mVertices[aif.mIndices[i]];
+                aabb->unify(Point3D(aip.x, aip.y, aip.z));
+            }
         }
+    };
 
-        scene->geomInsts.push_back(createGeometryInstance(
-            cuContext, scene, vertices, triangles,
-            scene->materials[baseMatIndex + aiMesh->mMaterialIndex], optixMat,
-            allocateGfxResource));
+    std::vector<AABB> taskAABBs(conversionTasks.size());
+    parallelForChunks(
+        0, static_cast<uint32_t>(conversionTasks.size()), 1,
+        [&](uint32_t chunkIdx, uint32_t chunkBegin, uint32_t chunkEnd) {
+        for (uint32_t taskIdx = chunkBegin; taskIdx < chunkEnd; ++taskIdx) {
+            const ConversionTask &task = conversionTasks[taskIdx];
+            const aiMesh* aiMesh = aiscene->mMeshes[task.meshIdx];
+            ConvertedMesh &convertedMesh = convertedMeshes[task.meshIdx];
+            if (task.isTriangleTask)
+                convertTriangles(
+                    aiMesh, task.begin, task.end, convertedMesh.triangles.data(), &taskAABBs[taskIdx]);
+            else
+                convertVertices(aiMesh, task.begin, task.end, convertedMesh.vertices.data());
+        }
+    });
+    for (uint32_t taskIdx = 0; taskIdx < conversionTasks.size(); ++taskIdx) {
+        const ConversionTask &task = conversionTasks[taskIdx];
+        if (task.isTriangleTask)
+            convertedMeshes[task.meshIdx].aabb.unify(taskAABBs[taskIdx]);
+    }
+
+}
+
+
+
+// JP: シーンキャッシュのファイル形式。各レコードと配列は16バイト境界に配置される。
+//     Header | (MaterialRecord, strings) * numMaterials
+//            | (MeshRecord, vertices, triangles) * numMeshes
+//            | (NodeRecord, mesh indices) * numNodes
+// EN: File format of the scene cache. Each record and array is placed at 16-byte boundary.
+static constexpr char sceneCacheMagic[8] = { 'G', 'F', 'X', 'S', 'C', 'N', 'C', 'H' };
+static constexpr uint32_t sceneCacheVersion = 2;
+static constexpr size_t sceneCacheAlignment = 16;
+
+// JP: キャッシュに記録する元ファイルの情報。
+// EN: Information of the source file recorded in a cache.
+struct CacheSourceStamp {
+    uint64_t size;
+    int64_t modificationTime;
+    uint64_t hash;
+};
+
+struct SceneCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    CacheSourceStamp source;
+    uint64_t keyHash;
+    uint64_t fileSize;
+    uint32_t numMaterials;
+    uint32_t numMeshes;
+    uint32_t numNodes;
+    uint32_t dummy;
+};
+
+struct SceneCacheMaterialRecord {
+    float immReflectance[3];
+    float immDiffuseColor[3];
+    float immSpecularColor[3];
+    float immEmittance[3];
+    float immSmoothness;
+    uint32_t stringLengths[6];
+};
+
+struct SceneCacheMeshRecord {
+    uint32_t numVertices;
+    uint32_t numTriangles;
+    uint32_t materialIndex;
+    uint32_t dummy;
+    AABB aabb;
+};
+
+struct SceneCacheNodeRecord {
+    Matrix4x4 transform;
+    uint32_t numMeshIndices;
+    uint32_t dummy[3];
+};
+
+static_assert(std::is_trivially_copyable_v<shared::Vertex> &&
+              std::is_trivially_copyable_v<shared::Triangle> &&
+              std::is_trivially_copyable_v<AABB> &&
+              std::is_trivially_copyable_v<Matrix4x4>,
+              "Types stored in the scene cache must be trivially copyable.");
+
+static uint64_t hashBytes(const uint8_t* data, size_t size, uint64_t seed) {
+    constexpr uint64_t prime = 0x9E3779B97F4A7C15ull;
+    const auto mix = [](uint64_t h, uint64_t w) {
+        w *= 0xBF58476D1CE4E5B9ull;
+        w ^= w >> 31;
+        h = (h ^ w) * prime;
+        return h ^ (h >> 29);
+    };
+
+    uint64_t h = seed ^ (size * prime);
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t w;
+        std::memcpy(&w, data + i, sizeof(w));
+        h = mix(h, w);
+    }
+    if (i < size) {
+        uint64_t w = 0;
+        std::memcpy(&w, data + i, size - i);
+        h = mix(h, w);
+    }
+    return h;
+}
+
+// JP: 固定サイズのブロックごとのハッシュを並列に計算してから結合する。
+//     ブロックサイズが固定なので結果はスレッド数に依存しない。
+// EN: Compute hashes of fixed-size blocks in parallel then combine them.
+//     The result doesn't depend on the number of threads since the block size is fixed.
+static bool computeFileHash(const std::filesystem::path &filePath, uint64_t* hash) {
+    MappedFile file;
+    if (!file.open(filePath))
+        return false;
+
+    constexpr size_t blockSize = 16 * 1024 * 1024;
+    const uint8_t* data = file.getData();
+    const size_t size = file.getSize();
+    const uint32_t numBlocks = static_cast<uint32_t>((size + blockSize - 1) / blockSize);
+    std::vector<uint64_t> blockHashes(numBlocks);
+    parallelForChunks(
+        0, numBlocks, 1,
+        [&](uint32_t chunkIdx, uint32_t chunkBegin, uint32_t chunkEnd) {
+        for (uint32_t blockIdx = chunkBegin; blockIdx < chunkEnd; ++blockIdx) {
+            const size_t offset = blockIdx * blockSize;
+            blockHashes[blockIdx] = hashBytes(data + offset, std::min(blockSize, size - offset), blockIdx);
+        }
+    });
+    *hash = hashBytes(
+        reinterpret_cast<const uint8_t*>(blockHashes.data()), sizeof(uint64_t) * numBlocks, size);
+
+    return true;
+}
+
+// JP: キャッシュの元ファイルとキャッシュに記録された情報を照合する。
+//     サイズが異なれば不一致、サイズと更新時刻が一致すれば一致とみなし、
+//     サイズのみが一致する場合(コピーやチェックアウトで更新時刻だけが変わった場合など)にのみ
+//     ファイル全体のハッシュを計算して比べる。ハッシュは一度だけ計算され、キャッシュの書き込みにも使われる。
+// EN: Check a cache's source file against the information recorded in the cache.
+//     A different size is a mismatch, and matching size and modification time are considered a match.
+//     Only when just the size matches (e.g. only the modification time changed by a copy or checkout),
+//     the hash of the whole file is computed and compared.
+//     The hash is computed only once and is also used for writing the cache.
+class CacheSource {
+    std::filesystem::path m_filePath;
+    CacheSourceStamp m_stamp;
+    bool m_isValid;
+    bool m_hashIsComputed;
+
+    bool computeHash() {
+        if (!m_hashIsComputed)
+            m_hashIsComputed = computeFileHash(m_filePath, &m_stamp.hash);
+        return m_hashIsComputed;
+    }
+
+public:
+    CacheSource(const std::filesystem::path &filePath) :
+        m_filePath(filePath), m_stamp{}, m_isValid(false), m_hashIsComputed(false) {
+        std::error_code ec;
+        m_stamp.size = std::filesystem::file_size(m_filePath, ec);
+        if (ec)
+            return;
+        const std::filesystem::file_time_type mtime = std::filesystem::last_write_time(m_filePath, ec);
+        if (ec)
+            return;
+        m_stamp.modificationTime = static_cast<int64_t>(mtime.time_since_epoch().count());
+        m_isValid = true;
+    }
+
+    bool isValid() const {
+        return m_isValid;
+    }
+
+    bool matches(const CacheSourceStamp &cachedStamp) {
+        if (!m_isValid || cachedStamp.size != m_stamp.size)
+            return false;
+        if (cachedStamp.modificationTime == m_stamp.modificationTime)
+            return true;
+        return computeHash() && cachedStamp.hash == m_stamp.hash;
+    }
+
+    // JP: キャッシュの書き込み用の情報を返す。必要ならハッシュを計算する。
+    // EN: Returns the information for writing a cache. Computes the hash if needed.
+    bool getStamp(CacheSourceStamp* stamp) {
+        if (!m_isValid || !computeHash())
+            return false;
+        *stamp = m_stamp;
+        return true;
+    }
+};
+
+static uint64_t computeSceneCacheKey(MaterialConvention matConv, const Matrix4x4 &preTransform) {
+    struct {
+        uint32_t version;
+        uint32_t matConv;
+        uint32_t useLambertMaterial;
+        uint32_t vertexSize;
+        uint32_t triangleSize;
+        float preTransform[16];
+    } key;
+    std::memset(&key, 0, sizeof(key));
+    key.version = sceneCacheVersion;
+    key.matConv = static_cast<uint32_t>(matConv);
+    key.useLambertMaterial = useLambertMaterial;
+    key.vertexSize = sizeof(shared::Vertex);
+    key.triangleSize = sizeof(shared::Triangle);
+    std::memcpy(key.preTransform, &preTransform, sizeof(key.preTransform));
+    return hashBytes(reinterpret_cast<const uint8_t*>(&key), sizeof(key), 0);
+}
+
+static bool writeSceneCache(
+    const std::filesystem::path &cachePath, const CacheSourceStamp &sourceStamp, uint64_t keyHash,
+    const std::vector<AssimpMaterialInfo> &matInfos,
+    const std::vector<MeshDataView> &meshes,
+    const std::vector<FlattenedNode> &flattenedNodes) {
+    // JP: 書き込み途中のファイルが読まれないよう、一時ファイルに書いてから置き換える。
+    // EN: Write to a temporary file then replace so that a partially written file won't be read.
+    std::filesystem::path tmpPath = cachePath;
+    tmpPath += ".tmp";
+    std::ofstream ofs(tmpPath, std::ios::binary);
+    if (!ofs)
+        return false;
+
+    uint64_t fileSize = 0;
+    const auto write = [&ofs, &fileSize](const void* data, size_t size) {
+        ofs.write(reinterpret_cast<const char*>(data), size);
+        fileSize += size;
+    };
+    const auto align = [&write, &fileSize]() {
+        constexpr uint8_t zeros[sceneCacheAlignment] = {};
+        write(zeros, alignUp(fileSize, sceneCacheAlignment) - fileSize);
+    };
+
+    SceneCacheHeader header = {};
+    std::copy_n(sceneCacheMagic, sizeof(sceneCacheMagic), header.magic);
+    header.version = sceneCacheVersion;
+    header.headerSize = sizeof(SceneCacheHeader);
+    header.source = sourceStamp;
+    header.keyHash = keyHash;
+    header.numMaterials = static_cast<uint32_t>(matInfos.size());
+    header.numMeshes = static_cast<uint32_t>(meshes.size());
+    header.numNodes = static_cast<uint32_t>(flattenedNodes.size());
+    write(&header, sizeof(header));
+    align();
+
+    for (const AssimpMaterialInfo &info : matInfos) {
+        const std::string* strings[] = {
+            &info.name,
+            &info.reflectancePath, &info.diffuseColorPath, &info.specularColorPath,
+            &info.normalPath, &info.emittancePath
+        };
+        SceneCacheMaterialRecord record = {};
+        std::memcpy(record.immReflectance, &info.immReflectance, sizeof(record.immReflectance));
+        std::memcpy(record.immDiffuseColor, &info.immDiffuseColor, sizeof(record.immDiffuseColor));
+        std::memcpy(record.immSpecularColor, &info.immSpecularColor, sizeof(record.immSpecularColor));
+        std::memcpy(record.immEmittance, &info.immEmittance, sizeof(record.immEmittance));
+        record.immSmoothness = info.immSmoothness;
+        for (uint32_t i = 0; i < lengthof(strings); ++i)
+            record.stringLengths[i] = static_cast<uint32_t>(strings[i]->size());
+        write(&record, sizeof(record));
+        for (uint32_t i = 0; i < lengthof(strings); ++i)
+            write(strings[i]->data(), strings[i]->size());
+        align();
+    }
+
+    for (const MeshDataView &mesh : meshes) {
+        SceneCacheMeshRecord record = {};
+        record.numVertices = mesh.numVertices;
+        record.numTriangles = mesh.numTriangles;
+        record.materialIndex = mesh.materialIndex;
+        record.aabb = mesh.aabb;
+        write(&record, sizeof(record));
+        align();
+        write(mesh.vertices, sizeof(shared::Vertex) * mesh.numVertices);
+        align();
+        write(mesh.triangles, sizeof(shared::Triangle) * mesh.numTriangles);
+        align();
+    }
+
+    for (const FlattenedNode &node : flattenedNodes) {
+        SceneCacheNodeRecord record = {};
+        record.transform = node.transform;
+        record.numMeshIndices = static_cast<uint32_t>(node.meshIndices.size());
+        write(&record, sizeof(record));
+        write(node.meshIndices.data(), sizeof(uint32_t) * node.meshIndices.size());
+        align();
+    }
+
+    // JP: 最後にファイルサイズを書き込んで完全性の確認に使う。
+    // EN: Finally write the file size to use it for integrity check.
+    header.fileSize = fileSize;
+    ofs.seekp(0);
+    ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    ofs.close();
+    if (!ofs)
+        return false;
+
+    std::error_code ec;
+    std::filesystem::rename(tmpPath, cachePath, ec);
+    if (ec) {
+        std::filesystem::remove(tmpPath, ec);
+        return false;
+    }
+
+    return true;
+}
+
+// JP: キャッシュをマップして内容を参照する。メッシュデータはコピーせずマップされたメモリーを直接指す。
+// EN: Map the cache and refer to the contents. Mesh data directly points to the mapped memory without copy.
+static bool readSceneCache(
+    const std::filesystem::path &cachePath, CacheSource* source, uint64_t keyHash,
+    MappedFile* cacheFile,
+    std::vector<AssimpMaterialInfo>* matInfos,
+    std::vector<MeshDataView>* meshes,
+    std::vector<FlattenedNode>* flattenedNodes) {
+    if (!cacheFile->open(cachePath))
+        return false;
+
+    const uint8_t* const data = cacheFile->getData();
+    const size_t size = cacheFile->getSize();
+    size_t offset = 0;
+    const auto read = [&](size_t readSize) -> const uint8_t* {
+        if (readSize > size - offset)
+            return nullptr;
+        const uint8_t* ret = data + offset;
+        offset += readSize;
+        return ret;
+    };
+    const auto align = [&]() {
+        offset = std::min(alignUp(offset, sceneCacheAlignment), size);
+    };
+
+    const auto header = reinterpret_cast<const SceneCacheHeader*>(read(sizeof(SceneCacheHeader)));
+    if (!header ||
+        !std::equal(sceneCacheMagic, sceneCacheMagic + sizeof(sceneCacheMagic), header->magic) ||
+        header->version != sceneCacheVersion ||
+        header->headerSize != sizeof(SceneCacheHeader) ||
+        header->fileSize != size ||
+        header->keyHash != keyHash ||
+        !source->matches(header->source)) {
+        cacheFile->close();
+        return false;
+    }
+    align();
+
+    const auto fail = [&]() {
+        matInfos->clear();
+        meshes->clear();
+        flattenedNodes->clear();
+        cacheFile->close();
+        return false;
+    };
+
+    matInfos->resize(header->numMaterials);
+    for (AssimpMaterialInfo &info : *matInfos) {
+        const auto record = reinterpret_cast<const SceneCacheMaterialRecord*>(
+            read(sizeof(SceneCacheMaterialRecord)));
+        if (!record)
+            return fail();
+        std::string* strings[] = {
+            &info.name,
+            &info.reflectancePath, &info.diffuseColorPath, &info.specularColorPath,
+            &info.normalPath, &info.emittancePath
+        };
+        for (uint32_t i = 0; i < lengthof(strings); ++i) {
+            const auto str = reinterpret_cast<const char*>(read(record->stringLengths[i]));
+            if (!str)
+                return fail();
+            strings[i]->assign(str, record->stringLengths[i]);
+        }
+        std::memcpy(&info.immReflectance, record->immReflectance, sizeof(record->immReflectance));
+        std::memcpy(&info.immDiffuseColor, record->immDiffuseColor, sizeof(record->immDiffuseColor));
+        std::memcpy(&info.immSpecularColor, record->immSpecularColor, sizeof(record->immSpecularColor));
+        std::memcpy(&info.immEmittance, record->immEmittance, sizeof(record->immEmittance));
+        info.immSmoothness = record->immSmoothness;
+        align();
+    }
+
+    meshes->resize(header->numMeshes);
+    for (MeshDataView &mesh : *meshes) {
+        const auto record = reinterpret_cast<const SceneCacheMeshRecord*>(read(sizeof(SceneCacheMeshRecord)));
+        if (!record)
+            return fail();
+        align();
+        mesh.vertices = reinterpret_cast<const shared::Vertex*>(
+            read(sizeof(shared::Vertex) * record->numVertices));
+        align();
+        mesh.triangles = reinterpret_cast<const shared::Triangle*>(
+            read(sizeof(shared::Triangle) * record->numTriangles));
+        align();
+        if ((!mesh.vertices && record->numVertices > 0) ||
+            (!mesh.triangles && record->numTriangles > 0) ||
+            record->materialIndex >= header->numMaterials)
+            return fail();
+        mesh.numVertices = record->numVertices;
+        mesh.numTriangles = record->numTriangles;
+        mesh.materialIndex = record->materialIndex;
+        mesh.aabb = record->aabb;
+    }
+
+    flattenedNodes->resize(header->numNodes);
+    for (FlattenedNode &node : *flattenedNodes) {
+        const auto record = reinterpret_cast<const SceneCacheNodeRecord*>(read(sizeof(SceneCacheNodeRecord)));
+        if (!record)
+            return fail();
+        const auto meshIndices = reinterpret_cast<const uint32_t*>(
+            read(sizeof(uint32_t) * record->numMeshIndices));
+        if (!meshIndices && record->numMeshIndices > 0)
+            return fail();
+        node.transform = record->transform;
+        node.meshIndices.assign(meshIndices, meshIndices + record->numMeshIndices);
+        for (uint32_t meshIdx : node.meshIndices) {
+            if (meshIdx >= header->numMeshes)
+                return fail();
+        }
+        align();
     }
 
+    return true;
+}
+
+void createTriangleMeshes(
+    const std::string &meshName,
+    const std::filesystem::path &filePath,
+    MaterialConvention matConv,
+    const Matrix4x4 &preTransform,
+    CUcontext cuContext, Scene* scene, optixu::Material optixMat,
+    bool allocateGfxResource) {
+    std::filesystem::path dirPath = filePath;
+    dirPath.remove_filename();
+    std::filesystem::path cachePath = filePath;
+    cachePath += ".gfxcache";
+
+    CacheSource cacheSource(filePath);
+    const uint64_t keyHash = computeSceneCacheKey(matConv, preTransform);
+
+    std::vector<AssimpMaterialInfo> matInfos;
+    std::vector<ConvertedMesh> convertedMeshes;
+    std::vector<MeshDataView> meshes;
     std::vector<FlattenedNode> flattenedNodes;
-    computeFlattenedNodes(aiscene, preTransform, aiscene->mRootNode, flattenedNodes);
+    MappedFile cacheFile;
+    if (cacheSource.isValid() &&
+        readSceneCache(cachePath, &cacheSource, keyHash, &cacheFile, &matInfos, &meshes, &flattenedNodes)) {
+        hpprintf("Read cache: %s\n", cachePath.string().c_str());
+    }
+    else {
+        hpprintf("Reading: %s ... ", filePath.string().c_str());
+        fflush(stdout);
+        Assimp::Importer importer;
+        const aiScene* aiscene = importer.ReadFile(
+            filePath.string(),
+            aiProcess_Triangulate |
+            aiProcess_GenNormals |
+            aiProcess_CalcTangentSpace |
+            aiProcess_FlipUVs);
+        if (!aiscene) {
+            hpprintf("Failed to load %s.\n", filePath.string().c_str());
+            return;
+        }
+        hpprintf("done.\n");
+
+        matInfos.resize(aiscene->mNumMaterials);
+        for (uint32_t matIdx = 0; matIdx < aiscene->mNumMaterials; ++matIdx)
+            extractAssimpMaterialInfo(aiscene->mMaterials[matIdx], &matInfos[matIdx]);
+
+        convertAssimpMeshes(aiscene, convertedMeshes);
+        meshes.resize(aiscene->mNumMeshes);
+        for (uint32_t meshIdx = 0; meshIdx < aiscene->mNumMeshes; ++meshIdx) {
+            const ConvertedMesh &convertedMesh = convertedMeshes[meshIdx];
+            MeshDataView &mesh = meshes[meshIdx];
+            mesh.vertices = convertedMesh.vertices.data();
+            mesh.triangles = convertedMesh.triangles.data();
+            mesh.numVertices = static_cast<uint32_t>(convertedMesh.vertices.size());
+            mesh.numTriangles = static_cast<uint32_t>(convertedMesh.triangles.size());
+            mesh.materialIndex = aiscene->mMeshes[meshIdx]->mMaterialIndex;
+            mesh.aabb = convertedMesh.aabb;
+        }
+
+        computeFlattenedNodes(aiscene, preTransform, aiscene->mRootNode, flattenedNodes);
+
+        CacheSourceStamp sourceStamp;
+        if (cacheSource.getStamp(&sourceStamp) &&
+            !writeSceneCache(cachePath, sourceStamp, keyHash, matInfos, meshes, flattenedNodes))
+            hpprintf("Failed to write cache: %s\n", cachePath.string().c_str());
+    }
     //for (int i = 0; i < flattenedNodes.size(); ++i) {
     //    const Matrix4x4 &mat = flattenedNodes[i].transform;
     //    hpprintf("%8.5f, %8.5f, %8.5f, %8.5f\n", mat.m00, mat.m01, mat.m02, mat.m03);
@@ -2184,6 +3787,36 @@ void createTriangleMeshes(
     //    hpprintf("\n");
     //}
 
+    uint32_t baseMatIndex = static_cast<uint32_t>(scene->materials.size());
+    for (const AssimpMaterialInfo &info : matInfos)
+        createMaterialFromInfo(cuContext, scene, matConv, dirPath, info);
+
+    // JP: デバイスとGLへのアップロードはメッシュの順番通りに行う。
+    // EN: Upload to the device and GL in mesh order.
+    uint32_t baseGeomInstIndex = static_cast<uint32_t>(scene->geomInsts.size());
+    for (uint32_t meshIdx = 0; meshIdx < meshes.size(); ++meshIdx) {
+        const MeshDataView &mesh = meshes[meshIdx];
+        scene->geomInsts.push_back(createGeometryInstance(
+            cuContext, scene,
+            mesh.vertices, mesh.numVertices,
+            mesh.triangles, mesh.numTriangles,
+            scene->materials[baseMatIndex + mesh.materialIndex], optixMat,
+            allocateGfxResource, &mesh.aabb));
+
+        // JP: 多くのメッシュに使われるマテリアルのテクスチャーを優先して読み込む。
+        // EN: Prioritize loading textures of materials used by many meshes.
+        if (scene->textureLoader) {
+            const Material* mat = scene->materials[baseMatIndex + mesh.materialIndex];
+            for (uint32_t requestID : mat->textureRequestIDs)
+                scene->textureLoader->raisePriority(requestID, 1.0f);
+        }
+
+        // JP: アップロード済みのホスト側データは早めに解放する。
+        // EN: Release host-side data that has been uploaded early.
+        if (meshIdx < convertedMeshes.size())
+            convertedMeshes[meshIdx] = ConvertedMesh();
+    }
+
     auto mesh = new Mesh();
     shared::InstanceData* instDataOnHost = scene->instDataBuffer[0].getMappedPointer();
     std::map<std::set<const GeometryInstance*>, GeometryGroup*> geomGroupMap;
@@ -2200,7 +3833,7 @@ void createTriangleMeshes(
             geomGroup = geomGroupMap.at(srcGeomInsts);
         }
         else {
-            geomGroup = createGeometryGroup(scene, srcGeomInsts);
+            geomGroup = createGeometryGroup(cuContext, scene, srcGeomInsts);
             scene->geomGroups.push_back(geomGroup);
         }
 
@@ -2247,7 +3880,7 @@ void createRectangleLight(
     scene->geomInsts.push_back(geomInst);
 
     std::set<const GeometryInstance*> srcGeomInsts = { geomInst };
-    GeometryGroup* geomGroup = createGeometryGroup(scene, srcGeomInsts);
+    GeometryGroup* geomGroup = createGeometryGroup(cuContext, scene, srcGeomInsts);
     scene->geomGroups.push_back(geomGroup);
 
     auto mesh = new Mesh();
@@ -2350,7 +3983,7 @@ void createSphereLight(
     scene->geomInsts.push_back(geomInst);
 
     std::set<const GeometryInstance*> srcGeomInsts = { geomInst };
-    GeometryGroup* geomGroup = createGeometryGroup(scene, srcGeomInsts);
+    GeometryGroup* geomGroup = createGeometryGroup(cuContext, scene, srcGeomInsts);
     scene->geomGroups.push_back(geomGroup);
 
     auto mesh = new Mesh();
@@ -2366,333 +3999,4758 @@ Instance* createInstance(
     CUcontext cuContext, Scene* scene,
     const Mesh::GeometryGroupInstance &geomGroupInst,
     const Matrix4x4 &transform) {
-    shared::InstanceData* instDataOnHost = scene->instDataBuffer[0].getMappedPointer();
+    Instance* inst;
+    createInstances(cuContext, scene, geomGroupInst, &transform, 1, &inst);
+    return inst;
+}
 
-    Matrix4x4 finalTransform = transform * geomGroupInst.transform;
+void createInstances(
+    CUcontext cuContext, Scene* scene,
+    const Mesh::GeometryGroupInstance &geomGroupInst,
+    const Matrix4x4* transforms, uint32_t numInstances,
+    Instance** insts) {
+    if (numInstances == 0)
+        return;
 
-    Vector3D scale;
-    finalTransform.decompose(&scale, nullptr, nullptr);
-    float uniformScale = scale.x;
+    shared::InstanceData* instDataOnHost = scene->instDataBuffer[0].getMappedPointer();
 
     // JP: 各ジオメトリインスタンスの光源サンプリングに関わるインポータンスは
     //     プリミティブのインポータンスの合計値とする。
     // EN: Use the sum of importance values of primitives as each geometry instances's importance
     //     for sampling a light source
-    std::vector<uint32_t> geomInstSlots;
     bool hasEmitterGeomInsts = false;
     const GeometryGroup* geomGroup = geomGroupInst.geomGroup;
+    const uint32_t numGeomInsts = static_cast<uint32_t>(geomGroup->geomInsts.size());
     for (auto it = geomGroup->geomInsts.cbegin(); it != geomGroup->geomInsts.cend(); ++it) {
         const GeometryInstance* geomInst = *it;
-        geomInstSlots.push_back(geomInst->geomInstSlot);
         if (geomInst->mat->texEmittance.cudaArray)
             hasEmitterGeomInsts = true;
     }
 
-    if (hasEmitterGeomInsts &&
-        (std::fabs(scale.y - uniformScale) / uniformScale >= 0.001f ||
-         std::fabs(scale.z - uniformScale) / uniformScale >= 0.001f ||
-         uniformScale <= 0.0f)) {
-        hpprintf("Non-uniform scaling (%g, %g, %g) is not recommended for a light source instance.\n",
-                 scale.x, scale.y, scale.z);
-    }
+    // JP: スロットのバッファーはジオメトリーグループが所有し、全インスタンスで共有する。
+    // EN: The geometry group owns the slot buffer, and all the instances share it.
+    const shared::ROBuffer<uint32_t> sharedGeomInstSlots =
+        geomGroup->geomInstSlots.getROBuffer<shared::enableBufferOobCheck>();
+    for (uint32_t instIdx = 0; instIdx < numInstances; ++instIdx) {
+        Matrix4x4 finalTransform = transforms[instIdx] * geomGroupInst.transform;
+
+        Vector3D scale;
+        finalTransform.decompose(&scale, nullptr, nullptr);
+        float uniformScale = scale.x;
+
+        if (hasEmitterGeomInsts &&
+            (std::fabs(scale.y - uniformScale) / uniformScale >= 0.001f ||
+             std::fabs(scale.z - uniformScale) / uniformScale >= 0.001f ||
+             uniformScale <= 0.0f)) {
+            hpprintf("Non-uniform scaling (%g, %g, %g) is not recommended for a light source instance.\n",
+                     scale.x, scale.y, scale.z);
+        }
+
+        const uint32_t instSlot = scene->instSlotFinder.claimFirstAvailableSlot();
+        if (instSlot == SlotFinder::InvalidSlotIndex)
+            throw std::runtime_error("Too many instances.");
 
-    Instance* inst = new Instance();
-    inst->geomGroupInst = geomGroupInst;
-    inst->geomInstSlots.initialize(cuContext, Scene::bufferType, geomInstSlots);
-    if (hasEmitterGeomInsts) {
+        Instance* inst = new Instance();
+        inst->geomGroupInst = geomGroupInst;
+        if (hasEmitterGeomInsts) {
 #if USE_PROBABILITY_TEXTURE
-        inst->lightGeomInstDist.initialize(
-            cuContext, static_cast<uint32_t>(geomInstSlots.size()));
+            inst->lightGeomInstDist.initialize(
+                cuContext, numGeomInsts);
 #else
-        inst->lightGeomInstDist.initialize(
-            cuContext, Scene::bufferType, nullptr, static_cast<uint32_t>(geomInstSlots.size()));
+            inst->lightGeomInstDist.initialize(
+                cuContext, Scene::bufferType, nullptr, numGeomInsts);
 #endif
-    }
-    inst->instSlot = scene->instSlotFinder.getFirstAvailableSlot();
-    scene->instSlotFinder.setInUse(inst->instSlot);
-
-    shared::InstanceData instData = {};
-    instData.transform = finalTransform;
-    instData.curToPrevTransform = Matrix4x4();
-    instData.normalMatrix = transpose(invert(finalTransform.getUpperLeftMatrix()));
-    instData.uniformScale = uniformScale;
-    instData.geomInstSlots = inst->geomInstSlots.getROBuffer<shared::enableBufferOobCheck>();
-    inst->lightGeomInstDist.getDeviceType(&instData.lightGeomInstDist);
-    instDataOnHost[inst->instSlot] = instData;
-
-    inst->optixInst = scene->optixScene.createInstance();
-    inst->optixInst.setID(inst->instSlot);
-    inst->optixInst.setChild(geomGroup->optixGas);
-    float xfm[12] = {
-        finalTransform.m00, finalTransform.m01, finalTransform.m02, finalTransform.m03,
-        finalTransform.m10, finalTransform.m11, finalTransform.m12, finalTransform.m13,
-        finalTransform.m20, finalTransform.m21, finalTransform.m22, finalTransform.m23,
-    };
-    inst->optixInst.setTransform(xfm);
+        }
+        inst->instSlot = instSlot;
+        inst->needsLightDistUpdate = true;
+        inst->needsLightInstDistUpdate = true;
+
+        shared::InstanceData instData = {};
+        instData.transform = finalTransform;
+        instData.curToPrevTransform = Matrix4x4();
+        instData.normalMatrix = transpose(invert(finalTransform.getUpperLeftMatrix()));
+        instData.uniformScale = uniformScale;
+        instData.geomInstSlots = sharedGeomInstSlots;
+        inst->lightGeomInstDist.getDeviceType(&instData.lightGeomInstDist);
+        instDataOnHost[inst->instSlot] = instData;
+
+        inst->optixInst = scene->optixScene.createInstance();
+        inst->optixInst.setID(inst->instSlot);
+        inst->optixInst.setChild(geomGroup->optixGas);
+        float xfm[12] = {
+            finalTransform.m00, finalTransform.m01, finalTransform.m02, finalTransform.m03,
+            finalTransform.m10, finalTransform.m11, finalTransform.m12, finalTransform.m13,
+            finalTransform.m20, finalTransform.m21, finalTransform.m22, finalTransform.m23,
+        };
+        inst->optixInst.setTransform(xfm);
 
-    inst->prevMatM2W = finalTransform;
-    inst->matM2W = finalTransform;
-    inst->nMatM2W = transpose(invert(finalTransform.getUpperLeftMatrix()));
+        inst->prevMatM2W = finalTransform;
+        inst->matM2W = finalTransform;
+        inst->nMatM2W = transpose(invert(finalTransform.getUpperLeftMatrix()));
 
-    return inst;
+        insts[instIdx] = inst;
+    }
 }
 
-void loadEnvironmentalTexture(
-    const std::filesystem::path &filePath,
-    CUcontext cuContext,
-    cudau::Array* envLightArray, CUtexObject* envLightTexture,
-    RegularConstantContinuousDistribution2D* envLightImportanceMap) {
-    cudau::TextureSampler sampler_float;
-    sampler_float.setXyFilterMode(cudau::TextureFilterMode::Linear);
-    sampler_float.setWrapMode(0, cudau::TextureWrapMode::Clamp);
-    sampler_float.setWrapMode(1, cudau::TextureWrapMode::Clamp);
-    sampler_float.setMipMapFilterMode(cudau::TextureFilterMode::Point);
-    sampler_float.setReadMode(cudau::TextureReadMode::ElementType);
 
+
+// JP: シーン記述のテキストを1パスで読むための行単位のトークナイザー。
+// EN: Line-oriented tokenizer to read a scene description text in a single pass.
+class SceneTextReader {
+    const char* m_cur;
+    const char* m_end;
+    uint32_t m_lineIndex;
+
+public:
+    SceneTextReader(const char* text, size_t textSize) :
+        m_cur(text), m_end(text + textSize), m_lineIndex(1) {}
+
+    uint32_t getLineIndex() const {
+        return m_lineIndex;
+    }
+
+    // JP: 現在の行の次のトークンを読む。行末に達した場合はfalseを返す。
+    // EN: Read the next token in the current line. Returns false when reaching the end of the line.
+    bool nextToken(std::string_view* token) {
+        while (m_cur < m_end && (*m_cur == ' ' || *m_cur == '\t' || *m_cur == '\r'))
+            ++m_cur;
+        if (m_cur < m_end && *m_cur == '#') {
+            while (m_cur < m_end && *m_cur != '\n')
+                ++m_cur;
+        }
+        if (m_cur >= m_end || *m_cur == '\n')
+            return false;
+
+        const char* begin = m_cur;
+        if (*m_cur == '"') {
+            ++begin;
+            ++m_cur;
+            while (m_cur < m_end && *m_cur != '"' && *m_cur != '\n')
+                ++m_cur;
+            *token = std::string_view(begin, m_cur - begin);
+            if (m_cur < m_end && *m_cur == '"')
+                ++m_cur;
+            return true;
+        }
+        while (m_cur < m_end &&
+               *m_cur != ' ' && *m_cur != '\t' && *m_cur != '\r' && *m_cur != '\n' && *m_cur != '#')
+            ++m_cur;
+        *token = std::string_view(begin, m_cur - begin);
+        return true;
+    }
+
+    bool readFloat(float* value) {
+        std::string_view token;
+        if (!nextToken(&token))
+            return false;
+        auto [ptr, ec] = std::from_chars(token.data(), token.data() + token.size(), *value);
+        return ec == std::errc() && ptr == token.data() + token.size() && std::isfinite(*value);
+    }
+
+    bool readUInt(uint32_t* value) {
+        std::string_view token;
+        if (!nextToken(&token))
+            return false;
+        auto [ptr, ec] = std::from_chars(token.data(), token.data() + token.size(), *value);
+        return ec == std::errc() && ptr == token.data() + token.size();
+    }
+
+    bool readPoint(Point3D* value) {
+        return readFloat(&value->x) && readFloat(&value->y) && readFloat(&value->z);
+    }
+
+    // JP: 度単位のroll, pitch, yawを読む。
+    // EN: Read roll, pitch and yaw in degrees.
+    bool readOrientation(Quaternion* value) {
+        float roll, pitch, yaw;
+        if (!readFloat(&roll) || !readFloat(&pitch) || !readFloat(&yaw))
+            return false;
+        *value = qFromEulerAngles(
+            roll * pi_v<float> / 180, pitch * pi_v<float> / 180, yaw * pi_v<float> / 180);
+        return true;
+    }
+
+    // JP: 次の行の先頭に移動する。ファイル終端に達した場合はfalseを返す。
+    // EN: Move to the beginning of the next line. Returns false when reaching the end of the file.
+    bool nextLine() {
+        while (m_cur < m_end && *m_cur != '\n')
+            ++m_cur;
+        if (m_cur >= m_end)
+            return false;
+        ++m_cur;
+        ++m_lineIndex;
+        return true;
+    }
+};
+
+bool loadSceneDescription(const std::filesystem::path &filePath, SceneDescription* desc) {
+    MappedFile file;
+    if (!file.open(filePath)) {
+        hpprintf("Failed to open the scene description: %s\n", filePath.string().c_str());
+        return false;
+    }
+    return parseSceneDescription(
+        reinterpret_cast<const char*>(file.getData()), file.getSize(),
+        filePath.parent_path(), desc);
+}
+
+bool parseSceneDescription(
+    const char* text, size_t textSize, const std::filesystem::path &baseDir,
+    SceneDescription* desc) {
+    SceneTextReader reader(text, textSize);
+    const auto reportError = [&reader](const char* message) {
+        hpprintf("Scene description (line %u): %s\n", reader.getLineIndex(), message);
+        return false;
+    };
+    const auto readPath = [&reader, &baseDir](std::filesystem::path* path) {
+        std::string_view token;
+        if (!reader.nextToken(&token))
+            return false;
+        *path = std::filesystem::path(std::string(token));
+        if (path->is_relative())
+            *path = baseDir / *path;
+        return true;
+    };
+
+    std::string_view token;
+    do {
+        std::string_view command;
+        if (!reader.nextToken(&command))
+            continue;
+
+        if (command == "mesh") {
+            std::string_view name;
+            std::string_view type;
+            if (!reader.nextToken(&name) || !reader.nextToken(&type))
+                return reportError("Invalid mesh.");
+
+            MeshInfo info;
+            if (type == "obj") {
+                MeshGeometryInfo mesh;
+                std::string_view matConv;
+                if (!readPath(&mesh.path) || !reader.readFloat(&mesh.preScale) ||
+                    !reader.nextToken(&matConv))
+                    return reportError("Invalid obj mesh.");
+                if (matConv == "trad")
+                    mesh.matConv = MaterialConvention::Traditional;
+                else if (matConv == "simple_pbr")
+                    mesh.matConv = MaterialConvention::SimplePBR;
+                else
+                    return reportError("Invalid material convention.");
+                info = mesh;
+            }
+            else if (type == "rectangle") {
+                RectangleGeometryInfo rect;
+                rect.emittance = RGB(0.0f, 0.0f, 0.0f);
+                if (!reader.readFloat(&rect.dimX) || !reader.readFloat(&rect.dimZ))
+                    return reportError("Invalid rectangle.");
+                while (reader.nextToken(&token)) {
+                    if (token == "emittance") {
+                        if (!reader.readFloat(&rect.emittance.r) ||
+                            !reader.readFloat(&rect.emittance.g) ||
+                            !reader.readFloat(&rect.emittance.b))
+                            return reportError("Invalid emittance.");
+                    }
+                    else if (token == "emitter-tex") {
+                        if (!readPath(&rect.emitterTexPath))
+                            return reportError("Invalid emitter texture.");
+                    }
+                    else {
+                        return reportError("Unknown rectangle attribute.");
+                    }
+                }
+                info = rect;
+            }
+            else {
+                return reportError("Unknown mesh type.");
+            }
+            desc->meshInfos[std::string(name)] = info;
+        }
+        else if (command == "inst" || command == "inst-grid") {
+            bool isGrid = command == "inst-grid";
+            std::string_view name;
+            if (!reader.nextToken(&name))
+                return reportError("Invalid instance.");
+            if (!desc->meshInfos.contains(std::string(name)))
+                return reportError("Undefined mesh.");
+
+            uint32_t gridSize[3] = { 1, 1, 1 };
+            Vector3D gridSpacing(0.0f, 0.0f, 0.0f);
+            if (isGrid) {
+                if (!reader.readUInt(&gridSize[0]) || !reader.readUInt(&gridSize[1]) ||
+                    !reader.readUInt(&gridSize[2]) ||
+                    !reader.readFloat(&gridSpacing.x) || !reader.readFloat(&gridSpacing.y) ||
+                    !reader.readFloat(&gridSpacing.z))
+                    return reportError("Invalid instance grid.");
+            }
+            // JP: 複数のグリッドの合計がインスタンス数の上限を超えないようにする。
+            // EN: Make sure that the total over multiple grids doesn't exceed the maximum number of instances.
+            const uint64_t numInsts = static_cast<uint64_t>(gridSize[0]) * gridSize[1] * gridSize[2];
+            if (numInsts == 0)
+                return reportError("Invalid number of instances.");
+            if (desc->meshInstInfos.size() + numInsts > Scene::maxNumInstances)
+                return reportError("Too many instances.");
+
+            MeshInstanceInfo info;
+            info.name = name;
+            info.beginPosition = Point3D(0.0f, 0.0f, 0.0f);
+            info.endPosition = Point3D(NAN, NAN, NAN);
+            info.beginOrientation = Quaternion();
+            info.endOrientation = Quaternion(NAN, NAN, NAN, NAN);
+            info.beginScale = 1.0f;
+            info.endScale = NAN;
+            info.frequency = 5.0f;
+            info.initTime = 0.0f;
+            float timeStep = 0.0f;
+            while (reader.nextToken(&token)) {
+                bool valid;
+                if (token == "pos")
+                    valid = reader.readPoint(&info.beginPosition);
+                else if (token == "rpy")
+                    valid = reader.readOrientation(&info.beginOrientation);
+                else if (token == "scale")
+                    valid = reader.readFloat(&info.beginScale);
+                else if (token == "end-pos")
+                    valid = reader.readPoint(&info.endPosition);
+                else if (token == "end-rpy")
+                    valid = reader.readOrientation(&info.endOrientation);
+                else if (token == "end-scale")
+                    valid = reader.readFloat(&info.endScale);
+                else if (token == "freq")
+                    valid = reader.readFloat(&info.frequency);
+                else if (token == "time")
+                    valid = reader.readFloat(&info.initTime);
+                else if (token == "time-step" && isGrid)
+                    valid = reader.readFloat(&timeStep);
+                else
+                    return reportError("Unknown instance attribute.");
+                if (!valid)
+                    return reportError("Invalid instance attribute.");
+            }
+            if (!info.endPosition.allFinite())
+                info.endPosition = info.beginPosition;
+            if (!info.endOrientation.allFinite())
+                info.endOrientation = info.beginOrientation;
+            if (!std::isfinite(info.endScale))
+                info.endScale = info.beginScale;
+
+            uint32_t linearIndex = 0;
+            for (uint32_t iz = 0; iz < gridSize[2]; ++iz) {
+                for (uint32_t iy = 0; iy < gridSize[1]; ++iy) {
+                    for (uint32_t ix = 0; ix < gridSize[0]; ++ix, ++linearIndex) {
+                        Vector3D offset(ix * gridSpacing.x, iy * gridSpacing.y, iz * gridSpacing.z);
+                        MeshInstanceInfo &dstInfo = desc->meshInstInfos.emplace_back(info);
+                        dstInfo.beginPosition += offset;
+                        dstInfo.endPosition += offset;
+                        dstInfo.initTime += linearIndex * timeStep;
+                    }
+                }
+            }
+        }
+        else {
+            return reportError("Unknown command.");
+        }
+
+        if (reader.nextToken(&token))
+            return reportError("Unexpected token.");
+    } while (reader.nextLine());
+
+    return true;
+}
+
+
+
+void SceneCommandlineParser::resetInstanceAttributes() {
+    m_beginPosition = Point3D(0.0f, 0.0f, 0.0f);
+    m_endPosition = Point3D(NAN, NAN, NAN);
+    m_beginOrientation = Quaternion();
+    m_endOrientation = Quaternion(NAN, NAN, NAN, NAN);
+    m_beginScale = 1.0f;
+    m_endScale = NAN;
+    m_frequency = 5.0f;
+    m_initTime = 0.0f;
+}
+
+CommandlineParseResult SceneCommandlineParser::parse(
+    int32_t argc, const char* argv[], int32_t* argIdx, SceneDescription* desc) {
+    int32_t &i = *argIdx;
+    const char* arg = argv[i];
+
+    const auto readFloats = [&](float* values, int32_t numValues) {
+        if (i + numValues >= argc)
+            return false;
+        for (int j = 0; j < numValues; ++j) {
+            values[j] = static_cast<float>(atof(argv[i + 1 + j]));
+            if (!std::isfinite(values[j]))
+                return false;
+        }
+        i += numValues;
+        return true;
+    };
+    const auto applyRotation = [&](const char* axis, Quaternion* ori) {
+        if (!allFinite(*ori))
+            *ori = Quaternion();
+        float angle;
+        if (!readFloats(&angle, 1))
+            return false;
+        angle *= pi_v<float> / 180;
+        if (strncmp(axis, "-roll", 6) == 0)
+            *ori = qRotateZ(angle) * *ori;
+        else if (strncmp(axis, "-pitch", 7) == 0)
+            *ori = qRotateX(angle) * *ori;
+        else
+            *ori = qRotateY(angle) * *ori;
+        return true;
+    };
+
+    bool valid = true;
+    if (strncmp(arg, "-scene", 7) == 0) {
+        if (i + 1 >= argc)
+            return CommandlineParseResult::Invalid;
+        valid = loadSceneDescription(argv[i + 1], desc);
+        i += 1;
+    }
+    else if (strncmp(arg, "-name", 6) == 0) {
+        if (i + 1 >= argc)
+            return CommandlineParseResult::Invalid;
+        m_name = argv[i + 1];
+        i += 1;
+    }
+    else if (strncmp(arg, "-emittance", 11) == 0) {
+        float values[3];
+        valid = readFloats(values, 3);
+        m_emittance = RGB(values[0], values[1], values[2]);
+    }
+    else if (strncmp(arg, "-rect-emitter-tex", 18) == 0) {
+        if (i + 1 >= argc)
+            return CommandlineParseResult::Invalid;
+        m_rectEmitterTexPath = argv[i + 1];
+        i += 1;
+    }
+    else if (strncmp(arg, "-max-texture-resolution", 24) == 0) {
+        if (i + 1 >= argc)
+            return CommandlineParseResult::Invalid;
+        const int32_t maxResolution = atoi(argv[i + 1]);
+        valid = maxResolution >= 0;
+        if (valid)
+            setMaxTextureResolution(static_cast<uint32_t>(maxResolution));
+        i += 1;
+    }
+    else if (strncmp(arg, "-obj", 5) == 0) {
+        if (i + 3 >= argc)
+            return CommandlineParseResult::Invalid;
+
+        MeshGeometryInfo mesh;
+        mesh.path = std::filesystem::path(argv[i + 1]);
+        mesh.preScale = static_cast<float>(atof(argv[i + 2]));
+        std::string matConv = argv[i + 3];
+        if (matConv == "trad")
+            mesh.matConv = MaterialConvention::Traditional;
+        else if (matConv == "simple_pbr")
+            mesh.matConv = MaterialConvention::SimplePBR;
+        else
+            valid = false;
+        desc->meshInfos[m_name] = mesh;
+
+        i += 3;
+    }
+    else if (strncmp(arg, "-rectangle", 11) == 0) {
+        RectangleGeometryInfo rect;
+        float dims[2];
+        valid = readFloats(dims, 2);
+        rect.dimX = dims[0];
+        rect.dimZ = dims[1];
+        rect.emittance = m_emittance;
+        rect.emitterTexPath = m_rectEmitterTexPath;
+        desc->meshInfos[m_name] = rect;
+
+        m_emittance = RGB(0.0f, 0.0f, 0.0f);
+        m_rectEmitterTexPath = "";
+    }
+    else if (strncmp(arg, "-begin-pos", 11) == 0) {
+        float values[3];
+        valid = readFloats(values, 3);
+        m_beginPosition = Point3D(values[0], values[1], values[2]);
+    }
+    else if (strncmp(arg, "-begin-roll", 12) == 0 ||
+             strncmp(arg, "-begin-pitch", 13) == 0 ||
+             strncmp(arg, "-begin-yaw", 11) == 0) {
+        valid = applyRotation(arg + 6, &m_beginOrientation);
+    }
+    else if (strncmp(arg, "-begin-scale", 13) == 0) {
+        valid = readFloats(&m_beginScale, 1);
+    }
+    else if (strncmp(arg, "-end-pos", 9) == 0) {
+        float values[3];
+        valid = readFloats(values, 3);
+        m_endPosition = Point3D(values[0], values[1], values[2]);
+    }
+    else if (strncmp(arg, "-end-roll", 10) == 0 ||
+             strncmp(arg, "-end-pitch", 11) == 0 ||
+             strncmp(arg, "-end-yaw", 9) == 0) {
+        valid = applyRotation(arg + 4, &m_endOrientation);
+    }
+    else if (strncmp(arg, "-end-scale", 11) == 0) {
+        valid = readFloats(&m_endScale, 1);
+    }
+    else if (strncmp(arg, "-freq", 6) == 0) {
+        valid = readFloats(&m_frequency, 1);
+    }
+    else if (strncmp(arg, "-time", 6) == 0) {
+        valid = readFloats(&m_initTime, 1);
+    }
+    else if (strncmp(arg, "-inst", 6) == 0) {
+        if (i + 1 >= argc)
+            return CommandlineParseResult::Invalid;
+
+        MeshInstanceInfo info;
+        info.name = argv[i + 1];
+        info.beginPosition = m_beginPosition;
+        info.beginOrientation = m_beginOrientation;
+        info.beginScale = m_beginScale;
+        info.endPosition = m_endPosition.allFinite() ? m_endPosition : m_beginPosition;
+        info.endOrientation = m_endOrientation.allFinite() ? m_endOrientation : m_beginOrientation;
+        info.endScale = std::isfinite(m_endScale) ? m_endScale : m_beginScale;
+        info.frequency = m_frequency;
+        info.initTime = m_initTime;
+        desc->meshInstInfos.push_back(info);
+
+        resetInstanceAttributes();
+
+        i += 1;
+    }
+    else {
+        return CommandlineParseResult::Unhandled;
+    }
+
+    return valid ? CommandlineParseResult::Handled : CommandlineParseResult::Invalid;
+}
+
+
+
+void instantiateSceneDescription(
+    const SceneDescription &desc,
+    CUcontext cuContext, Scene* scene, optixu::Material optixMat,
+    bool allocateGfxResource) {
+    for (auto it = desc.meshInfos.cbegin(); it != desc.meshInfos.cend(); ++it) {
+        const MeshInfo &info = it->second;
+
+        if (std::holds_alternative<MeshGeometryInfo>(info)) {
+            const auto &meshInfo = std::get<MeshGeometryInfo>(info);
+
+            createTriangleMeshes(
+                it->first,
+                meshInfo.path, meshInfo.matConv,
+                scale3D_4x4(meshInfo.preScale),
+                cuContext, scene, optixMat,
+                allocateGfxResource);
+        }
+        else if (std::holds_alternative<RectangleGeometryInfo>(info)) {
+            const auto &rectInfo = std::get<RectangleGeometryInfo>(info);
+
+            createRectangleLight(
+                it->first,
+                rectInfo.dimX, rectInfo.dimZ,
+                RGB(0.01f),
+                rectInfo.emitterTexPath, rectInfo.emittance, Matrix4x4(),
+                cuContext, scene, optixMat,
+                allocateGfxResource);
+        }
+    }
+
+    // JP: 同じメッシュが連続して宣言されたインスタンスを一括で生成する。
+    //     インスタンス(とスロット)の順序を宣言順、複数のジオメトリグループインスタンスを持つメッシュでは
+    //     インスタンスごとにグループインスタンス順、に保つため、その場合は一括にしない。
+    // EN: Create instances in bulk for consecutive declarations of the same mesh.
+    //     To keep the order of instances (and slots) as declared, and in group instance order per instance
+    //     for a mesh with multiple geometry group instances, don't batch in that case.
+    const uint32_t numInstInfos = static_cast<uint32_t>(desc.meshInstInfos.size());
+    std::vector<Matrix4x4> transforms;
+    std::vector<Instance*> insts;
+    for (uint32_t runBegin = 0; runBegin < numInstInfos;) {
+        const std::string &meshName = desc.meshInstInfos[runBegin].name;
+        const Mesh* mesh = scene->meshes.at(meshName);
+        uint32_t runEnd = runBegin + 1;
+        if (mesh->groupInsts.size() == 1) {
+            while (runEnd < numInstInfos && desc.meshInstInfos[runEnd].name == meshName)
+                ++runEnd;
+        }
+        const uint32_t numInsts = runEnd - runBegin;
+
+        transforms.resize(numInsts);
+        insts.resize(numInsts);
+        for (uint32_t i = 0; i < numInsts; ++i) {
+            const MeshInstanceInfo &info = desc.meshInstInfos[runBegin + i];
+            transforms[i] =
+                Matrix4x4(info.beginScale * info.beginOrientation.toMatrix3x3(), info.beginPosition);
+        }
+
+        for (int j = 0; j < mesh->groupInsts.size(); ++j) {
+            const Mesh::GeometryGroupInstance &groupInst = mesh->groupInsts[j];
+            createInstances(cuContext, scene, groupInst, transforms.data(), numInsts, insts.data());
+            scene->insts.insert(scene->insts.end(), insts.cbegin(), insts.cend());
+
+            for (uint32_t i = 0; i < numInsts; ++i) {
+                const MeshInstanceInfo &info = desc.meshInstInfos[runBegin + i];
+                scene->initialSceneAabb.unify(transforms[i] * groupInst.transform * groupInst.geomGroup->aabb);
+
+                if (any(info.beginPosition != info.endPosition) ||
+                    info.beginOrientation != info.endOrientation ||
+                    info.beginScale != info.endScale) {
+                    auto controller = new InstanceController(
+                        insts[i],
+                        info.beginScale, info.beginOrientation, info.beginPosition,
+                        info.endScale, info.endOrientation, info.endPosition,
+                        info.frequency, info.initTime);
+                    scene->instControllers.push_back(controller);
+                }
+            }
+        }
+
+        runBegin = runEnd;
+    }
+}
+
+bool testIncrementalLightDistributionUpdates(CUcontext cuContext, Scene* scene) {
+    CUstream cuStream;
+    CUDADRV_CHECK(cuStreamCreate(&cuStream, 0));
+    cudau::TypedBuffer<shared::LightDistribution> lightInstDistCopy;
+    lightInstDistCopy.initialize(cuContext, cudau::BufferType::Device, 1);
+    const CUdeviceptr lightInstDistAddr = lightInstDistCopy.getCUdeviceptr();
+
+    bool success = true;
+    Scene::LightDistUpdateStats prevStats = scene->lightDistUpdateStats;
+    const auto update = [&]() {
+        prevStats = scene->lightDistUpdateStats;
+        scene->setupLightGeomDistributions(cuStream);
+        scene->setupLightInstDistribution(cuStream, lightInstDistAddr, 0);
+        CUDADRV_CHECK(cuStreamSynchronize(cuStream));
+    };
+    const auto check = [&](
+        const char* caseName,
+        uint32_t expectedNumPrimDists, uint32_t expectedNumGeomInstDists, uint32_t expectedNumInstWeights) {
+        const Scene::LightDistUpdateStats &stats = scene->lightDistUpdateStats;
+        const uint32_t numPrimDists = stats.numEmitterPrimDistUpdates - prevStats.numEmitterPrimDistUpdates;
+        const uint32_t numGeomInstDists = stats.numLightGeomInstDistUpdates - prevStats.numLightGeomInstDistUpdates;
+        const uint32_t numInstDistBuilds = stats.numLightInstDistBuilds - prevStats.numLightInstDistBuilds;
+        const uint32_t numInstWeights = stats.numLightInstWeightUpdates - prevStats.numLightInstWeightUpdates;
+        const bool passed =
+            numPrimDists == expectedNumPrimDists &&
+            numGeomInstDists == expectedNumGeomInstDists &&
+            numInstDistBuilds == 0 &&
+            numInstWeights == expectedNumInstWeights;
+        hpprintf("%s: %s: prim dists %u/%u, geom inst dists %u/%u, inst dist builds %u/0, inst weights %u/%u\n",
+                 passed ? "OK" : "FAILED", caseName,
+                 numPrimDists, expectedNumPrimDists, numGeomInstDists, expectedNumGeomInstDists,
+                 numInstDistBuilds, numInstWeights, expectedNumInstWeights);
+        success &= passed;
+    };
+
+    // JP: 保留中の変更を全て反映し、インスタンス単位の分布を構築しておく。
+    // EN: Apply all the pending changes and build the distribution over instances.
+    update();
+
+    update();
+    check("No change", 0, 0, 0);
+
+    // JP: 発光マテリアルを1つ変更すると、それを使うジオメトリーインスタンスとそれらを含むインスタンスのみが更新される。
+    // EN: Changing an emissive material updates only the geometry instances using it and the instances containing them.
+    Material* emissiveMat = nullptr;
+    for (const GeometryInstance* geomInst : scene->geomInsts) {
+        if (!geomInst->emitterPrimDist.isInitialized())
+            continue;
+        for (Material* mat : scene->materials) {
+            if (mat == geomInst->mat) {
+                emissiveMat = mat;
+                break;
+            }
+        }
+        break;
+    }
+    if (emissiveMat) {
+        uint32_t expectedNumPrimDists = 0;
+        for (const GeometryInstance* geomInst : scene->geomInsts) {
+            if (geomInst->emitterPrimDist.isInitialized() && geomInst->mat == emissiveMat)
+                ++expectedNumPrimDists;
+        }
+        uint32_t expectedNumInsts = 0;
+        for (const Instance* inst : scene->insts) {
+            if (!inst->lightGeomInstDist.isInitialized())
+                continue;
+            for (const GeometryInstance* geomInst : inst->geomGroupInst.geomGroup->geomInsts) {
+                if (geomInst->emitterPrimDist.isInitialized() && geomInst->mat == emissiveMat) {
+                    ++expectedNumInsts;
+                    break;
+                }
+            }
+        }
+
+        emissiveMat->markLightDistDirty();
+        update();
+        check("Emissive material changed", expectedNumPrimDists, expectedNumInsts, expectedNumInsts);
+    }
+
+    // JP: 発光インスタンスを1つ動かすと、インスタンス単位の分布のその重みのみが更新される。
+    // EN: Moving an emissive instance updates only its weight in the distribution over instances.
+    Instance* emissiveInst = nullptr;
+    for (Instance* inst : scene->insts) {
+        if (inst->lightGeomInstDist.isInitialized()) {
+            emissiveInst = inst;
+            break;
+        }
+    }
+    if (emissiveInst) {
+        emissiveInst->markTransformDirty();
+        update();
+        check("Emissive instance moved", 0, 0, 1);
+    }
+
+    // JP: 差分更新した分布の積分値が全体を構築し直した場合と一致するか。
+    // EN: Does the integral of the incrementally updated distribution match the one of a full rebuild?
+    {
+        shared::LightDistribution patchedDist;
+        lightInstDistCopy.read(&patchedDist, 1, cuStream);
+        scene->lightInstDistInitialized = false;
+        scene->setupLightInstDistribution(cuStream, lightInstDistAddr, 0);
+        shared::LightDistribution rebuiltDist;
+        lightInstDistCopy.read(&rebuiltDist, 1, cuStream);
+        CUDADRV_CHECK(cuStreamSynchronize(cuStream));
+        const float patchedIntegral = patchedDist.integral();
+        const float rebuiltIntegral = rebuiltDist.integral();
+        const bool passed =
+            std::fabs(patchedIntegral - rebuiltIntegral) <= 1e-4f * std::fabs(rebuiltIntegral);
+        hpprintf("%s: Integral of the distribution over instances: %g (full rebuild: %g)\n",
+                 passed ? "OK" : "FAILED", patchedIntegral, rebuiltIntegral);
+        success &= passed;
+    }
+
+    if (!emissiveMat || !emissiveInst)
+        hpprintf("The scene has no emitters, some cases were skipped.\n");
+
+    lightInstDistCopy.finalize();
+    CUDADRV_CHECK(cuStreamDestroy(cuStream));
+
+    return success;
+}
+
+
+
+static float computeSurfaceArea(const AABB &aabb) {
+    if (!aabb.isValid())
+        return 0.0f;
+    const Vector3D d = aabb.maxP - aabb.minP;
+    return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+void ASUpdatePolicy::reset() {
+    m_referenceAabbs.clear();
+    m_referenceArea = 0.0f;
+    m_lastBoundsGrowth = 1.0f;
+    m_numConsecutiveRefits = 0;
+    m_numRebuilds = 0;
+    m_numRefits = 0;
+    m_hasReference = false;
+}
+
+float ASUpdatePolicy::estimateBoundsGrowth(const AABB* childAabbs, uint32_t numChildren) const {
+    if (!m_hasReference || numChildren != m_referenceAabbs.size())
+        return INFINITY;
+    if (m_referenceArea <= 0.0f)
+        return 1.0f;
+    double sumArea = 0.0;
+    for (uint32_t i = 0; i < numChildren; ++i) {
+        AABB aabb = m_referenceAabbs[i];
+        aabb.unify(childAabbs[i]);
+        sumArea += computeSurfaceArea(aabb);
+    }
+    return static_cast<float>(sumArea / m_referenceArea);
+}
+
+ASUpdateMethod ASUpdatePolicy::decide(bool refitAllowed, const AABB* childAabbs, uint32_t numChildren) {
+    if (!refitAllowed || !m_hasReference || numChildren != m_referenceAabbs.size())
+        return ASUpdateMethod::Rebuild;
+    if (m_numConsecutiveRefits >= m_config.maxConsecutiveRefits)
+        return ASUpdateMethod::Rebuild;
+    m_lastBoundsGrowth = estimateBoundsGrowth(childAabbs, numChildren);
+    return m_lastBoundsGrowth > m_config.maxBoundsGrowth ? ASUpdateMethod::Rebuild : ASUpdateMethod::Refit;
+}
+
+void ASUpdatePolicy::recordRebuild(const AABB* childAabbs, uint32_t numChildren) {
+    m_referenceAabbs.assign(childAabbs, childAabbs + numChildren);
+    double sumArea = 0.0;
+    for (uint32_t i = 0; i < numChildren; ++i)
+        sumArea += computeSurfaceArea(childAabbs[i]);
+    m_referenceArea = static_cast<float>(sumArea);
+    m_lastBoundsGrowth = 1.0f;
+    m_numConsecutiveRefits = 0;
+    ++m_numRebuilds;
+    m_hasReference = true;
+}
+
+
+
+void ScratchMemoryPool::finalize() {
+    for (int i = static_cast<int>(m_blocks.size()) - 1; i >= 0; --i) {
+        Block* block = m_blocks[i];
+        CUDADRV_CHECK(cuEventSynchronize(block->releaseEvent));
+        CUDADRV_CHECK(cuEventDestroy(block->releaseEvent));
+        block->buffer.finalize();
+        delete block;
+    }
+    m_blocks.clear();
+}
+
+const cudau::Buffer* ScratchMemoryPool::acquire(size_t size) {
+    const uint32_t sizeClass = computeSizeClass(std::max<size_t>(size, 1));
+    Block* bestBlock = nullptr;
+    for (Block* block : m_blocks) {
+        if (block->inUse || block->sizeClass < sizeClass)
+            continue;
+        if (bestBlock && block->sizeClass >= bestBlock->sizeClass)
+            continue;
+        const CUresult res = cuEventQuery(block->releaseEvent);
+        if (res == CUDA_ERROR_NOT_READY)
+            continue;
+        CUDADRV_CHECK(res);
+        bestBlock = block;
+    }
+
+    if (!bestBlock) {
+        // JP: 要求サイズが増えた場合、使われていない小さなブロックは今後も使われにくいので解放する。
+        // EN: When the requested size grows, release unused smaller blocks since they are unlikely to be used again.
+        for (int i = static_cast<int>(m_blocks.size()) - 1; i >= 0; --i) {
+            Block* block = m_blocks[i];
+            if (block->inUse || block->sizeClass >= sizeClass)
+                continue;
+            CUDADRV_CHECK(cuEventSynchronize(block->releaseEvent));
+            CUDADRV_CHECK(cuEventDestroy(block->releaseEvent));
+            block->buffer.finalize();
+            delete block;
+            m_blocks.erase(m_blocks.begin() + i);
+        }
+
+        bestBlock = new Block();
+        bestBlock->buffer.initialize(m_cuContext, cudau::BufferType::Device, getSizeClassBytes(sizeClass), 1);
+        CUDADRV_CHECK(cuEventCreate(&bestBlock->releaseEvent, CU_EVENT_DISABLE_TIMING));
+        bestBlock->sizeClass = sizeClass;
+        m_blocks.push_back(bestBlock);
+    }
+    bestBlock->inUse = true;
+
+    return &bestBlock->buffer;
+}
+
+void ScratchMemoryPool::release(const cudau::Buffer* buffer, CUstream stream) {
+    for (Block* block : m_blocks) {
+        if (&block->buffer != buffer)
+            continue;
+        Assert(block->inUse, "This block has already been released.");
+        CUDADRV_CHECK(cuEventRecord(block->releaseEvent, stream));
+        block->inUse = false;
+        return;
+    }
+    Assert_ShouldNotBeCalled();
+}
+
+
+
+void EmitterRegistry::setGeometryEmitters(
+    uint32_t geomInstSlot,
+    const shared::Vertex* vertices, const shared::Triangle* triangles, const RGB* emittances,
+    uint32_t numTriangles) {
+    constexpr uint32_t minChunkSize = 1 << 12;
+
+    if (geomInstSlot >= m_geometries.size())
+        m_geometries.resize(geomInstSlot + 1);
+    GeometryEmitters &geom = m_geometries[geomInstSlot];
+    for (int i = 0; i < 3; ++i)
+        geom.positions[i].resize(numTriangles);
+    geom.emittances.assign(emittances, emittances + numTriangles);
+
+    parallelForChunks(
+        0, numTriangles, minChunkSize,
+        [&](uint32_t chunkIdx, uint32_t begin, uint32_t end) {
+            for (uint32_t triIdx = begin; triIdx < end; ++triIdx) {
+                const shared::Triangle &tri = triangles[triIdx];
+                const shared::Vertex &v0 = vertices[tri.index0];
+                const shared::Vertex &v1 = vertices[tri.index1];
+                const shared::Vertex &v2 = vertices[tri.index2];
+                Point3D p1 = v1.position;
+                Point3D p2 = v2.position;
+                if (dot(cross(p1 - v0.position, p2 - v0.position), v0.normal + v1.normal + v2.normal) < 0.0f)
+                    std::swap(p1, p2);
+                geom.positions[0][triIdx] = v0.position;
+                geom.positions[1][triIdx] = p1;
+                geom.positions[2][triIdx] = p2;
+            }
+        });
+}
+
+void EmitterRegistry::updateTable() {
+    constexpr uint32_t minChunkSize = 1 << 12;
+
+    uint32_t numEmitters = 0;
+    for (InstanceGeometry &instGeom : m_instGeometries) {
+        instGeom.firstEmitter = numEmitters;
+        numEmitters += static_cast<uint32_t>(m_geometries[instGeom.geomInstSlot].emittances.size());
+    }
+
+    for (int i = 0; i < 3; ++i)
+        m_positions[i].resize(numEmitters);
+    m_areas.resize(numEmitters);
+    m_emittances.resize(numEmitters);
+    m_instSlots.resize(numEmitters);
+    m_geomInstSlots.resize(numEmitters);
+    m_primIndices.resize(numEmitters);
+    m_numEmitters = numEmitters;
+
+    // JP: チャンクの先頭を含むインスタンスとジオメトリーインスタンスの組を探し、そこから順に変換する。
+    // EN: Find the pair of an instance and a geometry instance containing the head of a chunk,
+    //     then transform from there in order.
+    parallelForChunks(
+        0, numEmitters, minChunkSize,
+        [this](uint32_t chunkIdx, uint32_t begin, uint32_t end) {
+            const auto it = std::upper_bound(
+                m_instGeometries.cbegin(), m_instGeometries.cend(), begin,
+                [](uint32_t emitterIdx, const InstanceGeometry &instGeom) {
+                    return emitterIdx < instGeom.firstEmitter;
+                });
+            size_t instGeomIdx = std::distance(m_instGeometries.cbegin(), it) - 1;
+            uint32_t emitterIdx = begin;
+            while (emitterIdx < end) {
+                const InstanceGeometry &instGeom = m_instGeometries[instGeomIdx++];
+                const GeometryEmitters &geom = m_geometries[instGeom.geomInstSlot];
+                const uint32_t numTriangles = static_cast<uint32_t>(geom.emittances.size());
+                const uint32_t segmentEnd = std::min(instGeom.firstEmitter + numTriangles, end);
+                for (; emitterIdx < segmentEnd; ++emitterIdx) {
+                    const uint32_t primIdx = emitterIdx - instGeom.firstEmitter;
+                    Point3D p[3];
+                    for (int i = 0; i < 3; ++i) {
+                        p[i] = instGeom.matM2W * geom.positions[i][primIdx];
+                        m_positions[i][emitterIdx] = p[i];
+                    }
+                    m_areas[emitterIdx] = 0.5f * length(cross(p[1] - p[0], p[2] - p[0]));
+                    m_emittances[emitterIdx] = geom.emittances[primIdx];
+                    m_instSlots[emitterIdx] = instGeom.instSlot;
+                    m_geomInstSlots[emitterIdx] = instGeom.geomInstSlot;
+                    m_primIndices[emitterIdx] = primIdx;
+                }
+            }
+        });
+}
+
+
+
+static float safeAcos(float x) {
+    return std::acos(std::fmin(std::fmax(x, -1.0f), 1.0f));
+}
+
+// JP: 方向コーン。cosThetaがINFINITYのものは空を表す。
+// EN: Direction cone. One with cosTheta of INFINITY represents empty.
+struct LightTreeDirectionCone {
+    Normal3D axis;
+    float cosTheta;
+
+    LightTreeDirectionCone() : axis(0, 0, 1), cosTheta(INFINITY) {}
+    LightTreeDirectionCone(const Normal3D &_axis, float _cosTheta) :
+        axis(_axis), cosTheta(_cosTheta) {}
+
+    bool isEmpty() const {
+        return cosTheta == INFINITY;
+    }
+};
+
+// Reference: pbrt-v4 DirectionCone Union()
+static LightTreeDirectionCone unifyDirectionCones(
+    const LightTreeDirectionCone &a, const LightTreeDirectionCone &b) {
+    if (a.isEmpty())
+        return b;
+    if (b.isEmpty())
+        return a;
+
+    // JP: ビン分けで頻繁に起こる、一方が全方向か他方が単一方向で内側にある場合は逆三角関数を避ける。
+    // EN: Avoid inverse trigonometric functions for the cases frequent in binning
+    //     where one covers all directions or the other is a single direction inside it.
+    if (a.cosTheta <= -1.0f || (b.cosTheta >= 1.0f && dot(a.axis, b.axis) >= a.cosTheta))
+        return a;
+    if (b.cosTheta <= -1.0f || (a.cosTheta >= 1.0f && dot(a.axis, b.axis) >= b.cosTheta))
+        return b;
+
+    const float thetaA = safeAcos(a.cosTheta);
+    const float thetaB = safeAcos(b.cosTheta);
+    const float thetaD = safeAcos(dot(a.axis, b.axis));
+    if (std::fmin(thetaD + thetaB, pi_v<float>) <= thetaA)
+        return a;
+    if (std::fmin(thetaD + thetaA, pi_v<float>) <= thetaB)
+        return b;
+
+    // JP: 両方のコーンを含むコーンの広がりと、aの軸をbの方へ回転させる角度を求める。
+    // EN: Compute the spread of the cone containing both cones and the angle to rotate a's axis toward b.
+    const float thetaO = 0.5f * (thetaA + thetaD + thetaB);
+    if (thetaO >= pi_v<float>)
+        return LightTreeDirectionCone(a.axis, -1.0f);
+    const float thetaR = thetaO - thetaA;
+    Vector3D rotAxis = cross(a.axis, b.axis);
+    if (rotAxis.sqLength() == 0.0f)
+        return LightTreeDirectionCone(a.axis, -1.0f);
+    rotAxis = normalize(rotAxis);
+    // JP: rotAxisはa.axisに直交するのでロドリゲスの回転公式が簡単になる。
+    // EN: rotAxis is orthogonal to a.axis, so Rodrigues' rotation formula simplifies.
+    const Vector3D axis = std::cos(thetaR) * Vector3D(a.axis) + std::sin(thetaR) * cross(rotAxis, a.axis);
+    return LightTreeDirectionCone(normalize(Normal3D(axis)), std::cos(thetaO));
+}
+
+struct LightTreeBuildItem {
+    AABB aabb;
+    Point3D centroid;
+    Normal3D normal;
+    float power;
+    uint32_t emitterIndex;
+};
+
+struct LightTreeBounds {
+    AABB aabb;
+    LightTreeDirectionCone cone;
+    float power;
+
+    LightTreeBounds() : power(0.0f) {}
+
+    void unify(const LightTreeBuildItem &item) {
+        aabb.unify(item.aabb);
+        cone = unifyDirectionCones(cone, LightTreeDirectionCone(item.normal, 1.0f));
+        power += item.power;
+    }
+    void unify(const LightTreeBounds &b) {
+        aabb.unify(b.aabb);
+        cone = unifyDirectionCones(cone, b.cone);
+        power += b.power;
+    }
+};
+
+// JP: 三角形の放射は半球なので、放射の広がりthetaEは常にPi / 2。
+// EN: The emission of a triangle is hemispherical, so the emission spread thetaE is always Pi / 2.
+static constexpr float lightTreeCosThetaE = 0.0f;
+
+// JP: Surface Area Orientation Heuristic (SAOH)によるコスト。
+//     lengthRatioはノードのバウンディングボックスの最大辺と分割軸方向の辺の比で、細長い分割を抑制する。
+// EN: Cost by the Surface Area Orientation Heuristic (SAOH).
+//     lengthRatio is the ratio of the longest edge of the node's bounding box to the edge along the split axis
+//     and penalizes thin splits.
+// Reference: pbrt-v4 BVHLightSampler::EvaluateCost()
+static float evaluateLightTreeSplitCost(const LightTreeBounds &b, float lengthRatio) {
+    const float cosThetaO = b.cone.cosTheta;
+    const float thetaO = safeAcos(cosThetaO);
+    const float thetaW = std::fmin(thetaO + 0.5f * pi_v<float>, pi_v<float>);
+    const float sinThetaO = std::sqrt(std::fmax(1 - pow2(cosThetaO), 0.0f));
+    // JP: thetaWの定義からcos(thetaO - 2 * thetaW)は-|cos(thetaO)|になる。
+    // EN: cos(thetaO - 2 * thetaW) becomes -|cos(thetaO)| from the definition of thetaW.
+    const float mOmega =
+        2 * pi_v<float> * (1 - cosThetaO) +
+        0.5f * pi_v<float> * (
+            2 * thetaW * sinThetaO + std::fabs(cosThetaO) - 2 * thetaO * sinThetaO + cosThetaO);
+    return b.power * mOmega * lengthRatio * computeSurfaceArea(b.aabb);
+}
+
+static constexpr uint32_t lightTreeNumBins = 12;
+// JP: 大きなノードのバウンディングとビンはこの要素数のブロックごとに並列に求め、ブロック順に統合する。
+// EN: Bounds and bins of a large node are computed in parallel per block of this number of items
+//     and merged in block order.
+static constexpr uint32_t lightTreeBlockSize = 1 << 14;
+// JP: この要素数以下のノードは部分木ごとに1スレッドで構築する。
+// EN: Nodes with this number of items or less are built with a single thread per subtree.
+static constexpr uint32_t lightTreeSubtreeSize = 1 << 13;
+
+struct LightTreeBuildTask {
+    uint32_t begin;
+    uint32_t end;
+    uint32_t nodeIndex;
+    uint32_t parentIndex;
+    // JP: n要素のノードの子孫は2n - 2個のノードをこの位置から連続して使う。
+    //     左の子と右の子をその先頭に置き、続けて左の子孫、右の子孫の順に割り当てる。
+    // EN: Descendants of a node with n items use 2n - 2 nodes contiguously from this position.
+    //     The left and right children are placed at the head,
+    //     followed by the left descendants then the right descendants.
+    uint32_t firstDescendantIndex;
+};
+
+using LightTreeBinSet = std::array<std::array<LightTreeBounds, lightTreeNumBins>, 3>;
+
+static uint32_t computeLightTreeBinIndex(
+    const LightTreeBuildItem &item, uint32_t axis, const AABB &centroidAabb, const Vector3D &centroidExtent) {
+    const float t = (item.centroid[axis] - centroidAabb.minP[axis]) / centroidExtent[axis];
+    return std::min(static_cast<uint32_t>(t * lightTreeNumBins), lightTreeNumBins - 1);
+}
+
+// JP: [begin, end)をブロックに分けて並列にfunc(blockIdx, blockBegin, blockEnd)を呼ぶ。
+// EN: Split [begin, end) into blocks and call func(blockIdx, blockBegin, blockEnd) in parallel.
+template <typename Func>
+static void forEachLightTreeBlock(uint32_t begin, uint32_t end, Func &&func) {
+    const uint32_t numBlocks = (end - begin + lightTreeBlockSize - 1) / lightTreeBlockSize;
+    parallelForChunks(
+        0, numBlocks, 1,
+        [&](uint32_t chunkIdx, uint32_t blockBegin, uint32_t blockEnd) {
+            for (uint32_t blockIdx = blockBegin; blockIdx < blockEnd; ++blockIdx) {
+                const uint32_t itemBegin = begin + blockIdx * lightTreeBlockSize;
+                func(blockIdx, itemBegin, std::min(itemBegin + lightTreeBlockSize, end));
+            }
+        });
+}
+
+// JP: タスクのノードを書き込み、分割した場合は子のタスクを返す。
+//     lightTreeBlockSizeより大きなノードはブロック単位で並列に処理し、workItemsを分割の作業領域に使う。
+// EN: Write the node of a task and return the child tasks when it is split.
+//     A node larger than lightTreeBlockSize is processed in parallel per block,
+//     using workItems as the work area for partitioning.
+static bool splitLightTreeNode(
+    const LightTreeBuildTask &task,
+    LightTreeBuildItem* items, LightTreeBuildItem* workItems,
+    shared::LightTreeNode* nodes, shared::LightTreeEmitter* treeEmitters,
+    LightTreeBuildTask childTasks[2]) {
+    const uint32_t numItems = task.end - task.begin;
+    const bool parallel = numItems > lightTreeBlockSize;
+    const uint32_t numBlocks = (numItems + lightTreeBlockSize - 1) / lightTreeBlockSize;
+
+    LightTreeBounds nodeBounds;
+    AABB centroidAabb;
+    if (parallel) {
+        std::vector<LightTreeBounds> blockBounds(numBlocks);
+        std::vector<AABB> blockCentroidAabbs(numBlocks);
+        forEachLightTreeBlock(
+            task.begin, task.end,
+            [&](uint32_t blockIdx, uint32_t begin, uint32_t end) {
+                for (uint32_t i = begin; i < end; ++i) {
+                    blockBounds[blockIdx].unify(items[i]);
+                    blockCentroidAabbs[blockIdx].unify(items[i].centroid);
+                }
+            });
+        for (uint32_t blockIdx = 0; blockIdx < numBlocks; ++blockIdx) {
+            nodeBounds.unify(blockBounds[blockIdx]);
+            centroidAabb.unify(blockCentroidAabbs[blockIdx]);
+        }
+    }
+    else {
+        for (uint32_t i = task.begin; i < task.end; ++i) {
+            nodeBounds.unify(items[i]);
+            centroidAabb.unify(items[i].centroid);
+        }
+    }
+
+    shared::LightTreeNode node;
+    node.minP = nodeBounds.aabb.minP;
+    node.maxP = nodeBounds.aabb.maxP;
+    node.axis = nodeBounds.cone.axis;
+    node.cosThetaO = nodeBounds.cone.cosTheta;
+    node.cosThetaE = lightTreeCosThetaE;
+    node.power = nodeBounds.power;
+    node.parentIndex = task.parentIndex;
+
+    if (numItems == 1) {
+        const uint32_t emitterIdx = items[task.begin].emitterIndex;
+        node.isLeaf = true;
+        node.childOrEmitterIndex = emitterIdx;
+        treeEmitters[emitterIdx].leafNodeIndex = task.nodeIndex;
+        nodes[task.nodeIndex] = node;
+        return false;
+    }
+
+    const uint32_t childIdx = task.firstDescendantIndex;
+    node.isLeaf = false;
+    node.childOrEmitterIndex = childIdx;
+    nodes[task.nodeIndex] = node;
+
+    // JP: 2要素のノードはどの分割でも同じ子になる。
+    // EN: A node with two items results in the same children with any split.
+    if (numItems == 2) {
+        childTasks[0] = LightTreeBuildTask{ task.begin, task.begin + 1, childIdx, task.nodeIndex, childIdx + 2 };
+        childTasks[1] = LightTreeBuildTask{ task.begin + 1, task.end, childIdx + 1, task.nodeIndex, childIdx + 2 };
+        return true;
+    }
+
+    // JP: 各軸についてビンに分けたSAOHを評価し、最小コストの分割を探す。
+    // EN: Evaluate the binned SAOH for each axis and find the split with the minimum cost.
+    const Vector3D nodeExtent = nodeBounds.aabb.maxP - nodeBounds.aabb.minP;
+    const float maxExtent = std::fmax(std::fmax(nodeExtent.x, nodeExtent.y), nodeExtent.z);
+    const Vector3D centroidExtent = centroidAabb.maxP - centroidAabb.minP;
+    const auto binItems = [&](uint32_t begin, uint32_t end, LightTreeBinSet &bins) {
+        for (uint32_t axis = 0; axis < 3; ++axis) {
+            if (!(centroidExtent[axis] > 0.0f))
+                continue;
+            for (uint32_t i = begin; i < end; ++i)
+                bins[axis][computeLightTreeBinIndex(items[i], axis, centroidAabb, centroidExtent)].unify(items[i]);
+        }
+    };
+    LightTreeBinSet bins;
+    if (parallel) {
+        std::vector<LightTreeBinSet> blockBins(numBlocks);
+        forEachLightTreeBlock(
+            task.begin, task.end,
+            [&](uint32_t blockIdx, uint32_t begin, uint32_t end) {
+                binItems(begin, end, blockBins[blockIdx]);
+            });
+        for (uint32_t blockIdx = 0; blockIdx < numBlocks; ++blockIdx) {
+            for (uint32_t axis = 0; axis < 3; ++axis) {
+                for (uint32_t b = 0; b < lightTreeNumBins; ++b)
+                    bins[axis][b].unify(blockBins[blockIdx][axis][b]);
+            }
+        }
+    }
+    else {
+        binItems(task.begin, task.end, bins);
+    }
+
+    float minCost = INFINITY;
+    uint32_t bestAxis = 0;
+    uint32_t bestSplit = 0;
+    for (uint32_t axis = 0; axis < 3; ++axis) {
+        if (!(centroidExtent[axis] > 0.0f))
+            continue;
+
+        const std::array<LightTreeBounds, lightTreeNumBins> &axisBins = bins[axis];
+        LightTreeBounds rightBounds[lightTreeNumBins];
+        rightBounds[lightTreeNumBins - 1] = axisBins[lightTreeNumBins - 1];
+        for (int32_t b = lightTreeNumBins - 2; b >= 1; --b) {
+            rightBounds[b] = axisBins[b];
+            rightBounds[b].unify(rightBounds[b + 1]);
+        }
+
+        const float lengthRatio = maxExtent / std::fmax(nodeExtent[axis], 1e-20f);
+        LightTreeBounds leftBounds;
+        for (uint32_t split = 1; split < lightTreeNumBins; ++split) {
+            leftBounds.unify(axisBins[split - 1]);
+            if (!leftBounds.aabb.isValid() || !rightBounds[split].aabb.isValid())
+                continue;
+            const float cost =
+                evaluateLightTreeSplitCost(leftBounds, lengthRatio) +
+                evaluateLightTreeSplitCost(rightBounds[split], lengthRatio);
+            if (cost < minCost) {
+                minCost = cost;
+                bestAxis = axis;
+                bestSplit = split;
+            }
+        }
+    }
+
+    uint32_t mid;
+    if (minCost < INFINITY) {
+        const auto isLeft = [&](const LightTreeBuildItem &item) {
+            return computeLightTreeBinIndex(item, bestAxis, centroidAabb, centroidExtent) < bestSplit;
+        };
+        if (parallel) {
+            // JP: ブロックごとに左側の要素数を数え、順序を保ったまま作業領域へ振り分けてから書き戻す。
+            // EN: Count the left items per block,
+            //     then scatter to the work area preserving the order and write back.
+            std::vector<uint32_t> leftOffsets(numBlocks + 1, 0);
+            forEachLightTreeBlock(
+                task.begin, task.end,
+                [&](uint32_t blockIdx, uint32_t begin, uint32_t end) {
+                    uint32_t numLefts = 0;
+                    for (uint32_t i = begin; i < end; ++i)
+                        numLefts += isLeft(items[i]) ? 1 : 0;
+                    leftOffsets[blockIdx + 1] = numLefts;
+                });
+            for (uint32_t blockIdx = 0; blockIdx < numBlocks; ++blockIdx)
+                leftOffsets[blockIdx + 1] += leftOffsets[blockIdx];
+            const uint32_t numLefts = leftOffsets[numBlocks];
+            forEachLightTreeBlock(
+                task.begin, task.end,
+                [&](uint32_t blockIdx, uint32_t begin, uint32_t end) {
+                    uint32_t leftIdx = task.begin + leftOffsets[blockIdx];
+                    uint32_t rightIdx = task.begin + numLefts + (begin - task.begin) - leftOffsets[blockIdx];
+                    for (uint32_t i = begin; i < end; ++i) {
+                        if (isLeft(items[i]))
+                            workItems[leftIdx++] = items[i];
+                        else
+                            workItems[rightIdx++] = items[i];
+                    }
+                });
+            forEachLightTreeBlock(
+                task.begin, task.end,
+                [&](uint32_t blockIdx, uint32_t begin, uint32_t end) {
+                    std::copy(workItems + begin, workItems + end, items + begin);
+                });
+            mid = task.begin + numLefts;
+        }
+        else {
+            LightTreeBuildItem* const midItem = std::partition(items + task.begin, items + task.end, isLeft);
+            mid = static_cast<uint32_t>(midItem - items);
+        }
+    }
+    else {
+        // JP: 有効な分割が無い(重心が重なっているなど)場合は最長軸で要素数を半分に分ける。
+        // EN: Split into halves by count along the longest axis when there is no valid split
+        //     (e.g. overlapping centroids).
+        uint32_t axis = 0;
+        if (centroidExtent.y > centroidExtent[axis])
+            axis = 1;
+        if (centroidExtent.z > centroidExtent[axis])
+            axis = 2;
+        mid = (task.begin + task.end) / 2;
+        std::nth_element(
+            items + task.begin, items + mid, items + task.end,
+            [axis](const LightTreeBuildItem &a, const LightTreeBuildItem &b) {
+                return a.centroid[axis] < b.centroid[axis];
+            });
+    }
+    Assert(mid > task.begin && mid < task.end, "Invalid split.");
+
+    childTasks[0] = LightTreeBuildTask{ task.begin, mid, childIdx, task.nodeIndex, childIdx + 2 };
+    childTasks[1] = LightTreeBuildTask{
+        mid, task.end, childIdx + 1, task.nodeIndex, childIdx + 2 + 2 * (mid - task.begin) - 2 };
+    return true;
+}
+
+template <typename Storage, typename T>
+static void uploadLightTreeBuffer(
+    CUcontext cuContext, typename Storage::template Buffer<T> &buffer, const std::vector<T> &values) {
+    if (values.empty())
+        return;
+    const uint32_t numValues = static_cast<uint32_t>(values.size());
+    if (!buffer.isInitialized() || buffer.numElements() < numValues) {
+        if (buffer.isInitialized())
+            buffer.finalize();
+        buffer.initialize(cuContext, cudau::BufferType::Device, numValues);
+    }
+    if constexpr (std::is_same_v<Storage, DeviceMemoryStorage>) {
+        buffer.write(values);
+    }
+    else {
+        T* dstValues = buffer.map();
+        std::copy(values.cbegin(), values.cend(), dstValues);
+        buffer.unmap();
+    }
+}
+
+template <typename Storage>
+void LightTreeTemplate<Storage>::build(CUcontext cuContext, const EmitterRegistry &registry) {
+    constexpr uint32_t minChunkSize = 1 << 12;
+
+    StopWatchHiRes sw;
+
+    sw.start();
+    const uint32_t numEmitters = registry.getNumEmitters();
+    const Point3D* const positions[3] = {
+        registry.getPositions(0), registry.getPositions(1), registry.getPositions(2)
+    };
+    const float* const areas = registry.getAreas();
+    const RGB* const emittances = registry.getEmittances();
+    const uint32_t* const instSlots = registry.getInstSlots();
+    const uint32_t* const geomInstSlots = registry.getGeomInstSlots();
+    const uint32_t* const primIndices = registry.getPrimIndices();
+
+    // JP: ヒットしたエミッターのインデックスを求めるための範囲を記録する。
+    // EN: Record the ranges to find the index of a hit emitter.
+    std::vector<uint2> instRanges;
+    std::vector<uint2> geomInstEmitterBases;
+    for (uint32_t emitterIdx = 0; emitterIdx < numEmitters; ++emitterIdx) {
+        const uint32_t instSlot = instSlots[emitterIdx];
+        const uint32_t geomInstSlot = geomInstSlots[emitterIdx];
+        const bool newInst = emitterIdx == 0 || instSlot != instSlots[emitterIdx - 1];
+        const bool newGeomInst = newInst || geomInstSlot != geomInstSlots[emitterIdx - 1];
+        if (newInst) {
+            if (instSlot >= instRanges.size())
+                instRanges.resize(instSlot + 1, uint2(0, 0));
+            Assert(instRanges[instSlot].y == 0,
+                   "Emitters of the instance %u are not contiguous.", instSlot);
+            instRanges[instSlot].x = static_cast<uint32_t>(geomInstEmitterBases.size());
+        }
+        if (newGeomInst) {
+            Assert(primIndices[emitterIdx] == 0,
+                   "Emitters of the geometry instance %u don't start from the first primitive.",
+                   geomInstSlot);
+            geomInstEmitterBases.push_back(uint2(geomInstSlot, emitterIdx));
+            ++instRanges[instSlot].y;
+        }
+        else {
+            Assert(primIndices[emitterIdx] == primIndices[emitterIdx - 1] + 1,
+                   "Emitters of the geometry instance %u are not in primitive order.",
+                   geomInstSlot);
+        }
+    }
+
+    // JP: パワーがゼロ、もしくは面積がゼロのエミッターはツリーに含めない。
+    //     チャンクごとに有効な要素数を数えて書き込み位置を求め、エミッター順のまま詰める。
+    // EN: Don't include emitters with zero power or zero area in the tree.
+    //     Count the valid items per chunk to compute the write offsets, then compact them in emitter order.
+    std::vector<shared::LightTreeEmitter> treeEmitters(numEmitters);
+    const auto isValidEmitter = [&](uint32_t emitterIdx) {
+        return areas[emitterIdx] > 0.0f && sRGB_calcLuminance(emittances[emitterIdx]) > 0.0f;
+    };
+    const uint32_t numChunks = computeNumParallelChunks(numEmitters, minChunkSize);
+    std::vector<uint32_t> itemOffsets(numChunks + 1, 0);
+    parallelForChunks(
+        0, numEmitters, minChunkSize,
+        [&](uint32_t chunkIdx, uint32_t begin, uint32_t end) {
+            uint32_t numItems = 0;
+            for (uint32_t emitterIdx = begin; emitterIdx < end; ++emitterIdx) {
+                shared::LightTreeEmitter &treeEmitter = treeEmitters[emitterIdx];
+                treeEmitter.instSlot = instSlots[emitterIdx];
+                treeEmitter.geomInstSlot = geomInstSlots[emitterIdx];
+                treeEmitter.primIndex = primIndices[emitterIdx];
+                treeEmitter.leafNodeIndex = 0xFFFFFFFF;
+                numItems += isValidEmitter(emitterIdx) ? 1 : 0;
+            }
+            itemOffsets[chunkIdx + 1] = numItems;
+        });
+    for (uint32_t chunkIdx = 0; chunkIdx < numChunks; ++chunkIdx)
+        itemOffsets[chunkIdx + 1] += itemOffsets[chunkIdx];
+    const uint32_t numItems = itemOffsets[numChunks];
+
+    std::vector<LightTreeBuildItem> items(numItems);
+    parallelForChunks(
+        0, numEmitters, minChunkSize,
+        [&](uint32_t chunkIdx, uint32_t begin, uint32_t end) {
+            uint32_t itemIdx = itemOffsets[chunkIdx];
+            for (uint32_t emitterIdx = begin; emitterIdx < end; ++emitterIdx) {
+                if (!isValidEmitter(emitterIdx))
+                    continue;
+                const Point3D p[3] = {
+                    positions[0][emitterIdx], positions[1][emitterIdx], positions[2][emitterIdx]
+                };
+                LightTreeBuildItem &item = items[itemIdx++];
+                item.aabb = AABB();
+                item.aabb.unify(p[0]).unify(p[1]).unify(p[2]);
+                item.centroid = (p[0] + p[1] + p[2]) / 3.0f;
+                item.normal = normalize(Normal3D(cross(p[1] - p[0], p[2] - p[0])));
+                item.power = sRGB_calcLuminance(emittances[emitterIdx]) * areas[emitterIdx];
+                item.emitterIndex = emitterIdx;
+            }
+        });
+    const uint32_t mSetUp = sw.stop();
+
+    // JP: 大きなノードはブロック単位で並列に分割し、小さくなったノードは部分木のタスクとして残す。
+    //     退化した入力で深くなり得るので、再帰ではなく明示的なスタックで構築する。
+    // EN: Split large nodes in parallel per block and leave nodes that become small as subtree tasks.
+    //     Build with an explicit stack instead of recursion since degenerate input can make the tree deep.
+    sw.start();
+    const uint32_t numNodes = numItems > 0 ? 2 * numItems - 1 : 0;
+    std::vector<shared::LightTreeNode> nodes(numNodes);
+    std::vector<LightTreeBuildTask> subtreeTasks;
+    if (numItems > 0) {
+        std::vector<LightTreeBuildItem> workItems(numItems > lightTreeBlockSize ? numItems : 0);
+        std::vector<LightTreeBuildTask> stack;
+        stack.push_back(LightTreeBuildTask{ 0, numItems, 0, 0, 1 });
+        while (!stack.empty()) {
+            const LightTreeBuildTask task = stack.back();
+            stack.pop_back();
+            if (task.end - task.begin <= lightTreeSubtreeSize) {
+                subtreeTasks.push_back(task);
+                continue;
+            }
+            LightTreeBuildTask childTasks[2];
+            if (splitLightTreeNode(
+                task, items.data(), workItems.data(), nodes.data(), treeEmitters.data(), childTasks)) {
+                stack.push_back(childTasks[1]);
+                stack.push_back(childTasks[0]);
+            }
+        }
+    }
+    const uint32_t mTopLevelSplits = sw.stop();
+
+    // JP: 部分木は互いに素な要素とノードの範囲を持つので、大きい順にスレッドが取り出して独立に構築する。
+    // EN: Subtrees have disjoint ranges of items and nodes,
+    //     so threads pick them up in descending order of size and build them independently.
+    sw.start();
+    std::sort(
+        subtreeTasks.begin(), subtreeTasks.end(),
+        [](const LightTreeBuildTask &a, const LightTreeBuildTask &b) {
+            return a.end - a.begin > b.end - b.begin;
+        });
+    std::atomic<uint32_t> nextSubtreeIdx = 0;
+    parallelForChunks(
+        0, static_cast<uint32_t>(subtreeTasks.size()), 1,
+        [&](uint32_t chunkIdx, uint32_t begin, uint32_t end) {
+            std::vector<LightTreeBuildTask> stack;
+            while (true) {
+                const uint32_t subtreeIdx = nextSubtreeIdx++;
+                if (subtreeIdx >= subtreeTasks.size())
+                    break;
+                stack.push_back(subtreeTasks[subtreeIdx]);
+                while (!stack.empty()) {
+                    const LightTreeBuildTask task = stack.back();
+                    stack.pop_back();
+                    LightTreeBuildTask childTasks[2];
+                    if (splitLightTreeNode(
+                        task, items.data(), nullptr, nodes.data(), treeEmitters.data(), childTasks)) {
+                        stack.push_back(childTasks[1]);
+                        stack.push_back(childTasks[0]);
+                    }
+                }
+            }
+        });
+    const uint32_t mSubtrees = sw.stop();
+
+    sw.start();
+    uploadLightTreeBuffer<Storage>(cuContext, m_nodes, nodes);
+    uploadLightTreeBuffer<Storage>(cuContext, m_emitters, treeEmitters);
+    uploadLightTreeBuffer<Storage>(cuContext, m_instRanges, instRanges);
+    uploadLightTreeBuffer<Storage>(cuContext, m_geomInstEmitterBases, geomInstEmitterBases);
+    m_numNodes = numNodes;
+    m_numEmitters = numEmitters;
+    m_numInstRanges = static_cast<uint32_t>(instRanges.size());
+    m_isInitialized = true;
+    const uint32_t mUpload = sw.stop();
+
+    m_buildTimings.setUp = sw.getMeasurement(mSetUp, StopWatchDurationType::Microseconds) * 1e-3f;
+    m_buildTimings.topLevelSplits = sw.getMeasurement(mTopLevelSplits, StopWatchDurationType::Microseconds) * 1e-3f;
+    m_buildTimings.subtrees = sw.getMeasurement(mSubtrees, StopWatchDurationType::Microseconds) * 1e-3f;
+    m_buildTimings.upload = sw.getMeasurement(mUpload, StopWatchDurationType::Microseconds) * 1e-3f;
+}
+
+template class LightTreeTemplate<DeviceMemoryStorage>;
+template class LightTreeTemplate<HostMemoryStorage>;
+
+int32_t benchmarkLightTreeBuilds(uint32_t maxNumEmitters) {
+    StopWatchHiRes sw;
+    const auto measure = [&sw](const auto &func) {
+        sw.start();
+        func();
+        return sw.getMeasurement(sw.stop(), StopWatchDurationType::Microseconds) * 1e-3f;
+    };
+
+    // JP: 1024個の発光三角形を持つジオメトリーを16種類作り、ランダムに配置したインスタンスで共有する。
+    //     三角形は単位立方体の中にランダムな向きで置き、放射輝度もランダムにする。
+    // EN: Make 16 kinds of geometries with 1024 emissive triangles each
+    //     and share them among randomly placed instances.
+    //     Triangles are placed in a unit cube with random orientations, and emittances are also random.
+    constexpr uint32_t numTrianglesPerGeom = 1024;
+    constexpr uint32_t numGeoms = 16;
+    std::mt19937 rng(320584712);
+    std::uniform_real_distribution<float> u01;
+    EmitterRegistry registry;
+    {
+        std::vector<shared::Vertex> vertices(3 * numTrianglesPerGeom);
+        std::vector<shared::Triangle> triangles(numTrianglesPerGeom);
+        std::vector<RGB> emittances(numTrianglesPerGeom);
+        for (uint32_t geomIdx = 0; geomIdx < numGeoms; ++geomIdx) {
+            for (uint32_t triIdx = 0; triIdx < numTrianglesPerGeom; ++triIdx) {
+                const Point3D center(u01(rng), u01(rng), u01(rng));
+                Point3D p[3];
+                for (int i = 0; i < 3; ++i)
+                    p[i] = center + 0.05f * Vector3D(u01(rng) - 0.5f, u01(rng) - 0.5f, u01(rng) - 0.5f);
+                const Normal3D n(normalize(cross(p[1] - p[0], p[2] - p[0])));
+                for (int i = 0; i < 3; ++i) {
+                    shared::Vertex &v = vertices[3 * triIdx + i];
+                    v.position = p[i];
+                    v.normal = n;
+                    v.texCoord0Dir = Vector3D(1, 0, 0);
+                    v.texCoord = Point2D(0.0f, 0.0f);
+                }
+                triangles[triIdx] = shared::Triangle{ 3 * triIdx + 0, 3 * triIdx + 1, 3 * triIdx + 2 };
+                emittances[triIdx] = RGB(u01(rng), u01(rng), u01(rng)) * (u01(rng) < 0.05f ? 100.0f : 1.0f);
+            }
+            registry.setGeometryEmitters(
+                geomIdx, vertices.data(), triangles.data(), emittances.data(), numTrianglesPerGeom);
+        }
+    }
+
+    hpprintf("Light tree builds on the host (%u threads)\n", std::max(std::thread::hardware_concurrency(), 1u));
+    hpprintf("%10s | %12s | %12s | %12s | %12s | %12s | %s\n",
+             "#emitters", "table", "set up", "top splits", "subtrees", "total", "valid");
+
+    bool allValid = true;
+    for (uint64_t numEmitters = numTrianglesPerGeom; numEmitters <= maxNumEmitters; numEmitters *= 4) {
+        const uint32_t numInsts = static_cast<uint32_t>(numEmitters / numTrianglesPerGeom);
+        const float sceneExtent = 4.0f * std::cbrt(static_cast<float>(numInsts));
+        registry.clearInstanceGeometries();
+        for (uint32_t instIdx = 0; instIdx < numInsts; ++instIdx) {
+            const Quaternion orientation = qRotate(
+                2 * pi_v<float> * u01(rng), u01(rng) - 0.5f, u01(rng) - 0.5f, u01(rng) - 0.5f);
+            const Point3D position(
+                sceneExtent * u01(rng), sceneExtent * u01(rng), sceneExtent * u01(rng));
+            const float scale = 0.5f + u01(rng);
+            registry.addInstanceGeometry(
+                instIdx, instIdx % numGeoms, Matrix4x4(scale * orientation.toMatrix3x3(), position));
+        }
+        const float tableTime = measure([&]() {
+            registry.updateTable();
+        });
+
+        HostLightTree lightTree;
+        lightTree.build(nullptr, registry);
+        const HostLightTree::BuildTimings &timings = lightTree.getBuildTimings();
+        const float buildTime = timings.setUp + timings.topLevelSplits + timings.subtrees + timings.upload;
+
+        // JP: 全てのエミッターが有効なので、2分木のノード数は2N - 1になるはず。
+        // EN: All the emitters are valid, so the binary tree should have 2N - 1 nodes.
+        const bool valid =
+            lightTree.getNumEmitters() == numEmitters && lightTree.getNumNodes() == 2 * numEmitters - 1;
+        allValid &= valid;
+        lightTree.finalize();
+
+        hpprintf("%10llu | %9.3f ms | %9.3f ms | %9.3f ms | %9.3f ms | %9.3f ms | %s\n",
+                 static_cast<unsigned long long>(numEmitters),
+                 tableTime, timings.setUp, timings.topLevelSplits, timings.subtrees, tableTime + buildTime,
+                 valid ? "yes" : "NO");
+    }
+
+    return allValid ? 0 : -1;
+}
+
+
+
+void InstanceControllerSystem::initialize(const std::vector<InstanceController*> &controllers) {
+    finalize();
+
+    // JP: スロット順に並べてステージングバッファー上の連続区間がデバイス上の連続区間に対応するようにする。
+    // EN: Sort in slot order so that contiguous ranges in the staging buffer correspond to contiguous ranges on the device.
+    std::vector<InstanceController*> sortedControllers(controllers.cbegin(), controllers.cend());
+    std::sort(
+        sortedControllers.begin(), sortedControllers.end(),
+        [](const InstanceController* a, const InstanceController* b) {
+        return a->inst->instSlot < b->inst->instSlot;
+    });
+
+    m_numControllers = static_cast<uint32_t>(sortedControllers.size());
+    if (m_numControllers == 0)
+        return;
+
+    m_controllers = sortedControllers;
+    m_insts.resize(m_numControllers);
+    m_times.resize(m_numControllers);
+    m_frequencies.resize(m_numControllers);
+    m_beginScales.resize(m_numControllers);
+    m_endScales.resize(m_numControllers);
+    for (int i = 0; i < 4; ++i) {
+        m_beginOrientations[i].resize(m_numControllers);
+        m_endOrientations[i].resize(m_numControllers);
+    }
+    for (int i = 0; i < 3; ++i) {
+        m_beginPositions[i].resize(m_numControllers);
+        m_endPositions[i].resize(m_numControllers);
+    }
+    for (int i = 0; i < 12; ++i) {
+        m_groupTransforms[i].resize(m_numControllers);
+        m_transforms[i].resize(m_numControllers);
+    }
+
+    for (uint32_t i = 0; i < m_numControllers; ++i) {
+        const InstanceController* controller = m_controllers[i];
+        Instance* inst = controller->inst;
+        Assert(i == 0 || inst->instSlot != m_insts[i - 1]->instSlot,
+               "Multiple controllers for the instance slot %u.", inst->instSlot);
+        m_insts[i] = inst;
+        m_times[i] = controller->time;
+        m_frequencies[i] = controller->frequency;
+        m_beginScales[i] = controller->beginScale;
+        m_endScales[i] = controller->endScale;
+        const Quaternion &q0 = controller->beginOrientation;
+        const Quaternion &q1 = controller->endOrientation;
+        m_beginOrientations[0][i] = q0.x;
+        m_beginOrientations[1][i] = q0.y;
+        m_beginOrientations[2][i] = q0.z;
+        m_beginOrientations[3][i] = q0.w;
+        m_endOrientations[0][i] = q1.x;
+        m_endOrientations[1][i] = q1.y;
+        m_endOrientations[2][i] = q1.z;
+        m_endOrientations[3][i] = q1.w;
+        m_beginPositions[0][i] = controller->beginPosition.x;
+        m_beginPositions[1][i] = controller->beginPosition.y;
+        m_beginPositions[2][i] = controller->beginPosition.z;
+        m_endPositions[0][i] = controller->endPosition.x;
+        m_endPositions[1][i] = controller->endPosition.y;
+        m_endPositions[2][i] = controller->endPosition.z;
+
+        const Matrix4x4 &groupTransform = inst->geomGroupInst.transform;
+        const Matrix4x4 &transform = inst->matM2W;
+        Assert(groupTransform.m30 == 0.0f && groupTransform.m31 == 0.0f &&
+               groupTransform.m32 == 0.0f && groupTransform.m33 == 1.0f,
+               "Group transform is not affine.");
+        for (int row = 0; row < 3; ++row) {
+            for (int col = 0; col < 4; ++col) {
+                m_groupTransforms[4 * row + col][i] = groupTransform[col][row];
+                m_transforms[4 * row + col][i] = transform[col][row];
+            }
+        }
+
+        if (m_slotRuns.empty() ||
+            m_slotRuns.back().slot + m_slotRuns.back().count != inst->instSlot)
+            m_slotRuns.push_back(SlotRun{ inst->instSlot, i, 0 });
+        ++m_slotRuns.back().count;
+    }
+
+    for (int i = 0; i < m_stagingBuffers.size(); ++i) {
+        CUDADRV_CHECK(cuMemAllocHost(
+            reinterpret_cast<void**>(&m_stagingBuffers[i]), m_numControllers * sizeof(TransformData)));
+    }
+}
+
+void InstanceControllerSystem::initializeWithRandomParameters(uint32_t numControllers, uint32_t seed) {
+    finalize();
+
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> u01;
+    const auto randomOrientation = [&]() {
+        return qRotate(2 * pi_v<float> * u01(rng), u01(rng) - 0.5f, u01(rng) - 0.5f, u01(rng) - 0.5f);
+    };
+
+    m_numControllers = numControllers;
+    m_times.resize(m_numControllers);
+    m_frequencies.resize(m_numControllers);
+    m_beginScales.resize(m_numControllers);
+    m_endScales.resize(m_numControllers);
+    for (int i = 0; i < 4; ++i) {
+        m_beginOrientations[i].resize(m_numControllers);
+        m_endOrientations[i].resize(m_numControllers);
+    }
+    for (int i = 0; i < 3; ++i) {
+        m_beginPositions[i].resize(m_numControllers);
+        m_endPositions[i].resize(m_numControllers);
+    }
+    for (int i = 0; i < 12; ++i) {
+        m_groupTransforms[i].resize(m_numControllers);
+        m_transforms[i].resize(m_numControllers);
+    }
+
+    for (uint32_t i = 0; i < m_numControllers; ++i) {
+        m_frequencies[i] = 1.0f + 4.0f * u01(rng);
+        m_times[i] = m_frequencies[i] * u01(rng);
+        m_beginScales[i] = 0.5f + u01(rng);
+        m_endScales[i] = 0.5f + u01(rng);
+        // JP: Slerp()の正規化線形補間の分岐も通るように、一部は終端の姿勢を始端のすぐ近くにする。
+        // EN: Make the end orientation very close to the beginning for some
+        //     so that the normalized linear interpolation branch of Slerp() is also exercised.
+        const Quaternion q0 = randomOrientation();
+        const Quaternion q1 = i % 4 == 0 ?
+            normalize(q0 + Quaternion(0.01f * (u01(rng) - 0.5f), 0.0f, 0.0f, 0.0f)) :
+            randomOrientation();
+        m_beginOrientations[0][i] = q0.x;
+        m_beginOrientations[1][i] = q0.y;
+        m_beginOrientations[2][i] = q0.z;
+        m_beginOrientations[3][i] = q0.w;
+        m_endOrientations[0][i] = q1.x;
+        m_endOrientations[1][i] = q1.y;
+        m_endOrientations[2][i] = q1.z;
+        m_endOrientations[3][i] = q1.w;
+        for (int c = 0; c < 3; ++c) {
+            m_beginPositions[c][i] = 10 * (u01(rng) - 0.5f);
+            m_endPositions[c][i] = 10 * (u01(rng) - 0.5f);
+        }
+
+        const Matrix4x4 groupTransform(
+            (0.5f + u01(rng)) * randomOrientation().toMatrix3x3(),
+            Point3D(u01(rng) - 0.5f, u01(rng) - 0.5f, u01(rng) - 0.5f));
+        for (int row = 0; row < 3; ++row) {
+            for (int col = 0; col < 4; ++col) {
+                m_groupTransforms[4 * row + col][i] = groupTransform[col][row];
+                m_transforms[4 * row + col][i] = groupTransform[col][row];
+            }
+        }
+    }
+}
+
+void InstanceControllerSystem::finalize() {
+    if (m_stagingBuffers[0]) {
+        // JP: 転送中の可能性があるステージングバッファーを解放する前に完了を待つ。
+        // EN: Wait for completion before freeing staging buffers that may be in flight.
+        CUDADRV_CHECK(cuCtxSynchronize());
+        for (int i = static_cast<int>(m_stagingBuffers.size()) - 1; i >= 0; --i) {
+            CUDADRV_CHECK(cuMemFreeHost(m_stagingBuffers[i]));
+            m_stagingBuffers[i] = nullptr;
+        }
+    }
+    // JP: 時間はupdate()でm_timesのみが進むので、再初期化で巻き戻らないようにコントローラーへ書き戻す。
+    // EN: update() advances only m_times, so write the times back to the controllers
+    //     so that re-initialization does not rewind them.
+    for (uint32_t i = 0; i < m_controllers.size(); ++i)
+        m_controllers[i]->time = m_times[i];
+    m_slotRuns.clear();
+    m_controllers.clear();
+    m_insts.clear();
+    m_numControllers = 0;
+}
+
+// JP: 従来のInstanceController単体の更新と同じ計算。AVX2が使えない場合と端数の処理に使う。
+// EN: The same computation as the former per-InstanceController update.
+//     Used when AVX2 is not available and for the remainder.
+void InstanceControllerSystem::evaluate(uint32_t begin, uint32_t end, float dt, TransformData* dst) {
+    for (uint32_t i = begin; i < end; ++i) {
+        const float frequency = m_frequencies[i];
+        const float time = std::fmod(m_times[i] + dt, frequency);
+        m_times[i] = time;
+        const float t = 0.5f - 0.5f * std::cos(2 * pi_v<float> * time / frequency);
+
+        const float scale = (1 - t) * m_beginScales[i] + t * m_endScales[i];
+        const Quaternion orientation = Slerp(
+            t,
+            Quaternion(m_beginOrientations[0][i], m_beginOrientations[1][i],
+                       m_beginOrientations[2][i], m_beginOrientations[3][i]),
+            Quaternion(m_endOrientations[0][i], m_endOrientations[1][i],
+                       m_endOrientations[2][i], m_endOrientations[3][i]));
+        const Point3D position(
+            (1 - t) * m_beginPositions[0][i] + t * m_endPositions[0][i],
+            (1 - t) * m_beginPositions[1][i] + t * m_endPositions[1][i],
+            (1 - t) * m_beginPositions[2][i] + t * m_endPositions[2][i]);
+        const Matrix3x3 matRot = orientation.toMatrix3x3();
+
+        Matrix4x4 groupTransform;
+        Matrix4x4 prevTransform;
+        for (int row = 0; row < 3; ++row) {
+            for (int col = 0; col < 4; ++col) {
+                groupTransform[col][row] = m_groupTransforms[4 * row + col][i];
+                prevTransform[col][row] = m_transforms[4 * row + col][i];
+            }
+        }
+
+        const Matrix4x4 transform = Matrix4x4(matRot * scale, position) * groupTransform;
+        for (int row = 0; row < 3; ++row) {
+            for (int col = 0; col < 4; ++col)
+                m_transforms[4 * row + col][i] = transform[col][row];
+        }
+
+        TransformData &data = dst[i];
+        data.transform = transform;
+        data.curToPrevTransform = prevTransform * invert(transform);
+        data.normalMatrix = matRot / scale;
+        data.uniformScale = length(Vector3D(transform.c0));
+    }
+}
+
+// JP: sse_mathfunのsincos_psと同じ範囲縮小とCephesの多項式による近似。
+// EN: Approximation with the same range reduction as sse_mathfun's sincos_ps and Cephes' polynomials.
+static inline void sincos_AVX2(__m256 x, __m256* s, __m256* c) {
+    const __m256 signMask = _mm256_set1_ps(-0.0f);
+    __m256 signSin = _mm256_and_ps(x, signMask);
+    x = _mm256_andnot_ps(signMask, x);
+
+    __m256i j = _mm256_cvttps_epi32(_mm256_mul_ps(x, _mm256_set1_ps(1.27323954473516f)));
+    j = _mm256_and_si256(_mm256_add_epi32(j, _mm256_set1_epi32(1)), _mm256_set1_epi32(~1));
+    const __m256 y = _mm256_cvtepi32_ps(j);
+    signSin = _mm256_xor_ps(
+        signSin,
+        _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_and_si256(j, _mm256_set1_epi32(4)), 29)));
+    const __m256 signCos = _mm256_castsi256_ps(_mm256_slli_epi32(
+        _mm256_andnot_si256(_mm256_sub_epi32(j, _mm256_set1_epi32(2)), _mm256_set1_epi32(4)), 29));
+    const __m256 useSinPoly = _mm256_castsi256_ps(
+        _mm256_cmpeq_epi32(_mm256_and_si256(j, _mm256_set1_epi32(2)), _mm256_setzero_si256()));
+
+    x = _mm256_sub_ps(x, _mm256_mul_ps(y, _mm256_set1_ps(0.78515625f)));
+    x = _mm256_sub_ps(x, _mm256_mul_ps(y, _mm256_set1_ps(2.4187564849853515625e-4f)));
+    x = _mm256_sub_ps(x, _mm256_mul_ps(y, _mm256_set1_ps(3.77489497744594108e-8f)));
+    const __m256 z = _mm256_mul_ps(x, x);
+
+    __m256 yc = _mm256_set1_ps(2.443315711809948e-5f);
+    yc = _mm256_add_ps(_mm256_mul_ps(yc, z), _mm256_set1_ps(-1.388731625493765e-3f));
+    yc = _mm256_add_ps(_mm256_mul_ps(yc, z), _mm256_set1_ps(4.166664568298827e-2f));
+    yc = _mm256_mul_ps(_mm256_mul_ps(yc, z), z);
+    yc = _mm256_add_ps(
+        _mm256_sub_ps(yc, _mm256_mul_ps(z, _mm256_set1_ps(0.5f))), _mm256_set1_ps(1.0f));
+
+    __m256 ys = _mm256_set1_ps(-1.9515295891e-4f);
+    ys = _mm256_add_ps(_mm256_mul_ps(ys, z), _mm256_set1_ps(8.3321608736e-3f));
+    ys = _mm256_add_ps(_mm256_mul_ps(ys, z), _mm256_set1_ps(-1.6666654611e-1f));
+    ys = _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(ys, z), x), x);
+
+    *s = _mm256_xor_ps(_mm256_blendv_ps(yc, ys, useSinPoly), signSin);
+    *c = _mm256_xor_ps(_mm256_blendv_ps(ys, yc, useSinPoly), signCos);
+}
+
+// JP: Cephesのacosfと同じ範囲分割と多項式による近似。入力は[-1, 1]であること。
+// EN: Approximation with the same range splitting and polynomial as Cephes' acosf. The input must be in [-1, 1].
+static inline __m256 acos_AVX2(__m256 x) {
+    const __m256 signMask = _mm256_set1_ps(-0.0f);
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 ax = _mm256_andnot_ps(signMask, x);
+    const __m256 isLarge = _mm256_cmp_ps(ax, half, _CMP_GT_OQ);
+    const __m256 a = _mm256_blendv_ps(
+        ax, _mm256_sqrt_ps(_mm256_mul_ps(half, _mm256_sub_ps(_mm256_set1_ps(1.0f), ax))), isLarge);
+    const __m256 z = _mm256_mul_ps(a, a);
+    __m256 p = _mm256_set1_ps(4.2163199048e-2f);
+    p = _mm256_add_ps(_mm256_mul_ps(p, z), _mm256_set1_ps(2.4181311049e-2f));
+    p = _mm256_add_ps(_mm256_mul_ps(p, z), _mm256_set1_ps(4.5470025998e-2f));
+    p = _mm256_add_ps(_mm256_mul_ps(p, z), _mm256_set1_ps(7.4953002686e-2f));
+    p = _mm256_add_ps(_mm256_mul_ps(p, z), _mm256_set1_ps(1.6666752422e-1f));
+    const __m256 asinA = _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(p, z), a), a);
+
+    // JP: |x| > 0.5: x > 0ならば2 asin(a)、x < 0ならばπ - 2 asin(a)。
+    //     |x| <= 0.5: π/2 - asin(x)。
+    // EN: |x| > 0.5: 2 asin(a) if x > 0, π - 2 asin(a) if x < 0.
+    //     |x| <= 0.5: π/2 - asin(x).
+    const __m256 sign = _mm256_and_ps(x, signMask);
+    const __m256 large = _mm256_add_ps(
+        _mm256_and_ps(_mm256_set1_ps(pi_v<float>), _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_LT_OQ)),
+        _mm256_xor_ps(_mm256_add_ps(asinA, asinA), sign));
+    const __m256 small = _mm256_sub_ps(_mm256_set1_ps(0.5f * pi_v<float>), _mm256_xor_ps(asinA, sign));
+    return _mm256_blendv_ps(small, large, isLarge);
+}
+
+// JP: 8インスタンスずつSoAのまま評価する。アフィン行列の逆行列は余因子から直接求める。
+//     端数はスカラー版で処理する。
+// EN: Evaluate 8 instances at a time while keeping the SoA form.
+//     The inverse of an affine matrix is computed directly from cofactors.
+//     The remainder is processed by the scalar version.
+void InstanceControllerSystem::evaluate_AVX2(uint32_t begin, uint32_t end, float dt, TransformData* dst) {
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 two = _mm256_set1_ps(2.0f);
+    const __m256 signMask = _mm256_set1_ps(-0.0f);
+    const auto load = [](const std::vector<float> &v, uint32_t i) {
+        return _mm256_loadu_ps(v.data() + i);
+    };
+    const auto lerp = [&one](__m256 a, __m256 b, __m256 t) {
+        return _mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(one, t), a), _mm256_mul_ps(t, b));
+    };
+    const auto fmadd = [](__m256 a, __m256 b, __m256 c) {
+        return _mm256_add_ps(_mm256_mul_ps(a, b), c);
+    };
+
+    uint32_t i = begin;
+    for (; i + 8 <= end; i += 8) {
+        // JP: 時間を進めて[0, frequency)に折り返す。
+        // EN: Advance the time and wrap it into [0, frequency).
+        const __m256 frequency = load(m_frequencies, i);
+        __m256 time = _mm256_add_ps(load(m_times, i), _mm256_set1_ps(dt));
+        time = _mm256_sub_ps(
+            time,
+            _mm256_mul_ps(
+                _mm256_round_ps(_mm256_div_ps(time, frequency), _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC),
+                frequency));
+        _mm256_storeu_ps(m_times.data() + i, time);
+        __m256 sinPhase, cosPhase;
+        sincos_AVX2(
+            _mm256_div_ps(_mm256_mul_ps(_mm256_set1_ps(2 * pi_v<float>), time), frequency),
+            &sinPhase, &cosPhase);
+        const __m256 t = _mm256_sub_ps(_mm256_set1_ps(0.5f), _mm256_mul_ps(_mm256_set1_ps(0.5f), cosPhase));
+
+        const __m256 scale = lerp(load(m_beginScales, i), load(m_endScales, i), t);
+        const __m256 px = lerp(load(m_beginPositions[0], i), load(m_endPositions[0], i), t);
+        const __m256 py = lerp(load(m_beginPositions[1], i), load(m_endPositions[1], i), t);
+        const __m256 pz = lerp(load(m_beginPositions[2], i), load(m_endPositions[2], i), t);
+
+        // JP: Slerp()と同じく、ほぼ平行な場合は正規化線形補間、それ以外は直交成分を使った球面線形補間。
+        // EN: Same as Slerp(), normalized linear interpolation for nearly parallel cases,
+        //     spherical linear interpolation using the orthogonal component otherwise.
+        __m256 q0[4], q1[4];
+        for (int c = 0; c < 4; ++c) {
+            q0[c] = load(m_beginOrientations[c], i);
+            q1[c] = load(m_endOrientations[c], i);
+        }
+        const __m256 cosTheta = fmadd(q0[0], q1[0], fmadd(q0[1], q1[1], fmadd(q0[2], q1[2], _mm256_mul_ps(q0[3], q1[3]))));
+        const __m256 useNlerp = _mm256_cmp_ps(cosTheta, _mm256_set1_ps(0.9995f), _CMP_GT_OQ);
+        __m256 qLerp[4], qPerp[4];
+        for (int c = 0; c < 4; ++c) {
+            qLerp[c] = lerp(q0[c], q1[c], t);
+            qPerp[c] = _mm256_sub_ps(q1[c], _mm256_mul_ps(q0[c], cosTheta));
+        }
+        const auto normalize4 = [&fmadd](__m256 (&q)[4]) {
+            const __m256 len = _mm256_sqrt_ps(
+                fmadd(q[0], q[0], fmadd(q[1], q[1], fmadd(q[2], q[2], _mm256_mul_ps(q[3], q[3])))));
+            for (int c = 0; c < 4; ++c)
+                q[c] = _mm256_div_ps(q[c], len);
+        };
+        normalize4(qLerp);
+        normalize4(qPerp);
+        const __m256 theta = acos_AVX2(_mm256_min_ps(_mm256_max_ps(cosTheta, _mm256_set1_ps(-1.0f)), one));
+        __m256 sinThetaP, cosThetaP;
+        sincos_AVX2(_mm256_mul_ps(theta, t), &sinThetaP, &cosThetaP);
+        __m256 q[4];
+        for (int c = 0; c < 4; ++c) {
+            q[c] = _mm256_blendv_ps(
+                fmadd(q0[c], cosThetaP, _mm256_mul_ps(qPerp[c], sinThetaP)), qLerp[c], useNlerp);
+        }
+
+        // JP: Quaternion::toMatrix3x3()と同じ回転行列。r[row][col]
+        // EN: The same rotation matrix as Quaternion::toMatrix3x3(). r[row][col]
+        const __m256 xx = _mm256_mul_ps(q[0], q[0]), yy = _mm256_mul_ps(q[1], q[1]), zz = _mm256_mul_ps(q[2], q[2]);
+        const __m256 xy = _mm256_mul_ps(q[0], q[1]), yz = _mm256_mul_ps(q[1], q[2]), zx = _mm256_mul_ps(q[2], q[0]);
+        const __m256 xw = _mm256_mul_ps(q[0], q[3]), yw = _mm256_mul_ps(q[1], q[3]), zw = _mm256_mul_ps(q[2], q[3]);
+        __m256 r[3][3];
+        r[0][0] = _mm256_sub_ps(one, _mm256_mul_ps(two, _mm256_add_ps(yy, zz)));
+        r[1][0] = _mm256_mul_ps(two, _mm256_add_ps(xy, zw));
+        r[2][0] = _mm256_mul_ps(two, _mm256_sub_ps(zx, yw));
+        r[0][1] = _mm256_mul_ps(two, _mm256_sub_ps(xy, zw));
+        r[1][1] = _mm256_sub_ps(one, _mm256_mul_ps(two, _mm256_add_ps(xx, zz)));
+        r[2][1] = _mm256_mul_ps(two, _mm256_add_ps(yz, xw));
+        r[0][2] = _mm256_mul_ps(two, _mm256_add_ps(zx, yw));
+        r[1][2] = _mm256_mul_ps(two, _mm256_sub_ps(yz, xw));
+        r[2][2] = _mm256_sub_ps(one, _mm256_mul_ps(two, _mm256_add_ps(xx, yy)));
+
+        // JP: M = [s R | p] * G
+        // EN: M = [s R | p] * G
+        __m256 g[3][4];
+        for (int row = 0; row < 3; ++row) {
+            for (int col = 0; col < 4; ++col)
+                g[row][col] = load(m_groupTransforms[4 * row + col], i);
+        }
+        const __m256 p[3] = { px, py, pz };
+        __m256 m[3][4];
+        for (int row = 0; row < 3; ++row) {
+            const __m256 sr0 = _mm256_mul_ps(scale, r[row][0]);
+            const __m256 sr1 = _mm256_mul_ps(scale, r[row][1]);
+            const __m256 sr2 = _mm256_mul_ps(scale, r[row][2]);
+            for (int col = 0; col < 4; ++col) {
+                m[row][col] = fmadd(sr0, g[0][col], fmadd(sr1, g[1][col], _mm256_mul_ps(sr2, g[2][col])));
+            }
+            m[row][3] = _mm256_add_ps(m[row][3], p[row]);
+        }
+
+        // JP: M^-1 = [A^-1 | -A^-1 t]、A^-1は余因子行列の転置を行列式で割ったもの。
+        // EN: M^-1 = [A^-1 | -A^-1 t], where A^-1 is the transposed cofactor matrix divided by the determinant.
+        __m256 inv[3][4];
+        inv[0][0] = _mm256_sub_ps(_mm256_mul_ps(m[1][1], m[2][2]), _mm256_mul_ps(m[1][2], m[2][1]));
+        inv[0][1] = _mm256_sub_ps(_mm256_mul_ps(m[0][2], m[2][1]), _mm256_mul_ps(m[0][1], m[2][2]));
+        inv[0][2] = _mm256_sub_ps(_mm256_mul_ps(m[0][1], m[1][2]), _mm256_mul_ps(m[0][2], m[1][1]));
+        inv[1][0] = _mm256_sub_ps(_mm256_mul_ps(m[1][2], m[2][0]), _mm256_mul_ps(m[1][0], m[2][2]));
+        inv[1][1] = _mm256_sub_ps(_mm256_mul_ps(m[0][0], m[2][2]), _mm256_mul_ps(m[0][2], m[2][0]));
+        inv[1][2] = _mm256_sub_ps(_mm256_mul_ps(m[0][2], m[1][0]), _mm256_mul_ps(m[0][0], m[1][2]));
+        inv[2][0] = _mm256_sub_ps(_mm256_mul_ps(m[1][0], m[2][1]), _mm256_mul_ps(m[1][1], m[2][0]));
+        inv[2][1] = _mm256_sub_ps(_mm256_mul_ps(m[0][1], m[2][0]), _mm256_mul_ps(m[0][0], m[2][1]));
+        inv[2][2] = _mm256_sub_ps(_mm256_mul_ps(m[0][0], m[1][1]), _mm256_mul_ps(m[0][1], m[1][0]));
+        const __m256 recDet = _mm256_div_ps(
+            one,
+            fmadd(m[0][0], inv[0][0], fmadd(m[0][1], inv[1][0], _mm256_mul_ps(m[0][2], inv[2][0]))));
+        for (int row = 0; row < 3; ++row) {
+            for (int col = 0; col < 3; ++col)
+                inv[row][col] = _mm256_mul_ps(inv[row][col], recDet);
+            inv[row][3] = _mm256_xor_ps(
+                fmadd(inv[row][0], m[0][3], fmadd(inv[row][1], m[1][3], _mm256_mul_ps(inv[row][2], m[2][3]))),
+                signMask);
+        }
+
+        // JP: 前フレームの行列との積を取り、現在の行列を次回のために保存する。
+        // EN: Multiply with the previous-frame matrix, then save the current matrix for the next time.
+        __m256 curToPrev[3][4];
+        for (int row = 0; row < 3; ++row) {
+            const __m256 prev0 = load(m_transforms[4 * row + 0], i);
+            const __m256 prev1 = load(m_transforms[4 * row + 1], i);
+            const __m256 prev2 = load(m_transforms[4 * row + 2], i);
+            const __m256 prev3 = load(m_transforms[4 * row + 3], i);
+            for (int col = 0; col < 4; ++col) {
+                curToPrev[row][col] =
+                    fmadd(prev0, inv[0][col], fmadd(prev1, inv[1][col], _mm256_mul_ps(prev2, inv[2][col])));
+            }
+            curToPrev[row][3] = _mm256_add_ps(curToPrev[row][3], prev3);
+        }
+        for (int row = 0; row < 3; ++row) {
+            for (int col = 0; col < 4; ++col)
+                _mm256_storeu_ps(m_transforms[4 * row + col].data() + i, m[row][col]);
+        }
+
+        const __m256 uniformScale = _mm256_sqrt_ps(
+            fmadd(m[0][0], m[0][0], fmadd(m[1][0], m[1][0], _mm256_mul_ps(m[2][0], m[2][0]))));
+        const __m256 recScale = _mm256_div_ps(one, scale);
+
+        // JP: レーンごとに列優先の行列としてAoSのステージングバッファーへ書き出す。
+        // EN: Write out to the AoS staging buffer per lane as column-major matrices.
+        alignas(32) float mLanes[3][4][8];
+        alignas(32) float curToPrevLanes[3][4][8];
+        alignas(32) float nLanes[3][3][8];
+        alignas(32) float uniformScaleLanes[8];
+        for (int row = 0; row < 3; ++row) {
+            for (int col = 0; col < 4; ++col) {
+                _mm256_store_ps(mLanes[row][col], m[row][col]);
+                _mm256_store_ps(curToPrevLanes[row][col], curToPrev[row][col]);
+            }
+            for (int col = 0; col < 3; ++col)
+                _mm256_store_ps(nLanes[row][col], _mm256_mul_ps(r[row][col], recScale));
+        }
+        _mm256_store_ps(uniformScaleLanes, uniformScale);
+        for (int lane = 0; lane < 8; ++lane) {
+            TransformData &data = dst[i + lane];
+            for (int col = 0; col < 4; ++col) {
+                data.transform[col] = Vector4D(
+                    mLanes[0][col][lane], mLanes[1][col][lane], mLanes[2][col][lane], col == 3 ? 1.0f : 0.0f);
+                data.curToPrevTransform[col] = Vector4D(
+                    curToPrevLanes[0][col][lane], curToPrevLanes[1][col][lane], curToPrevLanes[2][col][lane],
+                    col == 3 ? 1.0f : 0.0f);
+            }
+            for (int col = 0; col < 3; ++col)
+                data.normalMatrix[col] = Vector3D(nLanes[0][col][lane], nLanes[1][col][lane], nLanes[2][col][lane]);
+            data.uniformScale = uniformScaleLanes[lane];
+        }
+    }
+    evaluate(i, end, dt, dst);
+}
+
+void InstanceControllerSystem::evaluateAll(float dt, bool useAVX2, TransformData* dst) {
+    parallelForChunks(
+        0, m_numControllers, 1024,
+        [&](uint32_t chunkIdx, uint32_t begin, uint32_t end) {
+        if (useAVX2)
+            evaluate_AVX2(begin, end, dt, dst);
+        else
+            evaluate(begin, end, dt, dst);
+    });
+}
+
+void InstanceControllerSystem::update(
+    CUstream stream, float dt, uint32_t bufferIndex,
+    const cudau::TypedBuffer<shared::InstanceData> &dstBuffer) {
+    static_assert(
+        offsetof(TransformData, curToPrevTransform) == offsetof(shared::InstanceData, curToPrevTransform) &&
+        offsetof(TransformData, normalMatrix) == offsetof(shared::InstanceData, normalMatrix) &&
+        offsetof(TransformData, uniformScale) == offsetof(shared::InstanceData, uniformScale),
+        "TransformData layout mismatch.");
+    if (m_numControllers == 0)
+        return;
+
+    TransformData* stagingBuffer = m_stagingBuffers[bufferIndex % m_stagingBuffers.size()];
+    const bool useAVX2 = isAVX2Supported();
+    parallelForChunks(
+        0, m_numControllers, 1024,
+        [&](uint32_t chunkIdx, uint32_t begin, uint32_t end) {
+        if (useAVX2)
+            evaluate_AVX2(begin, end, dt, stagingBuffer);
+        else
+            evaluate(begin, end, dt, stagingBuffer);
+
+        // JP: Instance::setTransform()はインスタンス内の配列へのコピーのみなので、インスタンスごとに並列に呼べる。
+        // EN: Instance::setTransform() only copies into an array in the instance,
+        //     so it can be called in parallel per instance.
+        for (uint32_t i = begin; i < end; ++i) {
+            const TransformData &data = stagingBuffer[i];
+            Instance* inst = m_insts[i];
+            inst->matM2W = data.transform;
+            inst->nMatM2W = data.normalMatrix;
+            const Matrix4x4 tMatM2W = transpose(data.transform);
+            inst->optixInst.setTransform(reinterpret_cast<const float*>(&tMatM2W));
+            inst->markTransformDirty();
+        }
+    });
+
+    // JP: InstanceDataの残りのフィールドはデバイス側で管理されているので、トランスフォーム部分のみをピッチ付きで転送する。
+    // EN: The remaining fields of InstanceData are managed on the device side,
+    //     so transfer only the transform part with pitches.
+    for (const SlotRun &run : m_slotRuns) {
+        CUDA_MEMCPY2D params = {};
+        params.srcMemoryType = CU_MEMORYTYPE_HOST;
+        params.srcHost = stagingBuffer + run.begin;
+        params.srcPitch = sizeof(TransformData);
+        params.dstMemoryType = CU_MEMORYTYPE_DEVICE;
+        params.dstDevice = dstBuffer.getCUdeviceptrAt(run.slot);
+        params.dstPitch = sizeof(shared::InstanceData);
+        params.WidthInBytes = offsetof(shared::InstanceData, uniformScale) + sizeof(float);
+        params.Height = run.count;
+        CUDADRV_CHECK(cuMemcpy2DAsync(&params, stream));
+    }
+}
+
+// JP: 2つの評価結果の全要素の差の最大値を、値の大きさ(1未満の場合は1)に対する相対誤差として求める。
+// EN: Compute the maximum difference over all elements of two evaluation results
+//     as the error relative to the magnitude of the value (1 if smaller than 1).
+static float computeMaxTransformDataError(
+    const InstanceControllerSystem::TransformData* a, const InstanceControllerSystem::TransformData* b,
+    uint32_t numControllers) {
+    constexpr uint32_t numFloats = sizeof(InstanceControllerSystem::TransformData) / sizeof(float);
+    float maxError = 0.0f;
+    for (uint32_t i = 0; i < numControllers; ++i) {
+        const float* va = reinterpret_cast<const float*>(&a[i]);
+        const float* vb = reinterpret_cast<const float*>(&b[i]);
+        for (uint32_t j = 0; j < numFloats; ++j) {
+            const float error = std::fabs(va[j] - vb[j]) / std::max(std::fabs(vb[j]), 1.0f);
+            // JP: NaNも誤差として扱う。
+            // EN: Treat NaN as an error as well.
+            maxError = error == error ? std::max(maxError, error) : INFINITY;
+        }
+    }
+    return maxError;
+}
+
+int32_t benchmarkInstanceControllers(uint32_t numControllers) {
+    StopWatchHiRes sw;
+    const auto measure = [&sw](const auto &func) {
+        sw.start();
+        func();
+        return sw.getMeasurement(sw.stop(), StopWatchDurationType::Microseconds) * 1e-3f;
+    };
+
+    if (!isAVX2Supported()) {
+        hpprintf("AVX2 is not supported on this CPU.\n");
+        return -1;
+    }
+
+    // JP: 同じパラメターの2つのシステムをそれぞれスカラー版とAVX2版でフレームを進めて評価し、
+    //     各フレームの時間と結果の差を比べる。
+    // EN: Advance frames of two systems with the same parameters with the scalar and AVX2 versions respectively,
+    //     and compare the time and the difference of the results for each frame.
+    constexpr uint32_t numFrames = 32;
+    constexpr float dt = 1.0f / 60;
+    InstanceControllerSystem scalarSystem;
+    InstanceControllerSystem avx2System;
+    scalarSystem.initializeWithRandomParameters(numControllers, 577215664);
+    avx2System.initializeWithRandomParameters(numControllers, 577215664);
+    std::vector<InstanceControllerSystem::TransformData> scalarResults(numControllers);
+    std::vector<InstanceControllerSystem::TransformData> avx2Results(numControllers);
+
+    float scalarTime = 0.0f;
+    float avx2Time = 0.0f;
+    float maxError = 0.0f;
+    for (uint32_t frameIdx = 0; frameIdx < numFrames; ++frameIdx) {
+        scalarTime += measure([&]() {
+            scalarSystem.evaluateAll(dt, false, scalarResults.data());
+        });
+        avx2Time += measure([&]() {
+            avx2System.evaluateAll(dt, true, avx2Results.data());
+        });
+        maxError = std::max(
+            maxError, computeMaxTransformDataError(avx2Results.data(), scalarResults.data(), numControllers));
+    }
+    scalarTime /= numFrames;
+    avx2Time /= numFrames;
+
+    constexpr float tolerance = 1e-4f;
+    const bool matched = maxError <= tolerance;
+
+    hpprintf("Instance controllers: %u controllers, average of %u frames (%u threads)\n",
+             numControllers, numFrames, std::max(std::thread::hardware_concurrency(), 1u));
+    hpprintf("%12s | %12s | %8s\n", "scalar", "AVX2", "speedup");
+    hpprintf("%9.3f ms | %9.3f ms | %7.2fx\n",
+             scalarTime, avx2Time, scalarTime / std::max(avx2Time, 1e-6f));
+    hpprintf("max relative error: %g (%s)\n", maxError, matched ? "OK" : "FAILED");
+
+    return matched ? 0 : -1;
+}
+
+
+
+// JP: 環境テクスチャーの値をhalfの範囲にクランプし、立体角を考慮した輝度を重要度として求める。
+// EN: Clamp the values of an environmental texture to the half range,
+//     and compute luminance considering the solid angle as importance.
+static void computeEnvironmentalImportance(
+    float* textureData, int32_t width, int32_t height, float* importanceData) {
+    constexpr uint32_t minRowsPerChunk = 16;
+    parallelForChunks(
+        0, height, minRowsPerChunk,
+        [&](uint32_t chunkIdx, uint32_t begin, uint32_t end) {
+            for (int y = begin; y < static_cast<int>(end); ++y) {
+                float theta = pi_v<float> * (y + 0.5f) / height;
+                float sinTheta = std::sin(theta);
+                for (int x = 0; x < width; ++x) {
+                    uint32_t idx = 4 * (y * width + x);
+                    textureData[idx + 0] = std::clamp(textureData[idx + 0], 0.0f, 65504.0f);
+                    textureData[idx + 1] = std::clamp(textureData[idx + 1], 0.0f, 65504.0f);
+                    textureData[idx + 2] = std::clamp(textureData[idx + 2], 0.0f, 65504.0f);
+                    RGB value(textureData[idx + 0],
+                              textureData[idx + 1],
+                              textureData[idx + 2]);
+                    importanceData[y * width + x] = sRGB_calcLuminance(value) * sinTheta;
+                }
+            }
+        });
+}
+
+// JP: 重要度を2x2ずつ平均して、長辺がmaxResolution以下になるまで縮小する(0の場合は縮小しない)。
+//     奇数の辺では端の値を重複して使うので、値が正の領域は縮小後も必ず正の値を持つ。
+// EN: Downsample importance by averaging 2x2 until the longer side becomes maxResolution or less
+//     (no downsampling for 0).
+//     Odd sides reuse the edge values, so a region with positive values always has positive values after downsampling.
+static void downsampleImportance(
+    std::vector<float>* values, uint32_t* width, uint32_t* height, uint32_t maxResolution) {
+    std::vector<float> lowerValues;
+    while (maxResolution > 0 && std::max(*width, *height) > maxResolution) {
+        const uint32_t srcWidth = *width;
+        const uint32_t srcHeight = *height;
+        const uint32_t dstWidth = (srcWidth + 1) / 2;
+        const uint32_t dstHeight = (srcHeight + 1) / 2;
+        lowerValues.resize(dstWidth * dstHeight);
+        const float* srcValues = values->data();
+        constexpr uint32_t minRowsPerChunk = 16;
+        parallelForChunks(
+            0, dstHeight, minRowsPerChunk,
+            [&](uint32_t chunkIdx, uint32_t begin, uint32_t end) {
+                for (uint32_t y = begin; y < end; ++y) {
+                    const float* srcRow0 = srcValues + (2 * y) * srcWidth;
+                    const float* srcRow1 = srcValues + std::min(2 * y + 1, srcHeight - 1) * srcWidth;
+                    for (uint32_t x = 0; x < dstWidth; ++x) {
+                        const uint32_t x0 = 2 * x;
+                        const uint32_t x1 = std::min(2 * x + 1, srcWidth - 1);
+                        lowerValues[y * dstWidth + x] =
+                            0.25f * (srcRow0[x0] + srcRow0[x1] + srcRow1[x0] + srcRow1[x1]);
+                    }
+                }
+            });
+        std::swap(*values, lowerValues);
+        *width = dstWidth;
+        *height = dstHeight;
+    }
+}
+
+
+
+// JP: BC6H (符号なし)のモード11(1領域、10ビットのエンドポイント、4ビットのインデックス)のみを使う高速なエンコーダー。
+//     BC6Hはhalfのビット表現をほぼそのまま補間するので、誤差もhalfのビット表現上で評価する。
+//     エンドポイントはバウンディングボックスの対角から始めて、一度だけ最小二乗法で当てはめ直す。
+// EN: Fast encoder using only mode 11 of BC6H (unsigned) (one region, 10-bit endpoints and 4-bit indices).
+//     BC6H interpolates the bit representation of half almost as is,
+//     so evaluate the error also on the bit representation of half.
+//     Endpoints start from the diagonal of the bounding box, then are refit by least squares only once.
+static constexpr uint32_t bc6hBlockSize = 16;
+static constexpr int32_t bc6hWeights4[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+static int32_t unquantizeBC6HEndpoint(int32_t q) {
+    if (q == 0)
+        return 0;
+    if (q == 1023)
+        return 0xFFFF;
+    return ((q << 16) + 0x8000) >> 10;
+}
+
+// JP: halfのビット表現に対応する補間前の値を量子化されたエンドポイントに変換する。
+//     roundingが負なら値以下、正なら値以上で最も近いもの、0なら最も近いものを選ぶ。
+// EN: Convert a value before interpolation corresponding to a half bit representation to a quantized endpoint.
+//     Choose the nearest one not greater than the value if rounding is negative,
+//     not less than the value if positive, and the nearest one if 0.
+static int32_t quantizeBC6HEndpoint(float value, int32_t rounding = 0) {
+    const int32_t q = std::clamp(static_cast<int32_t>(std::lround((value - 32.0f) / 64.0f)), 0, 1023);
+    int32_t bestQ = rounding < 0 ? 0 : 1023;
+    float bestError = INFINITY;
+    for (int32_t cq = std::max(q - 1, 0); cq <= std::min(q + 1, 1023); ++cq) {
+        const float diff = unquantizeBC6HEndpoint(cq) - value;
+        if ((rounding < 0 && diff > 0) || (rounding > 0 && diff < 0))
+            continue;
+        if (std::fabs(diff) < bestError) {
+            bestQ = cq;
+            bestError = std::fabs(diff);
+        }
+    }
+    return bestQ;
+}
+
+static uint64_t computeBC6HIndices(
+    const uint16_t (&texels)[16][3], const int32_t (&qEndpoints)[2][3], uint8_t (&indices)[16]) {
+    int32_t palette[16][3];
+    for (int c = 0; c < 3; ++c) {
+        const int32_t e0 = unquantizeBC6HEndpoint(qEndpoints[0][c]);
+        const int32_t e1 = unquantizeBC6HEndpoint(qEndpoints[1][c]);
+        for (int i = 0; i < 16; ++i)
+            palette[i][c] = ((((64 - bc6hWeights4[i]) * e0 + bc6hWeights4[i] * e1 + 32) >> 6) * 31) >> 6;
+    }
+
+    uint64_t totalError = 0;
+    for (int t = 0; t < 16; ++t) {
+        uint32_t bestError = UINT32_MAX;
+        for (int i = 0; i < 16; ++i) {
+            uint32_t error = 0;
+            for (int c = 0; c < 3; ++c) {
+                const int32_t d = palette[i][c] - texels[t][c];
+                error += d * d;
+            }
+            if (error < bestError) {
+                bestError = error;
+                indices[t] = i;
+            }
+        }
+        totalError += bestError;
+    }
+    return totalError;
+}
+
+static void encodeBC6HBlock(const uint16_t (&texels)[16][3], uint8_t* dst) {
+    // JP: デコーダーは補間後の値に31/64を掛けてhalfにするので、目標値を補間前の値域に戻しておく。
+    // EN: The decoder multiplies interpolated values by 31/64 to make half,
+    //     so bring target values back to the value range before interpolation.
+    float values[16][3];
+    float minValues[3] = { INFINITY, INFINITY, INFINITY };
+    float maxValues[3] = { -INFINITY, -INFINITY, -INFINITY };
+    for (int t = 0; t < 16; ++t) {
+        for (int c = 0; c < 3; ++c) {
+            values[t][c] = texels[t][c] * (64.0f / 31.0f);
+            minValues[c] = std::min(minValues[c], values[t][c]);
+            maxValues[c] = std::max(maxValues[c], values[t][c]);
+        }
+    }
+
+    // JP: 量子化後のエンドポイントが値の範囲を囲むように最小値は切り下げ、最大値は切り上げる。
+    // EN: Round the min value down and the max value up so that the quantized endpoints enclose the value range.
+    int32_t qEndpoints[2][3];
+    for (int c = 0; c < 3; ++c) {
+        qEndpoints[0][c] = quantizeBC6HEndpoint(minValues[c], -1);
+        qEndpoints[1][c] = quantizeBC6HEndpoint(maxValues[c], 1);
+    }
+    uint8_t indices[16];
+    uint64_t error = computeBC6HIndices(texels, qEndpoints, indices);
+
+    // JP: 選ばれたインデックスの重みに対してエンドポイントを最小二乗法で当てはめ直す。
+    // EN: Refit endpoints by least squares for the weights of the chosen indices.
+    if (error > 0) {
+        float sumAA = 0.0f, sumAB = 0.0f, sumBB = 0.0f;
+        float sumAX[3] = {}, sumBX[3] = {};
+        for (int t = 0; t < 16; ++t) {
+            const float b = bc6hWeights4[indices[t]] / 64.0f;
+            const float a = 1.0f - b;
+            sumAA += a * a;
+            sumAB += a * b;
+            sumBB += b * b;
+            for (int c = 0; c < 3; ++c) {
+                sumAX[c] += a * values[t][c];
+                sumBX[c] += b * values[t][c];
+            }
+        }
+        const float det = sumAA * sumBB - sumAB * sumAB;
+        if (det > 1e-6f) {
+            int32_t refitQEndpoints[2][3];
+            for (int c = 0; c < 3; ++c) {
+                const float e0 = (sumBB * sumAX[c] - sumAB * sumBX[c]) / det;
+                const float e1 = (sumAA * sumBX[c] - sumAB * sumAX[c]) / det;
+                refitQEndpoints[0][c] = quantizeBC6HEndpoint(std::clamp(e0, 0.0f, 65535.0f));
+                refitQEndpoints[1][c] = quantizeBC6HEndpoint(std::clamp(e1, 0.0f, 65535.0f));
+            }
+            uint8_t refitIndices[16];
+            const uint64_t refitError = computeBC6HIndices(texels, refitQEndpoints, refitIndices);
+            if (refitError < error) {
+                std::copy_n(&refitQEndpoints[0][0], 6, &qEndpoints[0][0]);
+                std::copy_n(refitIndices, 16, indices);
+            }
+        }
+    }
+
+    // JP: 最初のテクセルのインデックスの最上位ビットは暗黙に0なので、必要ならエンドポイントを入れ替える。
+    //     重みは対称なので入れ替えても復元値は変わらない。
+    // EN: The most significant bit of the index of the first texel is implicitly 0,
+    //     so swap endpoints if needed.
+    //     Weights are symmetric, so decoded values don't change by swapping.
+    if (indices[0] & 0x8) {
+        for (int c = 0; c < 3; ++c)
+            std::swap(qEndpoints[0][c], qEndpoints[1][c]);
+        for (int t = 0; t < 16; ++t)
+            indices[t] = 15 - indices[t];
+    }
+
+    uint64_t bits[2] = { 0, 0 };
+    uint32_t bitPos = 0;
+    const auto put = [&bits, &bitPos](uint64_t value, uint32_t numBits) {
+        const uint32_t wordIdx = bitPos / 64;
+        const uint32_t bitIdx = bitPos % 64;
+        bits[wordIdx] |= value << bitIdx;
+        if (bitIdx + numBits > 64)
+            bits[wordIdx + 1] |= value >> (64 - bitIdx);
+        bitPos += numBits;
+    };
+    put(0b00011, 5); // mode 11
+    for (int e = 0; e < 2; ++e) {
+        for (int c = 0; c < 3; ++c)
+            put(qEndpoints[e][c], 10);
+    }
+    put(indices[0], 3);
+    for (int t = 1; t < 16; ++t)
+        put(indices[t], 4);
+    Assert(bitPos == 128, "Invalid BC6H block size: %u", bitPos);
+    std::memcpy(dst, bits, bc6hBlockSize);
+}
+
+// JP: RGBAのhalfの画像をBC6Hにエンコードする。画像の端を越えるブロックは端のテクセルで埋める。
+// EN: Encode an RGBA half image to BC6H. Blocks crossing the image boundary are padded by the edge texels.
+static void encodeBC6H(const uint16_t* srcTexels, uint32_t width, uint32_t height, uint8_t* dst) {
+    const uint32_t numBlocksX = (width + 3) / 4;
+    const uint32_t numBlocksY = (height + 3) / 4;
+    parallelForChunks(
+        0, numBlocksY, 1,
+        [&](uint32_t chunkIdx, uint32_t begin, uint32_t end) {
+            for (uint32_t by = begin; by < end; ++by) {
+                for (uint32_t bx = 0; bx < numBlocksX; ++bx) {
+                    uint16_t texels[16][3];
+                    for (uint32_t t = 0; t < 16; ++t) {
+                        const uint32_t x = std::min(4 * bx + t % 4, width - 1);
+                        const uint32_t y = std::min(4 * by + t / 4, height - 1);
+                        const uint16_t* texel = srcTexels + 4 * (static_cast<size_t>(y) * width + x);
+                        for (int c = 0; c < 3; ++c)
+                            texels[t][c] = texel[c];
+                    }
+                    encodeBC6HBlock(texels, dst + bc6hBlockSize * (static_cast<size_t>(by) * numBlocksX + bx));
+                }
+            }
+        });
+}
+
+
+
+// JP: 環境テクスチャーのキャッシュのファイル形式。各配列は16バイト境界に配置される。
+//     Header | texels | importance values
+// EN: File format of the environmental texture cache. Each array is placed at 16-byte boundary.
+static constexpr char envLightCacheMagic[8] = { 'G', 'F', 'X', 'E', 'N', 'V', 'C', 'H' };
+static constexpr uint32_t envLightCacheVersion = 2;
+static constexpr size_t envLightCacheAlignment = 16;
+
+struct EnvLightCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    CacheSourceStamp source;
+    uint64_t keyHash;
+    uint64_t fileSize;
+    uint64_t texelsSize;
+    uint32_t width;
+    uint32_t height;
+    uint32_t importanceWidth;
+    uint32_t importanceHeight;
+};
+
+struct EnvLightTextureData {
+    const uint8_t* texels;
+    size_t texelsSize;
+    const float* importance;
+    uint32_t width;
+    uint32_t height;
+    uint32_t importanceWidth;
+    uint32_t importanceHeight;
+};
+
+static const char* getEnvLightCacheExtension(EnvLightTextureFormat format) {
+    switch (format) {
+    case EnvLightTextureFormat::Float32:
+        return ".rgba32f.envcache";
+    case EnvLightTextureFormat::Float16:
+        return ".rgba16f.envcache";
+    case EnvLightTextureFormat::BC6H:
+        return ".bc6h.envcache";
+    default:
+        Assert_ShouldNotBeCalled();
+        return ".envcache";
+    }
+}
+
+static size_t computeEnvLightTexelsSize(EnvLightTextureFormat format, uint32_t width, uint32_t height) {
+    switch (format) {
+    case EnvLightTextureFormat::Float32:
+        return sizeof(float) * 4 * width * height;
+    case EnvLightTextureFormat::Float16:
+        return sizeof(uint16_t) * 4 * width * height;
+    case EnvLightTextureFormat::BC6H:
+        return bc6hBlockSize * ((width + 3) / 4) * ((height + 3) / 4);
+    default:
+        Assert_ShouldNotBeCalled();
+        return 0;
+    }
+}
+
+static uint64_t computeEnvLightCacheKey(EnvLightTextureFormat format, uint32_t importanceMapResolution) {
+    const uint32_t key[] = {
+        envLightCacheVersion,
+        static_cast<uint32_t>(format),
+        importanceMapResolution,
+    };
+    return hashBytes(reinterpret_cast<const uint8_t*>(key), sizeof(key), 0);
+}
+
+static bool writeEnvLightCache(
+    const std::filesystem::path &cachePath, const CacheSourceStamp &sourceStamp, uint64_t keyHash,
+    const EnvLightTextureData &data) {
+    // JP: 書き込み途中のファイルが読まれないよう、一時ファイルに書いてから置き換える。
+    // EN: Write to a temporary file then replace so that a partially written file won't be read.
+    std::filesystem::path tmpPath = cachePath;
+    tmpPath += ".tmp";
+    std::ofstream ofs(tmpPath, std::ios::binary);
+    if (!ofs)
+        return false;
+
+    uint64_t fileSize = 0;
+    const auto write = [&ofs, &fileSize](const void* data, size_t size) {
+        ofs.write(reinterpret_cast<const char*>(data), size);
+        fileSize += size;
+    };
+    const auto align = [&write, &fileSize]() {
+        constexpr uint8_t zeros[envLightCacheAlignment] = {};
+        write(zeros, alignUp(fileSize, envLightCacheAlignment) - fileSize);
+    };
+
+    EnvLightCacheHeader header = {};
+    std::copy_n(envLightCacheMagic, sizeof(envLightCacheMagic), header.magic);
+    header.version = envLightCacheVersion;
+    header.headerSize = sizeof(EnvLightCacheHeader);
+    header.source = sourceStamp;
+    header.keyHash = keyHash;
+    header.texelsSize = data.texelsSize;
+    header.width = data.width;
+    header.height = data.height;
+    header.importanceWidth = data.importanceWidth;
+    header.importanceHeight = data.importanceHeight;
+    write(&header, sizeof(header));
+    align();
+    write(data.texels, data.texelsSize);
+    align();
+    write(data.importance, sizeof(float) * data.importanceWidth * data.importanceHeight);
+
+    header.fileSize = fileSize;
+    ofs.seekp(0);
+    ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    ofs.close();
+    if (!ofs)
+        return false;
+
+    std::error_code ec;
+    std::filesystem::rename(tmpPath, cachePath, ec);
+    if (ec) {
+        std::filesystem::remove(tmpPath, ec);
+        return false;
+    }
+
+    return true;
+}
+
+// JP: キャッシュをマップして内容を参照する。テクセルと重要度はコピーせずマップされたメモリーを直接指す。
+// EN: Map the cache and refer to the contents. Texels and importance directly point to the mapped memory without copy.
+static bool readEnvLightCache(
+    const std::filesystem::path &cachePath, CacheSource* source, uint64_t keyHash,
+    EnvLightTextureFormat format,
+    MappedFile* cacheFile, EnvLightTextureData* data) {
+    if (!cacheFile->open(cachePath))
+        return false;
+
+    const uint8_t* const fileData = cacheFile->getData();
+    const size_t size = cacheFile->getSize();
+    size_t offset = 0;
+    const auto read = [&](size_t readSize) -> const uint8_t* {
+        if (readSize > size - offset)
+            return nullptr;
+        const uint8_t* ret = fileData + offset;
+        offset += readSize;
+        return ret;
+    };
+    const auto align = [&]() {
+        offset = std::min(alignUp(offset, envLightCacheAlignment), size);
+    };
+
+    const auto header = reinterpret_cast<const EnvLightCacheHeader*>(read(sizeof(EnvLightCacheHeader)));
+    if (!header ||
+        !std::equal(envLightCacheMagic, envLightCacheMagic + sizeof(envLightCacheMagic), header->magic) ||
+        header->version != envLightCacheVersion ||
+        header->headerSize != sizeof(EnvLightCacheHeader) ||
+        header->fileSize != size ||
+        header->keyHash != keyHash ||
+        header->texelsSize != computeEnvLightTexelsSize(format, header->width, header->height) ||
+        !source->matches(header->source)) {
+        cacheFile->close();
+        return false;
+    }
+    align();
+
+    data->texels = read(header->texelsSize);
+    align();
+    data->importance = reinterpret_cast<const float*>(
+        read(sizeof(float) * header->importanceWidth * header->importanceHeight));
+    if (!data->texels || !data->importance) {
+        cacheFile->close();
+        return false;
+    }
+    data->texelsSize = header->texelsSize;
+    data->width = header->width;
+    data->height = header->height;
+    data->importanceWidth = header->importanceWidth;
+    data->importanceHeight = header->importanceHeight;
+
+    return true;
+}
+
+static void convertRowToHalf(
+    const float* src, float scale, uint32_t width, uint16_t* dst);
+
+void loadEnvironmentalTexture(
+    const std::filesystem::path &filePath,
+    CUcontext cuContext,
+    cudau::Array* envLightArray, CUtexObject* envLightTexture,
+    EnvLightImportanceMap* envLightImportanceMap,
+    uint32_t importanceMapResolution,
+    EnvLightTextureFormat format) {
+    cudau::TextureSampler sampler_float;
+    sampler_float.setXyFilterMode(cudau::TextureFilterMode::Linear);
+    sampler_float.setWrapMode(0, cudau::TextureWrapMode::Clamp);
+    sampler_float.setWrapMode(1, cudau::TextureWrapMode::Clamp);
+    sampler_float.setMipMapFilterMode(cudau::TextureFilterMode::Point);
+    sampler_float.setReadMode(cudau::TextureReadMode::ElementType);
+
+    std::filesystem::path cachePath = filePath;
+    cachePath += getEnvLightCacheExtension(format);
+
+    CacheSource cacheSource(filePath);
+    const uint64_t keyHash = computeEnvLightCacheKey(format, importanceMapResolution);
+
+    EnvLightTextureData data;
+    MappedFile cacheFile;
+    std::vector<uint8_t> texelStorage;
+    std::vector<float> importanceStorage;
+    if (cacheSource.isValid() &&
+        readEnvLightCache(cachePath, &cacheSource, keyHash, format, &cacheFile, &data)) {
+        hpprintf("Read cache: %s\n", cachePath.string().c_str());
+    }
+    else {
+        int32_t width, height;
+        float* textureData;
+        const char* errMsg = nullptr;
+        int ret = LoadEXR(&textureData, &width, &height, filePath.string().c_str(), &errMsg);
+        if (ret != TINYEXR_SUCCESS) {
+            hpprintf("Failed to read %s\n", filePath.string().c_str());
+            hpprintf("%s\n", errMsg);
+            FreeEXRErrorMessage(errMsg);
+            return;
+        }
+
+        // JP: 重要度は元のテクスチャーから求めて、輝度のピラミッドを指定の解像度まで縮小する。
+        // EN: Compute importance from the original texture, then downsample the luminance pyramid
+        //     to the specified resolution.
+        importanceStorage.resize(width * height);
+        computeEnvironmentalImportance(textureData, width, height, importanceStorage.data());
+        data.width = width;
+        data.height = height;
+        data.importanceWidth = width;
+        data.importanceHeight = height;
+        downsampleImportance(
+            &importanceStorage, &data.importanceWidth, &data.importanceHeight, importanceMapResolution);
+        data.importance = importanceStorage.data();
+
+        data.texelsSize = computeEnvLightTexelsSize(format, width, height);
+        texelStorage.resize(data.texelsSize);
+        if (format == EnvLightTextureFormat::Float32) {
+            std::memcpy(texelStorage.data(), textureData, data.texelsSize);
+        }
+        else {
+            std::vector<uint16_t> halfTexels(4 * width * height);
+            constexpr uint32_t minRowsPerChunk = 16;
+            parallelForChunks(
+                0, height, minRowsPerChunk,
+                [&](uint32_t chunkIdx, uint32_t begin, uint32_t end) {
+                    for (uint32_t y = begin; y < end; ++y) {
+                        const size_t rowOffset = 4 * static_cast<size_t>(y) * width;
+                        convertRowToHalf(textureData + rowOffset, 1.0f, 4 * width, halfTexels.data() + rowOffset);
+                    }
+                });
+            if (format == EnvLightTextureFormat::Float16)
+                std::memcpy(texelStorage.data(), halfTexels.data(), data.texelsSize);
+            else
+                encodeBC6H(halfTexels.data(), width, height, texelStorage.data());
+        }
+        data.texels = texelStorage.data();
+        free(textureData);
+
+        CacheSourceStamp sourceStamp;
+        if (cacheSource.getStamp(&sourceStamp) && !writeEnvLightCache(cachePath, sourceStamp, keyHash, data))
+            hpprintf("Failed to write cache: %s\n", cachePath.string().c_str());
+    }
+
+    cudau::ArrayElementType elemType = cudau::ArrayElementType::Float32;
+    uint32_t numChannels = 4;
+    if (format == EnvLightTextureFormat::Float16) {
+        elemType = cudau::ArrayElementType::Float16;
+    }
+    else if (format == EnvLightTextureFormat::BC6H) {
+        elemType = cudau::ArrayElementType::BC6H_UF16;
+        numChannels = 1;
+    }
+    envLightArray->initialize2D(
+        cuContext, elemType, numChannels,
+        cudau::ArraySurface::Disable, cudau::ArrayTextureGather::Disable,
+        data.width, data.height, 1);
+    envLightArray->write<uint8_t>(data.texels, data.texelsSize);
+
+    envLightImportanceMap->initialize(
+        cuContext, Scene::bufferType, data.importance, data.importanceWidth, data.importanceHeight);
+
+    *envLightTexture = sampler_float.createTextureObject(*envLightArray);
+}
+
+int32_t benchmarkEnvironmentalImportanceMaps(
+    const std::filesystem::path &filePath, uint32_t importanceMapResolution, uint32_t numSamples) {
     int32_t width, height;
     float* textureData;
     const char* errMsg = nullptr;
     int ret = LoadEXR(&textureData, &width, &height, filePath.string().c_str(), &errMsg);
-    if (ret == TINYEXR_SUCCESS) {
-        float* importanceData = new float[width * height];
-        for (int y = 0; y < height; ++y) {
-            float theta = pi_v<float> * (y + 0.5f) / height;
-            float sinTheta = std::sin(theta);
-            for (int x = 0; x < width; ++x) {
-                uint32_t idx = 4 * (y * width + x);
-                textureData[idx + 0] = std::clamp(textureData[idx + 0], 0.0f, 65504.0f);
-                textureData[idx + 1] = std::clamp(textureData[idx + 1], 0.0f, 65504.0f);
-                textureData[idx + 2] = std::clamp(textureData[idx + 2], 0.0f, 65504.0f);
-                RGB value(textureData[idx + 0],
-                          textureData[idx + 1],
-                          textureData[idx + 2]);
-                importanceData[y * width + x] = sRGB_calcLuminance(value) * sinTheta;
-            }
-        }
-
-        envLightArray->initialize2D(
-            cuContext, cudau::ArrayElementType::Float32, 4,
-            cudau::ArraySurface::Disable, cudau::ArrayTextureGather::Disable,
-            width, height, 1);
-        envLightArray->write(textureData, width * height * 4);
+    if (ret != TINYEXR_SUCCESS) {
+        hpprintf("Failed to read %s\n", filePath.string().c_str());
+        hpprintf("%s\n", errMsg);
+        FreeEXRErrorMessage(errMsg);
+        return -1;
+    }
+
+    std::vector<float> importanceData(width * height);
+    computeEnvironmentalImportance(textureData, width, height, importanceData.data());
+    free(textureData);
+
+    StopWatchHiRes sw;
+    const auto measure = [&sw](const auto &func) {
+        sw.start();
+        func();
+        return sw.getMeasurement(sw.stop(), StopWatchDurationType::Microseconds) * 1e-3f;
+    };
+
+    // JP: 両方の分布をloadEnvironmentalTexture()と同じく縮小した輝度のピラミッドから作る。
+    // EN: Build both distributions from the downsampled luminance pyramid same as loadEnvironmentalTexture().
+    std::vector<float> levelData = importanceData;
+    uint32_t levelWidth = width;
+    uint32_t levelHeight = height;
+    const float pyramidBuildTime = measure([&]() {
+        downsampleImportance(&levelData, &levelWidth, &levelHeight, importanceMapResolution);
+    });
+
+    const auto computeRowCDFMemSize = [](uint32_t levelWidth, uint32_t levelHeight) {
+#if defined(USE_WALKER_ALIAS_METHOD)
+        const size_t rowDistValueSize =
+            sizeof(float) + sizeof(shared::AliasTableEntry<float>) + sizeof(shared::AliasValueMap<float>);
+        return rowDistValueSize * (static_cast<size_t>(levelWidth) * levelHeight + levelHeight) +
+            sizeof(shared::RegularConstantContinuousDistribution1D) * levelHeight;
+#else
+        return sizeof(float) * (2 * (static_cast<size_t>(levelWidth) * levelHeight + levelHeight) + levelHeight + 1) +
+            sizeof(shared::RegularConstantContinuousDistribution1D) * levelHeight;
+#endif
+    };
+
+    HostRegularConstantContinuousDistribution2D rowCDFMap;
+    const float rowCDFBuildTime = measure([&]() {
+        rowCDFMap.initialize(levelData.data(), levelWidth, levelHeight);
+    });
+    const size_t rowCDFMemSize = computeRowCDFMemSize(levelWidth, levelHeight);
+
+    HostHierarchicalImportanceMap hierMap;
+    const float hierBuildTime = measure([&]() {
+        hierMap.initialize(levelData.data(), levelWidth, levelHeight);
+    });
+
+    // JP: 乱数はあらかじめ生成しておき、サンプリングとPDF評価のみを計測する。
+    //     サンプルした方向の重要度をPDFで割った値の相対標準偏差を分布の質の指標とする。
+    //     入力の各値を区別できる解像度の分布ならほぼ0になる。
+    // EN: Generate random numbers beforehand to measure only sampling and PDF evaluation.
+    //     Use the relative standard deviation of the importance at sampled directions divided by the PDF
+    //     as a quality measure of the distribution.
+    //     It becomes almost 0 for a distribution with a resolution that can distinguish each input value.
+    std::vector<Point2D> randoms(numSamples);
+    {
+        std::mt19937 rng(591842031);
+        std::uniform_real_distribution<float> u01;
+        for (Point2D &u : randoms)
+            u = Point2D(u01(rng), u01(rng));
+    }
+    std::vector<Point2D> samples(numSamples);
+    std::vector<float> pdfs(numSamples);
+
+    const auto evaluate = [&](const char* name, const auto &dist, float buildTime, size_t memSize) {
+        const float sampleTime = measure([&]() {
+            for (uint32_t i = 0; i < numSamples; ++i)
+                dist.sample(randoms[i].x, randoms[i].y, &samples[i].x, &samples[i].y, &pdfs[i]);
+        });
+        float pdfSum = 0.0f;
+        const float pdfTime = measure([&]() {
+            for (uint32_t i = 0; i < numSamples; ++i)
+                pdfSum += dist.evaluatePDF(samples[i].x, samples[i].y);
+        });
+
+        double maxPDFRelError = 0.0;
+        double sum = 0.0;
+        double sqSum = 0.0;
+        for (uint32_t i = 0; i < numSamples; ++i) {
+            const float pdf = dist.evaluatePDF(samples[i].x, samples[i].y);
+            if (pdfs[i] > 0.0f)
+                maxPDFRelError = std::max(maxPDFRelError, std::fabs(pdf / pdfs[i] - 1.0));
+            const uint32_t x = std::min(static_cast<uint32_t>(samples[i].x * width), width - 1u);
+            const uint32_t y = std::min(static_cast<uint32_t>(samples[i].y * height), height - 1u);
+            const double estimate = pdfs[i] > 0.0f ? importanceData[y * width + x] / pdfs[i] : 0.0;
+            sum += estimate;
+            sqSum += estimate * estimate;
+        }
+        const double mean = sum / numSamples;
+        const double variance = std::max(sqSum / numSamples - mean * mean, 0.0);
+
+        hpprintf("%s:\n", name);
+        hpprintf("  build: %.3f [ms], memory: %.3f [MiB]\n",
+                 buildTime, memSize / (1024.0 * 1024.0));
+        hpprintf("  sample: %.2f [Msamples/s], PDF: %.2f [Mevals/s] (checksum: %g)\n",
+                 numSamples / (sampleTime * 1e+3f), numSamples / (pdfTime * 1e+3f), pdfSum);
+        hpprintf("  max relative error of PDF between sample and evaluation: %g\n", maxPDFRelError);
+        hpprintf("  relative std. dev. of importance / PDF: %g\n",
+                 mean > 0.0 ? std::sqrt(variance) / mean : 0.0);
+    };
+
+    hpprintf("Environmental importance maps for %s (%d x %d), %u samples\n",
+             filePath.string().c_str(), width, height, numSamples);
+    hpprintf("Luminance pyramid: %u x %u, %.3f [ms]\n", levelWidth, levelHeight, pyramidBuildTime);
+
+    shared::RegularConstantContinuousDistribution2D rowCDFDist;
+    rowCDFMap.getDeviceType(&rowCDFDist);
+    evaluate("Row CDFs", rowCDFDist, rowCDFBuildTime, rowCDFMemSize);
+
+    shared::HierarchicalImportanceMap hierDist;
+    hierMap.getDeviceType(&hierDist);
+    char hierName[64];
+    snprintf(hierName, sizeof(hierName), "Hierarchical (%u x %u)", hierMap.getWidth(), hierMap.getHeight());
+    evaluate(hierName, hierDist, hierBuildTime, hierMap.getMemorySize());
+
+    hierMap.finalize(nullptr);
+
+    // JP: loadEnvironmentalTexture()の既定の設定での両者のメモリ量も表示する。
+    // EN: Also print the memory of both in the default configuration of loadEnvironmentalTexture().
+    {
+        std::vector<float> defaultLevelData = importanceData;
+        uint32_t defaultLevelWidth = width;
+        uint32_t defaultLevelHeight = height;
+        downsampleImportance(
+            &defaultLevelData, &defaultLevelWidth, &defaultLevelHeight, defaultEnvImportanceMapResolution);
+        HostHierarchicalImportanceMap defaultHierMap;
+        defaultHierMap.initialize(defaultLevelData.data(), defaultLevelWidth, defaultLevelHeight);
+        hpprintf("Default configuration (luminance pyramid: %u x %u):\n", defaultLevelWidth, defaultLevelHeight);
+        hpprintf("  Row CDFs: %.3f [MiB]\n",
+                 computeRowCDFMemSize(defaultLevelWidth, defaultLevelHeight) / (1024.0 * 1024.0));
+        hpprintf("  Hierarchical (%u x %u): %.3f [MiB]\n",
+                 defaultHierMap.getWidth(), defaultHierMap.getHeight(),
+                 defaultHierMap.getMemorySize() / (1024.0 * 1024.0));
+        defaultHierMap.finalize(nullptr);
+    }
+    rowCDFMap.finalize(nullptr);
+
+    return 0;
+}
+
+// JP: 並列化前の逐次的なAlias Methodのテーブル構築。ベンチマークでの比較と一致の確認にのみ使う。
+// EN: The sequential alias table build before parallelization.
+//     Used only for comparison and identity check in the benchmark.
+template <typename RealType>
+static void buildAliasTableSequential(
+    const RealType* values, uint32_t numValues, RealType avgWeight,
+    shared::AliasTableEntry<RealType>* aliasTable, shared::AliasValueMap<RealType>* valueMaps) {
+    struct IndexAndWeight {
+        uint32_t index;
+        RealType weight;
+        IndexAndWeight() {}
+        IndexAndWeight(uint32_t _index, RealType _weight) :
+            index(_index), weight(_weight) {}
+    };
+
+    std::vector<IndexAndWeight> smallGroup;
+    std::vector<IndexAndWeight> largeGroup;
+    for (uint32_t i = 0; i < numValues; ++i) {
+        RealType weight = values[i];
+        IndexAndWeight entry(i, weight);
+        if (weight <= avgWeight)
+            smallGroup.push_back(entry);
+        else
+            largeGroup.push_back(entry);
+    }
+    while (!smallGroup.empty() && !largeGroup.empty()) {
+        IndexAndWeight smallPair = smallGroup.back();
+        smallGroup.pop_back();
+        IndexAndWeight &largePair = largeGroup.back();
+        uint32_t secondIndex = largePair.index;
+        RealType reducedWeight = (largePair.weight + smallPair.weight) - avgWeight;
+        largePair.weight = reducedWeight;
+        if (largePair.weight <= avgWeight) {
+            smallGroup.push_back(largePair);
+            largeGroup.pop_back();
+        }
+        RealType probToPickFirst = smallPair.weight / avgWeight;
+        aliasTable[smallPair.index] = shared::AliasTableEntry<RealType>(secondIndex, probToPickFirst);
+
+        shared::AliasValueMap<RealType> valueMap;
+        valueMap.scaleForFirst = avgWeight / values[smallPair.index];
+        valueMap.scaleForSecond = avgWeight / values[secondIndex];
+        valueMap.offsetForSecond = (reducedWeight - smallPair.weight) / values[secondIndex];
+        valueMaps[smallPair.index] = valueMap;
+    }
+    while (!smallGroup.empty() || !largeGroup.empty()) {
+        IndexAndWeight pair;
+        if (!smallGroup.empty()) {
+            pair = smallGroup.back();
+            smallGroup.pop_back();
+        }
+        else {
+            pair = largeGroup.back();
+            largeGroup.pop_back();
+        }
+        aliasTable[pair.index] = shared::AliasTableEntry<RealType>(0xFFFFFFFF, 1.0f);
+
+        shared::AliasValueMap<RealType> valueMap;
+        valueMap.scaleForFirst = avgWeight / values[pair.index];
+        valueMap.scaleForSecond = 0;
+        valueMap.offsetForSecond = 0;
+        valueMaps[pair.index] = valueMap;
+    }
+}
+
+int32_t benchmarkDiscreteDistributionBuilds(uint32_t maxNumValues) {
+    StopWatchHiRes sw;
+    const auto measure = [&sw](const auto &func) {
+        sw.start();
+        func();
+        return sw.getMeasurement(sw.stop(), StopWatchDurationType::Microseconds) * 1e-3f;
+    };
+
+    hpprintf("Discrete distribution builds (%u threads)\n", std::max(std::thread::hardware_concurrency(), 1u));
+    hpprintf("%10s | %12s | %12s | %8s | %12s | %s\n",
+             "#values", "alias (seq)", "alias (par)", "speedup", "CDF", "identical");
+
+    std::mt19937 rng(149203784);
+    std::uniform_real_distribution<float> u01;
+    bool allIdentical = true;
+    for (uint64_t numValues = 1024; numValues <= maxNumValues; numValues *= 4) {
+        const uint32_t n = static_cast<uint32_t>(numValues);
+
+        // JP: 発光三角形の重みを模して、ごく一部の値が大きい分布にする。
+        // EN: Make a distribution where a small part of the values is large, mimicking emissive triangle weights.
+        std::vector<float> values(n);
+        for (uint32_t i = 0; i < n; ++i) {
+            const float u = u01(rng);
+            values[i] = u < 0.01f ? 100.0f * u01(rng) + 1.0f : u01(rng) + 1e-3f;
+        }
+
+        CompensatedSum_T<float> sum(0);
+        for (uint32_t i = 0; i < n; ++i)
+            sum += values[i];
+        const float avgWeight = sum / n;
+
+        std::vector<shared::AliasTableEntry<float>> seqAliasTable(n);
+        std::vector<shared::AliasValueMap<float>> seqValueMaps(n);
+        const float seqTime = measure([&]() {
+            buildAliasTableSequential(values.data(), n, avgWeight, seqAliasTable.data(), seqValueMaps.data());
+        });
+
+        std::vector<shared::AliasTableEntry<float>> parAliasTable(n);
+        std::vector<shared::AliasValueMap<float>> parValueMaps(n);
+        const float parTime = measure([&]() {
+            buildAliasTable(values.data(), n, avgWeight, parAliasTable.data(), parValueMaps.data());
+        });
+
+        // JP: CDF方式の構築(逐次的な補償付き前置和)。
+        // EN: Build for the CDF method (sequential compensated prefix sum).
+        std::vector<float> CDF(n);
+        const float cdfTime = measure([&]() {
+            CompensatedSum_T<float> cdfSum(0);
+            for (uint32_t i = 0; i < n; ++i) {
+                CDF[i] = cdfSum;
+                cdfSum += values[i];
+            }
+        });
+
+        const bool identical =
+            std::memcmp(seqAliasTable.data(), parAliasTable.data(),
+                        sizeof(shared::AliasTableEntry<float>) * n) == 0 &&
+            std::memcmp(seqValueMaps.data(), parValueMaps.data(),
+                        sizeof(shared::AliasValueMap<float>) * n) == 0;
+        allIdentical &= identical;
+
+        hpprintf("%10u | %9.3f ms | %9.3f ms | %7.2fx | %9.3f ms | %s\n",
+                 n, seqTime, parTime, seqTime / std::max(parTime, 1e-6f), cdfTime,
+                 identical ? "yes" : "NO");
+    }
+
+    return allIdentical ? 0 : -1;
+}
+
+
+
+void saveImage(const std::filesystem::path &filepath, uint32_t width, uint32_t height, const uint32_t* data) {
+    if (filepath.extension() == ".png")
+        stbi_write_png(filepath.string().c_str(), width, height, 4, data,
+                       width * sizeof(uint32_t));
+    else if (filepath.extension() == ".bmp")
+        stbi_write_bmp(filepath.string().c_str(), width, height, 4, data);
+    else
+        Assert_ShouldNotBeCalled();
+}
+
+// JP: float値をIEEE 754の半精度浮動小数点数に変換する(最近接偶数丸め)。
+// EN: Convert a float value to an IEEE 754 half-precision float (round to nearest even).
+static uint16_t floatToHalf(float value) {
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    const uint16_t sign = static_cast<uint16_t>((bits >> 16) & 0x8000);
+    const uint32_t absBits = bits & 0x7FFF'FFFF;
+    // Inf or NaN
+    if (absBits >= 0x7F80'0000)
+        return sign | 0x7C00 | (absBits > 0x7F80'0000 ? 0x0200 : 0x0000);
+    // Values rounding to 65536 or larger overflow to Inf.
+    if (absBits >= 0x477F'F000)
+        return sign | 0x7C00;
+    // Subnormal half
+    if (absBits < 0x3880'0000) {
+        if (absBits < 0x3300'0000)
+            return sign;
+        const uint32_t shift = 126 - (absBits >> 23);
+        const uint32_t mantissa = (absBits & 0x007F'FFFF) | 0x0080'0000;
+        uint32_t h = mantissa >> shift;
+        const uint32_t rem = mantissa & ((1u << shift) - 1);
+        const uint32_t halfway = 1u << (shift - 1);
+        if (rem > halfway || (rem == halfway && (h & 1)))
+            ++h;
+        return sign | static_cast<uint16_t>(h);
+    }
+    uint32_t h = (absBits - 0x3800'0000) >> 13;
+    const uint32_t rem = absBits & 0x1FFF;
+    if (rem > 0x1000 || (rem == 0x1000 && (h & 1)))
+        ++h;
+    return sign | static_cast<uint16_t>(h);
+}
+
+// JP: F16CはAVX2をサポートする全てのCPUで利用可能。
+// EN: F16C is available on all CPUs supporting AVX2.
+static void convertRowToHalf_F16C(
+    const float* src, float scale, uint32_t width, uint16_t* dst) {
+    const __m256 scales = _mm256_set1_ps(scale);
+    uint32_t x = 0;
+    for (; x + 8 <= width; x += 8) {
+        const __m256 values = _mm256_mul_ps(_mm256_loadu_ps(src + x), scales);
+        _mm_storeu_si128(
+            reinterpret_cast<__m128i*>(dst + x),
+            _mm256_cvtps_ph(values, _MM_FROUND_TO_NEAREST_INT));
+    }
+    for (; x < width; ++x)
+        dst[x] = floatToHalf(scale * src[x]);
+}
+
+// JP: RGBAのピクセル列を転置しながらA, B, G, Rの順のチャンネルごとの行に変換する。
+// EN: Transpose RGBA pixels into per-channel rows in the order of A, B, G, R.
+static void convertRowToHalfPlanar_F16C(
+    const float4* src, float scale, uint32_t width, uint16_t* dst) {
+    uint16_t* dstA = dst;
+    uint16_t* dstB = dst + width;
+    uint16_t* dstG = dst + 2 * width;
+    uint16_t* dstR = dst + 3 * width;
+    const __m128 scales = _mm_set1_ps(scale);
+    uint32_t x = 0;
+    for (; x + 4 <= width; x += 4) {
+        const float* p = reinterpret_cast<const float*>(src + x);
+        __m128 r = _mm_loadu_ps(p + 0);
+        __m128 g = _mm_loadu_ps(p + 4);
+        __m128 b = _mm_loadu_ps(p + 8);
+        __m128 a = _mm_loadu_ps(p + 12);
+        _MM_TRANSPOSE4_PS(r, g, b, a);
+        _mm_storel_epi64(
+            reinterpret_cast<__m128i*>(dstA + x),
+            _mm_cvtps_ph(_mm_mul_ps(a, scales), _MM_FROUND_TO_NEAREST_INT));
+        _mm_storel_epi64(
+            reinterpret_cast<__m128i*>(dstB + x),
+            _mm_cvtps_ph(_mm_mul_ps(b, scales), _MM_FROUND_TO_NEAREST_INT));
+        _mm_storel_epi64(
+            reinterpret_cast<__m128i*>(dstG + x),
+            _mm_cvtps_ph(_mm_mul_ps(g, scales), _MM_FROUND_TO_NEAREST_INT));
+        _mm_storel_epi64(
+            reinterpret_cast<__m128i*>(dstR + x),
+            _mm_cvtps_ph(_mm_mul_ps(r, scales), _MM_FROUND_TO_NEAREST_INT));
+    }
+    for (; x < width; ++x) {
+        dstA[x] = floatToHalf(scale * src[x].w);
+        dstB[x] = floatToHalf(scale * src[x].z);
+        dstG[x] = floatToHalf(scale * src[x].y);
+        dstR[x] = floatToHalf(scale * src[x].x);
+    }
+}
+
+static void convertRowToHalf(
+    const float* src, float scale, uint32_t width, uint16_t* dst) {
+    if (isAVX2Supported()) {
+        convertRowToHalf_F16C(src, scale, width, dst);
+        return;
+    }
+    for (uint32_t x = 0; x < width; ++x)
+        dst[x] = floatToHalf(scale * src[x]);
+}
+
+static void convertRowToHalfPlanar(
+    const float4* src, float scale, uint32_t width, uint16_t* dst) {
+    if (isAVX2Supported()) {
+        convertRowToHalfPlanar_F16C(src, scale, width, dst);
+        return;
+    }
+    for (uint32_t x = 0; x < width; ++x) {
+        dst[0 * width + x] = floatToHalf(scale * src[x].w);
+        dst[1 * width + x] = floatToHalf(scale * src[x].z);
+        dst[2 * width + x] = floatToHalf(scale * src[x].y);
+        dst[3 * width + x] = floatToHalf(scale * src[x].x);
+    }
+}
+
+// JP: ZIP圧縮のEXRはブロックごとに16スキャンラインをまとめて圧縮する。
+//     作業領域は呼び出し間で再利用する。
+// EN: ZIP compressed EXR compresses 16 scanlines together per block.
+//     Scratch buffers are reused across calls.
+struct EXRWriterScratch {
+    std::vector<std::vector<uint8_t>> chunkWorkBuffers;
+    std::vector<std::vector<uint8_t>> packedBlocks;
+    std::vector<uint32_t> packedSizes;
+};
+
+static constexpr uint32_t exrNumScanlinesPerZipBlock = 16;
+
+// JP: 半精度のチャンネルを持つスキャンラインEXRを書き出す。
+//     convertRowはEXR上の行番号を受け取り、その行をチャンネルごと(名前のアルファベット順)に並べて書き込む。
+//     ブロック単位で行の変換、予測フィルター、Deflate圧縮を並列に行う。
+// EN: Write a scanline EXR with half-precision channels.
+//     convertRow receives a row index in the EXR and writes the row as per-channel runs
+//     (in alphabetical order of the names).
+//     Row conversion, prediction filter and deflate compression run in parallel per block.
+template <uint32_t numChannels, typename ConvertRow>
+static bool writeEXRImage(
+    const std::filesystem::path &filepath, uint32_t width, uint32_t height,
+    const char* const (&channelNames)[numChannels], ConvertRow &&convertRow) {
+    static thread_local EXRWriterScratch scratch;
+
+    const uint32_t numBlocks = (height + exrNumScanlinesPerZipBlock - 1) / exrNumScanlinesPerZipBlock;
+    const size_t rowSize = numChannels * width * sizeof(uint16_t);
+    const uint32_t numChunks = computeNumParallelChunks(numBlocks, 1);
+    if (scratch.chunkWorkBuffers.size() < numChunks)
+        scratch.chunkWorkBuffers.resize(numChunks);
+    if (scratch.packedBlocks.size() < numBlocks)
+        scratch.packedBlocks.resize(numBlocks);
+    scratch.packedSizes.resize(numBlocks);
+
+    parallelForChunks(
+        0, numBlocks, 1,
+        [&](uint32_t chunkIdx, uint32_t blockBegin, uint32_t blockEnd) {
+        std::vector<uint8_t> &work = scratch.chunkWorkBuffers[chunkIdx];
+        for (uint32_t blockIdx = blockBegin; blockIdx < blockEnd; ++blockIdx) {
+            const uint32_t yBegin = blockIdx * exrNumScanlinesPerZipBlock;
+            const uint32_t yEnd = std::min(yBegin + exrNumScanlinesPerZipBlock, height);
+            const size_t rawSize = (yEnd - yBegin) * rowSize;
+
+            // JP: 生データは後半に置き、前半にバイトを並べ替えた結果を書く。
+            // EN: Place the raw data in the latter half and write the reordered bytes to the former half.
+            work.resize(2 * rawSize);
+            uint8_t* const raw = work.data() + rawSize;
+            uint8_t* const reordered = work.data();
+            for (uint32_t y = yBegin; y < yEnd; ++y)
+                convertRow(y, reinterpret_cast<uint16_t*>(raw + (y - yBegin) * rowSize));
+
+            // JP: 偶数番目と奇数番目のバイトを分け、差分による予測を適用する。
+            // EN: Split even and odd bytes, then apply the delta predictor.
+            {
+                uint8_t* t1 = reordered;
+                uint8_t* t2 = reordered + (rawSize + 1) / 2;
+                for (size_t i = 0; i < rawSize; i += 2) {
+                    *t1++ = raw[i];
+                    if (i + 1 < rawSize)
+                        *t2++ = raw[i + 1];
+                }
+                int32_t prev = reordered[0];
+                for (size_t i = 1; i < rawSize; ++i) {
+                    const int32_t cur = reordered[i];
+                    reordered[i] = static_cast<uint8_t>(cur - prev + (128 + 256));
+                    prev = cur;
+                }
+            }
+
+            std::vector<uint8_t> &packed = scratch.packedBlocks[blockIdx];
+            mz_ulong packedSize = mz_compressBound(static_cast<mz_ulong>(rawSize));
+            packed.resize(packedSize);
+            const int32_t zRet = mz_compress2(
+                packed.data(), &packedSize, reordered, static_cast<mz_ulong>(rawSize), MZ_BEST_SPEED);
+            // JP: 圧縮で小さくならない場合は非圧縮で格納する(リーダーはサイズで判別する)。
+            // EN: Store uncompressed when compression does not shrink the data
+            //     (readers distinguish it by the size).
+            if (zRet != MZ_OK || packedSize >= rawSize) {
+                std::memcpy(packed.data(), raw, rawSize);
+                packedSize = static_cast<mz_ulong>(rawSize);
+            }
+            scratch.packedSizes[blockIdx] = static_cast<uint32_t>(packedSize);
+        }
+    });
+
+    std::vector<uint8_t> header;
+    const auto writeBytes = [&header](const void* data, size_t size) {
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        header.insert(header.end(), bytes, bytes + size);
+    };
+    const auto writeString = [&writeBytes](const char* str) {
+        writeBytes(str, strlen(str) + 1);
+    };
+    const auto writeAttribute = [&](const char* name, const char* type, const void* value, uint32_t size) {
+        writeString(name);
+        writeString(type);
+        writeBytes(&size, sizeof(size));
+        writeBytes(value, size);
+    };
+
+    const uint32_t magic = 20000630;
+    const uint32_t version = 2; // single-part scanline file
+    writeBytes(&magic, sizeof(magic));
+    writeBytes(&version, sizeof(version));
+    {
+        std::vector<uint8_t> chlist;
+        for (uint32_t chIdx = 0; chIdx < numChannels; ++chIdx) {
+            const char* name = channelNames[chIdx];
+            chlist.insert(chlist.end(), name, name + strlen(name) + 1);
+            const int32_t chInfo[4] = {
+                1, // HALF
+                0, // pLinear + reserved
+                1, 1 // x/y sampling
+            };
+            const uint8_t* chInfoBytes = reinterpret_cast<const uint8_t*>(chInfo);
+            chlist.insert(chlist.end(), chInfoBytes, chInfoBytes + sizeof(chInfo));
+        }
+        chlist.push_back(0);
+        writeAttribute("channels", "chlist", chlist.data(), static_cast<uint32_t>(chlist.size()));
+    }
+    const uint8_t compression = 3; // ZIP_COMPRESSION
+    writeAttribute("compression", "compression", &compression, sizeof(compression));
+    const int32_t window[4] = { 0, 0, static_cast<int32_t>(width) - 1, static_cast<int32_t>(height) - 1 };
+    writeAttribute("dataWindow", "box2i", window, sizeof(window));
+    writeAttribute("displayWindow", "box2i", window, sizeof(window));
+    const uint8_t lineOrder = 0; // INCREASING_Y
+    writeAttribute("lineOrder", "lineOrder", &lineOrder, sizeof(lineOrder));
+    const float pixelAspectRatio = 1.0f;
+    writeAttribute("pixelAspectRatio", "float", &pixelAspectRatio, sizeof(pixelAspectRatio));
+    const float screenWindowCenter[2] = { 0.0f, 0.0f };
+    writeAttribute("screenWindowCenter", "v2f", screenWindowCenter, sizeof(screenWindowCenter));
+    const float screenWindowWidth = 1.0f;
+    writeAttribute("screenWindowWidth", "float", &screenWindowWidth, sizeof(screenWindowWidth));
+    header.push_back(0);
+
+    uint64_t offset = header.size() + sizeof(uint64_t) * numBlocks;
+    for (uint32_t blockIdx = 0; blockIdx < numBlocks; ++blockIdx) {
+        writeBytes(&offset, sizeof(offset));
+        offset += 2 * sizeof(int32_t) + scratch.packedSizes[blockIdx];
+    }
+
+    std::ofstream ofs(filepath, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!ofs) {
+        fprintf(stderr, "Save EXR err: failed to open %s\n", filepath.string().c_str());
+        return false;
+    }
+    ofs.write(reinterpret_cast<const char*>(header.data()), header.size());
+    for (uint32_t blockIdx = 0; blockIdx < numBlocks; ++blockIdx) {
+        const int32_t blockHeader[2] = {
+            static_cast<int32_t>(blockIdx * exrNumScanlinesPerZipBlock),
+            static_cast<int32_t>(scratch.packedSizes[blockIdx])
+        };
+        ofs.write(reinterpret_cast<const char*>(blockHeader), sizeof(blockHeader));
+        ofs.write(
+            reinterpret_cast<const char*>(scratch.packedBlocks[blockIdx].data()),
+            scratch.packedSizes[blockIdx]);
+    }
+    if (!ofs) {
+        fprintf(stderr, "Save EXR err: failed to write %s\n", filepath.string().c_str());
+        return false;
+    }
+
+    return true;
+}
+
+void saveImageHDR(
+    const std::filesystem::path &filepath, uint32_t width, uint32_t height,
+    float brightnessScale,
+    const float* data, bool flipY) {
+    const char* const channelNames[] = { "Y" };
+    writeEXRImage(
+        filepath, width, height, channelNames,
+        [&](uint32_t y, uint16_t* dstRow) {
+        const uint32_t srcY = flipY ? (height - 1 - y) : y;
+        convertRowToHalf(data + static_cast<size_t>(srcY) * width, brightnessScale, width, dstRow);
+    });
+}
+
+void saveImageHDR(
+    const std::filesystem::path &filepath, uint32_t width, uint32_t height,
+    float brightnessScale,
+    const float4* data, bool flipY) {
+    // Must be (A)BGR order, since most of EXR viewers expect this channel order.
+    const char* const channelNames[] = { "A", "B", "G", "R" };
+    writeEXRImage(
+        filepath, width, height, channelNames,
+        [&](uint32_t y, uint16_t* dstRow) {
+        const uint32_t srcY = flipY ? (height - 1 - y) : y;
+        convertRowToHalfPlanar(data + static_cast<size_t>(srcY) * width, brightnessScale, width, dstRow);
+    });
+}
+
+// JP: [0, 1]の線形値から8ビットsRGB値へのLUT。
+//     2^-12から1までの各オクターブを256区間に分割し、区間中央の値を量子化して格納する。
+//     区間内のsRGB値の変化は0.5 LSB未満なので、直接計算との差は最大1 LSBに収まる。
+//     2^-12未満は量子化すると0になるので最初の区間に含めてよい。末尾の要素は1.0用。
+// EN: LUT from linear values in [0, 1] to 8-bit sRGB values.
+//     Each octave from 2^-12 to 1 is split into 256 intervals, and the quantized value at the center of
+//     each interval is stored.
+//     The sRGB value changes by less than 0.5 LSB within an interval, so the difference from
+//     direct evaluation is at most 1 LSB.
+//     Values below 2^-12 quantize to 0 so they can be merged into the first interval.
+//     The last element is for 1.0.
+static constexpr uint32_t sRGBLutNumOctaves = 12;
+static constexpr uint32_t sRGBLutLog2NumIntervalsPerOctave = 8;
+static constexpr uint32_t sRGBLutMinValueBits = (127 - sRGBLutNumOctaves) << 23;
+static constexpr uint32_t sRGBLutIndexShift = 23 - sRGBLutLog2NumIntervalsPerOctave;
+
+static const uint32_t* getSRGBEncodeLUT() {
+    static const std::vector<uint32_t> lut = []() {
+        constexpr uint32_t numIntervals = sRGBLutNumOctaves << sRGBLutLog2NumIntervalsPerOctave;
+        std::vector<uint32_t> ret(numIntervals + 1);
+        for (uint32_t i = 0; i < numIntervals; ++i) {
+            const uint32_t centerBits = sRGBLutMinValueBits + (i << sRGBLutIndexShift) + (1 << (sRGBLutIndexShift - 1));
+            float center;
+            std::memcpy(&center, &centerBits, sizeof(center));
+            ret[i] = std::min<uint32_t>(static_cast<uint32_t>(sRGB_gamma_s(center) * 255), 255);
+        }
+        ret[numIntervals] = 255;
+        return ret;
+    }();
+    return lut.data();
+}
+
+static inline uint32_t encodeSRGB8(const uint32_t* lut, float value) {
+    float minValue;
+    std::memcpy(&minValue, &sRGBLutMinValueBits, sizeof(minValue));
+    // JP: NaNも下限に丸められるように比較の向きに注意する。
+    // EN: Take care of the comparison direction so that NaN is also clamped to the lower bound.
+    value = value > minValue ? value : minValue;
+    value = value < 1.0f ? value : 1.0f;
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return lut[(bits - sRGBLutMinValueBits) >> sRGBLutIndexShift];
+}
+
+static inline uint32_t quantizeUNorm8(float value) {
+    value = value > 0.0f ? value : 0.0f;
+    value = value < 1.0f ? value : 1.0f;
+    return static_cast<uint32_t>(value * 255);
+}
+
+static void convertToSDRPixels(
+    const float4* src, uint32_t numPixels, const SDRImageSaverConfig &config, const uint32_t* lut,
+    uint32_t* dst) {
+    for (uint32_t i = 0; i < numPixels; ++i) {
+        float4 value = src[i];
+        if (config.alphaForOverride >= 0.0f)
+            value.w = config.alphaForOverride;
+        if (config.applyToneMap) {
+            RGB rgb(getXYZ(value));
+            if (!rgb.allFinite())
+                rgb = RGB(0.0f, 0.0f, 0.0f);
+            float lum = sRGB_calcLuminance(rgb);
+            float s = 0.0f;
+            if (lum > 0.0f)
+                s = simpleToneMap_s(config.brightnessScale * lum) / lum;
+            value.x = rgb.r * s;
+            value.y = rgb.g * s;
+            value.z = rgb.b * s;
+        }
+        uint32_t r, g, b;
+        if (config.apply_sRGB_gammaCorrection) {
+            r = encodeSRGB8(lut, value.x);
+            g = encodeSRGB8(lut, value.y);
+            b = encodeSRGB8(lut, value.z);
+        }
+        else {
+            r = quantizeUNorm8(value.x);
+            g = quantizeUNorm8(value.y);
+            b = quantizeUNorm8(value.z);
+        }
+        dst[i] = (r << 0) | (g << 8) | (b << 16) | (quantizeUNorm8(value.w) << 24);
+    }
+}
+
+static inline __m256i encodeSRGB8_AVX2(const uint32_t* lut, __m256 value) {
+    value = _mm256_min_ps(
+        _mm256_max_ps(value, _mm256_castsi256_ps(_mm256_set1_epi32(sRGBLutMinValueBits))),
+        _mm256_set1_ps(1.0f));
+    const __m256i indices = _mm256_srli_epi32(
+        _mm256_sub_epi32(_mm256_castps_si256(value), _mm256_set1_epi32(sRGBLutMinValueBits)),
+        sRGBLutIndexShift);
+    return _mm256_i32gather_epi32(reinterpret_cast<const int32_t*>(lut), indices, sizeof(uint32_t));
+}
+
+static inline __m256i quantizeUNorm8_AVX2(__m256 value) {
+    value = _mm256_min_ps(_mm256_max_ps(value, _mm256_setzero_ps()), _mm256_set1_ps(1.0f));
+    return _mm256_cvttps_epi32(_mm256_mul_ps(value, _mm256_set1_ps(255.0f)));
+}
+
+// JP: 8ピクセルずつ転置してトーンマップ、ガンマ補正、量子化を行う。端数はスカラー版で処理する。
+// EN: Transpose 8 pixels at a time to apply tone mapping, gamma correction and quantization.
+//     The remainder is processed by the scalar version.
+static void convertToSDRPixels_AVX2(
+    const float4* src, uint32_t numPixels, const SDRImageSaverConfig &config, const uint32_t* lut,
+    uint32_t* dst) {
+    const __m256 zero = _mm256_setzero_ps();
+    uint32_t i = 0;
+    for (; i + 8 <= numPixels; i += 8) {
+        const float* p = reinterpret_cast<const float*>(src + i);
+        const __m256 t0 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p + 0)), _mm_loadu_ps(p + 16), 1);
+        const __m256 t1 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p + 4)), _mm_loadu_ps(p + 20), 1);
+        const __m256 t2 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p + 8)), _mm_loadu_ps(p + 24), 1);
+        const __m256 t3 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p + 12)), _mm_loadu_ps(p + 28), 1);
+        const __m256 xy01 = _mm256_unpacklo_ps(t0, t1);
+        const __m256 xy23 = _mm256_unpacklo_ps(t2, t3);
+        const __m256 zw01 = _mm256_unpackhi_ps(t0, t1);
+        const __m256 zw23 = _mm256_unpackhi_ps(t2, t3);
+        __m256 r = _mm256_shuffle_ps(xy01, xy23, _MM_SHUFFLE(1, 0, 1, 0));
+        __m256 g = _mm256_shuffle_ps(xy01, xy23, _MM_SHUFFLE(3, 2, 3, 2));
+        __m256 b = _mm256_shuffle_ps(zw01, zw23, _MM_SHUFFLE(1, 0, 1, 0));
+        __m256 a = _mm256_shuffle_ps(zw01, zw23, _MM_SHUFFLE(3, 2, 3, 2));
+        if (config.alphaForOverride >= 0.0f)
+            a = _mm256_set1_ps(config.alphaForOverride);
+
+        if (config.applyToneMap) {
+            // JP: x - xはInfとNaNに対してのみNaNになる。
+            // EN: x - x becomes NaN only for Inf and NaN.
+            const __m256 finite = _mm256_cmp_ps(
+                _mm256_add_ps(_mm256_add_ps(_mm256_sub_ps(r, r), _mm256_sub_ps(g, g)), _mm256_sub_ps(b, b)),
+                zero, _CMP_EQ_OQ);
+            r = _mm256_and_ps(r, finite);
+            g = _mm256_and_ps(g, finite);
+            b = _mm256_and_ps(b, finite);
+            const __m256 lum = _mm256_add_ps(
+                _mm256_add_ps(
+                    _mm256_mul_ps(r, _mm256_set1_ps(0.2126729f)),
+                    _mm256_mul_ps(g, _mm256_set1_ps(0.7151522f))),
+                _mm256_mul_ps(b, _mm256_set1_ps(0.0721750f)));
+            const __m256 lumT = _mm256_sub_ps(
+                _mm256_set1_ps(1.0f),
+                exp_AVX2(_mm256_mul_ps(lum, _mm256_set1_ps(-config.brightnessScale))));
+            const __m256 s = _mm256_and_ps(
+                _mm256_div_ps(lumT, lum),
+                _mm256_cmp_ps(lum, zero, _CMP_GT_OQ));
+            r = _mm256_mul_ps(r, s);
+            g = _mm256_mul_ps(g, s);
+            b = _mm256_mul_ps(b, s);
+        }
+
+        __m256i ri, gi, bi;
+        if (config.apply_sRGB_gammaCorrection) {
+            ri = encodeSRGB8_AVX2(lut, r);
+            gi = encodeSRGB8_AVX2(lut, g);
+            bi = encodeSRGB8_AVX2(lut, b);
+        }
+        else {
+            ri = quantizeUNorm8_AVX2(r);
+            gi = quantizeUNorm8_AVX2(g);
+            bi = quantizeUNorm8_AVX2(b);
+        }
+        const __m256i ai = quantizeUNorm8_AVX2(a);
+        const __m256i packed = _mm256_or_si256(
+            _mm256_or_si256(ri, _mm256_slli_epi32(gi, 8)),
+            _mm256_or_si256(_mm256_slli_epi32(bi, 16), _mm256_slli_epi32(ai, 24)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), packed);
+    }
+    convertToSDRPixels(src + i, numPixels - i, config, lut, dst + i);
+}
+
+void convertToSDRImage(
+    uint32_t width, uint32_t height, const float4* data,
+    const SDRImageSaverConfig &config, uint32_t* dstImage) {
+    const uint32_t* lut = getSRGBEncodeLUT();
+    const bool useAVX2 = isAVX2Supported();
+    parallelForChunks(
+        0, height, 16,
+        [&](uint32_t chunkIdx, uint32_t yBegin, uint32_t yEnd) {
+        for (uint32_t y = yBegin; y < yEnd; ++y) {
+            const uint32_t sy = config.flipY ? (height - 1 - y) : y;
+            const float4* srcRow = data + static_cast<size_t>(sy) * width;
+            uint32_t* dstRow = dstImage + static_cast<size_t>(y) * width;
+            if (useAVX2)
+                convertToSDRPixels_AVX2(srcRow, width, config, lut, dstRow);
+            else
+                convertToSDRPixels(srcRow, width, config, lut, dstRow);
+        }
+    });
+}
+
+// JP: LUTとSIMD化の前の逐次的な変換。ベンチマークでの比較と誤差の確認にのみ使う。
+// EN: The sequential conversion before the LUT and SIMD.
+//     Used only for comparison and error check in the benchmark.
+static void convertToSDRImageLegacy(
+    uint32_t width, uint32_t height, const float4* data,
+    const SDRImageSaverConfig &config, uint32_t* dstImage) {
+    for (int y = 0; y < static_cast<int32_t>(height); ++y) {
+        uint32_t sy = config.flipY ? (height - 1 - y) : y;
+        for (int x = 0; x < static_cast<int32_t>(width); ++x) {
+            float4 src = data[sy * width + x];
+            if (config.alphaForOverride >= 0.0f)
+                src.w = config.alphaForOverride;
+            if (config.applyToneMap) {
+                RGB rgb(getXYZ(src));
+                if (!rgb.allFinite())
+                    rgb = RGB(0.0f, 0.0f, 0.0f);
+                float lum = sRGB_calcLuminance(rgb);
+                float lumT = simpleToneMap_s(config.brightnessScale * lum);
+                float s = lum > 0.0f ? lumT / lum : 0.0f;
+                src.x = rgb.r * s;
+                src.y = rgb.g * s;
+                src.z = rgb.b * s;
+            }
+            if (config.apply_sRGB_gammaCorrection) {
+                src.x = sRGB_gamma_s(src.x);
+                src.y = sRGB_gamma_s(src.y);
+                src.z = sRGB_gamma_s(src.z);
+            }
+            uint32_t &dst = dstImage[y * width + x];
+            dst = ((std::min<uint32_t>(static_cast<uint32_t>(src.x * 255), 255) << 0) |
+                   (std::min<uint32_t>(static_cast<uint32_t>(src.y * 255), 255) << 8) |
+                   (std::min<uint32_t>(static_cast<uint32_t>(src.z * 255), 255) << 16) |
+                   (std::min<uint32_t>(static_cast<uint32_t>(src.w * 255), 255) << 24));
+        }
+    }
+}
+
+int32_t benchmarkSDRConversion(uint32_t width, uint32_t height) {
+    StopWatchHiRes sw;
+    const auto measure = [&sw](const auto &func) {
+        sw.start();
+        func();
+        return sw.getMeasurement(sw.stop(), StopWatchDurationType::Microseconds) * 1e-3f;
+    };
+
+    // JP: 暗部から白飛びまでを含むように対数的に分布するHDR値を作る。
+    //     従来の変換が受け付けない負の値は含めない。
+    // EN: Make HDR values distributed logarithmically to include from dark areas to blown-out highlights.
+    //     Don't include negative values that the legacy conversion doesn't accept.
+    const size_t numPixels = static_cast<size_t>(width) * height;
+    std::vector<float4> hdrImage(numPixels);
+    {
+        std::mt19937 rng(718249043);
+        std::uniform_real_distribution<float> uLog2(-14.0f, 4.0f);
+        std::uniform_real_distribution<float> u01;
+        for (float4 &value : hdrImage)
+            value = make_float4(
+                std::exp2(uLog2(rng)), std::exp2(uLog2(rng)), std::exp2(uLog2(rng)), u01(rng));
+    }
+    std::vector<uint32_t> legacyImage(numPixels);
+    std::vector<uint32_t> image(numPixels);
+
+    struct TestCase {
+        const char* name;
+        bool applyToneMap;
+        bool apply_sRGB_gammaCorrection;
+    };
+    const TestCase testCases[] = {
+        { "Tone map + sRGB", true, true },
+        { "sRGB", false, true },
+        { "Linear", false, false },
+    };
+
+    hpprintf("SDR conversion of %u x %u pixels (AVX2: %s)\n",
+             width, height, isAVX2Supported() ? "yes" : "no");
+    bool withinTolerance = true;
+    for (const TestCase &testCase : testCases) {
+        SDRImageSaverConfig config;
+        config.brightnessScale = 0.5f;
+        config.applyToneMap = testCase.applyToneMap;
+        config.apply_sRGB_gammaCorrection = testCase.apply_sRGB_gammaCorrection;
+
+        const float legacyTime = measure([&]() {
+            convertToSDRImageLegacy(width, height, hdrImage.data(), config, legacyImage.data());
+        });
+        const float time = measure([&]() {
+            convertToSDRImage(width, height, hdrImage.data(), config, image.data());
+        });
+
+        // JP: 各チャンネルの差は最大1 LSBに収まらなければならない。
+        // EN: The difference of each channel must be within 1 LSB.
+        uint32_t maxDiff = 0;
+        size_t numDiffPixels = 0;
+        for (size_t i = 0; i < numPixels; ++i) {
+            if (image[i] == legacyImage[i])
+                continue;
+            ++numDiffPixels;
+            for (uint32_t c = 0; c < 4; ++c) {
+                const int32_t a = (image[i] >> (8 * c)) & 0xFF;
+                const int32_t b = (legacyImage[i] >> (8 * c)) & 0xFF;
+                maxDiff = std::max<uint32_t>(maxDiff, std::abs(a - b));
+            }
+        }
+        withinTolerance &= maxDiff <= 1;
+
+        hpprintf("%s:\n", testCase.name);
+        hpprintf("  legacy: %.3f [ms], current: %.3f [ms] (x%.2f)\n",
+                 legacyTime, time, legacyTime / time);
+        hpprintf("  max difference: %u [LSB], differing pixels: %zu / %zu\n",
+                 maxDiff, numDiffPixels, numPixels);
+    }
+
+    return withinTolerance ? 0 : -1;
+}
+
+void saveImage(
+    const std::filesystem::path &filepath, uint32_t width, uint32_t height, const float4* data,
+    const SDRImageSaverConfig &config) {
+    static thread_local std::vector<uint32_t> image;
+    image.resize(static_cast<size_t>(width) * height);
+    convertToSDRImage(width, height, data, config, image.data());
+    saveImage(filepath, width, height, image.data());
+}
+
+void saveImage(
+    const std::filesystem::path &filepath,
+    uint32_t width, cudau::TypedBuffer<float4> &buffer,
+    const SDRImageSaverConfig &config) {
+    Assert(buffer.numElements() % width == 0, "Buffer's length is not divisible by the width.");
+    uint32_t height = static_cast<uint32_t>(buffer.numElements()) / width;
+    auto data = buffer.map();
+    saveImage(filepath, width, height, data, config);
+    buffer.unmap();
+}
+
+void saveImage(
+    const std::filesystem::path &filepath,
+    cudau::Array &array,
+    const SDRImageSaverConfig &config) {
+    auto data = array.map<float4>();
+    saveImage(
+        filepath,
+        static_cast<uint32_t>(array.getWidth()), static_cast<uint32_t>(array.getHeight()),
+        data, config);
+    array.unmap();
+}
+
+
+
+void FrameCapturer::initialize(uint32_t numStagingBuffers, uint32_t numThreads) {
+    Assert(numStagingBuffers > 0, "At least one staging buffer is required.");
+    m_slots.resize(numStagingBuffers);
+    for (StagingSlot &slot : m_slots) {
+        slot.buffer = 0;
+        slot.mappedData = nullptr;
+        slot.numAllocatedPixels = 0;
+        slot.fence = nullptr;
+        slot.width = 0;
+        slot.height = 0;
+        slot.state = SlotState::Free;
+    }
+    m_nextSlotIndex = 0;
+
+    // JP: 各書き出しは内部で並列化されるので、ワーカーはハードウェアスレッドの半分に留める。
+    // EN: Each write is parallelized internally, so limit the workers to half the hardware threads.
+    if (numThreads == 0)
+        numThreads = std::max(std::thread::hardware_concurrency() / 2, 1u);
+    m_stopRequested = false;
+    m_workers.reserve(numThreads);
+    for (uint32_t i = 0; i < numThreads; ++i)
+        m_workers.emplace_back(&FrameCapturer::workerMain, this);
+}
+
+void FrameCapturer::finalize() {
+    if (m_slots.empty())
+        return;
+
+    waitAll();
+    {
+        std::lock_guard lock(m_mutex);
+        m_stopRequested = true;
+    }
+    m_workerCv.notify_all();
+    for (std::thread &worker : m_workers)
+        worker.join();
+    m_workers.clear();
+
+    for (StagingSlot &slot : m_slots) {
+        if (slot.buffer == 0)
+            continue;
+        glUnmapNamedBuffer(slot.buffer);
+        glDeleteBuffers(1, &slot.buffer);
+    }
+    m_slots.clear();
+    m_encodeQueue.clear();
+}
+
+void FrameCapturer::workerMain() {
+    while (true) {
+        uint32_t slotIndex;
+        {
+            std::unique_lock lock(m_mutex);
+            m_workerCv.wait(lock, [this]() { return m_stopRequested || !m_encodeQueue.empty(); });
+            if (m_stopRequested)
+                return;
 
-        free(textureData);
+            slotIndex = m_encodeQueue.front();
+            m_encodeQueue.erase(m_encodeQueue.begin());
+        }
 
-        envLightImportanceMap->initialize(
-            cuContext, Scene::bufferType, importanceData, width, height);
-        delete[] importanceData;
+        // JP: スロットはEncoding状態の間はメインスレッドから変更されない。
+        // EN: The main thread does not modify the slot while it is in the Encoding state.
+        const StagingSlot &slot = m_slots[slotIndex];
+        const Request &request = slot.request;
+        for (const std::filesystem::path &filePath : { request.sdrFilePath, request.hdrFilePath }) {
+            if (filePath.has_parent_path()) {
+                std::error_code ec;
+                std::filesystem::create_directories(filePath.parent_path(), ec);
+            }
+        }
+        if (!request.sdrFilePath.empty()) {
+            SDRImageSaverConfig config = request.sdrConfig;
+            config.flipY = request.flipY;
+            saveImage(request.sdrFilePath, slot.width, slot.height, slot.mappedData, config);
+        }
+        if (!request.hdrFilePath.empty()) {
+            saveImageHDR(
+                request.hdrFilePath, slot.width, slot.height,
+                request.hdrBrightnessScale, slot.mappedData, request.flipY);
+        }
 
-        *envLightTexture = sampler_float.createTextureObject(*envLightArray);
+        {
+            std::lock_guard lock(m_mutex);
+            m_slots[slotIndex].state = SlotState::Free;
+        }
+        m_slotCv.notify_all();
     }
-    else {
-        hpprintf("Failed to read %s\n", filePath.string().c_str());
-        hpprintf("%s\n", errMsg);
-        FreeEXRErrorMessage(errMsg);
+}
+
+void FrameCapturer::dispatchCompletedReadbacks(bool wait) {
+    for (uint32_t i = 0; i < m_slots.size(); ++i) {
+        // JP: Readback状態への遷移と解除はメインスレッドでのみ行われる。
+        // EN: Transitions to and from the Readback state happen only on the main thread.
+        const uint32_t slotIndex = (m_nextSlotIndex + i) % m_slots.size();
+        StagingSlot &slot = m_slots[slotIndex];
+        {
+            std::lock_guard lock(m_mutex);
+            if (slot.state != SlotState::Readback)
+                continue;
+        }
+
+        const GLenum status = glClientWaitSync(
+            slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, wait ? GL_TIMEOUT_IGNORED : 0);
+        if (status == GL_TIMEOUT_EXPIRED)
+            continue;
+        glDeleteSync(slot.fence);
+        slot.fence = nullptr;
+
+        std::lock_guard lock(m_mutex);
+        if (status == GL_WAIT_FAILED) {
+            hpprintf("Frame capture readback failed.\n");
+            slot.state = SlotState::Free;
+            continue;
+        }
+        slot.state = SlotState::Encoding;
+        m_encodeQueue.push_back(slotIndex);
+        m_workerCv.notify_one();
     }
 }
 
+void FrameCapturer::capture(GLuint texture, uint32_t width, uint32_t height, const Request &request) {
+    Assert(!m_slots.empty(), "FrameCapturer is not initialized.");
+    const uint32_t slotIndex = m_nextSlotIndex;
+    m_nextSlotIndex = (m_nextSlotIndex + 1) % m_slots.size();
+    StagingSlot &slot = m_slots[slotIndex];
 
+    // JP: リングを一周して使用中のスロットに戻ってきた場合は、その書き出しの完了を待つ。
+    // EN: Wait for the write of the slot when the ring wraps around to a slot in use.
+    bool readbackPending;
+    {
+        std::lock_guard lock(m_mutex);
+        readbackPending = slot.state == SlotState::Readback;
+    }
+    if (readbackPending)
+        dispatchCompletedReadbacks(true);
+    {
+        std::unique_lock lock(m_mutex);
+        m_slotCv.wait(lock, [&slot]() { return slot.state == SlotState::Free; });
+    }
 
-void saveImage(const std::filesystem::path &filepath, uint32_t width, uint32_t height, const uint32_t* data) {
-    if (filepath.extension() == ".png")
-        stbi_write_png(filepath.string().c_str(), width, height, 4, data,
-                       width * sizeof(uint32_t));
-    else if (filepath.extension() == ".bmp")
-        stbi_write_bmp(filepath.string().c_str(), width, height, 4, data);
-    else
-        Assert_ShouldNotBeCalled();
+    const size_t numPixels = static_cast<size_t>(width) * height;
+    if (numPixels > slot.numAllocatedPixels) {
+        if (slot.buffer != 0) {
+            glUnmapNamedBuffer(slot.buffer);
+            glDeleteBuffers(1, &slot.buffer);
+        }
+        const GLbitfield mapFlags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glCreateBuffers(1, &slot.buffer);
+        glNamedBufferStorage(
+            slot.buffer, numPixels * sizeof(float4), nullptr, mapFlags | GL_CLIENT_STORAGE_BIT);
+        slot.mappedData = static_cast<const float4*>(
+            glMapNamedBufferRange(slot.buffer, 0, numPixels * sizeof(float4), mapFlags));
+        slot.numAllocatedPixels = numPixels;
+    }
+    slot.width = width;
+    slot.height = height;
+    slot.request = request;
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+    glGetTextureSubImage(
+        texture, 0,
+        0, 0, 0, width, height, 1,
+        GL_RGBA, GL_FLOAT, static_cast<GLsizei>(numPixels * sizeof(float4)), nullptr);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+    std::lock_guard lock(m_mutex);
+    slot.state = SlotState::Readback;
 }
 
-void saveImageHDR(
-    const std::filesystem::path &filepath, uint32_t width, uint32_t height,
-    float brightnessScale,
-    const float* data, bool flipY) {
-    EXRHeader header;
-    InitEXRHeader(&header);
+void FrameCapturer::waitAll() {
+    dispatchCompletedReadbacks(true);
+    std::unique_lock lock(m_mutex);
+    m_slotCv.wait(lock, [this]() {
+        for (const StagingSlot &slot : m_slots) {
+            if (slot.state != SlotState::Free)
+                return false;
+        }
+        return true;
+    });
+}
+
+uint32_t FrameCapturer::getNumPendingFrames() {
+    std::lock_guard lock(m_mutex);
+    uint32_t numPendingFrames = 0;
+    for (const StagingSlot &slot : m_slots)
+        numPendingFrames += slot.state != SlotState::Free;
+    return numPendingFrames;
+}
+
+std::filesystem::path FrameCapturer::makeSequenceFilePath(
+    const std::filesystem::path &prefix, uint32_t frameIndex, const char* extension) {
+    char suffix[64];
+    snprintf(suffix, sizeof(suffix), "_%06u.%s", frameIndex, extension);
+    std::filesystem::path filePath = prefix;
+    filePath += suffix;
+    return filePath;
+}
 
-    EXRImage image;
-    InitEXRImage(&image);
 
-    image.num_channels = 4;
 
-    std::vector<float> images[4];
-    images[0].resize(width * height);
-    images[1].resize(width * height);
-    images[2].resize(width * height);
-    images[3].resize(width * height);
+CommandlineParseResult parseBenchmarkOption(
+    int32_t argc, const char* argv[], int32_t* argIdx, BenchmarkConfig* config) {
+    int32_t &i = *argIdx;
+    const char* arg = argv[i];
+    if (strncmp(arg, "-headless", 10) == 0) {
+        config->headless = true;
+    }
+    else if (strncmp(arg, "-frames", 8) == 0) {
+        if (i + 1 >= argc)
+            return CommandlineParseResult::Invalid;
+        char* end;
+        unsigned long numFrames = std::strtoul(argv[i + 1], &end, 10);
+        if (*end != '\0' || numFrames == 0 || numFrames > UINT32_MAX)
+            return CommandlineParseResult::Invalid;
+        config->numFrames = static_cast<uint32_t>(numFrames);
+        i += 1;
+    }
+    else if (strncmp(arg, "-camera-path", 13) == 0) {
+        if (i + 1 >= argc)
+            return CommandlineParseResult::Invalid;
+        config->cameraPathFile = argv[i + 1];
+        i += 1;
+    }
+    else if (strncmp(arg, "-report", 8) == 0) {
+        if (i + 1 >= argc)
+            return CommandlineParseResult::Invalid;
+        config->reportFile = argv[i + 1];
+        i += 1;
+    }
+    else {
+        return CommandlineParseResult::Unhandled;
+    }
+    return CommandlineParseResult::Handled;
+}
+
 
-    for (uint32_t y = 0; y < height; ++y) {
-        for (uint32_t x = 0; x < width; ++x) {
-            uint32_t srcIdx = y * width + x;
-            uint32_t dstIdx = (flipY ? (height - 1 - y) : y) * width + x;
-            images[0][dstIdx] = brightnessScale * data[srcIdx];
-            images[1][dstIdx] = 0.0f;
-            images[2][dstIdx] = 0.0f;
-            images[3][dstIdx] = 0.0f;
+
+bool CameraPath::load(const std::filesystem::path &filePath) {
+    std::ifstream ifs(filePath);
+    if (!ifs.is_open()) {
+        hpprintf("Failed to open the camera path: %s\n", filePath.string().c_str());
+        return false;
+    }
+    return parse(ifs);
+}
+
+bool CameraPath::parse(std::istream &stream) {
+    m_keyframes.clear();
+    std::string line;
+    uint32_t lineIndex = 0;
+    while (std::getline(stream, line)) {
+        ++lineIndex;
+        size_t commentPos = line.find('#');
+        if (commentPos != std::string::npos)
+            line.resize(commentPos);
+        if (line.find_first_not_of(" \t\r") == std::string::npos)
+            continue;
+
+        std::istringstream lineStream(line);
+        float time;
+        Point3D position;
+        float roll, pitch, yaw;
+        lineStream >> time >> position.x >> position.y >> position.z >> roll >> pitch >> yaw;
+        std::string rest;
+        if (lineStream.fail() || (lineStream >> rest) ||
+            !std::isfinite(time) || !position.allFinite() ||
+            !std::isfinite(roll) || !std::isfinite(pitch) || !std::isfinite(yaw) ||
+            (!m_keyframes.empty() && time < m_keyframes.back().time)) {
+            hpprintf("Invalid camera path keyframe at line %u.\n", lineIndex);
+            m_keyframes.clear();
+            return false;
         }
+
+        Quaternion orientation = qFromEulerAngles(
+            roll * pi_v<float> / 180, pitch * pi_v<float> / 180, yaw * pi_v<float> / 180);
+        addKeyframe(time, position, orientation);
     }
 
-    float* image_ptr[4];
-    image_ptr[0] = &(images[3].at(0)); // A
-    image_ptr[1] = &(images[2].at(0)); // B
-    image_ptr[2] = &(images[1].at(0)); // G
-    image_ptr[3] = &(images[0].at(0)); // R
+    return !m_keyframes.empty();
+}
 
-    image.images = (unsigned char**)image_ptr;
-    image.width = width;
-    image.height = height;
+void CameraPath::addKeyframe(float time, const Point3D &position, const Quaternion &orientation) {
+    Assert(m_keyframes.empty() || time >= m_keyframes.back().time,
+           "Keyframes need to be added in time order.");
+    Keyframe keyframe;
+    keyframe.time = time;
+    keyframe.position = position;
+    keyframe.orientation = normalize(orientation);
+    // JP: 隣接するキーフレームの姿勢を同じ半球に揃えて最短経路で補間されるようにする。
+    // EN: Align the orientation to the same hemisphere as the previous keyframe to interpolate along the shortest arc.
+    if (!m_keyframes.empty() && dot(m_keyframes.back().orientation, keyframe.orientation) < 0.0f)
+        keyframe.orientation = -keyframe.orientation;
+    m_keyframes.push_back(keyframe);
+}
 
-    header.num_channels = 4;
-    header.channels = (EXRChannelInfo *)malloc(sizeof(EXRChannelInfo) * header.num_channels);
-    // Must be (A)BGR order, since most of EXR viewers expect this channel order.
-    strncpy(header.channels[0].name, "A", 255); header.channels[0].name[strlen("A")] = '\0';
-    strncpy(header.channels[1].name, "B", 255); header.channels[1].name[strlen("B")] = '\0';
-    strncpy(header.channels[2].name, "G", 255); header.channels[2].name[strlen("G")] = '\0';
-    strncpy(header.channels[3].name, "R", 255); header.channels[3].name[strlen("R")] = '\0';
+void CameraPath::evaluate(float time, Point3D* position, Quaternion* orientation) const {
+    Assert(!m_keyframes.empty(), "Camera path is empty.");
+    if (time <= m_keyframes.front().time) {
+        *position = m_keyframes.front().position;
+        *orientation = m_keyframes.front().orientation;
+        return;
+    }
+    if (time >= m_keyframes.back().time) {
+        *position = m_keyframes.back().position;
+        *orientation = m_keyframes.back().orientation;
+        return;
+    }
 
-    header.pixel_types = (int32_t*)malloc(sizeof(int32_t) * header.num_channels);
-    header.requested_pixel_types = (int32_t*)malloc(sizeof(int32_t) * header.num_channels);
-    for (int i = 0; i < header.num_channels; i++) {
-        header.pixel_types[i] = TINYEXR_PIXELTYPE_FLOAT; // pixel type of input image
-        header.requested_pixel_types[i] = TINYEXR_PIXELTYPE_HALF; // pixel type of output image to be stored in .EXR
+    auto it = std::upper_bound(
+        m_keyframes.cbegin(), m_keyframes.cend(), time,
+        [](float t, const Keyframe &keyframe) {
+            return t < keyframe.time;
+        });
+    const Keyframe &kfB = *it;
+    const Keyframe &kfA = *(it - 1);
+    float duration = kfB.time - kfA.time;
+    float t = duration > 0.0f ? (time - kfA.time) / duration : 1.0f;
+    *position = kfA.position + t * (kfB.position - kfA.position);
+    *orientation = Slerp(t, kfA.orientation, kfB.orientation);
+}
+
+void CameraPath::evaluateAtFrame(
+    uint32_t frameIndex, uint32_t numFrames, Point3D* position, Quaternion* orientation) const {
+    float t = numFrames > 1 ?
+        static_cast<float>(std::min(frameIndex, numFrames - 1)) / (numFrames - 1) :
+        0.0f;
+    float beginTime = getBeginTime();
+    evaluate(beginTime + t * (getEndTime() - beginTime), position, orientation);
+}
+
+
+
+void BenchmarkReport::record(const std::string &name, float value) {
+    for (Series &series : m_series) {
+        if (series.name == name) {
+            series.samples.push_back(value);
+            return;
+        }
     }
+    Series series;
+    series.name = name;
+    series.samples.push_back(value);
+    m_series.push_back(std::move(series));
+}
 
-    const char* err = nullptr;
-    int32_t ret = SaveEXRImageToFile(&image, &header, filepath.string().c_str(), &err);
-    if (ret != TINYEXR_SUCCESS) {
-        fprintf(stderr, "Save EXR err: %s\n", err);
-        FreeEXRErrorMessage(err);
+const std::vector<float>* BenchmarkReport::getSamples(const std::string &name) const {
+    for (const Series &series : m_series) {
+        if (series.name == name)
+            return &series.samples;
     }
+    return nullptr;
+}
 
-    free(header.channels);
-    free(header.pixel_types);
-    free(header.requested_pixel_types);
+BenchmarkReport::Statistics BenchmarkReport::computeStatistics(std::vector<float> samples) {
+    Statistics stats = {};
+    stats.numSamples = static_cast<uint32_t>(samples.size());
+    if (samples.empty())
+        return stats;
+
+    std::sort(samples.begin(), samples.end());
+    size_t n = samples.size();
+    stats.min = samples.front();
+    stats.max = samples.back();
+    stats.median = (n % 2 == 1) ?
+        samples[n / 2] :
+        0.5f * (samples[n / 2 - 1] + samples[n / 2]);
+    size_t p99Rank = (99 * n + 99) / 100; // ceil(0.99 * n)
+    stats.p99 = samples[std::max<size_t>(p99Rank, 1) - 1];
+    double sum = 0.0;
+    for (float value : samples)
+        sum += value;
+    stats.mean = static_cast<float>(sum / n);
+
+    return stats;
 }
 
-void saveImageHDR(
-    const std::filesystem::path &filepath, uint32_t width, uint32_t height,
-    float brightnessScale,
-    const float4* data, bool flipY) {
-    EXRHeader header;
-    InitEXRHeader(&header);
+static void writeJSONString(std::ostream &os, const std::string &str) {
+    os << '"';
+    for (char c : str) {
+        if (c == '"' || c == '\\') {
+            os << '\\' << c;
+        }
+        else if (static_cast<unsigned char>(c) < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", static_cast<uint32_t>(c));
+            os << buf;
+        }
+        else {
+            os << c;
+        }
+    }
+    os << '"';
+}
+
+bool BenchmarkReport::writeJSON(
+    const std::filesystem::path &filePath, const char* programName,
+    uint32_t imageWidth, uint32_t imageHeight) const {
+    std::ofstream ofs(filePath);
+    if (!ofs.is_open()) {
+        hpprintf("Failed to open the benchmark report: %s\n", filePath.string().c_str());
+        return false;
+    }
+
+    ofs << std::setprecision(6) << std::fixed;
+    ofs << "{\n";
+    ofs << "  \"program\": ";
+    writeJSONString(ofs, programName);
+    ofs << ",\n";
+    ofs << "  \"imageSize\": [" << imageWidth << ", " << imageHeight << "],\n";
+    ofs << "  \"unit\": \"ms\",\n";
+    ofs << "  \"passes\": {";
+    for (int i = 0; i < m_series.size(); ++i) {
+        const Series &series = m_series[i];
+        Statistics stats = computeStatistics(series.samples);
+        ofs << (i > 0 ? ",\n    " : "\n    ");
+        writeJSONString(ofs, series.name);
+        ofs << ": { "
+            << "\"count\": " << stats.numSamples << ", "
+            << "\"min\": " << stats.min << ", "
+            << "\"median\": " << stats.median << ", "
+            << "\"p99\": " << stats.p99 << ", "
+            << "\"mean\": " << stats.mean << ", "
+            << "\"max\": " << stats.max << " }";
+    }
+    ofs << (m_series.empty() ? "}\n" : "\n  }\n");
+    ofs << "}\n";
+
+    return !ofs.fail();
+}
 
-    EXRImage image;
-    InitEXRImage(&image);
 
-    image.num_channels = 4;
 
-    std::vector<float> images[4];
-    images[0].resize(width * height);
-    images[1].resize(width * height);
-    images[2].resize(width * height);
-    images[3].resize(width * height);
+static bool reportSelfTestCheck(const char* name, bool passed) {
+    hpprintf("%s: %s\n", passed ? "OK" : "FAILED", name);
+    return passed;
+}
 
-    for (uint32_t y = 0; y < height; ++y) {
-        for (uint32_t x = 0; x < width; ++x) {
-            uint32_t srcIdx = y * width + x;
-            uint32_t dstIdx = (flipY ? (height - 1 - y) : y) * width + x;
-            images[0][dstIdx] = brightnessScale * data[srcIdx].x;
-            images[1][dstIdx] = brightnessScale * data[srcIdx].y;
-            images[2][dstIdx] = brightnessScale * data[srcIdx].z;
-            images[3][dstIdx] = brightnessScale * data[srcIdx].w;
+// JP: parseBenchmarkOption()を各サンプルのparseCommandline()と同じ形で呼び出して結果を確かめる。
+// EN: Call parseBenchmarkOption() in the same way as parseCommandline() of each sample and check the results.
+static bool testBenchmarkOptionParsing() {
+    const auto parseAll = [](
+        int32_t argc, const char* argv[], BenchmarkConfig* config, std::vector<CommandlineParseResult>* results) {
+        for (int32_t i = 0; i < argc; ++i) {
+            CommandlineParseResult result = parseBenchmarkOption(argc, argv, &i, config);
+            results->push_back(result);
+            if (result == CommandlineParseResult::Invalid)
+                break;
         }
+    };
+
+    bool success = true;
+
+    {
+        BenchmarkConfig config;
+        success &= reportSelfTestCheck(
+            "Benchmark option defaults",
+            !config.headless && config.numFrames == 100 &&
+            config.reportFile == "benchmark.json" && config.cameraPathFile.empty());
+    }
+
+    {
+        const char* argv[] = {
+            "-headless", "-frames", "120", "-camera-path", "path.txt", "-scene", "-report", "out.json"
+        };
+        BenchmarkConfig config;
+        std::vector<CommandlineParseResult> results;
+        parseAll(static_cast<int32_t>(lengthof(argv)), argv, &config, &results);
+        const std::vector<CommandlineParseResult> expectedResults = {
+            CommandlineParseResult::Handled,
+            CommandlineParseResult::Handled,
+            CommandlineParseResult::Handled,
+            CommandlineParseResult::Unhandled,
+            CommandlineParseResult::Handled,
+        };
+        success &= reportSelfTestCheck(
+            "Benchmark options with an unrelated option",
+            results == expectedResults &&
+            config.headless && config.numFrames == 120 &&
+            config.cameraPathFile == "path.txt" && config.reportFile == "out.json");
+    }
+
+    // JP: 引数の欠落や不正なフレーム数はInvalidになる。
+    // EN: A missing argument or an invalid number of frames results in Invalid.
+    const char* const invalidArgLists[][2] = {
+        { "-frames", nullptr },
+        { "-frames", "0" },
+        { "-frames", "12x" },
+        { "-frames", "" },
+        { "-camera-path", nullptr },
+        { "-report", nullptr },
+    };
+    for (const auto &invalidArgs : invalidArgLists) {
+        const char* argv[] = { invalidArgs[0], invalidArgs[1] };
+        const int32_t argc = invalidArgs[1] ? 2 : 1;
+        int32_t i = 0;
+        BenchmarkConfig config;
+        const CommandlineParseResult result = parseBenchmarkOption(argc, argv, &i, &config);
+        char name[128];
+        if (invalidArgs[1])
+            snprintf(name, sizeof(name), "Invalid benchmark option: %s '%s'", invalidArgs[0], invalidArgs[1]);
+        else
+            snprintf(name, sizeof(name), "Invalid benchmark option: %s without an argument", invalidArgs[0]);
+        success &= reportSelfTestCheck(
+            name, result == CommandlineParseResult::Invalid && config.numFrames == 100);
     }
 
-    float* image_ptr[4];
-    image_ptr[0] = &(images[3].at(0)); // A
-    image_ptr[1] = &(images[2].at(0)); // B
-    image_ptr[2] = &(images[1].at(0)); // G
-    image_ptr[3] = &(images[0].at(0)); // R
+    return success;
+}
 
-    image.images = (unsigned char**)image_ptr;
-    image.width = width;
-    image.height = height;
+// JP: CameraPathの読み込み、キーフレーム間の補間、範囲外の時刻の扱い、フレームへの割り当てを確かめる。
+// EN: Check CameraPath's loading, interpolation between keyframes, handling of out-of-range times
+//     and distribution over frames.
+static bool testCameraPathInterpolation() {
+    constexpr float tolerance = 1e-5f;
+    const auto isSameOrientation = [](const Quaternion &a, const Quaternion &b) {
+        return std::fabs(dot(a, b)) > 1.0f - tolerance;
+    };
+    const float deg = pi_v<float> / 180;
 
-    header.num_channels = 4;
-    header.channels = (EXRChannelInfo *)malloc(sizeof(EXRChannelInfo) * header.num_channels);
-    // Must be (A)BGR order, since most of EXR viewers expect this channel order.
-    strncpy(header.channels[0].name, "A", 255); header.channels[0].name[strlen("A")] = '\0';
-    strncpy(header.channels[1].name, "B", 255); header.channels[1].name[strlen("B")] = '\0';
-    strncpy(header.channels[2].name, "G", 255); header.channels[2].name[strlen("G")] = '\0';
-    strncpy(header.channels[3].name, "R", 255); header.channels[3].name[strlen("R")] = '\0';
+    bool success = true;
 
-    header.pixel_types = (int32_t*)malloc(sizeof(int32_t) * header.num_channels);
-    header.requested_pixel_types = (int32_t*)malloc(sizeof(int32_t) * header.num_channels);
-    for (int i = 0; i < header.num_channels; i++) {
-        header.pixel_types[i] = TINYEXR_PIXELTYPE_FLOAT; // pixel type of input image
-        header.requested_pixel_types[i] = TINYEXR_PIXELTYPE_HALF; // pixel type of output image to be stored in .EXR
+    CameraPath path;
+    {
+        std::istringstream stream(
+            "# time px py pz roll pitch yaw\n"
+            "0 0 0 0 0 0 0\n"
+            "\n"
+            "2 2 4 -6 0 0 90 # turn left\n");
+        const bool loaded = path.parse(stream);
+        success &= reportSelfTestCheck(
+            "Camera path parsing",
+            loaded && path.getNumKeyframes() == 2 &&
+            path.getBeginTime() == 0.0f && path.getEndTime() == 2.0f);
     }
+    if (!success)
+        return false;
 
-    const char* err = nullptr;
-    int32_t ret = SaveEXRImageToFile(&image, &header, filepath.string().c_str(), &err);
-    if (ret != TINYEXR_SUCCESS) {
-        fprintf(stderr, "Save EXR err: %s\n", err);
-        FreeEXRErrorMessage(err);
+    Point3D position;
+    Quaternion orientation;
+
+    path.evaluate(1.0f, &position, &orientation);
+    success &= reportSelfTestCheck(
+        "Camera path interpolation at the midpoint",
+        distance(position, Point3D(1.0f, 2.0f, -3.0f)) < tolerance &&
+        isSameOrientation(orientation, qFromEulerAngles(0.0f, 0.0f, 45 * deg)));
+
+    path.evaluate(0.5f, &position, &orientation);
+    success &= reportSelfTestCheck(
+        "Camera path interpolation at a quarter",
+        distance(position, Point3D(0.5f, 1.0f, -1.5f)) < tolerance &&
+        isSameOrientation(orientation, qFromEulerAngles(0.0f, 0.0f, 22.5f * deg)));
+
+    path.evaluate(-1.0f, &position, &orientation);
+    bool clamped =
+        distance(position, Point3D(0.0f, 0.0f, 0.0f)) < tolerance &&
+        isSameOrientation(orientation, Quaternion());
+    path.evaluate(5.0f, &position, &orientation);
+    clamped &=
+        distance(position, Point3D(2.0f, 4.0f, -6.0f)) < tolerance &&
+        isSameOrientation(orientation, qFromEulerAngles(0.0f, 0.0f, 90 * deg));
+    success &= reportSelfTestCheck("Camera path clamping outside the keyframes", clamped);
+
+    // JP: 5フレームに割り当てると時刻0, 0.5, 1, 1.5, 2になり、範囲外のフレームは最後に固定される。
+    // EN: Distributing over 5 frames gives times 0, 0.5, 1, 1.5, 2, and frames out of range are clamped to the last.
+    bool framesMatch = true;
+    const uint32_t frameIndices[] = { 0, 1, 2, 3, 4, 10 };
+    const float expectedTimes[] = { 0.0f, 0.5f, 1.0f, 1.5f, 2.0f, 2.0f };
+    for (uint32_t i = 0; i < lengthof(frameIndices); ++i) {
+        Point3D expectedPosition;
+        Quaternion expectedOrientation;
+        path.evaluate(expectedTimes[i], &expectedPosition, &expectedOrientation);
+        path.evaluateAtFrame(frameIndices[i], 5, &position, &orientation);
+        framesMatch &=
+            distance(position, expectedPosition) < tolerance &&
+            isSameOrientation(orientation, expectedOrientation);
+    }
+    path.evaluateAtFrame(3, 1, &position, &orientation);
+    framesMatch &= distance(position, Point3D(0.0f, 0.0f, 0.0f)) < tolerance;
+    success &= reportSelfTestCheck("Camera path distribution over frames", framesMatch);
+
+    // JP: 符号が逆の同じ姿勢を続けて追加しても、補間中に回転しないこと。
+    // EN: Adding the same orientation with the opposite sign in a row must not rotate during interpolation.
+    {
+        CameraPath flippedPath;
+        const Quaternion q = qFromEulerAngles(10 * deg, 20 * deg, 30 * deg);
+        flippedPath.addKeyframe(0.0f, Point3D(0.0f), q);
+        flippedPath.addKeyframe(1.0f, Point3D(0.0f), -q);
+        flippedPath.evaluate(0.5f, &position, &orientation);
+        success &= reportSelfTestCheck(
+            "Camera path interpolation along the shortest arc", isSameOrientation(orientation, q));
+    }
+
+    // JP: 時刻が戻るキーフレーム、余分なトークン、値の不足、空のパスは読み込みに失敗する。
+    // EN: Loading fails for a keyframe going back in time, an extra token, missing values and an empty path.
+    const char* const invalidPaths[] = {
+        "1 0 0 0 0 0 0\n0 0 0 0 0 0 0\n",
+        "0 0 0 0 0 0 0 7\n",
+        "0 0 0 0 0 0\n",
+        "# empty\n",
+    };
+    bool rejected = true;
+    for (const char* invalidPath : invalidPaths) {
+        CameraPath invalid;
+        std::istringstream stream(invalidPath);
+        rejected &= !invalid.parse(stream) && invalid.empty();
     }
+    success &= reportSelfTestCheck("Camera path rejecting invalid files", rejected);
 
-    free(header.channels);
-    free(header.pixel_types);
-    free(header.requested_pixel_types);
+    return success;
 }
 
-void saveImage(
-    const std::filesystem::path &filepath, uint32_t width, uint32_t height, const float4* data,
-    const SDRImageSaverConfig &config) {
-    auto image = new uint32_t[width * height];
-    for (int y = 0; y < static_cast<int32_t>(height); ++y) {
-        uint32_t sy = config.flipY ? (height - 1 - y) : y;
-        for (int x = 0; x < static_cast<int32_t>(width); ++x) {
-            float4 src = data[sy * width + x];
-            if (config.alphaForOverride >= 0.0f)
-                src.w = config.alphaForOverride;
-            if (config.applyToneMap) {
-                RGB rgb(getXYZ(src));
-                if (!rgb.allFinite())
-                    rgb = RGB(0.0f, 0.0f, 0.0f);
-                float lum = sRGB_calcLuminance(rgb);
-                float lumT = simpleToneMap_s(config.brightnessScale * lum);
-                float s = lum > 0.0f ? lumT / lum : 0.0f;
-                src.x = rgb.r * s;
-                src.y = rgb.g * s;
-                src.z = rgb.b * s;
+// JP: BenchmarkReportの統計値の計算とJSONの書き出しを確かめる。
+// EN: Check BenchmarkReport's statistics computation and JSON output.
+static bool testBenchmarkReport() {
+    bool success = true;
+
+    // JP: 1から100を逆順に与える。中央値は50と51の平均、99パーセンタイルは最近傍順位法で99番目。
+    // EN: Give 1 to 100 in reverse order. The median is the average of 50 and 51,
+    //     and the 99th percentile is the 99th value by the nearest-rank method.
+    {
+        std::vector<float> samples;
+        for (int i = 100; i >= 1; --i)
+            samples.push_back(static_cast<float>(i));
+        const BenchmarkReport::Statistics stats = BenchmarkReport::computeStatistics(samples);
+        success &= reportSelfTestCheck(
+            "Benchmark statistics of an even number of samples",
+            stats.numSamples == 100 && stats.min == 1.0f && stats.max == 100.0f &&
+            stats.median == 50.5f && stats.p99 == 99.0f && stats.mean == 50.5f);
+    }
+    {
+        const BenchmarkReport::Statistics stats = BenchmarkReport::computeStatistics({ 5.0f, 1.0f, 3.0f });
+        success &= reportSelfTestCheck(
+            "Benchmark statistics of an odd number of samples",
+            stats.numSamples == 3 && stats.min == 1.0f && stats.max == 5.0f &&
+            stats.median == 3.0f && stats.p99 == 5.0f && stats.mean == 3.0f);
+    }
+    {
+        const BenchmarkReport::Statistics stats = BenchmarkReport::computeStatistics({});
+        success &= reportSelfTestCheck("Benchmark statistics of no samples", stats.numSamples == 0);
+    }
+
+    BenchmarkReport report;
+    report.record("pass \"B\"", 2.0f);
+    report.record("A", 3.0f);
+    report.record("A", 1.0f);
+    const std::vector<float>* samplesA = report.getSamples("A");
+    success &= reportSelfTestCheck(
+        "Benchmark report series",
+        samplesA && *samplesA == std::vector<float>({ 3.0f, 1.0f }) &&
+        report.getSamples("missing") == nullptr);
+
+    // JP: 系列は最初に記録された順に、名前はエスケープして書き出される。
+    // EN: Series are written in the order of the first record, with names escaped.
+    const std::filesystem::path reportPath =
+        std::filesystem::temp_directory_path() / "gfxexp_selftest_report.json";
+    bool written = report.writeJSON(reportPath, "selftest", 640, 480);
+    std::string json;
+    if (written) {
+        std::ifstream ifs(reportPath);
+        std::ostringstream ss;
+        ss << ifs.rdbuf();
+        json = ss.str();
+        ifs.close();
+        std::filesystem::remove(reportPath);
+    }
+    const char* expectedJSON =
+        "{\n"
+        "  \"program\": \"selftest\",\n"
+        "  \"imageSize\": [640, 480],\n"
+        "  \"unit\": \"ms\",\n"
+        "  \"passes\": {\n"
+        "    \"pass \\\"B\\\"\": { \"count\": 1, \"min\": 2.000000, \"median\": 2.000000, "
+        "\"p99\": 2.000000, \"mean\": 2.000000, \"max\": 2.000000 },\n"
+        "    \"A\": { \"count\": 2, \"min\": 1.000000, \"median\": 2.000000, "
+        "\"p99\": 3.000000, \"mean\": 2.000000, \"max\": 3.000000 }\n"
+        "  }\n"
+        "}\n";
+    success &= reportSelfTestCheck("Benchmark report JSON", written && json == expectedJSON);
+
+    return success;
+}
+
+// JP: [0, 1]の全てのfloat値について、LUTによるsRGBの符号化とsRGB_gamma_s()による直接計算の差が
+//     1 LSB以内であることを確かめる。範囲外の値とNaNが端に丸められることも確かめる。
+// EN: Check that the difference between sRGB encoding by the LUT and direct evaluation by sRGB_gamma_s()
+//     is within 1 LSB for every float value in [0, 1].
+//     Also check that out-of-range values and NaN are clamped to the ends.
+static bool testSRGBEncodeLUT() {
+    const uint32_t* lut = getSRGBEncodeLUT();
+    const auto encodeDirectly = [](float value) {
+        return std::min<uint32_t>(static_cast<uint32_t>(sRGB_gamma_s(value) * 255), 255);
+    };
+
+    constexpr uint32_t oneBits = 0x3F800000;
+    std::mutex mutex;
+    int32_t maxDiff = 0;
+    parallelForChunks(
+        0, oneBits + 1, 1 << 20,
+        [&](uint32_t chunkIdx, uint32_t begin, uint32_t end) {
+            int32_t chunkMaxDiff = 0;
+            for (uint32_t bits = begin; bits < end; ++bits) {
+                float value;
+                std::memcpy(&value, &bits, sizeof(value));
+                const int32_t diff =
+                    static_cast<int32_t>(encodeSRGB8(lut, value)) - static_cast<int32_t>(encodeDirectly(value));
+                chunkMaxDiff = std::max(chunkMaxDiff, std::abs(diff));
             }
-            if (config.apply_sRGB_gammaCorrection) {
-                src.x = sRGB_gamma_s(src.x);
-                src.y = sRGB_gamma_s(src.y);
-                src.z = sRGB_gamma_s(src.z);
+            std::lock_guard lock(mutex);
+            maxDiff = std::max(maxDiff, chunkMaxDiff);
+        });
+
+    bool success = true;
+    char name[64];
+    snprintf(name, sizeof(name), "sRGB encode LUT vs. pow over [0, 1] (max %d LSB)", maxDiff);
+    success &= reportSelfTestCheck(name, maxDiff <= 1);
+    success &= reportSelfTestCheck(
+        "sRGB encode LUT clamping",
+        encodeSRGB8(lut, -1.0f) == 0 && encodeSRGB8(lut, NAN) == 0 &&
+        encodeSRGB8(lut, 2.0f) == 255 && encodeSRGB8(lut, INFINITY) == 255);
+
+    return success;
+}
+
+// JP: ASUpdatePolicyのリフィットとリビルドの選択、境界の膨張の推定、連続リフィット回数の上限、
+//     ScratchMemoryPoolのサイズクラスの計算を確かめる。
+// EN: Check ASUpdatePolicy's choice between refit and rebuild, estimation of bounds growth,
+//     the limit of consecutive refits and ScratchMemoryPool's size class computation.
+static bool testASUpdatePolicy() {
+    constexpr float tolerance = 1e-5f;
+    const AABB referenceAabbs[] = {
+        AABB(Point3D(0.0f, 0.0f, 0.0f), Point3D(1.0f, 1.0f, 1.0f)),
+        AABB(Point3D(2.0f, 0.0f, 0.0f), Point3D(3.0f, 1.0f, 1.0f)),
+    };
+    constexpr uint32_t numChildren = lengthof(referenceAabbs);
+
+    bool success = true;
+
+    {
+        ASUpdatePolicy policy;
+        const bool rebuildFirst =
+            policy.decide(true, referenceAabbs, numChildren) == ASUpdateMethod::Rebuild &&
+            policy.estimateBoundsGrowth(referenceAabbs, numChildren) == INFINITY;
+        success &= reportSelfTestCheck("AS update policy without a reference", rebuildFirst);
+    }
+
+    {
+        ASUpdatePolicy policy;
+        policy.recordRebuild(referenceAabbs, numChildren);
+        success &= reportSelfTestCheck(
+            "AS update policy refitting unchanged children",
+            policy.estimateBoundsGrowth(referenceAabbs, numChildren) == 1.0f &&
+            policy.decide(true, referenceAabbs, numChildren) == ASUpdateMethod::Refit);
+
+        // JP: 一つ目の立方体をx方向に0.25動かすと和集合の表面積は6から7になるので、膨張は13/12になる。
+        //     2動かすと14になり、膨張は20/12となって既定の閾値1.5を超える。
+        // EN: Moving the first cube by 0.25 along x grows the surface area of the union from 6 to 7,
+        //     so the growth becomes 13/12.
+        //     Moving it by 2 makes it 14, and the growth becomes 20/12, exceeding the default threshold 1.5.
+        AABB movedAabbs[numChildren] = { referenceAabbs[0], referenceAabbs[1] };
+        movedAabbs[0].minP.x += 0.25f;
+        movedAabbs[0].maxP.x += 0.25f;
+        const float smallGrowth = policy.estimateBoundsGrowth(movedAabbs, numChildren);
+        success &= reportSelfTestCheck(
+            "AS update policy refitting slightly moved children",
+            std::fabs(smallGrowth - 13.0f / 12.0f) <= tolerance &&
+            policy.decide(true, movedAabbs, numChildren) == ASUpdateMethod::Refit &&
+            policy.getLastBoundsGrowth() == smallGrowth);
+
+        movedAabbs[0] = referenceAabbs[0];
+        movedAabbs[0].minP.x += 2.0f;
+        movedAabbs[0].maxP.x += 2.0f;
+        const float largeGrowth = policy.estimateBoundsGrowth(movedAabbs, numChildren);
+        success &= reportSelfTestCheck(
+            "AS update policy rebuilding largely moved children",
+            std::fabs(largeGrowth - 20.0f / 12.0f) <= tolerance &&
+            policy.decide(true, movedAabbs, numChildren) == ASUpdateMethod::Rebuild);
+
+        success &= reportSelfTestCheck(
+            "AS update policy rebuilding when refit is not allowed or the children changed",
+            policy.decide(false, referenceAabbs, numChildren) == ASUpdateMethod::Rebuild &&
+            policy.decide(true, referenceAabbs, numChildren - 1) == ASUpdateMethod::Rebuild &&
+            policy.estimateBoundsGrowth(referenceAabbs, numChildren - 1) == INFINITY);
+    }
+
+    {
+        ASUpdatePolicy policy;
+        ASUpdatePolicy::Config config;
+        config.maxConsecutiveRefits = 3;
+        policy.setConfig(config);
+        policy.recordRebuild(referenceAabbs, numChildren);
+        bool refitsUpToLimit = true;
+        for (uint32_t i = 0; i < config.maxConsecutiveRefits; ++i) {
+            refitsUpToLimit &= policy.decide(true, referenceAabbs, numChildren) == ASUpdateMethod::Refit;
+            policy.recordRefit();
+        }
+        const bool rebuildAtLimit =
+            policy.decide(true, referenceAabbs, numChildren) == ASUpdateMethod::Rebuild;
+        policy.recordRebuild(referenceAabbs, numChildren);
+        const bool refitAfterRebuild =
+            policy.getNumConsecutiveRefits() == 0 &&
+            policy.decide(true, referenceAabbs, numChildren) == ASUpdateMethod::Refit;
+        success &= reportSelfTestCheck(
+            "AS update policy limiting consecutive refits",
+            refitsUpToLimit && rebuildAtLimit && refitAfterRebuild &&
+            policy.getNumRefits() == config.maxConsecutiveRefits && policy.getNumRebuilds() == 2);
+    }
+
+    {
+        constexpr size_t minClassBytes = static_cast<size_t>(1) << ScratchMemoryPool::minSizeClassLog2;
+        bool sizeClassesMatch =
+            ScratchMemoryPool::computeSizeClass(1) == 0 &&
+            ScratchMemoryPool::computeSizeClass(minClassBytes) == 0 &&
+            ScratchMemoryPool::computeSizeClass(minClassBytes + 1) == 1 &&
+            ScratchMemoryPool::computeSizeClass(2 * minClassBytes) == 1 &&
+            ScratchMemoryPool::computeSizeClass(2 * minClassBytes + 1) == 2 &&
+            ScratchMemoryPool::computeSizeClass(static_cast<size_t>(1) << 40) ==
+            40 - ScratchMemoryPool::minSizeClassLog2;
+        // JP: 最小クラスより大きいサイズは、サイズ以上で2倍未満のクラスに丸められる。
+        // EN: A size larger than the minimum class is rounded up to a class not smaller than the size
+        //     and smaller than twice the size.
+        for (size_t size = minClassBytes + 1; size < (static_cast<size_t>(1) << 34); size = size * 3 / 2 + 7) {
+            const size_t classBytes =
+                ScratchMemoryPool::getSizeClassBytes(ScratchMemoryPool::computeSizeClass(size));
+            sizeClassesMatch &= classBytes >= size && classBytes < 2 * size;
+        }
+        success &= reportSelfTestCheck("Scratch memory pool size classes", sizeClassesMatch);
+    }
+
+    return success;
+}
+
+// JP: ランダムな三角形から構築したHostLightTreeについて、いくつかのシェーディング点で
+//     sample()が返す確率がevaluatePMF()と一致し、層化したuによるサンプルのヒストグラムがPMFに一致することを確かめる。
+//     両方の子の重要度がゼロになるノードに達するとサンプルは失敗するので、
+//     PMFの合計はサンプルが成功する割合に一致するはず。
+//     放射輝度がゼロの三角形も混ぜてツリーに含まれないエミッターも扱う。
+// EN: For a HostLightTree built from random triangles, check at several shading points that
+//     the probability returned by sample() matches evaluatePMF(),
+//     and the histogram of samples with stratified u matches the PMF.
+//     Sampling fails when reaching a node whose children both have zero importance,
+//     so the sum of the PMF should match the rate of successful samples.
+//     Triangles with zero emittance are mixed in to also handle emitters not in the tree.
+static bool testLightTreeSampling() {
+    constexpr uint32_t numTriangles = 384;
+    std::mt19937 rng(718281828);
+    std::uniform_real_distribution<float> u01;
+    EmitterRegistry registry;
+    {
+        std::vector<shared::Vertex> vertices(3 * numTriangles);
+        std::vector<shared::Triangle> triangles(numTriangles);
+        std::vector<RGB> emittances(numTriangles);
+        for (uint32_t triIdx = 0; triIdx < numTriangles; ++triIdx) {
+            const Point3D center(4 * u01(rng), 4 * u01(rng), 4 * u01(rng));
+            Point3D p[3];
+            for (int i = 0; i < 3; ++i)
+                p[i] = center + 0.2f * Vector3D(u01(rng) - 0.5f, u01(rng) - 0.5f, u01(rng) - 0.5f);
+            const Normal3D n(normalize(cross(p[1] - p[0], p[2] - p[0])));
+            for (int i = 0; i < 3; ++i) {
+                shared::Vertex &v = vertices[3 * triIdx + i];
+                v.position = p[i];
+                v.normal = n;
+                v.texCoord0Dir = Vector3D(1, 0, 0);
+                v.texCoord = Point2D(0.0f, 0.0f);
             }
-            uint32_t &dst = image[y * width + x];
-            dst = ((std::min<uint32_t>(static_cast<uint32_t>(src.x * 255), 255) << 0) |
-                   (std::min<uint32_t>(static_cast<uint32_t>(src.y * 255), 255) << 8) |
-                   (std::min<uint32_t>(static_cast<uint32_t>(src.z * 255), 255) << 16) |
-                   (std::min<uint32_t>(static_cast<uint32_t>(src.w * 255), 255) << 24));
+            triangles[triIdx] = shared::Triangle{ 3 * triIdx + 0, 3 * triIdx + 1, 3 * triIdx + 2 };
+            emittances[triIdx] = triIdx % 16 == 5 ? RGB(0.0f) : RGB(u01(rng), u01(rng), u01(rng));
+        }
+        registry.setGeometryEmitters(0, vertices.data(), triangles.data(), emittances.data(), numTriangles);
+        registry.addInstanceGeometry(0, 0, Matrix4x4());
+        registry.updateTable();
+    }
+
+    HostLightTree hostLightTree;
+    hostLightTree.build(nullptr, registry);
+    shared::LightTree lightTree;
+    hostLightTree.getDeviceType(&lightTree);
+
+    const struct {
+        Point3D position;
+        Normal3D normal;
+    } shadingPoints[] = {
+        { Point3D(2.0f, 2.0f, 2.0f), Normal3D(0.0f, 0.0f, 0.0f) },
+        { Point3D(-3.0f, 1.0f, 2.0f), Normal3D(1.0f, 0.0f, 0.0f) },
+        { Point3D(6.0f, 5.0f, -1.0f), normalize(Normal3D(-1.0f, -1.0f, 0.5f)) },
+        { Point3D(0.5f, 3.5f, 1.0f), Normal3D(0.0f, 1.0f, 0.0f) },
+    };
+
+    bool probsMatch = true;
+    bool pmfSumsMatch = true;
+    bool histogramsMatch = true;
+    constexpr uint32_t numSamples = 1 << 18;
+    std::vector<uint32_t> histogram(numTriangles);
+    for (const auto &sp : shadingPoints) {
+        std::fill(histogram.begin(), histogram.end(), 0);
+        uint32_t numValidSamples = 0;
+        for (uint32_t i = 0; i < numSamples; ++i) {
+            const float u = (i + 0.5f) / numSamples;
+            float prob;
+            const uint32_t emitterIdx = lightTree.sample(sp.position, sp.normal, u, &prob);
+            if (emitterIdx == 0xFFFFFFFF) {
+                probsMatch &= prob == 0.0f;
+                continue;
+            }
+            if (emitterIdx >= numTriangles) {
+                probsMatch = false;
+                continue;
+            }
+            ++numValidSamples;
+            ++histogram[emitterIdx];
+            const float pmf = lightTree.evaluatePMF(sp.position, sp.normal, emitterIdx);
+            probsMatch &= prob > 0.0f && std::fabs(prob - pmf) <= 1e-4f * pmf;
         }
+
+        // JP: 木を降りる過程でuの区間がエミッターごとに長さPMFの区間に分割されるので、
+        //     層化したuによるヒストグラムは丸め誤差を除いてPMFに厳密に一致する。
+        // EN: Descending the tree partitions the range of u into an interval of length PMF per emitter,
+        //     so the histogram with stratified u exactly matches the PMF except for rounding errors.
+        double sumPMF = 0.0;
+        for (uint32_t emitterIdx = 0; emitterIdx < numTriangles; ++emitterIdx) {
+            const float pmf = lightTree.evaluatePMF(sp.position, sp.normal, emitterIdx);
+            const double expected = static_cast<double>(numSamples) * pmf;
+            histogramsMatch &= std::fabs(histogram[emitterIdx] - expected) <= 4 + 1e-3 * expected;
+            sumPMF += pmf;
+        }
+        pmfSumsMatch &=
+            sumPMF > 0.5 && std::fabs(sumPMF - static_cast<double>(numValidSamples) / numSamples) <= 1e-4;
     }
+    hostLightTree.finalize();
 
-    saveImage(filepath, width, height, image);
+    bool success = true;
+    success &= reportSelfTestCheck("Light tree sampling probabilities vs. PMF", probsMatch);
+    success &= reportSelfTestCheck("Light tree PMF sum vs. the rate of valid samples", pmfSumsMatch);
+    success &= reportSelfTestCheck("Light tree sample histogram vs. PMF", histogramsMatch);
 
-    delete[] image;
+    return success;
 }
 
-void saveImage(
-    const std::filesystem::path &filepath,
-    uint32_t width, cudau::TypedBuffer<float4> &buffer,
-    const SDRImageSaverConfig &config) {
-    Assert(buffer.numElements() % width == 0, "Buffer's length is not divisible by the width.");
-    uint32_t height = static_cast<uint32_t>(buffer.numElements()) / width;
-    auto data = buffer.map();
-    saveImage(filepath, width, height, data, config);
-    buffer.unmap();
+// JP: HostDiscreteDistribution1D::sampleN()がsample()と同じインデックスと確率を返すことを確かめる。
+//     AVX2の8個単位の処理と端数の処理の両方を通るようにクエリー数を変え、
+//     重みがゼロの連続区間(先頭、途中、末尾)、CDFの境界値、1に近いuも含める。
+// EN: Check that HostDiscreteDistribution1D::sampleN() returns the same indices and probabilities as sample().
+//     Vary the number of queries so that both the 8-wide AVX2 processing and the remainder are exercised,
+//     and include runs of zero weights (leading, middle and trailing), CDF boundary values and u close to 1.
+static bool testDiscreteDistributionBatchSampling() {
+    std::mt19937 rng(141421356);
+    std::uniform_real_distribution<float> u01;
+
+    const auto makeWeights = [&](uint32_t numValues, uint32_t pattern) {
+        std::vector<float> weights(numValues);
+        for (uint32_t i = 0; i < numValues; ++i)
+            weights[i] = u01(rng);
+        const uint32_t runLength = std::max(numValues / 4, 1u);
+        if (pattern == 1 && numValues > 1) {
+            for (uint32_t i = 0; i < runLength; ++i)
+                weights[i] = 0.0f;
+        }
+        else if (pattern == 2 && numValues > 2) {
+            for (uint32_t i = numValues / 3; i < numValues / 3 + runLength && i < numValues - 1; ++i)
+                weights[i] = 0.0f;
+        }
+        else if (pattern == 3 && numValues > 1) {
+            for (uint32_t i = numValues - runLength; i < numValues; ++i)
+                weights[i] = 0.0f;
+        }
+        else if (pattern == 4) {
+            // JP: 大部分の重みがゼロで、ところどころにだけ重みがある。
+            // EN: Most weights are zero, only a few here and there are not.
+            for (uint32_t i = 0; i < numValues; ++i)
+                weights[i] = i % 7 == 3 ? weights[i] : 0.0f;
+            weights[numValues / 2] = 1.0f;
+        }
+        return weights;
+    };
+
+    const uint32_t numValuesList[] = { 1, 2, 3, 7, 8, 9, 31, 64, 100, 1000, 1023, 1024, 1025 };
+    const uint32_t numQueriesList[] = { 1, 2, 5, 7, 8, 9, 15, 16, 17, 63, 255, 256, 257, 1031 };
+    constexpr uint32_t numPatterns = 5;
+
+    bool allMatch = true;
+    std::vector<float> us;
+    std::vector<uint32_t> indices;
+    std::vector<float> probs;
+    for (const uint32_t numValues : numValuesList) {
+        for (uint32_t pattern = 0; pattern < numPatterns; ++pattern) {
+            const std::vector<float> weights = makeWeights(numValues, pattern);
+            HostDiscreteDistribution1D hostDist;
+            hostDist.initialize(weights.data(), numValues);
+            shared::DiscreteDistribution1D dist;
+            hostDist.getDeviceType(&dist);
+
+            // JP: initialize()と同じ方法でCDFを計算し、その境界とその前後のu、1に近いuを用意する。
+            // EN: Compute the CDF in the same way as initialize(),
+            //     and prepare u at and around its boundaries and u close to 1.
+            std::vector<float> specialUs = { 0.0f };
+            CompensatedSum_T<float> cdf(0);
+            for (uint32_t i = 0; i < numValues; ++i) {
+                const float boundary = cdf / dist.integral();
+                for (const float u : {
+                    std::nextafter(boundary, 0.0f), boundary, std::nextafter(boundary, 1.0f) }) {
+                    if (u >= 0.0f && u < 1.0f)
+                        specialUs.push_back(u);
+                }
+                cdf += weights[i];
+            }
+            float uNearOne = 1.0f;
+            for (uint32_t i = 0; i < 8; ++i) {
+                uNearOne = std::nextafter(uNearOne, 0.0f);
+                specialUs.push_back(uNearOne);
+            }
+
+            // JP: 端数の位置にも特別なuが来るように、クエリー数によって特別なuの並びをずらす。
+            // EN: Shift the sequence of special u by the number of queries
+            //     so that special u also land on the remainder positions.
+            for (const uint32_t numQueries : numQueriesList) {
+                us.resize(numQueries);
+                for (uint32_t i = 0; i < numQueries; ++i)
+                    us[i] = i % 4 != 3 ? specialUs[(i + numQueries) % specialUs.size()] : u01(rng);
+                indices.resize(numQueries);
+                probs.resize(numQueries);
+                hostDist.sampleN(us.data(), numQueries, indices.data(), probs.data());
+                for (uint32_t i = 0; i < numQueries; ++i) {
+                    float prob;
+                    const uint32_t index = dist.sample(us[i], &prob);
+                    allMatch &= indices[i] == index && probs[i] == prob;
+                }
+            }
+            hostDist.finalize();
+        }
+    }
+
+    return reportSelfTestCheck("Discrete distribution batched sampling vs. sample()", allMatch);
 }
 
-void saveImage(
-    const std::filesystem::path &filepath,
-    cudau::Array &array,
-    const SDRImageSaverConfig &config) {
-    auto data = array.map<float4>();
-    saveImage(
-        filepath,
-        static_cast<uint32_t>(array.getWidth()), static_cast<uint32_t>(array.getHeight()),
-        data, config);
-    array.unmap();
+// JP: InstanceControllerSystemのAVX2版の評価がスカラー版と許容誤差内で一致することを確かめる。
+//     端数のあるコントローラー数と、周期を越えて時間が折り返す大きなdtで複数フレーム進める。
+// EN: Check that the AVX2 evaluation of InstanceControllerSystem matches the scalar version within the tolerance.
+//     Use a number of controllers with a remainder
+//     and advance multiple frames with a large dt so that the time wraps around the period.
+static bool testInstanceControllerEvaluation() {
+    if (!isAVX2Supported()) {
+        hpprintf("SKIPPED: Instance controller evaluation AVX2 vs. scalar (AVX2 is not supported)\n");
+        return true;
+    }
+
+    constexpr uint32_t numControllers = 1005;
+    constexpr uint32_t numFrames = 8;
+    constexpr float dt = 0.37f;
+    InstanceControllerSystem scalarSystem;
+    InstanceControllerSystem avx2System;
+    scalarSystem.initializeWithRandomParameters(numControllers, 161803398);
+    avx2System.initializeWithRandomParameters(numControllers, 161803398);
+    std::vector<InstanceControllerSystem::TransformData> scalarResults(numControllers);
+    std::vector<InstanceControllerSystem::TransformData> avx2Results(numControllers);
+    float maxError = 0.0f;
+    for (uint32_t frameIdx = 0; frameIdx < numFrames; ++frameIdx) {
+        scalarSystem.evaluateAll(dt, false, scalarResults.data());
+        avx2System.evaluateAll(dt, true, avx2Results.data());
+        maxError = std::max(
+            maxError, computeMaxTransformDataError(avx2Results.data(), scalarResults.data(), numControllers));
+    }
+
+    char name[128];
+    snprintf(name, sizeof(name), "Instance controller evaluation AVX2 vs. scalar (max relative error %g)", maxError);
+    return reportSelfTestCheck(name, maxError <= 1e-4f);
+}
+
+bool runHostSelfTests() {
+    bool success = true;
+    success &= testConcurrentSlotClaims();
+    success &= testBenchmarkOptionParsing();
+    success &= testCameraPathInterpolation();
+    success &= testBenchmarkReport();
+    success &= testSRGBEncodeLUT();
+    success &= testASUpdatePolicy();
+    success &= testLightTreeSampling();
+    success &= testDiscreteDistributionBatchSampling();
+    success &= testInstanceControllerEvaluation();
+    hpprintf("Host self tests: %s\n", success ? "passed" : "FAILED");
+
+    return success;
 }
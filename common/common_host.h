@@ -15,6 +15,9 @@
 #include <filesystem>
 #include <functional>
 #include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 #include <chrono>
 #include <variant>
 
@@ -133,6 +136,133 @@ std::string readTxtFile(const std::filesystem::path &filepath);
 
 std::vector<char> readBinaryFile(const std::filesystem::path &filepath);
 
+bool isAVX2Supported();
+
+// JP: Cephesのexpfと同じ範囲縮小と多項式による近似。AVX2をサポートするCPUでのみ呼ぶこと。
+// EN: Approximation with the same range reduction and polynomial as Cephes' expf.
+//     Call this only on CPUs supporting AVX2.
+inline __m256 exp_AVX2(__m256 x) {
+    x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-87.3f)), _mm256_set1_ps(88.3f));
+    const __m256 fx = _mm256_floor_ps(
+        _mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504088896341f)), _mm256_set1_ps(0.5f)));
+    x = _mm256_sub_ps(x, _mm256_mul_ps(fx, _mm256_set1_ps(0.693359375f)));
+    x = _mm256_sub_ps(x, _mm256_mul_ps(fx, _mm256_set1_ps(-2.12194440e-4f)));
+    __m256 y = _mm256_set1_ps(1.9875691500e-4f);
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(1.3981999507e-3f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(8.3334519073e-3f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(4.1665795894e-2f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(1.6666665459e-1f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(5.0000001201e-1f));
+    y = _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(y, x), x), _mm256_add_ps(x, _mm256_set1_ps(1.0f)));
+    const __m256i pow2n = _mm256_slli_epi32(
+        _mm256_add_epi32(_mm256_cvttps_epi32(fx), _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(y, _mm256_castsi256_ps(pow2n));
+}
+
+// JP: 読み取り専用のメモリーマップトファイル。
+// EN: Read-only memory-mapped file.
+class MappedFile {
+    const uint8_t* m_data;
+    size_t m_size;
+#if defined(HP_Platform_Windows_MSVC)
+    HANDLE m_fileHandle;
+    HANDLE m_mappingHandle;
+#endif
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+public:
+    MappedFile() : m_data(nullptr), m_size(0)
+#if defined(HP_Platform_Windows_MSVC)
+        , m_fileHandle(INVALID_HANDLE_VALUE), m_mappingHandle(nullptr)
+#endif
+    {}
+    ~MappedFile() {
+        close();
+    }
+    MappedFile(MappedFile &&b) : MappedFile() {
+        *this = std::move(b);
+    }
+    MappedFile &operator=(MappedFile &&b) {
+        close();
+        m_data = b.m_data;
+        m_size = b.m_size;
+        b.m_data = nullptr;
+        b.m_size = 0;
+#if defined(HP_Platform_Windows_MSVC)
+        m_fileHandle = b.m_fileHandle;
+        m_mappingHandle = b.m_mappingHandle;
+        b.m_fileHandle = INVALID_HANDLE_VALUE;
+        b.m_mappingHandle = nullptr;
+#endif
+        return *this;
+    }
+
+    bool open(const std::filesystem::path &filePath);
+    void close();
+
+    bool isOpen() const {
+        return m_data != nullptr;
+    }
+    const uint8_t* getData() const {
+        return m_data;
+    }
+    size_t getSize() const {
+        return m_size;
+    }
+};
+
+
+
+// JP: [begin, end)の範囲をハードウェアスレッド数程度のチャンクに分割して並列に処理する。
+//     funcは(chunkIdx, chunkBegin, chunkEnd)を受け取る。チャンク数を返す。
+//     チャンクの大きさの差は高々1で、空のチャンクは生じない。チャンクが1つの場合は呼び出しスレッドで処理する。
+// EN: Process the range [begin, end) in parallel by splitting it into chunks
+//     about as many as hardware threads.
+//     func receives (chunkIdx, chunkBegin, chunkEnd). Returns the number of chunks.
+//     Chunk sizes differ by at most one and no chunk is empty.
+//     A single chunk is processed on the calling thread.
+template <typename Func>
+uint32_t parallelForChunks(uint32_t begin, uint32_t end, uint32_t minChunkSize, Func &&func) {
+    if (end <= begin)
+        return 0;
+    const uint32_t numItems = end - begin;
+    const uint32_t maxNumThreads = std::max(std::thread::hardware_concurrency(), 1u);
+    const uint32_t numChunks = std::max(
+        std::min(maxNumThreads, numItems / std::max(minChunkSize, 1u)), 1u);
+    if (numChunks == 1) {
+        func(0u, begin, end);
+        return 1;
+    }
+
+    // JP: 切り上げた一定のチャンクサイズで分割すると末尾のチャンクが空になり得るので、
+    //     項目を均等に配分する。numChunks <= numItemsなので各チャンクは1つ以上の項目を持つ。
+    // EN: Splitting with a fixed rounded-up chunk size can leave trailing chunks empty,
+    //     so distribute the items evenly instead. Each chunk has at least one item since numChunks <= numItems.
+    const auto getChunkBegin = [begin, numItems, numChunks](uint32_t chunkIdx) {
+        return begin + static_cast<uint32_t>(static_cast<uint64_t>(numItems) * chunkIdx / numChunks);
+    };
+    std::vector<std::thread> threads;
+    threads.reserve(numChunks - 1);
+    for (uint32_t chunkIdx = 1; chunkIdx < numChunks; ++chunkIdx)
+        threads.emplace_back(func, chunkIdx, getChunkBegin(chunkIdx), getChunkBegin(chunkIdx + 1));
+    func(0u, begin, getChunkBegin(1));
+    for (std::thread &thread : threads)
+        thread.join();
+
+    return numChunks;
+}
+
+// JP: parallelForChunksが生成するチャンク数を事前に求める。
+// EN: Compute the number of chunks parallelForChunks will generate beforehand.
+inline uint32_t computeNumParallelChunks(uint32_t numItems, uint32_t minChunkSize) {
+    if (numItems == 0)
+        return 0;
+    const uint32_t maxNumThreads = std::max(std::thread::hardware_concurrency(), 1u);
+    return std::max(std::min(maxNumThreads, numItems / std::max(minChunkSize, 1u)), 1u);
+}
+
 
 
 template <uint32_t numBuffers>
@@ -190,14 +320,90 @@ public:
 
 
 
-template <typename RealType>
+// JP: cudau::TypedBufferと同じインターフェースを持つホストメモリー上のバッファー。
+//     getDevicePointer()はホストポインターを返すので、shared::の分布をCPUでそのまま使える。
+// EN: Buffer on host memory that has the same interface as cudau::TypedBuffer.
+//     getDevicePointer() returns the host pointer, so the shared:: distributions can be used on CPU as is.
+template <typename T>
+class HostBuffer {
+    std::vector<T> m_data;
+    unsigned int m_isInitialized : 1;
+
+public:
+    HostBuffer() : m_isInitialized(false) {}
+    HostBuffer(HostBuffer &&b) {
+        m_data = std::move(b.m_data);
+        m_isInitialized = b.m_isInitialized;
+        b.m_isInitialized = false;
+    }
+    HostBuffer &operator=(HostBuffer &&b) {
+        m_data = std::move(b.m_data);
+        m_isInitialized = b.m_isInitialized;
+        b.m_isInitialized = false;
+        return *this;
+    }
+
+    void initialize(CUcontext cuContext, cudau::BufferType type, uint32_t numElements) {
+        initialize(numElements);
+    }
+    void initialize(uint32_t numElements) {
+        Assert(!m_isInitialized, "Already initialized!");
+        m_data.resize(numElements);
+        m_isInitialized = true;
+    }
+    void finalize() {
+        m_data.clear();
+        m_data.shrink_to_fit();
+        m_isInitialized = false;
+    }
+
+    bool isInitialized() const { return m_isInitialized; }
+    uint32_t numElements() const { return static_cast<uint32_t>(m_data.size()); }
+
+    T* map() { return m_data.data(); }
+    void unmap() {}
+
+    T* getDevicePointer() const {
+        return const_cast<T*>(m_data.data());
+    }
+    T* getHostPointer() const {
+        return const_cast<T*>(m_data.data());
+    }
+};
+
+// JP: 分布クラスのバッファーの置き場所を決めるポリシー。
+// EN: Policies to decide where the buffers of the distribution classes live.
+struct DeviceMemoryStorage {
+    template <typename T>
+    using Buffer = cudau::TypedBuffer<T>;
+};
+
+struct HostMemoryStorage {
+    template <typename T>
+    using Buffer = HostBuffer<T>;
+};
+
+
+
+template <typename RealType, typename Storage = DeviceMemoryStorage>
 class DiscreteDistribution1DTemplate {
-    cudau::TypedBuffer<RealType> m_weights;
+    typename Storage::template Buffer<RealType> m_weights;
 #if defined(USE_WALKER_ALIAS_METHOD)
-    cudau::TypedBuffer<shared::AliasTableEntry<RealType>> m_aliasTable;
-    cudau::TypedBuffer<shared::AliasValueMap<RealType>> m_valueMaps;
+    typename Storage::template Buffer<shared::AliasTableEntry<RealType>> m_aliasTable;
+    typename Storage::template Buffer<shared::AliasValueMap<RealType>> m_valueMaps;
 #else
-    cudau::TypedBuffer<RealType> m_CDF;
+    typename Storage::template Buffer<RealType> m_CDF;
+    // JP: バッチサンプリング用にEytzinger順(幅優先の二分木順)に並べ替えたCDFのコピー。
+    //     ノード数が2^depth - 1になるように+infで埋めている。
+    //     m_eytzingerToSortedはノード番号から元のCDFのインデックスへの対応。
+    // EN: Copy of the CDF in Eytzinger order (breadth-first binary tree order) for batched sampling.
+    //     Padded with +inf so that the number of nodes is 2^depth - 1.
+    //     m_eytzingerToSorted maps a node number to the index in the original CDF.
+    std::vector<RealType> m_eytzingerCDF;
+    std::vector<uint32_t> m_eytzingerToSorted;
+    uint32_t m_eytzingerDepth;
+
+    void buildEytzingerCDF(const RealType* CDF);
 #endif
     RealType m_integral;
     uint32_t m_numValues;
@@ -205,10 +411,16 @@ class DiscreteDistribution1DTemplate {
 
 public:
     DiscreteDistribution1DTemplate() :
+#if !defined(USE_WALKER_ALIAS_METHOD)
+        m_eytzingerDepth(0),
+#endif
         m_integral(0.0f), m_numValues(0), m_isInitialized(false) {}
     void initialize(
         CUcontext cuContext, cudau::BufferType type,
         const RealType* values, uint32_t numValues);
+    void initialize(const RealType* values, uint32_t numValues) {
+        initialize(nullptr, cudau::BufferType::Device, values, numValues);
+    }
     void finalize() {
         if (!m_isInitialized)
             return;
@@ -223,6 +435,9 @@ public:
             m_CDF.finalize();
             m_weights.finalize();
         }
+        m_eytzingerCDF.clear();
+        m_eytzingerToSorted.clear();
+        m_eytzingerDepth = 0;
 #endif
     }
 
@@ -233,6 +448,9 @@ public:
         m_valueMaps = std::move(v.m_valueMaps);
 #else
         m_CDF = std::move(v.m_CDF);
+        m_eytzingerCDF = std::move(v.m_eytzingerCDF);
+        m_eytzingerToSorted = std::move(v.m_eytzingerToSorted);
+        m_eytzingerDepth = v.m_eytzingerDepth;
 #endif
         m_integral = v.m_integral;
         m_numValues = v.m_numValues;
@@ -264,6 +482,25 @@ public:
         return m_weights.getDevicePointer();
     }
 
+    // JP: 先頭numValues個の重みをホストに読み出す。streamは同期される。
+    // EN: Read the first numValues weights to the host. stream is synchronized.
+    void readWeights(RealType* values, uint32_t numValues, CUstream stream) const
+        requires std::is_same_v<Storage, DeviceMemoryStorage> {
+        Assert(numValues <= m_numValues, "Too many values: %u > %u", numValues, m_numValues);
+        m_weights.read(values, numValues, stream);
+        CUDADRV_CHECK(cuStreamSynchronize(stream));
+    }
+
+    // JP: n個の一様乱数uに対してまとめてサンプリングを行う。
+    //     結果はshared::DiscreteDistribution1DTemplate::sample()と同じインデックスになる。
+    //     CDF版ではEytzinger順のCDFを使い、AVX2が使える場合は8個ずつgatherで探索する。
+    // EN: Sample for n uniform random numbers u at once.
+    //     Results are the same indices as shared::DiscreteDistribution1DTemplate::sample().
+    //     The CDF version uses the Eytzinger-ordered CDF and searches 8 queries at a time with gathers
+    //     when AVX2 is available.
+    void sampleN(const RealType* u, uint32_t n, uint32_t* idx, RealType* prob) const
+        requires std::is_same_v<Storage, HostMemoryStorage>;
+
 #if !defined(USE_WALKER_ALIAS_METHOD)
     RealType* cdfOnDevice() const {
         return m_CDF.getDevicePointer();
@@ -273,14 +510,14 @@ public:
 
 
 
-template <typename RealType>
+template <typename RealType, typename Storage = DeviceMemoryStorage>
 class RegularConstantContinuousDistribution1DTemplate {
-    cudau::TypedBuffer<RealType> m_PDF;
+    typename Storage::template Buffer<RealType> m_PDF;
 #if defined(USE_WALKER_ALIAS_METHOD)
-    cudau::TypedBuffer<shared::AliasTableEntry<RealType>> m_aliasTable;
-    cudau::TypedBuffer<shared::AliasValueMap<RealType>> m_valueMaps;
+    typename Storage::template Buffer<shared::AliasTableEntry<RealType>> m_aliasTable;
+    typename Storage::template Buffer<shared::AliasValueMap<RealType>> m_valueMaps;
 #else
-    cudau::TypedBuffer<RealType> m_CDF;
+    typename Storage::template Buffer<RealType> m_CDF;
 #endif
     RealType m_integral;
     uint32_t m_numValues;
@@ -292,6 +529,9 @@ public:
     void initialize(
         CUcontext cuContext, cudau::BufferType type,
         const RealType* values, uint32_t numValues);
+    void initialize(const RealType* values, uint32_t numValues) {
+        initialize(nullptr, cudau::BufferType::Device, values, numValues);
+    }
     void finalize(CUcontext cuContext) {
         if (!m_isInitialized)
             return;
@@ -341,11 +581,11 @@ public:
 
 
 
-template <typename RealType>
+template <typename RealType, typename Storage = DeviceMemoryStorage>
 class RegularConstantContinuousDistribution2DTemplate {
-    cudau::TypedBuffer<shared::RegularConstantContinuousDistribution1DTemplate<RealType>> m_raw1DDists;
-    RegularConstantContinuousDistribution1DTemplate<RealType>* m_1DDists;
-    RegularConstantContinuousDistribution1DTemplate<RealType> m_top1DDist;
+    typename Storage::template Buffer<shared::RegularConstantContinuousDistribution1DTemplate<RealType>> m_raw1DDists;
+    RegularConstantContinuousDistribution1DTemplate<RealType, Storage>* m_1DDists;
+    RegularConstantContinuousDistribution1DTemplate<RealType, Storage> m_top1DDist;
     unsigned int m_isInitialized : 1;
 
 public:
@@ -361,6 +601,9 @@ public:
     void initialize(
         CUcontext cuContext, cudau::BufferType type,
         const RealType* values, uint32_t numD1, uint32_t numD2);
+    void initialize(const RealType* values, uint32_t numD1, uint32_t numD2) {
+        initialize(nullptr, cudau::BufferType::Device, values, numD1, numD2);
+    }
     void finalize(CUcontext cuContext) {
         if (!m_isInitialized)
             return;
@@ -388,9 +631,78 @@ public:
 
 
 
+template <typename RealType, typename Storage = DeviceMemoryStorage>
+class HierarchicalImportanceMapTemplate {
+    typename Storage::template Buffer<RealType> m_values;
+    uint32_t m_log2Width;
+    uint32_t m_log2Height;
+    unsigned int m_isInitialized : 1;
+
+public:
+    HierarchicalImportanceMapTemplate() : m_log2Width(0), m_log2Height(0), m_isInitialized(false) {}
+
+    HierarchicalImportanceMapTemplate &operator=(HierarchicalImportanceMapTemplate &&v) {
+        m_values = std::move(v.m_values);
+        m_log2Width = v.m_log2Width;
+        m_log2Height = v.m_log2Height;
+        m_isInitialized = v.m_isInitialized;
+        v.m_isInitialized = false;
+        return *this;
+    }
+
+    // JP: numD1 x numD2の値から重要度マップを作る。最も細かいレベルの各辺は入力の各辺を2の冪に切り上げたもので、
+    //     resolutionが0でない場合はアスペクト比を保ったまま長辺が2の冪に切り上げたresolutionになるよう拡縮する。
+    //     各セルは重なる入力の値の平均を持つので、入力より粗い解像度でも重要度が0になる部分は生じない。
+    // EN: Build an importance map from numD1 x numD2 values. Each side of the finest level is that of the input
+    //     rounded up to a power of two, and is scaled, keeping the aspect ratio,
+    //     so that the longer side becomes resolution rounded up to a power of two if resolution is not 0.
+    //     Each cell has the average of the overlapping input values,
+    //     so no part gets zero importance even at a resolution coarser than the input.
+    void initialize(
+        CUcontext cuContext, cudau::BufferType type,
+        const RealType* values, uint32_t numD1, uint32_t numD2, uint32_t resolution = 0);
+    void initialize(const RealType* values, uint32_t numD1, uint32_t numD2, uint32_t resolution = 0) {
+        initialize(nullptr, cudau::BufferType::Device, values, numD1, numD2, resolution);
+    }
+    void finalize(CUcontext cuContext) {
+        if (!m_isInitialized)
+            return;
+        m_values.finalize();
+        m_isInitialized = false;
+    }
+
+    bool isInitialized() const { return m_isInitialized; }
+    uint32_t getWidth() const { return 1 << m_log2Width; }
+    uint32_t getHeight() const { return 1 << m_log2Height; }
+    size_t getMemorySize() const { return sizeof(RealType) * m_values.numElements(); }
+
+    void getDeviceType(shared::HierarchicalImportanceMapTemplate<RealType>* instance) const {
+        new (instance) shared::HierarchicalImportanceMapTemplate<RealType>(
+            m_values.getDevicePointer(), m_log2Width, m_log2Height);
+    }
+};
+
+
+
 using DiscreteDistribution1D = DiscreteDistribution1DTemplate<float>;
 using RegularConstantContinuousDistribution1D = RegularConstantContinuousDistribution1DTemplate<float>;
 using RegularConstantContinuousDistribution2D = RegularConstantContinuousDistribution2DTemplate<float>;
+using HierarchicalImportanceMap = HierarchicalImportanceMapTemplate<float>;
+
+using HostDiscreteDistribution1D =
+    DiscreteDistribution1DTemplate<float, HostMemoryStorage>;
+using HostRegularConstantContinuousDistribution1D =
+    RegularConstantContinuousDistribution1DTemplate<float, HostMemoryStorage>;
+using HostRegularConstantContinuousDistribution2D =
+    RegularConstantContinuousDistribution2DTemplate<float, HostMemoryStorage>;
+using HostHierarchicalImportanceMap =
+    HierarchicalImportanceMapTemplate<float, HostMemoryStorage>;
+
+#if defined(USE_HIERARCHICAL_ENV_IMPORTANCE_MAP)
+using EnvLightImportanceMap = HierarchicalImportanceMap;
+#else
+using EnvLightImportanceMap = RegularConstantContinuousDistribution2D;
+#endif
 
 
 
@@ -416,6 +728,10 @@ public:
         return m_cuArray.getSurfaceObject(mipLevel);
     }
 
+    // JP: 先頭numValues個の重み(最初のミップレベルの値)をホストに読み出す。streamは同期される。
+    // EN: Read the first numValues weights (values of the first mip level) to the host. stream is synchronized.
+    void readWeights(float* values, uint32_t numValues, CUstream stream) const;
+
     void getDeviceType(shared::ProbabilityTexture* probTex) const {
         probTex->setTexObject(
             m_cuTexObj,
@@ -433,6 +749,277 @@ using LightDistribution =
 
 
 
+// JP: シーン中の全ての発光三角形を集めたホスト側のテーブル。
+//     ジオメトリーインスタンスごとのオブジェクト空間のデータ(頂点位置と平均放射輝度)は
+//     光源分布が再計算されたときに一度だけ登録し、
+//     インスタンスの変換を適用したワールド空間のSoAテーブルをフレームごとに並列に作る。
+//     テーブルはインスタンス、ジオメトリーインスタンス、プリミティブの順に並び、
+//     各ジオメトリーインスタンスの全プリミティブ(放射輝度がゼロのものも)を含む。
+//     頂点位置は放射する面が表になる巻き順(cross(p1 - p0, p2 - p0)が放射方向)。
+// EN: Host-side table gathering all the emissive triangles in a scene.
+//     Per-geometry-instance object-space data (vertex positions and average emittances) is registered once
+//     when the light distribution is recomputed,
+//     and the world-space SoA table applying the instance transforms is built in parallel per frame.
+//     The table is ordered by instance, geometry instance then primitive,
+//     and contains all the primitives (even ones with zero emittance) of each geometry instance.
+//     Vertex positions have the winding order where the emitting side is the front
+//     (cross(p1 - p0, p2 - p0) is the emission direction).
+class EmitterRegistry {
+    struct GeometryEmitters {
+        std::vector<Point3D> positions[3];
+        std::vector<RGB> emittances;
+    };
+
+    struct InstanceGeometry {
+        Matrix4x4 matM2W;
+        uint32_t instSlot;
+        uint32_t geomInstSlot;
+        uint32_t firstEmitter;
+    };
+
+    // JP: ジオメトリーインスタンススロットをインデックスとする。
+    // EN: Indexed by geometry instance slot.
+    std::vector<GeometryEmitters> m_geometries;
+    std::vector<InstanceGeometry> m_instGeometries;
+
+    std::vector<Point3D> m_positions[3];
+    std::vector<float> m_areas;
+    std::vector<RGB> m_emittances;
+    std::vector<uint32_t> m_instSlots;
+    std::vector<uint32_t> m_geomInstSlots;
+    std::vector<uint32_t> m_primIndices;
+    uint32_t m_numEmitters;
+
+public:
+    EmitterRegistry() : m_numEmitters(0) {}
+
+    // JP: ジオメトリーインスタンスの三角形を登録(置き換え)する。
+    //     放射はシェーディング法線側なので、幾何法線が逆を向いている三角形は巻き順を入れ替えて保持する。
+    // EN: Register (replace) the triangles of a geometry instance.
+    //     Emission is on the shading normal side,
+    //     so triangles whose geometric normal faces the opposite way are stored with the winding order swapped.
+    void setGeometryEmitters(
+        uint32_t geomInstSlot,
+        const shared::Vertex* vertices, const shared::Triangle* triangles, const RGB* emittances,
+        uint32_t numTriangles);
+    bool hasGeometryEmitters(uint32_t geomInstSlot) const {
+        return geomInstSlot < m_geometries.size() && !m_geometries[geomInstSlot].emittances.empty();
+    }
+
+    // JP: テーブルに含めるインスタンスとジオメトリーインスタンスの組をテーブルの順に追加してからupdateTable()を呼ぶ。
+    // EN: Add pairs of an instance and a geometry instance to include in the table in the table order,
+    //     then call updateTable().
+    void clearInstanceGeometries() {
+        m_instGeometries.clear();
+    }
+    void addInstanceGeometry(uint32_t instSlot, uint32_t geomInstSlot, const Matrix4x4 &matM2W) {
+        Assert(hasGeometryEmitters(geomInstSlot),
+               "Emitters of the geometry instance %u are not registered.", geomInstSlot);
+        m_instGeometries.push_back(InstanceGeometry{ matM2W, instSlot, geomInstSlot, 0 });
+    }
+    void updateTable();
+
+    uint32_t getNumEmitters() const {
+        return m_numEmitters;
+    }
+    const Point3D* getPositions(uint32_t vertexIndex) const {
+        return m_positions[vertexIndex].data();
+    }
+    const float* getAreas() const {
+        return m_areas.data();
+    }
+    const RGB* getEmittances() const {
+        return m_emittances.data();
+    }
+    const uint32_t* getInstSlots() const {
+        return m_instSlots.data();
+    }
+    const uint32_t* getGeomInstSlots() const {
+        return m_geomInstSlots.data();
+    }
+    const uint32_t* getPrimIndices() const {
+        return m_primIndices.data();
+    }
+};
+
+
+
+// JP: エミッター三角形上のライトツリー(shared::LightTree)をホストで構築する。
+//     各ノードは2つの子に分割され、分割はパワー、方向コーンの広がりと表面積を考慮したSAOHを
+//     ビンで評価して選ぶ。葉は1つのエミッターを持つ。
+//     大きなノードのビン分けと分割はブロック単位で並列に行い、小さな部分木はそれぞれ1スレッドで並列に構築する。
+//     ノードの配置は要素の範囲だけで決まり、ブロックの結果はブロック順に統合するので、
+//     結果はスレッド数に依存しない。
+//     HostMemoryStorageを使えば、構築とshared::LightTreeによるサンプリングをCPUだけで行える。
+// EN: Builds a light tree (shared::LightTree) over emitter triangles on the host.
+//     Each node is split into two children choosing the split by binned evaluation of the SAOH
+//     which accounts for the power, the spread of the direction cone and the surface area.
+//     A leaf has a single emitter.
+//     Binning and partitioning of large nodes are done in parallel per block,
+//     and small subtrees are built in parallel with a single thread each.
+//     Node placement depends only on the item ranges and block results are merged in block order,
+//     so the result doesn't depend on the number of threads.
+//     With HostMemoryStorage, the construction and sampling via shared::LightTree can be done only on CPU.
+template <typename Storage = DeviceMemoryStorage>
+class LightTreeTemplate {
+public:
+    struct BuildTimings {
+        float setUp;
+        float topLevelSplits;
+        float subtrees;
+        float upload;
+    };
+
+private:
+    typename Storage::template Buffer<shared::LightTreeNode> m_nodes;
+    typename Storage::template Buffer<shared::LightTreeEmitter> m_emitters;
+    typename Storage::template Buffer<uint2> m_instRanges;
+    typename Storage::template Buffer<uint2> m_geomInstEmitterBases;
+    uint32_t m_numNodes;
+    uint32_t m_numEmitters;
+    uint32_t m_numInstRanges;
+    BuildTimings m_buildTimings;
+    unsigned int m_isInitialized : 1;
+
+public:
+    LightTreeTemplate() :
+        m_numNodes(0), m_numEmitters(0), m_numInstRanges(0), m_buildTimings{}, m_isInitialized(false) {}
+
+    // JP: エミッターのパワーは放射輝度の輝度とワールド空間の面積の積。
+    //     バッファーは容量が足りない場合のみ確保し直す。
+    // EN: The power of an emitter is the product of the luminance of the emittance and the world-space area.
+    //     Buffers are reallocated only when their capacities are insufficient.
+    void build(CUcontext cuContext, const EmitterRegistry &registry);
+    void finalize() {
+        if (!m_isInitialized)
+            return;
+        if (m_geomInstEmitterBases.isInitialized())
+            m_geomInstEmitterBases.finalize();
+        if (m_instRanges.isInitialized())
+            m_instRanges.finalize();
+        if (m_emitters.isInitialized())
+            m_emitters.finalize();
+        if (m_nodes.isInitialized())
+            m_nodes.finalize();
+        m_numNodes = 0;
+        m_numEmitters = 0;
+        m_numInstRanges = 0;
+        m_isInitialized = false;
+    }
+
+    bool isInitialized() const { return m_isInitialized; }
+    uint32_t getNumNodes() const { return m_numNodes; }
+    uint32_t getNumEmitters() const { return m_numEmitters; }
+    const BuildTimings &getBuildTimings() const { return m_buildTimings; }
+
+    void getDeviceType(shared::LightTree* instance) const {
+        new (instance) shared::LightTree(
+            m_nodes.isInitialized() ? m_nodes.getDevicePointer() : nullptr,
+            m_emitters.isInitialized() ? m_emitters.getDevicePointer() : nullptr,
+            m_instRanges.isInitialized() ? m_instRanges.getDevicePointer() : nullptr,
+            m_geomInstEmitterBases.isInitialized() ? m_geomInstEmitterBases.getDevicePointer() : nullptr,
+            m_numNodes, m_numEmitters, m_numInstRanges);
+    }
+};
+
+using LightTree = LightTreeTemplate<DeviceMemoryStorage>;
+using HostLightTree = LightTreeTemplate<HostMemoryStorage>;
+
+// JP: ランダムに配置したインスタンスの発光三角形の数を1024個からmaxNumEmitters個まで4倍ずつ変えて、
+//     EmitterRegistryのテーブル更新とHostLightTreeの構築の各段階の時間を表示する。
+//     ツリーのノード数が期待通りでない場合は-1を返す。
+// EN: Print times of the EmitterRegistry table update and each stage of the HostLightTree build
+//     while sweeping the number of emissive triangles of randomly placed instances by 4x from 1024 to maxNumEmitters.
+//     Returns -1 if the number of tree nodes is not as expected.
+int32_t benchmarkLightTreeBuilds(uint32_t maxNumEmitters);
+
+
+
+// JP: 事前に光源をサンプリングしたサブセットのプール。乱数の状態とサンプルのバッファーを持つ。
+//     サブセットの数と大きさは初期化時に決める。
+//     光源が静的な場合は前のフレームのプールを使い回すこともできるが、複数フレームにわたって同じサンプルを
+//     使うことになるので、累積した結果はプールに依存したものに収束する。
+// EN: A pool of light subsets sampled in advance, holding buffers for RNG states and samples.
+//     The number and the size of subsets are determined at initialization.
+//     The pool of the previous frame can be reused when lights are static,
+//     but this uses the same samples over frames, so the accumulated result converges to one depending on the pool.
+template <typename LightSampleType>
+class PreSampledLightPoolTemplate {
+    cudau::TypedBuffer<shared::PCG32RNG> m_rngs;
+    cudau::TypedBuffer<shared::PreSampledLightTemplate<LightSampleType>> m_lights;
+    uint32_t m_numSubsets;
+    uint32_t m_subsetSize;
+    unsigned int m_reuseForStaticLights : 1;
+    unsigned int m_isUpToDate : 1;
+    unsigned int m_isInitialized : 1;
+
+public:
+    PreSampledLightPoolTemplate() :
+        m_numSubsets(0), m_subsetSize(0),
+        m_reuseForStaticLights(false), m_isUpToDate(false), m_isInitialized(false) {}
+
+    void initialize(
+        CUcontext cuContext, cudau::BufferType type,
+        uint32_t numSubsets, uint32_t subsetSize, uint64_t seed) {
+        Assert(numSubsets > 0 && subsetSize > 0, "Invalid pool size: %u x %u.", numSubsets, subsetSize);
+        m_numSubsets = numSubsets;
+        m_subsetSize = subsetSize;
+
+        const uint32_t numLights = getNumLights();
+        m_rngs.initialize(cuContext, type, numLights);
+        {
+            shared::PCG32RNG* rngs = m_rngs.map();
+            std::mt19937_64 rngSeed(seed);
+            for (uint32_t i = 0; i < numLights; ++i)
+                rngs[i].setState(rngSeed());
+            m_rngs.unmap();
+        }
+        m_lights.initialize(cuContext, type, numLights);
+
+        m_isUpToDate = false;
+        m_isInitialized = true;
+    }
+    void finalize() {
+        if (!m_isInitialized)
+            return;
+        m_lights.finalize();
+        m_rngs.finalize();
+        m_isUpToDate = false;
+        m_isInitialized = false;
+    }
+
+    bool isInitialized() const { return m_isInitialized; }
+    uint32_t getNumSubsets() const { return m_numSubsets; }
+    uint32_t getSubsetSize() const { return m_subsetSize; }
+    uint32_t getNumLights() const { return m_numSubsets * m_subsetSize; }
+
+    void setReuseForStaticLights(bool b) {
+        m_reuseForStaticLights = b;
+    }
+    bool getReuseForStaticLights() const {
+        return m_reuseForStaticLights;
+    }
+
+    // JP: このフレームでプールを生成し直す必要があるかを返す。
+    //     lightsChangedには光源やその分布がこのフレームで変化したかを渡す。
+    // EN: Return whether the pool needs to be regenerated in this frame.
+    //     Pass whether lights or their distribution changed in this frame to lightsChanged.
+    bool beginFrame(bool lightsChanged) {
+        bool needsUpdate = !m_reuseForStaticLights || !m_isUpToDate || lightsChanged;
+        m_isUpToDate = true;
+        return needsUpdate;
+    }
+
+    void getDeviceType(shared::PreSampledLightPoolTemplate<LightSampleType>* instance) const {
+        instance->rngs = m_rngs.getRWBuffer<shared::enableBufferOobCheck>();
+        instance->lights = m_lights.template getRWBuffer<shared::enableBufferOobCheck>();
+        instance->numSubsets = m_numSubsets;
+        instance->subsetSize = m_subsetSize;
+    }
+};
+
+
+
 struct MovingAverageTime {
     float values[60];
     uint32_t index;
@@ -453,46 +1040,155 @@ struct MovingAverageTime {
 
 
 
+// JP: ヘッドレスベンチマークモードの設定。
+//     "-headless -frames N -camera-path <file> -report <file>"をコマンドラインから受け取る。
+// EN: Settings for the headless benchmark mode.
+//     Accepts "-headless -frames N -camera-path <file> -report <file>" from the command line.
+struct BenchmarkConfig {
+    std::filesystem::path cameraPathFile;
+    std::filesystem::path reportFile;
+    uint32_t numFrames;
+    bool headless;
+
+    BenchmarkConfig() :
+        reportFile("benchmark.json"), numFrames(100), headless(false) {}
+};
+
+enum class CommandlineParseResult {
+    Unhandled = 0,
+    Handled,
+    Invalid,
+};
+
+// JP: argv[*argIdx]がベンチマーク用のオプションであれば解釈して*argIdxを引数の分だけ進める。
+// EN: Interpret argv[*argIdx] if it is a benchmark option and advance *argIdx by the number of its arguments.
+CommandlineParseResult parseBenchmarkOption(
+    int32_t argc, const char* argv[], int32_t* argIdx, BenchmarkConfig* config);
+
+// JP: キーフレーム間を位置は線形補間、姿勢は球面線形補間するカメラパス。
+//     ファイルは1行に"time px py pz roll pitch yaw"(角度は度)を持つテキスト形式で、'#'以降はコメント。
+// EN: Camera path that interpolates positions linearly and orientations spherically between keyframes.
+//     The file is a text format with "time px py pz roll pitch yaw" (angles in degrees) per line,
+//     and '#' starts a comment.
+class CameraPath {
+    struct Keyframe {
+        float time;
+        Point3D position;
+        Quaternion orientation;
+    };
+
+    std::vector<Keyframe> m_keyframes;
+
+public:
+    bool load(const std::filesystem::path &filePath);
+    bool parse(std::istream &stream);
+    // JP: キーフレームは時刻順に追加する必要がある。
+    // EN: Keyframes need to be added in time order.
+    void addKeyframe(float time, const Point3D &position, const Quaternion &orientation);
+
+    bool empty() const {
+        return m_keyframes.empty();
+    }
+    uint32_t getNumKeyframes() const {
+        return static_cast<uint32_t>(m_keyframes.size());
+    }
+    float getBeginTime() const {
+        return m_keyframes.empty() ? 0.0f : m_keyframes.front().time;
+    }
+    float getEndTime() const {
+        return m_keyframes.empty() ? 0.0f : m_keyframes.back().time;
+    }
+
+    // JP: 範囲外の時刻は端のキーフレームに固定される。
+    // EN: Times outside the range are clamped to the end keyframes.
+    void evaluate(float time, Point3D* position, Quaternion* orientation) const;
+    // JP: パス全体をnumFramesフレームに等間隔で割り当てた時のframeIndex番目の状態を返す。
+    // EN: Returns the state at frameIndex when the whole path is evenly distributed over numFrames frames.
+    void evaluateAtFrame(
+        uint32_t frameIndex, uint32_t numFrames, Point3D* position, Quaternion* orientation) const;
+};
+
+// JP: パスごとの計測時間を蓄積して最小値、中央値、99パーセンタイルなどをJSONとして書き出す。
+// EN: Accumulates measured times per pass and writes min, median, 99th percentile and so on as JSON.
+class BenchmarkReport {
+public:
+    struct Statistics {
+        uint32_t numSamples;
+        float min;
+        float median;
+        float p99;
+        float mean;
+        float max;
+    };
+
+private:
+    struct Series {
+        std::string name;
+        std::vector<float> samples;
+    };
+
+    std::vector<Series> m_series;
+
+public:
+    // JP: 系列は最初に記録された順に書き出される。
+    // EN: Series are written in the order they are first recorded.
+    void record(const std::string &name, float value);
+    const std::vector<float>* getSamples(const std::string &name) const;
+
+    // JP: パーセンタイルには最近傍順位法を用いる。
+    // EN: Uses the nearest-rank method for percentiles.
+    static Statistics computeStatistics(std::vector<float> samples);
+
+    bool writeJSON(
+        const std::filesystem::path &filePath, const char* programName,
+        uint32_t imageWidth, uint32_t imageHeight) const;
+};
+
+
+
+// JP: 64ビットワードの階層ビットマップによるスロットの割り当て管理。
+//     最下層は各スロットの使用状況、上位の層は下位のワードごとに
+//     「満杯か(AND)」「使用中のスロットを含むか(OR)」「使用中スロット数」を保持する。
+//     空きスロットの検索は各層でtzcntを1回ずつ行うだけで済む。
+// EN: Slot allocation management by a hierarchical bitmap of 64-bit words.
+//     The lowest layer holds the usage of each slot, and each upper layer holds
+//     "is full (AND)", "contains used slots (OR)" and "the number of used slots" for each word in the layer below.
+//     Finding an available slot requires only one tzcnt per layer.
 class SlotFinder {
+    std::vector<uint64_t> m_flagWords;
+    std::vector<uint32_t> m_numUsedFlagsUnderWordList;
+    std::vector<uint32_t> m_offsetsToOR_AND;
+    std::vector<uint32_t> m_offsetsToNumUsedFlags;
+    std::vector<uint32_t> m_numFlagsInLayerList;
     uint32_t m_numLayers;
-    uint32_t m_numLowestFlagBins;
-    uint32_t m_numTotalCompiledFlagBins;
-    uint32_t* m_flagBins;
-    uint32_t* m_offsetsToOR_AND;
-    uint32_t* m_numUsedFlagsUnderBinList;
-    uint32_t* m_offsetsToNumUsedFlags;
-    uint32_t* m_numFlagsInLayerList;
+    uint32_t m_numUsed;
 
     SlotFinder(const SlotFinder &) = delete;
     SlotFinder &operator=(const SlotFinder &) = delete;
 
-    void aggregate();
-
-    uint32_t getNumLayers() const {
-        return m_numLayers;
+    uint32_t getNumWordsInLayer(uint32_t layer) const {
+        return std::max(nextMultiplierForPowOf2(m_numFlagsInLayerList[layer], 6), 1u);
     }
 
-    const uint32_t* getOffsetsToOR_AND() const {
-        return m_offsetsToOR_AND;
+    uint64_t getFullMask(uint32_t layer, uint32_t wordIdx) const {
+        uint32_t numFlagsInWord = std::min(64u, m_numFlagsInLayerList[layer] - 64 * wordIdx);
+        return numFlagsInWord >= 64 ? ~0ull : ((1ull << numFlagsInWord) - 1);
     }
 
-    const uint32_t* getOffsetsToNumUsedFlags() const {
-        return m_offsetsToNumUsedFlags;
-    }
+    uint32_t getNumUsedFlagsUnderWord(uint32_t layer, uint32_t wordIdx) const;
 
-    const uint32_t* getNumFlagsInLayerList() const {
-        return m_numFlagsInLayerList;
-    }
+    // JP: 最下層のワード範囲[firstWordIdx, lastWordIdx]を覆う上位層の情報を再計算する。
+    // EN: Recompute the upper layer information covering the lowest word range [firstWordIdx, lastWordIdx].
+    void aggregate(uint32_t firstWordIdx, uint32_t lastWordIdx);
+
+    // JP: 満杯になった下位ワードのANDフラグを上位の層へアトミックに伝播する。
+    // EN: Atomically propagate the AND flag of a lower word that has become full to upper layers.
+    void propagateFullFlagConcurrent(uint32_t layer, uint32_t wordIdx);
 
 public:
     static constexpr uint32_t InvalidSlotIndex = 0xFFFFFFFF;
 
-    SlotFinder() :
-        m_numLayers(0), m_numLowestFlagBins(0), m_numTotalCompiledFlagBins(0),
-        m_flagBins(nullptr), m_offsetsToOR_AND(nullptr),
-        m_numUsedFlagsUnderBinList(nullptr), m_offsetsToNumUsedFlags(nullptr),
-        m_numFlagsInLayerList(nullptr) {
-    }
+    SlotFinder() : m_numLayers(0), m_numUsed(0) {}
     ~SlotFinder() {
     }
 
@@ -503,31 +1199,28 @@ public:
     SlotFinder &operator=(SlotFinder &&inst) {
         finalize();
 
+        m_flagWords = std::move(inst.m_flagWords);
+        m_numUsedFlagsUnderWordList = std::move(inst.m_numUsedFlagsUnderWordList);
+        m_offsetsToOR_AND = std::move(inst.m_offsetsToOR_AND);
+        m_offsetsToNumUsedFlags = std::move(inst.m_offsetsToNumUsedFlags);
+        m_numFlagsInLayerList = std::move(inst.m_numFlagsInLayerList);
         m_numLayers = inst.m_numLayers;
-        m_numLowestFlagBins = inst.m_numLowestFlagBins;
-        m_numTotalCompiledFlagBins = inst.m_numTotalCompiledFlagBins;
-        m_flagBins = inst.m_flagBins;
-        m_offsetsToOR_AND = inst.m_offsetsToOR_AND;
-        m_numUsedFlagsUnderBinList = inst.m_numUsedFlagsUnderBinList;
-        m_offsetsToNumUsedFlags = inst.m_offsetsToNumUsedFlags;
-        m_numFlagsInLayerList = inst.m_numFlagsInLayerList;
-        inst.m_flagBins = nullptr;
-        inst.m_offsetsToOR_AND = nullptr;
-        inst.m_numUsedFlagsUnderBinList = nullptr;
-        inst.m_offsetsToNumUsedFlags = nullptr;
-        inst.m_numFlagsInLayerList = nullptr;
+        m_numUsed = inst.m_numUsed;
+        inst.m_numLayers = 0;
+        inst.m_numUsed = 0;
 
         return *this;
     }
-    SlotFinder(SlotFinder &&inst) {
+    SlotFinder(SlotFinder &&inst) : m_numLayers(0), m_numUsed(0) {
         *this = std::move(inst);
     }
 
     void resize(uint32_t numSlots);
 
     void reset() {
-        std::fill_n(m_flagBins, m_numLowestFlagBins + m_numTotalCompiledFlagBins, 0);
-        std::fill_n(m_numUsedFlagsUnderBinList, m_numLowestFlagBins + m_numTotalCompiledFlagBins / 2, 0);
+        std::fill(m_flagWords.begin(), m_flagWords.end(), 0);
+        std::fill(m_numUsedFlagsUnderWordList.begin(), m_numUsedFlagsUnderWordList.end(), 0);
+        m_numUsed = 0;
     }
 
 
@@ -536,16 +1229,31 @@ public:
 
     void setNotInUse(uint32_t slotIdx);
 
+    // JP: [firstSlotIdx, firstSlotIdx + numSlots)のスロットをまとめて使用中/未使用にする。
+    // EN: Set the slots in [firstSlotIdx, firstSlotIdx + numSlots) in use / not in use at once.
+    void setInUseRange(uint32_t firstSlotIdx, uint32_t numSlots);
+
+    void releaseRange(uint32_t firstSlotIdx, uint32_t numSlots);
+
     bool getUsage(uint32_t slotIdx) const {
-        uint32_t binIdx = slotIdx / 32;
-        uint32_t flagIdxInBin = slotIdx % 32;
-        uint32_t flagBin = m_flagBins[binIdx];
+        uint32_t wordIdx = slotIdx / 64;
+        uint32_t flagIdxInWord = slotIdx % 64;
+        uint64_t flagWord = m_flagWords[wordIdx];
 
-        return (bool)((flagBin >> flagIdxInBin) & 0x1);
+        return (bool)((flagWord >> flagIdxInWord) & 0x1);
     }
 
     uint32_t getFirstAvailableSlot() const;
 
+    // JP: 最初の利用可能なスロットを探して使用中にする。
+    //     最下層のワードへのCASによってスロットを確保するため、複数のスレッドから同時に呼び出せる。
+    //     ただし他のメンバー関数(setNotInUseやresizeなど)と同時に呼び出してはならない。
+    // EN: Find the first available slot and set it in use.
+    //     This can be called from multiple threads simultaneously
+    //     since a slot is claimed by CAS on a lowest-layer word.
+    //     However, this must not be called concurrently with other member functions (e.g. setNotInUse or resize).
+    uint32_t claimFirstAvailableSlot();
+
     uint32_t getFirstUsedSlot() const;
 
     uint32_t find_nthUsedSlot(uint32_t n) const;
@@ -555,12 +1263,24 @@ public:
     }
 
     uint32_t getNumUsed() const {
-        return m_numUsedFlagsUnderBinList[m_offsetsToNumUsedFlags[m_numLayers - 1]];
+        return m_numUsed;
     }
 
     void debugPrint() const;
 };
 
+// JP: numSlots個のスロットの確保、インデックスによる検索、一部の解放と再確保、全解放の時間を
+//     64ビット階層ビットマップ化する前の実装と比較して表示する。
+//     確保されたスロットの列が一致しない場合は-1を返す。
+// EN: Compare and print times of claiming numSlots slots, lookup by index, releasing and reclaiming a part
+//     and releasing all against the implementation before the 64-bit hierarchical bitmap.
+//     Returns -1 if the sequences of claimed slots don't match.
+int32_t benchmarkSlotFinders(uint32_t numSlots);
+
+// JP: GPUを使わないホスト側のセルフテストを実行して結果を表示する。全て成功した場合にtrueを返す。
+// EN: Run host-side self tests not using the GPU and print the results. Returns true if all succeed.
+bool runHostSelfTests();
+
 
 
 enum class MaterialConvention {
@@ -620,8 +1340,20 @@ struct Material {
     cudau::TypedBuffer<optixu::NativeBlockBuffer2D<float2>> minMaxMipMapSurfs;
 
     uint32_t materialSlot;
-
-    Material() : materialSlot(0) {}
+    // JP: 放射輝度を変更した場合にmarkLightDistDirty()で立てる。Scene::setupLightGeomDistributions()で
+    //     このマテリアルを使うジオメトリーインスタンスの光源分布が再計算される。
+    // EN: Set by markLightDistDirty() when the emittance is changed. Scene::setupLightGeomDistributions() recomputes
+    //     the light distributions of geometry instances using this material.
+    uint32_t needsLightDistUpdate : 1;
+    // JP: このマテリアルのテクスチャーに対する非同期読み込みリクエスト。
+    // EN: Asynchronous loading requests for textures of this material.
+    std::vector<uint32_t> textureRequestIDs;
+
+    Material() : materialSlot(0), needsLightDistUpdate(true) {}
+
+    void markLightDistDirty() {
+        needsLightDistUpdate = true;
+    }
 };
 
 struct GeometryInstance {
@@ -637,6 +1369,11 @@ struct GeometryInstance {
     optixu::GeometryInstance optixGeomInst;
     AABB aabb;
     optixu::GeometryType geometryType;
+    uint32_t needsLightDistUpdate : 1;
+    // JP: 光源分布が再計算され、エミッターをScene::emitterRegistryへ集め直す必要がある。
+    // EN: The light distribution has been recomputed and the emitters need to be gathered again
+    //     into Scene::emitterRegistry.
+    uint32_t needsEmitterTriangleReadback : 1;
     // for TFDM
     cudau::TypedBuffer<shared::DisplacedTriangleAuxInfo> dispTriAuxInfoBuffer;
     cudau::TypedBuffer<AABB> aabbBuffer;
@@ -662,16 +1399,156 @@ struct GeometryInstance {
     }
 };
 
+enum class ASUpdateMethod {
+    Refit = 0,
+    Rebuild,
+};
+
+// JP: ASのリフィットとリビルドを選択するホスト側のコストモデル。デバイスに依存しない。
+//     最後のリビルド時の子の境界を基準として記録し、各子について基準と現在の境界の和集合を取った
+//     表面積の合計が基準の表面積の合計に対して何倍になったかを、リフィットによるBVH品質劣化の推定値とする。
+//     子が基準位置から離れるほどリフィットされたノードの境界は膨らむので、この値が閾値を超えるか、
+//     連続リフィット回数が上限に達したらリビルドを選ぶ。
+// EN: Host-side cost model to choose between refit and rebuild of an AS. Independent of the device.
+//     Records the child bounds at the last rebuild as the reference, and uses the ratio of the summed surface area
+//     of the union of the reference and current bounds of each child to the summed reference surface area
+//     as the estimate of BVH quality degradation by refitting.
+//     Refitted node bounds inflate as children move away from their reference positions,
+//     so rebuild is chosen when this value exceeds a threshold or the number of consecutive refits reaches the limit.
+class ASUpdatePolicy {
+public:
+    struct Config {
+        float maxBoundsGrowth;
+        uint32_t maxConsecutiveRefits;
+
+        Config() : maxBoundsGrowth(1.5f), maxConsecutiveRefits(64) {}
+    };
+
+private:
+    Config m_config;
+    std::vector<AABB> m_referenceAabbs;
+    float m_referenceArea;
+    float m_lastBoundsGrowth;
+    uint32_t m_numConsecutiveRefits;
+    uint32_t m_numRebuilds;
+    uint32_t m_numRefits;
+    bool m_hasReference;
+
+public:
+    ASUpdatePolicy() {
+        reset();
+    }
+
+    void setConfig(const Config &config) {
+        m_config = config;
+    }
+    const Config &getConfig() const {
+        return m_config;
+    }
+
+    // JP: 基準と統計を破棄する。次の判断は必ずリビルドになる。
+    // EN: Discard the reference and the statistics. The next decision will always be rebuild.
+    void reset();
+
+    float estimateBoundsGrowth(const AABB* childAabbs, uint32_t numChildren) const;
+    // JP: refitAllowedがfalseの場合(子の数や構成が変わった場合など)は常にリビルドを選ぶ。
+    // EN: Always chooses rebuild when refitAllowed is false (e.g. the number or composition of children changed).
+    ASUpdateMethod decide(bool refitAllowed, const AABB* childAabbs, uint32_t numChildren);
+    void recordRebuild(const AABB* childAabbs, uint32_t numChildren);
+    void recordRefit() {
+        ++m_numConsecutiveRefits;
+        ++m_numRefits;
+    }
+
+    float getLastBoundsGrowth() const {
+        return m_lastBoundsGrowth;
+    }
+    uint32_t getNumConsecutiveRefits() const {
+        return m_numConsecutiveRefits;
+    }
+    uint32_t getNumRebuilds() const {
+        return m_numRebuilds;
+    }
+    uint32_t getNumRefits() const {
+        return m_numRefits;
+    }
+};
+
+// JP: ASのビルド用スクラッチメモリーのプール。サイズを2の冪のクラスに丸めて確保し、解放されたブロックを再利用する。
+//     解放時にストリームにイベントを記録し、そのイベントが完了したブロックのみを再利用するので、
+//     異なるストリームで並行するフレーム間でもスクラッチメモリーが競合しない。
+// EN: Pool of scratch memory for AS builds. Allocates sizes rounded up to power-of-two classes
+//     and reuses released blocks.
+//     An event is recorded on the stream at release, and only blocks whose event has completed are reused,
+//     so scratch memory does not conflict even between frames running concurrently on different streams.
+class ScratchMemoryPool {
+    struct Block {
+        cudau::Buffer buffer;
+        CUevent releaseEvent;
+        uint32_t sizeClass;
+        bool inUse;
+    };
+
+    CUcontext m_cuContext;
+    std::vector<Block*> m_blocks;
+
+public:
+    static constexpr uint32_t minSizeClassLog2 = 16;
+
+    ScratchMemoryPool() : m_cuContext(nullptr) {}
+    ~ScratchMemoryPool() {
+        finalize();
+    }
+
+    void initialize(CUcontext cuContext) {
+        m_cuContext = cuContext;
+    }
+    void finalize();
+
+    static uint32_t computeSizeClass(size_t size) {
+        uint32_t sizeClass = 0;
+        while ((static_cast<size_t>(1) << (minSizeClassLog2 + sizeClass)) < size)
+            ++sizeClass;
+        return sizeClass;
+    }
+    static size_t getSizeClassBytes(uint32_t sizeClass) {
+        return static_cast<size_t>(1) << (minSizeClassLog2 + sizeClass);
+    }
+
+    // JP: size以上の、最も小さいクラスの再利用可能なブロックを返す。無ければ確保する。
+    // EN: Returns a reusable block of the smallest class not smaller than size. Allocates one if none is available.
+    const cudau::Buffer* acquire(size_t size);
+    // JP: streamに発行済みの処理が完了した後にブロックを再利用可能にする。
+    // EN: Make the block reusable after the work issued to stream completes.
+    void release(const cudau::Buffer* buffer, CUstream stream);
+
+    size_t getTotalAllocatedSize() const {
+        size_t sum = 0;
+        for (const Block* block : m_blocks)
+            sum += block->buffer.sizeInBytes();
+        return sum;
+    }
+};
+
 struct GeometryGroup {
     std::set<const GeometryInstance*> geomInsts;
+    // JP: geomInstsの順のスロット。このグループの全インスタンスのInstanceDataから共有される。
+    // EN: Slots in the order of geomInsts. Shared by InstanceData of all the instances of this group.
+    cudau::TypedBuffer<uint32_t> geomInstSlots;
 
     optixu::GeometryAccelerationStructure optixGas;
     cudau::Buffer optixGasMem;
     uint32_t numEmitterPrimitives;
     AABB aabb;
+    ASUpdatePolicy updatePolicy;
     uint32_t needsReallocation : 1;
     uint32_t needsRebuild : 1;
+    // JP: カスタムプリミティブのGASはAABBの変化に対してリフィットできる。
+    //     それ以外の静的なGASは最初のビルド後にコンパクションされる。
+    // EN: GASes of custom primitives can be refitted for AABB changes.
+    //     The other static GASes are compacted after the first build.
     uint32_t refittable : 1;
+    uint32_t compacted : 1;
 
     void draw() const {
         for (const GeometryInstance* geomInst : geomInsts)
@@ -690,15 +1567,31 @@ struct Mesh {
 struct Instance {
     Mesh::GeometryGroupInstance geomGroupInst;
 
-    cudau::TypedBuffer<uint32_t> geomInstSlots;
     LightDistribution lightGeomInstDist;
     uint32_t instSlot;
     optixu::Instance optixInst;
+    // JP: ジオメトリーインスタンス単位の分布(lightGeomInstDist)の再計算が必要。
+    // EN: The distribution over geometry instances (lightGeomInstDist) needs to be recomputed.
+    uint32_t needsLightDistUpdate : 1;
+    // JP: インスタンス単位の分布(Scene::lightInstDist)でのこのインスタンスの重みの更新が必要。
+    // EN: The weight of this instance in the distribution over instances (Scene::lightInstDist) needs to be updated.
+    uint32_t needsLightInstDistUpdate : 1;
 
     Matrix4x4 prevMatM2W;
     Matrix4x4 matM2W;
     Matrix3x3 nMatM2W;
 
+    // JP: インスタンスに含まれる発光ジオメトリーが変わった場合に呼ぶ。
+    // EN: Call this when the emissive geometries contained in the instance change.
+    void markLightDistDirty() {
+        needsLightDistUpdate = true;
+    }
+    // JP: トランスフォームを変更した場合に呼ぶ。インスタンス単位の分布の重みのみが更新される。
+    // EN: Call this when the transform is changed. Only the weight in the distribution over instances is updated.
+    void markTransformDirty() {
+        needsLightInstDistUpdate = true;
+    }
+
     void draw() const {
         glUniformMatrix4fv(5, 1, false, reinterpret_cast<const float*>(&prevMatM2W));
         glUniformMatrix4fv(6, 1, false, reinterpret_cast<const float*>(&matM2W));
@@ -708,13 +1601,11 @@ struct Instance {
     }
 };
 
+// JP: インスタンスのアニメーションパラメター。評価はInstanceControllerSystemがまとめて行う。
+// EN: Animation parameters of an instance. InstanceControllerSystem evaluates them in bulk.
 struct InstanceController {
     Instance* inst;
 
-    float curScale;
-    Quaternion curOrientation;
-    Point3D curPosition;
-
     float beginScale;
     Quaternion beginOrientation;
     Point3D beginPosition;
@@ -734,41 +1625,110 @@ struct InstanceController {
         endScale(_endScale), endOrientation(_endOrienatation), endPosition(_endPosition),
         time(initTime), frequency(_frequency) {
     }
+};
 
-    void updateBody(float dt) {
-        time = std::fmod(time + dt, frequency);
-        float t = 0.5f - 0.5f * std::cos(2 * pi_v<float> * time / frequency);
-        curScale = (1 - t) * beginScale + t * endScale;
-        curOrientation = Slerp(t, beginOrientation, endOrientation);
-        curPosition = (1 - t) * beginPosition + t * endPosition;
-    }
+// JP: 全インスタンスコントローラーのパラメターをSoA形式で保持し、AVX2と複数スレッドでまとめて評価する。
+//     InstanceDataのトランスフォーム部分はピン留めされたステージングバッファーにスロット順で連続して書き込み、
+//     スロットが連続する区間ごとに1回の転送でアップロードする。
+//     OptixInstanceのトランスフォームはoptixu::Instanceに書き込まれ、IASのリビルド時に一括で転送される。
+// EN: Holds the parameters of all instance controllers in SoA form and evaluates them in bulk
+//     with AVX2 and multiple threads.
+//     The transform part of InstanceData is written contiguously in slot order into a pinned staging buffer,
+//     and uploaded with one transfer per run of consecutive slots.
+//     OptixInstance transforms are written into optixu::Instance and transferred in bulk at the IAS rebuild.
+class InstanceControllerSystem {
+public:
+    // JP: InstanceDataの先頭のトランスフォーム部分と同じレイアウト。
+    // EN: Same layout as the leading transform part of InstanceData.
+    struct TransformData {
+        Matrix4x4 transform;
+        Matrix4x4 curToPrevTransform;
+        Matrix3x3 normalMatrix;
+        float uniformScale;
+    };
 
-    void update(shared::InstanceData* instDataBuffer, float dt) {
-        Matrix4x4 prevTransform = inst->matM2W;
-        updateBody(dt);
-        Matrix3x3 matRot = curOrientation.toMatrix3x3();
+private:
+    struct SlotRun {
+        uint32_t slot;
+        uint32_t begin;
+        uint32_t count;
+    };
 
-        inst->matM2W =
-            Matrix4x4(matRot * curScale, curPosition) *
-            inst->geomGroupInst.transform;
-        inst->nMatM2W = matRot / curScale;
+    std::vector<InstanceController*> m_controllers;
+    std::vector<Instance*> m_insts;
+    std::vector<float> m_times;
+    std::vector<float> m_frequencies;
+    std::vector<float> m_beginScales;
+    std::vector<float> m_endScales;
+    std::array<std::vector<float>, 4> m_beginOrientations;
+    std::array<std::vector<float>, 4> m_endOrientations;
+    std::array<std::vector<float>, 3> m_beginPositions;
+    std::array<std::vector<float>, 3> m_endPositions;
+    // JP: 3x4のアフィン行列を行優先で保持する。m_transformsは前回評価時の値で、次の評価の前フレーム行列になる。
+    // EN: 3x4 affine matrices in row-major order.
+    //     m_transforms holds the last evaluated values, which become the previous-frame matrices of the next evaluation.
+    std::array<std::vector<float>, 12> m_groupTransforms;
+    std::array<std::vector<float>, 12> m_transforms;
+    std::vector<SlotRun> m_slotRuns;
+    std::array<TransformData*, 2> m_stagingBuffers;
+    uint32_t m_numControllers;
+
+    void evaluate(uint32_t begin, uint32_t end, float dt, TransformData* dst);
+    void evaluate_AVX2(uint32_t begin, uint32_t end, float dt, TransformData* dst);
 
-        Matrix4x4 tMatM2W = transpose(inst->matM2W);
-        inst->optixInst.setTransform(reinterpret_cast<const float*>(&tMatM2W));
+public:
+    InstanceControllerSystem() : m_stagingBuffers{}, m_numControllers(0) {}
+    ~InstanceControllerSystem() {
+        finalize();
+    }
 
-        Vector3D scale;
-        inst->matM2W.decompose(&scale, nullptr, nullptr);
-        float uniformScale = scale.x;
+    // JP: コントローラーのパラメターと、インスタンスの現在のトランスフォームを取り込む。
+    //     コントローラーの集合が変わった場合は再度呼ぶ必要がある。
+    // EN: Take in the parameters of the controllers and the current transforms of the instances.
+    //     Needs to be called again when the set of controllers changes.
+    void initialize(const std::vector<InstanceController*> &controllers);
+    // JP: 進めた時間をコントローラーに書き戻してから解放する。
+    // EN: Write the advanced times back to the controllers, then release.
+    void finalize();
 
-        shared::InstanceData &instData = instDataBuffer[inst->instSlot];
-        instData.curToPrevTransform = prevTransform * invert(inst->matM2W);
-        instData.transform = inst->matM2W;
-        instData.normalMatrix = inst->nMatM2W;
-        instData.uniformScale = uniformScale;
+    uint32_t getNumControllers() const {
+        return m_numControllers;
     }
+
+    // JP: Instanceを伴わずに、ランダムなアニメーションパラメターとグループ変換でnumControllers個分のSoAを作る。
+    //     セルフテストとベンチマーク用で、update()は使えずevaluateAll()のみを使う。
+    // EN: Make the SoA for numControllers with random animation parameters and group transforms
+    //     without Instances.
+    //     For self tests and benchmarks, update() cannot be used and only evaluateAll() is used.
+    void initializeWithRandomParameters(uint32_t numControllers, uint32_t seed);
+    // JP: 全コントローラーの時間をdt進めてAVX2版かスカラー版で複数スレッドで評価し、結果をdstに書き出す。
+    //     Instanceは更新しない。
+    // EN: Advance the time of all controllers by dt and evaluate them with the AVX2 or scalar version
+    //     using multiple threads, then write the results to dst. Instances are not updated.
+    void evaluateAll(float dt, bool useAVX2, TransformData* dst);
+
+    // JP: 全コントローラーの時間をdt進めて評価し、Instanceの行列とOptiXインスタンスのトランスフォームを更新、
+    //     InstanceDataのトランスフォーム部分をdstBufferへ非同期にアップロードする。
+    //     ステージングバッファーはbufferIndexごとに分かれており、同じbufferIndexでの前回の転送は完了している必要がある。
+    // EN: Advance the time of all controllers by dt and evaluate them, update the matrices of Instances
+    //     and the transforms of OptiX instances, then asynchronously upload the transform part of InstanceData
+    //     to dstBuffer.
+    //     Staging buffers are separate per bufferIndex,
+    //     and the previous transfer with the same bufferIndex needs to have completed.
+    void update(
+        CUstream stream, float dt, uint32_t bufferIndex,
+        const cudau::TypedBuffer<shared::InstanceData> &dstBuffer);
 };
 
+// JP: ランダムなパラメターのnumControllers個のインスタンスコントローラーの評価時間を
+//     スカラー版とAVX2版で比較して表示する。結果の差が許容誤差を超える場合は-1を返す。
+// EN: Compare and print evaluation times of numControllers instance controllers with random parameters
+//     between the scalar and AVX2 versions. Returns -1 if the results differ beyond the tolerance.
+int32_t benchmarkInstanceControllers(uint32_t numControllers);
+
 // TODO: シーンまわり綺麗にしたい。
+class AsyncTextureLoader;
+
 struct Scene {
     static constexpr cudau::BufferType bufferType = cudau::BufferType::Device;
 
@@ -786,7 +1746,11 @@ struct Scene {
         cudau::Kernel computeTriangleProbBuffer;
         cudau::Kernel computeGeomInstProbBuffer;
         cudau::Kernel computeInstProbBuffer;
+        cudau::Kernel updateInstProbTexture;
+        cudau::Kernel updateInstProbBuffer;
+        cudau::Kernel updateMip;
         cudau::Kernel finalizeDiscreteDistribution1D;
+        cudau::Kernel computeTriangleEmittances;
         cudau::Kernel test;
     } computeProbTex;
 
@@ -808,18 +1772,70 @@ struct Scene {
 
     std::vector<Instance*> insts;
     std::vector<InstanceController*> instControllers;
+    InstanceControllerSystem instControllerSystem;
     AABB initialSceneAabb;
 
     LightDistribution lightInstDist;
+    // JP: lightInstDistのデバイス側の記述子。カーネルが積分値などを書き込む正本で、毎フレームコピーして使う。
+    // EN: Device-side descriptor of lightInstDist. The master copy into which kernels write the integral and so on,
+    //     copied for use every frame.
+    cudau::TypedBuffer<shared::LightDistribution> lightInstDistOnDevice;
+    cudau::TypedBuffer<uint32_t> lightInstSlotsToUpdate;
+    std::vector<uint32_t> lightInstSlotsToUpdateOnHost;
+    uint32_t lightInstDistNumInsts;
+
+    // JP: setupLightGeomDistributions()とsetupLightInstDistribution()で実際に再計算された光源分布の累積数。
+    // EN: Cumulative numbers of light distributions actually recomputed
+    //     in setupLightGeomDistributions() and setupLightInstDistribution().
+    struct LightDistUpdateStats {
+        uint32_t numEmitterPrimDistUpdates;
+        uint32_t numLightGeomInstDistUpdates;
+        uint32_t numLightInstDistBuilds;
+        uint32_t numLightInstWeightUpdates;
+        uint32_t numCalls;
+    } lightDistUpdateStats;
+    bool lightGeomDistsInitialized : 1;
+    bool lightInstDistInitialized : 1;
+
+    // JP: ライトツリー構築用の発光三角形のテーブルと、三角形ごとの放射輝度を読み戻すための作業バッファー。
+    // EN: Table of emissive triangles for light tree construction
+    //     and a work buffer to read back the per-triangle emittances.
+    EmitterRegistry emitterRegistry;
+    cudau::TypedBuffer<RGB> emitterEmittanceBuffer;
+    // JP: 直前のbuildLightTree()の各段階の時間[ms]。
+    // EN: Time [ms] of each stage of the last buildLightTree().
+    struct LightTreeBuildTimings {
+        float gatherEmitters;
+        float updateEmitterTable;
+        LightTree::BuildTimings buildTree;
+    } lightTreeBuildTimings;
+
+    // JP: 設定されている場合、マテリアルのカラーテクスチャーは非同期に読み込まれる。
+    //     ローダーはマテリアルの破棄より前に終了処理する必要がある。
+    // EN: Color textures of materials are loaded asynchronously when this is set.
+    //     The loader needs to be finalized before materials are destroyed.
+    AsyncTextureLoader* textureLoader;
 
     optixu::InstanceAccelerationStructure ias;
     cudau::Buffer iasMem;
     cudau::TypedBuffer<OptixInstance> iasInstanceBuffer;
+    ASUpdatePolicy iasUpdatePolicy;
+    std::vector<AABB> iasChildAabbs;
     bool iasNeedsReallocation : 1;
 
-    cudau::Buffer asScratchMem;
+    ScratchMemoryPool asScratchMemPool;
+    size_t asScratchSize;
     cudau::Buffer scanScratchMem; // TODO: unify
 
+    // JP: コンパクション前のGASのメモリー。参照する処理の完了を示すイベントが完了するまで解放を遅らせる。
+    // EN: Memory of GASes before compaction.
+    //     Freeing is deferred until the event indicating completion of work referencing it completes.
+    struct RetiredASMemory {
+        cudau::Buffer buffer;
+        CUevent retireEvent;
+    };
+    std::vector<RetiredASMemory*> retiredASMems;
+
     size_t hitGroupSbtSize;
 
     void initialize(
@@ -844,8 +1860,16 @@ struct Scene {
             cudau::Kernel(computeProbTex.cudaModule, "computeGeomInstProbBuffer", cudau::dim3(32), 0);
         computeProbTex.computeInstProbBuffer =
             cudau::Kernel(computeProbTex.cudaModule, "computeInstProbBuffer", cudau::dim3(32), 0);
+        computeProbTex.updateInstProbTexture =
+            cudau::Kernel(computeProbTex.cudaModule, "updateInstProbTexture", cudau::dim3(32), 0);
+        computeProbTex.updateInstProbBuffer =
+            cudau::Kernel(computeProbTex.cudaModule, "updateInstProbBuffer", cudau::dim3(32), 0);
+        computeProbTex.updateMip =
+            cudau::Kernel(computeProbTex.cudaModule, "updateProbabilityTextureMip", cudau::dim3(32), 0);
         computeProbTex.finalizeDiscreteDistribution1D =
             cudau::Kernel(computeProbTex.cudaModule, "finalizeDiscreteDistribution1D", cudau::dim3(32), 0);
+        computeProbTex.computeTriangleEmittances =
+            cudau::Kernel(computeProbTex.cudaModule, "computeTriangleEmittances", cudau::dim3(32), 0);
         computeProbTex.test =
             cudau::Kernel(computeProbTex.cudaModule, "testProbabilityTexture", cudau::dim3(32), 0);
 
@@ -864,11 +1888,23 @@ struct Scene {
         ias = optixScene.createInstanceAccelerationStructure();
         iasNeedsReallocation = true;
 
+        asScratchMemPool.initialize(cuContext);
+        asScratchSize = 0;
+
+        lightDistUpdateStats = {};
+        lightGeomDistsInitialized = false;
+        lightInstDistInitialized = false;
+        lightInstDistNumInsts = 0;
+        lightTreeBuildTimings = {};
+        textureLoader = nullptr;
+
 #if USE_PROBABILITY_TEXTURE
         lightInstDist.initialize(cuContext, maxNumInstances);
 #else
         lightInstDist.initialize(cuContext, bufferType, nullptr, maxNumInstances);
 #endif
+        lightInstDistOnDevice.initialize(cuContext, bufferType, 1);
+        lightInstSlotsToUpdate.initialize(cuContext, bufferType, maxNumInstances);
 
         size_t scanScratchSize;
         constexpr int32_t maxScanSize = std::max<int32_t>({
@@ -884,9 +1920,16 @@ struct Scene {
     void finalize() {
         scanScratchMem.finalize();
 
+        if (emitterEmittanceBuffer.isInitialized())
+            emitterEmittanceBuffer.finalize();
+        lightInstSlotsToUpdate.finalize();
+        lightInstDistOnDevice.finalize();
         lightInstDist.finalize();
 
-        asScratchMem.finalize();
+        instControllerSystem.finalize();
+
+        freeRetiredASMemories(true);
+        asScratchMemPool.finalize();
         iasInstanceBuffer.finalize();
         iasMem.finalize();
         for (int i = static_cast<int>(geomGroups.size()) - 1; i >= 0; --i) {
@@ -904,6 +1947,7 @@ struct Scene {
         for (int i = static_cast<int>(geomGroups.size()) - 1; i >= 0; --i) {
             GeometryGroup* geomGroup = geomGroups[i];
             geomGroup->optixGas.destroy();
+            geomGroup->geomInstSlots.finalize();
         }
         for (int i = static_cast<int>(geomInsts.size()) - 1; i >= 0; --i) {
             GeometryInstance* geomInst = geomInsts[i];
@@ -946,23 +1990,45 @@ struct Scene {
         materialDataBuffer.unmap();
     }
 
+    // JP: アニメーションするインスタンスのトランスフォームを更新し、instDataBuffer[bufferIndex]へ転送する。
+    // EN: Update the transforms of animated instances and transfer them to instDataBuffer[bufferIndex].
+    void updateInstances(CUstream stream, uint32_t bufferIndex, float dt) {
+        instControllerSystem.update(stream, dt, bufferIndex, instDataBuffer[bufferIndex]);
+    }
+
+    // JP: 変更のあったASを更新する。
+    //     リフィット可能なGASとIASは、構成が変わっていなければASUpdatePolicyに従ってリフィットかリビルドを選ぶ。
+    //     GASがリビルドされた場合はハンドルが変わり得るのでIASもリビルドする。
+    //     静的なGASは最初のビルド後にコンパクションする。
+    // EN: Update ASes with changes.
+    //     Refittable GASes and the IAS choose between refit and rebuild following ASUpdatePolicy
+    //     unless their composition has changed.
+    //     The IAS is also rebuilt when a GAS has been rebuilt since its handle may change.
+    //     Static GASes are compacted after the first build.
     OptixTraversableHandle updateASs(CUcontext cuContext, CUstream stream) {
+        freeRetiredASMemories(false);
+
         OptixAccelBufferSizes asSizes;
-        size_t asScratchSize = asScratchMem.isInitialized() ? asScratchMem.sizeInBytes() : 0;
         bool gasReallocated = false;
         for (int i = 0; i < geomGroups.size(); ++i) {
             GeometryGroup* geomGroup = geomGroups[i];
-            if (!geomGroup->needsReallocation)
+            // JP: コンパクション済みのバッファーはリビルドには小さいので確保し直す。
+            // EN: Reallocate since the compacted buffer is too small for a rebuild.
+            if (!geomGroup->needsReallocation && !(geomGroup->needsRebuild && geomGroup->compacted))
                 continue;
             geomGroup->optixGas.setConfiguration(
                 optixu::ASTradeoff::PreferFastTrace,
-                optixu::AllowUpdate::No, optixu::AllowCompaction::No, optixu::AllowRandomVertexAccess::No);
+                geomGroup->refittable ? optixu::AllowUpdate::Yes : optixu::AllowUpdate::No,
+                geomGroup->refittable ? optixu::AllowCompaction::No : optixu::AllowCompaction::Yes,
+                optixu::AllowRandomVertexAccess::No);
             geomGroup->optixGas.prepareForBuild(&asSizes);
             if (geomGroup->optixGasMem.isInitialized())
                 geomGroup->optixGasMem.resize(asSizes.outputSizeInBytes, 1);
             else
                 geomGroup->optixGasMem.initialize(cuContext, bufferType, asSizes.outputSizeInBytes, 1);
-            asScratchSize = std::max(asSizes.tempSizeInBytes, asScratchSize);
+            asScratchSize = std::max({ asSizes.tempSizeInBytes, asSizes.tempUpdateSizeInBytes, asScratchSize });
+            geomGroup->updatePolicy.reset();
+            geomGroup->compacted = false;
             geomGroup->needsReallocation = false;
             gasReallocated = true;
         }
@@ -975,58 +2041,176 @@ struct Scene {
 
             ias.setConfiguration(
                 optixu::ASTradeoff::PreferFastTrace,
-                optixu::AllowUpdate::No, optixu::AllowCompaction::No, optixu::AllowRandomInstanceAccess::No);
+                optixu::AllowUpdate::Yes, optixu::AllowCompaction::No, optixu::AllowRandomInstanceAccess::No);
             ias.prepareForBuild(&asSizes);
             if (iasMem.isInitialized())
                 iasMem.resize(asSizes.outputSizeInBytes, 1);
             else
                 iasMem.initialize(cuContext, bufferType, asSizes.outputSizeInBytes, 1);
-            asScratchSize = std::max(asSizes.tempSizeInBytes, asScratchSize);
+            asScratchSize = std::max({ asSizes.tempSizeInBytes, asSizes.tempUpdateSizeInBytes, asScratchSize });
             iasInstanceBuffer.initialize(cuContext, bufferType, ias.getNumChildren());
-
-            for (int bufIdx = 0; bufIdx < 2; ++bufIdx) {
-                cudau::TypedBuffer<shared::InstanceData> &curInstDataBuffer = instDataBuffer[bufIdx];
-                shared::InstanceData* instDataBufferOnHost = curInstDataBuffer.map();
-                for (int i = 0; i < instControllers.size(); ++i) {
-                    InstanceController* controller = instControllers[i];
-                    Instance* inst = controller->inst;
-                    shared::InstanceData &instData = instDataBufferOnHost[inst->instSlot];
-                    controller->update(instDataBufferOnHost, 0.0f);
-                    // TODO: まとめて送る。
-                    CUDADRV_CHECK(cuMemcpyHtoDAsync(
-                        curInstDataBuffer.getCUdeviceptrAt(inst->instSlot),
-                        &instData, sizeof(instData), 0));
-                }
-                curInstDataBuffer.unmap();
-            }
+            iasUpdatePolicy.reset();
+
+            // JP: 両方のinstDataBufferとステージングバッファーに書き込むので、
+            //     他のストリームで実行中のフレームを含めて全ての処理の完了を待つ。
+            //     また次のフレームが別のストリームで始まる前に転送を完了させる。
+            // EN: Wait for all work including frames in flight on other streams
+            //     since both instDataBuffers and staging buffers are written.
+            //     Also complete the transfers before the next frame starts on another stream.
+            CUDADRV_CHECK(cuCtxSynchronize());
+            instControllerSystem.initialize(instControllers);
+            for (int bufIdx = 0; bufIdx < 2; ++bufIdx)
+                instControllerSystem.update(stream, 0.0f, bufIdx, instDataBuffer[bufIdx]);
+            CUDADRV_CHECK(cuStreamSynchronize(stream));
 
             iasNeedsReallocation = false;
         }
 
-        if (!asScratchMem.isInitialized())
-            asScratchMem.initialize(cuContext, bufferType, asScratchSize, 1);
-        else if (asScratchSize > asScratchMem.sizeInBytes())
-            asScratchMem.resize(asScratchSize, 1);
-
         if (gasReallocated)
             optixScene.generateShaderBindingTableLayout(&hitGroupSbtSize);
 
+        const cudau::Buffer &asScratchMem = *asScratchMemPool.acquire(asScratchSize);
+
+        bool gasRebuilt = false;
+        std::vector<GeometryGroup*> geomGroupsToCompact;
         for (int i = 0; i < geomGroups.size(); ++i) {
             GeometryGroup* geomGroup = geomGroups[i];
-            if (geomGroup->needsRebuild)
-                geomGroup->optixGas.rebuild(0, geomGroup->optixGasMem, asScratchMem);
+            if (!geomGroup->needsRebuild)
+                continue;
+            // JP: GASの子の境界はデバイス上にしか無いことがあるので、グループ全体の境界で判断する。
+            // EN: Judge by the bounds of the whole group since the child bounds of a GAS may exist only on the device.
+            ASUpdateMethod method = geomGroup->updatePolicy.decide(
+                geomGroup->refittable && geomGroup->optixGas.isReady(), &geomGroup->aabb, 1);
+            if (method == ASUpdateMethod::Refit) {
+                geomGroup->optixGas.update(stream, asScratchMem);
+                geomGroup->updatePolicy.recordRefit();
+            }
+            else {
+                geomGroup->optixGas.rebuild(stream, geomGroup->optixGasMem, asScratchMem);
+                geomGroup->updatePolicy.recordRebuild(&geomGroup->aabb, 1);
+                gasRebuilt = true;
+                if (!geomGroup->refittable && !geomGroup->compacted)
+                    geomGroupsToCompact.push_back(geomGroup);
+            }
             geomGroup->needsRebuild = false;
         }
 
-        return ias.rebuild(0, iasInstanceBuffer, iasMem, asScratchMem);
+        // JP: コンパクション後のサイズの取得はビルドの完了を待つ。静的なGASに対して一度だけ行われる。
+        // EN: Obtaining the compacted size waits for the build to complete. This happens only once for static GASes.
+        for (GeometryGroup* geomGroup : geomGroupsToCompact) {
+            size_t compactedSize;
+            geomGroup->optixGas.prepareForCompact(&compactedSize);
+            if (compactedSize < geomGroup->optixGasMem.sizeInBytes()) {
+                cudau::Buffer compactedMem;
+                compactedMem.initialize(cuContext, bufferType, compactedSize, 1);
+                geomGroup->optixGas.compact(stream, compactedMem);
+                geomGroup->optixGas.removeUncompacted();
+                retireASMemory(std::move(geomGroup->optixGasMem), stream);
+                geomGroup->optixGasMem = std::move(compactedMem);
+            }
+            geomGroup->compacted = true;
+        }
+
+        const uint32_t numInsts = static_cast<uint32_t>(insts.size());
+        iasChildAabbs.resize(numInsts);
+        parallelForChunks(
+            0, numInsts, 4096,
+            [this](uint32_t chunkIdx, uint32_t begin, uint32_t end) {
+            for (uint32_t i = begin; i < end; ++i) {
+                const Instance* inst = insts[i];
+                iasChildAabbs[i] = inst->matM2W * inst->geomGroupInst.geomGroup->aabb;
+            }
+        });
+        ASUpdateMethod iasMethod = iasUpdatePolicy.decide(
+            !gasRebuilt && numInsts > 0 && ias.isReady(), iasChildAabbs.data(), numInsts);
+        if (iasMethod == ASUpdateMethod::Refit) {
+            ias.update(stream, asScratchMem);
+            iasUpdatePolicy.recordRefit();
+        }
+        else {
+            ias.rebuild(stream, iasInstanceBuffer, iasMem, asScratchMem);
+            iasUpdatePolicy.recordRebuild(iasChildAabbs.data(), numInsts);
+        }
+
+        asScratchMemPool.release(&asScratchMem, stream);
+
+        return ias.getHandle();
+    }
+
+    // JP: ストリームチェーンでは各フレームが前のフレームの完了を待つので、
+    //     streamに記録したイベントは他のストリームで実行中だったフレームによる参照の完了も含む。
+    // EN: Each frame waits for the completion of the previous frame in the stream chain,
+    //     so the event recorded on stream also covers references by a frame that was in flight on another stream.
+    void retireASMemory(cudau::Buffer &&buffer, CUstream stream) {
+        RetiredASMemory* retiredMem = new RetiredASMemory();
+        retiredMem->buffer = std::move(buffer);
+        CUDADRV_CHECK(cuEventCreate(&retiredMem->retireEvent, CU_EVENT_DISABLE_TIMING));
+        CUDADRV_CHECK(cuEventRecord(retiredMem->retireEvent, stream));
+        retiredASMems.push_back(retiredMem);
+    }
+
+    // JP: イベントが完了したメモリーを解放する。waitがtrueの場合は全てのイベントの完了を待つ。
+    // EN: Free memories whose events have completed. Waits for all the events when wait is true.
+    void freeRetiredASMemories(bool wait) {
+        for (int i = static_cast<int>(retiredASMems.size()) - 1; i >= 0; --i) {
+            RetiredASMemory* retiredMem = retiredASMems[i];
+            if (wait) {
+                CUDADRV_CHECK(cuEventSynchronize(retiredMem->retireEvent));
+            }
+            else {
+                const CUresult res = cuEventQuery(retiredMem->retireEvent);
+                if (res == CUDA_ERROR_NOT_READY)
+                    continue;
+                CUDADRV_CHECK(res);
+            }
+            CUDADRV_CHECK(cuEventDestroy(retiredMem->retireEvent));
+            retiredMem->buffer.finalize();
+            delete retiredMem;
+            retiredASMems.erase(retiredASMems.begin() + i);
+        }
     }
 
-    void setupLightGeomDistributions() {
-        CUstream cuStream = 0;
+    // JP: 変更フラグが立っているジオメトリーインスタンスとインスタンスの光源分布のみを再計算する。
+    //     マテリアルの変更はそれを使うジオメトリーインスタンスに、
+    //     ジオメトリーインスタンスの変更はそれを含むインスタンスに伝搬する。
+    //     変更が無い場合は何もしないので毎フレーム呼んでよい。
+    //     インスタンス単位の分布は毎フレームsetupLightInstDistribution()で更新される。
+    // EN: Recompute only the light distributions of geometry instances and instances flagged as changed.
+    //     A material change propagates to the geometry instances using it,
+    //     and a geometry instance change propagates to the instances containing it.
+    //     This does nothing when there is no change, so it can be called every frame.
+    //     The distribution over instances is updated every frame in setupLightInstDistribution().
+    void setupLightGeomDistributions(CUstream cuStream = 0) {
+        ++lightDistUpdateStats.numCalls;
+
+        bool hasChanges = false;
+        for (int matIdx = 0; matIdx < materials.size() && !hasChanges; ++matIdx)
+            hasChanges = materials[matIdx]->needsLightDistUpdate;
+        for (int geomInstIdx = 0; geomInstIdx < geomInsts.size() && !hasChanges; ++geomInstIdx)
+            hasChanges = geomInsts[geomInstIdx]->needsLightDistUpdate;
+        for (int instIdx = 0; instIdx < insts.size() && !hasChanges; ++instIdx)
+            hasChanges = insts[instIdx]->needsLightDistUpdate;
+        if (!hasChanges)
+            return;
+
+        for (int geomInstIdx = 0; geomInstIdx < geomInsts.size(); ++geomInstIdx) {
+            GeometryInstance* geomInst = geomInsts[geomInstIdx];
+            if (geomInst->mat->needsLightDistUpdate)
+                geomInst->needsLightDistUpdate = true;
+        }
+        for (int instIdx = 0; instIdx < insts.size(); ++instIdx) {
+            Instance* inst = insts[instIdx];
+            for (const GeometryInstance* geomInst : inst->geomGroupInst.geomGroup->geomInsts) {
+                if (geomInst->needsLightDistUpdate) {
+                    inst->needsLightDistUpdate = true;
+                    break;
+                }
+            }
+        }
 
         for (int geomInstIdx = 0; geomInstIdx < geomInsts.size(); ++geomInstIdx) {
             const GeometryInstance* geomInst = geomInsts[geomInstIdx];
-            if (!geomInst->emitterPrimDist.isInitialized())
+            if (!geomInst->emitterPrimDist.isInitialized() || !geomInst->needsLightDistUpdate)
                 continue;
             shared::GeometryInstanceData* geomInstData =
                 geomInstDataBuffer.getDevicePointerAt(geomInst->geomInstSlot);
@@ -1051,11 +2235,12 @@ struct Scene {
 
         for (int geomInstIdx = 0; geomInstIdx < geomInsts.size(); ++geomInstIdx) {
             const GeometryInstance* geomInst = geomInsts[geomInstIdx];
-            if (!geomInst->emitterPrimDist.isInitialized())
+            if (!geomInst->emitterPrimDist.isInitialized() || !geomInst->needsLightDistUpdate)
                 continue;
             shared::GeometryInstanceData* geomInstData =
                 geomInstDataBuffer.getDevicePointerAt(geomInst->geomInstSlot);
             uint32_t numTriangles = static_cast<uint32_t>(geomInst->triangleBuffer.numElements());
+            ++lightDistUpdateStats.numEmitterPrimDistUpdates;
 #if USE_PROBABILITY_TEXTURE
             uint2 curDims = shared::computeProbabilityTextureDimentions(numTriangles);
             uint32_t numMipLevels = nextPowOf2Exponent(curDims.x) + 1;
@@ -1101,7 +2286,7 @@ struct Scene {
 
         for (int instIdx = 0; instIdx < insts.size(); ++instIdx) {
             const Instance* inst = insts[instIdx];
-            if (!inst->lightGeomInstDist.isInitialized())
+            if (!inst->lightGeomInstDist.isInitialized() || !inst->needsLightDistUpdate)
                 continue;
             shared::InstanceData* instData = instDataBuffer[0].getDevicePointerAt(inst->instSlot);
             uint32_t numGeomInsts = static_cast<uint32_t>(inst->geomGroupInst.geomGroup->geomInsts.size());
@@ -1125,10 +2310,11 @@ struct Scene {
 
         for (int instIdx = 0; instIdx < insts.size(); ++instIdx) {
             const Instance* inst = insts[instIdx];
-            if (!inst->lightGeomInstDist.isInitialized())
+            if (!inst->lightGeomInstDist.isInitialized() || !inst->needsLightDistUpdate)
                 continue;
             shared::InstanceData* instData = instDataBuffer[0].getDevicePointerAt(inst->instSlot);
             uint32_t numGeomInsts = static_cast<uint32_t>(inst->geomGroupInst.geomGroup->geomInsts.size());
+            ++lightDistUpdateStats.numLightGeomInstDistUpdates;
 #if USE_PROBABILITY_TEXTURE
             uint2 curDims = shared::computeProbabilityTextureDimentions(numGeomInsts);
             uint32_t numMipLevels = nextPowOf2Exponent(curDims.x) + 1;
@@ -1144,7 +2330,7 @@ struct Scene {
 #else
             size_t scratchMemSize = scanScratchMem.sizeInBytes();
             CUDADRV_CHECK(cubd::DeviceScan::ExclusiveSum(
-                asScratchMem.getDevicePointer(), scratchMemSize,
+                scanScratchMem.getDevicePointer(), scratchMemSize,
                 inst->lightGeomInstDist.weightsOnDevice(),
                 inst->lightGeomInstDist.cdfOnDevice(),
                 numGeomInsts, cuStream));
@@ -1172,14 +2358,206 @@ struct Scene {
         //    }
         //}
 
-        CUDADRV_CHECK(cuMemcpyDtoDAsync(
-            instDataBuffer[1].getCUdeviceptr(), instDataBuffer[0].getCUdeviceptr(),
-            instDataBuffer[1].sizeInBytes(), cuStream));
+        // JP: 初回はインスタンスデータ全体を2つ目のバッファーにコピーする。
+        //     以降は、他のフィールドはフレームごとに更新されているので、更新した分布のみをコピーする。
+        // EN: Copy the entire instance data to the second buffer for the first time.
+        //     After that, copy only the updated distributions since other fields are updated per frame.
+        if (!lightGeomDistsInitialized) {
+            CUDADRV_CHECK(cuMemcpyDtoDAsync(
+                instDataBuffer[1].getCUdeviceptr(), instDataBuffer[0].getCUdeviceptr(),
+                instDataBuffer[1].sizeInBytes(), cuStream));
+            lightGeomDistsInitialized = true;
+        }
+        else {
+            constexpr size_t distOffset = offsetof(shared::InstanceData, lightGeomInstDist);
+            for (int instIdx = 0; instIdx < insts.size(); ++instIdx) {
+                const Instance* inst = insts[instIdx];
+                if (!inst->lightGeomInstDist.isInitialized() || !inst->needsLightDistUpdate)
+                    continue;
+                CUDADRV_CHECK(cuMemcpyDtoDAsync(
+                    instDataBuffer[1].getCUdeviceptrAt(inst->instSlot) + distOffset,
+                    instDataBuffer[0].getCUdeviceptrAt(inst->instSlot) + distOffset,
+                    sizeof(shared::LightDistribution), cuStream));
+            }
+        }
+
+        // JP: 再計算した分布の積分値はインスタンス単位の分布の重みに反映する必要がある。
+        // EN: The integrals of the recomputed distributions need to be reflected
+        //     in the weights of the distribution over instances.
+        for (int instIdx = 0; instIdx < insts.size(); ++instIdx) {
+            Instance* inst = insts[instIdx];
+            if (inst->needsLightDistUpdate)
+                inst->needsLightInstDistUpdate = true;
+            inst->needsLightDistUpdate = false;
+        }
+        for (int geomInstIdx = 0; geomInstIdx < geomInsts.size(); ++geomInstIdx) {
+            GeometryInstance* geomInst = geomInsts[geomInstIdx];
+            if (geomInst->needsLightDistUpdate)
+                geomInst->needsEmitterTriangleReadback = true;
+            geomInst->needsLightDistUpdate = false;
+        }
+        for (int matIdx = 0; matIdx < materials.size(); ++matIdx)
+            materials[matIdx]->needsLightDistUpdate = false;
 
         CUDADRV_CHECK(cuStreamSynchronize(cuStream));
     }
 
+    // JP: 現在のインスタンスの変換を使ってemitterRegistryのワールド空間のテーブルを更新し、ライトツリーを構築する。
+    //     三角形と放射輝度は光源分布が更新されたジオメトリーインスタンスについてのみ読み戻す。
+    //     setupLightGeomDistributions()の後に呼ぶ必要がある。
+    // EN: Update the world-space table of emitterRegistry using the current instance transforms and build a light tree.
+    //     Triangles and emittances are read back only for geometry instances whose light distributions were updated.
+    //     This needs to be called after setupLightGeomDistributions().
+    void buildLightTree(CUcontext cuContext, CUstream cuStream, LightTree* lightTree) {
+        StopWatchHiRes sw;
+
+        // JP: 光源分布が再計算されたジオメトリーインスタンスの三角形と放射輝度の推定値を読み戻して登録する。
+        //     放射輝度テクスチャーはブロック圧縮されていることがあるので、推定値はGPUで求める。
+        // EN: Read back the triangles and the estimated emittances of geometry instances
+        //     whose light distributions have been recomputed and register them.
+        //     Emittance textures can be block-compressed, so the estimates are computed on the GPU.
+        sw.start();
+        std::vector<shared::Vertex> vertices;
+        std::vector<shared::Triangle> triangles;
+        std::vector<RGB> emittances;
+        for (int geomInstIdx = 0; geomInstIdx < geomInsts.size(); ++geomInstIdx) {
+            GeometryInstance* geomInst = geomInsts[geomInstIdx];
+            if (!geomInst->emitterPrimDist.isInitialized() || !geomInst->needsEmitterTriangleReadback)
+                continue;
+            const uint32_t numTriangles = static_cast<uint32_t>(geomInst->triangleBuffer.numElements());
+            if (!emitterEmittanceBuffer.isInitialized() || emitterEmittanceBuffer.numElements() < numTriangles) {
+                if (emitterEmittanceBuffer.isInitialized())
+                    emitterEmittanceBuffer.finalize();
+                emitterEmittanceBuffer.initialize(cuContext, bufferType, numTriangles);
+            }
+            computeProbTex.computeTriangleEmittances(
+                cuStream, computeProbTex.computeTriangleEmittances.calcGridDim(numTriangles),
+                geomInstDataBuffer.getDevicePointerAt(geomInst->geomInstSlot), numTriangles,
+                materialDataBuffer.getDevicePointer(), emitterEmittanceBuffer.getDevicePointer());
+
+            vertices.resize(geomInst->vertexBuffer.numElements());
+            triangles.resize(numTriangles);
+            emittances.resize(numTriangles);
+            geomInst->vertexBuffer.read(vertices, cuStream);
+            geomInst->triangleBuffer.read(triangles, cuStream);
+            emitterEmittanceBuffer.read(emittances.data(), numTriangles, cuStream);
+            CUDADRV_CHECK(cuStreamSynchronize(cuStream));
+
+            emitterRegistry.setGeometryEmitters(
+                geomInst->geomInstSlot, vertices.data(), triangles.data(), emittances.data(), numTriangles);
+            geomInst->needsEmitterTriangleReadback = false;
+        }
+        const uint32_t mGather = sw.stop();
+
+        sw.start();
+        emitterRegistry.clearInstanceGeometries();
+        for (int instIdx = 0; instIdx < insts.size(); ++instIdx) {
+            const Instance* inst = insts[instIdx];
+            if (!inst->lightGeomInstDist.isInitialized())
+                continue;
+            for (const GeometryInstance* geomInst : inst->geomGroupInst.geomGroup->geomInsts) {
+                if (!geomInst->emitterPrimDist.isInitialized())
+                    continue;
+                emitterRegistry.addInstanceGeometry(inst->instSlot, geomInst->geomInstSlot, inst->matM2W);
+            }
+        }
+        emitterRegistry.updateTable();
+        const uint32_t mUpdateTable = sw.stop();
+
+        lightTree->build(cuContext, emitterRegistry);
+
+        lightTreeBuildTimings.gatherEmitters =
+            sw.getMeasurement(mGather, StopWatchDurationType::Microseconds) * 1e-3f;
+        lightTreeBuildTimings.updateEmitterTable =
+            sw.getMeasurement(mUpdateTable, StopWatchDurationType::Microseconds) * 1e-3f;
+        lightTreeBuildTimings.buildTree = lightTree->getBuildTimings();
+    }
+
+    // JP: インスタンス単位の光源分布を更新してlightInstDistAddrにコピーする。
+    //     初回とインスタンス数が変わった場合は全体を構築し、それ以外では
+    //     トランスフォームかジオメトリーインスタンス単位の分布が変わった発光インスタンスの重みのみを書き換える。
+    //     記述子の正本はシーンが持つので、lightInstDistAddrの内容が他で上書きされても毎フレーム復元される。
+    // EN: Update the light distribution over instances and copy it to lightInstDistAddr.
+    //     Build the whole for the first time and when the number of instances changes, otherwise
+    //     rewrite only the weights of emissive instances whose transforms or distributions over geometry instances
+    //     have changed.
+    //     The scene holds the master descriptor, so it is restored every frame
+    //     even if the contents at lightInstDistAddr are overwritten elsewhere.
     void setupLightInstDistribution(
+        CUstream cuStream, CUdeviceptr lightInstDistAddr, uint32_t instBufferIndex) {
+        const uint32_t numInsts = static_cast<uint32_t>(insts.size());
+        const CUdeviceptr masterAddr = lightInstDistOnDevice.getCUdeviceptr();
+        if (!lightInstDistInitialized || numInsts != lightInstDistNumInsts) {
+            buildLightInstDistribution(cuStream, masterAddr, instBufferIndex);
+            lightInstDistInitialized = true;
+            lightInstDistNumInsts = numInsts;
+            ++lightDistUpdateStats.numLightInstDistBuilds;
+        }
+        else {
+            lightInstSlotsToUpdateOnHost.clear();
+            for (int instIdx = 0; instIdx < insts.size(); ++instIdx) {
+                const Instance* inst = insts[instIdx];
+                if (inst->lightGeomInstDist.isInitialized() && inst->needsLightInstDistUpdate)
+                    lightInstSlotsToUpdateOnHost.push_back(inst->instSlot);
+            }
+            if (!lightInstSlotsToUpdateOnHost.empty()) {
+                patchLightInstDistribution(cuStream, masterAddr, instBufferIndex);
+                lightDistUpdateStats.numLightInstWeightUpdates +=
+                    static_cast<uint32_t>(lightInstSlotsToUpdateOnHost.size());
+            }
+        }
+        for (int instIdx = 0; instIdx < insts.size(); ++instIdx)
+            insts[instIdx]->needsLightInstDistUpdate = false;
+
+        CUDADRV_CHECK(cuMemcpyDtoDAsync(
+            lightInstDistAddr, masterAddr, sizeof(shared::LightDistribution), cuStream));
+    }
+
+    void patchLightInstDistribution(
+        CUstream cuStream, CUdeviceptr lightInstDistAddr, uint32_t instBufferIndex) {
+        const uint32_t numInstsToUpdate = static_cast<uint32_t>(lightInstSlotsToUpdateOnHost.size());
+        lightInstSlotsToUpdate.write(lightInstSlotsToUpdateOnHost.data(), numInstsToUpdate, cuStream);
+#if USE_PROBABILITY_TEXTURE
+        computeProbTex.updateInstProbTexture(
+            cuStream, computeProbTex.updateInstProbTexture.calcGridDim(numInstsToUpdate),
+            lightInstDistAddr, lightInstSlotsToUpdate.getDevicePointer(), numInstsToUpdate,
+            instDataBuffer[instBufferIndex].getDevicePointer(),
+            lightInstDist.getSurfaceObject(0));
+
+        // JP: 書き換えた要素の祖先のみを下位のミップレベルへ順に再計算する。
+        // EN: Recompute only the ancestors of the rewritten elements toward coarser mip levels in order.
+        uint2 dims = shared::computeProbabilityTextureDimentions(lightInstDistNumInsts);
+        uint32_t numMipLevels = nextPowOf2Exponent(dims.x) + 1;
+        for (int dstMipLevel = 1; dstMipLevel < numMipLevels; ++dstMipLevel) {
+            computeProbTex.updateMip(
+                cuStream, computeProbTex.updateMip.calcGridDim(numInstsToUpdate),
+                lightInstDistAddr, dstMipLevel,
+                lightInstSlotsToUpdate.getDevicePointer(), numInstsToUpdate,
+                lightInstDist.getSurfaceObject(dstMipLevel - 1),
+                lightInstDist.getSurfaceObject(dstMipLevel));
+        }
+#else
+        computeProbTex.updateInstProbBuffer(
+            cuStream, computeProbTex.updateInstProbBuffer.calcGridDim(numInstsToUpdate),
+            lightInstDistAddr, lightInstSlotsToUpdate.getDevicePointer(), numInstsToUpdate,
+            instDataBuffer[instBufferIndex].getDevicePointer());
+
+        // JP: CDFは書き換えた位置以降が全て変わるのでスキャンはし直す。
+        // EN: Redo the scan since the CDF changes entirely after the rewritten positions.
+        size_t scratchMemSize = scanScratchMem.sizeInBytes();
+        CUDADRV_CHECK(cubd::DeviceScan::ExclusiveSum(
+            scanScratchMem.getDevicePointer(), scratchMemSize,
+            lightInstDist.weightsOnDevice(),
+            lightInstDist.cdfOnDevice(),
+            lightInstDistNumInsts, cuStream));
+
+        computeProbTex.finalizeDiscreteDistribution1D(
+            cuStream, computeProbTex.finalizeDiscreteDistribution1D.calcGridDim(1),
+            lightInstDistAddr);
+#endif
+    }
+
+    void buildLightInstDistribution(
         CUstream cuStream, CUdeviceptr lightInstDistAddr, uint32_t instBufferIndex) {
         shared::LightDistribution dLightInstDist;
         lightInstDist.getDeviceType(&dLightInstDist);
@@ -1280,8 +2658,27 @@ struct Scene {
     }
 };
 
+// JP: 光源分布の差分更新が変更の無い分布を再計算しないことを、lightDistUpdateStatsの増分で確かめる。
+//     変更無し、発光マテリアル1つの変更、発光インスタンス1つの移動の各場合を試し、
+//     最後に差分更新したインスタンス単位の分布の積分値が全体の構築と一致することを確かめる。
+//     setupLightGeomDistributions()の後に呼ぶ。
+// EN: Check with the increments of lightDistUpdateStats that incremental updates of light distributions
+//     never recompute unchanged distributions.
+//     Tries no change, a change of one emissive material and a move of one emissive instance,
+//     then checks that the integral of the incrementally updated distribution over instances matches a full build.
+//     Call this after setupLightGeomDistributions().
+bool testIncrementalLightDistributionUpdates(CUcontext cuContext, Scene* scene);
+
 void finalizeTextureCaches();
 
+// JP: DDSテクスチャー読み込み時に許容する最大解像度。これを超える上位のミップレベルは読み込まない。
+//     0は無制限。テクスチャーを読み込む前に設定する必要がある。
+//     テクスチャーのキャッシュはこの値ごとに分かれる。
+// EN: Maximum resolution allowed when loading DDS textures. Upper mip levels larger than this are not loaded.
+//     0 means unlimited. This needs to be set before loading textures.
+//     The texture cache is separate per this value.
+void setMaxTextureResolution(uint32_t maxResolution);
+
 template <typename T>
 void createImmTexture(
     CUcontext cuContext,
@@ -1305,6 +2702,90 @@ bool loadNormalTexture(
     std::shared_ptr<glu::Texture2D>* gfxTexture,
     BumpMapTextureType* bumpMapType);
 
+struct DecodedTextureImage;
+
+// JP: ワーカースレッド群でテクスチャーのファイル読み込みとデコードを行い、
+//     完了したものをメインスレッドでデバイスにアップロードする。
+//     リクエストは優先度の高い順に処理される。同じファイルへのリクエストはまとめられ、優先度は加算される。
+// EN: Worker threads read and decode texture files,
+//     then completed ones are uploaded to the device on the main thread.
+//     Requests are processed in descending order of priority.
+//     Requests for the same file are merged and their priorities are added.
+class AsyncTextureLoader {
+public:
+    using CompletionCallback = std::function<void(
+        CUstream stream, const std::shared_ptr<cudau::Array> &texture, bool needsDegamma, bool isHDR)>;
+
+private:
+    struct Request {
+        std::filesystem::path filePath;
+        float priority;
+        std::vector<CompletionCallback> callbacks;
+        std::shared_ptr<DecodedTextureImage> image;
+        bool isQueued;
+    };
+    // JP: 優先度の降順、同じ優先度の中ではリクエスト順。
+    // EN: Descending order of priority, request order within the same priority.
+    struct QueueOrder {
+        bool operator()(const std::pair<float, uint32_t> &a, const std::pair<float, uint32_t> &b) const {
+            if (a.first != b.first)
+                return a.first > b.first;
+            return a.second < b.second;
+        }
+    };
+
+    std::vector<std::thread> m_workers;
+    mutable std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::vector<Request> m_requests;
+    std::map<std::filesystem::path, uint32_t> m_pathToRequest;
+    std::set<std::pair<float, uint32_t>, QueueOrder> m_queue;
+    std::vector<uint32_t> m_completedRequests;
+    uint32_t m_numUnfinishedRequests;
+    bool m_stopRequested;
+
+    void workerMain();
+
+public:
+    AsyncTextureLoader() : m_numUnfinishedRequests(0), m_stopRequested(false) {}
+    ~AsyncTextureLoader() {
+        finalize();
+    }
+
+    // JP: numThreadsが0の場合はハードウェアスレッド数を使う。
+    // EN: Use the number of hardware threads when numThreads is 0.
+    void initialize(uint32_t numThreads = 0);
+    void finalize();
+
+    // JP: コールバックはprocessCompletedRequests()の中でメインスレッドから呼ばれる。
+    // EN: The callback is called from the main thread in processCompletedRequests().
+    uint32_t request(
+        const std::filesystem::path &filePath, float priority,
+        const CompletionCallback &callback);
+    void raisePriority(uint32_t requestID, float deltaPriority);
+
+    // JP: デコードが完了したテクスチャーをアップロードしてコールバックを呼ぶ。処理したリクエスト数を返す。
+    //     コールバックはデバイス上のデータの更新をstreamに発行する。
+    //     コールバックは古いテクスチャーを破棄するので、呼び出し側は差し替えられるテクスチャーを使う
+    //     GPUの処理が無いことを保証する必要がある。Scene::map()とunmap()の間で呼んではならない。
+    // EN: Upload textures whose decoding have completed and call the callbacks.
+    //     Returns the number of processed requests.
+    //     The callbacks issue updates of data on the device to stream.
+    //     The callbacks destroy old textures, so the caller needs to ensure that
+    //     there is no GPU work using the textures being replaced.
+    //     This must not be called between Scene::map() and unmap().
+    uint32_t processCompletedRequests(CUcontext cuContext, CUstream stream);
+
+    bool hasCompletedRequests() const {
+        std::lock_guard lock(m_mutex);
+        return !m_completedRequests.empty();
+    }
+    uint32_t getNumUnfinishedRequests() const {
+        std::lock_guard lock(m_mutex);
+        return m_numUnfinishedRequests;
+    }
+};
+
 void createNormalTexture(
     CUcontext cuContext,
     const std::filesystem::path &normalPath,
@@ -1340,12 +2821,36 @@ void createSimplePBRMaterial(
     const std::filesystem::path &normalPath,
     const std::filesystem::path &emittancePath, const RGB &immEmittance);
 
+// JP: マテリアルの放射輝度を一様な値に置き換え、光源分布の再計算を要求する。
+//     光源分布は作成時に発光していたマテリアルのジオメトリーにしか無いので、それ以外のマテリアルには使えない。
+//     マテリアルを参照する処理が実行中でないことは呼び出し側が保証する必要がある。
+// EN: Replace the emittance of a material with a uniform value and request recomputing light distributions.
+//     Light distributions exist only for geometries with materials emissive at creation,
+//     so this cannot be used for other materials.
+//     The caller needs to make sure that no work referencing the material is in flight.
+void setMaterialEmittance(CUcontext cuContext, Scene* scene, Material* mat, const RGB &immEmittance);
+
+// JP: aabbが与えられた場合は三角形からのAABBの計算を省略する。
+// EN: Skip computing the AABB from the triangles when aabb is given.
 GeometryInstance* createGeometryInstance(
+    CUcontext cuContext, Scene* scene,
+    const shared::Vertex* vertices, uint32_t numVertices,
+    const shared::Triangle* triangles, uint32_t numTriangles,
+    const Material* mat, optixu::Material optixMat,
+    bool allocateGfxResource, const AABB* aabb = nullptr);
+
+inline GeometryInstance* createGeometryInstance(
     CUcontext cuContext, Scene* scene,
     const std::vector<shared::Vertex> &vertices,
     const std::vector<shared::Triangle> &triangles,
     const Material* mat, optixu::Material optixMat,
-    bool allocateGfxResource);
+    bool allocateGfxResource, const AABB* aabb = nullptr) {
+    return createGeometryInstance(
+        cuContext, scene,
+        vertices.data(), static_cast<uint32_t>(vertices.size()),
+        triangles.data(), static_cast<uint32_t>(triangles.size()),
+        mat, optixMat, allocateGfxResource, aabb);
+}
 
 GeometryInstance* createTFDMGeometryInstance(
     CUcontext cuContext, Scene* scene,
@@ -1354,9 +2859,15 @@ GeometryInstance* createTFDMGeometryInstance(
     const Material* mat, optixu::Material optixMat);
 
 GeometryGroup* createGeometryGroup(
-    Scene* scene,
+    CUcontext cuContext, Scene* scene,
     const std::set<const GeometryInstance*> &geomInsts);
 
+// JP: Assimpによる読み込み結果は"<filePath>.gfxcache"にバイナリキャッシュとして保存され、
+//     ソースファイル、preTransformとmatConvが一致する場合は次回以降それが使われる。
+//     ソースファイルはサイズと更新時刻で照合し、更新時刻のみが異なる場合はハッシュで照合する。
+// EN: The result of loading by Assimp is saved as a binary cache at "<filePath>.gfxcache"
+//     and is used from the next time when the source file, preTransform and matConv match.
+//     The source file is checked by size and modification time, and by hash when only the modification time differs.
 void createTriangleMeshes(
     const std::string &meshName,
     const std::filesystem::path &filePath,
@@ -1390,11 +2901,163 @@ Instance* createInstance(
     const Mesh::GeometryGroupInstance &geomGroupInst,
     const Matrix4x4 &transform);
 
+// JP: 同じジオメトリグループの複数インスタンスをまとめて生成する。
+//     ジオメトリインスタンスのスロットのバッファー(GeometryGroup::geomInstSlots)は全インスタンスで共有する。
+//     インスタンスのスロットが足りない場合はstd::runtime_errorを投げる。
+// EN: Create multiple instances of the same geometry group at once.
+//     All the instances share the buffer of geometry instance slots (GeometryGroup::geomInstSlots).
+//     Throws std::runtime_error when running out of instance slots.
+void createInstances(
+    CUcontext cuContext, Scene* scene,
+    const Mesh::GeometryGroupInstance &geomGroupInst,
+    const Matrix4x4* transforms, uint32_t numInstances,
+    Instance** insts);
+
+
+
+struct MeshGeometryInfo {
+    std::filesystem::path path;
+    float preScale;
+    MaterialConvention matConv;
+};
+
+struct RectangleGeometryInfo {
+    float dimX;
+    float dimZ;
+    RGB emittance;
+    std::filesystem::path emitterTexPath;
+};
+
+struct MeshInstanceInfo {
+    std::string name;
+    Point3D beginPosition;
+    Point3D endPosition;
+    float beginScale;
+    float endScale;
+    Quaternion beginOrientation;
+    Quaternion endOrientation;
+    float frequency;
+    float initTime;
+};
+
+using MeshInfo = std::variant<MeshGeometryInfo, RectangleGeometryInfo>;
+
+struct SceneDescription {
+    std::map<std::string, MeshInfo> meshInfos;
+    std::vector<MeshInstanceInfo> meshInstInfos;
+};
+
+// JP: シーン記述ファイルを読み込んでdescに追加する。1行に1つの命令を持つテキスト形式で、'#'以降はコメント。
+//     相対パスはシーンファイルのディレクトリからの相対パスとして扱う。角度は度。
+//       mesh <name> obj <path> <pre-scale> <trad|simple_pbr>
+//       mesh <name> rectangle <dim-x> <dim-z> [emittance <r> <g> <b>] [emitter-tex <path>]
+//       inst <mesh> [pos <x> <y> <z>] [rpy <roll> <pitch> <yaw>] [scale <s>]
+//                   [end-pos <x> <y> <z>] [end-rpy <roll> <pitch> <yaw>] [end-scale <s>]
+//                   [freq <f>] [time <t>]
+//       inst-grid <mesh> <nx> <ny> <nz> <dx> <dy> <dz> [instの属性] [time-step <dt>]
+//     inst-gridはnx * ny * nz個のインスタンスを(dx, dy, dz)間隔で並べ、i番目の時刻をtime + i * dtとする。
+// EN: Load a scene description file and append it to desc. A text format with one command per line,
+//     and '#' starts a comment. Relative paths are relative to the directory of the scene file. Angles are in degrees.
+//       mesh <name> obj <path> <pre-scale> <trad|simple_pbr>
+//       mesh <name> rectangle <dim-x> <dim-z> [emittance <r> <g> <b>] [emitter-tex <path>]
+//       inst <mesh> [pos <x> <y> <z>] [rpy <roll> <pitch> <yaw>] [scale <s>]
+//                   [end-pos <x> <y> <z>] [end-rpy <roll> <pitch> <yaw>] [end-scale <s>]
+//                   [freq <f>] [time <t>]
+//       inst-grid <mesh> <nx> <ny> <nz> <dx> <dy> <dz> [inst attributes] [time-step <dt>]
+//     inst-grid places nx * ny * nz instances at (dx, dy, dz) intervals with time + i * dt for the i-th one.
+bool loadSceneDescription(const std::filesystem::path &filePath, SceneDescription* desc);
+bool parseSceneDescription(
+    const char* text, size_t textSize, const std::filesystem::path &baseDir,
+    SceneDescription* desc);
+
+// JP: "-name", "-obj", "-rectangle", "-inst"などのシーン用のコマンドラインオプションと
+//     シーン記述ファイルを指定する"-scene <file>"を解釈する。インスタンスの属性は次の"-inst"まで保持される。
+//     "-max-texture-resolution <N>"はsetMaxTextureResolution()を呼ぶ。
+// EN: Interprets command line options for the scene such as "-name", "-obj", "-rectangle" and "-inst",
+//     and "-scene <file>" to specify a scene description file.
+//     Instance attributes are held until the next "-inst".
+//     "-max-texture-resolution <N>" calls setMaxTextureResolution().
+class SceneCommandlineParser {
+    std::string m_name;
+    Point3D m_beginPosition;
+    Point3D m_endPosition;
+    Quaternion m_beginOrientation;
+    Quaternion m_endOrientation;
+    float m_beginScale;
+    float m_endScale;
+    float m_frequency;
+    float m_initTime;
+    RGB m_emittance;
+    std::filesystem::path m_rectEmitterTexPath;
+
+    void resetInstanceAttributes();
+
+public:
+    SceneCommandlineParser() : m_emittance(0.0f, 0.0f, 0.0f) {
+        resetInstanceAttributes();
+    }
+
+    CommandlineParseResult parse(
+        int32_t argc, const char* argv[], int32_t* argIdx, SceneDescription* desc);
+};
+
+// JP: シーン記述のメッシュを生成し、同じメッシュが連続して宣言されたインスタンスをまとめて宣言順に生成する。
+//     scene->map()された状態で呼ぶ。
+// EN: Create meshes of a scene description and create instances in declared order,
+//     batching consecutive declarations of the same mesh. Call this while scene->map() is in effect.
+void instantiateSceneDescription(
+    const SceneDescription &desc,
+    CUcontext cuContext, Scene* scene, optixu::Material optixMat,
+    bool allocateGfxResource = false);
+
+// JP: 環境テクスチャーのGPU上での格納形式。
+//     Float16はFloat32の1/2、BC6Hは1/16のメモリ量になる。値は読み込み時にhalfの範囲にクランプされる。
+// EN: Storage format of an environmental texture on the GPU.
+//     Float16 takes 1/2 and BC6H takes 1/16 memory of Float32. Values are clamped to the half range on load.
+enum class EnvLightTextureFormat {
+    Float32 = 0,
+    Float16,
+    BC6H,
+};
+
+// JP: 既定では重要度マップの長辺を1024以下に抑えて、高解像度のテクスチャーでもメモリ量を小さく保つ。
+// EN: By default, keep the longer side of the importance map 1024 or less
+//     to keep the memory small even for a high-resolution texture.
+constexpr uint32_t defaultEnvImportanceMapResolution = 1024;
+
+// JP: 重要度マップは輝度のピラミッドを長辺がimportanceMapResolution以下になるまで縮小したものから作る
+//     (0の場合はテクスチャーと同じ解像度)。
+//     変換したテクセルと重要度は"<filePath>.<format>.envcache"にキャッシュされ、
+//     ソースファイル、形式と重要度の解像度が一致する場合は次回以降それが使われる(照合方法はcreateTriangleMeshes()と同じ)。
+// EN: The importance map is built from the luminance pyramid downsampled
+//     until the longer side becomes importanceMapResolution or less (the same resolution as the texture for 0).
+//     Converted texels and importance are cached at "<filePath>.<format>.envcache"
+//     and are used from the next time when the source file, the format and the importance resolution match
+//     (checked in the same way as createTriangleMeshes()).
 void loadEnvironmentalTexture(
     const std::filesystem::path &filePath,
     CUcontext cuContext,
     cudau::Array* envLightArray, CUtexObject* envLightTexture,
-    RegularConstantContinuousDistribution2D* envLightImportanceMap);
+    EnvLightImportanceMap* envLightImportanceMap,
+    uint32_t importanceMapResolution = defaultEnvImportanceMapResolution,
+    EnvLightTextureFormat format = EnvLightTextureFormat::Float16);
+
+// JP: 行ごとのCDFと階層的な重要度マップをCPU上で構築して、構築時間、メモリ量、サンプリングとPDF評価の速度、
+//     サンプリングとPDF評価の一貫性、分布の質を比較して表示する。
+//     両者はloadEnvironmentalTexture()と同じく縮小した輝度のピラミッドから作る。
+// EN: Build per-row CDFs and a hierarchical importance map on the CPU, then compare and print
+//     build time, memory, sampling and PDF evaluation throughput,
+//     consistency between sampling and PDF evaluation, and distribution quality.
+//     Both are built from the downsampled luminance pyramid same as loadEnvironmentalTexture().
+int32_t benchmarkEnvironmentalImportanceMaps(
+    const std::filesystem::path &filePath, uint32_t importanceMapResolution, uint32_t numSamples);
+
+// JP: 1K個からmaxNumValues個まで4倍ずつ要素数を変えて、逐次版と並列版のAlias Methodのテーブル構築と
+//     CDFの構築の時間を比較して表示する。並列版の結果が逐次版と完全に一致しない場合は-1を返す。
+// EN: Compare and print build times of the sequential and parallel alias tables and the CDF
+//     while sweeping the number of values by 4x from 1K to maxNumValues.
+//     Returns -1 if the parallel result is not bit-identical to the sequential one.
+int32_t benchmarkDiscreteDistributionBuilds(uint32_t maxNumValues);
 
 
 
@@ -1422,6 +3085,20 @@ struct SDRImageSaverConfig {
         alphaForOverride(-1) {}
 };
 
+// JP: HDR画像をトーンマップ、ガンマ補正してRGBA8のピクセル列に変換する。dstImageはwidth * heightの要素を持つ必要がある。
+// EN: Convert an HDR image into RGBA8 pixels with tone mapping and gamma correction.
+//     dstImage must have width * height elements.
+void convertToSDRImage(
+    uint32_t width, uint32_t height, const float4* data,
+    const SDRImageSaverConfig &config, uint32_t* dstImage);
+
+// JP: width x heightのランダムなHDR画像に対してLUTとSIMD化の前の変換とconvertToSDRImage()の時間を
+//     トーンマップとガンマ補正の組み合わせごとに比較して表示する。差が1 LSBを超える場合は-1を返す。
+// EN: Compare and print times of the conversion before the LUT and SIMD and convertToSDRImage()
+//     for a random width x height HDR image for each combination of tone mapping and gamma correction.
+//     Returns -1 if the difference exceeds 1 LSB.
+int32_t benchmarkSDRConversion(uint32_t width, uint32_t height);
+
 void saveImage(
     const std::filesystem::path &filepath, uint32_t width, uint32_t height, const float4* data,
     const SDRImageSaverConfig &config);
@@ -1454,3 +3131,88 @@ void saveImage(
     saveImage(filepath, width, height, data, config);
     delete[] data;
 }
+
+
+// JP: フレームキャプチャー。テクスチャーを永続マップされたステージングバッファーのリングへ非同期に読み戻し、
+//     フェンスで完了を検出した後、ワーカースレッド群でPNG/EXRに符号化して書き出す。
+//     ワーカーはマップされたメモリーから直接変換するので、読み戻したデータのコピーは発生しない。
+//     capture(), update(), waitAll(), finalize()はGLコンテキストを持つスレッドから呼ぶ必要がある。
+// EN: Frame capturer. Asynchronously reads a texture back into a ring of persistently mapped staging buffers,
+//     detects completion with fences, then encodes and writes PNG/EXR on worker threads.
+//     Workers convert directly from the mapped memory, so no copy of the read back data is made.
+//     capture(), update(), waitAll() and finalize() need to be called from the thread owning the GL context.
+class FrameCapturer {
+public:
+    // JP: 空のパスの形式は書き出さない。
+    // EN: Formats with an empty path are not written.
+    struct Request {
+        std::filesystem::path sdrFilePath;
+        std::filesystem::path hdrFilePath;
+        SDRImageSaverConfig sdrConfig;
+        float hdrBrightnessScale;
+        bool flipY;
+
+        Request() : hdrBrightnessScale(1.0f), flipY(false) {}
+    };
+
+private:
+    enum class SlotState {
+        Free = 0,
+        Readback,
+        Encoding,
+    };
+    struct StagingSlot {
+        GLuint buffer;
+        const float4* mappedData;
+        size_t numAllocatedPixels;
+        GLsync fence;
+        uint32_t width;
+        uint32_t height;
+        Request request;
+        SlotState state;
+    };
+
+    std::vector<StagingSlot> m_slots;
+    uint32_t m_nextSlotIndex;
+    std::vector<std::thread> m_workers;
+    std::mutex m_mutex;
+    std::condition_variable m_workerCv;
+    std::condition_variable m_slotCv;
+    std::vector<uint32_t> m_encodeQueue;
+    bool m_stopRequested;
+
+    void workerMain();
+    void dispatchCompletedReadbacks(bool wait);
+
+public:
+    FrameCapturer() : m_nextSlotIndex(0), m_stopRequested(false) {}
+    ~FrameCapturer() {
+        finalize();
+    }
+
+    // JP: numThreadsが0の場合はハードウェアスレッド数の半分を使う。
+    // EN: Use half the number of hardware threads when numThreads is 0.
+    void initialize(uint32_t numStagingBuffers = 4, uint32_t numThreads = 0);
+    void finalize();
+
+    // JP: テクスチャーのミップレベル0(RGBA float)の読み戻しを発行する。
+    //     空きのステージングバッファーが無い場合は最も古いキャプチャーの完了を待つ。
+    // EN: Issue a readback of mip level 0 (RGBA float) of the texture.
+    //     Waits for the oldest capture to complete when there is no free staging buffer.
+    void capture(GLuint texture, uint32_t width, uint32_t height, const Request &request);
+    // JP: 読み戻しが完了したフレームをワーカーに渡す。毎フレーム呼ぶ。
+    // EN: Hand frames whose readback has completed to the workers. Call this every frame.
+    void update() {
+        dispatchCompletedReadbacks(false);
+    }
+    // JP: 発行済みの全てのキャプチャーの書き出し完了を待つ。
+    // EN: Wait for all issued captures to be written.
+    void waitAll();
+
+    uint32_t getNumPendingFrames();
+
+    // JP: "<prefix>_<6桁のフレーム番号>.<extension>"を返す。
+    // EN: Returns "<prefix>_<6-digit frame number>.<extension>".
+    static std::filesystem::path makeSequenceFilePath(
+        const std::filesystem::path &prefix, uint32_t frameIndex, const char* extension);
+};
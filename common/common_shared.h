@@ -16,6 +16,11 @@
 // Use Walker's alias method with initialization by Vose's algorithm
 //#define USE_WALKER_ALIAS_METHOD
 
+// JP: 環境光の重要度マップに行ごとのCDFの代わりに階層的な重要度マップ(Hierarchical Sample Warping)を使う。
+// EN: Use the hierarchical importance map (hierarchical sample warping)
+//     instead of per-row CDFs for the importance map of the environmental light.
+#define USE_HIERARCHICAL_ENV_IMPORTANCE_MAP
+
 #define PROCESS_DYNAMIC_FUNCTIONS \
     PROCESS_DYNAMIC_FUNCTION(readModifiedNormalFromNormalMap), \
     PROCESS_DYNAMIC_FUNCTION(readModifiedNormalFromNormalMap2ch), \
@@ -226,6 +231,9 @@ namespace shared {
                 if (idx < m_numValues - 1)
                     rCDF = m_CDF[idx + 1];
                 *remapped = (u - lCDF) / (rCDF - lCDF);
+#if !defined(__CUDA_ARCH__)
+                using std::isfinite;
+#endif
                 Assert(isfinite(*remapped), "Remapped value is not a finite value %g.",
                        *remapped);
             }
@@ -324,6 +332,9 @@ namespace shared {
         }
         CUDA_COMMON_FUNCTION RealType evaluatePDF(RealType smp) const {
             Assert(smp >= 0 && smp < 1.0, "\"smp\": %g is out of range [0, 1).", smp);
+#if !defined(__CUDA_ARCH__)
+            using std::min;
+#endif
             int32_t idx = min(m_numValues - 1, static_cast<uint32_t>(smp * m_numValues));
             return m_PDF[idx];
         }
@@ -367,6 +378,160 @@ namespace shared {
 
 
 
+    // JP: 重要度のミップピラミッドを根から2x2ずつ降りてサンプルする階層的な重要度マップ。
+    //     最も細かいレベルはW x H (W, Hは2の冪)の区分定数の分布で、各レベルは下のレベルの2x2の合計を持つ。
+    //     ピラミッドは入力のアスペクト比を保ち、短辺が1になったレベルより上では長辺方向の2つの合計を持つ。
+    //     レベル0は全体の合計で、各レベルの値はレベル0から順に並ぶ。
+    //     各レベルでは左右の列を選んでから上下を選ぶ。
+    //     各レベルの選択確率の積は最も細かいセルの値と全体の合計の比になるので、
+    //     確率密度はサンプルとPDF評価のどちらでもその比から求め、両者を常に一致させる。
+    // EN: Hierarchical importance map sampling by descending the mip pyramid of importance 2x2 at a time from the root.
+    //     The finest level is a W x H (W, H are powers of two) piecewise-constant distribution,
+    //     and each level has the sums of 2x2 of the level below.
+    //     The pyramid keeps the aspect ratio of the input, and levels above the one whose shorter side reaches 1
+    //     have the sums of two along the longer side.
+    //     Level 0 is the total sum, and the values of each level are stored in order from level 0.
+    //     Each level chooses the left or right column, then the upper or lower one.
+    //     The product of selection probabilities at each level equals the ratio of the finest cell value to the total,
+    //     so both sampling and PDF evaluation compute the probability density from that ratio to always match.
+    // Reference: Clarberg et al., "Wavelet Importance Sampling: Efficiently Evaluating Products of Complex Functions"
+    template <typename RealType>
+    class HierarchicalImportanceMapTemplate {
+        const RealType* m_values;
+        const RealType* m_finestValues;
+        uint32_t m_log2Width;
+        uint32_t m_log2Height;
+        uint32_t m_numLevels;
+
+        CUDA_COMMON_FUNCTION CUDA_INLINE RealType evaluateCellPDF(uint32_t x, uint32_t y) const {
+            const uint32_t width = 1 << m_log2Width;
+            const RealType numCells = static_cast<RealType>(width) * static_cast<RealType>(1 << m_log2Height);
+            return m_finestValues[y * width + x] / m_values[0] * numCells;
+        }
+
+    public:
+        HierarchicalImportanceMapTemplate(const RealType* values, uint32_t log2Width, uint32_t log2Height) :
+            m_values(values), m_log2Width(log2Width), m_log2Height(log2Height) {
+            m_numLevels = std::max(log2Width, log2Height) + 1;
+            size_t finestOffset = 0;
+            for (uint32_t level = 0; level < m_numLevels - 1; ++level) {
+                const uint32_t shift = m_numLevels - 1 - level;
+                finestOffset +=
+                    static_cast<size_t>(1) << ((log2Width > shift ? log2Width - shift : 0) +
+                                               (log2Height > shift ? log2Height - shift : 0));
+            }
+            m_finestValues = values + finestOffset;
+        }
+
+        CUDA_COMMON_FUNCTION HierarchicalImportanceMapTemplate() {}
+
+        CUDA_COMMON_FUNCTION void sample(
+            RealType u0, RealType u1, RealType* d0, RealType* d1, RealType* probDensity) const {
+            Assert(u0 >= 0 && u0 < 1, "\"u0\": %g must be in range [0, 1).", u0);
+            Assert(u1 >= 0 && u1 < 1, "\"u1\": %g must be in range [0, 1).", u1);
+#if !defined(__CUDA_ARCH__)
+            using std::fmin;
+            using std::nextafter;
+#endif
+            constexpr RealType oneMinusEpsilon = static_cast<RealType>(0x1.fffffep-1);
+            if (!(m_values[0] > 0)) {
+                *d0 = u0;
+                *d1 = u1;
+                *probDensity = 0;
+                return;
+            }
+
+            uint32_t x = 0;
+            uint32_t y = 0;
+            const RealType* values = m_values + 1;
+            for (uint32_t level = 1; level < m_numLevels; ++level) {
+                // JP: 長辺方向にしか分割されないレベルでは、もう一方の選択を省略する。
+                // EN: Skip the choice in the other direction at a level split only along the longer side.
+                const uint32_t shift = m_numLevels - 1 - level;
+                const bool splitX = m_log2Width > shift;
+                const bool splitY = m_log2Height > shift;
+                const uint32_t res = 1 << (splitX ? m_log2Width - shift : 0);
+                if (splitX)
+                    x *= 2;
+                if (splitY)
+                    y *= 2;
+                const RealType v00 = values[y * res + x];
+                const RealType v10 = splitX ? values[y * res + x + 1] : 0;
+                const RealType v01 = splitY ? values[(y + 1) * res + x] : 0;
+                const RealType v11 = splitX && splitY ? values[(y + 1) * res + x + 1] : 0;
+
+                // JP: 1 - pで反対側の確率を求めると、極端に小さい確率が0になってしまうので、それぞれ直接求める。
+                // EN: Compute the probability of each side directly
+                //     since computing the opposite side by 1 - p makes an extremely small probability zero.
+                RealType upper = v00;
+                RealType lower = v01;
+                if (splitX) {
+                    const RealType sumLeft = v00 + v01;
+                    const RealType sumRight = v10 + v11;
+                    const RealType probLeft = sumLeft / (sumLeft + sumRight);
+                    if (u0 < probLeft) {
+                        u0 /= probLeft;
+                    }
+                    else {
+                        u0 = (u0 - probLeft) / (sumRight / (sumLeft + sumRight));
+                        ++x;
+                        upper = v10;
+                        lower = v11;
+                    }
+                    u0 = fmin(u0, oneMinusEpsilon);
+                }
+
+                if (splitY) {
+                    const RealType probUpper = upper / (upper + lower);
+                    if (u1 < probUpper) {
+                        u1 /= probUpper;
+                    }
+                    else {
+                        u1 = (u1 - probUpper) / (lower / (upper + lower));
+                        ++y;
+                    }
+                    u1 = fmin(u1, oneMinusEpsilon);
+                }
+
+                values += res << (splitY ? m_log2Height - shift : 0);
+            }
+
+            // JP: セル内の位置が丸めによって隣のセルに入らないようにする。
+            // EN: Prevent the position in a cell from getting into the next cell by rounding.
+            const RealType recWidth = static_cast<RealType>(1) / (1 << m_log2Width);
+            const RealType recHeight = static_cast<RealType>(1) / (1 << m_log2Height);
+            *d0 = fmin((x + u0) * recWidth, nextafter((x + 1) * recWidth, static_cast<RealType>(0)));
+            *d1 = fmin((y + u1) * recHeight, nextafter((y + 1) * recHeight, static_cast<RealType>(0)));
+            *probDensity = evaluateCellPDF(x, y);
+        }
+        CUDA_COMMON_FUNCTION RealType evaluatePDF(RealType d0, RealType d1) const {
+            Assert(d0 >= 0 && d0 <= 1, "\"d0\": %g is out of range [0, 1].", d0);
+            Assert(d1 >= 0 && d1 <= 1, "\"d1\": %g is out of range [0, 1].", d1);
+            if (!(m_values[0] > 0))
+                return 0;
+            return evaluateCellPDF(
+                mapPrimarySampleToDiscrete(d0, 1u << m_log2Width),
+                mapPrimarySampleToDiscrete(d1, 1u << m_log2Height));
+        }
+
+        CUDA_COMMON_FUNCTION uint32_t width() const {
+            return 1 << m_log2Width;
+        }
+        CUDA_COMMON_FUNCTION uint32_t height() const {
+            return 1 << m_log2Height;
+        }
+    };
+
+    using HierarchicalImportanceMap = HierarchicalImportanceMapTemplate<float>;
+
+#if defined(USE_HIERARCHICAL_ENV_IMPORTANCE_MAP)
+    using EnvLightImportanceMap = HierarchicalImportanceMap;
+#else
+    using EnvLightImportanceMap = RegularConstantContinuousDistribution2D;
+#endif
+
+
+
     CUDA_COMMON_FUNCTION CUDA_INLINE uint2 computeProbabilityTextureDimentions(uint32_t maxNumElems) {
 #if !defined(__CUDA_ARCH__)
         using std::max;
@@ -514,6 +679,253 @@ namespace shared {
 
 
 
+    // JP: ライトツリーのノード。
+    //     エミッター群のバウンディングボックス、放射方向のコーン(軸, 放射法線の広がりcosThetaO, 放射の広がりcosThetaE)
+    //     とパワーの合計を持つ。子は連続する2つのノードとして格納される。
+    // EN: A node of the light tree.
+    //     This has the bounding box of the emitters, the cone of the emission directions
+    //     (axis, spread of the emitter normals cosThetaO, spread of the emission cosThetaE) and the total power.
+    //     Children are stored as two consecutive nodes.
+    struct LightTreeNode {
+        Point3D minP;
+        Point3D maxP;
+        Normal3D axis;
+        float cosThetaO;
+        float cosThetaE;
+        float power;
+        uint32_t parentIndex;
+        uint32_t isLeaf : 1;
+        uint32_t childOrEmitterIndex : 31;
+
+        CUDA_COMMON_FUNCTION CUDA_INLINE static float cosSubClamped(
+            float sinThetaA, float cosThetaA, float sinThetaB, float cosThetaB) {
+            if (cosThetaA > cosThetaB)
+                return 1.0f;
+            return cosThetaA * cosThetaB + sinThetaA * sinThetaB;
+        }
+
+        CUDA_COMMON_FUNCTION CUDA_INLINE static float sinSubClamped(
+            float sinThetaA, float cosThetaA, float sinThetaB, float cosThetaB) {
+            if (cosThetaA > cosThetaB)
+                return 0.0f;
+            return sinThetaA * cosThetaB - cosThetaA * sinThetaB;
+        }
+
+        // JP: シェーディング点から見たノードの重要度の保守的な見積もり。
+        //     法線がゼロの場合(媒質中の点など)はシェーディング点側の余弦項を無視する。
+        // EN: Conservative estimate of the importance of the node seen from the shading point.
+        //     The cosine term on the shading point side is ignored when the normal is zero (e.g. a point in a medium).
+        // Reference: pbrt-v4 LightBounds::Importance()
+        CUDA_COMMON_FUNCTION CUDA_INLINE float computeImportance(
+            const Point3D &p, const Normal3D &n) const {
+            if (power == 0.0f)
+                return 0.0f;
+
+            Point3D center = 0.5f * (minP + maxP);
+            float d2 = sqDistance(p, center);
+            // JP: ノードの内部やすぐ近くの点で重要度が発散しないようにする。
+            // EN: Avoid the importance diverging at a point inside or very close to the node.
+            d2 = std::fmax(d2, 0.5f * length(maxP - minP));
+            Vector3D wi = normalize(p - center);
+
+            float cosThetaW = dot(axis, wi);
+            float sinThetaW = std::sqrt(std::fmax(1 - pow2(cosThetaW), 0.0f));
+
+            // JP: シェーディング点から見たバウンディングスフィアの広がり。
+            // EN: Spread of the bounding sphere seen from the shading point.
+            float cosThetaB = -1.0f;
+            float radius2 = sqDistance(center, maxP);
+            float dist2ToCenter = sqDistance(p, center);
+            if (dist2ToCenter >= radius2)
+                cosThetaB = std::sqrt(std::fmax(1 - radius2 / dist2ToCenter, 0.0f));
+            float sinThetaB = std::sqrt(std::fmax(1 - pow2(cosThetaB), 0.0f));
+
+            // JP: cos(max(0, thetaW - thetaO - thetaB))を求める。
+            // EN: Compute cos(max(0, thetaW - thetaO - thetaB)).
+            float sinThetaO = std::sqrt(std::fmax(1 - pow2(cosThetaO), 0.0f));
+            float cosThetaX = cosSubClamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+            float sinThetaX = sinSubClamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+            float cosThetaP = cosSubClamped(sinThetaX, cosThetaX, sinThetaB, cosThetaB);
+            if (cosThetaP <= cosThetaE)
+                return 0.0f;
+
+            float importance = power * cosThetaP / d2;
+            if (n.x != 0.0f || n.y != 0.0f || n.z != 0.0f) {
+                float cosThetaI = std::fabs(dot(wi, n));
+                float sinThetaI = std::sqrt(std::fmax(1 - pow2(cosThetaI), 0.0f));
+                importance *= cosSubClamped(sinThetaI, cosThetaI, sinThetaB, cosThetaB);
+            }
+
+            return std::fmax(importance, 0.0f);
+        }
+    };
+
+    struct LightTreeEmitter {
+        uint32_t instSlot;
+        uint32_t geomInstSlot;
+        uint32_t primIndex;
+        // JP: パワーがゼロのエミッターはツリーに含まれず0xFFFFFFFFとなる。
+        // EN: Emitters with zero power are not in the tree and have 0xFFFFFFFF.
+        uint32_t leafNodeIndex;
+    };
+
+    // JP: エミッター三角形上のBVH(ライトツリー)。
+    //     シェーディング点と法線に応じた重要度に従って根から葉へと降りることでエミッターをサンプルする。
+    //     エミッターはインスタンス、ジオメトリーインスタンス、プリミティブの順に並んでおり、
+    //     ヒットしたエミッターの確率の評価のためにインスタンスごとの範囲と
+    //     ジオメトリーインスタンスごとの先頭インデックスを持つ。
+    // EN: BVH over emitter triangles (light tree).
+    //     This samples an emitter by descending from the root to a leaf
+    //     following the importances depending on the shading point and normal.
+    //     Emitters are ordered by instance, geometry instance then primitive,
+    //     and this has the range per instance and the first index per geometry instance
+    //     to evaluate the probability of a hit emitter.
+    class LightTree {
+        const LightTreeNode* m_nodes;
+        const LightTreeEmitter* m_emitters;
+        // JP: インスタンススロットをインデックスとする(ジオメトリーインスタンス範囲の先頭, 数)。
+        // EN: (first of the geometry instance range, count) indexed by instance slot.
+        const uint2* m_instRanges;
+        // JP: (ジオメトリーインスタンススロット, 先頭エミッターインデックス)。
+        // EN: (geometry instance slot, first emitter index).
+        const uint2* m_geomInstEmitterBases;
+        uint32_t m_numNodes;
+        uint32_t m_numEmitters;
+        uint32_t m_numInstRanges;
+
+    public:
+        LightTree(
+            const LightTreeNode* nodes, const LightTreeEmitter* emitters,
+            const uint2* instRanges, const uint2* geomInstEmitterBases,
+            uint32_t numNodes, uint32_t numEmitters, uint32_t numInstRanges) :
+            m_nodes(nodes), m_emitters(emitters),
+            m_instRanges(instRanges), m_geomInstEmitterBases(geomInstEmitterBases),
+            m_numNodes(numNodes), m_numEmitters(numEmitters), m_numInstRanges(numInstRanges) {}
+
+        CUDA_COMMON_FUNCTION LightTree() {}
+
+        CUDA_COMMON_FUNCTION CUDA_INLINE uint32_t sample(
+            const Point3D &shadingPoint, const Normal3D &shadingNormal, float u, float* prob) const {
+            Assert(u >= 0 && u < 1, "\"u\": %g must be in range [0, 1).", u);
+            *prob = 0.0f;
+            if (m_numNodes == 0 || m_nodes[0].computeImportance(shadingPoint, shadingNormal) == 0.0f)
+                return 0xFFFFFFFF;
+
+            uint32_t nodeIdx = 0;
+            float p = 1.0f;
+            while (true) {
+                const LightTreeNode &node = m_nodes[nodeIdx];
+                if (node.isLeaf) {
+                    *prob = p;
+                    return node.childOrEmitterIndex;
+                }
+
+                uint32_t childIdx = node.childOrEmitterIndex;
+                float importance0 = m_nodes[childIdx].computeImportance(shadingPoint, shadingNormal);
+                float importance1 = m_nodes[childIdx + 1].computeImportance(shadingPoint, shadingNormal);
+                if (importance0 == 0.0f && importance1 == 0.0f)
+                    return 0xFFFFFFFF;
+                float prob0 = importance0 / (importance0 + importance1);
+                if (u < prob0) {
+                    nodeIdx = childIdx;
+                    u = std::fmin(u / prob0, 0x1.fffffep-1f);
+                    p *= prob0;
+                }
+                else {
+                    nodeIdx = childIdx + 1;
+                    u = std::fmin((u - prob0) / (1 - prob0), 0x1.fffffep-1f);
+                    p *= 1 - prob0;
+                }
+            }
+        }
+
+        CUDA_COMMON_FUNCTION CUDA_INLINE float evaluatePMF(
+            const Point3D &shadingPoint, const Normal3D &shadingNormal, uint32_t emitterIndex) const {
+            if (emitterIndex >= m_numEmitters)
+                return 0.0f;
+            uint32_t nodeIdx = m_emitters[emitterIndex].leafNodeIndex;
+            if (nodeIdx == 0xFFFFFFFF ||
+                m_nodes[0].computeImportance(shadingPoint, shadingNormal) == 0.0f)
+                return 0.0f;
+
+            float prob = 1.0f;
+            while (nodeIdx != 0) {
+                const LightTreeNode &parent = m_nodes[m_nodes[nodeIdx].parentIndex];
+                uint32_t childIdx = parent.childOrEmitterIndex;
+                float importance0 = m_nodes[childIdx].computeImportance(shadingPoint, shadingNormal);
+                float importance1 = m_nodes[childIdx + 1].computeImportance(shadingPoint, shadingNormal);
+                float importance = nodeIdx == childIdx ? importance0 : importance1;
+                if (importance == 0.0f)
+                    return 0.0f;
+                prob *= importance / (importance0 + importance1);
+                nodeIdx = m_nodes[nodeIdx].parentIndex;
+            }
+            return prob;
+        }
+
+        CUDA_COMMON_FUNCTION CUDA_INLINE const LightTreeEmitter &getEmitter(uint32_t emitterIndex) const {
+            return m_emitters[emitterIndex];
+        }
+
+        CUDA_COMMON_FUNCTION CUDA_INLINE uint32_t findEmitter(
+            uint32_t instSlot, uint32_t geomInstSlot, uint32_t primIndex) const {
+            if (instSlot >= m_numInstRanges)
+                return 0xFFFFFFFF;
+            const uint2 &range = m_instRanges[instSlot];
+            for (uint32_t i = 0; i < range.y; ++i) {
+                const uint2 &base = m_geomInstEmitterBases[range.x + i];
+                if (base.x == geomInstSlot)
+                    return base.y + primIndex;
+            }
+            return 0xFFFFFFFF;
+        }
+
+        CUDA_COMMON_FUNCTION CUDA_INLINE uint32_t numEmitters() const {
+            return m_numEmitters;
+        }
+    };
+
+
+
+    static constexpr uint32_t defaultNumPreSampledLightSubsets = 128;
+    static constexpr uint32_t defaultPreSampledLightSubsetSize = 1024;
+
+    template <typename LightSampleType>
+    struct PreSampledLightTemplate {
+        LightSampleType sample;
+        float areaPDensity;
+    };
+
+    // JP: 事前に光源を複数回サンプリングしたサブセットの集まり。
+    //     各サブセットの先頭は環境光、残りはそれ以外の光源のサンプルになる。
+    //     タイルやセルごとに一つのサブセットからサンプルを取ることで、階層的な分布をたどる回数を減らし、
+    //     メモリアクセスのコヒーレンシーを改善する。
+    // EN: A collection of light subsets each of which samples lights multiple times in advance.
+    //     The head of each subset has environmental light samples and the rest has samples of the other lights.
+    //     Drawing samples from a single subset per tile or per cell reduces traversals of the hierarchical
+    //     distributions and improves memory access coherency.
+    template <typename LightSampleType>
+    struct PreSampledLightPoolTemplate {
+        RWBuffer<PCG32RNG> rngs;
+        RWBuffer<PreSampledLightTemplate<LightSampleType>> lights;
+        uint32_t numSubsets;
+        uint32_t subsetSize;
+
+        CUDA_COMMON_FUNCTION uint32_t getNumLights() const {
+            return numSubsets * subsetSize;
+        }
+
+        CUDA_COMMON_FUNCTION uint32_t sampleSubset(float u) const {
+            return mapPrimarySampleToDiscrete(u, numSubsets);
+        }
+
+        CUDA_COMMON_FUNCTION const PreSampledLightTemplate<LightSampleType>* getSubset(uint32_t subsetIdx) const {
+            return &lights[subsetIdx * subsetSize];
+        }
+    };
+
+
+
     // Reference:
     // Long-Period Hash Functions for Procedural Texturing
     // combined permutation table of the hash function of period 739,024 = lcm(11, 13, 16, 17, 19)
@@ -33,12 +33,19 @@
 #   undef near
 #   undef far
 #   undef RGB
+#else
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#   include <fcntl.h>
+#   include <unistd.h>
 #endif
 
 #include "dds_loader.h"
 
 #include <algorithm>
+#include <cstring>
 #include <fstream>
+#include <utility>
 
 #ifdef _DEBUG
 #   define ENABLE_ASSERT
@@ -229,98 +236,309 @@ namespace dds {
 
 
 
-    uint8_t** load(const char* filepath, int32_t* width, int32_t* height, int32_t* mipCount, size_t** sizes, Format* format) {
-        std::ifstream ifs(filepath, std::ios::in | std::ios::binary);
-        if (!ifs.is_open()) {
-            hpprintf("Not found: %s\n", filepath);
-            return nullptr;
-        }
-
-        ifs.seekg(0, std::ios::end);
-        size_t fileSize = ifs.tellg();
+    static bool isSupportedFormat(Format format) {
+        return (format == Format::BC1_UNorm || format == Format::BC1_UNorm_sRGB ||
+                format == Format::BC2_UNorm || format == Format::BC2_UNorm_sRGB ||
+                format == Format::BC3_UNorm || format == Format::BC3_UNorm_sRGB ||
+                format == Format::BC4_UNorm || format == Format::BC4_SNorm ||
+                format == Format::BC5_UNorm || format == Format::BC5_SNorm ||
+                format == Format::BC6H_UF16 || format == Format::BC6H_SF16 ||
+                format == Format::BC7_UNorm || format == Format::BC7_UNorm_sRGB);
+    }
 
-        ifs.clear();
-        ifs.seekg(0, std::ios::beg);
+    uint32_t getBlockSize(Format format) {
+        if (format == Format::BC1_UNorm || format == Format::BC1_UNorm_sRGB ||
+            format == Format::BC4_UNorm || format == Format::BC4_SNorm)
+            return 8;
+        return 16;
+    }
 
+    // Parses the header(s) at the beginning of the given data and returns the offset to the image data.
+    static bool parseHeader(
+        const uint8_t* data, size_t dataSize, const char* filepath,
+        ImageInfo* info, size_t* headerSize) {
         Header header;
-        ifs.read((char*)&header, sizeof(Header));
+        if (dataSize < sizeof(Header)) {
+            hpprintf("Non dds (dx10) file: %s\n", filepath);
+            return false;
+        }
+        std::memcpy(&header, data, sizeof(Header));
         if (header.m_magic != 0x20534444) {
-            hpprintf("Non dds (dx10) file: %s", filepath);
-            return nullptr;
+            hpprintf("Non dds (dx10) file: %s\n", filepath);
+            return false;
         }
-        *width = header.m_width;
-        *height = header.m_height;
+        info->width = header.m_width;
+        info->height = header.m_height;
 
-        size_t headerSize = sizeof(Header);
+        *headerSize = sizeof(Header);
         if (header.m_fourCC == 0x30315844) {
+            if (dataSize < sizeof(Header) + sizeof(HeaderDX10)) {
+                hpprintf("Truncated dds (dx10) file: %s\n", filepath);
+                return false;
+            }
             HeaderDX10 dx10Header;
-            ifs.read((char*)&dx10Header, sizeof(HeaderDX10));
-            *format = static_cast<Format>(dx10Header.m_format);
-            headerSize += sizeof(HeaderDX10);
+            std::memcpy(&dx10Header, data + sizeof(Header), sizeof(HeaderDX10));
+            info->format = static_cast<Format>(dx10Header.m_format);
+            *headerSize += sizeof(HeaderDX10);
         }
         else {
             const auto makeFourCC = [](uint32_t B0, uint32_t B1, uint32_t B2, uint32_t B3) {
                 return ((B0 << 0) | (B1 << 8) | (B2 << 16) | (B3 << 24));
             };
             if (header.m_fourCC == makeFourCC('D', 'X', 'T', '1'))
-                *format = Format::BC1_UNorm;
+                info->format = Format::BC1_UNorm;
             else if (header.m_fourCC == makeFourCC('D', 'X', 'T', '3'))
-                *format = Format::BC2_UNorm;
+                info->format = Format::BC2_UNorm;
             else if (header.m_fourCC == makeFourCC('D', 'X', 'T', '5'))
-                *format = Format::BC3_UNorm;
+                info->format = Format::BC3_UNorm;
             else if (header.m_fourCC == makeFourCC('B', 'C', '4', 'U'))
-                *format = Format::BC4_UNorm;
+                info->format = Format::BC4_UNorm;
             else if (header.m_fourCC == makeFourCC('B', 'C', '4', 'S'))
-                *format = Format::BC4_SNorm;
+                info->format = Format::BC4_SNorm;
             else if (header.m_fourCC == makeFourCC('B', 'C', '5', 'U') ||
                      header.m_fourCC == makeFourCC('A', 'T', 'I', '2'))
-                *format = Format::BC5_UNorm;
+                info->format = Format::BC5_UNorm;
             else if (header.m_fourCC == makeFourCC('B', 'C', '5', 'S'))
-                *format = Format::BC5_SNorm;
+                info->format = Format::BC5_SNorm;
             else
-                Assert_NotImplemented();
+                info->format = static_cast<Format>(0);
+        }
+
+        if (!isSupportedFormat(info->format)) {
+            hpprintf("No support for non block compressed formats: %s\n", filepath);
+            return false;
+        }
+
+        info->mipCount = 1;
+        if ((header.m_flags & Header::Flags::MipMapCount) != 0)
+            info->mipCount = std::max<int32_t>(header.m_mipmapCount, 1);
+
+        return true;
+    }
+
+    // Computes the layout of each mip level relative to the beginning of the image data.
+    static void computeMipView(
+        const ImageInfo &info, int32_t mipLevel, size_t* offset, MipView* view) {
+        const uint32_t blockSize = getBlockSize(info.format);
+        int32_t mipWidth = info.width;
+        int32_t mipHeight = info.height;
+        size_t accDataSize = 0;
+        for (int i = 0; i <= mipLevel; ++i) {
+            size_t bw = (mipWidth + 3) / 4;
+            size_t bh = (mipHeight + 3) / 4;
+            view->size = bw * bh * blockSize;
+            view->rowPitch = bw * blockSize;
+            view->width = mipWidth;
+            view->height = mipHeight;
+            *offset = accDataSize;
+            accDataSize += view->size;
+
+            mipWidth = std::max<int32_t>(1, mipWidth / 2);
+            mipHeight = std::max<int32_t>(1, mipHeight / 2);
+        }
+    }
+
+    bool queryInfo(const char* filepath, ImageInfo* info) {
+        std::ifstream ifs(filepath, std::ios::in | std::ios::binary);
+        if (!ifs.is_open()) {
+            hpprintf("Not found: %s\n", filepath);
+            return false;
+        }
+
+        uint8_t headers[sizeof(Header) + sizeof(HeaderDX10)];
+        ifs.read(reinterpret_cast<char*>(headers), sizeof(headers));
+        size_t headerSize;
+        return parseHeader(headers, static_cast<size_t>(ifs.gcount()), filepath, info, &headerSize);
+    }
+
+
+
+    MappedImage::MappedImage() :
+        m_data(nullptr), m_fileSize(0),
+        m_fileHandle(nullptr), m_mappingHandle(nullptr),
+        m_info{}, m_firstMipLevel(0), m_numMipLevels(0), m_mipViews(nullptr) {}
+
+    MappedImage::MappedImage(MappedImage &&b) : MappedImage() {
+        *this = std::move(b);
+    }
+
+    MappedImage &MappedImage::operator=(MappedImage &&b) {
+        close();
+        m_data = b.m_data;
+        m_fileSize = b.m_fileSize;
+        m_fileHandle = b.m_fileHandle;
+        m_mappingHandle = b.m_mappingHandle;
+        m_info = b.m_info;
+        m_firstMipLevel = b.m_firstMipLevel;
+        m_numMipLevels = b.m_numMipLevels;
+        m_mipViews = b.m_mipViews;
+        b.m_data = nullptr;
+        b.m_fileSize = 0;
+        b.m_fileHandle = nullptr;
+        b.m_mappingHandle = nullptr;
+        b.m_numMipLevels = 0;
+        b.m_mipViews = nullptr;
+        return *this;
+    }
+
+    bool MappedImage::open(const char* filepath, int32_t firstMipLevel, int32_t numMipLevels) {
+        close();
+
+#if defined(Platform_Windows_MSVC)
+        HANDLE fileHandle = CreateFileA(
+            filepath, GENERIC_READ, FILE_SHARE_READ, nullptr,
+            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (fileHandle == INVALID_HANDLE_VALUE) {
+            hpprintf("Not found: %s\n", filepath);
+            return false;
         }
+        m_fileHandle = fileHandle;
 
-        if (*format != Format::BC1_UNorm && *format != Format::BC1_UNorm_sRGB &&
-            *format != Format::BC2_UNorm && *format != Format::BC2_UNorm_sRGB &&
-            *format != Format::BC3_UNorm && *format != Format::BC3_UNorm_sRGB &&
-            *format != Format::BC4_UNorm && *format != Format::BC4_SNorm &&
-            *format != Format::BC5_UNorm && *format != Format::BC5_SNorm &&
-            *format != Format::BC6H_UF16 && *format != Format::BC6H_SF16 &&
-            *format != Format::BC7_UNorm && *format != Format::BC7_UNorm_sRGB) {
-            hpprintf("No support for non block compressed formats: %s", filepath);
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(fileHandle, &fileSize) || fileSize.QuadPart == 0) {
+            hpprintf("Non dds (dx10) file: %s\n", filepath);
+            close();
+            return false;
+        }
+
+        m_mappingHandle = CreateFileMappingA(fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!m_mappingHandle) {
+            hpprintf("Failed to map: %s\n", filepath);
+            close();
+            return false;
+        }
+
+        m_data = static_cast<const uint8_t*>(MapViewOfFile(m_mappingHandle, FILE_MAP_READ, 0, 0, 0));
+        if (!m_data) {
+            hpprintf("Failed to map: %s\n", filepath);
+            close();
+            return false;
+        }
+        m_fileSize = static_cast<size_t>(fileSize.QuadPart);
+#else
+        int fd = ::open(filepath, O_RDONLY);
+        if (fd < 0) {
+            hpprintf("Not found: %s\n", filepath);
+            return false;
+        }
+
+        struct stat fileStat;
+        if (fstat(fd, &fileStat) != 0 || fileStat.st_size == 0) {
+            hpprintf("Non dds (dx10) file: %s\n", filepath);
+            ::close(fd);
+            return false;
+        }
+
+        void* data = mmap(nullptr, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (data == MAP_FAILED) {
+            hpprintf("Failed to map: %s\n", filepath);
+            return false;
+        }
+        m_data = static_cast<const uint8_t*>(data);
+        m_fileSize = static_cast<size_t>(fileStat.st_size);
+#endif
+
+        size_t headerSize;
+        if (!parseHeader(m_data, m_fileSize, filepath, &m_info, &headerSize)) {
+            close();
+            return false;
+        }
+
+        m_firstMipLevel = std::min(std::max(firstMipLevel, 0), m_info.mipCount - 1);
+        m_numMipLevels = m_info.mipCount - m_firstMipLevel;
+        if (numMipLevels > 0)
+            m_numMipLevels = std::min(m_numMipLevels, numMipLevels);
+
+        // The last selected level determines how much of the file has to be present.
+        size_t lastOffset;
+        MipView lastView;
+        computeMipView(m_info, m_firstMipLevel + m_numMipLevels - 1, &lastOffset, &lastView);
+        if (headerSize + lastOffset + lastView.size > m_fileSize) {
+            hpprintf("Truncated dds (dx10) file: %s\n", filepath);
+            close();
+            return false;
+        }
+
+        const uint8_t* imageData = m_data + headerSize;
+        m_mipViews = new MipView[m_numMipLevels];
+        for (int32_t i = 0; i < m_numMipLevels; ++i) {
+            size_t offset;
+            MipView &view = m_mipViews[i];
+            computeMipView(m_info, m_firstMipLevel + i, &offset, &view);
+            view.data = imageData + offset;
+        }
+
+        return true;
+    }
+
+    void MappedImage::close() {
+#if defined(Platform_Windows_MSVC)
+        if (m_data)
+            UnmapViewOfFile(m_data);
+        if (m_mappingHandle)
+            CloseHandle(m_mappingHandle);
+        if (m_fileHandle)
+            CloseHandle(m_fileHandle);
+#else
+        if (m_data)
+            munmap(const_cast<uint8_t*>(m_data), m_fileSize);
+#endif
+        delete[] m_mipViews;
+        m_data = nullptr;
+        m_fileSize = 0;
+        m_fileHandle = nullptr;
+        m_mappingHandle = nullptr;
+        m_firstMipLevel = 0;
+        m_numMipLevels = 0;
+        m_mipViews = nullptr;
+    }
+
+
+
+    uint8_t** load(const char* filepath, int32_t* width, int32_t* height, int32_t* mipCount, size_t** sizes, Format* format) {
+        std::ifstream ifs(filepath, std::ios::in | std::ios::binary);
+        if (!ifs.is_open()) {
+            hpprintf("Not found: %s\n", filepath);
             return nullptr;
         }
 
-        const size_t dataSize = fileSize - headerSize;
+        ifs.seekg(0, std::ios::end);
+        size_t fileSize = ifs.tellg();
 
-        *mipCount = 1;
-        if ((header.m_flags & Header::Flags::MipMapCount) != 0)
-            *mipCount = header.m_mipmapCount;
+        ifs.clear();
+        ifs.seekg(0, std::ios::beg);
+
+        uint8_t headers[sizeof(Header) + sizeof(HeaderDX10)];
+        ifs.read(reinterpret_cast<char*>(headers), sizeof(headers));
+        ImageInfo info;
+        size_t headerSize;
+        if (!parseHeader(headers, static_cast<size_t>(ifs.gcount()), filepath, &info, &headerSize))
+            return nullptr;
+        *width = info.width;
+        *height = info.height;
+        *mipCount = info.mipCount;
+        *format = info.format;
+
+        ifs.clear();
+        ifs.seekg(headerSize, std::ios::beg);
+
+        const size_t dataSize = fileSize - headerSize;
 
         uint8_t* singleData = new uint8_t[dataSize];
         ifs.read((char*)singleData, dataSize);
 
         uint8_t** data = new uint8_t*[*mipCount];
         *sizes = new size_t[*mipCount];
-        int32_t mipWidth = *width;
-        int32_t mipHeight = *height;
-        uint32_t blockSize = 16;
-        if (*format == Format::BC1_UNorm || *format == Format::BC1_UNorm_sRGB ||
-            *format == Format::BC4_UNorm || *format == Format::BC4_SNorm)
-            blockSize = 8;
         size_t accDataSize = 0;
         for (int i = 0; i < *mipCount; ++i) {
-            int32_t bw = (mipWidth + 3) / 4;
-            int32_t bh = (mipHeight + 3) / 4;
-            size_t mipDataSize = bw * bh * blockSize;
+            size_t offset;
+            MipView view;
+            computeMipView(info, i, &offset, &view);
 
-            data[i] = singleData + accDataSize;
-            (*sizes)[i] = mipDataSize;
-            accDataSize += mipDataSize;
-
-            mipWidth = std::max<int32_t>(1, mipWidth / 2);
-            mipHeight = std::max<int32_t>(1, mipHeight / 2);
+            data[i] = singleData + offset;
+            (*sizes)[i] = view.size;
+            accDataSize += view.size;
         }
         Assert(accDataSize == dataSize, "Data size mismatch.");
 
@@ -331,6 +549,6 @@ namespace dds {
         void* singleData = data[0];
         delete[] sizes;
         delete[] data;
-        delete singleData;
+        delete[] static_cast<uint8_t*>(singleData);
     }
 }
@@ -19,6 +19,7 @@
 #pragma once
 
 #include <cstdint>
+#include <cstddef>
 
 // For DDS image read (block compressed format)
 namespace dds {
@@ -39,6 +40,87 @@ namespace dds {
         BC7_UNorm_sRGB = 99,
     };
 
+    struct ImageInfo {
+        int32_t width;
+        int32_t height;
+        int32_t mipCount;
+        Format format;
+    };
+
+    // Reads only the header(s) of the file.
+    bool queryInfo(const char* filepath, ImageInfo* info);
+
+    // Byte size of a 4x4 block.
+    uint32_t getBlockSize(Format format);
+
+    // View into a memory-mapped mip level.
+    // rowPitch is the byte size of a row of 4x4 blocks.
+    struct MipView {
+        const uint8_t* data;
+        size_t size;
+        size_t rowPitch;
+        int32_t width;
+        int32_t height;
+    };
+
+    // Memory-maps a DDS file and exposes a range of its mip levels without copying.
+    // Views are valid until close() or destruction.
+    class MappedImage {
+        const uint8_t* m_data;
+        size_t m_fileSize;
+        void* m_fileHandle;
+        void* m_mappingHandle;
+        ImageInfo m_info;
+        int32_t m_firstMipLevel;
+        int32_t m_numMipLevels;
+        MipView* m_mipViews;
+
+        MappedImage(const MappedImage &) = delete;
+        MappedImage &operator=(const MappedImage &) = delete;
+
+    public:
+        MappedImage();
+        ~MappedImage() {
+            close();
+        }
+        MappedImage(MappedImage &&b);
+        MappedImage &operator=(MappedImage &&b);
+
+        // Maps the file and selects up to numMipLevels levels starting at firstMipLevel
+        // (0 selects all the remaining levels).
+        // firstMipLevel is clamped so that at least one level is selected.
+        bool open(const char* filepath, int32_t firstMipLevel = 0, int32_t numMipLevels = 0);
+        void close();
+
+        bool isOpen() const {
+            return m_data != nullptr;
+        }
+        // Info of the whole file.
+        const ImageInfo &getInfo() const {
+            return m_info;
+        }
+        Format getFormat() const {
+            return m_info.format;
+        }
+        int32_t getFirstMipLevel() const {
+            return m_firstMipLevel;
+        }
+        int32_t getNumMipLevels() const {
+            return m_numMipLevels;
+        }
+        // Dimensions of the first selected mip level.
+        int32_t getWidth() const {
+            return m_mipViews[0].width;
+        }
+        int32_t getHeight() const {
+            return m_mipViews[0].height;
+        }
+        // Index relative to the first selected mip level.
+        const MipView &getMip(int32_t index) const {
+            return m_mipViews[index];
+        }
+    };
+
     [[nodiscard]]
     uint8_t** load(const char* filepath, int32_t* width, int32_t* height, int32_t* mipCount, size_t** sizes, Format* format);
     void free(uint8_t** data, int32_t mipCount, size_t* sizes);
@@ -19,6 +19,17 @@ CUDA_DEVICE_KERNEL void computeProbabilityTextureFirstMip(
 
 
 
+CUDA_DEVICE_FUNCTION CUDA_INLINE RGB estimateTriangleEmittance(
+    const Vertex (&v)[3], const MaterialData &mat) {
+    // TODO: もっと正確な、少なくとも保守的な推定の実装。テクスチャー空間中の面積に応じてMIPレベルを選択する？
+    RGB emittanceEstimate(0.0f, 0.0f, 0.0f);
+    emittanceEstimate += RGB(getXYZ(tex2DLod<float4>(mat.emittance, v[0].texCoord.x, v[0].texCoord.y, 0)));
+    emittanceEstimate += RGB(getXYZ(tex2DLod<float4>(mat.emittance, v[1].texCoord.x, v[1].texCoord.y, 0)));
+    emittanceEstimate += RGB(getXYZ(tex2DLod<float4>(mat.emittance, v[2].texCoord.x, v[2].texCoord.y, 0)));
+    emittanceEstimate /= 3;
+    return emittanceEstimate;
+}
+
 CUDA_DEVICE_FUNCTION CUDA_INLINE float computeTriangleImportance(
     GeometryInstanceData* geomInst, uint32_t triIndex,
     const MaterialData* materialDataBuffer) {
@@ -33,12 +44,7 @@ CUDA_DEVICE_FUNCTION CUDA_INLINE float computeTriangleImportance(
     Normal3D normal(cross(v[1].position - v[0].position, v[2].position - v[0].position));
     float area = 0.5f * length(normal);
 
-    // TODO: もっと正確な、少なくとも保守的な推定の実装。テクスチャー空間中の面積に応じてMIPレベルを選択する？
-    RGB emittanceEstimate(0.0f, 0.0f, 0.0f);
-    emittanceEstimate += RGB(getXYZ(tex2DLod<float4>(mat.emittance, v[0].texCoord.x, v[0].texCoord.y, 0)));
-    emittanceEstimate += RGB(getXYZ(tex2DLod<float4>(mat.emittance, v[1].texCoord.x, v[1].texCoord.y, 0)));
-    emittanceEstimate += RGB(getXYZ(tex2DLod<float4>(mat.emittance, v[2].texCoord.x, v[2].texCoord.y, 0)));
-    emittanceEstimate /= 3;
+    RGB emittanceEstimate = estimateTriangleEmittance(v, mat);
 
     float importance = sRGB_calcLuminance(emittanceEstimate) * area;
     Assert(isfinite(importance), "imp: %g, area: %g", importance, area);
@@ -81,6 +87,26 @@ CUDA_DEVICE_KERNEL void computeTriangleProbBuffer(
     }
 }
 
+// JP: ホスト側の発光三角形のテーブルのために、三角形ごとの平均放射輝度の推定値を書き出す。
+//     放射輝度テクスチャーはブロック圧縮されていることがあるのでホストではなくここでサンプルする。
+// EN: Write the estimated average emittance of each triangle for the host-side emitter table.
+//     Emittance textures can be block-compressed, so they are sampled here instead of on the host.
+CUDA_DEVICE_KERNEL void computeTriangleEmittances(
+    const GeometryInstanceData* geomInst, uint32_t numTriangles,
+    const MaterialData* materialDataBuffer, RGB* emittances) {
+    uint32_t linearIndex = blockDim.x * blockIdx.x + threadIdx.x;
+    if (linearIndex >= numTriangles)
+        return;
+    const MaterialData &mat = materialDataBuffer[geomInst->materialSlot];
+    const Triangle &tri = geomInst->triangleBuffer[linearIndex];
+    const Vertex (&v)[3] = {
+        geomInst->vertexBuffer[tri.index0],
+        geomInst->vertexBuffer[tri.index1],
+        geomInst->vertexBuffer[tri.index2]
+    };
+    emittances[linearIndex] = estimateTriangleEmittance(v, mat);
+}
+
 
 
 CUDA_DEVICE_FUNCTION CUDA_INLINE float computeGeomInstImportance(
@@ -173,6 +199,34 @@ CUDA_DEVICE_KERNEL void computeInstProbBuffer(
     }
 }
 
+// JP: 変更のあったインスタンスのスロットの重みのみを書き換える。
+// EN: Rewrite only the weights at the slots of changed instances.
+CUDA_DEVICE_KERNEL void updateInstProbTexture(
+    const ProbabilityTexture* lightInstDist, const uint32_t* instSlots, uint32_t numInstsToUpdate,
+    const InstanceData* instanceDataBuffer,
+    optixu::NativeBlockBuffer2D<float> dstMip) {
+    if constexpr (USE_PROBABILITY_TEXTURE) {
+        uint32_t linearIndex = blockDim.x * blockIdx.x + threadIdx.x;
+        if (linearIndex >= numInstsToUpdate)
+            return;
+        uint32_t instSlot = instSlots[linearIndex];
+        uint2 idx2D = lightInstDist->compute2DFrom1D(instSlot);
+        dstMip.write(idx2D, computeInstImportance(instanceDataBuffer, instSlot));
+    }
+}
+
+CUDA_DEVICE_KERNEL void updateInstProbBuffer(
+    DiscreteDistribution1D* lightInstDist, const uint32_t* instSlots, uint32_t numInstsToUpdate,
+    const InstanceData* instanceDataBuffer) {
+    if constexpr (!USE_PROBABILITY_TEXTURE) {
+        uint32_t linearIndex = blockDim.x * blockIdx.x + threadIdx.x;
+        if (linearIndex >= numInstsToUpdate)
+            return;
+        uint32_t instSlot = instSlots[linearIndex];
+        lightInstDist->setWeightAt(instSlot, computeInstImportance(instanceDataBuffer, instSlot));
+    }
+}
+
 
 
 CUDA_DEVICE_KERNEL void computeProbabilityTextureMip(
@@ -203,6 +257,36 @@ CUDA_DEVICE_KERNEL void computeProbabilityTextureMip(
     }
 }
 
+// JP: 最上位のミップレベルで書き換えた要素の祖先のみを再計算する。
+//     複数のスレッドが同じ祖先を計算することがあるが、書き込む値は同じになる。
+// EN: Recompute only the ancestors of the elements rewritten in the finest mip level.
+//     Multiple threads may compute the same ancestor, but they write the same value.
+CUDA_DEVICE_KERNEL void updateProbabilityTextureMip(
+    ProbabilityTexture* probTex, uint32_t dstMipLevel,
+    const uint32_t* indices, uint32_t numIndices,
+    optixu::NativeBlockBuffer2D<float> srcMip,
+    optixu::NativeBlockBuffer2D<float> dstMip) {
+    uint32_t numMipLevels = probTex->calcNumMipLevels();
+    uint32_t linearIndex = blockDim.x * blockIdx.x + threadIdx.x;
+    if (dstMipLevel >= numMipLevels || linearIndex >= numIndices)
+        return;
+
+    uint2 srcDims = probTex->getDimensions() >> (dstMipLevel - 1);
+    uint2 globalIndex = probTex->compute2DFrom1D(indices[linearIndex]) >> dstMipLevel;
+    uint2 ul = 2 * globalIndex;
+    uint2 ur = ul + make_uint2(1, 0);
+    uint2 ll = ul + make_uint2(0, 1);
+    uint2 lr = ll + make_uint2(1, 0);
+    float sum = 0.0f;
+    sum += (ul.x < srcDims.x && ul.y < srcDims.y) ? srcMip.read(ul) : 0.0f;
+    sum += (ur.x < srcDims.x && ur.y < srcDims.y) ? srcMip.read(ur) : 0.0f;
+    sum += (ll.x < srcDims.x && ll.y < srcDims.y) ? srcMip.read(ll) : 0.0f;
+    sum += (lr.x < srcDims.x && lr.y < srcDims.y) ? srcMip.read(lr) : 0.0f;
+    dstMip.write(globalIndex, sum);
+    if (dstMipLevel == numMipLevels - 1)
+        probTex->setIntegral(sum);
+}
+
 CUDA_DEVICE_KERNEL void finalizeDiscreteDistribution1D(
     DiscreteDistribution1D* lightInstDist) {
 #if !defined(USE_WALKER_ALIAS_METHOD)
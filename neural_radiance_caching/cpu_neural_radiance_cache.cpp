@@ -0,0 +1,362 @@
+﻿#include "cpu_neural_radiance_cache.h"
+
+// JP: network_interface.cuのtiny-cuda-nnの設定と同じ値。
+// EN: Same values as the tiny-cuda-nn configuration in network_interface.cu.
+static constexpr uint32_t numPositionDims = 3;
+static constexpr uint32_t numOneBlobDims = 5;
+static constexpr uint32_t numIdentityDims = 6;
+static constexpr uint32_t triangleWaveNumFrequencies = 12;
+static constexpr uint32_t oneBlobNumBins = 4;
+static constexpr uint32_t hashGridNumLevels = 16;
+static constexpr uint32_t hashGridNumFeaturesPerLevel = 2;
+static constexpr uint32_t hashGridLog2HashMapSize = 15;
+static constexpr uint32_t hashGridBaseResolution = 16;
+static constexpr float hashGridPerLevelScale = 2.0f;
+static constexpr float adamBeta1 = 0.9f;
+static constexpr float adamBeta2 = 0.99f;
+static constexpr float adamL2Reg = 1e-6f;
+static constexpr float emaDecay = 0.99f;
+
+static constexpr uint32_t minNumDataPerChunk = 256;
+static constexpr uint32_t minNumParamsPerChunk = 1 << 14;
+
+static_assert(numPositionDims + numOneBlobDims + numIdentityDims == CPUNeuralRadianceCache::numInputDims,
+              "Input dimensions mismatch.");
+
+static float triangleWave(float x) {
+    return 4 * std::fabs(x - std::floor(x) - 0.5f) - 1;
+}
+
+// JP: OneBlobエンコーディングが使う4次カーネルの累積分布関数。
+// EN: Cumulative distribution function of the quartic kernel used by the one-blob encoding.
+static float quarticCdf(float t) {
+    if (t <= -1.0f)
+        return 0.0f;
+    if (t >= 1.0f)
+        return 1.0f;
+    const float t2 = pow2(t);
+    return 15.0f / 16.0f * (t - 2.0f / 3.0f * t2 * t + 0.2f * t2 * t2 * t) + 0.5f;
+}
+
+static float calcLuminance(const float* rgb) {
+    return 0.299f * rgb[0] + 0.587f * rgb[1] + 0.114f * rgb[2];
+}
+
+
+
+// JP: 各レベルで位置を囲む8個の格子点について(レベル, パラメター位置, 補間ウェイト)を列挙する。
+// EN: Enumerate (level, parameter position, interpolation weight) for the 8 lattice points enclosing the position
+//     at each level.
+template <typename Func>
+void CPUNeuralRadianceCache::forEachGridCorner(const float* position, Func &&func) const {
+    for (uint32_t levelIdx = 0; levelIdx < m_gridLevels.size(); ++levelIdx) {
+        const HashGridLevel &level = m_gridLevels[levelIdx];
+        uint32_t gridPos[3];
+        float frac[3];
+        for (uint32_t dim = 0; dim < 3; ++dim) {
+            const float pos = position[dim] * level.scale + 0.5f;
+            const float floorPos = std::floor(pos);
+            gridPos[dim] = static_cast<uint32_t>(static_cast<int32_t>(floorPos));
+            frac[dim] = pos - floorPos;
+        }
+
+        for (uint32_t cornerIdx = 0; cornerIdx < 8; ++cornerIdx) {
+            uint32_t cornerPos[3];
+            float weight = 1.0f;
+            for (uint32_t dim = 0; dim < 3; ++dim) {
+                const uint32_t bit = (cornerIdx >> dim) & 0b1;
+                cornerPos[dim] = gridPos[dim] + bit;
+                weight *= bit ? frac[dim] : 1 - frac[dim];
+            }
+
+            uint32_t entryIdx;
+            if (level.dense)
+                entryIdx = cornerPos[0] + (cornerPos[1] + cornerPos[2] * level.resolution) * level.resolution;
+            else
+                entryIdx = cornerPos[0] ^ (cornerPos[1] * 2654435761u) ^ (cornerPos[2] * 805459861u);
+            entryIdx %= level.tableSize;
+
+            func(levelIdx, level.paramOffset + entryIdx * hashGridNumFeaturesPerLevel, weight);
+        }
+    }
+}
+
+void CPUNeuralRadianceCache::encode(const float* params, const float* input, float* encoded) const {
+    uint32_t dstIdx = 0;
+    if (m_posEnc == PositionEncoding::HashGrid) {
+        std::fill_n(encoded, hashGridNumLevels * hashGridNumFeaturesPerLevel, 0.0f);
+        forEachGridCorner(input, [&](uint32_t levelIdx, uint32_t paramIdx, float weight) {
+            for (uint32_t featIdx = 0; featIdx < hashGridNumFeaturesPerLevel; ++featIdx)
+                encoded[levelIdx * hashGridNumFeaturesPerLevel + featIdx] += weight * params[paramIdx + featIdx];
+        });
+        dstIdx += hashGridNumLevels * hashGridNumFeaturesPerLevel;
+    }
+    else {
+        for (uint32_t dim = 0; dim < numPositionDims; ++dim) {
+            for (uint32_t freqIdx = 0; freqIdx < triangleWaveNumFrequencies; ++freqIdx)
+                encoded[dstIdx++] = triangleWave(std::ldexp(input[dim], freqIdx));
+        }
+    }
+
+    constexpr float binWidth = 1.0f / oneBlobNumBins;
+    for (uint32_t dim = numPositionDims; dim < numPositionDims + numOneBlobDims; ++dim) {
+        for (uint32_t binIdx = 0; binIdx < oneBlobNumBins; ++binIdx) {
+            const float left = binIdx * binWidth;
+            encoded[dstIdx++] =
+                quarticCdf((left + binWidth - input[dim]) / binWidth) -
+                quarticCdf((left - input[dim]) / binWidth);
+        }
+    }
+
+    for (uint32_t dim = numPositionDims + numOneBlobDims; dim < numInputDims; ++dim)
+        encoded[dstIdx++] = input[dim];
+}
+
+// JP: activationsにはエンコード結果と各隠れ層の出力を順に格納する。
+// EN: activations stores the encoded input and the outputs of the hidden layers in order.
+void CPUNeuralRadianceCache::forward(
+    const float* params, const float* input, float* activations, float* output) const {
+    encode(params, input, activations);
+    const float* x = activations;
+    float* y = activations + m_numEncodedDims;
+    for (uint32_t layerIdx = 0; layerIdx <= m_numHiddenLayers; ++layerIdx) {
+        const uint32_t numInDims = getLayerInputDims(layerIdx);
+        const uint32_t numOutDims = getLayerOutputDims(layerIdx);
+        const float* weights = params + m_layerOffsets[layerIdx];
+        const bool isOutputLayer = layerIdx == m_numHiddenLayers;
+        float* dst = isOutputLayer ? output : y;
+        for (uint32_t outIdx = 0; outIdx < numOutDims; ++outIdx) {
+            const float* row = weights + outIdx * numInDims;
+            float sum = 0.0f;
+            for (uint32_t inIdx = 0; inIdx < numInDims; ++inIdx)
+                sum += row[inIdx] * x[inIdx];
+            dst[outIdx] = isOutputLayer ? sum : std::fmax(sum, 0.0f);
+        }
+        x = y;
+        y += numNeurons;
+    }
+}
+
+
+
+void CPUNeuralRadianceCache::initialize(PositionEncoding posEnc, uint32_t numHiddenLayers, float learningRate) {
+    Assert(numHiddenLayers >= 1, "At least one hidden layer is required.");
+    m_posEnc = posEnc;
+    m_numHiddenLayers = numHiddenLayers;
+    m_learningRate = learningRate;
+    m_adamEpsilon = posEnc == PositionEncoding::TriangleWave ? 1e-8f : 1e-15f;
+
+    m_gridLevels.clear();
+    m_numEncodingParams = 0;
+    if (posEnc == PositionEncoding::HashGrid) {
+        constexpr uint32_t hashMapSize = 1 << hashGridLog2HashMapSize;
+        for (uint32_t levelIdx = 0; levelIdx < hashGridNumLevels; ++levelIdx) {
+            HashGridLevel level;
+            level.scale = hashGridBaseResolution * std::pow(hashGridPerLevelScale, static_cast<float>(levelIdx)) - 1;
+            level.resolution = static_cast<uint32_t>(std::ceil(level.scale)) + 1;
+            const uint64_t numDenseEntries = static_cast<uint64_t>(level.resolution) * level.resolution * level.resolution;
+            level.dense = numDenseEntries <= hashMapSize;
+            level.tableSize = level.dense ? static_cast<uint32_t>((numDenseEntries + 7) / 8 * 8) : hashMapSize;
+            level.paramOffset = m_numEncodingParams;
+            m_numEncodingParams += level.tableSize * hashGridNumFeaturesPerLevel;
+            m_gridLevels.push_back(level);
+        }
+        m_numEncodedDims = hashGridNumLevels * hashGridNumFeaturesPerLevel;
+    }
+    else {
+        m_numEncodedDims = numPositionDims * triangleWaveNumFrequencies;
+    }
+    m_numEncodedDims += numOneBlobDims * oneBlobNumBins + numIdentityDims;
+
+    uint32_t numParams = m_numEncodingParams;
+    m_layerOffsets.resize(numHiddenLayers + 1);
+    for (uint32_t layerIdx = 0; layerIdx <= numHiddenLayers; ++layerIdx) {
+        m_layerOffsets[layerIdx] = numParams;
+        numParams += getLayerInputDims(layerIdx) * getLayerOutputDims(layerIdx);
+    }
+
+    // JP: tiny-cuda-nnと同じくハッシュグリッドは小さな一様乱数、重みはXavierの一様分布で初期化する。
+    // EN: Initialize the hash grid with small uniform random numbers and the weights with Xavier uniform
+    //     distribution same as tiny-cuda-nn.
+    m_params.resize(numParams);
+    std::mt19937 rng(1337);
+    {
+        std::uniform_real_distribution<float> u(-1e-4f, 1e-4f);
+        for (uint32_t i = 0; i < m_numEncodingParams; ++i)
+            m_params[i] = u(rng);
+    }
+    for (uint32_t layerIdx = 0; layerIdx <= numHiddenLayers; ++layerIdx) {
+        const uint32_t numInDims = getLayerInputDims(layerIdx);
+        const uint32_t numOutDims = getLayerOutputDims(layerIdx);
+        const float range = std::sqrt(6.0f / (numInDims + numOutDims));
+        std::uniform_real_distribution<float> u(-range, range);
+        for (uint32_t i = 0; i < numInDims * numOutDims; ++i)
+            m_params[m_layerOffsets[layerIdx] + i] = u(rng);
+    }
+
+    m_adamFirstMoments.assign(numParams, 0.0f);
+    m_adamSecondMoments.assign(numParams, 0.0f);
+    m_emaParams.assign(numParams, 0.0f);
+    m_inferenceParams = m_params;
+    m_step = 0;
+}
+
+void CPUNeuralRadianceCache::finalize() {
+    m_chunkLosses.clear();
+    m_chunkGradients.clear();
+    m_inferenceParams.clear();
+    m_emaParams.clear();
+    m_adamSecondMoments.clear();
+    m_adamFirstMoments.clear();
+    m_params.clear();
+    m_layerOffsets.clear();
+    m_gridLevels.clear();
+}
+
+void CPUNeuralRadianceCache::infer(const float* inputData, uint32_t numData, float* predictionData) const {
+    parallelForChunks(
+        0, numData, minNumDataPerChunk,
+        [&](uint32_t chunkIdx, uint32_t dataBegin, uint32_t dataEnd) {
+        std::vector<float> activations(m_numEncodedDims + numNeurons * m_numHiddenLayers);
+        for (uint32_t dataIdx = dataBegin; dataIdx < dataEnd; ++dataIdx) {
+            forward(
+                m_inferenceParams.data(), inputData + numInputDims * dataIdx,
+                activations.data(), predictionData + numOutputDims * dataIdx);
+        }
+    });
+}
+
+void CPUNeuralRadianceCache::train(
+    const float* inputData, const float* targetData, uint32_t numData, float* loss) {
+    Assert(!m_params.empty(), "The network is not initialized.");
+    const uint32_t numParams = getNumParameters();
+    const uint32_t numChunks = computeNumParallelChunks(numData, minNumDataPerChunk);
+    if (m_chunkGradients.size() < numChunks)
+        m_chunkGradients.resize(numChunks);
+    m_chunkLosses.resize(numChunks);
+
+    // JP: チャンクごとに勾配を累積し、後でチャンク順に足し合わせる。結果はスレッド数にのみ依存する。
+    // EN: Accumulate gradients per chunk, then sum them up in the chunk order later.
+    //     The result depends only on the number of threads.
+    const float lossScale = 1.0f / (numData * numOutputDims);
+    parallelForChunks(
+        0, numData, minNumDataPerChunk,
+        [&](uint32_t chunkIdx, uint32_t dataBegin, uint32_t dataEnd) {
+        std::vector<float> &gradients = m_chunkGradients[chunkIdx];
+        gradients.assign(numParams, 0.0f);
+        std::vector<float> activations(m_numEncodedDims + numNeurons * m_numHiddenLayers);
+        std::vector<float> delta(std::max(m_numEncodedDims, numNeurons));
+        std::vector<float> prevDelta(std::max(m_numEncodedDims, numNeurons));
+        double sumLosses = 0.0;
+        for (uint32_t dataIdx = dataBegin; dataIdx < dataEnd; ++dataIdx) {
+            const float* input = inputData + numInputDims * dataIdx;
+            const float* target = targetData + numOutputDims * dataIdx;
+            float output[numOutputDims];
+            forward(m_params.data(), input, activations.data(), output);
+
+            // JP: RelativeL2Luminanceの分母は定数として扱う。
+            // EN: Treat the denominator of RelativeL2Luminance as a constant.
+            const float denom = pow2(calcLuminance(output)) + 0.01f;
+            for (uint32_t outIdx = 0; outIdx < numOutputDims; ++outIdx) {
+                const float diff = output[outIdx] - target[outIdx];
+                sumLosses += pow2(diff) / denom;
+                delta[outIdx] = 2 * diff / denom * lossScale;
+            }
+
+            for (int32_t layerIdx = m_numHiddenLayers; layerIdx >= 0; --layerIdx) {
+                const uint32_t numInDims = getLayerInputDims(layerIdx);
+                const uint32_t numOutDims = getLayerOutputDims(layerIdx);
+                const float* weights = m_params.data() + m_layerOffsets[layerIdx];
+                float* weightGrads = gradients.data() + m_layerOffsets[layerIdx];
+                const float* x = layerIdx == 0 ?
+                    activations.data() :
+                    activations.data() + m_numEncodedDims + numNeurons * (layerIdx - 1);
+                for (uint32_t outIdx = 0; outIdx < numOutDims; ++outIdx) {
+                    if (delta[outIdx] == 0.0f)
+                        continue;
+                    float* rowGrads = weightGrads + outIdx * numInDims;
+                    for (uint32_t inIdx = 0; inIdx < numInDims; ++inIdx)
+                        rowGrads[inIdx] += delta[outIdx] * x[inIdx];
+                }
+
+                if (layerIdx == 0 && m_posEnc != PositionEncoding::HashGrid)
+                    break;
+
+                // JP: 入力側に誤差を逆伝播する。隠れ層ではReLUの微分を掛ける。
+                // EN: Backpropagate the error to the input side. Multiply the derivative of ReLU for hidden layers.
+                const uint32_t numPropagatedDims = layerIdx == 0 ?
+                    hashGridNumLevels * hashGridNumFeaturesPerLevel : numInDims;
+                for (uint32_t inIdx = 0; inIdx < numPropagatedDims; ++inIdx) {
+                    float sum = 0.0f;
+                    for (uint32_t outIdx = 0; outIdx < numOutDims; ++outIdx)
+                        sum += weights[outIdx * numInDims + inIdx] * delta[outIdx];
+                    prevDelta[inIdx] = (layerIdx == 0 || x[inIdx] > 0.0f) ? sum : 0.0f;
+                }
+                std::swap(delta, prevDelta);
+            }
+
+            if (m_posEnc == PositionEncoding::HashGrid) {
+                forEachGridCorner(input, [&](uint32_t levelIdx, uint32_t paramIdx, float weight) {
+                    for (uint32_t featIdx = 0; featIdx < hashGridNumFeaturesPerLevel; ++featIdx)
+                        gradients[paramIdx + featIdx] += weight * delta[levelIdx * hashGridNumFeaturesPerLevel + featIdx];
+                });
+            }
+        }
+        m_chunkLosses[chunkIdx] = sumLosses;
+    });
+
+    // JP: Adamで更新し、推論にはtiny-cuda-nnのEMAオプティマイザーと同じくバイアス補正した指数移動平均を使う。
+    //     Instant NGPと同様に勾配がちょうど0のハッシュグリッドのエントリーはAdamの更新をスキップする。
+    // EN: Update with Adam and use the bias-corrected exponential moving average for inference
+    //     same as tiny-cuda-nn's EMA optimizer.
+    //     Skip Adam updates for hash grid entries whose gradient is exactly 0 as in Instant NGP.
+    ++m_step;
+    const float beta1Correction = 1 - std::pow(adamBeta1, static_cast<float>(m_step));
+    const float beta2Correction = 1 - std::pow(adamBeta2, static_cast<float>(m_step));
+    const float emaCorrection = 1 - std::pow(emaDecay, static_cast<float>(m_step));
+    parallelForChunks(
+        0, numParams, minNumParamsPerChunk,
+        [&](uint32_t chunkIdx, uint32_t paramBegin, uint32_t paramEnd) {
+        for (uint32_t paramIdx = paramBegin; paramIdx < paramEnd; ++paramIdx) {
+            float gradient = 0.0f;
+            for (uint32_t i = 0; i < numChunks; ++i)
+                gradient += m_chunkGradients[i][paramIdx];
+
+            float &param = m_params[paramIdx];
+            if (paramIdx >= m_numEncodingParams || gradient != 0.0f) {
+                gradient += adamL2Reg * param;
+                float &m = m_adamFirstMoments[paramIdx];
+                float &v = m_adamSecondMoments[paramIdx];
+                m = adamBeta1 * m + (1 - adamBeta1) * gradient;
+                v = adamBeta2 * v + (1 - adamBeta2) * pow2(gradient);
+                param -= m_learningRate * (m / beta1Correction) / (std::sqrt(v / beta2Correction) + m_adamEpsilon);
+            }
+
+            float &emaParam = m_emaParams[paramIdx];
+            emaParam = emaDecay * emaParam + (1 - emaDecay) * param;
+            m_inferenceParams[paramIdx] = emaParam / emaCorrection;
+        }
+    });
+
+    if (loss) {
+        double sumLosses = 0.0;
+        for (uint32_t i = 0; i < numChunks; ++i)
+            sumLosses += m_chunkLosses[i];
+        *loss = static_cast<float>(sumLosses / (static_cast<double>(numData) * numOutputDims));
+    }
+}
+
+
+
+float computeRelativeL2LuminanceLoss(const float* predictions, const float* targets, uint32_t numData) {
+    constexpr uint32_t numOutputDims = CPUNeuralRadianceCache::numOutputDims;
+    double sumLosses = 0.0;
+    for (uint32_t dataIdx = 0; dataIdx < numData; ++dataIdx) {
+        const float* prediction = predictions + numOutputDims * dataIdx;
+        const float* target = targets + numOutputDims * dataIdx;
+        const float denom = pow2(calcLuminance(prediction)) + 0.01f;
+        for (uint32_t outIdx = 0; outIdx < numOutputDims; ++outIdx)
+            sumLosses += pow2(prediction[outIdx] - target[outIdx]) / denom;
+    }
+    return numData > 0 ? static_cast<float>(sumLosses / (static_cast<double>(numData) * numOutputDims)) : 0.0f;
+}
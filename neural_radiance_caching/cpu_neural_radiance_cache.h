@@ -0,0 +1,78 @@
+﻿#pragma once
+
+#include "network_interface.h"
+#include "../common/common_host.h"
+
+// JP: GPUの無い環境のためのNeuralRadianceCacheのCPU実装。
+//     network_interface.cuと同じ14入力/3出力のレイアウト、エンコーディング、MLP、損失関数、オプティマイザーの構成を
+//     float32で評価する。tiny-cuda-nnの半精度演算や内部の乱数とは一致しないので、結果は統計的にのみ比較できる。
+// EN: CPU implementation of NeuralRadianceCache for machines without a GPU.
+//     This evaluates the same 14-in/3-out layout, encodings, MLP, loss and optimizer configuration as
+//     network_interface.cu in float32. It doesn't match tiny-cuda-nn's half precision arithmetic and internal RNG,
+//     so results can only be compared statistically.
+class CPUNeuralRadianceCache {
+public:
+    static constexpr uint32_t numInputDims = 14;
+    static constexpr uint32_t numOutputDims = 3;
+    static constexpr uint32_t numNeurons = 64;
+
+private:
+    struct HashGridLevel {
+        float scale;
+        uint32_t resolution;
+        uint32_t tableSize;
+        uint32_t paramOffset;
+        bool dense;
+    };
+
+    // JP: パラメター配列はハッシュグリッド(使う場合)の後にMLPの各層の重み行列(行優先)が続く。
+    // EN: The parameter array has the hash grid (if used) followed by the weight matrices (row-major) of MLP layers.
+    PositionEncoding m_posEnc;
+    uint32_t m_numHiddenLayers;
+    float m_learningRate;
+    float m_adamEpsilon;
+    uint32_t m_numEncodedDims;
+    uint32_t m_numEncodingParams;
+    std::vector<HashGridLevel> m_gridLevels;
+    std::vector<uint32_t> m_layerOffsets;
+    std::vector<float> m_params;
+    std::vector<float> m_adamFirstMoments;
+    std::vector<float> m_adamSecondMoments;
+    std::vector<float> m_emaParams;
+    std::vector<float> m_inferenceParams;
+    std::vector<std::vector<float>> m_chunkGradients;
+    std::vector<double> m_chunkLosses;
+    uint32_t m_step;
+
+    uint32_t getLayerInputDims(uint32_t layerIdx) const {
+        return layerIdx == 0 ? m_numEncodedDims : numNeurons;
+    }
+    uint32_t getLayerOutputDims(uint32_t layerIdx) const {
+        return layerIdx == m_numHiddenLayers ? numOutputDims : numNeurons;
+    }
+
+    template <typename Func>
+    void forEachGridCorner(const float* position, Func &&func) const;
+    void encode(const float* params, const float* input, float* encoded) const;
+    void forward(const float* params, const float* input, float* activations, float* output) const;
+
+public:
+    CPUNeuralRadianceCache() :
+        m_posEnc(PositionEncoding::HashGrid), m_numHiddenLayers(0), m_learningRate(0.0f), m_adamEpsilon(0.0f),
+        m_numEncodedDims(0), m_numEncodingParams(0), m_step(0) {}
+
+    void initialize(PositionEncoding posEnc, uint32_t numHiddenLayers, float learningRate);
+    void finalize();
+
+    void infer(const float* inputData, uint32_t numData, float* predictionData) const;
+    void train(const float* inputData, const float* targetData, uint32_t numData,
+               float* loss = nullptr);
+
+    uint32_t getNumParameters() const {
+        return static_cast<uint32_t>(m_params.size());
+    }
+};
+
+// JP: tiny-cuda-nnのRelativeL2Luminanceと同じ損失の平均値を求める。
+// EN: Compute the mean of the same loss as tiny-cuda-nn's RelativeL2Luminance.
+float computeRelativeL2LuminanceLoss(const float* predictions, const float* targets, uint32_t numData);
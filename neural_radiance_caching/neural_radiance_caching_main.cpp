@@ -69,6 +69,8 @@ EN: This program is an example implementation of Neural Radiance Caching (NRC) [
 #include "neural_radiance_caching_shared.h"
 #include "../common/common_host.h"
 #include "network_interface.h"
+#include "cpu_neural_radiance_cache.h"
+#include "training_batch_stream.h"
 
 // Include glfw3.h after our OpenGL definitions
 #include "../utils/gl_util.h"
@@ -449,55 +451,29 @@ static Quaternion g_cameraOrientation;
 static Quaternion g_tempCameraOrientation;
 static Point3D g_cameraPosition;
 static std::filesystem::path g_envLightTexturePath;
+static BenchmarkConfig g_benchmarkConfig;
 
 static PositionEncoding g_positionEncoding = PositionEncoding::HashGrid;
 static uint32_t g_numHiddenLayers = 2;
 static float g_learningRate = 1e-2f;
 
-struct MeshGeometryInfo {
-    std::filesystem::path path;
-    float preScale;
-    MaterialConvention matConv;
+enum class TrainingReplayBackend {
+    GPU = 0,
+    CPU,
 };
 
-struct RectangleGeometryInfo {
-    float dimX;
-    float dimZ;
-    RGB emittance;
-    std::filesystem::path emitterTexPath;
-};
-
-struct MeshInstanceInfo {
-    std::string name;
-    Point3D beginPosition;
-    Point3D endPosition;
-    float beginScale;
-    float endScale;
-    Quaternion beginOrientation;
-    Quaternion endOrientation;
-    float frequency;
-    float initTime;
-};
+static std::filesystem::path g_trainingRecordPath;
+static std::filesystem::path g_trainingReplayPath;
+static TrainingReplayBackend g_trainingReplayBackend = TrainingReplayBackend::GPU;
+static uint32_t g_trainingReplayBatchSize = shared::numTrainingDataPerFrame / 4;
+static uint32_t g_trainingReplayNumEpochs = 1;
 
-using MeshInfo = std::variant<MeshGeometryInfo, RectangleGeometryInfo>;
-static std::map<std::string, MeshInfo> g_meshInfos;
-static std::vector<MeshInstanceInfo> g_meshInstInfos;
+static SceneDescription g_sceneDesc;
 
 static void parseCommandline(int32_t argc, const char* argv[]) {
-    std::string name;
-
     Quaternion camOrientation = Quaternion();
 
-    Point3D beginPosition(0.0f, 0.0f, 0.0f);
-    Point3D endPosition(NAN, NAN, NAN);
-    Quaternion beginOrientation = Quaternion();
-    Quaternion endOrientation = Quaternion(NAN, NAN, NAN, NAN);
-    float beginScale = 1.0f;
-    float endScale = NAN;
-    float frequency = 5.0f;
-    float initTime = 0.0f;
-    RGB emittance(0.0f, 0.0f, 0.0f);
-    std::filesystem::path rectEmitterTexPath;
+    SceneCommandlineParser sceneParser;
 
     for (int i = 0; i < argc; ++i) {
         const char* arg = argv[i];
@@ -563,201 +539,78 @@ static void parseCommandline(int32_t argc, const char* argv[]) {
             g_envLightTexturePath = argv[i + 1];
             i += 1;
         }
-        else if (strncmp(arg, "-name", 6) == 0) {
-            if (i + 1 >= argc) {
-                hpprintf("Invalid option.\n");
-                exit(EXIT_FAILURE);
-            }
-            name = argv[i + 1];
-            i += 1;
-        }
-        else if (0 == strncmp(arg, "-emittance", 11)) {
-            if (i + 3 >= argc) {
+        else if (CommandlineParseResult result = sceneParser.parse(argc, argv, &i, &g_sceneDesc);
+                 result != CommandlineParseResult::Unhandled) {
+            if (result == CommandlineParseResult::Invalid) {
                 printf("Invalid option.\n");
                 exit(EXIT_FAILURE);
             }
-            emittance = RGB(atof(argv[i + 1]), atof(argv[i + 2]), atof(argv[i + 3]));
-            if (!emittance.allFinite()) {
-                printf("Invalid value.\n");
-                exit(EXIT_FAILURE);
-            }
-            i += 3;
         }
-        else if (0 == strncmp(arg, "-rect-emitter-tex", 18)) {
+        else if (strncmp(arg, "-position-encoding", 19) == 0) {
             if (i + 1 >= argc) {
                 printf("Invalid option.\n");
                 exit(EXIT_FAILURE);
             }
-            rectEmitterTexPath = argv[i + 1];
-            i += 1;
-        }
-        else if (0 == strncmp(arg, "-obj", 5)) {
-            if (i + 3 >= argc) {
-                printf("Invalid option.\n");
-                exit(EXIT_FAILURE);
-            }
-
-            MeshInfo info = MeshGeometryInfo();
-            auto &mesh = std::get<MeshGeometryInfo>(info);
-            mesh.path = std::filesystem::path(argv[i + 1]);
-            mesh.preScale = atof(argv[i + 2]);
-            std::string matConv = argv[i + 3];
-            if (matConv == "trad") {
-                mesh.matConv = MaterialConvention::Traditional;
+            const char* enc = argv[i + 1];
+            if (strncmp(enc, "tri-wave", 8) == 0) {
+                g_positionEncoding = PositionEncoding::TriangleWave;
             }
-            else if (matConv == "simple_pbr") {
-                mesh.matConv = MaterialConvention::SimplePBR;
+            else if (strncmp(enc, "hash-grid", 10) == 0) {
+                g_positionEncoding = PositionEncoding::HashGrid;
             }
             else {
-                printf("Invalid material convention.\n");
-                exit(EXIT_FAILURE);
-            }
-
-            g_meshInfos[name] = info;
-
-            i += 3;
-        }
-        else if (0 == strncmp(arg, "-rectangle", 11)) {
-            if (i + 2 >= argc) {
-                printf("Invalid option.\n");
-                exit(EXIT_FAILURE);
-            }
-
-            MeshInfo info = RectangleGeometryInfo();
-            auto &rect = std::get<RectangleGeometryInfo>(info);
-            rect.dimX = atof(argv[i + 1]);
-            rect.dimZ = atof(argv[i + 2]);
-            rect.emittance = emittance;
-            rect.emitterTexPath = rectEmitterTexPath;
-            g_meshInfos[name] = info;
-
-            emittance = RGB(0.0f, 0.0f, 0.0f);
-            rectEmitterTexPath = "";
-
-            i += 2;
-        }
-        else if (0 == strncmp(arg, "-begin-pos", 11)) {
-            if (i + 3 >= argc) {
-                printf("Invalid option.\n");
-                exit(EXIT_FAILURE);
-            }
-            beginPosition = Point3D(atof(argv[i + 1]), atof(argv[i + 2]), atof(argv[i + 3]));
-            if (!beginPosition.allFinite()) {
-                printf("Invalid value.\n");
-                exit(EXIT_FAILURE);
-            }
-            i += 3;
-        }
-        else if (strncmp(arg, "-begin-roll", 10) == 0 ||
-                 strncmp(arg, "-begin-pitch", 11) == 0 ||
-                 strncmp(arg, "-begin-yaw", 9) == 0) {
-            computeOrientation(arg + 6, &beginOrientation);
-        }
-        else if (0 == strncmp(arg, "-begin-scale", 13)) {
-            if (i + 1 >= argc) {
                 printf("Invalid option.\n");
                 exit(EXIT_FAILURE);
             }
-            beginScale = atof(argv[i + 1]);
-            if (!isfinite(beginScale)) {
-                printf("Invalid value.\n");
-                exit(EXIT_FAILURE);
-            }
             i += 1;
         }
-        else if (0 == strncmp(arg, "-end-pos", 9)) {
-            if (i + 3 >= argc) {
-                printf("Invalid option.\n");
-                exit(EXIT_FAILURE);
-            }
-            endPosition = Point3D(atof(argv[i + 1]), atof(argv[i + 2]), atof(argv[i + 3]));
-            if (!endPosition.allFinite()) {
-                printf("Invalid value.\n");
-                exit(EXIT_FAILURE);
-            }
-            i += 3;
-        }
-        else if (strncmp(arg, "-end-roll", 10) == 0 ||
-                 strncmp(arg, "-end-pitch", 11) == 0 ||
-                 strncmp(arg, "-end-yaw", 9) == 0) {
-            computeOrientation(arg + 4, &endOrientation);
-        }
-        else if (0 == strncmp(arg, "-end-scale", 11)) {
+        else if (0 == strncmp(arg, "-num-hidden-layers", 19)) {
             if (i + 1 >= argc) {
                 printf("Invalid option.\n");
                 exit(EXIT_FAILURE);
             }
-            endScale = atof(argv[i + 1]);
-            if (!isfinite(endScale)) {
-                printf("Invalid value.\n");
-                exit(EXIT_FAILURE);
-            }
+            g_numHiddenLayers = atoi(argv[i + 1]);
             i += 1;
         }
-        else if (0 == strncmp(arg, "-freq", 6)) {
+        else if (0 == strncmp(arg, "-learning-rate", 15)) {
             if (i + 1 >= argc) {
                 printf("Invalid option.\n");
                 exit(EXIT_FAILURE);
             }
-            frequency = atof(argv[i + 1]);
-            if (!isfinite(frequency)) {
+            g_learningRate = atof(argv[i + 1]);
+            if (!isfinite(g_learningRate)) {
                 printf("Invalid value.\n");
                 exit(EXIT_FAILURE);
             }
             i += 1;
         }
-        else if (0 == strncmp(arg, "-time", 6)) {
+        else if (0 == strncmp(arg, "-nrc-record", 12)) {
             if (i + 1 >= argc) {
                 printf("Invalid option.\n");
                 exit(EXIT_FAILURE);
             }
-            initTime = atof(argv[i + 1]);
-            if (!isfinite(initTime)) {
-                printf("Invalid value.\n");
-                exit(EXIT_FAILURE);
-            }
+            g_trainingRecordPath = argv[i + 1];
             i += 1;
         }
-        else if (0 == strncmp(arg, "-inst", 6)) {
+        else if (0 == strncmp(arg, "-nrc-replay", 12)) {
             if (i + 1 >= argc) {
                 printf("Invalid option.\n");
                 exit(EXIT_FAILURE);
             }
-
-            MeshInstanceInfo info;
-            info.name = argv[i + 1];
-            info.beginPosition = beginPosition;
-            info.beginOrientation = beginOrientation;
-            info.beginScale = beginScale;
-            info.endPosition = endPosition.allFinite() ? endPosition : beginPosition;
-            info.endOrientation = endOrientation.allFinite() ? endOrientation : beginOrientation;
-            info.endScale = std::isfinite(endScale) ? endScale : beginScale;
-            info.frequency = frequency;
-            info.initTime = initTime;
-            g_meshInstInfos.push_back(info);
-
-            beginPosition = Point3D(0.0f, 0.0f, 0.0f);
-            endPosition = Point3D(NAN, NAN, NAN);
-            beginOrientation = Quaternion();
-            endOrientation = Quaternion(NAN, NAN, NAN, NAN);
-            beginScale = 1.0f;
-            endScale = NAN;
-            frequency = 5.0f;
-            initTime = 0.0f;
-
+            g_trainingReplayPath = argv[i + 1];
             i += 1;
         }
-        else if (strncmp(arg, "-position-encoding", 19) == 0) {
+        else if (0 == strncmp(arg, "-nrc-replay-backend", 20)) {
             if (i + 1 >= argc) {
                 printf("Invalid option.\n");
                 exit(EXIT_FAILURE);
             }
-            const char* enc = argv[i + 1];
-            if (strncmp(enc, "tri-wave", 8) == 0) {
-                g_positionEncoding = PositionEncoding::TriangleWave;
+            const char* backend = argv[i + 1];
+            if (strncmp(backend, "gpu", 4) == 0) {
+                g_trainingReplayBackend = TrainingReplayBackend::GPU;
             }
-            else if (strncmp(enc, "hash-grid", 10) == 0) {
-                g_positionEncoding = PositionEncoding::HashGrid;
+            else if (strncmp(backend, "cpu", 4) == 0) {
+                g_trainingReplayBackend = TrainingReplayBackend::CPU;
             }
             else {
                 printf("Invalid option.\n");
@@ -765,25 +618,33 @@ static void parseCommandline(int32_t argc, const char* argv[]) {
             }
             i += 1;
         }
-        else if (0 == strncmp(arg, "-num-hidden-layers", 19)) {
+        else if (0 == strncmp(arg, "-nrc-replay-batch-size", 23)) {
             if (i + 1 >= argc) {
                 printf("Invalid option.\n");
                 exit(EXIT_FAILURE);
             }
-            g_numHiddenLayers = atoi(argv[i + 1]);
+            const int32_t batchSize = atoi(argv[i + 1]);
+            if (batchSize <= 0 || batchSize % 256 != 0) {
+                printf("Batch size has to be a positive multiple of 256.\n");
+                exit(EXIT_FAILURE);
+            }
+            g_trainingReplayBatchSize = batchSize;
             i += 1;
         }
-        else if (0 == strncmp(arg, "-learning-rate", 15)) {
+        else if (0 == strncmp(arg, "-nrc-replay-epochs", 19)) {
             if (i + 1 >= argc) {
                 printf("Invalid option.\n");
                 exit(EXIT_FAILURE);
             }
-            g_learningRate = atof(argv[i + 1]);
-            if (!isfinite(g_learningRate)) {
-                printf("Invalid value.\n");
+            g_trainingReplayNumEpochs = std::max(atoi(argv[i + 1]), 1);
+            i += 1;
+        }
+        else if (CommandlineParseResult result = parseBenchmarkOption(argc, argv, &i, &g_benchmarkConfig);
+                 result != CommandlineParseResult::Unhandled) {
+            if (result == CommandlineParseResult::Invalid) {
+                printf("Invalid option.\n");
                 exit(EXIT_FAILURE);
             }
-            i += 1;
         }
         else {
             printf("Unknown option.\n");
@@ -837,11 +698,169 @@ namespace ImGui {
     }
 }
 
+// JP: 記録したトレーニングデータをレンダラー無しで再生してネットワークを訓練する。
+//     各レコードについて訓練前にレコード全体の損失(=未学習のデータに対する誤差)を評価してから
+//     バッチごとに訓練し、損失とスループットを出力する。
+// EN: Replay the recorded training data to train the network without the renderer.
+//     For each record, evaluate the loss over the entire record before training on it
+//     (= error for unseen data), then train per batch and print the loss and throughput.
+static int32_t runTrainingReplay() {
+    TrainingBatchStreamReader reader;
+    if (!reader.open(g_trainingReplayPath)) {
+        hpprintf("Failed to open the training batch stream: %s\n", g_trainingReplayPath.string().c_str());
+        return -1;
+    }
+
+    const bool useGPU = g_trainingReplayBackend == TrainingReplayBackend::GPU;
+    const uint32_t batchSize = g_trainingReplayBatchSize;
+    hpprintf("Training replay: %s, %s backend, %s, %u hidden layers, learning rate: %g, batch size: %u\n",
+             g_trainingReplayPath.string().c_str(), useGPU ? "GPU" : "CPU",
+             g_positionEncoding == PositionEncoding::HashGrid ? "hash grid" : "triangle wave",
+             g_numHiddenLayers, g_learningRate, batchSize);
+
+    CUcontext cuContext = nullptr;
+    CUstream cuStream = nullptr;
+    NeuralRadianceCache neuralRadianceCache;
+    CPUNeuralRadianceCache cpuNeuralRadianceCache;
+    cudau::TypedBuffer<shared::RadianceQuery> queryBuffer;
+    cudau::TypedBuffer<RGB> targetBuffer;
+    cudau::TypedBuffer<RGB> predictionBuffer;
+    if (useGPU) {
+        CUDADRV_CHECK(cuInit(0));
+        CUDADRV_CHECK(cuCtxCreate(&cuContext, 0, 0));
+        CUDADRV_CHECK(cuCtxSetCurrent(cuContext));
+        CUDADRV_CHECK(cuStreamCreate(&cuStream, 0));
+        neuralRadianceCache.initialize(g_positionEncoding, g_numHiddenLayers, g_learningRate);
+    }
+    else {
+        cpuNeuralRadianceCache.initialize(g_positionEncoding, g_numHiddenLayers, g_learningRate);
+        hpprintf("CPU network: %u parameters\n", cpuNeuralRadianceCache.getNumParameters());
+    }
+
+    TrainingBatch batch;
+    std::vector<RGB> predictions;
+    uint64_t totalNumTrainedData = 0;
+    double totalTrainTime = 0.0;
+    float lastLoss = 0.0f;
+    StopWatchHiRes sw;
+    bool succeeded = true;
+    for (uint32_t epochIdx = 0; succeeded && epochIdx < g_trainingReplayNumEpochs; ++epochIdx) {
+        reader.rewind();
+        uint32_t recordIdx = 0;
+        while (true) {
+            const TrainingBatchReadResult readResult = reader.readNext(&batch);
+            if (readResult == TrainingBatchReadResult::EndOfStream)
+                break;
+            if (readResult == TrainingBatchReadResult::InvalidRecord) {
+                hpprintf("Truncated or corrupted record %u in the training batch stream: %s\n",
+                         recordIdx, g_trainingReplayPath.string().c_str());
+                succeeded = false;
+                break;
+            }
+
+            // JP: GPU版のネットワークは128の倍数のデータ数を要求するので端数は使わない。
+            //     (レンダリング中の推論クエリー数の切り上げと同じ粒度。)
+            // EN: The GPU network requires the number of data to be a multiple of 128, so drop the remainder.
+            //     (Same granularity as the rounding of the number of inference queries during rendering.)
+            const uint32_t numEvalData = batch.getNumData() / 128 * 128;
+            const uint32_t numBatches = batch.getNumData() / batchSize;
+            if (numEvalData == 0) {
+                ++recordIdx;
+                continue;
+            }
+            predictions.resize(numEvalData);
+
+            float* queries = reinterpret_cast<float*>(batch.queries.data());
+            float* targets = reinterpret_cast<float*>(batch.targets.data());
+            double trainTime;
+            if (useGPU) {
+                if (!queryBuffer.isInitialized() || queryBuffer.numElements() < batch.getNumData()) {
+                    queryBuffer.finalize();
+                    targetBuffer.finalize();
+                    predictionBuffer.finalize();
+                    queryBuffer.initialize(cuContext, cudau::BufferType::Device, batch.getNumData());
+                    targetBuffer.initialize(cuContext, cudau::BufferType::Device, batch.getNumData());
+                    predictionBuffer.initialize(cuContext, cudau::BufferType::Device, batch.getNumData());
+                }
+                queryBuffer.write(batch.queries.data(), batch.getNumData(), cuStream);
+                targetBuffer.write(batch.targets.data(), batch.getNumData(), cuStream);
+
+                neuralRadianceCache.infer(
+                    cuStream, reinterpret_cast<float*>(queryBuffer.getDevicePointer()), numEvalData,
+                    reinterpret_cast<float*>(predictionBuffer.getDevicePointer()));
+                predictionBuffer.read(predictions.data(), numEvalData, cuStream);
+                CUDADRV_CHECK(cuStreamSynchronize(cuStream));
+
+                sw.start();
+                for (uint32_t batchIdx = 0; batchIdx < numBatches; ++batchIdx) {
+                    neuralRadianceCache.train(
+                        cuStream,
+                        reinterpret_cast<float*>(queryBuffer.getDevicePointerAt(batchIdx * batchSize)),
+                        reinterpret_cast<float*>(targetBuffer.getDevicePointerAt(batchIdx * batchSize)),
+                        batchSize);
+                }
+                CUDADRV_CHECK(cuStreamSynchronize(cuStream));
+                trainTime = sw.getMeasurement(sw.stop(), StopWatchDurationType::Microseconds) * 1e-3;
+            }
+            else {
+                cpuNeuralRadianceCache.infer(queries, numEvalData, reinterpret_cast<float*>(predictions.data()));
+
+                sw.start();
+                for (uint32_t batchIdx = 0; batchIdx < numBatches; ++batchIdx) {
+                    cpuNeuralRadianceCache.train(
+                        queries + CPUNeuralRadianceCache::numInputDims * batchIdx * batchSize,
+                        targets + CPUNeuralRadianceCache::numOutputDims * batchIdx * batchSize,
+                        batchSize);
+                }
+                trainTime = sw.getMeasurement(sw.stop(), StopWatchDurationType::Microseconds) * 1e-3;
+            }
+            const float loss = computeRelativeL2LuminanceLoss(
+                reinterpret_cast<const float*>(predictions.data()), targets, numEvalData);
+
+            const uint32_t numTrainedData = numBatches * batchSize;
+            hpprintf("Epoch %u, Record %4u (Frame %5u): Loss: %.6f, Train: %8.3f [ms], %.3e [samples/s]\n",
+                     epochIdx, recordIdx, batch.frameIndex, loss, trainTime,
+                     trainTime > 0.0 ? numTrainedData / (trainTime * 1e-3) : 0.0);
+            totalNumTrainedData += numTrainedData;
+            totalTrainTime += trainTime;
+            lastLoss = loss;
+            ++recordIdx;
+        }
+    }
+
+    hpprintf("Trained %llu samples in %.3f [ms], %.3e [samples/s], last loss: %.6f\n",
+             totalNumTrainedData, totalTrainTime,
+             totalTrainTime > 0.0 ? totalNumTrainedData / (totalTrainTime * 1e-3) : 0.0, lastLoss);
+
+    if (useGPU) {
+        predictionBuffer.finalize();
+        targetBuffer.finalize();
+        queryBuffer.finalize();
+        neuralRadianceCache.finalize();
+        CUDADRV_CHECK(cuStreamDestroy(cuStream));
+        CUDADRV_CHECK(cuCtxDestroy(cuContext));
+    }
+    else {
+        cpuNeuralRadianceCache.finalize();
+    }
+
+    return succeeded ? 0 : -1;
+}
+
 int32_t main(int32_t argc, const char* argv[]) try {
     const std::filesystem::path exeDir = getExecutableDirectory();
 
     parseCommandline(argc, argv);
 
+    if (!g_trainingReplayPath.empty())
+        return runTrainingReplay();
+
+    CameraPath cameraPath;
+    if (g_benchmarkConfig.headless && !g_benchmarkConfig.cameraPathFile.empty()) {
+        if (!cameraPath.load(g_benchmarkConfig.cameraPathFile))
+            return -1;
+    }
+
     // ----------------------------------------------------------------
     // JP: OpenGL, GLFWの初期化。
     // EN: Initialize OpenGL and GLFW.
@@ -869,6 +888,13 @@ int32_t main(int32_t argc, const char* argv[]) try {
 
     glfwWindowHint(GLFW_SRGB_CAPABLE, GLFW_TRUE);
 
+    // JP: ヘッドレスモードではウインドウを表示しない。
+    //     出力バッファーがGLとのインターオペで作られるためコンテキスト自体は必要。
+    // EN: Don't show the window in the headless mode.
+    //     The context itself is still required since the output buffer is created via GL interop.
+    if (g_benchmarkConfig.headless)
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+
     int32_t renderTargetSizeX = 1920;
     int32_t renderTargetSizeY = 1080;
 
@@ -1041,63 +1067,24 @@ int32_t main(int32_t argc, const char* argv[]) try {
 
     StreamChain<2> streamChain;
     streamChain.initialize(gpuEnv.cuContext);
+
+    FrameCapturer frameCapturer;
+    frameCapturer.initialize();
+
     CUstream stream = streamChain.waitAvailableAndGetCurrentStream();
 
+    AsyncTextureLoader textureLoader;
+    textureLoader.initialize();
+    scene.textureLoader = &textureLoader;
+
     // ----------------------------------------------------------------
     // JP: シーンのセットアップ。
     // EN: Setup a scene.
 
     scene.map();
 
-    for (auto it = g_meshInfos.cbegin(); it != g_meshInfos.cend(); ++it) {
-        const MeshInfo &info = it->second;
-
-        if (std::holds_alternative<MeshGeometryInfo>(info)) {
-            const auto &meshInfo = std::get<MeshGeometryInfo>(info);
-
-            createTriangleMeshes(
-                it->first,
-                meshInfo.path, meshInfo.matConv,
-                scale3D_4x4(meshInfo.preScale),
-                gpuEnv.cuContext, &scene, gpuEnv.optixDefaultMaterial);
-        }
-        else if (std::holds_alternative<RectangleGeometryInfo>(info)) {
-            const auto &rectInfo = std::get<RectangleGeometryInfo>(info);
-
-            createRectangleLight(
-                it->first,
-                rectInfo.dimX, rectInfo.dimZ,
-                RGB(0.01f),
-                rectInfo.emitterTexPath, rectInfo.emittance, Matrix4x4(),
-                gpuEnv.cuContext, &scene, gpuEnv.optixDefaultMaterial);
-        }
-    }
-
-    for (int i = 0; i < g_meshInstInfos.size(); ++i) {
-        const MeshInstanceInfo &info = g_meshInstInfos[i];
-        const Mesh* mesh = scene.meshes.at(info.name);
-        for (int j = 0; j < mesh->groupInsts.size(); ++j) {
-            const Mesh::GeometryGroupInstance &groupInst = mesh->groupInsts[j];
-
-            Matrix4x4 instXfm =
-                Matrix4x4(info.beginScale * info.beginOrientation.toMatrix3x3(), info.beginPosition);
-            Instance* inst = createInstance(gpuEnv.cuContext, &scene, groupInst, instXfm);
-            scene.insts.push_back(inst);
-
-            scene.initialSceneAabb.unify(instXfm * groupInst.transform * groupInst.geomGroup->aabb);
-
-            if (any(info.beginPosition != info.endPosition) ||
-                info.beginOrientation != info.endOrientation ||
-                info.beginScale != info.endScale) {
-                auto controller = new InstanceController(
-                    inst,
-                    info.beginScale, info.beginOrientation, info.beginPosition,
-                    info.endScale, info.endOrientation, info.endPosition,
-                    info.frequency, info.initTime);
-                scene.instControllers.push_back(controller);
-            }
-        }
-    }
+    instantiateSceneDescription(
+        g_sceneDesc, gpuEnv.cuContext, &scene, gpuEnv.optixDefaultMaterial);
 
     Vector3D sceneDim = scene.initialSceneAabb.maxP - scene.initialSceneAabb.minP;
     g_cameraPositionalMovingSpeed = 0.003f * std::max({ sceneDim.x, sceneDim.y, sceneDim.z });
@@ -1117,7 +1104,7 @@ int32_t main(int32_t argc, const char* argv[]) try {
     // EN: Read a environmental texture, then compute a CDF to sample it.
     cudau::Array envLightArray;
     CUtexObject envLightTexture = 0;
-    RegularConstantContinuousDistribution2D envLightImportanceMap;
+    EnvLightImportanceMap envLightImportanceMap;
     if (!g_envLightTexturePath.empty())
         loadEnvironmentalTexture(g_envLightTexturePath, gpuEnv.cuContext,
                                  &envLightArray, &envLightTexture, &envLightImportanceMap);
@@ -1187,6 +1174,18 @@ int32_t main(int32_t argc, const char* argv[]) try {
     NeuralRadianceCache neuralRadianceCache;
     neuralRadianceCache.initialize(g_positionEncoding, g_numHiddenLayers, g_learningRate);
 
+    // JP: シャッフル後のトレーニングデータをオフラインで再生するために記録する。
+    // EN: Record the shuffled training data to replay it offline.
+    const std::filesystem::path trainingRecordPath =
+        g_trainingRecordPath.empty() ? "nrc_training_batches.bin" : g_trainingRecordPath;
+    TrainingBatchStreamWriter trainingBatchWriter;
+    std::vector<shared::RadianceQuery> recordedQueries(shared::numTrainingDataPerFrame);
+    std::vector<RGB> recordedTargets(shared::numTrainingDataPerFrame);
+    if (!g_trainingRecordPath.empty()) {
+        if (!trainingBatchWriter.open(trainingRecordPath))
+            hpprintf("Failed to open the training batch stream: %s\n", trainingRecordPath.string().c_str());
+    }
+
     // END: Initialize NRC training-related buffers.
     // ----------------------------------------------------------------
 
@@ -1590,6 +1589,15 @@ int32_t main(int32_t argc, const char* argv[]) try {
     gpuTimers[0].initialize(gpuEnv.cuContext);
     gpuTimers[1].initialize(gpuEnv.cuContext);
     uint64_t frameIndex = 0;
+    // JP: 各GPUタイマーは2フレーム後に読み出されるので、ヘッドレスモードではフレーム2以降の値を記録する。
+    // EN: Each GPU timer is read back two frames later, so the headless mode records values from frame 2 onward.
+    BenchmarkReport benchmarkReport;
+    const auto reportGPUTime = [&](const char* passName, auto &timer) {
+        float time = timer.report();
+        if (g_benchmarkConfig.headless && frameIndex >= 2)
+            benchmarkReport.record(passName, time);
+        return time;
+    };
     glfwSetWindowUserPointer(window, &frameIndex);
     int32_t requestedSize[2];
     uint32_t numAccumFrames = 0;
@@ -1602,6 +1610,8 @@ int32_t main(int32_t argc, const char* argv[]) try {
 
         if (glfwWindowShouldClose(window))
             break;
+        if (g_benchmarkConfig.headless && frameIndex >= g_benchmarkConfig.numFrames + 2)
+            break;
         glfwPollEvents();
 
         CUstream curCuStream = streamChain.waitAvailableAndGetCurrentStream();
@@ -1677,9 +1687,16 @@ int32_t main(int32_t argc, const char* argv[]) try {
             resized = true;
         }
 
-        ImGui_ImplOpenGL3_NewFrame();
-        ImGui_ImplGlfw_NewFrame();
-        ImGui::NewFrame();
+        // JP: ヘッドレスモードではImGuiのフレームとウインドウの構築を省略する。
+        //     ウインドウ内で初期化を行うサンプルもあるので最初のフレームは構築する。
+        // EN: Skip building ImGui frames and windows in the headless mode.
+        //     Some samples initialize things inside the windows, so the first frame builds them.
+        const bool buildGUI = !g_benchmarkConfig.headless || frameIndex == 0;
+        if (buildGUI) {
+            ImGui_ImplOpenGL3_NewFrame();
+            ImGui_ImplGlfw_NewFrame();
+            ImGui::NewFrame();
+        }
 
 
 
@@ -1762,9 +1779,29 @@ int32_t main(int32_t argc, const char* argv[]) try {
             perFramePlp.camera.orientation = g_tempCameraOrientation.toMatrix3x3();
         }
 
+        // JP: ヘッドレスモードではカメラパスに沿ってカメラを動かす。
+        // EN: Move the camera along the camera path in the headless mode.
+        if (g_benchmarkConfig.headless && !cameraPath.empty()) {
+            cameraPath.evaluateAtFrame(
+                static_cast<uint32_t>(frameIndex), g_benchmarkConfig.numFrames,
+                &g_cameraPosition, &g_cameraOrientation);
+            g_tempCameraOrientation = g_cameraOrientation;
+            cameraIsActuallyMoving = cameraPath.getNumKeyframes() > 1;
+
+            perFramePlp.camera.position = g_cameraPosition;
+            perFramePlp.camera.orientation = g_tempCameraOrientation.toMatrix3x3();
+        }
+
 
 
         bool resetAccumulation = false;
+
+        // JP: 非同期に読み込まれたテクスチャーを反映する。
+        // EN: Apply textures loaded asynchronously.
+        if (textureLoader.hasCompletedRequests()) {
+            streamChain.waitAllWorkDone();
+            resetAccumulation |= textureLoader.processCompletedRequests(gpuEnv.cuContext, curCuStream) > 0;
+        }
         
         // Camera Window
         static shared::BufferToDisplay bufferTypeToDisplay = shared::BufferToDisplay::NoisyBeauty;
@@ -1773,7 +1810,7 @@ int32_t main(int32_t argc, const char* argv[]) try {
         static bool enableEnvLight = true;
         static float log10EnvLightPowerCoeff = 0.0f;
         static float envLightRotation = 0.0f;
-        {
+        if (buildGUI) {
             ImGui::Begin("Camera / Env", nullptr, ImGuiWindowFlags_AlwaysAutoResize);
 
             ImGui::Text("W/A/S/D/R/F: Move, Q/E: Tilt");
@@ -1801,26 +1838,32 @@ int32_t main(int32_t argc, const char* argv[]) try {
             ImGui::SameLine();
             if (ImGui::Button("Both"))
                 saveSS_LDR = saveSS_HDR = true;
-            if (saveSS_LDR || saveSS_HDR) {
-                streamChain.waitAllWorkDone();
-                auto rawImage = new float4[renderTargetSizeX * renderTargetSizeY];
-                glGetTextureSubImage(
-                    outputTexture.getHandle(), 0,
-                    0, 0, 0, renderTargetSizeX, renderTargetSizeY, 1,
-                    GL_RGBA, GL_FLOAT, sizeof(float4) * renderTargetSizeX * renderTargetSizeY, rawImage);
-
-                if (saveSS_LDR) {
-                    SDRImageSaverConfig config;
-                    config.brightnessScale = std::pow(10.0f, brightness);
-                    config.applyToneMap = applyToneMapAndGammaCorrection;
-                    config.apply_sRGB_gammaCorrection = applyToneMapAndGammaCorrection;
-                    saveImage("output.png", renderTargetSizeX, renderTargetSizeY, rawImage,
-                              config);
+            ImGui::SameLine();
+            static bool recordSequence = false;
+            ImGui::Checkbox("Record", &recordSequence);
+            frameCapturer.update();
+            if (saveSS_LDR || saveSS_HDR || recordSequence) {
+                static uint32_t sequenceFrameIndex = 0;
+                FrameCapturer::Request request;
+                request.sdrConfig.brightnessScale = std::pow(10.0f, brightness);
+                request.sdrConfig.applyToneMap = applyToneMapAndGammaCorrection;
+                request.sdrConfig.apply_sRGB_gammaCorrection = applyToneMapAndGammaCorrection;
+                request.hdrBrightnessScale = std::pow(10.0f, brightness);
+                if (recordSequence) {
+                    request.sdrFilePath = FrameCapturer::makeSequenceFilePath(
+                        "capture/frame", sequenceFrameIndex, "png");
+                    request.hdrFilePath = FrameCapturer::makeSequenceFilePath(
+                        "capture/frame", sequenceFrameIndex, "exr");
+                    ++sequenceFrameIndex;
                 }
-                if (saveSS_HDR)
-                    saveImageHDR("output.exr", renderTargetSizeX, renderTargetSizeY,
-                                 std::pow(10.0f, brightness), rawImage);
-                delete[] rawImage;
+                else {
+                    if (saveSS_LDR)
+                        request.sdrFilePath = "output.png";
+                    if (saveSS_HDR)
+                        request.hdrFilePath = "output.exr";
+                }
+                frameCapturer.capture(
+                    outputTexture.getHandle(), renderTargetSizeX, renderTargetSizeY, request);
             }
 
             if (!g_envLightTexturePath.empty()) {
@@ -1855,7 +1898,7 @@ int32_t main(int32_t argc, const char* argv[]) try {
         static bool debugSwitches[] = {
             false, false, false, false, false, false, false, false
         };
-        {
+        if (buildGUI) {
             ImGui::Begin("Debug", nullptr, ImGuiWindowFlags_AlwaysAutoResize);
 
             if (ImGui::Button(animate ? "Stop" : "Play")) {
@@ -1970,6 +2013,24 @@ int32_t main(int32_t argc, const char* argv[]) try {
                         ImGui::SameLine();
                         bool resetNN = ImGui::Button("Reset");
 
+                        bool recordTrainingBatches = trainingBatchWriter.isOpen();
+                        if (ImGui::Checkbox("Record Training Batches", &recordTrainingBatches)) {
+                            if (recordTrainingBatches) {
+                                if (!trainingBatchWriter.open(trainingRecordPath))
+                                    hpprintf("Failed to open the training batch stream: %s\n",
+                                             trainingRecordPath.string().c_str());
+                            }
+                            else {
+                                hpprintf("Recorded %u frames of training data: %s\n",
+                                         trainingBatchWriter.getNumRecords(), trainingRecordPath.string().c_str());
+                                trainingBatchWriter.close();
+                            }
+                        }
+                        if (trainingBatchWriter.isOpen()) {
+                            ImGui::SameLine();
+                            ImGui::Text("%u", trainingBatchWriter.getNumRecords());
+                        }
+
                         ImGui::Text("Radiance Scale (Log10): %.2e", std::pow(10.0f, log10RadianceScale));
                         resetAccumulation |= ImGui::SliderFloat(
                             "##RadianceScale", &log10RadianceScale, -5, 5, "%.3f", ImGuiSliderFlags_AlwaysClamp);
@@ -2083,17 +2144,8 @@ int32_t main(int32_t argc, const char* argv[]) try {
 
         // Stats Window
         {
-            ImGui::Begin("Stats", nullptr, ImGuiWindowFlags_AlwaysAutoResize);
-
-#if !defined(USE_HARD_CODED_BSDF_FUNCTIONS)
-            ImGui::PushTextWrapPos(ImGui::GetCursorPos().x + 300);
-            ImGui::TextColored(
-                ImVec4(1.0f, 0.0f, 0.0f, 1.0f),
-                "BSDF callables are enabled.\n"
-                "USE_HARD_CODED_BSDF_FUNCTIONS is recommended for better performance.");
-            ImGui::PopTextWrapPos();
-#endif
-
+            // JP: 計測値はGUIを構築しないフレームでも記録する。
+            // EN: Record the measurements even in frames not building the GUI.
             static MovingAverageTime cudaFrameTime;
             static MovingAverageTime updateTime;
             static MovingAverageTime computePDFTextureTime;
@@ -2108,40 +2160,53 @@ int32_t main(int32_t argc, const char* argv[]) try {
             static MovingAverageTime visualizeCacheTime;
             static MovingAverageTime denoiseTime;
 
-            cudaFrameTime.append(curGPUTimer.frame.report());
-            updateTime.append(curGPUTimer.update.report());
-            computePDFTextureTime.append(curGPUTimer.computePDFTexture.report());
-            setupGBuffersTime.append(curGPUTimer.setupGBuffers.report());
-            preprocessNRCTime.append(curGPUTimer.preprocessNRC.report());
-            pathTraceTime.append(curGPUTimer.pathTrace.report());
-            inferTime.append(curGPUTimer.infer.report());
-            accumulateInferredRadiancesTime.append(curGPUTimer.accumulateInferredRadiances.report());
-            propagateRadiancesTime.append(curGPUTimer.propagateRadiances.report());
-            shuffleTrainingDataTime.append(curGPUTimer.shuffleTrainingData.report());
-            trainTime.append(curGPUTimer.train.report());
-            visualizeCacheTime.append(curGPUTimer.visualizeCache.report());
-            denoiseTime.append(curGPUTimer.denoise.report());
-
-            //ImGui::SetNextItemWidth(100.0f);
-            ImGui::Text("CUDA/OptiX GPU %.3f [ms]:", cudaFrameTime.getAverage());
-            ImGui::Text("  update: %.3f [ms]", updateTime.getAverage());
-            ImGui::Text("  compute PDF Texture: %.3f [ms]", computePDFTextureTime.getAverage());
-            ImGui::Text("  setup G-buffers: %.3f [ms]", setupGBuffersTime.getAverage());
-            ImGui::Text("  pre-process NRC: %.3f [ms]", preprocessNRCTime.getAverage());
-            ImGui::Text("  pathTrace: %.3f [ms]", pathTraceTime.getAverage());
-            ImGui::Text("  inference: %.3f [ms]", inferTime.getAverage());
-            ImGui::Text("  accum radiance: %.3f [ms]", accumulateInferredRadiancesTime.getAverage());
-            ImGui::Text("  prop radiance: %.3f [ms]", propagateRadiancesTime.getAverage());
-            ImGui::Text("  shuffle train data: %.3f [ms]", shuffleTrainingDataTime.getAverage());
-            ImGui::Text("  training: %.3f [ms]", trainTime.getAverage());
-            if (bufferTypeToDisplay == shared::BufferToDisplay::DirectlyVisualizedPrediction)
-                ImGui::Text("  visualize cache: %.3f [ms]", visualizeCacheTime.getAverage());
-            if (bufferTypeToDisplay == shared::BufferToDisplay::DenoisedBeauty)
-                ImGui::Text("  denoise: %.3f [ms]", denoiseTime.getAverage());
-
-            ImGui::Text("%u [spp]", std::min(numAccumFrames + 1, (1u << log2MaxNumAccums)));
+            cudaFrameTime.append(reportGPUTime("frame", curGPUTimer.frame));
+            updateTime.append(reportGPUTime("update", curGPUTimer.update));
+            computePDFTextureTime.append(reportGPUTime("computePDFTexture", curGPUTimer.computePDFTexture));
+            setupGBuffersTime.append(reportGPUTime("setupGBuffers", curGPUTimer.setupGBuffers));
+            preprocessNRCTime.append(reportGPUTime("preprocessNRC", curGPUTimer.preprocessNRC));
+            pathTraceTime.append(reportGPUTime("pathTrace", curGPUTimer.pathTrace));
+            inferTime.append(reportGPUTime("infer", curGPUTimer.infer));
+            accumulateInferredRadiancesTime.append(reportGPUTime("accumulateInferredRadiances", curGPUTimer.accumulateInferredRadiances));
+            propagateRadiancesTime.append(reportGPUTime("propagateRadiances", curGPUTimer.propagateRadiances));
+            shuffleTrainingDataTime.append(reportGPUTime("shuffleTrainingData", curGPUTimer.shuffleTrainingData));
+            trainTime.append(reportGPUTime("train", curGPUTimer.train));
+            visualizeCacheTime.append(reportGPUTime("visualizeCache", curGPUTimer.visualizeCache));
+            denoiseTime.append(reportGPUTime("denoise", curGPUTimer.denoise));
+
+            if (buildGUI) {
+                ImGui::Begin("Stats", nullptr, ImGuiWindowFlags_AlwaysAutoResize);
 
-            ImGui::End();
+#if !defined(USE_HARD_CODED_BSDF_FUNCTIONS)
+                ImGui::PushTextWrapPos(ImGui::GetCursorPos().x + 300);
+                ImGui::TextColored(
+                    ImVec4(1.0f, 0.0f, 0.0f, 1.0f),
+                    "BSDF callables are enabled.\n"
+                    "USE_HARD_CODED_BSDF_FUNCTIONS is recommended for better performance.");
+                ImGui::PopTextWrapPos();
+#endif
+
+                //ImGui::SetNextItemWidth(100.0f);
+                ImGui::Text("CUDA/OptiX GPU %.3f [ms]:", cudaFrameTime.getAverage());
+                ImGui::Text("  update: %.3f [ms]", updateTime.getAverage());
+                ImGui::Text("  compute PDF Texture: %.3f [ms]", computePDFTextureTime.getAverage());
+                ImGui::Text("  setup G-buffers: %.3f [ms]", setupGBuffersTime.getAverage());
+                ImGui::Text("  pre-process NRC: %.3f [ms]", preprocessNRCTime.getAverage());
+                ImGui::Text("  pathTrace: %.3f [ms]", pathTraceTime.getAverage());
+                ImGui::Text("  inference: %.3f [ms]", inferTime.getAverage());
+                ImGui::Text("  accum radiance: %.3f [ms]", accumulateInferredRadiancesTime.getAverage());
+                ImGui::Text("  prop radiance: %.3f [ms]", propagateRadiancesTime.getAverage());
+                ImGui::Text("  shuffle train data: %.3f [ms]", shuffleTrainingDataTime.getAverage());
+                ImGui::Text("  training: %.3f [ms]", trainTime.getAverage());
+                if (bufferTypeToDisplay == shared::BufferToDisplay::DirectlyVisualizedPrediction)
+                    ImGui::Text("  visualize cache: %.3f [ms]", visualizeCacheTime.getAverage());
+                if (bufferTypeToDisplay == shared::BufferToDisplay::DenoisedBeauty)
+                    ImGui::Text("  denoise: %.3f [ms]", denoiseTime.getAverage());
+
+                ImGui::Text("%u [spp]", std::min(numAccumFrames + 1, (1u << log2MaxNumAccums)));
+
+                ImGui::End();
+            }
         }
 
         applyToneMapAndGammaCorrection =
@@ -2155,20 +2220,8 @@ int32_t main(int32_t argc, const char* argv[]) try {
 
         // JP: 各インスタンスのトランスフォームを更新する。
         // EN: Update the transform of each instance.
-        if (animate || lastFrameWasAnimated) {
-            cudau::TypedBuffer<shared::InstanceData> &curInstDataBuffer = scene.instDataBuffer[bufferIndex];
-            shared::InstanceData* instDataBufferOnHost = curInstDataBuffer.map();
-            for (int i = 0; i < scene.instControllers.size(); ++i) {
-                InstanceController* controller = scene.instControllers[i];
-                Instance* inst = controller->inst;
-                shared::InstanceData &instData = instDataBufferOnHost[inst->instSlot];
-                controller->update(instDataBufferOnHost, animate ? 1.0f / 60.0f : 0.0f);
-                // TODO: まとめて送る。
-                CUDADRV_CHECK(cuMemcpyHtoDAsync(curInstDataBuffer.getCUdeviceptrAt(inst->instSlot),
-                                                &instData, sizeof(instData), curCuStream));
-            }
-            curInstDataBuffer.unmap();
-        }
+        if (animate || lastFrameWasAnimated)
+            scene.updateInstances(curCuStream, bufferIndex, animate ? 1.0f / 60.0f : 0.0f);
 
         // JP: IASのリビルドを行う。
         // EN: Rebuild the IAS.
@@ -2204,6 +2257,10 @@ int32_t main(int32_t argc, const char* argv[]) try {
         // EN: Compute the probability texture for light instances.
         curGPUTimer.computePDFTexture.start(curCuStream);
         {
+            // JP: 放射輝度などに変更があったジオメトリーインスタンスとインスタンスの分布のみを再計算する。
+            // EN: Recompute only the distributions of geometry instances and instances with changes such as emittance.
+            scene.setupLightGeomDistributions(curCuStream);
+
             CUdeviceptr probTexAddr =
                 staticPlpOnDevice + offsetof(shared::StaticPipelineLaunchParameters, lightInstDist);
             scene.setupLightInstDistribution(curCuStream, probTexAddr, bufferIndex);
@@ -2330,6 +2387,20 @@ int32_t main(int32_t argc, const char* argv[]) try {
                     curCuStream, cudau::dim3(shared::numTrainingDataPerFrame));
                 curGPUTimer.shuffleTrainingData.stop(curCuStream);
 
+                if (trainingBatchWriter.isOpen()) {
+                    trainRadianceQueryBuffer[1].read(
+                        recordedQueries.data(), shared::numTrainingDataPerFrame, curCuStream);
+                    trainTargetBuffer[1].read(
+                        recordedTargets.data(), shared::numTrainingDataPerFrame, curCuStream);
+                    CUDADRV_CHECK(cuStreamSynchronize(curCuStream));
+                    if (!trainingBatchWriter.write(
+                        static_cast<uint32_t>(frameIndex),
+                        recordedQueries.data(), recordedTargets.data(), shared::numTrainingDataPerFrame)) {
+                        hpprintf("Failed to write the training batch stream.\n");
+                        trainingBatchWriter.close();
+                    }
+                }
+
                 // JP: トレーニングの実行。
                 // EN: Perform training.
                 curGPUTimer.train.start(curCuStream);
@@ -2459,6 +2530,15 @@ int32_t main(int32_t argc, const char* argv[]) try {
 
         streamChain.swap();
 
+        // JP: ヘッドレスモードでは表示を省略する。
+        // EN: Skip presentation in the headless mode.
+        if (g_benchmarkConfig.headless) {
+            if (buildGUI)
+                ImGui::EndFrame();
+            ++frameIndex;
+            continue;
+        }
+
 
 
         // ----------------------------------------------------------------
@@ -2504,6 +2584,11 @@ int32_t main(int32_t argc, const char* argv[]) try {
     }
 
     streamChain.waitAllWorkDone();
+    if (g_benchmarkConfig.headless) {
+        if (benchmarkReport.writeJSON(
+            g_benchmarkConfig.reportFile, "neural_radiance_caching", renderTargetSizeX, renderTargetSizeY))
+            hpprintf("Benchmark report: %s\n", g_benchmarkConfig.reportFile.string().c_str());
+    }
     gpuTimers[1].finalize();
     gpuTimers[0].finalize();
 
@@ -2535,6 +2620,7 @@ int32_t main(int32_t argc, const char* argv[]) try {
     
     finalizeScreenRelatedBuffers();
 
+    trainingBatchWriter.close();
     neuralRadianceCache.finalize();
     dataShufflerBuffer.finalize();
     trainSuffixTerminalInfoBuffer.finalize();
@@ -2561,8 +2647,13 @@ int32_t main(int32_t argc, const char* argv[]) try {
         cuTexObjectDestroy(envLightTexture);
     envLightArray.finalize();
 
+    scene.textureLoader = nullptr;
+    textureLoader.finalize();
+
     finalizeTextureCaches();
 
+    frameCapturer.finalize();
+
     streamChain.finalize();
 
     scene.finalize();
@@ -237,7 +237,7 @@ namespace shared {
         ROBuffer<MaterialData> materialDataBuffer;
         ROBuffer<GeometryInstanceData> geometryInstanceDataBuffer;
         LightDistribution lightInstDist;
-        RegularConstantContinuousDistribution2D envLightImportanceMap;
+        EnvLightImportanceMap envLightImportanceMap;
         CUtexObject envLightTexture;
 
         AABB* sceneAABB;
@@ -0,0 +1,138 @@
+﻿#include "training_batch_stream.h"
+
+using namespace shared;
+
+static constexpr char trainingBatchStreamMagic[8] = { 'G', 'F', 'X', 'N', 'R', 'C', 'T', 'B' };
+static constexpr uint32_t trainingBatchStreamVersion = 1;
+static constexpr uint32_t numQueryDims = sizeof(RadianceQuery) / sizeof(float);
+static constexpr uint32_t numTargetDims = sizeof(RGB) / sizeof(float);
+
+static_assert(sizeof(RadianceQuery) == 14 * sizeof(float) && sizeof(RGB) == 3 * sizeof(float),
+              "RadianceQuery and RGB are assumed to be tightly packed float sequences.");
+static_assert(std::is_trivially_copyable_v<RadianceQuery> && std::is_trivially_copyable_v<RGB>,
+              "Types stored in the training batch stream must be trivially copyable.");
+
+struct TrainingBatchStreamHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    uint32_t numQueryDims;
+    uint32_t numTargetDims;
+    uint32_t dummy[2];
+};
+
+struct TrainingBatchRecordHeader {
+    uint32_t frameIndex;
+    uint32_t numData;
+};
+
+bool TrainingBatchStreamWriter::open(const std::filesystem::path &filePath) {
+    close();
+    m_ofs.open(filePath, std::ios::binary);
+    if (!m_ofs)
+        return false;
+
+    TrainingBatchStreamHeader header = {};
+    std::copy_n(trainingBatchStreamMagic, sizeof(trainingBatchStreamMagic), header.magic);
+    header.version = trainingBatchStreamVersion;
+    header.headerSize = sizeof(TrainingBatchStreamHeader);
+    header.numQueryDims = numQueryDims;
+    header.numTargetDims = numTargetDims;
+    m_ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    m_numRecords = 0;
+
+    return static_cast<bool>(m_ofs);
+}
+
+void TrainingBatchStreamWriter::close() {
+    if (m_ofs.is_open())
+        m_ofs.close();
+}
+
+bool TrainingBatchStreamWriter::write(
+    uint32_t frameIndex,
+    const RadianceQuery* queries, const RGB* targets, uint32_t numData) {
+    Assert(m_ofs.is_open(), "The stream is not open.");
+    TrainingBatchRecordHeader recordHeader = {};
+    recordHeader.frameIndex = frameIndex;
+    recordHeader.numData = numData;
+    m_ofs.write(reinterpret_cast<const char*>(&recordHeader), sizeof(recordHeader));
+    m_ofs.write(reinterpret_cast<const char*>(queries), sizeof(RadianceQuery) * numData);
+    m_ofs.write(reinterpret_cast<const char*>(targets), sizeof(RGB) * numData);
+    if (!m_ofs)
+        return false;
+    ++m_numRecords;
+
+    return true;
+}
+
+
+
+bool TrainingBatchStreamReader::open(const std::filesystem::path &filePath) {
+    close();
+    m_ifs.open(filePath, std::ios::binary);
+    if (!m_ifs)
+        return false;
+
+    TrainingBatchStreamHeader header;
+    m_ifs.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!m_ifs ||
+        !std::equal(trainingBatchStreamMagic, trainingBatchStreamMagic + sizeof(trainingBatchStreamMagic),
+                    header.magic) ||
+        header.version != trainingBatchStreamVersion ||
+        header.headerSize != sizeof(TrainingBatchStreamHeader) ||
+        header.numQueryDims != numQueryDims ||
+        header.numTargetDims != numTargetDims) {
+        close();
+        return false;
+    }
+    m_firstRecordPos = m_ifs.tellg();
+    m_ifs.seekg(0, std::ios::end);
+    m_fileSize = m_ifs.tellg();
+    m_ifs.seekg(m_firstRecordPos);
+
+    return true;
+}
+
+void TrainingBatchStreamReader::close() {
+    if (m_ifs.is_open())
+        m_ifs.close();
+}
+
+TrainingBatchReadResult TrainingBatchStreamReader::readNext(TrainingBatch* batch) {
+    if (!m_ifs.is_open() || !m_ifs)
+        return TrainingBatchReadResult::InvalidRecord;
+
+    if (m_ifs.tellg() == m_fileSize)
+        return TrainingBatchReadResult::EndOfStream;
+
+    TrainingBatchRecordHeader recordHeader;
+    m_ifs.read(reinterpret_cast<char*>(&recordHeader), sizeof(recordHeader));
+    if (!m_ifs)
+        return TrainingBatchReadResult::InvalidRecord;
+
+    // JP: 壊れたファイルで巨大な確保をしないように、データ数をファイルの残りサイズと照合する。
+    // EN: Check the number of data against the remaining file size
+    //     to avoid a huge allocation with a corrupted file.
+    const uint64_t remainingSize = static_cast<uint64_t>(m_fileSize - m_ifs.tellg());
+    const uint64_t recordDataSize = static_cast<uint64_t>(sizeof(RadianceQuery) + sizeof(RGB)) * recordHeader.numData;
+    if (recordDataSize > remainingSize) {
+        m_ifs.setstate(std::ios::failbit);
+        return TrainingBatchReadResult::InvalidRecord;
+    }
+
+    batch->frameIndex = recordHeader.frameIndex;
+    batch->queries.resize(recordHeader.numData);
+    batch->targets.resize(recordHeader.numData);
+    m_ifs.read(reinterpret_cast<char*>(batch->queries.data()), sizeof(RadianceQuery) * recordHeader.numData);
+    m_ifs.read(reinterpret_cast<char*>(batch->targets.data()), sizeof(RGB) * recordHeader.numData);
+    if (!m_ifs)
+        return TrainingBatchReadResult::InvalidRecord;
+
+    return TrainingBatchReadResult::Success;
+}
+
+void TrainingBatchStreamReader::rewind() {
+    m_ifs.clear();
+    m_ifs.seekg(m_firstRecordPos);
+}
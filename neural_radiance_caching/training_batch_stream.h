@@ -0,0 +1,76 @@
+﻿#pragma once
+
+#include "neural_radiance_caching_shared.h"
+#include "../common/common_host.h"
+
+// JP: 1フレーム分のトレーニングデータ(シャッフル後のRadianceQueryとターゲット輝度)。
+// EN: Training data of a frame (shuffled RadianceQuery and target radiance).
+struct TrainingBatch {
+    uint32_t frameIndex;
+    std::vector<shared::RadianceQuery> queries;
+    std::vector<RGB> targets;
+
+    TrainingBatch() : frameIndex(0) {}
+
+    uint32_t getNumData() const {
+        return static_cast<uint32_t>(queries.size());
+    }
+};
+
+// JP: トレーニングデータをフレームごとにバイナリーストリームとして書き出す。
+//     ヘッダーの後にフレームごとのレコード(フレーム番号, データ数, 入力, ターゲット)が続くだけの形式で、
+//     入力とターゲットはネットワークに渡すのと同じ14要素と3要素のfloat列のまま格納する。
+// EN: Write training data per frame as a binary stream.
+//     The format is just a header followed by per-frame records (frame index, #data, inputs, targets),
+//     and inputs and targets are stored as is as 14-element and 3-element float sequences same as passed to the network.
+class TrainingBatchStreamWriter {
+    std::ofstream m_ofs;
+    uint32_t m_numRecords;
+
+public:
+    TrainingBatchStreamWriter() : m_numRecords(0) {}
+
+    bool open(const std::filesystem::path &filePath);
+    void close();
+    bool isOpen() const {
+        return m_ofs.is_open();
+    }
+
+    bool write(
+        uint32_t frameIndex,
+        const shared::RadianceQuery* queries, const RGB* targets, uint32_t numData);
+    bool write(const TrainingBatch &batch) {
+        return write(batch.frameIndex, batch.queries.data(), batch.targets.data(), batch.getNumData());
+    }
+
+    uint32_t getNumRecords() const {
+        return m_numRecords;
+    }
+};
+
+enum class TrainingBatchReadResult {
+    Success = 0,
+    EndOfStream,
+    InvalidRecord,
+};
+
+class TrainingBatchStreamReader {
+    std::ifstream m_ifs;
+    std::streampos m_firstRecordPos;
+    std::streampos m_fileSize;
+
+public:
+    bool open(const std::filesystem::path &filePath);
+    void close();
+
+    // JP: 次のレコードを読み込む。
+    //     ストリームがレコードの境界でちょうど終わっている場合はEndOfStreamを返し、
+    //     途中で途切れたレコードや壊れたレコードではInvalidRecordを返す。
+    // EN: Read the next record.
+    //     Returns EndOfStream when the stream ends exactly at a record boundary,
+    //     and InvalidRecord for a truncated or corrupted record.
+    TrainingBatchReadResult readNext(TrainingBatch* batch);
+    // JP: 複数エポック再生するために最初のレコードに戻る。
+    // EN: Go back to the first record to replay multiple epochs.
+    void rewind();
+};
@@ -43,7 +43,7 @@ CUDA_DEVICE_FUNCTION CUDA_INLINE RGB performNextEventEstimation(
         LightSample lightSample;
         float areaPDensity;
         sampleLight<useSolidAngleSampling>(
-            shadingPoint,
+            shadingPoint, shadingFrame.normal,
             uLight, selectEnvLight, rng.getFloat0cTo1o(), rng.getFloat0cTo1o(),
             &lightSample, &areaPDensity);
         areaPDensity *= probToSampleCurLightType;
@@ -96,6 +96,7 @@ CUDA_DEVICE_FUNCTION CUDA_INLINE void pathTrace_rayGen_generic() {
         // EN: Shading on the first hit.
         Vector3D vIn;
         float dirPDensity;
+        Normal3D shadingNormal;
         {
             const MaterialData &mat = plp.s->materialDataBuffer[materialSlot];
 
@@ -130,6 +131,7 @@ CUDA_DEVICE_FUNCTION CUDA_INLINE void pathTrace_rayGen_generic() {
                 vOutLocal, rng.getFloat0cTo1o(), rng.getFloat0cTo1o(),
                 &vInLocal, &dirPDensity);
             vIn = shadingFrame.fromLocal(vInLocal);
+            shadingNormal = shadingFrame.normal;
         }
 
         // Path extension loop
@@ -141,6 +143,7 @@ CUDA_DEVICE_FUNCTION CUDA_INLINE void pathTrace_rayGen_generic() {
         rwPayload.initImportance = initImportance;
         rwPayload.alpha = alpha;
         rwPayload.prevDirPDensity = dirPDensity;
+        rwPayload.prevNormal = shadingNormal;
         rwPayload.contribution = contribution;
         rwPayload.pathLength = 1;
         Point3D rayOrg = positionInWorld;
@@ -222,8 +225,8 @@ CUDA_DEVICE_FUNCTION CUDA_INLINE void pathTrace_closestHit_generic() {
     Point2D texCoord;
     float hypAreaPDensity;
     computeSurfacePoint<useMultipleImportanceSampling, useSolidAngleSampling>(
-        inst, geomInst, hp.primIndex, hp.b1, hp.b2,
-        rayOrigin,
+        inst, geomInst, optixGetInstanceId(), sbtr.geomInstSlot, hp.primIndex, hp.b1, hp.b2,
+        rayOrigin, rwPayload->prevNormal,
         &positionInWorld, &shadingNormalInWorld, &texCoord0DirInWorld,
         &geometricNormalInWorld, &texCoord, &hypAreaPDensity);
     if constexpr (!useMultipleImportanceSampling)
@@ -282,6 +285,7 @@ CUDA_DEVICE_FUNCTION CUDA_INLINE void pathTrace_closestHit_generic() {
     woPayload->nextOrigin = positionInWorld;
     woPayload->nextDirection = vIn;
     rwPayload->prevDirPDensity = dirPDensity;
+    rwPayload->prevNormal = shadingFrame.normal;
     rwPayload->terminate = false;
 }
 
@@ -313,51 +313,25 @@ static Quaternion g_cameraOrientation;
 static Quaternion g_tempCameraOrientation;
 static Point3D g_cameraPosition;
 static std::filesystem::path g_envLightTexturePath;
-
-struct MeshGeometryInfo {
-    std::filesystem::path path;
-    float preScale;
-    MaterialConvention matConv;
-};
-
-struct RectangleGeometryInfo {
-    float dimX;
-    float dimZ;
-    RGB emittance;
-    std::filesystem::path emitterTexPath;
-};
-
-struct MeshInstanceInfo {
-    std::string name;
-    Point3D beginPosition;
-    Point3D endPosition;
-    float beginScale;
-    float endScale;
-    Quaternion beginOrientation;
-    Quaternion endOrientation;
-    float frequency;
-    float initTime;
-};
-
-using MeshInfo = std::variant<MeshGeometryInfo, RectangleGeometryInfo>;
-static std::map<std::string, MeshInfo> g_meshInfos;
-static std::vector<MeshInstanceInfo> g_meshInstInfos;
+static EnvLightTextureFormat g_envLightTextureFormat = EnvLightTextureFormat::Float16;
+static uint32_t g_envImportanceMapResolution = defaultEnvImportanceMapResolution;
+static uint32_t g_envImportanceBenchmarkNumSamples = 0;
+static uint32_t g_distributionBenchmarkMaxNumValues = 0;
+static uint32_t g_slotFinderBenchmarkNumSlots = 0;
+static uint32_t g_sdrBenchmarkResolution = 0;
+static uint32_t g_lightTreeBenchmarkMaxNumEmitters = 0;
+static uint32_t g_instanceControllerBenchmarkNumControllers = 0;
+static bool g_useLightTree = false;
+static bool g_runSelfTests = false;
+static bool g_runHostSelfTestsOnly = false;
+static BenchmarkConfig g_benchmarkConfig;
+
+static SceneDescription g_sceneDesc;
 
 static void parseCommandline(int32_t argc, const char* argv[]) {
-    std::string name;
-
     Quaternion camOrientation = Quaternion();
 
-    Point3D beginPosition(0.0f, 0.0f, 0.0f);
-    Point3D endPosition(NAN, NAN, NAN);
-    Quaternion beginOrientation = Quaternion();
-    Quaternion endOrientation = Quaternion(NAN, NAN, NAN, NAN);
-    float beginScale = 1.0f;
-    float endScale = NAN;
-    float frequency = 5.0f;
-    float initTime = 0.0f;
-    RGB emittance(0.0f, 0.0f, 0.0f);
-    std::filesystem::path rectEmitterTexPath;
+    SceneCommandlineParser sceneParser;
 
     for (int i = 0; i < argc; ++i) {
         const char* arg = argv[i];
@@ -423,189 +397,104 @@ static void parseCommandline(int32_t argc, const char* argv[]) {
             g_envLightTexturePath = argv[i + 1];
             i += 1;
         }
-        else if (strncmp(arg, "-name", 6) == 0) {
+        else if (strncmp(arg, "-env-texture-format", 20) == 0) {
             if (i + 1 >= argc) {
                 hpprintf("Invalid option.\n");
                 exit(EXIT_FAILURE);
             }
-            name = argv[i + 1];
-            i += 1;
-        }
-        else if (0 == strncmp(arg, "-emittance", 11)) {
-            if (i + 3 >= argc) {
-                printf("Invalid option.\n");
-                exit(EXIT_FAILURE);
-            }
-            emittance = RGB(atof(argv[i + 1]), atof(argv[i + 2]), atof(argv[i + 3]));
-            if (!emittance.allFinite()) {
-                printf("Invalid value.\n");
+            if (strncmp(argv[i + 1], "f32", 4) == 0)
+                g_envLightTextureFormat = EnvLightTextureFormat::Float32;
+            else if (strncmp(argv[i + 1], "f16", 4) == 0)
+                g_envLightTextureFormat = EnvLightTextureFormat::Float16;
+            else if (strncmp(argv[i + 1], "bc6h", 5) == 0)
+                g_envLightTextureFormat = EnvLightTextureFormat::BC6H;
+            else {
+                hpprintf("Invalid option.\n");
                 exit(EXIT_FAILURE);
             }
-            i += 3;
+            i += 1;
         }
-        else if (0 == strncmp(arg, "-rect-emitter-tex", 18)) {
+        else if (strncmp(arg, "-env-importance-res", 20) == 0) {
             if (i + 1 >= argc) {
-                printf("Invalid option.\n");
+                hpprintf("Invalid option.\n");
                 exit(EXIT_FAILURE);
             }
-            rectEmitterTexPath = argv[i + 1];
+            g_envImportanceMapResolution = static_cast<uint32_t>(std::max(std::atoi(argv[i + 1]), 0));
             i += 1;
         }
-        else if (0 == strncmp(arg, "-obj", 5)) {
-            if (i + 3 >= argc) {
-                printf("Invalid option.\n");
-                exit(EXIT_FAILURE);
-            }
-
-            MeshInfo info = MeshGeometryInfo();
-            auto &mesh = std::get<MeshGeometryInfo>(info);
-            mesh.path = std::filesystem::path(argv[i + 1]);
-            mesh.preScale = atof(argv[i + 2]);
-            std::string matConv = argv[i + 3];
-            if (matConv == "trad") {
-                mesh.matConv = MaterialConvention::Traditional;
-            }
-            else if (matConv == "simple_pbr") {
-                mesh.matConv = MaterialConvention::SimplePBR;
-            }
-            else {
-                printf("Invalid material convention.\n");
-                exit(EXIT_FAILURE);
-            }
-
-            g_meshInfos[name] = info;
-
-            i += 3;
-        }
-        else if (0 == strncmp(arg, "-rectangle", 11)) {
-            if (i + 2 >= argc) {
-                printf("Invalid option.\n");
+        else if (strncmp(arg, "-env-importance-benchmark", 26) == 0) {
+            if (i + 1 >= argc) {
+                hpprintf("Invalid option.\n");
                 exit(EXIT_FAILURE);
             }
-
-            MeshInfo info = RectangleGeometryInfo();
-            auto &rect = std::get<RectangleGeometryInfo>(info);
-            rect.dimX = atof(argv[i + 1]);
-            rect.dimZ = atof(argv[i + 2]);
-            rect.emittance = emittance;
-            rect.emitterTexPath = rectEmitterTexPath;
-            g_meshInfos[name] = info;
-
-            emittance = RGB(0.0f, 0.0f, 0.0f);
-            rectEmitterTexPath = "";
-
-            i += 2;
+            g_envImportanceBenchmarkNumSamples = static_cast<uint32_t>(std::max(std::atoi(argv[i + 1]), 1));
+            i += 1;
         }
-        else if (0 == strncmp(arg, "-begin-pos", 11)) {
-            if (i + 3 >= argc) {
-                printf("Invalid option.\n");
-                exit(EXIT_FAILURE);
-            }
-            beginPosition = Point3D(atof(argv[i + 1]), atof(argv[i + 2]), atof(argv[i + 3]));
-            if (!beginPosition.allFinite()) {
-                printf("Invalid value.\n");
+        else if (strncmp(arg, "-distribution-benchmark", 24) == 0) {
+            if (i + 1 >= argc) {
+                hpprintf("Invalid option.\n");
                 exit(EXIT_FAILURE);
             }
-            i += 3;
-        }
-        else if (strncmp(arg, "-begin-roll", 10) == 0 ||
-                 strncmp(arg, "-begin-pitch", 11) == 0 ||
-                 strncmp(arg, "-begin-yaw", 9) == 0) {
-            computeOrientation(arg + 6, &beginOrientation);
+            g_distributionBenchmarkMaxNumValues = static_cast<uint32_t>(
+                std::min<uint64_t>(std::max<int64_t>(std::atoll(argv[i + 1]), 1024), 1u << 31));
+            i += 1;
         }
-        else if (0 == strncmp(arg, "-begin-scale", 13)) {
+        else if (strncmp(arg, "-slot-finder-benchmark", 23) == 0) {
             if (i + 1 >= argc) {
-                printf("Invalid option.\n");
-                exit(EXIT_FAILURE);
-            }
-            beginScale = atof(argv[i + 1]);
-            if (!isfinite(beginScale)) {
-                printf("Invalid value.\n");
+                hpprintf("Invalid option.\n");
                 exit(EXIT_FAILURE);
             }
+            g_slotFinderBenchmarkNumSlots = static_cast<uint32_t>(std::max(std::atoi(argv[i + 1]), 1));
             i += 1;
         }
-        else if (0 == strncmp(arg, "-end-pos", 9)) {
-            if (i + 3 >= argc) {
-                printf("Invalid option.\n");
-                exit(EXIT_FAILURE);
-            }
-            endPosition = Point3D(atof(argv[i + 1]), atof(argv[i + 2]), atof(argv[i + 3]));
-            if (!endPosition.allFinite()) {
-                printf("Invalid value.\n");
+        else if (strncmp(arg, "-sdr-benchmark", 15) == 0) {
+            if (i + 1 >= argc) {
+                hpprintf("Invalid option.\n");
                 exit(EXIT_FAILURE);
             }
-            i += 3;
-        }
-        else if (strncmp(arg, "-end-roll", 10) == 0 ||
-                 strncmp(arg, "-end-pitch", 11) == 0 ||
-                 strncmp(arg, "-end-yaw", 9) == 0) {
-            computeOrientation(arg + 4, &endOrientation);
+            g_sdrBenchmarkResolution = static_cast<uint32_t>(std::clamp(std::atoi(argv[i + 1]), 1, 16384));
+            i += 1;
         }
-        else if (0 == strncmp(arg, "-end-scale", 11)) {
+        else if (strncmp(arg, "-light-tree-benchmark", 22) == 0) {
             if (i + 1 >= argc) {
-                printf("Invalid option.\n");
-                exit(EXIT_FAILURE);
-            }
-            endScale = atof(argv[i + 1]);
-            if (!isfinite(endScale)) {
-                printf("Invalid value.\n");
+                hpprintf("Invalid option.\n");
                 exit(EXIT_FAILURE);
             }
+            g_lightTreeBenchmarkMaxNumEmitters = static_cast<uint32_t>(
+                std::min<uint64_t>(std::max<int64_t>(std::atoll(argv[i + 1]), 1024), 1u << 28));
             i += 1;
         }
-        else if (0 == strncmp(arg, "-freq", 6)) {
+        else if (strncmp(arg, "-instance-controller-benchmark", 31) == 0) {
             if (i + 1 >= argc) {
-                printf("Invalid option.\n");
-                exit(EXIT_FAILURE);
-            }
-            frequency = atof(argv[i + 1]);
-            if (!isfinite(frequency)) {
-                printf("Invalid value.\n");
+                hpprintf("Invalid option.\n");
                 exit(EXIT_FAILURE);
             }
+            g_instanceControllerBenchmarkNumControllers =
+                static_cast<uint32_t>(std::clamp(std::atoi(argv[i + 1]), 1, 1 << 24));
             i += 1;
         }
-        else if (0 == strncmp(arg, "-time", 6)) {
-            if (i + 1 >= argc) {
+        else if (strncmp(arg, "-light-tree", 12) == 0) {
+            g_useLightTree = true;
+        }
+        else if (strncmp(arg, "-selftest", 10) == 0) {
+            g_runSelfTests = true;
+        }
+        else if (strncmp(arg, "-host-selftest", 15) == 0) {
+            g_runHostSelfTestsOnly = true;
+        }
+        else if (CommandlineParseResult result = sceneParser.parse(argc, argv, &i, &g_sceneDesc);
+                 result != CommandlineParseResult::Unhandled) {
+            if (result == CommandlineParseResult::Invalid) {
                 printf("Invalid option.\n");
                 exit(EXIT_FAILURE);
             }
-            initTime = atof(argv[i + 1]);
-            if (!isfinite(initTime)) {
-                printf("Invalid value.\n");
-                exit(EXIT_FAILURE);
-            }
-            i += 1;
         }
-        else if (0 == strncmp(arg, "-inst", 6)) {
-            if (i + 1 >= argc) {
+        else if (CommandlineParseResult result = parseBenchmarkOption(argc, argv, &i, &g_benchmarkConfig);
+                 result != CommandlineParseResult::Unhandled) {
+            if (result == CommandlineParseResult::Invalid) {
                 printf("Invalid option.\n");
                 exit(EXIT_FAILURE);
             }
-
-            MeshInstanceInfo info;
-            info.name = argv[i + 1];
-            info.beginPosition = beginPosition;
-            info.beginOrientation = beginOrientation;
-            info.beginScale = beginScale;
-            info.endPosition = endPosition.allFinite() ? endPosition : beginPosition;
-            info.endOrientation = endOrientation.allFinite() ? endOrientation : beginOrientation;
-            info.endScale = std::isfinite(endScale) ? endScale : beginScale;
-            info.frequency = frequency;
-            info.initTime = initTime;
-            g_meshInstInfos.push_back(info);
-
-            beginPosition = Point3D(0.0f, 0.0f, 0.0f);
-            endPosition = Point3D(NAN, NAN, NAN);
-            beginOrientation = Quaternion();
-            endOrientation = Quaternion(NAN, NAN, NAN, NAN);
-            beginScale = 1.0f;
-            endScale = NAN;
-            frequency = 5.0f;
-            initTime = 0.0f;
-
-            i += 1;
         }
         else {
             printf("Unknown option.\n");
@@ -664,6 +553,59 @@ int32_t main(int32_t argc, const char* argv[]) try {
 
     parseCommandline(argc, argv);
 
+    // JP: 環境光の重要度マップの比較のみを行って終了する。
+    // EN: Only compare the importance maps of the environmental light, then exit.
+    if (g_envImportanceBenchmarkNumSamples > 0) {
+        if (g_envLightTexturePath.empty()) {
+            hpprintf("-env-importance-benchmark requires -env-texture.\n");
+            return -1;
+        }
+        return benchmarkEnvironmentalImportanceMaps(
+            g_envLightTexturePath, g_envImportanceMapResolution, g_envImportanceBenchmarkNumSamples);
+    }
+
+    // JP: 離散分布の構築時間の比較のみを行って終了する。
+    // EN: Only compare the build times of discrete distributions, then exit.
+    if (g_distributionBenchmarkMaxNumValues > 0)
+        return benchmarkDiscreteDistributionBuilds(g_distributionBenchmarkMaxNumValues);
+
+    // JP: SlotFinderの新旧の実装の比較のみを行って終了する。
+    // EN: Only compare the old and new SlotFinder implementations, then exit.
+    if (g_slotFinderBenchmarkNumSlots > 0)
+        return benchmarkSlotFinders(g_slotFinderBenchmarkNumSlots);
+
+    // JP: SDR画像への変換の新旧の実装の比較のみを行って終了する。
+    // EN: Only compare the old and new implementations of conversion into an SDR image, then exit.
+    if (g_sdrBenchmarkResolution > 0)
+        return benchmarkSDRConversion(g_sdrBenchmarkResolution, g_sdrBenchmarkResolution);
+
+    // JP: ライトツリーのホストでの構築時間の計測のみを行って終了する。
+    // EN: Only measure the host-side build times of the light tree, then exit.
+    if (g_lightTreeBenchmarkMaxNumEmitters > 0)
+        return benchmarkLightTreeBuilds(g_lightTreeBenchmarkMaxNumEmitters);
+
+    // JP: インスタンスコントローラーのスカラー版とAVX2版の評価の比較のみを行って終了する。
+    // EN: Only compare the scalar and AVX2 evaluations of instance controllers, then exit.
+    if (g_instanceControllerBenchmarkNumControllers > 0)
+        return benchmarkInstanceControllers(g_instanceControllerBenchmarkNumControllers);
+
+    // JP: GPUを使わないセルフテストのみを実行して終了する。GL/CUDAの初期化を行わないためGPUの無い環境でも実行できる。
+    // EN: Only run the self tests not using the GPU, then exit.
+    //     This doesn't initialize GL/CUDA so it can run even on a machine without a GPU.
+    if (g_runHostSelfTestsOnly)
+        return runHostSelfTests() ? 0 : -1;
+
+    // JP: GPUを使わないセルフテストを先に実行する。
+    // EN: Run the self tests not using the GPU first.
+    if (g_runSelfTests && !runHostSelfTests())
+        return -1;
+
+    CameraPath cameraPath;
+    if (g_benchmarkConfig.headless && !g_benchmarkConfig.cameraPathFile.empty()) {
+        if (!cameraPath.load(g_benchmarkConfig.cameraPathFile))
+            return -1;
+    }
+
     // ----------------------------------------------------------------
     // JP: OpenGL, GLFWの初期化。
     // EN: Initialize OpenGL and GLFW.
@@ -691,6 +633,13 @@ int32_t main(int32_t argc, const char* argv[]) try {
 
     glfwWindowHint(GLFW_SRGB_CAPABLE, GLFW_TRUE);
 
+    // JP: ヘッドレスモードではウインドウを表示しない。
+    //     出力バッファーがGLとのインターオペで作られるためコンテキスト自体は必要。
+    // EN: Don't show the window in the headless mode.
+    //     The context itself is still required since the output buffer is created via GL interop.
+    if (g_benchmarkConfig.headless)
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+
     int32_t renderTargetSizeX = 1920;
     int32_t renderTargetSizeY = 1080;
 
@@ -863,63 +812,24 @@ int32_t main(int32_t argc, const char* argv[]) try {
 
     StreamChain<2> streamChain;
     streamChain.initialize(gpuEnv.cuContext);
+
+    FrameCapturer frameCapturer;
+    frameCapturer.initialize();
+
     CUstream stream = streamChain.waitAvailableAndGetCurrentStream();
 
+    AsyncTextureLoader textureLoader;
+    textureLoader.initialize();
+    scene.textureLoader = &textureLoader;
+
     // ----------------------------------------------------------------
     // JP: シーンのセットアップ。
     // EN: Setup a scene.
 
     scene.map();
 
-    for (auto it = g_meshInfos.cbegin(); it != g_meshInfos.cend(); ++it) {
-        const MeshInfo &info = it->second;
-
-        if (std::holds_alternative<MeshGeometryInfo>(info)) {
-            const auto &meshInfo = std::get<MeshGeometryInfo>(info);
-
-            createTriangleMeshes(
-                it->first,
-                meshInfo.path, meshInfo.matConv,
-                scale3D_4x4(meshInfo.preScale),
-                gpuEnv.cuContext, &scene, gpuEnv.optixDefaultMaterial);
-        }
-        else if (std::holds_alternative<RectangleGeometryInfo>(info)) {
-            const auto &rectInfo = std::get<RectangleGeometryInfo>(info);
-
-            createRectangleLight(
-                it->first,
-                rectInfo.dimX, rectInfo.dimZ,
-                RGB(0.01f),
-                rectInfo.emitterTexPath, rectInfo.emittance, Matrix4x4(),
-                gpuEnv.cuContext, &scene, gpuEnv.optixDefaultMaterial);
-        }
-    }
-
-    for (int i = 0; i < g_meshInstInfos.size(); ++i) {
-        const MeshInstanceInfo &info = g_meshInstInfos[i];
-        const Mesh* mesh = scene.meshes.at(info.name);
-        for (int j = 0; j < mesh->groupInsts.size(); ++j) {
-            const Mesh::GeometryGroupInstance &groupInst = mesh->groupInsts[j];
-
-            Matrix4x4 instXfm =
-                Matrix4x4(info.beginScale * info.beginOrientation.toMatrix3x3(), info.beginPosition);
-            Instance* inst = createInstance(gpuEnv.cuContext, &scene, groupInst, instXfm);
-            scene.insts.push_back(inst);
-
-            scene.initialSceneAabb.unify(instXfm * groupInst.transform * groupInst.geomGroup->aabb);
-
-            if (any(info.beginPosition != info.endPosition) ||
-                info.beginOrientation != info.endOrientation ||
-                info.beginScale != info.endScale) {
-                auto controller = new InstanceController(
-                    inst,
-                    info.beginScale, info.beginOrientation, info.beginPosition,
-                    info.endScale, info.endOrientation, info.endPosition,
-                    info.frequency, info.initTime);
-                scene.instControllers.push_back(controller);
-            }
-        }
-    }
+    instantiateSceneDescription(
+        g_sceneDesc, gpuEnv.cuContext, &scene, gpuEnv.optixDefaultMaterial);
 
     Vector3D sceneDim = scene.initialSceneAabb.maxP - scene.initialSceneAabb.minP;
     g_cameraPositionalMovingSpeed = 0.003f * std::max({ sceneDim.x, sceneDim.y, sceneDim.z });
@@ -939,13 +849,23 @@ int32_t main(int32_t argc, const char* argv[]) try {
     // EN: Read a environmental texture, then compute a CDF to sample it.
     cudau::Array envLightArray;
     CUtexObject envLightTexture = 0;
-    RegularConstantContinuousDistribution2D envLightImportanceMap;
+    EnvLightImportanceMap envLightImportanceMap;
     if (!g_envLightTexturePath.empty())
         loadEnvironmentalTexture(g_envLightTexturePath, gpuEnv.cuContext,
-                                 &envLightArray, &envLightTexture, &envLightImportanceMap);
+                                 &envLightArray, &envLightTexture, &envLightImportanceMap,
+                                 g_envImportanceMapResolution, g_envLightTextureFormat);
 
     scene.setupLightGeomDistributions();
 
+    // JP: シーンを使うセルフテストを実行し、通常の終了処理を通って終了する。
+    // EN: Run the self tests using the scene, then exit through the regular finalization.
+    int32_t exitCode = 0;
+    if (g_runSelfTests) {
+        if (!testIncrementalLightDistributionUpdates(gpuEnv.cuContext, &scene))
+            exitCode = -1;
+        glfwSetWindowShouldClose(window, GLFW_TRUE);
+    }
+
     // END: Setup a scene.
     // ----------------------------------------------------------------
 
@@ -1224,6 +1144,12 @@ int32_t main(int32_t argc, const char* argv[]) try {
     pickInfos[0].initialize(gpuEnv.cuContext, Scene::bufferType, 1, initPickInfo);
     pickInfos[1].initialize(gpuEnv.cuContext, Scene::bufferType, 1, initPickInfo);
 
+    // JP: ライトツリーはインスタンスの変換を反映するので、instDataBufferと同様にフレームごとに切り替える。
+    // EN: Light trees reflect instance transforms, so switch them per frame same as instDataBuffer.
+    LightTree lightTrees[2];
+    bool lightTreeIsDirty[2] = { true, true };
+    uint32_t lastNumEmitterPrimDistUpdates = 0;
+
     CUdeviceptr plpOnDevice;
     CUDADRV_CHECK(cuMemAlloc(&plpOnDevice, sizeof(plp)));
 
@@ -1259,6 +1185,15 @@ int32_t main(int32_t argc, const char* argv[]) try {
     gpuTimers[0].initialize(gpuEnv.cuContext);
     gpuTimers[1].initialize(gpuEnv.cuContext);
     uint64_t frameIndex = 0;
+    // JP: 各GPUタイマーは2フレーム後に読み出されるので、ヘッドレスモードではフレーム2以降の値を記録する。
+    // EN: Each GPU timer is read back two frames later, so the headless mode records values from frame 2 onward.
+    BenchmarkReport benchmarkReport;
+    const auto reportGPUTime = [&](const char* passName, auto &timer) {
+        float time = timer.report();
+        if (g_benchmarkConfig.headless && frameIndex >= 2)
+            benchmarkReport.record(passName, time);
+        return time;
+    };
     glfwSetWindowUserPointer(window, &frameIndex);
     int32_t requestedSize[2];
     uint32_t numAccumFrames = 0;
@@ -1271,6 +1206,8 @@ int32_t main(int32_t argc, const char* argv[]) try {
 
         if (glfwWindowShouldClose(window))
             break;
+        if (g_benchmarkConfig.headless && frameIndex >= g_benchmarkConfig.numFrames + 2)
+            break;
         glfwPollEvents();
 
         CUstream curCuStream = streamChain.waitAvailableAndGetCurrentStream();
@@ -1339,9 +1276,16 @@ int32_t main(int32_t argc, const char* argv[]) try {
             resized = true;
         }
 
-        ImGui_ImplOpenGL3_NewFrame();
-        ImGui_ImplGlfw_NewFrame();
-        ImGui::NewFrame();
+        // JP: ヘッドレスモードではImGuiのフレームとウインドウの構築を省略する。
+        //     ウインドウ内で初期化を行うサンプルもあるので最初のフレームは構築する。
+        // EN: Skip building ImGui frames and windows in the headless mode.
+        //     Some samples initialize things inside the windows, so the first frame builds them.
+        const bool buildGUI = !g_benchmarkConfig.headless || frameIndex == 0;
+        if (buildGUI) {
+            ImGui_ImplOpenGL3_NewFrame();
+            ImGui_ImplGlfw_NewFrame();
+            ImGui::NewFrame();
+        }
 
 
 
@@ -1424,9 +1368,29 @@ int32_t main(int32_t argc, const char* argv[]) try {
             perFramePlp.camera.orientation = g_tempCameraOrientation.toMatrix3x3();
         }
 
+        // JP: ヘッドレスモードではカメラパスに沿ってカメラを動かす。
+        // EN: Move the camera along the camera path in the headless mode.
+        if (g_benchmarkConfig.headless && !cameraPath.empty()) {
+            cameraPath.evaluateAtFrame(
+                static_cast<uint32_t>(frameIndex), g_benchmarkConfig.numFrames,
+                &g_cameraPosition, &g_cameraOrientation);
+            g_tempCameraOrientation = g_cameraOrientation;
+            cameraIsActuallyMoving = cameraPath.getNumKeyframes() > 1;
+
+            perFramePlp.camera.position = g_cameraPosition;
+            perFramePlp.camera.orientation = g_tempCameraOrientation.toMatrix3x3();
+        }
+
 
 
         bool resetAccumulation = false;
+
+        // JP: 非同期に読み込まれたテクスチャーを反映する。
+        // EN: Apply textures loaded asynchronously.
+        if (textureLoader.hasCompletedRequests()) {
+            streamChain.waitAllWorkDone();
+            resetAccumulation |= textureLoader.processCompletedRequests(gpuEnv.cuContext, curCuStream) > 0;
+        }
         
         // Camera Window
         static shared::BufferToDisplay bufferTypeToDisplay = shared::BufferToDisplay::NoisyBeauty;
@@ -1435,7 +1399,7 @@ int32_t main(int32_t argc, const char* argv[]) try {
         static bool enableEnvLight = true;
         static float log10EnvLightPowerCoeff = 0.0f;
         static float envLightRotation = 0.0f;
-        {
+        if (buildGUI) {
             ImGui::Begin("Camera / Env", nullptr, ImGuiWindowFlags_AlwaysAutoResize);
 
             ImGui::Text("W/A/S/D/R/F: Move, Q/E: Tilt");
@@ -1463,26 +1427,32 @@ int32_t main(int32_t argc, const char* argv[]) try {
             ImGui::SameLine();
             if (ImGui::Button("Both"))
                 saveSS_LDR = saveSS_HDR = true;
-            if (saveSS_LDR || saveSS_HDR) {
-                streamChain.waitAllWorkDone();
-                auto rawImage = new float4[renderTargetSizeX * renderTargetSizeY];
-                glGetTextureSubImage(
-                    outputTexture.getHandle(), 0,
-                    0, 0, 0, renderTargetSizeX, renderTargetSizeY, 1,
-                    GL_RGBA, GL_FLOAT, sizeof(float4) * renderTargetSizeX * renderTargetSizeY, rawImage);
-
-                if (saveSS_LDR) {
-                    SDRImageSaverConfig config;
-                    config.brightnessScale = std::pow(10.0f, brightness);
-                    config.applyToneMap = applyToneMapAndGammaCorrection;
-                    config.apply_sRGB_gammaCorrection = applyToneMapAndGammaCorrection;
-                    saveImage("output.png", renderTargetSizeX, renderTargetSizeY, rawImage,
-                              config);
+            ImGui::SameLine();
+            static bool recordSequence = false;
+            ImGui::Checkbox("Record", &recordSequence);
+            frameCapturer.update();
+            if (saveSS_LDR || saveSS_HDR || recordSequence) {
+                static uint32_t sequenceFrameIndex = 0;
+                FrameCapturer::Request request;
+                request.sdrConfig.brightnessScale = std::pow(10.0f, brightness);
+                request.sdrConfig.applyToneMap = applyToneMapAndGammaCorrection;
+                request.sdrConfig.apply_sRGB_gammaCorrection = applyToneMapAndGammaCorrection;
+                request.hdrBrightnessScale = std::pow(10.0f, brightness);
+                if (recordSequence) {
+                    request.sdrFilePath = FrameCapturer::makeSequenceFilePath(
+                        "capture/frame", sequenceFrameIndex, "png");
+                    request.hdrFilePath = FrameCapturer::makeSequenceFilePath(
+                        "capture/frame", sequenceFrameIndex, "exr");
+                    ++sequenceFrameIndex;
                 }
-                if (saveSS_HDR)
-                    saveImageHDR("output.exr", renderTargetSizeX, renderTargetSizeY,
-                                 std::pow(10.0f, brightness), rawImage);
-                delete[] rawImage;
+                else {
+                    if (saveSS_LDR)
+                        request.sdrFilePath = "output.png";
+                    if (saveSS_HDR)
+                        request.hdrFilePath = "output.exr";
+                }
+                frameCapturer.capture(
+                    outputTexture.getHandle(), renderTargetSizeX, renderTargetSizeY, request);
             }
 
             if (!g_envLightTexturePath.empty()) {
@@ -1503,12 +1473,13 @@ int32_t main(int32_t argc, const char* argv[]) try {
         static int32_t log2MaxNumAccums = 16;
         static bool enableJittering = false;
         static bool enableBumpMapping = false;
+        static bool useLightTree = g_useLightTree;
         bool lastFrameWasAnimated = false;
         static int32_t maxPathLength = 5;
         static bool debugSwitches[] = {
             false, false, false, false, false, false, false, false
         };
-        {
+        if (buildGUI) {
             ImGui::Begin("Debug", nullptr, ImGuiWindowFlags_AlwaysAutoResize);
 
             if (ImGui::Button(animate ? "Stop" : "Play")) {
@@ -1523,6 +1494,7 @@ int32_t main(int32_t argc, const char* argv[]) try {
             ImGui::InputLog2Int("#MaxNumAccum", &log2MaxNumAccums, 16, 5);
             resetAccumulation |= ImGui::Checkbox("Enable Jittering", &enableJittering);
             resetAccumulation |= ImGui::Checkbox("Enable Bump Mapping", &enableBumpMapping);
+            resetAccumulation |= ImGui::Checkbox("Light Tree", &useLightTree);
 
             ImGui::Separator();
             ImGui::Text("Cursor Info: %.1lf, %.1lf", g_mouseX, g_mouseY);
@@ -1550,6 +1522,27 @@ int32_t main(int32_t argc, const char* argv[]) try {
                         pickInfoOnHost.emittance.g,
                         pickInfoOnHost.emittance.b);
 
+            // JP: 発光マテリアルの放射輝度を編集する。光源分布は次のフレームで差分更新される。
+            // EN: Edit the emittance of an emissive material.
+            //     Light distributions are updated incrementally in the next frame.
+            static int32_t editedMatSlot = 0;
+            static float editedEmittance[3] = { 1.0f, 1.0f, 1.0f };
+            ImGui::InputInt("Light Material", &editedMatSlot);
+            ImGui::InputFloat3("Light Emittance", editedEmittance);
+            if (ImGui::Button("Set Emittance")) {
+                for (Material* mat : scene.materials) {
+                    if (mat->materialSlot != static_cast<uint32_t>(editedMatSlot) ||
+                        !mat->texEmittance.cudaArray)
+                        continue;
+                    streamChain.waitAllWorkDone();
+                    setMaterialEmittance(
+                        gpuEnv.cuContext, &scene, mat,
+                        RGB(editedEmittance[0], editedEmittance[1], editedEmittance[2]));
+                    resetAccumulation = true;
+                    break;
+                }
+            }
+
             ImGui::Separator();
 
             if (ImGui::BeginTabBar("MyTabBar")) {
@@ -1624,17 +1617,8 @@ int32_t main(int32_t argc, const char* argv[]) try {
 
         // Stats Window
         {
-            ImGui::Begin("Stats", nullptr, ImGuiWindowFlags_AlwaysAutoResize);
-
-#if !defined(USE_HARD_CODED_BSDF_FUNCTIONS)
-            ImGui::PushTextWrapPos(ImGui::GetCursorPos().x + 300);
-            ImGui::TextColored(
-                ImVec4(1.0f, 0.0f, 0.0f, 1.0f),
-                "BSDF callables are enabled.\n"
-                "USE_HARD_CODED_BSDF_FUNCTIONS is recommended for better performance.");
-            ImGui::PopTextWrapPos();
-#endif
-
+            // JP: 計測値はGUIを構築しないフレームでも記録する。
+            // EN: Record the measurements even in frames not building the GUI.
             static MovingAverageTime cudaFrameTime;
             static MovingAverageTime updateTime;
             static MovingAverageTime computePDFTextureTime;
@@ -1642,25 +1626,50 @@ int32_t main(int32_t argc, const char* argv[]) try {
             static MovingAverageTime pathTraceTime;
             static MovingAverageTime denoiseTime;
 
-            cudaFrameTime.append(curGPUTimer.frame.report());
-            updateTime.append(curGPUTimer.update.report());
-            computePDFTextureTime.append(curGPUTimer.computePDFTexture.report());
-            setupGBuffersTime.append(curGPUTimer.setupGBuffers.report());
-            pathTraceTime.append(curGPUTimer.pathTrace.report());
-            denoiseTime.append(curGPUTimer.denoise.report());
+            cudaFrameTime.append(reportGPUTime("frame", curGPUTimer.frame));
+            updateTime.append(reportGPUTime("update", curGPUTimer.update));
+            computePDFTextureTime.append(reportGPUTime("computePDFTexture", curGPUTimer.computePDFTexture));
+            setupGBuffersTime.append(reportGPUTime("setupGBuffers", curGPUTimer.setupGBuffers));
+            pathTraceTime.append(reportGPUTime("pathTrace", curGPUTimer.pathTrace));
+            denoiseTime.append(reportGPUTime("denoise", curGPUTimer.denoise));
 
-            //ImGui::SetNextItemWidth(100.0f);
-            ImGui::Text("CUDA/OptiX GPU %.3f [ms]:", cudaFrameTime.getAverage());
-            ImGui::Text("  Update: %.3f [ms]", updateTime.getAverage());
-            ImGui::Text("  Compute PDF Texture: %.3f [ms]", computePDFTextureTime.getAverage());
-            ImGui::Text("  Setup G-Buffers: %.3f [ms]", setupGBuffersTime.getAverage());
-            ImGui::Text("  Path Trace: %.3f [ms]", pathTraceTime.getAverage());
-            if (bufferTypeToDisplay == shared::BufferToDisplay::DenoisedBeauty)
-                ImGui::Text("  Denoise: %.3f [ms]", denoiseTime.getAverage());
+            if (buildGUI) {
+                ImGui::Begin("Stats", nullptr, ImGuiWindowFlags_AlwaysAutoResize);
 
-            ImGui::Text("%u [spp]", std::min(numAccumFrames + 1, (1u << log2MaxNumAccums)));
+#if !defined(USE_HARD_CODED_BSDF_FUNCTIONS)
+                ImGui::PushTextWrapPos(ImGui::GetCursorPos().x + 300);
+                ImGui::TextColored(
+                    ImVec4(1.0f, 0.0f, 0.0f, 1.0f),
+                    "BSDF callables are enabled.\n"
+                    "USE_HARD_CODED_BSDF_FUNCTIONS is recommended for better performance.");
+                ImGui::PopTextWrapPos();
+#endif
 
-            ImGui::End();
+                //ImGui::SetNextItemWidth(100.0f);
+                ImGui::Text("CUDA/OptiX GPU %.3f [ms]:", cudaFrameTime.getAverage());
+                ImGui::Text("  Update: %.3f [ms]", updateTime.getAverage());
+                ImGui::Text("  Compute PDF Texture: %.3f [ms]", computePDFTextureTime.getAverage());
+                ImGui::Text("  Setup G-Buffers: %.3f [ms]", setupGBuffersTime.getAverage());
+                ImGui::Text("  Path Trace: %.3f [ms]", pathTraceTime.getAverage());
+                if (bufferTypeToDisplay == shared::BufferToDisplay::DenoisedBeauty)
+                    ImGui::Text("  Denoise: %.3f [ms]", denoiseTime.getAverage());
+
+                ImGui::Text("%u [spp]", std::min(numAccumFrames + 1, (1u << log2MaxNumAccums)));
+
+                if (useLightTree) {
+                    const Scene::LightTreeBuildTimings &timings = scene.lightTreeBuildTimings;
+                    ImGui::Separator();
+                    ImGui::Text("Light Tree CPU (%u emitters):", scene.emitterRegistry.getNumEmitters());
+                    ImGui::Text("  Gather Emitters: %.3f [ms]", timings.gatherEmitters);
+                    ImGui::Text("  Update Emitter Table: %.3f [ms]", timings.updateEmitterTable);
+                    ImGui::Text("  Build Set Up: %.3f [ms]", timings.buildTree.setUp);
+                    ImGui::Text("  Build Top-Level Splits: %.3f [ms]", timings.buildTree.topLevelSplits);
+                    ImGui::Text("  Build Subtrees: %.3f [ms]", timings.buildTree.subtrees);
+                    ImGui::Text("  Upload: %.3f [ms]", timings.buildTree.upload);
+                }
+
+                ImGui::End();
+            }
         }
 
         applyToneMapAndGammaCorrection =
@@ -1673,20 +1682,8 @@ int32_t main(int32_t argc, const char* argv[]) try {
 
         // JP: 各インスタンスのトランスフォームを更新する。
         // EN: Update the transform of each instance.
-        if (animate || lastFrameWasAnimated) {
-            cudau::TypedBuffer<shared::InstanceData> &curInstDataBuffer = scene.instDataBuffer[bufferIndex];
-            shared::InstanceData* instDataBufferOnHost = curInstDataBuffer.map();
-            for (int i = 0; i < scene.instControllers.size(); ++i) {
-                InstanceController* controller = scene.instControllers[i];
-                Instance* inst = controller->inst;
-                shared::InstanceData &instData = instDataBufferOnHost[inst->instSlot];
-                controller->update(instDataBufferOnHost, animate ? 1.0f / 60.0f : 0.0f);
-                // TODO: まとめて送る。
-                CUDADRV_CHECK(cuMemcpyHtoDAsync(curInstDataBuffer.getCUdeviceptrAt(inst->instSlot),
-                                                &instData, sizeof(instData), curCuStream));
-            }
-            curInstDataBuffer.unmap();
-        }
+        if (animate || lastFrameWasAnimated)
+            scene.updateInstances(curCuStream, bufferIndex, animate ? 1.0f / 60.0f : 0.0f);
 
         // JP: IASのリビルドを行う。
         // EN: Rebuild the IAS.
@@ -1722,12 +1719,40 @@ int32_t main(int32_t argc, const char* argv[]) try {
         // EN: Compute the probability texture for light instances.
         curGPUTimer.computePDFTexture.start(curCuStream);
         {
+            // JP: 放射輝度などに変更があったジオメトリーインスタンスとインスタンスの分布のみを再計算する。
+            // EN: Recompute only the distributions of geometry instances and instances with changes such as emittance.
+            scene.setupLightGeomDistributions(curCuStream);
+
             CUdeviceptr probTexAddr =
                 staticPlpOnDevice + offsetof(shared::StaticPipelineLaunchParameters, lightInstDist);
             scene.setupLightInstDistribution(curCuStream, probTexAddr, bufferIndex);
         }
         curGPUTimer.computePDFTexture.stop(curCuStream);
 
+        // JP: インスタンスが動いたか光源分布が再計算された場合、両方のライトツリーを作り直す。
+        // EN: Rebuild both light trees when instances moved or light distributions were recomputed.
+        if (animate || lastFrameWasAnimated ||
+            scene.lightDistUpdateStats.numEmitterPrimDistUpdates != lastNumEmitterPrimDistUpdates) {
+            lightTreeIsDirty[0] = true;
+            lightTreeIsDirty[1] = true;
+            lastNumEmitterPrimDistUpdates = scene.lightDistUpdateStats.numEmitterPrimDistUpdates;
+        }
+        if (useLightTree && lightTreeIsDirty[bufferIndex]) {
+            scene.buildLightTree(gpuEnv.cuContext, curCuStream, &lightTrees[bufferIndex]);
+            lightTreeIsDirty[bufferIndex] = false;
+            if (g_benchmarkConfig.headless) {
+                const Scene::LightTreeBuildTimings &timings = scene.lightTreeBuildTimings;
+                benchmarkReport.record(
+                    "lightTree.numEmitters", static_cast<float>(scene.emitterRegistry.getNumEmitters()));
+                benchmarkReport.record("lightTree.gatherEmitters", timings.gatherEmitters);
+                benchmarkReport.record("lightTree.updateEmitterTable", timings.updateEmitterTable);
+                benchmarkReport.record("lightTree.buildSetUp", timings.buildTree.setUp);
+                benchmarkReport.record("lightTree.buildTopLevelSplits", timings.buildTree.topLevelSplits);
+                benchmarkReport.record("lightTree.buildSubtrees", timings.buildTree.subtrees);
+                benchmarkReport.record("lightTree.upload", timings.buildTree.upload);
+            }
+        }
+
         bool newSequence = resized || frameIndex == 0 || resetAccumulation;
         bool firstAccumFrame =
             animate || !enableAccumulation || cameraIsActuallyMoving || newSequence;
@@ -1742,6 +1767,7 @@ int32_t main(int32_t argc, const char* argv[]) try {
         perFramePlp.frameIndex = frameIndex;
         perFramePlp.instanceDataBuffer =
             scene.instDataBuffer[bufferIndex].getROBuffer<shared::enableBufferOobCheck>();
+        lightTrees[bufferIndex].getDeviceType(&perFramePlp.lightTree);
         perFramePlp.envLightPowerCoeff = std::pow(10.0f, log10EnvLightPowerCoeff);
         perFramePlp.envLightRotation = envLightRotation;
         perFramePlp.mousePosition = int2(static_cast<int32_t>(g_mouseX),
@@ -1754,6 +1780,7 @@ int32_t main(int32_t argc, const char* argv[]) try {
         perFramePlp.enableJittering = enableJittering;
         perFramePlp.enableEnvLight = enableEnvLight;
         perFramePlp.enableBumpMapping = enableBumpMapping;
+        perFramePlp.useLightTree = useLightTree;
         for (int i = 0; i < lengthof(debugSwitches); ++i)
             perFramePlp.setDebugSwitch(i, debugSwitches[i]);
 
@@ -1863,6 +1890,15 @@ int32_t main(int32_t argc, const char* argv[]) try {
 
         streamChain.swap();
 
+        // JP: ヘッドレスモードでは表示を省略する。
+        // EN: Skip presentation in the headless mode.
+        if (g_benchmarkConfig.headless) {
+            if (buildGUI)
+                ImGui::EndFrame();
+            ++frameIndex;
+            continue;
+        }
+
 
 
         // ----------------------------------------------------------------
@@ -1908,6 +1944,11 @@ int32_t main(int32_t argc, const char* argv[]) try {
     }
 
     streamChain.waitAllWorkDone();
+    if (g_benchmarkConfig.headless) {
+        if (benchmarkReport.writeJSON(
+            g_benchmarkConfig.reportFile, "path_tracing", renderTargetSizeX, renderTargetSizeY))
+            hpprintf("Benchmark report: %s\n", g_benchmarkConfig.reportFile.string().c_str());
+    }
     gpuTimers[1].finalize();
     gpuTimers[0].finalize();
 
@@ -1915,6 +1956,9 @@ int32_t main(int32_t argc, const char* argv[]) try {
 
     CUDADRV_CHECK(cuMemFree(plpOnDevice));
 
+    lightTrees[1].finalize();
+    lightTrees[0].finalize();
+
     pickInfos[1].finalize();
     pickInfos[0].finalize();
 
@@ -1946,8 +1990,13 @@ int32_t main(int32_t argc, const char* argv[]) try {
         cuTexObjectDestroy(envLightTexture);
     envLightArray.finalize();
 
+    scene.textureLoader = nullptr;
+    textureLoader.finalize();
+
     finalizeTextureCaches();
 
+    frameCapturer.finalize();
+
     streamChain.finalize();
 
     scene.finalize();
@@ -1962,7 +2011,7 @@ int32_t main(int32_t argc, const char* argv[]) try {
 
     glfwTerminate();
 
-    return 0;
+    return exitCode;
 }
 catch (const std::exception &ex) {
     hpprintf("Error: %s\n", ex.what());
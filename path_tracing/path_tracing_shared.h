@@ -120,6 +120,9 @@ namespace shared {
         RGB alpha;
         RGB contribution;
         float prevDirPDensity;
+        // JP: 前の頂点で光源サンプリングに使ったシェーディング法線。ライトツリーの確率の評価に使う。
+        // EN: Shading normal used for light sampling at the previous vertex. Used to evaluate the light tree probability.
+        Normal3D prevNormal;
         unsigned int maxLengthTerminate : 1;
         unsigned int terminate : 1;
         unsigned int pathLength : 6;
@@ -138,7 +141,7 @@ namespace shared {
         ROBuffer<MaterialData> materialDataBuffer;
         ROBuffer<GeometryInstanceData> geometryInstanceDataBuffer;
         LightDistribution lightInstDist;
-        RegularConstantContinuousDistribution2D envLightImportanceMap;
+        EnvLightImportanceMap envLightImportanceMap;
         CUtexObject envLightTexture;
 
         optixu::NativeBlockBuffer2D<float4> beautyAccumBuffer;
@@ -152,6 +155,9 @@ namespace shared {
         uint32_t frameIndex;
 
         ROBuffer<InstanceData> instanceDataBuffer;
+        // JP: インスタンスの変換を反映するのでinstanceDataBufferと同様にフレームごとに切り替わる。
+        // EN: This reflects instance transforms so is switched per frame same as instanceDataBuffer.
+        LightTree lightTree;
 
         PerspectiveCamera camera;
         PerspectiveCamera prevCamera;
@@ -168,6 +174,7 @@ namespace shared {
         unsigned int enableJittering : 1;
         unsigned int enableEnvLight : 1;
         unsigned int enableBumpMapping : 1;
+        unsigned int useLightTree : 1;
 
         uint32_t debugSwitches;
         void setDebugSwitch(int32_t idx, bool b) {
@@ -218,7 +225,7 @@ RT_PIPELINE_LAUNCH_PARAMETERS shared::PipelineLaunchParameters plp;
 
 template <bool useSolidAngleSampling>
 CUDA_DEVICE_FUNCTION CUDA_INLINE void sampleLight(
-    const Point3D &shadingPoint,
+    const Point3D &shadingPoint, const Normal3D &shadingNormal,
     float ul, bool sampleEnvLight, float u0, float u1,
     shared::LightSample* lightSample, float* areaPDensity) {
     using namespace shared;
@@ -258,41 +265,63 @@ CUDA_DEVICE_FUNCTION CUDA_INLINE void sampleLight(
     else {
         float lightProb = 1.0f;
 
-        // JP: まずはインスタンスをサンプルする。
-        // EN: First, sample an instance.
-        float instProb;
-        float uGeomInst;
-        uint32_t instIndex = plp.s->lightInstDist.sample(ul, &instProb, &uGeomInst);
-        lightProb *= instProb;
-        const InstanceData &inst = plp.f->instanceDataBuffer[instIndex];
-        if (instProb == 0.0f) {
-            *areaPDensity = 0.0f;
-            return;
+        uint32_t instIndex;
+        uint32_t geomInstIndex;
+        uint32_t primIndex;
+        if (plp.f->useLightTree) {
+            // JP: ライトツリーを使ってシェーディング点に応じてエミッターを直接サンプルする。
+            // EN: Directly sample an emitter depending on the shading point using the light tree.
+            float emitterProb;
+            uint32_t emitterIndex = plp.f->lightTree.sample(shadingPoint, shadingNormal, ul, &emitterProb);
+            if (emitterProb == 0.0f) {
+                *areaPDensity = 0.0f;
+                return;
+            }
+            const LightTreeEmitter &emitter = plp.f->lightTree.getEmitter(emitterIndex);
+            instIndex = emitter.instSlot;
+            geomInstIndex = emitter.geomInstSlot;
+            primIndex = emitter.primIndex;
+            lightProb *= emitterProb;
         }
-        //Assert(inst.lightGeomInstDist.integral() > 0.0f,
-        //       "Non-emissive inst %u, prob %g, u: %g(0x%08x).", instIndex, instProb, ul, *(uint32_t*)&ul);
-
-
-        // JP: 次にサンプルしたインスタンスに属するジオメトリインスタンスをサンプルする。
-        // EN: Next, sample a geometry instance which belongs to the sampled instance.
-        float geomInstProb;
-        float uPrim;
-        uint32_t geomInstIndexInInst = inst.lightGeomInstDist.sample(uGeomInst, &geomInstProb, &uPrim);
-        uint32_t geomInstIndex = inst.geomInstSlots[geomInstIndexInInst];
-        lightProb *= geomInstProb;
-        const GeometryInstanceData &geomInst = plp.s->geometryInstanceDataBuffer[geomInstIndex];
-        if (geomInstProb == 0.0f) {
-            *areaPDensity = 0.0f;
-            return;
+        else {
+            // JP: まずはインスタンスをサンプルする。
+            // EN: First, sample an instance.
+            float instProb;
+            float uGeomInst;
+            instIndex = plp.s->lightInstDist.sample(ul, &instProb, &uGeomInst);
+            lightProb *= instProb;
+            const InstanceData &inst = plp.f->instanceDataBuffer[instIndex];
+            if (instProb == 0.0f) {
+                *areaPDensity = 0.0f;
+                return;
+            }
+            //Assert(inst.lightGeomInstDist.integral() > 0.0f,
+            //       "Non-emissive inst %u, prob %g, u: %g(0x%08x).", instIndex, instProb, ul, *(uint32_t*)&ul);
+
+
+            // JP: 次にサンプルしたインスタンスに属するジオメトリインスタンスをサンプルする。
+            // EN: Next, sample a geometry instance which belongs to the sampled instance.
+            float geomInstProb;
+            float uPrim;
+            uint32_t geomInstIndexInInst = inst.lightGeomInstDist.sample(uGeomInst, &geomInstProb, &uPrim);
+            geomInstIndex = inst.geomInstSlots[geomInstIndexInInst];
+            lightProb *= geomInstProb;
+            const GeometryInstanceData &geomInst = plp.s->geometryInstanceDataBuffer[geomInstIndex];
+            if (geomInstProb == 0.0f) {
+                *areaPDensity = 0.0f;
+                return;
+            }
+            //Assert(geomInst.emitterPrimDist.integral() > 0.0f,
+            //       "Non-emissive geom inst %u, prob %g, u: %g.", geomInstIndex, geomInstProb, uGeomInst);
+
+            // JP: 最後に、サンプルしたジオメトリインスタンスに属するプリミティブをサンプルする。
+            // EN: Finally, sample a primitive which belongs to the sampled geometry instance.
+            float primProb;
+            primIndex = geomInst.emitterPrimDist.sample(uPrim, &primProb);
+            lightProb *= primProb;
         }
-        //Assert(geomInst.emitterPrimDist.integral() > 0.0f,
-        //       "Non-emissive geom inst %u, prob %g, u: %g.", geomInstIndex, geomInstProb, uGeomInst);
-
-        // JP: 最後に、サンプルしたジオメトリインスタンスに属するプリミティブをサンプルする。
-        // EN: Finally, sample a primitive which belongs to the sampled geometry instance.
-        float primProb;
-        uint32_t primIndex = geomInst.emitterPrimDist.sample(uPrim, &primProb);
-        lightProb *= primProb;
+        const InstanceData &inst = plp.f->instanceDataBuffer[instIndex];
+        const GeometryInstanceData &geomInst = plp.s->geometryInstanceDataBuffer[geomInstIndex];
 
         //printf("%u-%u-%u: %g\n", instIndex, geomInstIndex, primIndex, lightProb);
 
@@ -480,8 +509,9 @@ template <bool computeHypotheticalAreaPDensity, bool useSolidAngleSampling>
 CUDA_DEVICE_FUNCTION CUDA_INLINE void computeSurfacePoint(
     const shared::InstanceData &inst,
     const shared::GeometryInstanceData &geomInst,
+    uint32_t instSlot, uint32_t geomInstSlot,
     uint32_t primIndex, float b1, float b2,
-    const Point3D &referencePoint,
+    const Point3D &referencePoint, const Normal3D &referenceNormal,
     Point3D* positionInWorld, Normal3D* shadingNormalInWorld, Vector3D* texCoord0DirInWorld,
     Normal3D* geometricNormalInWorld, Point2D* texCoord,
     float* hypAreaPDensity) {
@@ -531,14 +561,21 @@ CUDA_DEVICE_FUNCTION CUDA_INLINE void computeSurfacePoint(
         float lightProb = 1.0f;
         if (plp.s->envLightTexture && plp.f->enableEnvLight)
             lightProb *= (1 - probToSampleEnvLight);
-        float instImportance = inst.lightGeomInstDist.integral();
-        lightProb *= (pow2(inst.uniformScale) * instImportance) / plp.s->lightInstDist.integral();
-        lightProb *= geomInst.emitterPrimDist.integral() / instImportance;
-        if (!isfinite(lightProb)) {
-            *hypAreaPDensity = 0.0f;
-            return;
+        if (plp.f->useLightTree) {
+            const LightTree &lightTree = plp.f->lightTree;
+            uint32_t emitterIndex = lightTree.findEmitter(instSlot, geomInstSlot, primIndex);
+            lightProb *= lightTree.evaluatePMF(referencePoint, referenceNormal, emitterIndex);
+        }
+        else {
+            float instImportance = inst.lightGeomInstDist.integral();
+            lightProb *= (pow2(inst.uniformScale) * instImportance) / plp.s->lightInstDist.integral();
+            lightProb *= geomInst.emitterPrimDist.integral() / instImportance;
+            if (!isfinite(lightProb)) {
+                *hypAreaPDensity = 0.0f;
+                return;
+            }
+            lightProb *= geomInst.emitterPrimDist.evaluatePMF(primIndex);
         }
-        lightProb *= geomInst.emitterPrimDist.evaluatePMF(primIndex);
         if constexpr (useSolidAngleSampling) {
             // TODO: ? compute in the local coordinates.
             Vector3D A = normalize(p[0] - referencePoint);
@@ -3,32 +3,54 @@
 
 using namespace shared;
 
-CUDA_DEVICE_FUNCTION CUDA_INLINE RGB sampleIntensity(
-    const Point3D &cellCenter, const Vector3D &halfCellSize, float minSquaredDistance,
-    float uLight, bool sampleEnvLight, float uPos0, float uPos1,
-    LightSample* lightSample, float* probDensity) {
-    sampleLight<false>(
-        cellCenter,
-        uLight, sampleEnvLight, uPos0, uPos1,
-        lightSample, probDensity);
+CUDA_DEVICE_KERNEL void performLightPreSampling() {
+    uint32_t linearThreadIndex = blockDim.x * blockIdx.x + threadIdx.x;
+    PreSampledLightPool &pool = plp.s->preSampledLightPool;
+    if (linearThreadIndex >= pool.getNumLights())
+        return;
+
+    // JP: 環境光テクスチャーが設定されている場合は一定の確率でサンプルする。
+    //     ただし、そもそもReGIRは2段階のRISにおいてVisibilityを一切考慮していないため、環境光は(特に高いエネルギーの場合)、
+    //     Reservoir中のサンプルに無駄なものを増やしてしまい、むしろ分散が増える傾向にある。
+    //     環境光のサンプリングは別で行うほうが良いかもしれない。
+    // EN: Sample an environmental light texture with a fixed probability if it is set.
+    //     However in the first place, ReGIR doesn't take visibility into account at all during two-stage RIS,
+    //     therefore an environmental light (particularly with a high-energy case) tends to increase useless
+    //     samples in reservoirs, resulting in high variance.
+    //     Separated environmental light sampling may be preferred.
+    bool hasEnvLight = plp.s->envLightTexture && plp.f->enableEnvLight;
+    bool hasAreaLights = plp.s->lightInstDist.integral() > 0.0f;
+    preSampleLight(
+        pool, linearThreadIndex, hasEnvLight, hasAreaLights, probToSampleEnvLight,
+        [](float ul, bool sampleEnvLight, float u0, float u1,
+           LightSample* lightSample, float* areaPDensity) {
+            sampleLight<false>(
+                Point3D(0.0f),
+                ul, sampleEnvLight, u0, u1,
+                lightSample, areaPDensity);
+        });
+}
 
+CUDA_DEVICE_FUNCTION CUDA_INLINE RGB evaluateIntensity(
+    const Point3D &cellCenter, const Vector3D &halfCellSize, float minSquaredDistance,
+    const LightSample &lightSample) {
     float dist2 = minSquaredDistance;
     float lpCos = 1;
     bool isOutsideCell =
-        lightSample->atInfinity ||
-        lightSample->position.x < cellCenter.x - halfCellSize.x ||
-        lightSample->position.x > cellCenter.x + halfCellSize.x ||
-        lightSample->position.y < cellCenter.y - halfCellSize.y ||
-        lightSample->position.y > cellCenter.y + halfCellSize.y ||
-        lightSample->position.z < cellCenter.z - halfCellSize.z ||
-        lightSample->position.z > cellCenter.z + halfCellSize.z;
+        lightSample.atInfinity ||
+        lightSample.position.x < cellCenter.x - halfCellSize.x ||
+        lightSample.position.x > cellCenter.x + halfCellSize.x ||
+        lightSample.position.y < cellCenter.y - halfCellSize.y ||
+        lightSample.position.y > cellCenter.y + halfCellSize.y ||
+        lightSample.position.z < cellCenter.z - halfCellSize.z ||
+        lightSample.position.z > cellCenter.z + halfCellSize.z;
     if (isOutsideCell) {
-        Vector3D shadowRayDir = lightSample->atInfinity ?
-            Vector3D(lightSample->position) :
-            (lightSample->position - cellCenter);
+        Vector3D shadowRayDir = lightSample.atInfinity ?
+            Vector3D(lightSample.position) :
+            (lightSample.position - cellCenter);
         // JP: 光源点を含む平面への垂直距離を求める。
         // EN: Calculate the perpendicular distance to a plane on which the light point is.
-        float perpDistance = dot(-shadowRayDir, lightSample->normal);
+        float perpDistance = dot(-shadowRayDir, lightSample.normal);
 
         dist2 = shadowRayDir.sqLength();
         float dist = std::sqrt(dist2);
@@ -47,7 +69,7 @@ CUDA_DEVICE_FUNCTION CUDA_INLINE RGB sampleIntensity(
             contribute to the cell.
             Always evaluate the cosine term as 1 for the unknown case.
         */
-        bool cellIsInValidHalfSpace = lpCos > minSquaredDistance || lightSample->atInfinity;
+        bool cellIsInValidHalfSpace = lpCos > minSquaredDistance || lightSample.atInfinity;
         bool cellIsInInvalidHalfSpace = lpCos < -minSquaredDistance;
         if (cellIsInValidHalfSpace)
             lpCos = perpDistance / dist;
@@ -58,7 +80,7 @@ CUDA_DEVICE_FUNCTION CUDA_INLINE RGB sampleIntensity(
     }
 
     if (lpCos > 0.0f) {
-        RGB Le = lightSample->emittance / Pi;
+        RGB Le = lightSample.emittance / Pi;
         RGB ret = Le * (lpCos / dist2);
         return ret;
     }
@@ -95,6 +117,18 @@ CUDA_DEVICE_FUNCTION CUDA_INLINE void buildCellReservoirsAndTemporalReuse(uint32
 
     PCG32RNG rng = plp.s->lightSlotRngs[linearThreadIndex];
 
+    // JP: セル(に属する全ライトスロット)ごとに共通のライトサブセットを選択することで
+    //     メモリアクセスのコヒーレンシーを改善する。
+    //     セルは複数のブロックにまたがるので、セル番号とフレーム番号のハッシュからサブセットを決める。
+    // EN: Select a common light subset for each cell (all the light slots belonging to it)
+    //     to improve memory access coherency.
+    //     A cell spans multiple blocks, so determine the subset from a hash of the cell index and the frame index.
+    const PreSampledLightPool &lightPool = plp.s->preSampledLightPool;
+    PCG32RNG cellRng;
+    cellRng.setState((static_cast<uint64_t>(frameIndex) << 32 | cellLinearIndex) * 0x9E3779B97F4A7C15ULL);
+    cellRng();
+    const PreSampledLight* lightSubSet = lightPool.getSubset(lightPool.sampleSubset(cellRng.getFloat0cTo1o()));
+
     float selectedTargetPDensity = 0.0f;
     Reservoir<LightSample> reservoir;
     reservoir.initialize();
@@ -104,50 +138,18 @@ CUDA_DEVICE_FUNCTION CUDA_INLINE void buildCellReservoirsAndTemporalReuse(uint32
     //     as the target PDF.
     const uint32_t numCandidates = 1 << plp.f->log2NumCandidatesPerLightSlot;
     for (int candIdx = 0; candIdx < numCandidates; ++candIdx) {
-        // JP: 環境光テクスチャーが設定されている場合は一定の確率でサンプルする。
-        //     ダイバージェンスを抑えるために、ループの最初とそれ以外で環境光かそれ以外のサンプリングを分ける。
-        //     ただし、そもそもReGIRは2段階のRISにおいてVisibilityを一切考慮していないため、環境光は(特に高いエネルギーの場合)、
-        //     Reservoir中のサンプルに無駄なものを増やしてしまい、むしろ分散が増える傾向にある。
-        //     環境光のサンプリングは別で行うほうが良いかもしれない。
-        // EN: Sample an environmental light texture with a fixed probability if it is set.
-        //     Separate sampling from the environmental light and the others to
-        //     the beginning of the loop and the rest to avoid divergence.
-        //     However in the first place, ReGIR doesn't take visibility into account at all during two-stage RIS,
-        //     therefore an environmental light (particularly with a high-energy case) tends to increase useless
-        //     samples in reservoirs, resulting in high variance.
-        //     Separated environmental light sampling may be preferred.
-        float uLight = rng.getFloat0cTo1o();
-        bool sampleEnvLight = false;
-        float probToSampleCurLightType = 1.0f;
-        if (plp.s->envLightTexture && plp.f->enableEnvLight) {
-            if (plp.s->lightInstDist.integral() > 0.0f) {
-                float prob = min(max(probToSampleEnvLight * numCandidates - candIdx, 0.0f), 1.0f);
-                if (uLight < prob) {
-                    probToSampleCurLightType = probToSampleEnvLight;
-                    uLight = uLight / prob;
-                    sampleEnvLight = true;
-                }
-                else {
-                    probToSampleCurLightType = 1.0f - probToSampleEnvLight;
-                    uLight = (uLight - prob) / (1 - prob);
-                }
-            }
-            else {
-                sampleEnvLight = true;
-            }
-        }
+        uint32_t lightIndex = mapPrimarySampleToDiscrete(rng.getFloat0cTo1o(), lightPool.subsetSize);
+        const PreSampledLight &preSampledLight = lightSubSet[lightIndex];
+        const LightSample &lightSample = preSampledLight.sample;
+        float areaPDensity = preSampledLight.areaPDensity;
 
-        // JP: 候補サンプルを生成して、ターゲットPDFを計算する。
+        // JP: 候補サンプルを取り出して、ターゲットPDFを計算する。
         //     ターゲットPDFは正規化されていなくても良い。
-        // EN: Generate a candidate sample then calculate the target PDF for it.
+        // EN: Take a candidate sample then calculate the target PDF for it.
         //     Target PDF doesn't require to be normalized.
-        LightSample lightSample;
-        float areaPDensity;
-        RGB cont = sampleIntensity(
+        RGB cont = evaluateIntensity(
             cellCenter, halfCellSize, minSquaredDistance,
-            uLight, sampleEnvLight, rng.getFloat0cTo1o(), rng.getFloat0cTo1o(),
-            &lightSample, &areaPDensity);
-        areaPDensity *= probToSampleCurLightType;
+            lightSample);
         float targetPDensity = convertToWeight(cont);
 
         // JP: 候補サンプル生成用のPDFとターゲットPDFは異なるためサンプルにはウェイトがかかる。
@@ -72,6 +72,7 @@ struct GPUEnvironment {
     optixu::Context optixContext;
 
     CUmodule cellBuilderModule;
+    cudau::Kernel kernelPerformLightPreSampling;
     cudau::Kernel kernelBuildCellReservoirs;
     cudau::Kernel kernelBuildCellReservoirsAndTemporalReuse;
     cudau::Kernel kernelUpdateLastAccessFrameIndices;
@@ -111,6 +112,8 @@ struct GPUEnvironment {
         CUDADRV_CHECK(cuModuleLoad(
             &cellBuilderModule,
             (getExecutableDirectory() / "regir/ptxes/build_cell_reservoirs.ptx").string().c_str()));
+        kernelPerformLightPreSampling =
+            cudau::Kernel(cellBuilderModule, "performLightPreSampling", cudau::dim3(32), 0);
         kernelBuildCellReservoirs =
             cudau::Kernel(cellBuilderModule, "buildCellReservoirs", cudau::dim3(32), 0);
         kernelBuildCellReservoirsAndTemporalReuse =
@@ -411,51 +414,16 @@ static Quaternion g_cameraOrientation;
 static Quaternion g_tempCameraOrientation;
 static Point3D g_cameraPosition;
 static std::filesystem::path g_envLightTexturePath;
+static uint32_t g_numLightSubsets = shared::defaultNumPreSampledLightSubsets;
+static uint32_t g_lightSubsetSize = shared::defaultPreSampledLightSubsetSize;
+static BenchmarkConfig g_benchmarkConfig;
 
-struct MeshGeometryInfo {
-    std::filesystem::path path;
-    float preScale;
-    MaterialConvention matConv;
-};
-
-struct RectangleGeometryInfo {
-    float dimX;
-    float dimZ;
-    RGB emittance;
-    std::filesystem::path emitterTexPath;
-};
-
-struct MeshInstanceInfo {
-    std::string name;
-    Point3D beginPosition;
-    Point3D endPosition;
-    float beginScale;
-    float endScale;
-    Quaternion beginOrientation;
-    Quaternion endOrientation;
-    float frequency;
-    float initTime;
-};
-
-using MeshInfo = std::variant<MeshGeometryInfo, RectangleGeometryInfo>;
-static std::map<std::string, MeshInfo> g_meshInfos;
-static std::vector<MeshInstanceInfo> g_meshInstInfos;
+static SceneDescription g_sceneDesc;
 
 static void parseCommandline(int32_t argc, const char* argv[]) {
-    std::string name;
-
     Quaternion camOrientation = Quaternion();
 
-    Point3D beginPosition(0.0f, 0.0f, 0.0f);
-    Point3D endPosition(NAN, NAN, NAN);
-    Quaternion beginOrientation = Quaternion();
-    Quaternion endOrientation = Quaternion(NAN, NAN, NAN, NAN);
-    float beginScale = 1.0f;
-    float endScale = NAN;
-    float frequency = 5.0f;
-    float initTime = 0.0f;
-    RGB emittance(0.0f, 0.0f, 0.0f);
-    std::filesystem::path rectEmitterTexPath;
+    SceneCommandlineParser sceneParser;
 
     for (int i = 0; i < argc; ++i) {
         const char* arg = argv[i];
@@ -521,189 +489,35 @@ static void parseCommandline(int32_t argc, const char* argv[]) {
             g_envLightTexturePath = argv[i + 1];
             i += 1;
         }
-        else if (strncmp(arg, "-name", 6) == 0) {
+        else if (strncmp(arg, "-light-subsets", 15) == 0) {
             if (i + 1 >= argc) {
                 hpprintf("Invalid option.\n");
                 exit(EXIT_FAILURE);
             }
-            name = argv[i + 1];
-            i += 1;
-        }
-        else if (0 == strncmp(arg, "-emittance", 11)) {
-            if (i + 3 >= argc) {
-                printf("Invalid option.\n");
-                exit(EXIT_FAILURE);
-            }
-            emittance = RGB(atof(argv[i + 1]), atof(argv[i + 2]), atof(argv[i + 3]));
-            if (!emittance.allFinite()) {
-                printf("Invalid value.\n");
-                exit(EXIT_FAILURE);
-            }
-            i += 3;
-        }
-        else if (0 == strncmp(arg, "-rect-emitter-tex", 18)) {
-            if (i + 1 >= argc) {
-                printf("Invalid option.\n");
-                exit(EXIT_FAILURE);
-            }
-            rectEmitterTexPath = argv[i + 1];
-            i += 1;
-        }
-        else if (0 == strncmp(arg, "-obj", 5)) {
-            if (i + 3 >= argc) {
-                printf("Invalid option.\n");
-                exit(EXIT_FAILURE);
-            }
-
-            MeshInfo info = MeshGeometryInfo();
-            auto &mesh = std::get<MeshGeometryInfo>(info);
-            mesh.path = std::filesystem::path(argv[i + 1]);
-            mesh.preScale = atof(argv[i + 2]);
-            std::string matConv = argv[i + 3];
-            if (matConv == "trad") {
-                mesh.matConv = MaterialConvention::Traditional;
-            }
-            else if (matConv == "simple_pbr") {
-                mesh.matConv = MaterialConvention::SimplePBR;
-            }
-            else {
-                printf("Invalid material convention.\n");
-                exit(EXIT_FAILURE);
-            }
-
-            g_meshInfos[name] = info;
-
-            i += 3;
-        }
-        else if (0 == strncmp(arg, "-rectangle", 11)) {
-            if (i + 2 >= argc) {
-                printf("Invalid option.\n");
-                exit(EXIT_FAILURE);
-            }
-
-            MeshInfo info = RectangleGeometryInfo();
-            auto &rect = std::get<RectangleGeometryInfo>(info);
-            rect.dimX = atof(argv[i + 1]);
-            rect.dimZ = atof(argv[i + 2]);
-            rect.emittance = emittance;
-            rect.emitterTexPath = rectEmitterTexPath;
-            g_meshInfos[name] = info;
-
-            emittance = RGB(0.0f, 0.0f, 0.0f);
-            rectEmitterTexPath = "";
-
-            i += 2;
-        }
-        else if (0 == strncmp(arg, "-begin-pos", 11)) {
-            if (i + 3 >= argc) {
-                printf("Invalid option.\n");
-                exit(EXIT_FAILURE);
-            }
-            beginPosition = Point3D(atof(argv[i + 1]), atof(argv[i + 2]), atof(argv[i + 3]));
-            if (!beginPosition.allFinite()) {
-                printf("Invalid value.\n");
-                exit(EXIT_FAILURE);
-            }
-            i += 3;
-        }
-        else if (strncmp(arg, "-begin-roll", 10) == 0 ||
-                 strncmp(arg, "-begin-pitch", 11) == 0 ||
-                 strncmp(arg, "-begin-yaw", 9) == 0) {
-            computeOrientation(arg + 6, &beginOrientation);
-        }
-        else if (0 == strncmp(arg, "-begin-scale", 13)) {
-            if (i + 1 >= argc) {
-                printf("Invalid option.\n");
-                exit(EXIT_FAILURE);
-            }
-            beginScale = atof(argv[i + 1]);
-            if (!isfinite(beginScale)) {
-                printf("Invalid value.\n");
-                exit(EXIT_FAILURE);
-            }
+            g_numLightSubsets = std::max(atoi(argv[i + 1]), 1);
             i += 1;
         }
-        else if (0 == strncmp(arg, "-end-pos", 9)) {
-            if (i + 3 >= argc) {
-                printf("Invalid option.\n");
-                exit(EXIT_FAILURE);
-            }
-            endPosition = Point3D(atof(argv[i + 1]), atof(argv[i + 2]), atof(argv[i + 3]));
-            if (!endPosition.allFinite()) {
-                printf("Invalid value.\n");
-                exit(EXIT_FAILURE);
-            }
-            i += 3;
-        }
-        else if (strncmp(arg, "-end-roll", 10) == 0 ||
-                 strncmp(arg, "-end-pitch", 11) == 0 ||
-                 strncmp(arg, "-end-yaw", 9) == 0) {
-            computeOrientation(arg + 4, &endOrientation);
-        }
-        else if (0 == strncmp(arg, "-end-scale", 11)) {
+        else if (strncmp(arg, "-light-subset-size", 19) == 0) {
             if (i + 1 >= argc) {
-                printf("Invalid option.\n");
-                exit(EXIT_FAILURE);
-            }
-            endScale = atof(argv[i + 1]);
-            if (!isfinite(endScale)) {
-                printf("Invalid value.\n");
-                exit(EXIT_FAILURE);
-            }
-            i += 1;
-        }
-        else if (0 == strncmp(arg, "-freq", 6)) {
-            if (i + 1 >= argc) {
-                printf("Invalid option.\n");
-                exit(EXIT_FAILURE);
-            }
-            frequency = atof(argv[i + 1]);
-            if (!isfinite(frequency)) {
-                printf("Invalid value.\n");
+                hpprintf("Invalid option.\n");
                 exit(EXIT_FAILURE);
             }
+            g_lightSubsetSize = std::max(atoi(argv[i + 1]), 1);
             i += 1;
         }
-        else if (0 == strncmp(arg, "-time", 6)) {
-            if (i + 1 >= argc) {
+        else if (CommandlineParseResult result = sceneParser.parse(argc, argv, &i, &g_sceneDesc);
+                 result != CommandlineParseResult::Unhandled) {
+            if (result == CommandlineParseResult::Invalid) {
                 printf("Invalid option.\n");
                 exit(EXIT_FAILURE);
             }
-            initTime = atof(argv[i + 1]);
-            if (!isfinite(initTime)) {
-                printf("Invalid value.\n");
-                exit(EXIT_FAILURE);
-            }
-            i += 1;
         }
-        else if (0 == strncmp(arg, "-inst", 6)) {
-            if (i + 1 >= argc) {
+        else if (CommandlineParseResult result = parseBenchmarkOption(argc, argv, &i, &g_benchmarkConfig);
+                 result != CommandlineParseResult::Unhandled) {
+            if (result == CommandlineParseResult::Invalid) {
                 printf("Invalid option.\n");
                 exit(EXIT_FAILURE);
             }
-
-            MeshInstanceInfo info;
-            info.name = argv[i + 1];
-            info.beginPosition = beginPosition;
-            info.beginOrientation = beginOrientation;
-            info.beginScale = beginScale;
-            info.endPosition = endPosition.allFinite() ? endPosition : beginPosition;
-            info.endOrientation = endOrientation.allFinite() ? endOrientation : beginOrientation;
-            info.endScale = std::isfinite(endScale) ? endScale : beginScale;
-            info.frequency = frequency;
-            info.initTime = initTime;
-            g_meshInstInfos.push_back(info);
-
-            beginPosition = Point3D(0.0f, 0.0f, 0.0f);
-            endPosition = Point3D(NAN, NAN, NAN);
-            beginOrientation = Quaternion();
-            endOrientation = Quaternion(NAN, NAN, NAN, NAN);
-            beginScale = 1.0f;
-            endScale = NAN;
-            frequency = 5.0f;
-            initTime = 0.0f;
-
-            i += 1;
         }
         else {
             printf("Unknown option.\n");
@@ -762,6 +576,12 @@ int32_t main(int32_t argc, const char* argv[]) try {
 
     parseCommandline(argc, argv);
 
+    CameraPath cameraPath;
+    if (g_benchmarkConfig.headless && !g_benchmarkConfig.cameraPathFile.empty()) {
+        if (!cameraPath.load(g_benchmarkConfig.cameraPathFile))
+            return -1;
+    }
+
     // ----------------------------------------------------------------
     // JP: OpenGL, GLFWの初期化。
     // EN: Initialize OpenGL and GLFW.
@@ -789,6 +609,13 @@ int32_t main(int32_t argc, const char* argv[]) try {
 
     glfwWindowHint(GLFW_SRGB_CAPABLE, GLFW_TRUE);
 
+    // JP: ヘッドレスモードではウインドウを表示しない。
+    //     出力バッファーがGLとのインターオペで作られるためコンテキスト自体は必要。
+    // EN: Don't show the window in the headless mode.
+    //     The context itself is still required since the output buffer is created via GL interop.
+    if (g_benchmarkConfig.headless)
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+
     int32_t renderTargetSizeX = 1920;
     int32_t renderTargetSizeY = 1080;
 
@@ -961,63 +788,24 @@ int32_t main(int32_t argc, const char* argv[]) try {
 
     StreamChain<2> streamChain;
     streamChain.initialize(gpuEnv.cuContext);
+
+    FrameCapturer frameCapturer;
+    frameCapturer.initialize();
+
     CUstream stream = streamChain.waitAvailableAndGetCurrentStream();
 
+    AsyncTextureLoader textureLoader;
+    textureLoader.initialize();
+    scene.textureLoader = &textureLoader;
+
     // ----------------------------------------------------------------
     // JP: シーンのセットアップ。
     // EN: Setup a scene.
 
     scene.map();
 
-    for (auto it = g_meshInfos.cbegin(); it != g_meshInfos.cend(); ++it) {
-        const MeshInfo &info = it->second;
-
-        if (std::holds_alternative<MeshGeometryInfo>(info)) {
-            const auto &meshInfo = std::get<MeshGeometryInfo>(info);
-
-            createTriangleMeshes(
-                it->first,
-                meshInfo.path, meshInfo.matConv,
-                scale3D_4x4(meshInfo.preScale),
-                gpuEnv.cuContext, &scene, gpuEnv.optixDefaultMaterial);
-        }
-        else if (std::holds_alternative<RectangleGeometryInfo>(info)) {
-            const auto &rectInfo = std::get<RectangleGeometryInfo>(info);
-
-            createRectangleLight(
-                it->first,
-                rectInfo.dimX, rectInfo.dimZ,
-                RGB(0.01f),
-                rectInfo.emitterTexPath, rectInfo.emittance, Matrix4x4(),
-                gpuEnv.cuContext, &scene, gpuEnv.optixDefaultMaterial);
-        }
-    }
-
-    for (int i = 0; i < g_meshInstInfos.size(); ++i) {
-        const MeshInstanceInfo &info = g_meshInstInfos[i];
-        const Mesh* mesh = scene.meshes.at(info.name);
-        for (int j = 0; j < mesh->groupInsts.size(); ++j) {
-            const Mesh::GeometryGroupInstance &groupInst = mesh->groupInsts[j];
-
-            Matrix4x4 instXfm =
-                Matrix4x4(info.beginScale * info.beginOrientation.toMatrix3x3(), info.beginPosition);
-            Instance* inst = createInstance(gpuEnv.cuContext, &scene, groupInst, instXfm);
-            scene.insts.push_back(inst);
-
-            scene.initialSceneAabb.unify(instXfm * groupInst.transform * groupInst.geomGroup->aabb);
-
-            if (any(info.beginPosition != info.endPosition) ||
-                info.beginOrientation != info.endOrientation ||
-                info.beginScale != info.endScale) {
-                auto controller = new InstanceController(
-                    inst,
-                    info.beginScale, info.beginOrientation, info.beginPosition,
-                    info.endScale, info.endOrientation, info.endPosition,
-                    info.frequency, info.initTime);
-                scene.instControllers.push_back(controller);
-            }
-        }
-    }
+    instantiateSceneDescription(
+        g_sceneDesc, gpuEnv.cuContext, &scene, gpuEnv.optixDefaultMaterial);
 
     Vector3D sceneDim = scene.initialSceneAabb.maxP - scene.initialSceneAabb.minP;
     g_cameraPositionalMovingSpeed = 0.003f * std::max({ sceneDim.x, sceneDim.y, sceneDim.z });
@@ -1037,7 +825,7 @@ int32_t main(int32_t argc, const char* argv[]) try {
     // EN: Read a environmental texture, then compute a CDF to sample it.
     cudau::Array envLightArray;
     CUtexObject envLightTexture = 0;
-    RegularConstantContinuousDistribution2D envLightImportanceMap;
+    EnvLightImportanceMap envLightImportanceMap;
     if (!g_envLightTexturePath.empty())
         loadEnvironmentalTexture(g_envLightTexturePath, gpuEnv.cuContext,
                                  &envLightArray, &envLightTexture, &envLightImportanceMap);
@@ -1105,6 +893,12 @@ int32_t main(int32_t argc, const char* argv[]) try {
 
     initializeReservoirs(scene.initialSceneAabb, uint3(32, 8, 32), -1);
 
+    // JP: セルのReservoir構築で候補サンプルを取り出すための、事前に光源をサンプリングしたサブセットのプール。
+    // EN: A pool of light subsets sampled in advance to draw candidate samples from in cell reservoir building.
+    PreSampledLightPoolTemplate<shared::LightSample> preSampledLightPool;
+    preSampledLightPool.initialize(
+        gpuEnv.cuContext, Scene::bufferType, g_numLightSubsets, g_lightSubsetSize, 894213312210);
+
     // END: Initialize buffers related to rerservoir grid.
     // ----------------------------------------------------------------
 
@@ -1346,6 +1140,7 @@ int32_t main(int32_t argc, const char* argv[]) try {
             reservoirInfos[1].getRWBuffer<shared::enableBufferOobCheck>();
         staticPlp.lightSlotRngs =
             lightSlotRngs.getRWBuffer<shared::enableBufferOobCheck>();
+        preSampledLightPool.getDeviceType(&staticPlp.preSampledLightPool);
         staticPlp.perCellNumAccesses =
             perCellNumAccesses.getRWBuffer<shared::enableBufferOobCheck>();
         staticPlp.lastAccessFrameIndices =
@@ -1414,6 +1209,7 @@ int32_t main(int32_t argc, const char* argv[]) try {
         cudau::Timer update;
         cudau::Timer computePDFTexture;
         cudau::Timer setupGBuffers;
+        cudau::Timer performPreSamplingLights;
         cudau::Timer buildCellReservoirs;
         cudau::Timer pathTrace;
         cudau::Timer denoise;
@@ -1423,6 +1219,7 @@ int32_t main(int32_t argc, const char* argv[]) try {
             update.initialize(context);
             computePDFTexture.initialize(context);
             setupGBuffers.initialize(context);
+            performPreSamplingLights.initialize(context);
             buildCellReservoirs.initialize(context);
             pathTrace.initialize(context);
             denoise.initialize(context);
@@ -1431,6 +1228,7 @@ int32_t main(int32_t argc, const char* argv[]) try {
             denoise.finalize();
             pathTrace.finalize();
             buildCellReservoirs.finalize();
+            performPreSamplingLights.finalize();
             setupGBuffers.finalize();
             computePDFTexture.finalize();
             update.finalize();
@@ -1442,6 +1240,15 @@ int32_t main(int32_t argc, const char* argv[]) try {
     gpuTimers[0].initialize(gpuEnv.cuContext);
     gpuTimers[1].initialize(gpuEnv.cuContext);
     uint64_t frameIndex = 0;
+    // JP: 各GPUタイマーは2フレーム後に読み出されるので、ヘッドレスモードではフレーム2以降の値を記録する。
+    // EN: Each GPU timer is read back two frames later, so the headless mode records values from frame 2 onward.
+    BenchmarkReport benchmarkReport;
+    const auto reportGPUTime = [&](const char* passName, auto &timer) {
+        float time = timer.report();
+        if (g_benchmarkConfig.headless && frameIndex >= 2)
+            benchmarkReport.record(passName, time);
+        return time;
+    };
     glfwSetWindowUserPointer(window, &frameIndex);
     int32_t requestedSize[2];
     uint32_t numAccumFrames = 0;
@@ -1454,6 +1261,8 @@ int32_t main(int32_t argc, const char* argv[]) try {
 
         if (glfwWindowShouldClose(window))
             break;
+        if (g_benchmarkConfig.headless && frameIndex >= g_benchmarkConfig.numFrames + 2)
+            break;
         glfwPollEvents();
 
         CUstream curCuStream = streamChain.waitAvailableAndGetCurrentStream();
@@ -1522,9 +1331,16 @@ int32_t main(int32_t argc, const char* argv[]) try {
             resized = true;
         }
 
-        ImGui_ImplOpenGL3_NewFrame();
-        ImGui_ImplGlfw_NewFrame();
-        ImGui::NewFrame();
+        // JP: ヘッドレスモードではImGuiのフレームとウインドウの構築を省略する。
+        //     ウインドウ内で初期化を行うサンプルもあるので最初のフレームは構築する。
+        // EN: Skip building ImGui frames and windows in the headless mode.
+        //     Some samples initialize things inside the windows, so the first frame builds them.
+        const bool buildGUI = !g_benchmarkConfig.headless || frameIndex == 0;
+        if (buildGUI) {
+            ImGui_ImplOpenGL3_NewFrame();
+            ImGui_ImplGlfw_NewFrame();
+            ImGui::NewFrame();
+        }
 
 
 
@@ -1607,9 +1423,29 @@ int32_t main(int32_t argc, const char* argv[]) try {
             perFramePlp.camera.orientation = g_tempCameraOrientation.toMatrix3x3();
         }
 
+        // JP: ヘッドレスモードではカメラパスに沿ってカメラを動かす。
+        // EN: Move the camera along the camera path in the headless mode.
+        if (g_benchmarkConfig.headless && !cameraPath.empty()) {
+            cameraPath.evaluateAtFrame(
+                static_cast<uint32_t>(frameIndex), g_benchmarkConfig.numFrames,
+                &g_cameraPosition, &g_cameraOrientation);
+            g_tempCameraOrientation = g_cameraOrientation;
+            cameraIsActuallyMoving = cameraPath.getNumKeyframes() > 1;
+
+            perFramePlp.camera.position = g_cameraPosition;
+            perFramePlp.camera.orientation = g_tempCameraOrientation.toMatrix3x3();
+        }
+
 
 
         bool resetAccumulation = false;
+
+        // JP: 非同期に読み込まれたテクスチャーを反映する。
+        // EN: Apply textures loaded asynchronously.
+        if (textureLoader.hasCompletedRequests()) {
+            streamChain.waitAllWorkDone();
+            resetAccumulation |= textureLoader.processCompletedRequests(gpuEnv.cuContext, curCuStream) > 0;
+        }
         
         // Camera Window
         static shared::BufferToDisplay bufferTypeToDisplay = shared::BufferToDisplay::NoisyBeauty;
@@ -1618,7 +1454,7 @@ int32_t main(int32_t argc, const char* argv[]) try {
         static bool enableEnvLight = true;
         static float log10EnvLightPowerCoeff = 0.0f;
         static float envLightRotation = 0.0f;
-        {
+        if (buildGUI) {
             ImGui::Begin("Camera / Env", nullptr, ImGuiWindowFlags_AlwaysAutoResize);
 
             ImGui::Text("W/A/S/D/R/F: Move, Q/E: Tilt");
@@ -1646,26 +1482,32 @@ int32_t main(int32_t argc, const char* argv[]) try {
             ImGui::SameLine();
             if (ImGui::Button("Both"))
                 saveSS_LDR = saveSS_HDR = true;
-            if (saveSS_LDR || saveSS_HDR) {
-                streamChain.waitAllWorkDone();
-                auto rawImage = new float4[renderTargetSizeX * renderTargetSizeY];
-                glGetTextureSubImage(
-                    outputTexture.getHandle(), 0,
-                    0, 0, 0, renderTargetSizeX, renderTargetSizeY, 1,
-                    GL_RGBA, GL_FLOAT, sizeof(float4) * renderTargetSizeX * renderTargetSizeY, rawImage);
-
-                if (saveSS_LDR) {
-                    SDRImageSaverConfig config;
-                    config.brightnessScale = std::pow(10.0f, brightness);
-                    config.applyToneMap = applyToneMapAndGammaCorrection;
-                    config.apply_sRGB_gammaCorrection = applyToneMapAndGammaCorrection;
-                    saveImage("output.png", renderTargetSizeX, renderTargetSizeY, rawImage,
-                              config);
+            ImGui::SameLine();
+            static bool recordSequence = false;
+            ImGui::Checkbox("Record", &recordSequence);
+            frameCapturer.update();
+            if (saveSS_LDR || saveSS_HDR || recordSequence) {
+                static uint32_t sequenceFrameIndex = 0;
+                FrameCapturer::Request request;
+                request.sdrConfig.brightnessScale = std::pow(10.0f, brightness);
+                request.sdrConfig.applyToneMap = applyToneMapAndGammaCorrection;
+                request.sdrConfig.apply_sRGB_gammaCorrection = applyToneMapAndGammaCorrection;
+                request.hdrBrightnessScale = std::pow(10.0f, brightness);
+                if (recordSequence) {
+                    request.sdrFilePath = FrameCapturer::makeSequenceFilePath(
+                        "capture/frame", sequenceFrameIndex, "png");
+                    request.hdrFilePath = FrameCapturer::makeSequenceFilePath(
+                        "capture/frame", sequenceFrameIndex, "exr");
+                    ++sequenceFrameIndex;
+                }
+                else {
+                    if (saveSS_LDR)
+                        request.sdrFilePath = "output.png";
+                    if (saveSS_HDR)
+                        request.hdrFilePath = "output.exr";
                 }
-                if (saveSS_HDR)
-                    saveImageHDR("output.exr", renderTargetSizeX, renderTargetSizeY,
-                                 std::pow(10.0f, brightness), rawImage);
-                delete[] rawImage;
+                frameCapturer.capture(
+                    outputTexture.getHandle(), renderTargetSizeX, renderTargetSizeY, request);
             }
 
             if (!g_envLightTexturePath.empty()) {
@@ -1693,11 +1535,12 @@ int32_t main(int32_t argc, const char* argv[]) try {
         static int32_t log2NumCandidatesPerCell = 2;
         static bool enableTemporalReuse = true;
         static bool enableCellRandomization = true;
+        static bool reuseLightPoolForStaticLights = false;
         static bool visualizeCells = false;
         static bool debugSwitches[] = {
             false, false, false, false, false, false, false, false
         };
-        {
+        if (buildGUI) {
             ImGui::Begin("Debug", nullptr, ImGuiWindowFlags_AlwaysAutoResize);
 
             if (ImGui::Button(animate ? "Stop" : "Play")) {
@@ -1764,6 +1607,8 @@ int32_t main(int32_t argc, const char* argv[]) try {
                     ImGui::InputLog2Int("#Shading Candidates", &log2NumCandidatesPerCell, 8);
                     resetAccumulation |= ImGui::Checkbox("Temporal Reuse", &enableTemporalReuse);
                     resetAccumulation |= ImGui::Checkbox("Cell Randomization", &enableCellRandomization);
+                    resetAccumulation |=
+                        ImGui::Checkbox("Reuse Light Pool for Static Lights", &reuseLightPoolForStaticLights);
 
                     ImGui::PushID("Debug Switches");
                     for (int i = lengthof(debugSwitches) - 1; i >= 0; --i) {
@@ -1834,46 +1679,53 @@ int32_t main(int32_t argc, const char* argv[]) try {
 
         // Stats Window
         {
-            ImGui::Begin("Stats", nullptr, ImGuiWindowFlags_AlwaysAutoResize);
-
-#if !defined(USE_HARD_CODED_BSDF_FUNCTIONS)
-            ImGui::PushTextWrapPos(ImGui::GetCursorPos().x + 300);
-            ImGui::TextColored(ImVec4(1.0f, 0.0f, 0.0f, 1.0f),
-                               "BSDF callables are enabled.\n"
-                               "USE_HARD_CODED_BSDF_FUNCTIONS is recommended for better performance.");
-            ImGui::PopTextWrapPos();
-#endif
-
+            // JP: 計測値はGUIを構築しないフレームでも記録する。
+            // EN: Record the measurements even in frames not building the GUI.
             static MovingAverageTime cudaFrameTime;
             static MovingAverageTime updateTime;
             static MovingAverageTime computePDFTextureTime;
             static MovingAverageTime setupGBuffersTime;
+            static MovingAverageTime performPreSamplingLightsTime;
             static MovingAverageTime buildCellReservoirsTime;
             static MovingAverageTime pathTraceTime;
             static MovingAverageTime denoiseTime;
 
-            cudaFrameTime.append(curGPUTimer.frame.report());
-            updateTime.append(curGPUTimer.update.report());
-            computePDFTextureTime.append(curGPUTimer.computePDFTexture.report());
-            setupGBuffersTime.append(curGPUTimer.setupGBuffers.report());
-            buildCellReservoirsTime.append(curGPUTimer.buildCellReservoirs.report());
-            pathTraceTime.append(curGPUTimer.pathTrace.report());
-            denoiseTime.append(curGPUTimer.denoise.report());
-
-            //ImGui::SetNextItemWidth(100.0f);
-            ImGui::Text("CUDA/OptiX GPU %.3f [ms]:", cudaFrameTime.getAverage());
-            ImGui::Text("  Update: %.3f [ms]", updateTime.getAverage());
-            ImGui::Text("  Compute PDF Texture: %.3f [ms]", computePDFTextureTime.getAverage());
-            ImGui::Text("  Setup G-Buffers: %.3f [ms]", setupGBuffersTime.getAverage());
-            ImGui::Text("  Build Cell Reservoirs + ");
-            ImGui::Text("  Temporal Reuse: %.3f [ms]", buildCellReservoirsTime.getAverage());
-            ImGui::Text("  Path Trace: %.3f [ms]", pathTraceTime.getAverage());
-            if (bufferTypeToDisplay == shared::BufferToDisplay::DenoisedBeauty)
-                ImGui::Text("  Denoise: %.3f [ms]", denoiseTime.getAverage());
-
-            ImGui::Text("%u [spp]", std::min(numAccumFrames + 1, (1u << log2MaxNumAccums)));
+            cudaFrameTime.append(reportGPUTime("frame", curGPUTimer.frame));
+            updateTime.append(reportGPUTime("update", curGPUTimer.update));
+            computePDFTextureTime.append(reportGPUTime("computePDFTexture", curGPUTimer.computePDFTexture));
+            setupGBuffersTime.append(reportGPUTime("setupGBuffers", curGPUTimer.setupGBuffers));
+            performPreSamplingLightsTime.append(reportGPUTime("performPreSamplingLights", curGPUTimer.performPreSamplingLights));
+            buildCellReservoirsTime.append(reportGPUTime("buildCellReservoirs", curGPUTimer.buildCellReservoirs));
+            pathTraceTime.append(reportGPUTime("pathTrace", curGPUTimer.pathTrace));
+            denoiseTime.append(reportGPUTime("denoise", curGPUTimer.denoise));
 
-            ImGui::End();
+            if (buildGUI) {
+                ImGui::Begin("Stats", nullptr, ImGuiWindowFlags_AlwaysAutoResize);
+
+#if !defined(USE_HARD_CODED_BSDF_FUNCTIONS)
+                ImGui::PushTextWrapPos(ImGui::GetCursorPos().x + 300);
+                ImGui::TextColored(ImVec4(1.0f, 0.0f, 0.0f, 1.0f),
+                                   "BSDF callables are enabled.\n"
+                                   "USE_HARD_CODED_BSDF_FUNCTIONS is recommended for better performance.");
+                ImGui::PopTextWrapPos();
+#endif
+
+                //ImGui::SetNextItemWidth(100.0f);
+                ImGui::Text("CUDA/OptiX GPU %.3f [ms]:", cudaFrameTime.getAverage());
+                ImGui::Text("  Update: %.3f [ms]", updateTime.getAverage());
+                ImGui::Text("  Compute PDF Texture: %.3f [ms]", computePDFTextureTime.getAverage());
+                ImGui::Text("  Setup G-Buffers: %.3f [ms]", setupGBuffersTime.getAverage());
+                ImGui::Text("  Light Pre-sampling: %.3f [ms]", performPreSamplingLightsTime.getAverage());
+                ImGui::Text("  Build Cell Reservoirs + ");
+                ImGui::Text("  Temporal Reuse: %.3f [ms]", buildCellReservoirsTime.getAverage());
+                ImGui::Text("  Path Trace: %.3f [ms]", pathTraceTime.getAverage());
+                if (bufferTypeToDisplay == shared::BufferToDisplay::DenoisedBeauty)
+                    ImGui::Text("  Denoise: %.3f [ms]", denoiseTime.getAverage());
+
+                ImGui::Text("%u [spp]", std::min(numAccumFrames + 1, (1u << log2MaxNumAccums)));
+
+                ImGui::End();
+            }
         }
 
         applyToneMapAndGammaCorrection =
@@ -1886,20 +1738,8 @@ int32_t main(int32_t argc, const char* argv[]) try {
 
         // JP: 各インスタンスのトランスフォームを更新する。
         // EN: Update the transform of each instance.
-        if (animate || lastFrameWasAnimated) {
-            cudau::TypedBuffer<shared::InstanceData> &curInstDataBuffer = scene.instDataBuffer[bufferIndex];
-            shared::InstanceData* instDataBufferOnHost = curInstDataBuffer.map();
-            for (int i = 0; i < scene.instControllers.size(); ++i) {
-                InstanceController* controller = scene.instControllers[i];
-                Instance* inst = controller->inst;
-                shared::InstanceData &instData = instDataBufferOnHost[inst->instSlot];
-                controller->update(instDataBufferOnHost, animate ? 1.0f / 60.0f : 0.0f);
-                // TODO: まとめて送る。
-                CUDADRV_CHECK(cuMemcpyHtoDAsync(curInstDataBuffer.getCUdeviceptrAt(inst->instSlot),
-                                                &instData, sizeof(instData), curCuStream));
-            }
-            curInstDataBuffer.unmap();
-        }
+        if (animate || lastFrameWasAnimated)
+            scene.updateInstances(curCuStream, bufferIndex, animate ? 1.0f / 60.0f : 0.0f);
 
         // JP: IASのリビルドを行う。
         // EN: Rebuild the IAS.
@@ -1935,6 +1775,10 @@ int32_t main(int32_t argc, const char* argv[]) try {
         // EN: Compute the probability texture for light instances.
         curGPUTimer.computePDFTexture.start(curCuStream);
         {
+            // JP: 放射輝度などに変更があったジオメトリーインスタンスとインスタンスの分布のみを再計算する。
+            // EN: Recompute only the distributions of geometry instances and instances with changes such as emittance.
+            scene.setupLightGeomDistributions(curCuStream);
+
             CUdeviceptr probTexAddr =
                 staticPlpOnDevice + offsetof(shared::StaticPipelineLaunchParameters, lightInstDist);
             scene.setupLightInstDistribution(curCuStream, probTexAddr, bufferIndex);
@@ -1993,6 +1837,26 @@ int32_t main(int32_t argc, const char* argv[]) try {
         // EN: Build multiple reservoirs per cell.
         //     Then combine reservoirs between the current cell and
         //     the cell from the previous frame.
+        // JP: あらかじめライトを複数回サンプリングしたサブセットを複数個作成しておく。
+        //     セルごとのReservoir構築では、あるサブセット中からのサンプリングに限定されることで
+        //     光源の分布をたどる回数が減り、メモリアクセスのコヒーレンシーも向上する。
+        //     光源が静的でプールの使い回しが有効な場合は前のフレームのプールをそのまま使う。
+        // EN: Create multiple light subsets each of which samples lights multiple times.
+        //     Per-cell reservoir building is limited to sampling from a subset, reducing traversals of
+        //     the light distribution and improving memory access coherency.
+        //     Use the pool of the previous frame as is when lights are static and pool reuse is enabled.
+        curGPUTimer.performPreSamplingLights.start(curCuStream);
+        if (useReGIR) {
+            preSampledLightPool.setReuseForStaticLights(reuseLightPoolForStaticLights);
+            bool lightsChanged = animate || lastFrameWasAnimated || newSequence;
+            if (preSampledLightPool.beginFrame(lightsChanged)) {
+                gpuEnv.kernelPerformLightPreSampling(
+                    curCuStream,
+                    gpuEnv.kernelPerformLightPreSampling.calcGridDim(preSampledLightPool.getNumLights()));
+            }
+        }
+        curGPUTimer.performPreSamplingLights.stop(curCuStream);
+
         curGPUTimer.buildCellReservoirs.start(curCuStream);
         if (useReGIR) {
             if (enableTemporalReuse && !newSequence)
@@ -2111,6 +1975,15 @@ int32_t main(int32_t argc, const char* argv[]) try {
 
         streamChain.swap();
 
+        // JP: ヘッドレスモードでは表示を省略する。
+        // EN: Skip presentation in the headless mode.
+        if (g_benchmarkConfig.headless) {
+            if (buildGUI)
+                ImGui::EndFrame();
+            ++frameIndex;
+            continue;
+        }
+
 
 
         // ----------------------------------------------------------------
@@ -2156,6 +2029,11 @@ int32_t main(int32_t argc, const char* argv[]) try {
     }
 
     streamChain.waitAllWorkDone();
+    if (g_benchmarkConfig.headless) {
+        if (benchmarkReport.writeJSON(
+            g_benchmarkConfig.reportFile, "regir", renderTargetSizeX, renderTargetSizeY))
+            hpprintf("Benchmark report: %s\n", g_benchmarkConfig.reportFile.string().c_str());
+    }
     gpuTimers[1].finalize();
     gpuTimers[0].finalize();
 
@@ -2189,6 +2067,8 @@ int32_t main(int32_t argc, const char* argv[]) try {
     
     finalizeScreenRelatedBuffers();
 
+    preSampledLightPool.finalize();
+
     finalizeReservoirs();
 
 
@@ -2198,8 +2078,13 @@ int32_t main(int32_t argc, const char* argv[]) try {
         cuTexObjectDestroy(envLightTexture);
     envLightArray.finalize();
 
+    scene.textureLoader = nullptr;
+    textureLoader.finalize();
+
     finalizeTextureCaches();
 
+    frameCapturer.finalize();
+
     streamChain.finalize();
 
     scene.finalize();
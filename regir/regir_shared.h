@@ -84,6 +84,9 @@ namespace shared {
         unsigned int atInfinity : 1;
     };
 
+    using PreSampledLight = PreSampledLightTemplate<LightSample>;
+    using PreSampledLightPool = PreSampledLightPoolTemplate<LightSample>;
+
     using WeightSum = float;
     //using WeightSum = FloatSum;
 
@@ -190,6 +193,7 @@ namespace shared {
         RWBuffer<Reservoir<LightSample>> reservoirs[2];
         RWBuffer<ReservoirInfo> reservoirInfos[2];
         RWBuffer<PCG32RNG> lightSlotRngs;
+        PreSampledLightPool preSampledLightPool;
         RWBuffer<uint32_t> perCellNumAccesses;
         RWBuffer<uint32_t> lastAccessFrameIndices;
         Point3D gridOrigin;
@@ -199,7 +203,7 @@ namespace shared {
         ROBuffer<MaterialData> materialDataBuffer;
         ROBuffer<GeometryInstanceData> geometryInstanceDataBuffer;
         LightDistribution lightInstDist;
-        RegularConstantContinuousDistribution2D envLightImportanceMap;
+        EnvLightImportanceMap envLightImportanceMap;
         CUtexObject envLightTexture;
 
         optixu::NativeBlockBuffer2D<float4> beautyAccumBuffer;
@@ -5,38 +5,23 @@ using namespace shared;
 
 CUDA_DEVICE_KERNEL void performLightPreSampling() {
     uint32_t linearThreadIndex = blockDim.x * blockIdx.x + threadIdx.x;
-    //uint32_t subsetIndex = linearThreadIndex / lightSubsetSize;
-    uint32_t indexInSubset = linearThreadIndex % lightSubsetSize;
-    PCG32RNG rng = plp.s->lightPreSamplingRngs[linearThreadIndex];
+    PreSampledLightPool &pool = plp.s->preSampledLightPool;
+    if (linearThreadIndex >= pool.getNumLights())
+        return;
 
     // JP: 環境光テクスチャーが設定されている場合は一定の確率でサンプルする。
-    //     ダイバージェンスを抑えるために、サブセットの最初とそれ以外で環境光かそれ以外のサンプリングを分ける。
     // EN: Sample an environmental light texture with a fixed probability if it is set.
-    //     Separate sampling from the environmental light and the others to
-    //     the beginning of the subset and the rest to avoid divergence.
-    float probToSampleCurLightType = 1.0f;
-    bool sampleEnvLight = false;
-    if (plp.s->envLightTexture && plp.f->enableEnvLight) {
-        if (plp.s->lightInstDist.integral() > 0.0f) {
-            sampleEnvLight = indexInSubset < probToSampleEnvLight * lightSubsetSize;
-            //sampleEnvLight = subsetIndex < probToSampleEnvLight * numLightSubsets;
-            probToSampleCurLightType = sampleEnvLight ?
-                probToSampleEnvLight : (1 - probToSampleEnvLight);
-        }
-        else {
-            sampleEnvLight = true;
-        }
-    }
-
-    PreSampledLight preSampledLight;
-    sampleLight<false>(
-        Point3D(0.0f),
-        rng.getFloat0cTo1o(), sampleEnvLight, rng.getFloat0cTo1o(), rng.getFloat0cTo1o(),
-        &preSampledLight.sample, &preSampledLight.areaPDensity);
-    preSampledLight.areaPDensity *= probToSampleCurLightType;
-
-    plp.s->lightPreSamplingRngs[linearThreadIndex] = rng;
-    plp.s->preSampledLights[linearThreadIndex] = preSampledLight;
+    bool hasEnvLight = plp.s->envLightTexture && plp.f->enableEnvLight;
+    bool hasAreaLights = plp.s->lightInstDist.integral() > 0.0f;
+    preSampleLight(
+        pool, linearThreadIndex, hasEnvLight, hasAreaLights, probToSampleEnvLight,
+        [](float ul, bool sampleEnvLight, float u0, float u1,
+           LightSample* lightSample, float* areaPDensity) {
+            sampleLight<false>(
+                Point3D(0.0f),
+                ul, sampleEnvLight, u0, u1,
+                lightSample, areaPDensity);
+        });
 }
 
 
@@ -57,13 +42,14 @@ CUDA_DEVICE_KERNEL void performPerPixelRIS() {
 
     // JP: タイルごとに共通のライトサブセットを選択することでメモリアクセスのコヒーレンシーを改善する。
     // EN: Select a common light subset for each tile to improve memory access coherency.
+    const PreSampledLightPool &lightPool = plp.s->preSampledLightPool;
     PCG32RNG rng = plp.s->rngBuffer.read(launchIndex);
     CUDA_SHARED_MEM uint32_t sm_perTileLightSubsetIndex;
     if (threadIdx.x == 0 && threadIdx.y == 0)
-        sm_perTileLightSubsetIndex = mapPrimarySampleToDiscrete(rng.getFloat0cTo1o(), numLightSubsets);
+        sm_perTileLightSubsetIndex = lightPool.sampleSubset(rng.getFloat0cTo1o());
     __syncthreads();
     uint32_t perTileLightSubsetIndex = sm_perTileLightSubsetIndex;
-    const PreSampledLight* lightSubSet = &plp.s->preSampledLights[perTileLightSubsetIndex * lightSubsetSize];
+    const PreSampledLight* lightSubSet = lightPool.getSubset(perTileLightSubsetIndex);
 
     if (materialSlot == 0xFFFFFFFF)
         return;
@@ -92,7 +78,7 @@ CUDA_DEVICE_KERNEL void performPerPixelRIS() {
     float selectedTargetDensity = 0.0f;
     uint32_t numCandidates = 1 << plp.f->log2NumCandidateSamples;
     for (int i = 0; i < numCandidates; ++i) {
-        uint32_t lightIndex = mapPrimarySampleToDiscrete(rng.getFloat0cTo1o(), lightSubsetSize);
+        uint32_t lightIndex = mapPrimarySampleToDiscrete(rng.getFloat0cTo1o(), lightPool.subsetSize);
         const PreSampledLight &preSampledLight = lightSubSet[lightIndex];
 
         // JP: 候補サンプルを生成して、ターゲットPDFを計算する。
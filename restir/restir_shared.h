@@ -5,8 +5,6 @@
 namespace shared {
     static constexpr float probToSampleEnvLight = 0.25f;
 
-    static constexpr uint32_t numLightSubsets = 128;
-    static constexpr uint32_t lightSubsetSize = 1024;
     static constexpr int tileSizeX = 8;
     static constexpr int tileSizeY = 8;
 
@@ -86,10 +84,8 @@ namespace shared {
         unsigned int atInfinity : 1;
     };
 
-    struct PreSampledLight {
-        LightSample sample;
-        float areaPDensity;
-    };
+    using PreSampledLight = PreSampledLightTemplate<LightSample>;
+    using PreSampledLightPool = PreSampledLightPoolTemplate<LightSample>;
 
     using WeightSum = float;
     //using WeightSum = FloatSum;
@@ -198,13 +194,12 @@ namespace shared {
         ROBuffer<MaterialData> materialDataBuffer;
         ROBuffer<GeometryInstanceData> geometryInstanceDataBuffer;
         LightDistribution lightInstDist;
-        RegularConstantContinuousDistribution2D envLightImportanceMap;
+        EnvLightImportanceMap envLightImportanceMap;
         CUtexObject envLightTexture;
 
         // only for rearchitected ver.
         int2 numTiles;
-        RWBuffer<PCG32RNG> lightPreSamplingRngs;
-        RWBuffer<PreSampledLight> preSampledLights;
+        PreSampledLightPool preSampledLightPool;
 
         optixu::BlockBuffer2D<Reservoir<LightSample>, 0> reservoirBuffer[2];
         optixu::NativeBlockBuffer2D<ReservoirInfo> reservoirInfoBuffer[2];
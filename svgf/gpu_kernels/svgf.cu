@@ -3,30 +3,6 @@
 
 using namespace shared;
 
-CUDA_DEVICE_FUNCTION CUDA_INLINE float calcDepthWeight(
-    float nbDepth, float depth,
-    float dzdx, float dzdy, int32_t dx, int32_t dy) {
-    constexpr float sigma_z = 1.0f;
-    constexpr float eps = 1e-6f;
-    return std::exp(-std::fabs(nbDepth - depth) / (sigma_z * std::fabs(dzdx * dx + dzdy * dy) + eps));
-}
-
-CUDA_DEVICE_FUNCTION CUDA_INLINE float calcNormalWeight(
-    const Normal3D &nbNormal, const Normal3D &normal) {
-    constexpr float sigma_n = 128;
-    return std::pow(std::fmax(0.0f, dot(nbNormal, normal)), sigma_n);
-}
-
-CUDA_DEVICE_FUNCTION CUDA_INLINE float calcLuminanceWeight(
-    float nbLuminance, float luminance,
-    float localMeanStdDev) {
-    constexpr float sigma_l = 4.0f;
-    constexpr float eps = 1e-6f;
-    return std::exp(-std::fabs(nbLuminance - luminance) / (sigma_l * localMeanStdDev + eps));
-}
-
-
-
 CUDA_DEVICE_FUNCTION CUDA_INLINE void estimateVariance_generic() {
     const auto glPix = [](int2 pix) {
         return make_int2(pix.x, plp.s->imageSize.y - 1 - pix.y);
@@ -47,6 +23,16 @@ CUDA_DEVICE_FUNCTION CUDA_INLINE void estimateVariance_generic() {
         plp.f->temporalSets[curBufIdx];
 
     uint32_t matSlot = perFrameTemporalSet.GBuffer2.read(glPix(pix)).materialSlot;
+
+    // JP: タイル化したà-trousフィルターが全ステージで使うガイドを背景を含めて書き込んでおく。
+    // EN: Write the guide which the tiled à-trous filter uses at all stages including the background.
+    plp.s->aTrousGuideBuffer.write(
+        pix,
+        ATrousGuide(
+            perFrameTemporalSet.depthBuffer.read(glPix(pix)),
+            perFrameTemporalSet.GBuffer1.read(glPix(pix)).normalInWorld,
+            matSlot == 0xFFFFFFFF));
+
     if (matSlot == 0xFFFFFFFF)
         return;
 
@@ -134,89 +120,6 @@ CUDA_DEVICE_KERNEL void estimateVariance() {
 
 
 
-enum ATrousKernelType {
-    ATrousKernelType_Box3x3 = 0,
-    ATrousKernelType_Gauss3x3,
-    ATrousKernelType_Gauss5x5,
-};
-
-template <ATrousKernelType kernelType>
-struct ATrousKernel {};
-
-template <>
-struct ATrousKernel<ATrousKernelType_Box3x3> {
-    CUDA_DEVICE_FUNCTION constexpr static float Weights(uint32_t idx) {
-        constexpr float _Weights[] = {
-            1, 1, 1,
-            1, 1, 1,
-            1, 1, 1,
-        };
-        return _Weights[idx];
-    }
-    CUDA_DEVICE_FUNCTION constexpr static int2 Offsets(uint32_t idx) {
-        constexpr int2 _Offsets[] = {
-            int2{-1, -1}, int2{0, -1}, int2{1, -1},
-            int2{-1,  0}, int2{0,  0}, int2{1,  0},
-            int2{-1,  1}, int2{0,  1}, int2{1,  1},
-        };
-        return _Offsets[idx];
-    }
-    CUDA_DEVICE_FUNCTION constexpr static uint32_t Size() {
-        return 9;
-    }
-    static constexpr uint32_t centerIndex = 4;
-};
-template <>
-struct ATrousKernel<ATrousKernelType_Gauss3x3> {
-    CUDA_DEVICE_FUNCTION constexpr static float Weights(uint32_t idx) {
-        constexpr float _Weights[] = {
-            1 / 16.0f, 1 / 8.0f, 1 / 16.0f,
-            1 / 8.0f, 1 / 4.0f, 1 / 8.0f,
-            1 / 16.0f, 1 / 8.0f, 1 / 16.0f,
-        };
-        return _Weights[idx];
-    }
-    CUDA_DEVICE_FUNCTION constexpr static int2 Offsets(uint32_t idx) {
-        constexpr int2 _Offsets[] = {
-            int2{-1, -1}, int2{0, -1}, int2{1, -1},
-            int2{-1,  0}, int2{0,  0}, int2{1,  0},
-            int2{-1,  1}, int2{0,  1}, int2{1,  1},
-        };
-        return _Offsets[idx];
-    }
-    CUDA_DEVICE_FUNCTION constexpr static uint32_t Size() {
-        return 9;
-    }
-    static constexpr uint32_t centerIndex = 4;
-};
-template <>
-struct ATrousKernel<ATrousKernelType_Gauss5x5> {
-    CUDA_DEVICE_FUNCTION constexpr static float Weights(uint32_t idx) {
-        constexpr float _Weights[] = {
-            1 / 256.0f,  4 / 256.0f,  6 / 256.0f,  4 / 256.0f, 1 / 256.0f,
-            4 / 256.0f, 16 / 256.0f, 24 / 256.0f, 16 / 256.0f, 4 / 256.0f,
-            6 / 256.0f, 24 / 256.0f, 36 / 256.0f, 24 / 256.0f, 6 / 256.0f,
-            4 / 256.0f, 16 / 256.0f, 24 / 256.0f, 16 / 256.0f, 4 / 256.0f,
-            1 / 256.0f,  4 / 256.0f,  6 / 256.0f,  4 / 256.0f, 1 / 256.0f,
-        };
-        return _Weights[idx];
-    }
-    CUDA_DEVICE_FUNCTION constexpr static int2 Offsets(uint32_t idx) {
-        constexpr int2 _Offsets[] = {
-            int2{-2, -2}, int2{-1, -2}, int2{0, -2}, int2{1, -2}, int2{2, -2},
-            int2{-2, -1}, int2{-1, -1}, int2{0, -1}, int2{1, -1}, int2{2, -1},
-            int2{-2,  0}, int2{-1,  0}, int2{0,  0}, int2{1,  0}, int2{2,  0},
-            int2{-2,  1}, int2{-1,  1}, int2{0,  1}, int2{1,  1}, int2{2,  1},
-            int2{-2,  2}, int2{-1,  2}, int2{0,  2}, int2{1,  2}, int2{2,  2},
-        };
-        return _Offsets[idx];
-    }
-    CUDA_DEVICE_FUNCTION constexpr static uint32_t Size() {
-        return 25;
-    }
-    static constexpr uint32_t centerIndex = 12;
-};
-
 template <ATrousKernelType kernelType>
 CUDA_DEVICE_FUNCTION void applyATrousFilter_generic(uint32_t filterStageIndex) {
     int2 launchIndex = make_int2(blockDim.x * blockIdx.x + threadIdx.x,
@@ -227,14 +130,7 @@ CUDA_DEVICE_FUNCTION void applyATrousFilter_generic(uint32_t filterStageIndex) {
     if (!valid)
         return;
 
-    constexpr int32_t stepWidths[] = {
-#if 1
-        1, 2, 4, 8, 16,
-#else
-        1, 2, 5, 11, 24
-#endif
-    };
-    const int32_t stepWidth = stepWidths[filterStageIndex];
+    const int32_t stepWidth = getATrousStepWidth(filterStageIndex);
 
     uint32_t curBufIdx = plp.f->bufferIndex;
     //const StaticPipelineLaunchParameters::TemporalSet &staticTemporalSet =
@@ -353,6 +249,94 @@ CUDA_DEVICE_KERNEL void applyATrousFilter_box3x3(uint32_t filterStageIndex) {
 
 
 
+// JP: applyATrousFilter_generic()のタイル版。
+//     ブロックがタイルとエプロンのガイド、タイル周囲1ピクセルまでの分散をシェアードメモリーに一度だけ読み込み、
+//     G-Bufferを近傍ごとに読み直す代わりにタイル内の全スレッドで共有する。
+//     ブロックサイズはaTrousTileSize x aTrousTileSize、動的シェアードメモリーのサイズは
+//     pow2(getATrousGuideTileWidth()) * sizeof(ATrousGuide)でなければならない。
+// EN: Tiled version of applyATrousFilter_generic().
+//     A block loads the guide of the tile and its apron, and the variance up to a pixel around the tile
+//     into shared memory only once, then all threads in the tile share them
+//     instead of re-reading the G-buffers for each neighbor.
+//     The block size must be aTrousTileSize x aTrousTileSize,
+//     and the dynamic shared memory size must be pow2(getATrousGuideTileWidth()) * sizeof(ATrousGuide).
+template <ATrousKernelType kernelType>
+CUDA_DEVICE_FUNCTION void applyATrousFilter_tiled_generic(uint32_t filterStageIndex) {
+    // JP: ATrousGuideはコンストラクターを持つので生のメモリーとして宣言する。
+    // EN: Declare as raw memory since ATrousGuide has constructors.
+    extern __shared__ uint2 s_guideTileMemory[];
+    __shared__ float s_varianceTile[pow2(aTrousVarianceTileWidth)];
+    ATrousGuide* const guideTile = reinterpret_cast<ATrousGuide*>(s_guideTileMemory);
+
+    int2 imageSize = plp.s->imageSize;
+    int2 tileOrigin = make_int2(aTrousTileSize * blockIdx.x, aTrousTileSize * blockIdx.y);
+    const int32_t threadIndex = threadIdx.y * aTrousTileSize + threadIdx.x;
+    constexpr int32_t numThreads = pow2(aTrousTileSize);
+
+    optixu::NativeBlockBuffer2D<Lighting_Variance> &src_lighting_variance_buffer =
+        plp.s->lighting_variance_buffers[filterStageIndex % 2];
+    optixu::NativeBlockBuffer2D<Lighting_Variance> &dst_lighting_variance_buffer =
+        plp.s->lighting_variance_buffers[(filterStageIndex + 1) % 2];
+
+    // JP: 画像外のガイドは背景として扱う。近傍は画像内に限られるので参照されることはない。
+    // EN: Treat the guide outside the image as background.
+    //     Neighbors are limited inside the image so it is never referenced.
+    const int32_t apronWidth = getATrousGuideApronWidth<kernelType>(filterStageIndex);
+    const int32_t guideTileWidth = getATrousGuideTileWidth<kernelType>(filterStageIndex);
+    for (int32_t i = threadIndex; i < pow2(guideTileWidth); i += numThreads) {
+        int2 tilePix = make_int2(tileOrigin.x - apronWidth + i % guideTileWidth,
+                                 tileOrigin.y - apronWidth + i / guideTileWidth);
+        bool inImage = tilePix.x >= 0 && tilePix.y >= 0 && tilePix.x < imageSize.x && tilePix.y < imageSize.y;
+        guideTile[i] = inImage ?
+            plp.s->aTrousGuideBuffer.read(tilePix) :
+            ATrousGuide(1.0f, Normal3D(0, 0, 1), true);
+    }
+    for (int32_t i = threadIndex; i < pow2(aTrousVarianceTileWidth); i += numThreads) {
+        int2 tilePix = make_int2(clamp(tileOrigin.x - 1 + i % aTrousVarianceTileWidth, 0, imageSize.x - 1),
+                                 clamp(tileOrigin.y - 1 + i / aTrousVarianceTileWidth, 0, imageSize.y - 1));
+        s_varianceTile[i] = src_lighting_variance_buffer.read(tilePix).variance;
+    }
+    __syncthreads();
+
+    int2 pix = make_int2(tileOrigin.x + threadIdx.x, tileOrigin.y + threadIdx.y);
+    bool valid = pix.x >= 0 && pix.y >= 0 && pix.x < imageSize.x && pix.y < imageSize.y;
+    if (!valid)
+        return;
+
+    const int32_t guideTileCenter = (threadIdx.y + apronWidth) * guideTileWidth + threadIdx.x + apronWidth;
+    const ATrousGuide guide = guideTile[guideTileCenter];
+    if (guide.isBackground())
+        return;
+
+    Lighting_Variance src_lighting_var = src_lighting_variance_buffer.read(pix);
+    if (filterStageIndex == 0 && !plp.f->feedback1stFilteredResult)
+        plp.s->prevNoisyLightingBuffer.write(pix, src_lighting_var);
+
+    const int32_t varianceTileCenter = (threadIdx.y + 1) * aTrousVarianceTileWidth + threadIdx.x + 1;
+    Lighting_Variance dst_lighting_var = applyATrousFilterWithGuide<kernelType>(
+        filterStageIndex, pix, imageSize, guide, src_lighting_var,
+        [&](const int2 &offset) {
+            return guideTile[guideTileCenter + offset.y * guideTileWidth + offset.x];
+        },
+        [&](const int2 &offset) {
+            return s_varianceTile[varianceTileCenter + offset.y * aTrousVarianceTileWidth + offset.x];
+        },
+        [&](const int2 &nbPix) {
+            return src_lighting_variance_buffer.read(nbPix);
+        });
+
+    dst_lighting_variance_buffer.write(pix, dst_lighting_var);
+
+    if (filterStageIndex == 0 && plp.f->feedback1stFilteredResult)
+        plp.s->prevNoisyLightingBuffer.write(pix, dst_lighting_var);
+}
+
+CUDA_DEVICE_KERNEL void applyATrousFilter_box3x3_tiled(uint32_t filterStageIndex) {
+    applyATrousFilter_tiled_generic<ATrousKernelType_Box3x3>(filterStageIndex);
+}
+
+
+
 // for the case where SVGF is disabled and temporal accumulation is enabled.
 CUDA_DEVICE_KERNEL void feedbackNoisyLighting() {
     int2 launchIndex = make_int2(
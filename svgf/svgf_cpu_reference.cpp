@@ -0,0 +1,905 @@
+﻿#include "svgf_cpu_reference.h"
+
+using namespace shared;
+
+// JP: ダンプファイルの形式。ヘッダーの後に各バッファーをSVGFFrameDumpのメンバー順にそのまま並べる。
+// EN: File format of the dump. Each buffer follows the header as is in the member order of SVGFFrameDump.
+static constexpr char svgfFrameDumpMagic[8] = { 'G', 'F', 'X', 'S', 'V', 'G', 'F', 'D' };
+static constexpr uint32_t svgfFrameDumpVersion = 1;
+
+enum SVGFFrameDumpFlag {
+    SVGFFrameDumpFlag_Feedback1stFilteredResult = 1 << 0,
+    SVGFFrameDumpFlag_EnableTemporalAA = 1 << 1,
+    SVGFFrameDumpFlag_ModulateAlbedo = 1 << 2,
+    SVGFFrameDumpFlag_IsFirstFrame = 1 << 3,
+    SVGFFrameDumpFlag_HasGPUResults = 1 << 4,
+    SVGFFrameDumpFlag_TiledATrousFilter = 1 << 5,
+};
+
+struct SVGFFrameDumpHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    uint32_t width;
+    uint32_t height;
+    uint32_t numFilteringStages;
+    uint32_t taaHistoryLength;
+    uint32_t flags;
+    uint32_t dummy[3];
+};
+
+static_assert(std::is_trivially_copyable_v<GBuffer0> &&
+              std::is_trivially_copyable_v<GBuffer1> &&
+              std::is_trivially_copyable_v<GBuffer2> &&
+              std::is_trivially_copyable_v<Albedo> &&
+              std::is_trivially_copyable_v<MomentPair_SampleInfo> &&
+              std::is_trivially_copyable_v<Lighting_Variance> &&
+              std::is_trivially_copyable_v<float4>,
+              "Types stored in the SVGF frame dump must be trivially copyable.");
+
+template <typename DumpType, typename Func>
+static void forEachDumpBuffer(DumpType &dump, bool withGPUResults, Func &&func) {
+    func(dump.gBuffer0);
+    func(dump.gBuffer1);
+    func(dump.gBuffer2);
+    func(dump.depthBuffer);
+    func(dump.albedoBuffer);
+    func(dump.momentPair_sampleInfo_buffer);
+    func(dump.noisyLightingBuffer);
+    func(dump.aTrousWorkBuffer);
+    func(dump.prevFinalLightingBuffer);
+    if (withGPUResults) {
+        func(dump.denoisedLightingBuffer);
+        func(dump.prevNoisyLightingBuffer);
+        func(dump.finalLightingBuffer);
+    }
+}
+
+void SVGFFrameDump::resize(uint32_t _width, uint32_t _height, bool withGPUResults) {
+    width = _width;
+    height = _height;
+    const size_t numPixels = static_cast<size_t>(width) * height;
+    forEachDumpBuffer(*this, true, [](auto &buffer) {
+        buffer.clear();
+    });
+    forEachDumpBuffer(*this, withGPUResults, [numPixels](auto &buffer) {
+        buffer.resize(numPixels);
+    });
+}
+
+bool SVGFFrameDump::write(const std::filesystem::path &filePath) const {
+    std::ofstream ofs(filePath, std::ios::binary);
+    if (!ofs)
+        return false;
+
+    SVGFFrameDumpHeader header = {};
+    std::copy_n(svgfFrameDumpMagic, sizeof(svgfFrameDumpMagic), header.magic);
+    header.version = svgfFrameDumpVersion;
+    header.headerSize = sizeof(SVGFFrameDumpHeader);
+    header.width = width;
+    header.height = height;
+    header.numFilteringStages = numFilteringStages;
+    header.taaHistoryLength = taaHistoryLength;
+    header.flags =
+        (feedback1stFilteredResult ? SVGFFrameDumpFlag_Feedback1stFilteredResult : 0) |
+        (enableTemporalAA ? SVGFFrameDumpFlag_EnableTemporalAA : 0) |
+        (modulateAlbedo ? SVGFFrameDumpFlag_ModulateAlbedo : 0) |
+        (isFirstFrame ? SVGFFrameDumpFlag_IsFirstFrame : 0) |
+        (hasGPUResults() ? SVGFFrameDumpFlag_HasGPUResults : 0) |
+        (tiledATrousFilter ? SVGFFrameDumpFlag_TiledATrousFilter : 0);
+    ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    forEachDumpBuffer(*this, hasGPUResults(), [&ofs](const auto &buffer) {
+        using T = typename std::remove_cvref_t<decltype(buffer)>::value_type;
+        ofs.write(reinterpret_cast<const char*>(buffer.data()), sizeof(T) * buffer.size());
+    });
+
+    return static_cast<bool>(ofs);
+}
+
+bool SVGFFrameDump::read(const std::filesystem::path &filePath) {
+    std::ifstream ifs(filePath, std::ios::binary);
+    if (!ifs)
+        return false;
+
+    SVGFFrameDumpHeader header;
+    ifs.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!ifs ||
+        !std::equal(svgfFrameDumpMagic, svgfFrameDumpMagic + sizeof(svgfFrameDumpMagic), header.magic) ||
+        header.version != svgfFrameDumpVersion ||
+        header.headerSize != sizeof(SVGFFrameDumpHeader) ||
+        header.width == 0 || header.height == 0 ||
+        header.numFilteringStages > maxNumFilteringStages)
+        return false;
+
+    const bool withGPUResults = (header.flags & SVGFFrameDumpFlag_HasGPUResults) != 0;
+    resize(header.width, header.height, withGPUResults);
+    numFilteringStages = header.numFilteringStages;
+    taaHistoryLength = header.taaHistoryLength;
+    feedback1stFilteredResult = (header.flags & SVGFFrameDumpFlag_Feedback1stFilteredResult) != 0;
+    enableTemporalAA = (header.flags & SVGFFrameDumpFlag_EnableTemporalAA) != 0;
+    modulateAlbedo = (header.flags & SVGFFrameDumpFlag_ModulateAlbedo) != 0;
+    isFirstFrame = (header.flags & SVGFFrameDumpFlag_IsFirstFrame) != 0;
+    tiledATrousFilter = (header.flags & SVGFFrameDumpFlag_TiledATrousFilter) != 0;
+
+    forEachDumpBuffer(*this, withGPUResults, [&ifs](auto &buffer) {
+        using T = typename std::remove_cvref_t<decltype(buffer)>::value_type;
+        ifs.read(reinterpret_cast<char*>(buffer.data()), sizeof(T) * buffer.size());
+    });
+    if (!ifs) {
+        resize(0, 0, false);
+        return false;
+    }
+
+    return true;
+}
+
+
+
+void SVGFReferenceFilter::setUp(uint32_t yBegin, uint32_t yEnd) {
+    const SVGFFrameDump &dump = *m_dump;
+    const bool hasWorkBuffer = !dump.aTrousWorkBuffer.empty();
+    for (int32_t y = yBegin; y < static_cast<int32_t>(yEnd); ++y) {
+        // JP: 余白を含めて行全体を初期化する。
+        // EN: Initialize the entire row including the margins.
+        const uint32_t rowBegin = y * m_stride;
+        std::fill_n(m_depth.data() + rowBegin, m_stride, 1.0f);
+        std::fill_n(m_normalX.data() + rowBegin, m_stride, 0.0f);
+        std::fill_n(m_normalY.data() + rowBegin, m_stride, 0.0f);
+        std::fill_n(m_normalZ.data() + rowBegin, m_stride, 0.0f);
+        for (uint32_t planeSetIdx = 0; planeSetIdx < 2; ++planeSetIdx) {
+            LightingPlanes &planes = m_lightingPlanes[planeSetIdx];
+            std::fill_n(planes.r.data() + rowBegin, m_stride, 0.0f);
+            std::fill_n(planes.g.data() + rowBegin, m_stride, 0.0f);
+            std::fill_n(planes.b.data() + rowBegin, m_stride, 0.0f);
+            std::fill_n(planes.variance.data() + rowBegin, m_stride, 0.0f);
+        }
+        std::fill_n(m_localMeanStdDev.data() + rowBegin, m_stride, 0.0f);
+
+        const uint32_t glRowBegin = glPix(make_int2(0, y)).y * m_width;
+        for (int32_t x = 0; x < static_cast<int32_t>(m_width); ++x) {
+            const uint32_t idx = planeIndex(x, y);
+            const uint32_t linearIndex = y * m_width + x;
+            const uint32_t glLinearIndex = glRowBegin + x;
+            m_depth[idx] = dump.depthBuffer[glLinearIndex];
+            const Normal3D &normal = dump.gBuffer1[glLinearIndex].normalInWorld;
+            m_normalX[idx] = normal.x;
+            m_normalY[idx] = normal.y;
+            m_normalZ[idx] = normal.z;
+            m_isForeground[linearIndex] = dump.gBuffer2[glLinearIndex].materialSlot != 0xFFFFFFFF;
+            if (!m_aTrousGuides.empty()) {
+                m_aTrousGuides[linearIndex] = ATrousGuide(
+                    m_depth[idx], normal, !m_isForeground[linearIndex]);
+            }
+
+            writeLighting(0, idx, dump.noisyLightingBuffer[linearIndex]);
+            if (hasWorkBuffer)
+                writeLighting(1, idx, dump.aTrousWorkBuffer[linearIndex]);
+            m_prevNoisyLighting[linearIndex] = dump.noisyLightingBuffer[linearIndex];
+        }
+    }
+}
+
+// JP: estimateVariance_generic()の移植。
+// EN: Port of estimateVariance_generic().
+void SVGFReferenceFilter::estimateVariance(uint32_t yBegin, uint32_t yEnd) {
+    const SVGFFrameDump &dump = *m_dump;
+    const int2 imageSize = make_int2(m_width, m_height);
+    for (int32_t y = yBegin; y < static_cast<int32_t>(yEnd); ++y) {
+        for (int32_t x = 0; x < imageSize.x; ++x) {
+            const int2 pix = make_int2(x, y);
+            if (!m_isForeground[y * m_width + x])
+                continue;
+
+            const MomentPair_SampleInfo &momentPair_sampleInfo =
+                dump.momentPair_sampleInfo_buffer[y * m_width + x];
+            float firstMoment = momentPair_sampleInfo.firstMoment;
+            float secondMoment = momentPair_sampleInfo.secondMoment;
+            const SampleInfo &sampleInfo = momentPair_sampleInfo.sampleInfo;
+
+            if (sampleInfo.count < 4) {
+                // JP: 空間的な分散推定へのフォールバック
+                // EN: Fallback to spatial estimate of variance
+                constexpr float filterKernel[] = {
+                    0.00598, 0.060626, 0.241843, 0.383103, 0.241843, 0.060626, 0.00598
+                };
+
+                constexpr float centerWeight = pow2(filterKernel[3]);
+                float sumFirstMoments = centerWeight * firstMoment;
+                float sumSecondMoments = centerWeight * secondMoment;
+
+                const uint32_t idx = planeIndex(pix.x, pix.y);
+                float depth = m_depth[idx];
+                int32_t dx = pix.x < imageSize.x / 2 ? 1 : -1;
+                int32_t dy = pix.y < imageSize.y / 2 ? 1 : -1;
+                float hnbDepth = m_depth[planeIndex(pix.x + dx, pix.y)];
+                float vnbDepth = m_depth[planeIndex(pix.x, pix.y + dy)];
+                float dzdx = (hnbDepth - depth) * dx;
+                float dzdy = (vnbDepth - depth) * dy;
+                Normal3D normal(m_normalX[idx], m_normalY[idx], m_normalZ[idx]);
+
+                // 7x7 Bilateral Filter driven by depth and normal.
+                float sumWeights = centerWeight;
+                for (int i = -3; i <= 3; ++i) {
+                    int nbPixY = pix.y + i;
+                    if (nbPixY < 0 || nbPixY >= imageSize.y)
+                        continue;
+                    float hy = filterKernel[i + 3];
+
+                    for (int j = -3; j <= 3; ++j) {
+                        int nbPixX = pix.x + j;
+                        if (nbPixX < 0 || nbPixX >= imageSize.x)
+                            continue;
+
+                        if (i == 0 && j == 0)
+                            continue;
+
+                        float hx = filterKernel[j + 3];
+
+                        const uint32_t nbIdx = planeIndex(nbPixX, nbPixY);
+                        float nbDepth = m_depth[nbIdx];
+                        if (nbDepth == 1.0f)
+                            continue;
+                        Normal3D nbNormal(m_normalX[nbIdx], m_normalY[nbIdx], m_normalZ[nbIdx]);
+
+                        float wz = calcDepthWeight(nbDepth, depth, dzdx, dzdy, j, i);
+                        float wn = calcNormalWeight(nbNormal, normal);
+                        float weight = hx * hy * wz * wn;
+
+                        const MomentPair_SampleInfo &nb_momentPair_sampleInfo =
+                            dump.momentPair_sampleInfo_buffer[nbPixY * m_width + nbPixX];
+                        sumFirstMoments += weight * nb_momentPair_sampleInfo.firstMoment;
+                        sumSecondMoments += weight * nb_momentPair_sampleInfo.secondMoment;
+                        sumWeights += weight;
+                    }
+                }
+                firstMoment = sumFirstMoments / sumWeights;
+                secondMoment = sumSecondMoments / sumWeights;
+            }
+
+            // V[X] = E[X^2] - E[X]^2
+            float variance = std::fmax(secondMoment - pow2(firstMoment), 0.0f);
+            m_lightingPlanes[0].variance[planeIndex(pix.x, pix.y)] = variance;
+        }
+    }
+}
+
+// JP: 安定化のため分散は3x3のガウシアンフィルターにかける。
+//     中心ピクセルの値しか使わないので、à-trousフィルターの前に行ごとに計算しておく。
+// EN: Apply 3x3 Gaussian filter to variance for stabilization.
+//     Only the value at the center pixel is used, so compute it per row before the à-trous filter.
+void SVGFReferenceFilter::computeLocalMeanStdDev(uint32_t filterStageIndex, int32_t y) {
+    const LightingPlanes &src = m_lightingPlanes[filterStageIndex % 2];
+    const int2 imageSize = make_int2(m_width, m_height);
+    constexpr float gaussKernel[] = {
+        1 / 4.0f, 1 / 2.0f, 1 / 4.0f
+    };
+    for (int32_t x = 0; x < imageSize.x; ++x) {
+        if (!m_isForeground[y * m_width + x])
+            continue;
+
+        float sumLocalVars = 0.0f;
+        float sumVarWeights = 0.0f;
+        for (int i = -1; i <= 1; ++i) {
+            int nbPixY = std::clamp(y + i, 0, imageSize.y - 1);
+            float hy = gaussKernel[i + 1];
+            for (int j = -1; j <= 1; ++j) {
+                int nbPixX = std::clamp(x + j, 0, imageSize.x - 1);
+                float hx = gaussKernel[j + 1];
+                float weight = hx * hy;
+                sumLocalVars += weight * src.variance[planeIndex(nbPixX, nbPixY)];
+                sumVarWeights += weight;
+            }
+        }
+        m_localMeanStdDev[planeIndex(x, y)] = std::sqrt(sumLocalVars / sumVarWeights);
+    }
+}
+
+// JP: applyATrousFilter_generic<ATrousKernelType_Box3x3>()の移植。
+// EN: Port of applyATrousFilter_generic<ATrousKernelType_Box3x3>().
+void SVGFReferenceFilter::applyATrousFilter(uint32_t filterStageIndex, int32_t x, int32_t y) {
+    const int2 imageSize = make_int2(m_width, m_height);
+    const int2 pix = make_int2(x, y);
+    const int32_t stepWidth = getATrousStepWidth(filterStageIndex);
+    const uint32_t srcSetIdx = filterStageIndex % 2;
+    const uint32_t dstSetIdx = (filterStageIndex + 1) % 2;
+
+    if (!m_isForeground[y * m_width + x])
+        return;
+
+    const uint32_t idx = planeIndex(pix.x, pix.y);
+    Lighting_Variance src_lighting_var = readLighting(srcSetIdx, idx);
+    if (filterStageIndex == 0 && !m_dump->feedback1stFilteredResult)
+        m_prevNoisyLighting[y * m_width + x] = src_lighting_var;
+    float luminance = sRGB_calcLuminance(src_lighting_var.noisyLighting);
+
+    float depth = m_depth[idx];
+    int32_t dx = pix.x < imageSize.x / 2 ? 1 : -1;
+    int32_t dy = pix.y < imageSize.y / 2 ? 1 : -1;
+    float hnbDepth = m_depth[planeIndex(pix.x + dx, pix.y)];
+    float vnbDepth = m_depth[planeIndex(pix.x, pix.y + dy)];
+    float dzdx = (hnbDepth - depth) * dx;
+    float dzdy = (vnbDepth - depth) * dy;
+    Normal3D normal(m_normalX[idx], m_normalY[idx], m_normalZ[idx]);
+
+    float localMeanStdDev = m_localMeanStdDev[idx];
+
+    using Kernel = ATrousKernel<ATrousKernelType_Box3x3>;
+    constexpr float centerWeight = Kernel::Weights(Kernel::centerIndex);
+    float sumWeights = centerWeight;
+    Lighting_Variance dst_lighting_var;
+    dst_lighting_var.denoisedLighting = centerWeight * src_lighting_var.noisyLighting;
+    dst_lighting_var.variance = pow2(centerWeight) * src_lighting_var.variance;
+    for (int i = 0; i < Kernel::Size(); ++i) {
+        if (i == Kernel::centerIndex)
+            continue;
+
+        int2 offset = make_int2(Kernel::Offsets(i).x * stepWidth, Kernel::Offsets(i).y * stepWidth);
+        int2 nbPix = make_int2(pix.x + offset.x, pix.y + offset.y);
+        if (nbPix.x < 0 || nbPix.x >= imageSize.x ||
+            nbPix.y < 0 || nbPix.y >= imageSize.y)
+            continue;
+
+        float h = Kernel::Weights(i);
+
+        const uint32_t nbIdx = planeIndex(nbPix.x, nbPix.y);
+        float nbDepth = m_depth[nbIdx];
+        if (nbDepth == 1.0f)
+            continue;
+        Normal3D nbNormal(m_normalX[nbIdx], m_normalY[nbIdx], m_normalZ[nbIdx]);
+
+        float wz = calcDepthWeight(nbDepth, depth, dzdx, dzdy, offset.x, offset.y);
+        float wn = calcNormalWeight(nbNormal, normal);
+
+        Lighting_Variance nb_lighting_var = readLighting(srcSetIdx, nbIdx);
+        float nbLuminance = sRGB_calcLuminance(nb_lighting_var.noisyLighting);
+        float wl = calcLuminanceWeight(nbLuminance, luminance, localMeanStdDev);
+
+        float weight = h * wz * wn * wl;
+        dst_lighting_var.denoisedLighting += weight * nb_lighting_var.noisyLighting;
+        dst_lighting_var.variance += pow2(weight) * nb_lighting_var.variance;
+        sumWeights += weight;
+    }
+    dst_lighting_var.denoisedLighting /= sumWeights;
+    dst_lighting_var.variance /= pow2(sumWeights);
+
+    writeLighting(dstSetIdx, idx, dst_lighting_var);
+
+    if (filterStageIndex == 0 && m_dump->feedback1stFilteredResult)
+        m_prevNoisyLighting[y * m_width + x] = dst_lighting_var;
+}
+
+// JP: 8ピクセルを各レーンに割り当てて、スカラー版と同じ順序で演算する。
+//     expは多項式近似、128乗は二乗の繰り返しで求めるので結果は数ULP異なり得る。
+//     近傍の列は余白に収まるので読み出し範囲の判定は行単位のみ。
+// EN: Assign 8 pixels to the lanes and compute in the same order as the scalar version.
+//     exp is approximated by a polynomial and the 128th power is computed by repeated squaring,
+//     so the results can differ by a few ULPs.
+//     Neighbor columns fit in the margins so only per-row bounds checks are needed.
+void SVGFReferenceFilter::applyATrousFilter_AVX2(uint32_t filterStageIndex, int32_t xBegin, int32_t y) {
+    const int2 imageSize = make_int2(m_width, m_height);
+    const int32_t stepWidth = getATrousStepWidth(filterStageIndex);
+    const LightingPlanes &src = m_lightingPlanes[filterStageIndex % 2];
+    LightingPlanes &dst = m_lightingPlanes[(filterStageIndex + 1) % 2];
+
+    const __m128i fgBytes = _mm_loadl_epi64(
+        reinterpret_cast<const __m128i*>(m_isForeground.data() + y * m_width + xBegin));
+    const __m256 fgMask = _mm256_castsi256_ps(
+        _mm256_cmpgt_epi32(_mm256_cvtepu8_epi32(fgBytes), _mm256_setzero_si256()));
+    const int32_t fgBits = _mm256_movemask_ps(fgMask);
+    if (fgBits == 0)
+        return;
+
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+    const __m256 eps = _mm256_set1_ps(1e-6f);
+    const __m256 lumR = _mm256_set1_ps(0.2126729f);
+    const __m256 lumG = _mm256_set1_ps(0.7151522f);
+    const __m256 lumB = _mm256_set1_ps(0.0721750f);
+
+    const uint32_t idx = planeIndex(xBegin, y);
+    const __m256 r = _mm256_loadu_ps(src.r.data() + idx);
+    const __m256 g = _mm256_loadu_ps(src.g.data() + idx);
+    const __m256 b = _mm256_loadu_ps(src.b.data() + idx);
+    const __m256 variance = _mm256_loadu_ps(src.variance.data() + idx);
+    const __m256 luminance = _mm256_add_ps(
+        _mm256_add_ps(_mm256_mul_ps(lumR, r), _mm256_mul_ps(lumG, g)),
+        _mm256_mul_ps(lumB, b));
+
+    // JP: 水平方向の隣接ピクセルはレーンごとに画像の中心に向かう側を選ぶ。
+    // EN: Choose the horizontal neighbor on the side toward the image center for each lane.
+    const __m256 depth = _mm256_loadu_ps(m_depth.data() + idx);
+    const __m256i laneX = _mm256_add_epi32(
+        _mm256_set1_epi32(xBegin), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    const __m256 toRight = _mm256_castsi256_ps(
+        _mm256_cmpgt_epi32(_mm256_set1_epi32(imageSize.x / 2), laneX));
+    const __m256 dx = _mm256_blendv_ps(_mm256_set1_ps(-1.0f), one, toRight);
+    const int32_t dy = y < imageSize.y / 2 ? 1 : -1;
+    const __m256 hnbDepth = _mm256_blendv_ps(
+        _mm256_loadu_ps(m_depth.data() + idx - 1), _mm256_loadu_ps(m_depth.data() + idx + 1), toRight);
+    const __m256 vnbDepth = _mm256_loadu_ps(m_depth.data() + planeIndex(xBegin, y + dy));
+    const __m256 dzdx = _mm256_mul_ps(_mm256_sub_ps(hnbDepth, depth), dx);
+    const __m256 dzdy = _mm256_mul_ps(_mm256_sub_ps(vnbDepth, depth), _mm256_set1_ps(static_cast<float>(dy)));
+    const __m256 normalX = _mm256_loadu_ps(m_normalX.data() + idx);
+    const __m256 normalY = _mm256_loadu_ps(m_normalY.data() + idx);
+    const __m256 normalZ = _mm256_loadu_ps(m_normalZ.data() + idx);
+
+    const __m256 lumDenom = _mm256_add_ps(
+        _mm256_mul_ps(_mm256_set1_ps(4.0f), _mm256_loadu_ps(m_localMeanStdDev.data() + idx)), eps);
+
+    using Kernel = ATrousKernel<ATrousKernelType_Box3x3>;
+    constexpr float centerWeight = Kernel::Weights(Kernel::centerIndex);
+    __m256 sumWeights = _mm256_set1_ps(centerWeight);
+    __m256 sumR = _mm256_mul_ps(_mm256_set1_ps(centerWeight), r);
+    __m256 sumG = _mm256_mul_ps(_mm256_set1_ps(centerWeight), g);
+    __m256 sumB = _mm256_mul_ps(_mm256_set1_ps(centerWeight), b);
+    __m256 sumVariance = _mm256_mul_ps(_mm256_set1_ps(pow2(centerWeight)), variance);
+    for (int i = 0; i < Kernel::Size(); ++i) {
+        if (i == Kernel::centerIndex)
+            continue;
+
+        const int2 offset = make_int2(Kernel::Offsets(i).x * stepWidth, Kernel::Offsets(i).y * stepWidth);
+        const int32_t nbPixY = y + offset.y;
+        if (nbPixY < 0 || nbPixY >= imageSize.y)
+            continue;
+
+        const uint32_t nbIdx = planeIndex(xBegin + offset.x, nbPixY);
+        const __m256 nbDepth = _mm256_loadu_ps(m_depth.data() + nbIdx);
+        const __m256 valid = _mm256_andnot_ps(_mm256_cmp_ps(nbDepth, one, _CMP_EQ_OQ), fgMask);
+        if (_mm256_movemask_ps(valid) == 0)
+            continue;
+
+        // wz
+        const __m256 depthDenom = _mm256_add_ps(
+            _mm256_and_ps(
+                _mm256_add_ps(
+                    _mm256_mul_ps(dzdx, _mm256_set1_ps(static_cast<float>(offset.x))),
+                    _mm256_mul_ps(dzdy, _mm256_set1_ps(static_cast<float>(offset.y)))),
+                absMask),
+            eps);
+        const __m256 wz = exp_AVX2(_mm256_div_ps(
+            _mm256_xor_ps(_mm256_and_ps(_mm256_sub_ps(nbDepth, depth), absMask), _mm256_set1_ps(-0.0f)),
+            depthDenom));
+
+        // wn
+        const __m256 nbNormalX = _mm256_loadu_ps(m_normalX.data() + nbIdx);
+        const __m256 nbNormalY = _mm256_loadu_ps(m_normalY.data() + nbIdx);
+        const __m256 nbNormalZ = _mm256_loadu_ps(m_normalZ.data() + nbIdx);
+        __m256 wn = _mm256_max_ps(
+            _mm256_add_ps(
+                _mm256_add_ps(_mm256_mul_ps(nbNormalX, normalX), _mm256_mul_ps(nbNormalY, normalY)),
+                _mm256_mul_ps(nbNormalZ, normalZ)),
+            zero);
+        for (int k = 0; k < 7; ++k)
+            wn = _mm256_mul_ps(wn, wn);
+
+        // wl
+        const __m256 nbR = _mm256_loadu_ps(src.r.data() + nbIdx);
+        const __m256 nbG = _mm256_loadu_ps(src.g.data() + nbIdx);
+        const __m256 nbB = _mm256_loadu_ps(src.b.data() + nbIdx);
+        const __m256 nbVariance = _mm256_loadu_ps(src.variance.data() + nbIdx);
+        const __m256 nbLuminance = _mm256_add_ps(
+            _mm256_add_ps(_mm256_mul_ps(lumR, nbR), _mm256_mul_ps(lumG, nbG)),
+            _mm256_mul_ps(lumB, nbB));
+        const __m256 wl = exp_AVX2(_mm256_div_ps(
+            _mm256_xor_ps(_mm256_and_ps(_mm256_sub_ps(nbLuminance, luminance), absMask), _mm256_set1_ps(-0.0f)),
+            lumDenom));
+
+        const __m256 h = _mm256_set1_ps(Kernel::Weights(i));
+        const __m256 weight = _mm256_and_ps(
+            _mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(h, wz), wn), wl), valid);
+        sumR = _mm256_add_ps(sumR, _mm256_and_ps(_mm256_mul_ps(weight, nbR), valid));
+        sumG = _mm256_add_ps(sumG, _mm256_and_ps(_mm256_mul_ps(weight, nbG), valid));
+        sumB = _mm256_add_ps(sumB, _mm256_and_ps(_mm256_mul_ps(weight, nbB), valid));
+        sumVariance = _mm256_add_ps(
+            sumVariance, _mm256_and_ps(_mm256_mul_ps(_mm256_mul_ps(weight, weight), nbVariance), valid));
+        sumWeights = _mm256_add_ps(sumWeights, weight);
+    }
+    const __m256 recSumWeights = _mm256_div_ps(one, sumWeights);
+    const __m256 dstR = _mm256_mul_ps(sumR, recSumWeights);
+    const __m256 dstG = _mm256_mul_ps(sumG, recSumWeights);
+    const __m256 dstB = _mm256_mul_ps(sumB, recSumWeights);
+    const __m256 dstVariance = _mm256_div_ps(sumVariance, _mm256_mul_ps(sumWeights, sumWeights));
+
+    // JP: 背景ピクセルには書き込まない。
+    // EN: Don't write to background pixels.
+    const __m256i storeMask = _mm256_castps_si256(fgMask);
+    _mm256_maskstore_ps(dst.r.data() + idx, storeMask, dstR);
+    _mm256_maskstore_ps(dst.g.data() + idx, storeMask, dstG);
+    _mm256_maskstore_ps(dst.b.data() + idx, storeMask, dstB);
+    _mm256_maskstore_ps(dst.variance.data() + idx, storeMask, dstVariance);
+
+    if (filterStageIndex == 0) {
+        const bool feedbackFiltered = m_dump->feedback1stFilteredResult;
+        alignas(32) float values[4][8];
+        _mm256_store_ps(values[0], feedbackFiltered ? dstR : r);
+        _mm256_store_ps(values[1], feedbackFiltered ? dstG : g);
+        _mm256_store_ps(values[2], feedbackFiltered ? dstB : b);
+        _mm256_store_ps(values[3], feedbackFiltered ? dstVariance : variance);
+        for (int lane = 0; lane < 8; ++lane) {
+            if ((fgBits >> lane & 0b1) == 0)
+                continue;
+            Lighting_Variance &value = m_prevNoisyLighting[y * m_width + xBegin + lane];
+            value.noisyLighting = RGB(values[0][lane], values[1][lane], values[2][lane]);
+            value.variance = values[3][lane];
+        }
+    }
+}
+
+// JP: applyATrousFilter_tiled_generic<ATrousKernelType_Box3x3>()の移植。
+//     ブロックと同じくタイルとエプロンのガイド、周囲1ピクセルまでの分散を作業領域に読み込んでから処理する。
+// EN: Port of applyATrousFilter_tiled_generic<ATrousKernelType_Box3x3>().
+//     Same as a block, load the guide of the tile and its apron,
+//     and the variance up to a pixel around the tile into the work area before processing.
+void SVGFReferenceFilter::applyATrousFilter_tiled(
+    uint32_t filterStageIndex, int32_t tileX, int32_t tileY, TileScratch &scratch) {
+    constexpr ATrousKernelType kernelType = ATrousKernelType_Box3x3;
+    const int2 imageSize = make_int2(m_width, m_height);
+    const int2 tileOrigin = make_int2(aTrousTileSize * tileX, aTrousTileSize * tileY);
+    const uint32_t srcSetIdx = filterStageIndex % 2;
+    const uint32_t dstSetIdx = (filterStageIndex + 1) % 2;
+    const LightingPlanes &src = m_lightingPlanes[srcSetIdx];
+
+    const int32_t apronWidth = getATrousGuideApronWidth<kernelType>(filterStageIndex);
+    const int32_t guideTileWidth = getATrousGuideTileWidth<kernelType>(filterStageIndex);
+    scratch.guides.resize(pow2(guideTileWidth));
+    for (int32_t ty = 0; ty < guideTileWidth; ++ty) {
+        const int32_t y = tileOrigin.y - apronWidth + ty;
+        for (int32_t tx = 0; tx < guideTileWidth; ++tx) {
+            const int32_t x = tileOrigin.x - apronWidth + tx;
+            const bool inImage = x >= 0 && y >= 0 && x < imageSize.x && y < imageSize.y;
+            scratch.guides[ty * guideTileWidth + tx] = inImage ?
+                m_aTrousGuides[y * m_width + x] :
+                ATrousGuide(1.0f, Normal3D(0, 0, 1), true);
+        }
+    }
+    for (int32_t ty = 0; ty < aTrousVarianceTileWidth; ++ty) {
+        const int32_t y = std::clamp(tileOrigin.y - 1 + ty, 0, imageSize.y - 1);
+        for (int32_t tx = 0; tx < aTrousVarianceTileWidth; ++tx) {
+            const int32_t x = std::clamp(tileOrigin.x - 1 + tx, 0, imageSize.x - 1);
+            scratch.variances[ty * aTrousVarianceTileWidth + tx] = src.variance[planeIndex(x, y)];
+        }
+    }
+
+    for (int32_t ly = 0; ly < aTrousTileSize; ++ly) {
+        for (int32_t lx = 0; lx < aTrousTileSize; ++lx) {
+            const int2 pix = make_int2(tileOrigin.x + lx, tileOrigin.y + ly);
+            if (pix.x >= imageSize.x || pix.y >= imageSize.y)
+                continue;
+
+            const int32_t guideTileCenter = (ly + apronWidth) * guideTileWidth + lx + apronWidth;
+            const ATrousGuide guide = scratch.guides[guideTileCenter];
+            if (guide.isBackground())
+                continue;
+
+            const uint32_t idx = planeIndex(pix.x, pix.y);
+            const uint32_t linearIndex = pix.y * m_width + pix.x;
+            Lighting_Variance src_lighting_var = readLighting(srcSetIdx, idx);
+            if (filterStageIndex == 0 && !m_dump->feedback1stFilteredResult)
+                m_prevNoisyLighting[linearIndex] = src_lighting_var;
+
+            const int32_t varianceTileCenter = (ly + 1) * aTrousVarianceTileWidth + lx + 1;
+            Lighting_Variance dst_lighting_var = applyATrousFilterWithGuide<kernelType>(
+                filterStageIndex, pix, imageSize, guide, src_lighting_var,
+                [&](const int2 &offset) {
+                    return scratch.guides[guideTileCenter + offset.y * guideTileWidth + offset.x];
+                },
+                [&](const int2 &offset) {
+                    return scratch.variances[varianceTileCenter + offset.y * aTrousVarianceTileWidth + offset.x];
+                },
+                [&](const int2 &nbPix) {
+                    return readLighting(srcSetIdx, planeIndex(nbPix.x, nbPix.y));
+                });
+
+            writeLighting(dstSetIdx, idx, dst_lighting_var);
+
+            if (filterStageIndex == 0 && m_dump->feedback1stFilteredResult)
+                m_prevNoisyLighting[linearIndex] = dst_lighting_var;
+        }
+    }
+}
+
+// JP: fillBackground()の代わりに背景ピクセルのライティングを設定し、フィルター結果を取り出す。
+//     環境テクスチャーを引く代わりにGPUの結果を使い、無ければfillBackground()の既定値を使う。
+// EN: Set the lighting of background pixels instead of fillBackground() and extract the filtered result.
+//     Use the GPU result instead of looking up the environmental texture, or fillBackground()'s default if absent.
+void SVGFReferenceFilter::fillBackground(uint32_t yBegin, uint32_t yEnd) {
+    const SVGFFrameDump &dump = *m_dump;
+    const uint32_t finalSetIdx = dump.numFilteringStages % 2;
+    const bool hasGPUResults = dump.hasGPUResults();
+    for (uint32_t y = yBegin; y < yEnd; ++y) {
+        for (uint32_t x = 0; x < m_width; ++x) {
+            const uint32_t linearIndex = y * m_width + x;
+            const uint32_t idx = planeIndex(x, y);
+            if (!m_isForeground[linearIndex]) {
+                Lighting_Variance lighting_var;
+                lighting_var.denoisedLighting = hasGPUResults ?
+                    dump.denoisedLightingBuffer[linearIndex].denoisedLighting :
+                    RGB(0.001f, 0.001f, 0.001f);
+                lighting_var.variance = 0.0f;
+                writeLighting(finalSetIdx, idx, lighting_var);
+            }
+            m_denoisedLighting[linearIndex] = readLighting(finalSetIdx, idx);
+        }
+    }
+}
+
+// JP: applyAlbedoModulationAndTemporalAntiAliasing()とreprojectPreviousAccumulation()の移植。
+// EN: Port of applyAlbedoModulationAndTemporalAntiAliasing() and reprojectPreviousAccumulation().
+void SVGFReferenceFilter::applyAlbedoModulationAndTemporalAntiAliasing(uint32_t yBegin, uint32_t yEnd) {
+    const SVGFFrameDump &dump = *m_dump;
+    const int2 imageSize = make_int2(m_width, m_height);
+    const auto glLinearIndex = [this](int2 pix) {
+        int2 glp = glPix(pix);
+        return glp.y * m_width + glp.x;
+    };
+
+    const auto reprojectPreviousAccumulation = [&]
+    (Point2D prevScreenPos, RGB* prevFinalLighting, bool* outOfScreen) {
+        *prevFinalLighting = RGB(0.0f, 0.0f, 0.0f);
+        *outOfScreen = (prevScreenPos.x < 0.0f || prevScreenPos.y < 0.0f ||
+                        prevScreenPos.x >= 1.0f || prevScreenPos.y >= 1.0f);
+        if (*outOfScreen)
+            return;
+
+        Point2D prevViewportPos(imageSize.x * prevScreenPos.x, imageSize.y * prevScreenPos.y);
+        int2 prevPixPos = make_int2(static_cast<int32_t>(prevViewportPos.x), static_cast<int32_t>(prevViewportPos.y));
+        Vector2D fDelta = prevViewportPos - (Point2D(prevPixPos.x, prevPixPos.y) + Point2D(0.5f));
+        int2 delta = make_int2(fDelta.x < 0 ? -1 : 1,
+                               fDelta.y < 0 ? -1 : 1);
+
+        int2 basePos = make_int2(prevPixPos.x, prevPixPos.y);
+        int2 dxPos = make_int2(std::clamp(prevPixPos.x + delta.x, 0, imageSize.x - 1), prevPixPos.y);
+        int2 dyPos = make_int2(prevPixPos.x, std::clamp(prevPixPos.y + delta.y, 0, imageSize.y - 1));
+        int2 dxdyPos = make_int2(std::clamp(prevPixPos.x + delta.x, 0, imageSize.x - 1),
+                                 std::clamp(prevPixPos.y + delta.y, 0, imageSize.y - 1));
+
+        float sumWeights = 0.0f;
+        float s = std::fabs(fDelta.x);
+        float t = std::fabs(fDelta.y);
+
+        const std::vector<float4> &prevFinalLightingBuffer = dump.prevFinalLightingBuffer;
+        // Base
+        {
+            float weight = (1 - s) * (1 - t);
+            *prevFinalLighting += weight * RGB(getXYZ(prevFinalLightingBuffer[glLinearIndex(basePos)]));
+            sumWeights += weight;
+        }
+        // dx
+        {
+            float weight = s * (1 - t);
+            *prevFinalLighting += weight * RGB(getXYZ(prevFinalLightingBuffer[glLinearIndex(dxPos)]));
+            sumWeights += weight;
+        }
+        // dy
+        {
+            float weight = (1 - s) * t;
+            *prevFinalLighting += weight * RGB(getXYZ(prevFinalLightingBuffer[glLinearIndex(dyPos)]));
+            sumWeights += weight;
+        }
+        // dxdy
+        {
+            float weight = s * t;
+            *prevFinalLighting += weight * RGB(getXYZ(prevFinalLightingBuffer[glLinearIndex(dxdyPos)]));
+            sumWeights += weight;
+        }
+
+        *prevFinalLighting = safeDivide(*prevFinalLighting, sumWeights);
+    };
+
+    for (int32_t y = yBegin; y < static_cast<int32_t>(yEnd); ++y) {
+        for (int32_t x = 0; x < imageSize.x; ++x) {
+            const int2 pix = make_int2(x, y);
+
+            const Lighting_Variance &src_lighting_var = m_denoisedLighting[y * m_width + x];
+            const Albedo &albedo = dump.albedoBuffer[y * m_width + x];
+            RGB finalLighting = src_lighting_var.denoisedLighting;
+            if (dump.modulateAlbedo)
+                finalLighting *= albedo.dhReflectance;
+
+            if (dump.enableTemporalAA && !dump.isFirstFrame) {
+                const GBuffer2 &gBuffer2 = dump.gBuffer2[glLinearIndex(pix)];
+                RGB prevFinalLighting;
+                bool prevWasOutOfScreen;
+                reprojectPreviousAccumulation(
+                    gBuffer2.prevScreenPos,
+                    &prevFinalLighting, &prevWasOutOfScreen);
+
+                RGB nbBoxMin = finalLighting;
+                RGB nbBoxMax = finalLighting;
+                RGB nbCrossMin = finalLighting;
+                RGB nbCrossMax = finalLighting;
+                for (int i = -1; i <= 1; ++i) {
+                    for (int j = -1; j <= 1; ++j) {
+                        if (i == 0 && j == 0)
+                            continue;
+                        int2 nbPix = make_int2(std::clamp<int32_t>(pix.x + j, 0, imageSize.x - 1),
+                                               std::clamp<int32_t>(pix.y + i, 0, imageSize.y - 1));
+                        const uint32_t nbLinearIndex = nbPix.y * m_width + nbPix.x;
+                        const Lighting_Variance &nbSrc_lighting_var = m_denoisedLighting[nbLinearIndex];
+                        const Albedo &nbAlbedo = dump.albedoBuffer[nbLinearIndex];
+                        RGB nbValue = nbSrc_lighting_var.denoisedLighting;
+                        if (dump.modulateAlbedo)
+                            nbValue *= nbAlbedo.dhReflectance;
+
+                        nbBoxMin = min(nbBoxMin, nbValue);
+                        nbBoxMax = max(nbBoxMax, nbValue);
+                        if (i == 0 || j == 0) {
+                            nbCrossMin = min(nbCrossMin, nbValue);
+                            nbCrossMax = max(nbCrossMax, nbValue);
+                        }
+                    }
+                }
+                RGB nbMin = 0.5f * (nbBoxMin + nbCrossMin);
+                RGB nbMax = 0.5f * (nbBoxMax + nbCrossMax);
+                prevFinalLighting = min(max(prevFinalLighting, nbMin), nbMax);
+
+                float curWeight = 1.0f / dump.taaHistoryLength; // Exponential Moving Average
+                float prevWeight = 1.0f - curWeight;
+                finalLighting = prevWeight * prevFinalLighting + curWeight * finalLighting;
+            }
+
+            m_finalLighting[glLinearIndex(pix)] = make_float4(finalLighting.toNative(), 1.0f);
+        }
+    }
+}
+
+void SVGFReferenceFilter::run(const SVGFFrameDump &dump, Implementation impl) {
+    Assert(dump.width > 0 && dump.height > 0, "Empty dump.");
+    if (impl == Implementation::AVX2 && !isAVX2Supported())
+        impl = Implementation::Scalar;
+
+    m_dump = &dump;
+    m_width = dump.width;
+    m_height = dump.height;
+    m_stride = margin + m_width + margin;
+    const size_t numPixels = static_cast<size_t>(m_width) * m_height;
+    const size_t planeSize = static_cast<size_t>(m_stride) * m_height;
+
+    StopWatchHiRes sw;
+    sw.start();
+    m_depth.resize(planeSize);
+    m_normalX.resize(planeSize);
+    m_normalY.resize(planeSize);
+    m_normalZ.resize(planeSize);
+    m_isForeground.resize(numPixels);
+    for (uint32_t planeSetIdx = 0; planeSetIdx < 2; ++planeSetIdx) {
+        LightingPlanes &planes = m_lightingPlanes[planeSetIdx];
+        planes.r.resize(planeSize);
+        planes.g.resize(planeSize);
+        planes.b.resize(planeSize);
+        planes.variance.resize(planeSize);
+    }
+    m_localMeanStdDev.resize(planeSize);
+    if (impl == Implementation::Tiled)
+        m_aTrousGuides.resize(numPixels);
+    else
+        m_aTrousGuides.clear();
+    m_denoisedLighting.resize(numPixels);
+    m_prevNoisyLighting.resize(numPixels);
+    m_finalLighting.resize(numPixels);
+
+    constexpr uint32_t minNumRowsPerChunk = 8;
+    parallelForChunks(
+        0, m_height, minNumRowsPerChunk,
+        [this](uint32_t chunkIdx, uint32_t yBegin, uint32_t yEnd) {
+        setUp(yBegin, yEnd);
+    });
+    const uint32_t mSetUp = sw.stop();
+
+    sw.start();
+    parallelForChunks(
+        0, m_height, minNumRowsPerChunk,
+        [this](uint32_t chunkIdx, uint32_t yBegin, uint32_t yEnd) {
+        estimateVariance(yBegin, yEnd);
+    });
+    const uint32_t mEstimateVariance = sw.stop();
+
+    sw.start();
+    const uint32_t numTilesX = (m_width + aTrousTileSize - 1) / aTrousTileSize;
+    const uint32_t numTilesY = (m_height + aTrousTileSize - 1) / aTrousTileSize;
+    for (uint32_t filterStageIndex = 0; filterStageIndex < dump.numFilteringStages; ++filterStageIndex) {
+        if (impl == Implementation::Tiled) {
+            parallelForChunks(
+                0, numTilesX * numTilesY, 1,
+                [this, filterStageIndex, numTilesX](uint32_t chunkIdx, uint32_t tileBegin, uint32_t tileEnd) {
+                TileScratch scratch;
+                for (uint32_t tileIdx = tileBegin; tileIdx < tileEnd; ++tileIdx)
+                    applyATrousFilter_tiled(filterStageIndex, tileIdx % numTilesX, tileIdx / numTilesX, scratch);
+            });
+            continue;
+        }
+
+        parallelForChunks(
+            0, m_height, minNumRowsPerChunk,
+            [this, filterStageIndex, impl](uint32_t chunkIdx, uint32_t yBegin, uint32_t yEnd) {
+            for (int32_t y = yBegin; y < static_cast<int32_t>(yEnd); ++y) {
+                computeLocalMeanStdDev(filterStageIndex, y);
+                int32_t x = 0;
+                if (impl == Implementation::AVX2) {
+                    for (; x + 8 <= static_cast<int32_t>(m_width); x += 8)
+                        applyATrousFilter_AVX2(filterStageIndex, x, y);
+                }
+                for (; x < static_cast<int32_t>(m_width); ++x)
+                    applyATrousFilter(filterStageIndex, x, y);
+            }
+        });
+    }
+    const uint32_t mATrousFilter = sw.stop();
+
+    sw.start();
+    parallelForChunks(
+        0, m_height, minNumRowsPerChunk,
+        [this](uint32_t chunkIdx, uint32_t yBegin, uint32_t yEnd) {
+        fillBackground(yBegin, yEnd);
+    });
+    parallelForChunks(
+        0, m_height, minNumRowsPerChunk,
+        [this](uint32_t chunkIdx, uint32_t yBegin, uint32_t yEnd) {
+        applyAlbedoModulationAndTemporalAntiAliasing(yBegin, yEnd);
+    });
+    const uint32_t mTemporalAA = sw.stop();
+
+    m_timings.setUp = sw.getMeasurement(mSetUp, StopWatchDurationType::Microseconds) * 1e-3f;
+    m_timings.estimateVariance = sw.getMeasurement(mEstimateVariance, StopWatchDurationType::Microseconds) * 1e-3f;
+    m_timings.aTrousFilter = sw.getMeasurement(mATrousFilter, StopWatchDurationType::Microseconds) * 1e-3f;
+    m_timings.temporalAA = sw.getMeasurement(mTemporalAA, StopWatchDurationType::Microseconds) * 1e-3f;
+}
+
+SVGFReferenceFilter::ErrorStatistics SVGFReferenceFilter::compareLighting(
+    const std::vector<Lighting_Variance> &values,
+    const std::vector<Lighting_Variance> &refValues, float absTolerance) const {
+    Assert(values.size() == m_isForeground.size() && refValues.size() == m_isForeground.size(),
+           "Buffer size mismatch.");
+    ErrorStatistics stats = {};
+    double sumSqErrors = 0.0;
+    for (size_t i = 0; i < values.size(); ++i) {
+        if (!m_isForeground[i])
+            continue;
+        const float diffs[] = {
+            std::fabs(values[i].denoisedLighting.r - refValues[i].denoisedLighting.r),
+            std::fabs(values[i].denoisedLighting.g - refValues[i].denoisedLighting.g),
+            std::fabs(values[i].denoisedLighting.b - refValues[i].denoisedLighting.b),
+        };
+        bool mismatch = false;
+        for (float diff : diffs) {
+            mismatch |= !(diff < absTolerance);
+            stats.maxAbsError = std::fmax(stats.maxAbsError, diff);
+            sumSqErrors += pow2(static_cast<double>(diff));
+        }
+        ++stats.numPixels;
+        if (mismatch)
+            ++stats.numMismatches;
+    }
+    if (stats.numPixels > 0)
+        stats.rmse = static_cast<float>(std::sqrt(sumSqErrors / (3.0 * stats.numPixels)));
+    return stats;
+}
+
+SVGFReferenceFilter::ErrorStatistics SVGFReferenceFilter::compareFinalLighting(
+    const std::vector<float4> &values,
+    const std::vector<float4> &refValues, float absTolerance) const {
+    Assert(values.size() == refValues.size(), "Buffer size mismatch.");
+    ErrorStatistics stats = {};
+    double sumSqErrors = 0.0;
+    for (size_t i = 0; i < values.size(); ++i) {
+        const float diffs[] = {
+            std::fabs(values[i].x - refValues[i].x),
+            std::fabs(values[i].y - refValues[i].y),
+            std::fabs(values[i].z - refValues[i].z),
+        };
+        bool mismatch = false;
+        for (float diff : diffs) {
+            mismatch |= !(diff < absTolerance);
+            stats.maxAbsError = std::fmax(stats.maxAbsError, diff);
+            sumSqErrors += pow2(static_cast<double>(diff));
+        }
+        ++stats.numPixels;
+        if (mismatch)
+            ++stats.numMismatches;
+    }
+    if (stats.numPixels > 0)
+        stats.rmse = static_cast<float>(std::sqrt(sumSqErrors / (3.0 * stats.numPixels)));
+    return stats;
+}
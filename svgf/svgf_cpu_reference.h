@@ -0,0 +1,203 @@
+﻿#pragma once
+
+#include "svgf_shared.h"
+#include "../common/common_host.h"
+
+// JP: SVGFのCPUリファレンス実装が入力とする1フレーム分のバッファーのダンプ。
+//     OpenGL由来のバッファー(G-Buffer, デプス, 最終ライティング)はカーネルがglPix()経由で読むのと同じく
+//     下から上への行順のまま保持する。それ以外はCUDAの配列と同じ上から下への行順。
+//     GPUの結果(denoisedLightingBuffer以降)は比較用で、空でも良い。
+// EN: Dump of the buffers of a frame which the CPU reference implementation of SVGF takes as input.
+//     Buffers from OpenGL (G-buffers, depth, final lighting) keep the bottom-up row order as is
+//     same as the kernels read them via glPix(). The others have the top-down row order same as the CUDA arrays.
+//     The GPU results (denoisedLightingBuffer and later) are for comparison and can be empty.
+struct SVGFFrameDump {
+    // JP: 実装しているフィルターの段数の上限。
+    // EN: Upper limit of the number of filtering stages the implementation has.
+    static constexpr uint32_t maxNumFilteringStages = 5;
+
+    uint32_t width;
+    uint32_t height;
+    uint32_t numFilteringStages;
+    uint32_t taaHistoryLength;
+    bool feedback1stFilteredResult;
+    bool enableTemporalAA;
+    bool modulateAlbedo;
+    bool isFirstFrame;
+    bool tiledATrousFilter;
+
+    std::vector<shared::GBuffer0> gBuffer0;
+    std::vector<shared::GBuffer1> gBuffer1;
+    // JP: fillBackground()が背景のprevScreenPosを書き込んだ後のもの。
+    // EN: Taken after fillBackground() writes prevScreenPos for the background.
+    std::vector<shared::GBuffer2> gBuffer2;
+    std::vector<float> depthBuffer;
+    std::vector<shared::Albedo> albedoBuffer;
+    std::vector<shared::MomentPair_SampleInfo> momentPair_sampleInfo_buffer;
+    // JP: パストレーシング直後のlighting_variance_buffers[0]と[1]。
+    //     [1]の背景部分は前フレームの内容で、3x3の分散フィルターがそれを読むため必要になる。
+    // EN: lighting_variance_buffers[0] and [1] right after path tracing.
+    //     The background of [1] has the previous frame's content which the 3x3 variance filter reads.
+    std::vector<shared::Lighting_Variance> noisyLightingBuffer;
+    std::vector<shared::Lighting_Variance> aTrousWorkBuffer;
+    std::vector<float4> prevFinalLightingBuffer;
+
+    std::vector<shared::Lighting_Variance> denoisedLightingBuffer;
+    std::vector<shared::Lighting_Variance> prevNoisyLightingBuffer;
+    std::vector<float4> finalLightingBuffer;
+
+    SVGFFrameDump() :
+        width(0), height(0), numFilteringStages(0), taaHistoryLength(1),
+        feedback1stFilteredResult(true), enableTemporalAA(false), modulateAlbedo(true),
+        isFirstFrame(true), tiledATrousFilter(false) {}
+
+    void resize(uint32_t _width, uint32_t _height, bool withGPUResults);
+    bool hasGPUResults() const {
+        return !finalLightingBuffer.empty();
+    }
+
+    bool write(const std::filesystem::path &filePath) const;
+    bool read(const std::filesystem::path &filePath);
+};
+
+
+
+// JP: SVGFのフィルターチェイン(分散推定, à-trousフィルター, 背景の充填, アルベド乗算とTAA)のCPU実装。
+//     Scalar実装はカーネルと同じ順序で同じ関数を評価するゴールデンリファレンス、
+//     AVX2実装はà-trousフィルターを8ピクセルずつ処理するスループット用。
+//     Tiled実装はタイル化したカーネルの移植で、量子化したガイドを使うのでScalar実装とはわずかに異なる。
+//     いずれも行かタイル単位で並列化され、結果はスレッド数に依存しない。
+//     環境テクスチャーは参照しないので、背景のライティングはダンプ中のGPUの結果から取る。
+// EN: CPU implementation of the SVGF filter chain
+//     (variance estimation, à-trous filter, background fill, albedo modulation and TAA).
+//     The scalar implementation is the golden reference evaluating the same functions in the same order as the kernels,
+//     and the AVX2 implementation is for throughput processing the à-trous filter 8 pixels at a time.
+//     The tiled implementation is a port of the tiled kernel
+//     and slightly differs from the scalar one since it uses the quantized guide.
+//     All are parallelized per row or tile and the results don't depend on the number of threads.
+//     This doesn't reference the environmental texture, so the background lighting is taken from the GPU result in the dump.
+class SVGFReferenceFilter {
+public:
+    enum class Implementation {
+        Scalar = 0,
+        AVX2,
+        Tiled,
+    };
+
+    struct Timings {
+        float setUp;
+        float estimateVariance;
+        float aTrousFilter;
+        float temporalAA;
+    };
+
+    struct ErrorStatistics {
+        uint32_t numPixels;
+        uint32_t numMismatches;
+        float maxAbsError;
+        float rmse;
+    };
+
+private:
+    // JP: à-trousフィルターの最大半径分の余白を左右に持つSoAプレーン。
+    //     余白のデプスは1なので近傍として使われない。
+    // EN: SoA planes with margins of the maximum à-trous filter radius on the left and right.
+    //     The margins have the depth of 1 so they are never used as neighbors.
+    static constexpr uint32_t margin = 16;
+
+    struct LightingPlanes {
+        std::vector<float> r;
+        std::vector<float> g;
+        std::vector<float> b;
+        std::vector<float> variance;
+    };
+
+    // JP: GPUのブロックのシェアードメモリーに相当する作業領域。
+    // EN: Work area corresponding to the shared memory of a GPU block.
+    struct TileScratch {
+        std::vector<shared::ATrousGuide> guides;
+        float variances[pow2(shared::aTrousVarianceTileWidth)];
+    };
+
+    const SVGFFrameDump* m_dump;
+    uint32_t m_width;
+    uint32_t m_height;
+    uint32_t m_stride;
+    std::vector<float> m_depth;
+    std::vector<float> m_normalX;
+    std::vector<float> m_normalY;
+    std::vector<float> m_normalZ;
+    std::vector<uint8_t> m_isForeground;
+    LightingPlanes m_lightingPlanes[2];
+    std::vector<float> m_localMeanStdDev;
+    std::vector<shared::ATrousGuide> m_aTrousGuides;
+
+    std::vector<shared::Lighting_Variance> m_denoisedLighting;
+    std::vector<shared::Lighting_Variance> m_prevNoisyLighting;
+    std::vector<float4> m_finalLighting;
+    Timings m_timings;
+
+    uint32_t planeIndex(int32_t x, int32_t y) const {
+        return y * m_stride + margin + x;
+    }
+    int2 glPix(int2 pix) const {
+        return make_int2(pix.x, m_height - 1 - pix.y);
+    }
+    shared::Lighting_Variance readLighting(uint32_t planeSetIdx, uint32_t idx) const {
+        const LightingPlanes &planes = m_lightingPlanes[planeSetIdx];
+        shared::Lighting_Variance ret;
+        ret.noisyLighting = RGB(planes.r[idx], planes.g[idx], planes.b[idx]);
+        ret.variance = planes.variance[idx];
+        return ret;
+    }
+    void writeLighting(uint32_t planeSetIdx, uint32_t idx, const shared::Lighting_Variance &value) {
+        LightingPlanes &planes = m_lightingPlanes[planeSetIdx];
+        planes.r[idx] = value.noisyLighting.r;
+        planes.g[idx] = value.noisyLighting.g;
+        planes.b[idx] = value.noisyLighting.b;
+        planes.variance[idx] = value.variance;
+    }
+
+    void setUp(uint32_t yBegin, uint32_t yEnd);
+    void estimateVariance(uint32_t yBegin, uint32_t yEnd);
+    void computeLocalMeanStdDev(uint32_t filterStageIndex, int32_t y);
+    void applyATrousFilter(uint32_t filterStageIndex, int32_t x, int32_t y);
+    // JP: [xBegin, xBegin + 8)のピクセルを処理する。
+    // EN: Process pixels in [xBegin, xBegin + 8).
+    void applyATrousFilter_AVX2(uint32_t filterStageIndex, int32_t xBegin, int32_t y);
+    void applyATrousFilter_tiled(uint32_t filterStageIndex, int32_t tileX, int32_t tileY, TileScratch &scratch);
+    void fillBackground(uint32_t yBegin, uint32_t yEnd);
+    void applyAlbedoModulationAndTemporalAntiAliasing(uint32_t yBegin, uint32_t yEnd);
+
+public:
+    SVGFReferenceFilter() : m_dump(nullptr), m_width(0), m_height(0), m_stride(0), m_timings{} {}
+
+    void run(const SVGFFrameDump &dump, Implementation impl);
+
+    const std::vector<shared::Lighting_Variance> &getDenoisedLighting() const {
+        return m_denoisedLighting;
+    }
+    const std::vector<shared::Lighting_Variance> &getPrevNoisyLighting() const {
+        return m_prevNoisyLighting;
+    }
+    // JP: 最終ライティングはOpenGLのバッファーと同じく下から上への行順。
+    // EN: The final lighting has the bottom-up row order same as the OpenGL buffer.
+    const std::vector<float4> &getFinalLighting() const {
+        return m_finalLighting;
+    }
+    const Timings &getTimings() const {
+        return m_timings;
+    }
+
+    // JP: absTolerance以上の差があるチャンネルを持つピクセルを不一致とする。
+    //     ライティングのバッファー(上から下への行順)は前景ピクセルのみ、最終ライティングは全ピクセルを比較する。
+    // EN: Pixels having a channel with a difference equal to or larger than absTolerance are mismatches.
+    //     Lighting buffers (top-down row order) are compared only at foreground pixels,
+    //     and the final lighting is compared at all pixels.
+    ErrorStatistics compareLighting(
+        const std::vector<shared::Lighting_Variance> &values,
+        const std::vector<shared::Lighting_Variance> &refValues, float absTolerance) const;
+    ErrorStatistics compareFinalLighting(
+        const std::vector<float4> &values,
+        const std::vector<float4> &refValues, float absTolerance) const;
+};
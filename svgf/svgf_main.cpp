@@ -40,6 +40,7 @@ EN: This program is an example implementation of SVGF (Spatiotemporal Variance-G
 */
 
 #include "svgf_shared.h"
+#include "svgf_cpu_reference.h"
 #include "../common/common_host.h"
 
 // Include glfw3.h after our OpenGL definitions
@@ -68,6 +69,7 @@ struct GPUEnvironment {
     CUmodule svgfModule;
     cudau::Kernel kernelEstimateVariance;
     cudau::Kernel kernelApplyATrousFilter_box3x3;
+    cudau::Kernel kernelApplyATrousFilter_box3x3_tiled;
     cudau::Kernel kernelFeedbackNoisyLighting;
     cudau::Kernel kernelFillBackground;
     cudau::Kernel kernelApplyAlbedoModulationAndTemporalAntiAliasing;
@@ -112,6 +114,9 @@ struct GPUEnvironment {
             cudau::Kernel(svgfModule, "estimateVariance", cudau::dim3(8, 8), 0);
         kernelApplyATrousFilter_box3x3 =
             cudau::Kernel(svgfModule, "applyATrousFilter_box3x3", cudau::dim3(8, 8), 0);
+        kernelApplyATrousFilter_box3x3_tiled =
+            cudau::Kernel(svgfModule, "applyATrousFilter_box3x3_tiled",
+                          cudau::dim3(shared::aTrousTileSize, shared::aTrousTileSize), 0);
         kernelFeedbackNoisyLighting =
             cudau::Kernel(svgfModule, "feedbackNoisyLighting", cudau::dim3(8, 8), 0);
         kernelFillBackground =
@@ -403,51 +408,18 @@ static Quaternion g_cameraOrientation;
 static Quaternion g_tempCameraOrientation;
 static Point3D g_cameraPosition;
 static std::filesystem::path g_envLightTexturePath;
+static BenchmarkConfig g_benchmarkConfig;
+static std::filesystem::path g_cpuSVGFDumpPath;
+static std::filesystem::path g_cpuSVGFOutputPath;
+static SVGFReferenceFilter::Implementation g_cpuSVGFImpl = SVGFReferenceFilter::Implementation::AVX2;
+static uint32_t g_cpuSVGFNumRuns = 1;
 
-struct MeshGeometryInfo {
-    std::filesystem::path path;
-    float preScale;
-    MaterialConvention matConv;
-};
-
-struct RectangleGeometryInfo {
-    float dimX;
-    float dimZ;
-    RGB emittance;
-    std::filesystem::path emitterTexPath;
-};
-
-struct MeshInstanceInfo {
-    std::string name;
-    Point3D beginPosition;
-    Point3D endPosition;
-    float beginScale;
-    float endScale;
-    Quaternion beginOrientation;
-    Quaternion endOrientation;
-    float frequency;
-    float initTime;
-};
-
-using MeshInfo = std::variant<MeshGeometryInfo, RectangleGeometryInfo>;
-static std::map<std::string, MeshInfo> g_meshInfos;
-static std::vector<MeshInstanceInfo> g_meshInstInfos;
+static SceneDescription g_sceneDesc;
 
 static void parseCommandline(int32_t argc, const char* argv[]) {
-    std::string name;
-
     Quaternion camOrientation = Quaternion();
 
-    Point3D beginPosition(0.0f, 0.0f, 0.0f);
-    Point3D endPosition(NAN, NAN, NAN);
-    Quaternion beginOrientation = Quaternion();
-    Quaternion endOrientation = Quaternion(NAN, NAN, NAN, NAN);
-    float beginScale = 1.0f;
-    float endScale = NAN;
-    float frequency = 5.0f;
-    float initTime = 0.0f;
-    RGB emittance(0.0f, 0.0f, 0.0f);
-    std::filesystem::path rectEmitterTexPath;
+    SceneCommandlineParser sceneParser;
 
     for (int i = 0; i < argc; ++i) {
         const char* arg = argv[i];
@@ -513,189 +485,56 @@ static void parseCommandline(int32_t argc, const char* argv[]) {
             g_envLightTexturePath = argv[i + 1];
             i += 1;
         }
-        else if (strncmp(arg, "-name", 6) == 0) {
-            if (i + 1 >= argc) {
+        else if (strncmp(arg, "-cpu-svgf", 10) == 0) {
+            if (i + 2 >= argc) {
                 hpprintf("Invalid option.\n");
                 exit(EXIT_FAILURE);
             }
-            name = argv[i + 1];
-            i += 1;
-        }
-        else if (0 == strncmp(arg, "-emittance", 11)) {
-            if (i + 3 >= argc) {
-                printf("Invalid option.\n");
-                exit(EXIT_FAILURE);
-            }
-            emittance = RGB(atof(argv[i + 1]), atof(argv[i + 2]), atof(argv[i + 3]));
-            if (!emittance.allFinite()) {
-                printf("Invalid value.\n");
-                exit(EXIT_FAILURE);
-            }
-            i += 3;
+            g_cpuSVGFDumpPath = argv[i + 1];
+            g_cpuSVGFOutputPath = argv[i + 2];
+            i += 2;
         }
-        else if (0 == strncmp(arg, "-rect-emitter-tex", 18)) {
+        else if (strncmp(arg, "-cpu-svgf-impl", 15) == 0) {
             if (i + 1 >= argc) {
-                printf("Invalid option.\n");
+                hpprintf("Invalid option.\n");
                 exit(EXIT_FAILURE);
             }
-            rectEmitterTexPath = argv[i + 1];
-            i += 1;
-        }
-        else if (0 == strncmp(arg, "-obj", 5)) {
-            if (i + 3 >= argc) {
-                printf("Invalid option.\n");
-                exit(EXIT_FAILURE);
+            if (strncmp(argv[i + 1], "scalar", 7) == 0) {
+                g_cpuSVGFImpl = SVGFReferenceFilter::Implementation::Scalar;
             }
-
-            MeshInfo info = MeshGeometryInfo();
-            auto &mesh = std::get<MeshGeometryInfo>(info);
-            mesh.path = std::filesystem::path(argv[i + 1]);
-            mesh.preScale = atof(argv[i + 2]);
-            std::string matConv = argv[i + 3];
-            if (matConv == "trad") {
-                mesh.matConv = MaterialConvention::Traditional;
+            else if (strncmp(argv[i + 1], "avx2", 5) == 0) {
+                g_cpuSVGFImpl = SVGFReferenceFilter::Implementation::AVX2;
             }
-            else if (matConv == "simple_pbr") {
-                mesh.matConv = MaterialConvention::SimplePBR;
+            else if (strncmp(argv[i + 1], "tiled", 6) == 0) {
+                g_cpuSVGFImpl = SVGFReferenceFilter::Implementation::Tiled;
             }
             else {
-                printf("Invalid material convention.\n");
-                exit(EXIT_FAILURE);
-            }
-
-            g_meshInfos[name] = info;
-
-            i += 3;
-        }
-        else if (0 == strncmp(arg, "-rectangle", 11)) {
-            if (i + 2 >= argc) {
-                printf("Invalid option.\n");
-                exit(EXIT_FAILURE);
-            }
-
-            MeshInfo info = RectangleGeometryInfo();
-            auto &rect = std::get<RectangleGeometryInfo>(info);
-            rect.dimX = atof(argv[i + 1]);
-            rect.dimZ = atof(argv[i + 2]);
-            rect.emittance = emittance;
-            rect.emitterTexPath = rectEmitterTexPath;
-            g_meshInfos[name] = info;
-
-            emittance = RGB(0.0f, 0.0f, 0.0f);
-            rectEmitterTexPath = "";
-
-            i += 2;
-        }
-        else if (0 == strncmp(arg, "-begin-pos", 11)) {
-            if (i + 3 >= argc) {
-                printf("Invalid option.\n");
-                exit(EXIT_FAILURE);
-            }
-            beginPosition = Point3D(atof(argv[i + 1]), atof(argv[i + 2]), atof(argv[i + 3]));
-            if (!beginPosition.allFinite()) {
-                printf("Invalid value.\n");
-                exit(EXIT_FAILURE);
-            }
-            i += 3;
-        }
-        else if (strncmp(arg, "-begin-roll", 10) == 0 ||
-                 strncmp(arg, "-begin-pitch", 11) == 0 ||
-                 strncmp(arg, "-begin-yaw", 9) == 0) {
-            computeOrientation(arg + 6, &beginOrientation);
-        }
-        else if (0 == strncmp(arg, "-begin-scale", 13)) {
-            if (i + 1 >= argc) {
-                printf("Invalid option.\n");
-                exit(EXIT_FAILURE);
-            }
-            beginScale = atof(argv[i + 1]);
-            if (!isfinite(beginScale)) {
-                printf("Invalid value.\n");
+                hpprintf("Invalid option.\n");
                 exit(EXIT_FAILURE);
             }
             i += 1;
         }
-        else if (0 == strncmp(arg, "-end-pos", 9)) {
-            if (i + 3 >= argc) {
-                printf("Invalid option.\n");
-                exit(EXIT_FAILURE);
-            }
-            endPosition = Point3D(atof(argv[i + 1]), atof(argv[i + 2]), atof(argv[i + 3]));
-            if (!endPosition.allFinite()) {
-                printf("Invalid value.\n");
-                exit(EXIT_FAILURE);
-            }
-            i += 3;
-        }
-        else if (strncmp(arg, "-end-roll", 10) == 0 ||
-                 strncmp(arg, "-end-pitch", 11) == 0 ||
-                 strncmp(arg, "-end-yaw", 9) == 0) {
-            computeOrientation(arg + 4, &endOrientation);
-        }
-        else if (0 == strncmp(arg, "-end-scale", 11)) {
+        else if (strncmp(arg, "-cpu-svgf-runs", 15) == 0) {
             if (i + 1 >= argc) {
-                printf("Invalid option.\n");
-                exit(EXIT_FAILURE);
-            }
-            endScale = atof(argv[i + 1]);
-            if (!isfinite(endScale)) {
-                printf("Invalid value.\n");
+                hpprintf("Invalid option.\n");
                 exit(EXIT_FAILURE);
             }
+            g_cpuSVGFNumRuns = std::max(atoi(argv[i + 1]), 1);
             i += 1;
         }
-        else if (0 == strncmp(arg, "-freq", 6)) {
-            if (i + 1 >= argc) {
+        else if (CommandlineParseResult result = sceneParser.parse(argc, argv, &i, &g_sceneDesc);
+                 result != CommandlineParseResult::Unhandled) {
+            if (result == CommandlineParseResult::Invalid) {
                 printf("Invalid option.\n");
                 exit(EXIT_FAILURE);
             }
-            frequency = atof(argv[i + 1]);
-            if (!isfinite(frequency)) {
-                printf("Invalid value.\n");
-                exit(EXIT_FAILURE);
-            }
-            i += 1;
         }
-        else if (0 == strncmp(arg, "-time", 6)) {
-            if (i + 1 >= argc) {
+        else if (CommandlineParseResult result = parseBenchmarkOption(argc, argv, &i, &g_benchmarkConfig);
+                 result != CommandlineParseResult::Unhandled) {
+            if (result == CommandlineParseResult::Invalid) {
                 printf("Invalid option.\n");
                 exit(EXIT_FAILURE);
             }
-            initTime = atof(argv[i + 1]);
-            if (!isfinite(initTime)) {
-                printf("Invalid value.\n");
-                exit(EXIT_FAILURE);
-            }
-            i += 1;
-        }
-        else if (0 == strncmp(arg, "-inst", 6)) {
-            if (i + 1 >= argc) {
-                printf("Invalid option.\n");
-                exit(EXIT_FAILURE);
-            }
-
-            MeshInstanceInfo info;
-            info.name = argv[i + 1];
-            info.beginPosition = beginPosition;
-            info.beginOrientation = beginOrientation;
-            info.beginScale = beginScale;
-            info.endPosition = endPosition.allFinite() ? endPosition : beginPosition;
-            info.endOrientation = endOrientation.allFinite() ? endOrientation : beginOrientation;
-            info.endScale = std::isfinite(endScale) ? endScale : beginScale;
-            info.frequency = frequency;
-            info.initTime = initTime;
-            g_meshInstInfos.push_back(info);
-
-            beginPosition = Point3D(0.0f, 0.0f, 0.0f);
-            endPosition = Point3D(NAN, NAN, NAN);
-            beginOrientation = Quaternion();
-            endOrientation = Quaternion(NAN, NAN, NAN, NAN);
-            beginScale = 1.0f;
-            endScale = NAN;
-            frequency = 5.0f;
-            initTime = 0.0f;
-
-            i += 1;
         }
         else {
             printf("Unknown option.\n");
@@ -749,11 +588,64 @@ namespace ImGui {
     }
 }
 
+static void reportSVGFReferenceComparison(const SVGFReferenceFilter &filter, const SVGFFrameDump &dump) {
+    // JP: GPUは--use_fast_mathでコンパイルされているので完全には一致しない。
+    // EN: The GPU doesn't match exactly since it is compiled with --use_fast_math.
+    constexpr float absTolerance = 1e-3f;
+    const auto report = [](const char* name, const SVGFReferenceFilter::ErrorStatistics &stats) {
+        hpprintf("  %s: %u / %u mismatches, max abs error: %g, RMSE: %g\n",
+                 name, stats.numMismatches, stats.numPixels, stats.maxAbsError, stats.rmse);
+    };
+    hpprintf("CPU reference vs GPU (%s a-trous filter, tolerance: %g):\n",
+             dump.tiledATrousFilter ? "tiled" : "non-tiled", absTolerance);
+    report("Denoised Lighting",
+           filter.compareLighting(filter.getDenoisedLighting(), dump.denoisedLightingBuffer, absTolerance));
+    report("Prev Noisy Lighting",
+           filter.compareLighting(filter.getPrevNoisyLighting(), dump.prevNoisyLightingBuffer, absTolerance));
+    report("Final Lighting",
+           filter.compareFinalLighting(filter.getFinalLighting(), dump.finalLightingBuffer, absTolerance));
+}
+
+// JP: GPUを使わずに、ダンプしたフレームをCPUでデノイズしてEXRとして保存する。
+// EN: Denoise a dumped frame on the CPU without using the GPU and save it as EXR.
+static int32_t runCPUReferenceSVGF() {
+    SVGFFrameDump dump;
+    if (!dump.read(g_cpuSVGFDumpPath)) {
+        hpprintf("Failed to read the SVGF frame dump: %s\n", g_cpuSVGFDumpPath.string().c_str());
+        return -1;
+    }
+
+    SVGFReferenceFilter filter;
+    for (uint32_t runIdx = 0; runIdx < g_cpuSVGFNumRuns; ++runIdx) {
+        filter.run(dump, g_cpuSVGFImpl);
+        const SVGFReferenceFilter::Timings &timings = filter.getTimings();
+        hpprintf("Run %u: Set Up: %.3f, Estimate Variance: %.3f, A-Trous Filter: %.3f, TAA: %.3f [ms]\n",
+                 runIdx, timings.setUp, timings.estimateVariance, timings.aTrousFilter, timings.temporalAA);
+    }
+    if (dump.hasGPUResults())
+        reportSVGFReferenceComparison(filter, dump);
+
+    saveImageHDR(
+        g_cpuSVGFOutputPath, dump.width, dump.height, 1.0f,
+        filter.getFinalLighting().data(), true);
+
+    return 0;
+}
+
 int32_t main(int32_t argc, const char* argv[]) try {
     const std::filesystem::path exeDir = getExecutableDirectory();
 
     parseCommandline(argc, argv);
 
+    if (!g_cpuSVGFDumpPath.empty())
+        return runCPUReferenceSVGF();
+
+    CameraPath cameraPath;
+    if (g_benchmarkConfig.headless && !g_benchmarkConfig.cameraPathFile.empty()) {
+        if (!cameraPath.load(g_benchmarkConfig.cameraPathFile))
+            return -1;
+    }
+
     // ----------------------------------------------------------------
     // JP: OpenGL, GLFWの初期化。
     // EN: Initialize OpenGL and GLFW.
@@ -781,6 +673,13 @@ int32_t main(int32_t argc, const char* argv[]) try {
 
     glfwWindowHint(GLFW_SRGB_CAPABLE, GLFW_TRUE);
 
+    // JP: ヘッドレスモードではウインドウを表示しない。
+    //     出力バッファーがGLとのインターオペで作られるためコンテキスト自体は必要。
+    // EN: Don't show the window in the headless mode.
+    //     The context itself is still required since the output buffer is created via GL interop.
+    if (g_benchmarkConfig.headless)
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+
     int32_t renderTargetSizeX = 1920;
     int32_t renderTargetSizeY = 1080;
 
@@ -953,8 +852,16 @@ int32_t main(int32_t argc, const char* argv[]) try {
 
     StreamChain<2> streamChain;
     streamChain.initialize(gpuEnv.cuContext);
+
+    FrameCapturer frameCapturer;
+    frameCapturer.initialize();
+
     CUstream stream = streamChain.waitAvailableAndGetCurrentStream();
 
+    AsyncTextureLoader textureLoader;
+    textureLoader.initialize();
+    scene.textureLoader = &textureLoader;
+
     // ----------------------------------------------------------------
     // JP: シーンのセットアップ。
     // EN: Setup a scene.
@@ -963,57 +870,9 @@ int32_t main(int32_t argc, const char* argv[]) try {
 
     constexpr bool allocateGfxResource = true;
 
-    for (auto it = g_meshInfos.cbegin(); it != g_meshInfos.cend(); ++it) {
-        const MeshInfo &info = it->second;
-
-        if (std::holds_alternative<MeshGeometryInfo>(info)) {
-            const auto &meshInfo = std::get<MeshGeometryInfo>(info);
-
-            createTriangleMeshes(
-                it->first,
-                meshInfo.path, meshInfo.matConv,
-                scale3D_4x4(meshInfo.preScale),
-                gpuEnv.cuContext, &scene, gpuEnv.optixDefaultMaterial,
-                allocateGfxResource);
-        }
-        else if (std::holds_alternative<RectangleGeometryInfo>(info)) {
-            const auto &rectInfo = std::get<RectangleGeometryInfo>(info);
-
-            createRectangleLight(
-                it->first,
-                rectInfo.dimX, rectInfo.dimZ,
-                RGB(0.01f),
-                rectInfo.emitterTexPath, rectInfo.emittance, Matrix4x4(),
-                gpuEnv.cuContext, &scene, gpuEnv.optixDefaultMaterial,
-                allocateGfxResource);
-        }
-    }
-
-    for (int i = 0; i < g_meshInstInfos.size(); ++i) {
-        const MeshInstanceInfo &info = g_meshInstInfos[i];
-        const Mesh* mesh = scene.meshes.at(info.name);
-        for (int j = 0; j < mesh->groupInsts.size(); ++j) {
-            const Mesh::GeometryGroupInstance &groupInst = mesh->groupInsts[j];
-
-            Matrix4x4 instXfm =
-                Matrix4x4(info.beginScale * info.beginOrientation.toMatrix3x3(), info.beginPosition);
-            Instance* inst = createInstance(gpuEnv.cuContext, &scene, groupInst, instXfm);
-            scene.insts.push_back(inst);
-
-            scene.initialSceneAabb.unify(instXfm * groupInst.transform * groupInst.geomGroup->aabb);
-
-            if (any(info.beginPosition != info.endPosition) ||
-                info.beginOrientation != info.endOrientation ||
-                info.beginScale != info.endScale) {
-                auto controller = new InstanceController(
-                    inst,
-                    info.beginScale, info.beginOrientation, info.beginPosition,
-                    info.endScale, info.endOrientation, info.endPosition,
-                    info.frequency, info.initTime);
-                scene.instControllers.push_back(controller);
-            }
-        }
-    }
+    instantiateSceneDescription(
+        g_sceneDesc, gpuEnv.cuContext, &scene, gpuEnv.optixDefaultMaterial,
+        allocateGfxResource);
 
     Vector3D sceneDim = scene.initialSceneAabb.maxP - scene.initialSceneAabb.minP;
     g_cameraPositionalMovingSpeed = 0.003f * std::max({ sceneDim.x, sceneDim.y, sceneDim.z });
@@ -1033,7 +892,7 @@ int32_t main(int32_t argc, const char* argv[]) try {
     // EN: Read a environmental texture, then compute a CDF to sample it.
     cudau::Array envLightArray;
     CUtexObject envLightTexture = 0;
-    RegularConstantContinuousDistribution2D envLightImportanceMap;
+    EnvLightImportanceMap envLightImportanceMap;
     if (!g_envLightTexturePath.empty())
         loadEnvironmentalTexture(g_envLightTexturePath, gpuEnv.cuContext,
                                  &envLightArray, &envLightTexture, &envLightImportanceMap);
@@ -1082,6 +941,7 @@ int32_t main(int32_t argc, const char* argv[]) try {
     cudau::Array albedoBuffer;
     cudau::Array lighting_variance_buffers[2];
     cudau::Array prevNoisyLightingBuffer;
+    cudau::Array aTrousGuideBuffer;
     cudau::Array rngBuffer;
     glu::Texture2D gfxDebugVisualizeBuffer;
     cudau::Array cuArrayDebugVisualizeBuffer;
@@ -1151,6 +1011,10 @@ int32_t main(int32_t argc, const char* argv[]) try {
             gpuEnv.cuContext, cudau::ArrayElementType::UInt32, (sizeof(shared::Lighting_Variance) + 3) / 4,
             cudau::ArraySurface::Enable, cudau::ArrayTextureGather::Disable,
             renderTargetSizeX, renderTargetSizeY, 1);
+        aTrousGuideBuffer.initialize2D(
+            gpuEnv.cuContext, cudau::ArrayElementType::UInt32, (sizeof(shared::ATrousGuide) + 3) / 4,
+            cudau::ArraySurface::Enable, cudau::ArrayTextureGather::Disable,
+            renderTargetSizeX, renderTargetSizeY, 1);
 
         rngBuffer.initialize2D(
             gpuEnv.cuContext, cudau::ArrayElementType::UInt32, (sizeof(shared::PCG32RNG) + 3) / 4,
@@ -1183,6 +1047,7 @@ int32_t main(int32_t argc, const char* argv[]) try {
 
         rngBuffer.finalize();
 
+        aTrousGuideBuffer.finalize();
         prevNoisyLightingBuffer.finalize();
         for (int i = 1; i >= 0; --i)
             lighting_variance_buffers[i].finalize();
@@ -1264,6 +1129,7 @@ int32_t main(int32_t argc, const char* argv[]) try {
         for (int i = 0; i < 2; ++i)
             lighting_variance_buffers[i].resize(width, height);
         prevNoisyLightingBuffer.resize(width, height);
+        aTrousGuideBuffer.resize(width, height);
 
         rngBuffer.resize(width, height);
         {
@@ -1342,6 +1208,7 @@ int32_t main(int32_t argc, const char* argv[]) try {
         staticPlp.lighting_variance_buffers[0] = lighting_variance_buffers[0].getSurfaceObject(0);
         staticPlp.lighting_variance_buffers[1] = lighting_variance_buffers[1].getSurfaceObject(0);
         staticPlp.prevNoisyLightingBuffer = prevNoisyLightingBuffer.getSurfaceObject(0);
+        staticPlp.aTrousGuideBuffer = aTrousGuideBuffer.getSurfaceObject(0);
 
         staticPlp.materialDataBuffer =
             scene.materialDataBuffer.getROBuffer<shared::enableBufferOobCheck>();
@@ -1471,9 +1338,19 @@ int32_t main(int32_t argc, const char* argv[]) try {
     gpuTimers[0].initialize(gpuEnv.cuContext);
     gpuTimers[1].initialize(gpuEnv.cuContext);
     uint64_t frameIndex = 0;
+    // JP: 各GPUタイマーは2フレーム後に読み出されるので、ヘッドレスモードではフレーム2以降の値を記録する。
+    // EN: Each GPU timer is read back two frames later, so the headless mode records values from frame 2 onward.
+    BenchmarkReport benchmarkReport;
+    const auto reportGPUTime = [&](const char* passName, auto &timer) {
+        float time = timer.report();
+        if (g_benchmarkConfig.headless && frameIndex >= 2)
+            benchmarkReport.record(passName, time);
+        return time;
+    };
     glfwSetWindowUserPointer(window, &frameIndex);
     int32_t requestedSize[2];
     uint32_t numAccumFrames = 0;
+    SVGFFrameDump svgfFrameDump;
     while (true) {
         const uint32_t curBufIdx = frameIndex % 2;
         const uint32_t prevBufIdx = (frameIndex + 1) % 2;
@@ -1497,6 +1374,8 @@ int32_t main(int32_t argc, const char* argv[]) try {
 
         if (glfwWindowShouldClose(window))
             break;
+        if (g_benchmarkConfig.headless && frameIndex >= g_benchmarkConfig.numFrames + 2)
+            break;
         glfwPollEvents();
 
         CUstream curCuStream = streamChain.waitAvailableAndGetCurrentStream();
@@ -1533,6 +1412,7 @@ int32_t main(int32_t argc, const char* argv[]) try {
             staticPlp.lighting_variance_buffers[0] = lighting_variance_buffers[0].getSurfaceObject(0);
             staticPlp.lighting_variance_buffers[1] = lighting_variance_buffers[1].getSurfaceObject(0);
             staticPlp.prevNoisyLightingBuffer = prevNoisyLightingBuffer.getSurfaceObject(0);
+        staticPlp.aTrousGuideBuffer = aTrousGuideBuffer.getSurfaceObject(0);
             curPerFrameTemporalSet.camera.aspect = (float)renderTargetSizeX / renderTargetSizeY;
             curMatV2C = camera(
                 curPerFrameTemporalSet.camera.aspect,
@@ -1545,9 +1425,16 @@ int32_t main(int32_t argc, const char* argv[]) try {
             resized = true;
         }
 
-        ImGui_ImplOpenGL3_NewFrame();
-        ImGui_ImplGlfw_NewFrame();
-        ImGui::NewFrame();
+        // JP: ヘッドレスモードではImGuiのフレームとウインドウの構築を省略する。
+        //     ウインドウ内で初期化を行うサンプルもあるので最初のフレームは構築する。
+        // EN: Skip building ImGui frames and windows in the headless mode.
+        //     Some samples initialize things inside the windows, so the first frame builds them.
+        const bool buildGUI = !g_benchmarkConfig.headless || frameIndex == 0;
+        if (buildGUI) {
+            ImGui_ImplOpenGL3_NewFrame();
+            ImGui_ImplGlfw_NewFrame();
+            ImGui::NewFrame();
+        }
 
 
 
@@ -1630,9 +1517,29 @@ int32_t main(int32_t argc, const char* argv[]) try {
             curPerFrameTemporalSet.camera.orientation = g_tempCameraOrientation.toMatrix3x3();
         }
 
+        // JP: ヘッドレスモードではカメラパスに沿ってカメラを動かす。
+        // EN: Move the camera along the camera path in the headless mode.
+        if (g_benchmarkConfig.headless && !cameraPath.empty()) {
+            cameraPath.evaluateAtFrame(
+                static_cast<uint32_t>(frameIndex), g_benchmarkConfig.numFrames,
+                &g_cameraPosition, &g_cameraOrientation);
+            g_tempCameraOrientation = g_cameraOrientation;
+            cameraIsActuallyMoving = cameraPath.getNumKeyframes() > 1;
+
+            curPerFrameTemporalSet.camera.position = g_cameraPosition;
+            curPerFrameTemporalSet.camera.orientation = g_tempCameraOrientation.toMatrix3x3();
+        }
+
 
 
         bool resetAccumulation = false;
+
+        // JP: 非同期に読み込まれたテクスチャーを反映する。
+        // EN: Apply textures loaded asynchronously.
+        if (textureLoader.hasCompletedRequests()) {
+            streamChain.waitAllWorkDone();
+            resetAccumulation |= textureLoader.processCompletedRequests(gpuEnv.cuContext, curCuStream) > 0;
+        }
         
         // Camera Window
         static shared::BufferToDisplay bufferTypeToDisplay = shared::BufferToDisplay::FinalRendering;
@@ -1641,7 +1548,7 @@ int32_t main(int32_t argc, const char* argv[]) try {
         static bool enableEnvLight = true;
         static float log10EnvLightPowerCoeff = 0.0f;
         static float envLightRotation = 0.0f;
-        {
+        if (buildGUI) {
             ImGui::Begin("Camera / Env", nullptr, ImGuiWindowFlags_AlwaysAutoResize);
 
             ImGui::Text("W/A/S/D/R/F: Move, Q/E: Tilt");
@@ -1669,29 +1576,35 @@ int32_t main(int32_t argc, const char* argv[]) try {
             ImGui::SameLine();
             if (ImGui::Button("Both"))
                 saveSS_LDR = saveSS_HDR = true;
-            if (saveSS_LDR || saveSS_HDR) {
-                glFinish();
-                streamChain.waitAllWorkDone();
-                auto rawImage = new float4[renderTargetSizeX * renderTargetSizeY];
+            ImGui::SameLine();
+            static bool recordSequence = false;
+            ImGui::Checkbox("Record", &recordSequence);
+            frameCapturer.update();
+            if (saveSS_LDR || saveSS_HDR || recordSequence) {
+                static uint32_t sequenceFrameIndex = 0;
+                FrameCapturer::Request request;
+                request.sdrConfig.brightnessScale = std::pow(10.0f, brightness);
+                request.sdrConfig.applyToneMap = applyToneMapAndGammaCorrection;
+                request.sdrConfig.apply_sRGB_gammaCorrection = applyToneMapAndGammaCorrection;
+                request.hdrBrightnessScale = std::pow(10.0f, brightness);
+                request.flipY = true;
+                if (recordSequence) {
+                    request.sdrFilePath = FrameCapturer::makeSequenceFilePath(
+                        "capture/frame", sequenceFrameIndex, "png");
+                    request.hdrFilePath = FrameCapturer::makeSequenceFilePath(
+                        "capture/frame", sequenceFrameIndex, "exr");
+                    ++sequenceFrameIndex;
+                }
+                else {
+                    if (saveSS_LDR)
+                        request.sdrFilePath = "output.png";
+                    if (saveSS_HDR)
+                        request.hdrFilePath = "output.exr";
+                }
                 glu::Texture2D &texToDisplay = bufferTypeToDisplay == shared::BufferToDisplay::FinalRendering ?
                     curTemporalSet.gfxFinalLightingBuffer : gfxDebugVisualizeBuffer;
-                glGetTextureSubImage(
-                    texToDisplay.getHandle(), 0,
-                    0, 0, 0, renderTargetSizeX, renderTargetSizeY, 1,
-                    GL_RGBA, GL_FLOAT, sizeof(float4) * renderTargetSizeX * renderTargetSizeY, rawImage);
-
-                if (saveSS_LDR) {
-                    SDRImageSaverConfig config;
-                    config.brightnessScale = std::pow(10.0f, brightness);
-                    config.applyToneMap = applyToneMapAndGammaCorrection;
-                    config.apply_sRGB_gammaCorrection = applyToneMapAndGammaCorrection;
-                    config.flipY = true;
-                    saveImage("output.png", renderTargetSizeX, renderTargetSizeY, rawImage, config);
-                }
-                if (saveSS_HDR)
-                    saveImageHDR("output.exr", renderTargetSizeX, renderTargetSizeY,
-                                 std::pow(10.0f, brightness), rawImage, true);
-                delete[] rawImage;
+                frameCapturer.capture(
+                    texToDisplay.getHandle(), renderTargetSizeX, renderTargetSizeY, request);
             }
 
             if (!g_envLightTexturePath.empty()) {
@@ -1710,10 +1623,12 @@ int32_t main(int32_t argc, const char* argv[]) try {
         static bool enableAccumulation = /*true*/false;
         static int32_t log2MaxNumAccums = 16;
         bool lastFrameWasAnimated = false;
+        bool dumpSVGFFrame = false;
         static int32_t maxPathLength = 5;
         static bool enableTemporalAccumulation = true;
         static bool enableSVGF = true;
         static bool feedback1stFilteredResult = true;
+        static bool tiledATrousFilter = true;
         static bool specularMollification = true;
         static bool enableTemporalAA = true;
         static bool modulateAlbedo = true;
@@ -1721,7 +1636,7 @@ int32_t main(int32_t argc, const char* argv[]) try {
         static bool debugSwitches[] = {
             false, false, false, false, false, false, false, false
         };
-        {
+        if (buildGUI) {
             ImGui::Begin("Debug", nullptr, ImGuiWindowFlags_AlwaysAutoResize);
 
             if (ImGui::Button(animate ? "Stop" : "Play")) {
@@ -1771,7 +1686,9 @@ int32_t main(int32_t argc, const char* argv[]) try {
                     resetAccumulation |= ImGui::Checkbox("SVGF", &enableSVGF);
                     if (enableSVGF) {
                         ImGui::Checkbox("Feedback 1st filtered result", &feedback1stFilteredResult);
+                        ImGui::Checkbox("Tiled A-Trous Filter", &tiledATrousFilter);
                         ImGui::Checkbox("Specular Mollification", &specularMollification);
+                        dumpSVGFFrame = ImGui::Button("Dump Frame for CPU Reference");
                     }
 
                     resetAccumulation |= ImGui::Checkbox("Temporal AA", &enableTemporalAA);
@@ -1831,17 +1748,8 @@ int32_t main(int32_t argc, const char* argv[]) try {
 
         // Stats Window
         {
-            ImGui::Begin("Stats", nullptr, ImGuiWindowFlags_AlwaysAutoResize);
-
-#if !defined(USE_HARD_CODED_BSDF_FUNCTIONS)
-            ImGui::PushTextWrapPos(ImGui::GetCursorPos().x + 300);
-            ImGui::TextColored(
-                ImVec4(1.0f, 0.0f, 0.0f, 1.0f),
-                "BSDF callables are enabled.\n"
-                "USE_HARD_CODED_BSDF_FUNCTIONS is recommended for better performance.");
-            ImGui::PopTextWrapPos();
-#endif
-
+            // JP: 計測値はGUIを構築しないフレームでも記録する。
+            // EN: Record the measurements even in frames not building the GUI.
             static MovingAverageTime cudaFrameTime;
             static MovingAverageTime updateTime;
             static MovingAverageTime computePDFTextureTime;
@@ -1854,34 +1762,47 @@ int32_t main(int32_t argc, const char* argv[]) try {
             static MovingAverageTime pickTime;
             static MovingAverageTime toneMapTime;
 
-            cudaFrameTime.append(curGPUTimer.frame.report());
-            updateTime.append(curGPUTimer.update.report());
-            computePDFTextureTime.append(curGPUTimer.computePDFTexture.report());
-            setupGBuffersTime.append(curGPUTimer.setupGBuffers.report());
-            pathTraceTime.append(curGPUTimer.pathTrace.report());
-            denoiseTime.append(curGPUTimer.denoise.report());
-            estimateVarianceTime.append(curGPUTimer.estimateVariance.report());
-            aTrousFilterTime.append(curGPUTimer.aTrousFilter.report());
-            temporalAATime.append(curGPUTimer.temporalAA.report());
-            pickTime.append(curGPUTimer.pick.report());
+            cudaFrameTime.append(reportGPUTime("frame", curGPUTimer.frame));
+            updateTime.append(reportGPUTime("update", curGPUTimer.update));
+            computePDFTextureTime.append(reportGPUTime("computePDFTexture", curGPUTimer.computePDFTexture));
+            setupGBuffersTime.append(reportGPUTime("setupGBuffers", curGPUTimer.setupGBuffers));
+            pathTraceTime.append(reportGPUTime("pathTrace", curGPUTimer.pathTrace));
+            denoiseTime.append(reportGPUTime("denoise", curGPUTimer.denoise));
+            estimateVarianceTime.append(reportGPUTime("estimateVariance", curGPUTimer.estimateVariance));
+            aTrousFilterTime.append(reportGPUTime("aTrousFilter", curGPUTimer.aTrousFilter));
+            temporalAATime.append(reportGPUTime("temporalAA", curGPUTimer.temporalAA));
+            pickTime.append(reportGPUTime("pick", curGPUTimer.pick));
             toneMapTime.append(curGPUTimer.toneMap.report());
 
-            //ImGui::SetNextItemWidth(100.0f);
-            ImGui::Text("CUDA/OptiX GPU %.3f [ms]:", cudaFrameTime.getAverage());
-            ImGui::Text("  Update: %.3f [ms]", updateTime.getAverage());
-            ImGui::Text("  Compute PDF Texture: %.3f [ms]", computePDFTextureTime.getAverage());
-            ImGui::Text("  Setup G-Buffers: %.3f [ms]", setupGBuffersTime.getAverage());
-            ImGui::Text("  Path Trace: %.3f [ms]", pathTraceTime.getAverage());
-            ImGui::Text("  Denoise: %.3f [ms]", denoiseTime.getAverage());
-            ImGui::Text("    Estimate Variance: %.3f [ms]", estimateVarianceTime.getAverage());
-            ImGui::Text("    A-Trous Filter: %.3f [ms]", aTrousFilterTime.getAverage());
-            ImGui::Text("  Temporal AA: %.3f [ms]", temporalAATime.getAverage());
-            ImGui::Text("  Pick: %.3f [ms]", pickTime.getAverage());
-            ImGui::Text("  Tone Map: %.3f [ms]", toneMapTime.getAverage());
-
-            ImGui::Text("%u [spp]", std::min(numAccumFrames + 1, (1u << log2MaxNumAccums)));
+            if (buildGUI) {
+                ImGui::Begin("Stats", nullptr, ImGuiWindowFlags_AlwaysAutoResize);
 
-            ImGui::End();
+#if !defined(USE_HARD_CODED_BSDF_FUNCTIONS)
+                ImGui::PushTextWrapPos(ImGui::GetCursorPos().x + 300);
+                ImGui::TextColored(
+                    ImVec4(1.0f, 0.0f, 0.0f, 1.0f),
+                    "BSDF callables are enabled.\n"
+                    "USE_HARD_CODED_BSDF_FUNCTIONS is recommended for better performance.");
+                ImGui::PopTextWrapPos();
+#endif
+
+                //ImGui::SetNextItemWidth(100.0f);
+                ImGui::Text("CUDA/OptiX GPU %.3f [ms]:", cudaFrameTime.getAverage());
+                ImGui::Text("  Update: %.3f [ms]", updateTime.getAverage());
+                ImGui::Text("  Compute PDF Texture: %.3f [ms]", computePDFTextureTime.getAverage());
+                ImGui::Text("  Setup G-Buffers: %.3f [ms]", setupGBuffersTime.getAverage());
+                ImGui::Text("  Path Trace: %.3f [ms]", pathTraceTime.getAverage());
+                ImGui::Text("  Denoise: %.3f [ms]", denoiseTime.getAverage());
+                ImGui::Text("    Estimate Variance: %.3f [ms]", estimateVarianceTime.getAverage());
+                ImGui::Text("    A-Trous Filter: %.3f [ms]", aTrousFilterTime.getAverage());
+                ImGui::Text("  Temporal AA: %.3f [ms]", temporalAATime.getAverage());
+                ImGui::Text("  Pick: %.3f [ms]", pickTime.getAverage());
+                ImGui::Text("  Tone Map: %.3f [ms]", toneMapTime.getAverage());
+
+                ImGui::Text("%u [spp]", std::min(numAccumFrames + 1, (1u << log2MaxNumAccums)));
+
+                ImGui::End();
+            }
         }
 
         applyToneMapAndGammaCorrection =
@@ -1896,19 +1817,8 @@ int32_t main(int32_t argc, const char* argv[]) try {
 
         // JP: 各インスタンスのトランスフォームを更新する。
         // EN: Update the transform of each instance.
-        if (animate || lastFrameWasAnimated) {
-            shared::InstanceData* instDataBufferOnHost = curInstDataBuffer.map();
-            for (int i = 0; i < scene.instControllers.size(); ++i) {
-                InstanceController* controller = scene.instControllers[i];
-                Instance* inst = controller->inst;
-                shared::InstanceData &instData = instDataBufferOnHost[inst->instSlot];
-                controller->update(instDataBufferOnHost, animate ? 1.0f / 60.0f : 0.0f);
-                // TODO: まとめて送る。
-                CUDADRV_CHECK(cuMemcpyHtoDAsync(curInstDataBuffer.getCUdeviceptrAt(inst->instSlot),
-                                                &instData, sizeof(instData), curCuStream));
-            }
-            curInstDataBuffer.unmap();
-        }
+        if (animate || lastFrameWasAnimated)
+            scene.updateInstances(curCuStream, curBufIdx, animate ? 1.0f / 60.0f : 0.0f);
 
         // JP: IASのリビルドを行う。
         // EN: Rebuild the IAS.
@@ -1944,6 +1854,10 @@ int32_t main(int32_t argc, const char* argv[]) try {
         // EN: Compute the probability texture for light instances.
         curGPUTimer.computePDFTexture.start(curCuStream);
         {
+            // JP: 放射輝度などに変更があったジオメトリーインスタンスとインスタンスの分布のみを再計算する。
+            // EN: Recompute only the distributions of geometry instances and instances with changes such as emittance.
+            scene.setupLightGeomDistributions(curCuStream);
+
             CUdeviceptr probTexAddr =
                 staticPlpOnDevice + offsetof(shared::StaticPipelineLaunchParameters, lightInstDist);
             scene.setupLightInstDistribution(curCuStream, probTexAddr, curBufIdx);
@@ -2110,7 +2024,27 @@ int32_t main(int32_t argc, const char* argv[]) try {
             curCuStream, plpOnDevice, renderTargetSizeX, renderTargetSizeY, 1);
         curGPUTimer.pathTrace.stop(curCuStream);
 
-        constexpr uint32_t numFilteringStages = 5;
+        constexpr uint32_t numFilteringStages = SVGFFrameDump::maxNumFilteringStages;
+
+        // JP: CPUリファレンス実装のためにフィルタリング前のライティングを読み出す。
+        //     残りのバッファーはフレームの最後に読み出す。
+        // EN: Read back the lighting before filtering for the CPU reference implementation.
+        //     The remaining buffers are read back at the end of the frame.
+        dumpSVGFFrame &= enableSVGF;
+        if (dumpSVGFFrame) {
+            svgfFrameDump.resize(renderTargetSizeX, renderTargetSizeY, true);
+            svgfFrameDump.numFilteringStages = numFilteringStages;
+            svgfFrameDump.taaHistoryLength = perFramePlp.taaHistoryLength;
+            svgfFrameDump.feedback1stFilteredResult = perFramePlp.feedback1stFilteredResult;
+            svgfFrameDump.enableTemporalAA = perFramePlp.enableTemporalAA;
+            svgfFrameDump.modulateAlbedo = perFramePlp.modulateAlbedo;
+            svgfFrameDump.isFirstFrame = perFramePlp.isFirstFrame;
+            svgfFrameDump.tiledATrousFilter = tiledATrousFilter;
+            const size_t numPixels = svgfFrameDump.noisyLightingBuffer.size();
+            lighting_variance_buffers[0].read(svgfFrameDump.noisyLightingBuffer.data(), numPixels, 0, curCuStream);
+            lighting_variance_buffers[1].read(svgfFrameDump.aTrousWorkBuffer.data(), numPixels, 0, curCuStream);
+        }
+
         if (enableSVGF) {
             curGPUTimer.denoise.start(curCuStream);
 
@@ -2134,9 +2068,22 @@ int32_t main(int32_t argc, const char* argv[]) try {
             // EN: Apply the a-trous filter to lighting and its variance multiple times.
             curGPUTimer.aTrousFilter.start(curCuStream);
             for (uint32_t filterStageIndex = 0; filterStageIndex < numFilteringStages; ++filterStageIndex) {
-                gpuEnv.kernelApplyATrousFilter_box3x3.launchWithThreadDim(
-                    curCuStream, cudau::dim3(renderTargetSizeX, renderTargetSizeY),
-                    filterStageIndex);
+                if (tiledATrousFilter) {
+                    // JP: エプロンの幅はステップ幅に応じて変わるのでステージごとにシェアードメモリーのサイズを設定する。
+                    // EN: The apron width varies with the step width so set the shared memory size for each stage.
+                    const int32_t guideTileWidth =
+                        shared::getATrousGuideTileWidth<shared::ATrousKernelType_Box3x3>(filterStageIndex);
+                    gpuEnv.kernelApplyATrousFilter_box3x3_tiled.setSharedMemorySize(
+                        static_cast<uint32_t>(pow2(guideTileWidth) * sizeof(shared::ATrousGuide)));
+                    gpuEnv.kernelApplyATrousFilter_box3x3_tiled.launchWithThreadDim(
+                        curCuStream, cudau::dim3(renderTargetSizeX, renderTargetSizeY),
+                        filterStageIndex);
+                }
+                else {
+                    gpuEnv.kernelApplyATrousFilter_box3x3.launchWithThreadDim(
+                        curCuStream, cudau::dim3(renderTargetSizeX, renderTargetSizeY),
+                        filterStageIndex);
+                }
             }
             curGPUTimer.aTrousFilter.stop(curCuStream);
 
@@ -2170,6 +2117,24 @@ int32_t main(int32_t argc, const char* argv[]) try {
                 numFilteringStages);
         }
 
+        if (dumpSVGFFrame) {
+            const size_t numPixels = svgfFrameDump.noisyLightingBuffer.size();
+            curTemporalSet.cuArrayGBuffer0.read(svgfFrameDump.gBuffer0.data(), numPixels, 0, curCuStream);
+            curTemporalSet.cuArrayGBuffer1.read(svgfFrameDump.gBuffer1.data(), numPixels, 0, curCuStream);
+            curTemporalSet.cuArrayGBuffer2.read(svgfFrameDump.gBuffer2.data(), numPixels, 0, curCuStream);
+            curTemporalSet.cuArrayDepthBuffer.read(svgfFrameDump.depthBuffer.data(), numPixels, 0, curCuStream);
+            albedoBuffer.read(svgfFrameDump.albedoBuffer.data(), numPixels, 0, curCuStream);
+            curTemporalSet.cuArray_momentPair_sampleInfo_buffer.read(
+                svgfFrameDump.momentPair_sampleInfo_buffer.data(), numPixels, 0, curCuStream);
+            prevTemporalSet.cuArrayFinalLightingBuffer.read(
+                svgfFrameDump.prevFinalLightingBuffer.data(), numPixels, 0, curCuStream);
+            lighting_variance_buffers[numFilteringStages % 2].read(
+                svgfFrameDump.denoisedLightingBuffer.data(), numPixels, 0, curCuStream);
+            prevNoisyLightingBuffer.read(svgfFrameDump.prevNoisyLightingBuffer.data(), numPixels, 0, curCuStream);
+            curTemporalSet.cuArrayFinalLightingBuffer.read(
+                svgfFrameDump.finalLightingBuffer.data(), numPixels, 0, curCuStream);
+        }
+
         debugVisualizeBufferInteropHandler.endCUDAAccess(curCuStream, true);
 
         curTemporalSet.finalLightingBufferInteropHandler.endCUDAAccess(curCuStream, true);
@@ -2184,12 +2149,38 @@ int32_t main(int32_t argc, const char* argv[]) try {
         prevTemporalSet.gBuffer1InteropHandler.endCUDAAccess(curCuStream, true);
         prevTemporalSet.gBuffer0InteropHandler.endCUDAAccess(curCuStream, true);
 
+        if (dumpSVGFFrame) {
+            CUDADRV_CHECK(cuStreamSynchronize(curCuStream));
+            const std::filesystem::path dumpPath = "svgf_frame_dump.bin";
+            if (svgfFrameDump.write(dumpPath))
+                hpprintf("SVGF frame dump: %s\n", dumpPath.string().c_str());
+
+            SVGFReferenceFilter filter;
+            filter.run(
+                svgfFrameDump,
+                svgfFrameDump.tiledATrousFilter ?
+                SVGFReferenceFilter::Implementation::Tiled :
+                SVGFReferenceFilter::Implementation::Scalar);
+            reportSVGFReferenceComparison(filter, svgfFrameDump);
+        }
+
         curGPUTimer.pick.start(curCuStream);
         gpuEnv.pick.setEntryPoint(PickerEntryPoint::pick);
         gpuEnv.pick.optixPipeline.launch(
             curCuStream, plpOnDevice, 1, 1, 1);
         curGPUTimer.pick.stop(curCuStream);
 
+        // JP: ヘッドレスモードでは表示を省略する。
+        // EN: Skip presentation in the headless mode.
+        if (g_benchmarkConfig.headless) {
+            if (buildGUI)
+                ImGui::EndFrame();
+            curGPUTimer.frame.stop(curCuStream);
+            streamChain.swap();
+            ++frameIndex;
+            continue;
+        }
+
         // ----------------------------------------------------------------
         // JP: 最終レンダーターゲットに結果を描画する。
         // EN: Draw the result to the final render target.
@@ -2241,6 +2232,11 @@ int32_t main(int32_t argc, const char* argv[]) try {
     }
 
     streamChain.waitAllWorkDone();
+    if (g_benchmarkConfig.headless) {
+        if (benchmarkReport.writeJSON(
+            g_benchmarkConfig.reportFile, "svgf", renderTargetSizeX, renderTargetSizeY))
+            hpprintf("Benchmark report: %s\n", g_benchmarkConfig.reportFile.string().c_str());
+    }
     gpuTimers[1].finalize();
     gpuTimers[0].finalize();
 
@@ -2271,8 +2267,13 @@ int32_t main(int32_t argc, const char* argv[]) try {
         cuTexObjectDestroy(envLightTexture);
     envLightArray.finalize();
 
+    scene.textureLoader = nullptr;
+    textureLoader.finalize();
+
     finalizeTextureCaches();
 
+    frameCapturer.finalize();
+
     streamChain.finalize();
 
     scene.finalize();
@@ -148,6 +148,308 @@ namespace shared {
 
 
 
+    // JP: エッジ停止関数とà-trousフィルターの定義。
+    //     CPUリファレンス実装(svgf_cpu_reference.cpp)とカーネルで同じものを使う。
+    // EN: Edge-stopping functions and à-trous filter definitions.
+    //     The CPU reference implementation (svgf_cpu_reference.cpp) and the kernels share these.
+
+    CUDA_COMMON_FUNCTION CUDA_INLINE float calcDepthWeight(
+        float nbDepth, float depth,
+        float dzdx, float dzdy, int32_t dx, int32_t dy) {
+        constexpr float sigma_z = 1.0f;
+        constexpr float eps = 1e-6f;
+        return std::exp(-std::fabs(nbDepth - depth) / (sigma_z * std::fabs(dzdx * dx + dzdy * dy) + eps));
+    }
+
+    CUDA_COMMON_FUNCTION CUDA_INLINE float calcNormalWeight(
+        const Normal3D &nbNormal, const Normal3D &normal) {
+        constexpr float sigma_n = 128;
+        return std::pow(std::fmax(0.0f, dot(nbNormal, normal)), sigma_n);
+    }
+
+    CUDA_COMMON_FUNCTION CUDA_INLINE float calcLuminanceWeight(
+        float nbLuminance, float luminance,
+        float localMeanStdDev) {
+        constexpr float sigma_l = 4.0f;
+        constexpr float eps = 1e-6f;
+        return std::exp(-std::fabs(nbLuminance - luminance) / (sigma_l * localMeanStdDev + eps));
+    }
+
+    CUDA_COMMON_FUNCTION constexpr int32_t getATrousStepWidth(uint32_t filterStageIndex) {
+        constexpr int32_t stepWidths[] = {
+#if 1
+            1, 2, 4, 8, 16,
+#else
+            1, 2, 5, 11, 24
+#endif
+        };
+        return stepWidths[filterStageIndex];
+    }
+
+    enum ATrousKernelType {
+        ATrousKernelType_Box3x3 = 0,
+        ATrousKernelType_Gauss3x3,
+        ATrousKernelType_Gauss5x5,
+    };
+
+    template <ATrousKernelType kernelType>
+    struct ATrousKernel {};
+
+    template <>
+    struct ATrousKernel<ATrousKernelType_Box3x3> {
+        CUDA_COMMON_FUNCTION constexpr static float Weights(uint32_t idx) {
+            constexpr float _Weights[] = {
+                1, 1, 1,
+                1, 1, 1,
+                1, 1, 1,
+            };
+            return _Weights[idx];
+        }
+        CUDA_COMMON_FUNCTION constexpr static int2 Offsets(uint32_t idx) {
+            constexpr int2 _Offsets[] = {
+                int2{-1, -1}, int2{0, -1}, int2{1, -1},
+                int2{-1,  0}, int2{0,  0}, int2{1,  0},
+                int2{-1,  1}, int2{0,  1}, int2{1,  1},
+            };
+            return _Offsets[idx];
+        }
+        CUDA_COMMON_FUNCTION constexpr static uint32_t Size() {
+            return 9;
+        }
+        CUDA_COMMON_FUNCTION constexpr static int32_t Radius() {
+            return 1;
+        }
+        static constexpr uint32_t centerIndex = 4;
+    };
+    template <>
+    struct ATrousKernel<ATrousKernelType_Gauss3x3> {
+        CUDA_COMMON_FUNCTION constexpr static float Weights(uint32_t idx) {
+            constexpr float _Weights[] = {
+                1 / 16.0f, 1 / 8.0f, 1 / 16.0f,
+                1 / 8.0f, 1 / 4.0f, 1 / 8.0f,
+                1 / 16.0f, 1 / 8.0f, 1 / 16.0f,
+            };
+            return _Weights[idx];
+        }
+        CUDA_COMMON_FUNCTION constexpr static int2 Offsets(uint32_t idx) {
+            constexpr int2 _Offsets[] = {
+                int2{-1, -1}, int2{0, -1}, int2{1, -1},
+                int2{-1,  0}, int2{0,  0}, int2{1,  0},
+                int2{-1,  1}, int2{0,  1}, int2{1,  1},
+            };
+            return _Offsets[idx];
+        }
+        CUDA_COMMON_FUNCTION constexpr static uint32_t Size() {
+            return 9;
+        }
+        CUDA_COMMON_FUNCTION constexpr static int32_t Radius() {
+            return 1;
+        }
+        static constexpr uint32_t centerIndex = 4;
+    };
+    template <>
+    struct ATrousKernel<ATrousKernelType_Gauss5x5> {
+        CUDA_COMMON_FUNCTION constexpr static float Weights(uint32_t idx) {
+            constexpr float _Weights[] = {
+                1 / 256.0f,  4 / 256.0f,  6 / 256.0f,  4 / 256.0f, 1 / 256.0f,
+                4 / 256.0f, 16 / 256.0f, 24 / 256.0f, 16 / 256.0f, 4 / 256.0f,
+                6 / 256.0f, 24 / 256.0f, 36 / 256.0f, 24 / 256.0f, 6 / 256.0f,
+                4 / 256.0f, 16 / 256.0f, 24 / 256.0f, 16 / 256.0f, 4 / 256.0f,
+                1 / 256.0f,  4 / 256.0f,  6 / 256.0f,  4 / 256.0f, 1 / 256.0f,
+            };
+            return _Weights[idx];
+        }
+        CUDA_COMMON_FUNCTION constexpr static int2 Offsets(uint32_t idx) {
+            constexpr int2 _Offsets[] = {
+                int2{-2, -2}, int2{-1, -2}, int2{0, -2}, int2{1, -2}, int2{2, -2},
+                int2{-2, -1}, int2{-1, -1}, int2{0, -1}, int2{1, -1}, int2{2, -1},
+                int2{-2,  0}, int2{-1,  0}, int2{0,  0}, int2{1,  0}, int2{2,  0},
+                int2{-2,  1}, int2{-1,  1}, int2{0,  1}, int2{1,  1}, int2{2,  1},
+                int2{-2,  2}, int2{-1,  2}, int2{0,  2}, int2{1,  2}, int2{2,  2},
+            };
+            return _Offsets[idx];
+        }
+        CUDA_COMMON_FUNCTION constexpr static uint32_t Size() {
+            return 25;
+        }
+        CUDA_COMMON_FUNCTION constexpr static int32_t Radius() {
+            return 2;
+        }
+        static constexpr uint32_t centerIndex = 12;
+    };
+
+
+
+    // JP: タイル化したà-trousフィルターが全ステージで使う1ピクセル8バイトのガイド。
+    //     デプスはそのまま、法線は八面体マッピングで16ビットx2に量子化して保持する。
+    //     背景(無効なマテリアルスロット)かどうかはデプスの符号ビットに格納する。
+    // EN: 8-byte per-pixel guide which the tiled à-trous filter uses at all stages.
+    //     Depth is kept as is and the normal is quantized into 16 bits x 2 with octahedral mapping.
+    //     Whether the pixel is background (invalid material slot) is stored in the sign bit of the depth.
+    struct ATrousGuide {
+        uint32_t depth_isBackground;
+        uint32_t octNormal;
+
+        CUDA_COMMON_FUNCTION ATrousGuide() {}
+        CUDA_COMMON_FUNCTION ATrousGuide(float depth, const Normal3D &normal, bool isBackground) {
+#if defined(__CUDA_ARCH__)
+            const uint32_t depthBits = __float_as_uint(depth);
+#else
+            const uint32_t depthBits = *reinterpret_cast<const uint32_t*>(&depth);
+#endif
+            depth_isBackground = (depthBits & 0x7FFFFFFF) | (static_cast<uint32_t>(isBackground) << 31);
+
+            float u = 0.0f;
+            float v = 0.0f;
+            const float sumAbs = std::fabs(normal.x) + std::fabs(normal.y) + std::fabs(normal.z);
+            if (sumAbs > 0.0f) {
+                u = normal.x / sumAbs;
+                v = normal.y / sumAbs;
+                if (normal.z < 0.0f) {
+                    const float foldedU = (1 - std::fabs(v)) * (u >= 0.0f ? 1 : -1);
+                    const float foldedV = (1 - std::fabs(u)) * (v >= 0.0f ? 1 : -1);
+                    u = foldedU;
+                    v = foldedV;
+                }
+            }
+            octNormal = quantizeSnorm16(u) | (quantizeSnorm16(v) << 16);
+        }
+
+        CUDA_COMMON_FUNCTION float getDepth() const {
+            const uint32_t depthBits = depth_isBackground & 0x7FFFFFFF;
+#if defined(__CUDA_ARCH__)
+            return __uint_as_float(depthBits);
+#else
+            return *reinterpret_cast<const float*>(&depthBits);
+#endif
+        }
+        CUDA_COMMON_FUNCTION bool isBackground() const {
+            return (depth_isBackground >> 31) != 0;
+        }
+        CUDA_COMMON_FUNCTION Normal3D getNormal() const {
+            const float u = (octNormal & 0xFFFF) / 65535.0f * 2 - 1;
+            const float v = (octNormal >> 16) / 65535.0f * 2 - 1;
+            Normal3D normal(u, v, 1 - std::fabs(u) - std::fabs(v));
+            const float t = std::fmax(-normal.z, 0.0f);
+            normal.x += normal.x >= 0.0f ? -t : t;
+            normal.y += normal.y >= 0.0f ? -t : t;
+            return normalize(normal);
+        }
+
+    private:
+        CUDA_COMMON_FUNCTION static uint32_t quantizeSnorm16(float x) {
+            return static_cast<uint32_t>(std::fmin(std::fmax(0.5f * x + 0.5f, 0.0f), 1.0f) * 65535 + 0.5f);
+        }
+    };
+
+    // JP: タイル化したà-trousフィルターのタイルサイズ(=ブロックサイズ)。
+    //     ガイドはタイルの周囲にà-trousカーネルの半径とデプス勾配用の1ピクセル分のエプロンを付けて読み込み、
+    //     分散はタイルの周囲1ピクセル(3x3フィルター用)まで読み込む。
+    // EN: Tile size (= block size) of the tiled à-trous filter.
+    //     The guide is loaded for the tile with an apron of the à-trous kernel's radius plus a pixel for the depth gradient,
+    //     and the variance is loaded for the tile plus a pixel around it (for the 3x3 filter).
+    static constexpr int32_t aTrousTileSize = 16;
+    static constexpr int32_t aTrousVarianceTileWidth = aTrousTileSize + 2;
+
+    template <ATrousKernelType kernelType>
+    CUDA_COMMON_FUNCTION constexpr int32_t getATrousGuideApronWidth(uint32_t filterStageIndex) {
+        return ATrousKernel<kernelType>::Radius() * getATrousStepWidth(filterStageIndex) + 1;
+    }
+
+    template <ATrousKernelType kernelType>
+    CUDA_COMMON_FUNCTION constexpr int32_t getATrousGuideTileWidth(uint32_t filterStageIndex) {
+        return aTrousTileSize + 2 * getATrousGuideApronWidth<kernelType>(filterStageIndex);
+    }
+
+    // JP: ガイドを使ったà-trousフィルターの1ピクセル分の処理。タイル化したカーネルとそのCPU移植で共有する。
+    //     getGuide(offset)とgetVariance(offset)は中心ピクセルからのオフセットで読み出す。
+    //     getVariance()は画像端でクランプした座標の値を返し、readLighting(nbPix)は画像内の座標で呼ばれる。
+    // EN: Processing of a pixel of the à-trous filter using the guide. The tiled kernel and its CPU port share this.
+    //     getGuide(offset) and getVariance(offset) read with the offset from the center pixel.
+    //     getVariance() returns the value at the coordinates clamped at the image edges,
+    //     and readLighting(nbPix) is called with coordinates inside the image.
+    template <ATrousKernelType kernelType, typename GuideFunc, typename VarianceFunc, typename LightingFunc>
+    CUDA_COMMON_FUNCTION CUDA_INLINE Lighting_Variance applyATrousFilterWithGuide(
+        uint32_t filterStageIndex, const int2 &pix, const int2 &imageSize,
+        const ATrousGuide &guide, const Lighting_Variance &src_lighting_var,
+        GuideFunc getGuide, VarianceFunc getVariance, LightingFunc readLighting) {
+        const int32_t stepWidth = getATrousStepWidth(filterStageIndex);
+
+        float luminance = sRGB_calcLuminance(src_lighting_var.noisyLighting);
+
+        float depth = guide.getDepth();
+        int32_t dx = pix.x < imageSize.x / 2 ? 1 : -1;
+        int32_t dy = pix.y < imageSize.y / 2 ? 1 : -1;
+        float hnbDepth = getGuide(make_int2(dx, 0)).getDepth();
+        float vnbDepth = getGuide(make_int2(0, dy)).getDepth();
+        float dzdx = (hnbDepth - depth) * dx;
+        float dzdy = (vnbDepth - depth) * dy;
+        Normal3D normal = guide.getNormal();
+
+        // JP: 安定化のため分散は3x3のガウシアンフィルターにかける。
+        // EN: Apply 3x3 Gaussian filter to variance for stabilization.
+        constexpr float gaussKernel[] = {
+            1 / 4.0f, 1 / 2.0f, 1 / 4.0f
+        };
+        float sumLocalVars = 0.0f;
+        float sumVarWeights = 0.0f;
+#pragma unroll
+        for (int i = -1; i <= 1; ++i) {
+            float hy = gaussKernel[i + 1];
+            for (int j = -1; j <= 1; ++j) {
+                float hx = gaussKernel[j + 1];
+                float weight = hx * hy;
+                sumLocalVars += weight * getVariance(make_int2(j, i));
+                sumVarWeights += weight;
+            }
+        }
+        float localMeanStdDev = std::sqrt(sumLocalVars / sumVarWeights);
+
+        using Kernel = ATrousKernel<kernelType>;
+        constexpr float centerWeight = Kernel::Weights(Kernel::centerIndex);
+        float sumWeights = centerWeight;
+        Lighting_Variance dst_lighting_var;
+        dst_lighting_var.denoisedLighting = centerWeight * src_lighting_var.noisyLighting;
+        dst_lighting_var.variance = pow2(centerWeight) * src_lighting_var.variance;
+#pragma unroll
+        for (int i = 0; i < Kernel::Size(); ++i) {
+            if (i == Kernel::centerIndex)
+                continue;
+
+            int2 offset = make_int2(Kernel::Offsets(i).x * stepWidth, Kernel::Offsets(i).y * stepWidth);
+            int2 nbPix = make_int2(pix.x + offset.x, pix.y + offset.y);
+            if (nbPix.x < 0 || nbPix.x >= imageSize.x ||
+                nbPix.y < 0 || nbPix.y >= imageSize.y)
+                continue;
+
+            float h = Kernel::Weights(i);
+
+            const ATrousGuide nbGuide = getGuide(offset);
+            float nbDepth = nbGuide.getDepth();
+            if (nbDepth == 1.0f)
+                continue;
+            Normal3D nbNormal = nbGuide.getNormal();
+
+            float wz = calcDepthWeight(nbDepth, depth, dzdx, dzdy, offset.x, offset.y);
+            float wn = calcNormalWeight(nbNormal, normal);
+
+            Lighting_Variance nb_lighting_var = readLighting(nbPix);
+            float nbLuminance = sRGB_calcLuminance(nb_lighting_var.noisyLighting);
+            float wl = calcLuminanceWeight(nbLuminance, luminance, localMeanStdDev);
+
+            float weight = h * wz * wn * wl;
+            dst_lighting_var.denoisedLighting += weight * nb_lighting_var.noisyLighting;
+            dst_lighting_var.variance += pow2(weight) * nb_lighting_var.variance;
+            sumWeights += weight;
+        }
+        dst_lighting_var.denoisedLighting /= sumWeights;
+        dst_lighting_var.variance /= pow2(sumWeights);
+
+        return dst_lighting_var;
+    }
+
+
+
     struct PathTraceWriteOnlyPayload {
         Point3D nextOrigin;
         Vector3D nextDirection;
@@ -178,11 +480,12 @@ namespace shared {
         optixu::NativeBlockBuffer2D<Albedo> albedoBuffer;
         optixu::NativeBlockBuffer2D<Lighting_Variance> lighting_variance_buffers[2];
         optixu::NativeBlockBuffer2D<Lighting_Variance> prevNoisyLightingBuffer;
+        optixu::NativeBlockBuffer2D<ATrousGuide> aTrousGuideBuffer;
 
         ROBuffer<MaterialData> materialDataBuffer;
         ROBuffer<GeometryInstanceData> geometryInstanceDataBuffer;
         LightDistribution lightInstDist;
-        RegularConstantContinuousDistribution2D envLightImportanceMap;
+        EnvLightImportanceMap envLightImportanceMap;
         CUtexObject envLightTexture;
     };
 
@@ -506,6 +506,7 @@ static Quaternion g_cameraOrientation = qRotateY(pi_v<float>);
 static Quaternion g_tempCameraOrientation;
 static Point3D g_cameraPosition(0, 0, 1.5f);
 static std::filesystem::path g_envLightTexturePath;
+static BenchmarkConfig g_benchmarkConfig;
 
 static constexpr float initInstPitch = 45.0f;
 static constexpr float initHeightOffset = 0.0f;
@@ -606,6 +607,13 @@ static void parseCommandline(int32_t argc, const char* argv[]) {
             name = argv[i + 1];
             i += 1;
         }
+        else if (CommandlineParseResult result = parseBenchmarkOption(argc, argv, &i, &g_benchmarkConfig);
+                 result != CommandlineParseResult::Unhandled) {
+            if (result == CommandlineParseResult::Invalid) {
+                printf("Invalid option.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
         else {
             printf("Unknown option.\n");
             exit(EXIT_FAILURE);
@@ -800,6 +808,12 @@ int32_t main(int32_t argc, const char* argv[]) try {
 
     parseCommandline(argc, argv);
 
+    CameraPath cameraPath;
+    if (g_benchmarkConfig.headless && !g_benchmarkConfig.cameraPathFile.empty()) {
+        if (!cameraPath.load(g_benchmarkConfig.cameraPathFile))
+            return -1;
+    }
+
     // ----------------------------------------------------------------
     // JP: OpenGL, GLFWの初期化。
     // EN: Initialize OpenGL and GLFW.
@@ -827,6 +841,13 @@ int32_t main(int32_t argc, const char* argv[]) try {
 
     glfwWindowHint(GLFW_SRGB_CAPABLE, GLFW_TRUE);
 
+    // JP: ヘッドレスモードではウインドウを表示しない。
+    //     出力バッファーがGLとのインターオペで作られるためコンテキスト自体は必要。
+    // EN: Don't show the window in the headless mode.
+    //     The context itself is still required since the output buffer is created via GL interop.
+    if (g_benchmarkConfig.headless)
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+
     int32_t renderTargetSizeX = 1920;
     int32_t renderTargetSizeY = 1080;
 
@@ -1005,8 +1026,16 @@ int32_t main(int32_t argc, const char* argv[]) try {
 
     StreamChain<2> streamChain;
     streamChain.initialize(gpuEnv.cuContext);
+
+    FrameCapturer frameCapturer;
+    frameCapturer.initialize();
+
     CUstream stream = streamChain.waitAvailableAndGetCurrentStream();
 
+    AsyncTextureLoader textureLoader;
+    textureLoader.initialize();
+    scene.textureLoader = &textureLoader;
+
     // ----------------------------------------------------------------
     // JP: シーンのセットアップ。
     // EN: Setup a scene.
@@ -1034,7 +1063,7 @@ int32_t main(int32_t argc, const char* argv[]) try {
         scene.geomInsts.push_back(geomInst);
 
         std::set<const GeometryInstance*> srcGeomInsts = { geomInst };
-        GeometryGroup* geomGroup = createGeometryGroup(&scene, srcGeomInsts);
+        GeometryGroup* geomGroup = createGeometryGroup(gpuEnv.cuContext, &scene, srcGeomInsts);
         scene.geomGroups.push_back(geomGroup);
 
         auto mesh = new Mesh();
@@ -1075,7 +1104,7 @@ int32_t main(int32_t argc, const char* argv[]) try {
         scene.geomInsts.push_back(geomInst);
 
         std::set<const GeometryInstance*> srcGeomInsts = { geomInst };
-        GeometryGroup* geomGroup = createGeometryGroup(&scene, srcGeomInsts);
+        GeometryGroup* geomGroup = createGeometryGroup(gpuEnv.cuContext, &scene, srcGeomInsts);
         scene.geomGroups.push_back(geomGroup);
 
         auto mesh = new Mesh();
@@ -1125,7 +1154,7 @@ int32_t main(int32_t argc, const char* argv[]) try {
         scene.geomInsts.push_back(tfdmMeshGeomInst);
 
         std::set<const GeometryInstance*> srcGeomInsts = { tfdmMeshGeomInst };
-        tfdmGeomGroup = createGeometryGroup(&scene, srcGeomInsts);
+        tfdmGeomGroup = createGeometryGroup(gpuEnv.cuContext, &scene, srcGeomInsts);
         scene.geomGroups.push_back(tfdmGeomGroup);
 
         auto mesh = new Mesh();
@@ -1165,7 +1194,7 @@ int32_t main(int32_t argc, const char* argv[]) try {
     // EN: Read a environmental texture, then compute a CDF to sample it.
     cudau::Array envLightArray;
     CUtexObject envLightTexture = 0;
-    RegularConstantContinuousDistribution2D envLightImportanceMap;
+    EnvLightImportanceMap envLightImportanceMap;
     if (!g_envLightTexturePath.empty())
         loadEnvironmentalTexture(
             g_envLightTexturePath, gpuEnv.cuContext,
@@ -1513,6 +1542,15 @@ int32_t main(int32_t argc, const char* argv[]) try {
     gpuTimers[0].initialize(gpuEnv.cuContext);
     gpuTimers[1].initialize(gpuEnv.cuContext);
     uint64_t frameIndex = 0;
+    // JP: 各GPUタイマーは2フレーム後に読み出されるので、ヘッドレスモードではフレーム2以降の値を記録する。
+    // EN: Each GPU timer is read back two frames later, so the headless mode records values from frame 2 onward.
+    BenchmarkReport benchmarkReport;
+    const auto reportGPUTime = [&](const char* passName, auto &timer) {
+        float time = timer.report();
+        if (g_benchmarkConfig.headless && frameIndex >= 2)
+            benchmarkReport.record(passName, time);
+        return time;
+    };
     glfwSetWindowUserPointer(window, &frameIndex);
     int32_t requestedSize[2];
     uint32_t numAccumFrames = 0;
@@ -1525,6 +1563,8 @@ int32_t main(int32_t argc, const char* argv[]) try {
 
         if (glfwWindowShouldClose(window))
             break;
+        if (g_benchmarkConfig.headless && frameIndex >= g_benchmarkConfig.numFrames + 2)
+            break;
         glfwPollEvents();
 
         CUstream curCuStream = streamChain.waitAvailableAndGetCurrentStream();
@@ -1596,9 +1636,16 @@ int32_t main(int32_t argc, const char* argv[]) try {
             resized = true;
         }
 
-        ImGui_ImplOpenGL3_NewFrame();
-        ImGui_ImplGlfw_NewFrame();
-        ImGui::NewFrame();
+        // JP: ヘッドレスモードではImGuiのフレームとウインドウの構築を省略する。
+        //     ウインドウ内で初期化を行うサンプルもあるので最初のフレームは構築する。
+        // EN: Skip building ImGui frames and windows in the headless mode.
+        //     Some samples initialize things inside the windows, so the first frame builds them.
+        const bool buildGUI = !g_benchmarkConfig.headless || frameIndex == 0;
+        if (buildGUI) {
+            ImGui_ImplOpenGL3_NewFrame();
+            ImGui_ImplGlfw_NewFrame();
+            ImGui::NewFrame();
+        }
 
 
 
@@ -1681,9 +1728,29 @@ int32_t main(int32_t argc, const char* argv[]) try {
             perFramePlp.camera.orientation = g_tempCameraOrientation.toMatrix3x3();
         }
 
+        // JP: ヘッドレスモードではカメラパスに沿ってカメラを動かす。
+        // EN: Move the camera along the camera path in the headless mode.
+        if (g_benchmarkConfig.headless && !cameraPath.empty()) {
+            cameraPath.evaluateAtFrame(
+                static_cast<uint32_t>(frameIndex), g_benchmarkConfig.numFrames,
+                &g_cameraPosition, &g_cameraOrientation);
+            g_tempCameraOrientation = g_cameraOrientation;
+            cameraIsActuallyMoving = cameraPath.getNumKeyframes() > 1;
+
+            perFramePlp.camera.position = g_cameraPosition;
+            perFramePlp.camera.orientation = g_tempCameraOrientation.toMatrix3x3();
+        }
+
 
 
         bool resetAccumulation = false;
+
+        // JP: 非同期に読み込まれたテクスチャーを反映する。
+        // EN: Apply textures loaded asynchronously.
+        if (textureLoader.hasCompletedRequests()) {
+            streamChain.waitAllWorkDone();
+            resetAccumulation |= textureLoader.processCompletedRequests(gpuEnv.cuContext, curCuStream) > 0;
+        }
         
         // Camera Window
         static bool applyToneMapAndGammaCorrection = true;
@@ -1691,7 +1758,7 @@ int32_t main(int32_t argc, const char* argv[]) try {
         static bool enableEnvLight = true;
         static float log10EnvLightPowerCoeff = 0.0f;
         static float envLightRotation = 0.0f;
-        {
+        if (buildGUI) {
             ImGui::Begin("Camera / Env", nullptr, ImGuiWindowFlags_AlwaysAutoResize);
 
             ImGui::Text("W/A/S/D/R/F: Move, Q/E: Tilt");
@@ -1720,26 +1787,32 @@ int32_t main(int32_t argc, const char* argv[]) try {
             ImGui::SameLine();
             if (ImGui::Button("Both"))
                 saveSS_LDR = saveSS_HDR = true;
-            if (saveSS_LDR || saveSS_HDR) {
-                streamChain.waitAllWorkDone();
-                auto rawImage = new float4[renderTargetSizeX * renderTargetSizeY];
-                glGetTextureSubImage(
-                    outputTexture.getHandle(), 0,
-                    0, 0, 0, renderTargetSizeX, renderTargetSizeY, 1,
-                    GL_RGBA, GL_FLOAT, sizeof(float4) * renderTargetSizeX * renderTargetSizeY, rawImage);
-
-                if (saveSS_LDR) {
-                    SDRImageSaverConfig config;
-                    config.brightnessScale = std::pow(10.0f, brightness);
-                    config.applyToneMap = applyToneMapAndGammaCorrection;
-                    config.apply_sRGB_gammaCorrection = applyToneMapAndGammaCorrection;
-                    saveImage("output.png", renderTargetSizeX, renderTargetSizeY, rawImage, config);
+            ImGui::SameLine();
+            static bool recordSequence = false;
+            ImGui::Checkbox("Record", &recordSequence);
+            frameCapturer.update();
+            if (saveSS_LDR || saveSS_HDR || recordSequence) {
+                static uint32_t sequenceFrameIndex = 0;
+                FrameCapturer::Request request;
+                request.sdrConfig.brightnessScale = std::pow(10.0f, brightness);
+                request.sdrConfig.applyToneMap = applyToneMapAndGammaCorrection;
+                request.sdrConfig.apply_sRGB_gammaCorrection = applyToneMapAndGammaCorrection;
+                request.hdrBrightnessScale = std::pow(10.0f, brightness);
+                if (recordSequence) {
+                    request.sdrFilePath = FrameCapturer::makeSequenceFilePath(
+                        "capture/frame", sequenceFrameIndex, "png");
+                    request.hdrFilePath = FrameCapturer::makeSequenceFilePath(
+                        "capture/frame", sequenceFrameIndex, "exr");
+                    ++sequenceFrameIndex;
                 }
-                if (saveSS_HDR)
-                    saveImageHDR(
-                        "output.exr", renderTargetSizeX, renderTargetSizeY,
-                        std::pow(10.0f, brightness), rawImage);
-                delete[] rawImage;
+                else {
+                    if (saveSS_LDR)
+                        request.sdrFilePath = "output.png";
+                    if (saveSS_HDR)
+                        request.hdrFilePath = "output.exr";
+                }
+                frameCapturer.capture(
+                    outputTexture.getHandle(), renderTargetSizeX, renderTargetSizeY, request);
             }
 
             if (!g_envLightTexturePath.empty()) {
@@ -1786,7 +1859,7 @@ int32_t main(int32_t argc, const char* argv[]) try {
         static bool debugSwitches[] = {
             false, false, false, false, false, false, false, false
         };
-        {
+        if (buildGUI) {
             ImGui::Begin("Debug", nullptr, ImGuiWindowFlags_AlwaysAutoResize);
 
             ImGui::SameLine();
@@ -2184,17 +2257,8 @@ int32_t main(int32_t argc, const char* argv[]) try {
 
         // Stats Window
         {
-            ImGui::Begin("Stats", nullptr, ImGuiWindowFlags_AlwaysAutoResize);
-
-#if !defined(USE_HARD_CODED_BSDF_FUNCTIONS)
-            ImGui::PushTextWrapPos(ImGui::GetCursorPos().x + 300);
-            ImGui::TextColored(
-                ImVec4(1.0f, 0.0f, 0.0f, 1.0f),
-                "BSDF callables are enabled.\n"
-                "USE_HARD_CODED_BSDF_FUNCTIONS is recommended for better performance.");
-            ImGui::PopTextWrapPos();
-#endif
-
+            // JP: 計測値はGUIを構築しないフレームでも記録する。
+            // EN: Record the measurements even in frames not building the GUI.
             static MovingAverageTime cudaFrameTime;
             static MovingAverageTime updateTime;
             static MovingAverageTime computePDFTextureTime;
@@ -2202,25 +2266,38 @@ int32_t main(int32_t argc, const char* argv[]) try {
             static MovingAverageTime pathTraceTime;
             static MovingAverageTime denoiseTime;
 
-            cudaFrameTime.append(curGPUTimer.frame.report());
-            updateTime.append(curGPUTimer.update.report());
-            computePDFTextureTime.append(curGPUTimer.computePDFTexture.report());
-            setupGBuffersTime.append(curGPUTimer.setupGBuffers.report());
-            pathTraceTime.append(curGPUTimer.pathTrace.report());
-            denoiseTime.append(curGPUTimer.denoise.report());
+            cudaFrameTime.append(reportGPUTime("frame", curGPUTimer.frame));
+            updateTime.append(reportGPUTime("update", curGPUTimer.update));
+            computePDFTextureTime.append(reportGPUTime("computePDFTexture", curGPUTimer.computePDFTexture));
+            setupGBuffersTime.append(reportGPUTime("setupGBuffers", curGPUTimer.setupGBuffers));
+            pathTraceTime.append(reportGPUTime("pathTrace", curGPUTimer.pathTrace));
+            denoiseTime.append(reportGPUTime("denoise", curGPUTimer.denoise));
 
-            //ImGui::SetNextItemWidth(100.0f);
-            ImGui::Text("CUDA/OptiX GPU %.3f [ms]:", cudaFrameTime.getAverage());
-            ImGui::Text("  Update: %.3f [ms]", updateTime.getAverage());
-            ImGui::Text("  Compute PDF Texture: %.3f [ms]", computePDFTextureTime.getAverage());
-            ImGui::Text("  Setup G-Buffers: %.3f [ms]", setupGBuffersTime.getAverage());
-            ImGui::Text("  Path Trace: %.3f [ms]", pathTraceTime.getAverage());
-            if (bufferTypeToDisplay == shared::BufferToDisplay::DenoisedBeauty)
-                ImGui::Text("  Denoise: %.3f [ms]", denoiseTime.getAverage());
+            if (buildGUI) {
+                ImGui::Begin("Stats", nullptr, ImGuiWindowFlags_AlwaysAutoResize);
 
-            ImGui::Text("%u [spp]", std::min(numAccumFrames + 1, (1u << log2MaxNumAccums)));
+#if !defined(USE_HARD_CODED_BSDF_FUNCTIONS)
+                ImGui::PushTextWrapPos(ImGui::GetCursorPos().x + 300);
+                ImGui::TextColored(
+                    ImVec4(1.0f, 0.0f, 0.0f, 1.0f),
+                    "BSDF callables are enabled.\n"
+                    "USE_HARD_CODED_BSDF_FUNCTIONS is recommended for better performance.");
+                ImGui::PopTextWrapPos();
+#endif
 
-            ImGui::End();
+                //ImGui::SetNextItemWidth(100.0f);
+                ImGui::Text("CUDA/OptiX GPU %.3f [ms]:", cudaFrameTime.getAverage());
+                ImGui::Text("  Update: %.3f [ms]", updateTime.getAverage());
+                ImGui::Text("  Compute PDF Texture: %.3f [ms]", computePDFTextureTime.getAverage());
+                ImGui::Text("  Setup G-Buffers: %.3f [ms]", setupGBuffersTime.getAverage());
+                ImGui::Text("  Path Trace: %.3f [ms]", pathTraceTime.getAverage());
+                if (bufferTypeToDisplay == shared::BufferToDisplay::DenoisedBeauty)
+                    ImGui::Text("  Denoise: %.3f [ms]", denoiseTime.getAverage());
+
+                ImGui::Text("%u [spp]", std::min(numAccumFrames + 1, (1u << log2MaxNumAccums)));
+
+                ImGui::End();
+            }
         }
 
         applyToneMapAndGammaCorrection =
@@ -2235,17 +2312,7 @@ int32_t main(int32_t argc, const char* argv[]) try {
         // EN: Update the transform of each instance.
         if (animate || lastFrameWasAnimated || frameIndex == 0) {
             cudau::TypedBuffer<shared::InstanceData> &curInstDataBuffer = scene.instDataBuffer[bufferIndex];
-            shared::InstanceData* instDataBufferOnHost = curInstDataBuffer.map();
-            for (int i = 0; i < scene.instControllers.size(); ++i) {
-                InstanceController* controller = scene.instControllers[i];
-                Instance* inst = controller->inst;
-                shared::InstanceData &instData = instDataBufferOnHost[inst->instSlot];
-                controller->update(instDataBufferOnHost, animate ? 1.0f / 60.0f : 0.0f);
-                // TODO: まとめて送る。
-                CUDADRV_CHECK(cuMemcpyHtoDAsync(
-                    curInstDataBuffer.getCUdeviceptrAt(inst->instSlot),
-                    &instData, sizeof(instData), curCuStream));
-            }
+            scene.updateInstances(curCuStream, bufferIndex, animate ? 1.0f / 60.0f : 0.0f);
             {
                 Matrix4x4 prevMatM2W = tfdmInst->matM2W;
                 Matrix3x3 matRot =
@@ -2256,17 +2323,21 @@ int32_t main(int32_t argc, const char* argv[]) try {
                 tfdmInst->nMatM2W = matRot / instScale;
                 Matrix4x4 tMatM2W = transpose(tfdmInst->matM2W);
                 tfdmInst->optixInst.setTransform(reinterpret_cast<const float*>(&tMatM2W));
+                // JP: インスタンス単位の光源分布でのこのインスタンスの重みも更新させる。
+                // EN: Let the weight of this instance in the light distribution over instances be updated as well.
+                tfdmInst->markTransformDirty();
 
-                shared::InstanceData instData = instDataBufferOnHost[tfdmInst->instSlot];
+                // JP: 残りのフィールドはデバイス側で管理されているので、トランスフォーム部分のみを送る。
+                // EN: Send only the transform part since the remaining fields are managed on the device side.
+                shared::InstanceData instData;
                 instData.curToPrevTransform = prevMatM2W * invert(tfdmInst->matM2W);
                 instData.transform = tfdmInst->matM2W;
                 instData.normalMatrix = tfdmInst->nMatM2W;
                 instData.uniformScale = instScale;
                 CUDADRV_CHECK(cuMemcpyHtoDAsync(
                     curInstDataBuffer.getCUdeviceptrAt(tfdmInst->instSlot),
-                    &instData, sizeof(instData), curCuStream));
+                    &instData, offsetof(shared::InstanceData, uniformScale) + sizeof(float), curCuStream));
             }
-            curInstDataBuffer.unmap();
 
             if (animate)
                 lastFrameWasAnimated = true;
@@ -2463,6 +2534,10 @@ int32_t main(int32_t argc, const char* argv[]) try {
         // EN: Compute the probability texture for light instances.
         curGPUTimer.computePDFTexture.start(curCuStream);
         {
+            // JP: 放射輝度などに変更があったジオメトリーインスタンスとインスタンスの分布のみを再計算する。
+            // EN: Recompute only the distributions of geometry instances and instances with changes such as emittance.
+            scene.setupLightGeomDistributions(curCuStream);
+
             CUdeviceptr probTexAddr =
                 staticPlpOnDevice + offsetof(shared::StaticPipelineLaunchParameters, lightInstDist);
             scene.setupLightInstDistribution(curCuStream, probTexAddr, bufferIndex);
@@ -2615,6 +2690,15 @@ int32_t main(int32_t argc, const char* argv[]) try {
 
         streamChain.swap();
 
+        // JP: ヘッドレスモードでは表示を省略する。
+        // EN: Skip presentation in the headless mode.
+        if (g_benchmarkConfig.headless) {
+            if (buildGUI)
+                ImGui::EndFrame();
+            ++frameIndex;
+            continue;
+        }
+
 
 
         // ----------------------------------------------------------------
@@ -2660,6 +2744,11 @@ int32_t main(int32_t argc, const char* argv[]) try {
     }
 
     streamChain.waitAllWorkDone();
+    if (g_benchmarkConfig.headless) {
+        if (benchmarkReport.writeJSON(
+            g_benchmarkConfig.reportFile, "tfdm", renderTargetSizeX, renderTargetSizeY))
+            hpprintf("Benchmark report: %s\n", g_benchmarkConfig.reportFile.string().c_str());
+    }
     gpuTimers[1].finalize();
     gpuTimers[0].finalize();
 
@@ -2698,8 +2787,13 @@ int32_t main(int32_t argc, const char* argv[]) try {
         cuTexObjectDestroy(envLightTexture);
     envLightArray.finalize();
 
+    scene.textureLoader = nullptr;
+    textureLoader.finalize();
+
     finalizeTextureCaches();
 
+    frameCapturer.finalize();
+
     streamChain.finalize();
 
     geomInstTfdmDataBuffer.finalize();
@@ -194,7 +194,7 @@ namespace shared {
         ROBuffer<GeometryInstanceData> geometryInstanceDataBuffer;
         ROBuffer<GeometryInstanceDataForTFDM> geomInstTfdmDataBuffer;
         LightDistribution lightInstDist;
-        RegularConstantContinuousDistribution2D envLightImportanceMap;
+        EnvLightImportanceMap envLightImportanceMap;
         CUtexObject envLightTexture;
 
         optixu::NativeBlockBuffer2D<float4> beautyAccumBuffer;